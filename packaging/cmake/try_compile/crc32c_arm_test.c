@@ -0,0 +1,19 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <arm_acle.h>
+#if !defined(__aarch64__)
+#error "ARMv8 CRC32 instructions require AArch64"
+#endif
+#if defined(__clang__)
+__attribute__((target("crc")))
+#else
+__attribute__((target("+crc")))
+#endif
+static uint32_t crc (uint32_t c, uint64_t v, uint8_t b) {
+   return __crc32cb(__crc32cd(c, v), b);
+}
+int main (void) {
+  printf("avoiding unused code removal by printing %u\n",
+         (unsigned int)crc(0, 0x0123456789abcdefULL, 0x5a));
+  return 0;
+}
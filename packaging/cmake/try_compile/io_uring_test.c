@@ -0,0 +1,21 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+int main (void) {
+  struct io_uring_params p = { 0 };
+  struct io_uring_buf_reg reg = { .bgid = 0 };
+  struct io_uring_getevents_arg arg = { .sigmask = 0 };
+  struct io_uring_sqe sqe = { .opcode = IORING_OP_RECV,
+                              .ioprio = IORING_RECV_MULTISHOT,
+                              .flags = IOSQE_BUFFER_SELECT };
+  int fd = (int)syscall(__NR_io_uring_setup, 8, &p);
+  (void)syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1);
+  (void)syscall(__NR_io_uring_enter, fd, 0, 1,
+                IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+                &arg, sizeof(arg));
+  return sqe.buf_group + (int)sizeof(struct io_uring_buf_ring) +
+          (p.features & IORING_FEAT_EXT_ARG);
+}
@@ -10,6 +10,24 @@ try_compile(
     "${TRYCOMPILE_SRC_DIR}/strndup_test.c"
 )
 
+try_compile(
+    WITH_CRC32C_HW
+    "${CMAKE_CURRENT_BINARY_DIR}/try_compile"
+    "${TRYCOMPILE_SRC_DIR}/crc32c_hw_test.c"
+)
+
+try_compile(
+    WITH_CRC32C_ARM
+    "${CMAKE_CURRENT_BINARY_DIR}/try_compile"
+    "${TRYCOMPILE_SRC_DIR}/crc32c_arm_test.c"
+)
+
+try_compile(
+    WITH_IO_URING
+    "${CMAKE_CURRENT_BINARY_DIR}/try_compile"
+    "${TRYCOMPILE_SRC_DIR}/io_uring_test.c"
+)
+
 # Atomic 32 tests {
 set(LINK_ATOMIC NO)
 set(HAVE_ATOMICS_32 NO)
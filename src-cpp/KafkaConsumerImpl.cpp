@@ -177,6 +177,34 @@ RdKafka::KafkaConsumerImpl::unassign () {
 }
 
 
+RdKafka::ErrorCode
+RdKafka::KafkaConsumerImpl::incremental_assign (const std::vector<TopicPartition*> &partitions) {
+  rd_kafka_topic_partition_list_t *c_parts;
+  rd_kafka_resp_err_t err;
+
+  c_parts = partitions_to_c_parts(partitions);
+
+  err = rd_kafka_incremental_assign(rk_, c_parts);
+
+  rd_kafka_topic_partition_list_destroy(c_parts);
+  return static_cast<RdKafka::ErrorCode>(err);
+}
+
+
+RdKafka::ErrorCode
+RdKafka::KafkaConsumerImpl::incremental_unassign (const std::vector<TopicPartition*> &partitions) {
+  rd_kafka_topic_partition_list_t *c_parts;
+  rd_kafka_resp_err_t err;
+
+  c_parts = partitions_to_c_parts(partitions);
+
+  err = rd_kafka_incremental_unassign(rk_, c_parts);
+
+  rd_kafka_topic_partition_list_destroy(c_parts);
+  return static_cast<RdKafka::ErrorCode>(err);
+}
+
+
 RdKafka::ErrorCode
 RdKafka::KafkaConsumerImpl::committed (std::vector<RdKafka::TopicPartition*> &partitions, int timeout_ms) {
   rd_kafka_topic_partition_list_t *c_parts;
@@ -377,7 +377,39 @@ enum ErrorCode {
         /** Security features are disabled */
         ERR_SECURITY_DISABLED = 54,
         /** Operation not attempted */
-        ERR_OPERATION_NOT_ATTEMPTED = 55
+        ERR_OPERATION_NOT_ATTEMPTED = 55,
+        /** Disk error when trying to access log file on the disk */
+        ERR_KAFKA_STORAGE_ERROR = 56,
+        /** The user-specified log directory is not found in the broker config */
+        ERR_LOG_DIR_NOT_FOUND = 57,
+        /** SASL Authentication failed */
+        ERR_SASL_AUTHENTICATION_FAILED = 58,
+        /** Unknown Producer Id */
+        ERR_UNKNOWN_PRODUCER_ID = 59,
+        /** Partition reassignment is in progress */
+        ERR_REASSIGNMENT_IN_PROGRESS = 60,
+        /** Delegation Token feature is not enabled */
+        ERR_DELEGATION_TOKEN_AUTH_DISABLED = 61,
+        /** No delegation token found on server */
+        ERR_DELEGATION_TOKEN_NOT_FOUND = 62,
+        /** Specified Principal is not valid Owner/Renewer */
+        ERR_DELEGATION_TOKEN_OWNER_MISMATCH = 63,
+        /** Delegation Token requests are not allowed on this connection */
+        ERR_DELEGATION_TOKEN_REQUEST_NOT_ALLOWED = 64,
+        /** Delegation Token authorization failed */
+        ERR_DELEGATION_TOKEN_AUTHORIZATION_FAILED = 65,
+        /** Delegation Token is expired */
+        ERR_DELEGATION_TOKEN_EXPIRED = 66,
+        /** Supplied principalType is not supported */
+        ERR_INVALID_PRINCIPAL_TYPE = 67,
+        /** The group is not empty */
+        ERR_NON_EMPTY_GROUP = 68,
+        /** The group id does not exist */
+        ERR_GROUP_ID_NOT_FOUND = 69,
+        /** The fetch session ID was not found */
+        ERR_FETCH_SESSION_ID_NOT_FOUND = 70,
+        /** The fetch session epoch is invalid */
+        ERR_INVALID_FETCH_SESSION_EPOCH = 71
 };
 
 
@@ -653,6 +685,12 @@ public:
    * such as fetching offsets from an alternate location (on assign)
    * or manually committing offsets (on revoke).
    *
+   * With the COOPERATIVE rebalance protocol (\c cooperative-sticky assignor)
+   * \p partitions only contains the partitions added to or removed from
+   * the current assignment and the callback must call
+   * KafkaConsumer::incremental_assign() and
+   * KafkaConsumer::incremental_unassign() instead.
+   *
    * The following example show's the application's responsibilities:
    * @code
    *    class MyRebalanceCb : public RdKafka::RebalanceCb {
@@ -1553,8 +1591,8 @@ class RD_EXPORT Queue {
  *
  * @remark Requires Apache Kafka >= 0.9.0 brokers
  *
- * Currently supports the \c range and \c roundrobin partition assignment
- * strategies (see \c partition.assignment.strategy)
+ * Currently supports the \c range, \c roundrobin and \c sticky partition
+ * assignment strategies (see \c partition.assignment.strategy)
  */
 class RD_EXPORT KafkaConsumer : public virtual Handle {
 public:
@@ -1814,6 +1852,41 @@ public:
    *          RdKafka::ERR___INVALID_ARG if \c enable.auto.offset.store is true.
    */
   virtual ErrorCode offsets_store (std::vector<TopicPartition*> &offsets) = 0;
+
+  /**
+   * @brief Incrementally add \p partitions to the current assignment.
+   *
+   * This is the COOPERATIVE rebalance protocol counterpart of assign(),
+   * to be called from RdKafka::RebalanceCb on
+   * RdKafka::ERR__ASSIGN_PARTITIONS.
+   * Partitions already assigned keep being consumed.
+   *
+   * @returns RdKafka::ERR_NO_ERROR on success,
+   *          RdKafka::ERR__CONFLICT if any of the partitions is already
+   *          assigned, or RdKafka::ERR__STATE if the group uses the
+   *          EAGER rebalance protocol.
+   */
+  virtual ErrorCode incremental_assign (const std::vector<TopicPartition*> &partitions) = 0;
+
+  /**
+   * @brief Incrementally remove \p partitions from the current assignment.
+   *
+   * This is the COOPERATIVE rebalance protocol counterpart of unassign(),
+   * to be called from RdKafka::RebalanceCb on
+   * RdKafka::ERR__REVOKE_PARTITIONS.
+   *
+   * @returns RdKafka::ERR_NO_ERROR on success,
+   *          RdKafka::ERR__CONFLICT if any of the partitions is not
+   *          assigned, or RdKafka::ERR__STATE if the group uses the
+   *          EAGER rebalance protocol.
+   */
+  virtual ErrorCode incremental_unassign (const std::vector<TopicPartition*> &partitions) = 0;
+
+  /**
+   * @returns the rebalance protocol currently in use by the consumer group:
+   *          \c "NONE" (not joined), \c "EAGER" or \c "COOPERATIVE".
+   */
+  virtual std::string rebalance_protocol () = 0;
 };
 
 
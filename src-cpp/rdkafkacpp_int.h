@@ -723,6 +723,11 @@ public:
   ErrorCode unsubscribe ();
   ErrorCode assign (const std::vector<TopicPartition*> &partitions);
   ErrorCode unassign ();
+  ErrorCode incremental_assign (const std::vector<TopicPartition*> &partitions);
+  ErrorCode incremental_unassign (const std::vector<TopicPartition*> &partitions);
+  std::string rebalance_protocol () {
+          return std::string(rd_kafka_rebalance_protocol(rk_));
+  }
 
   Message *consume (int timeout_ms);
   ErrorCode commitSync () {
@@ -4,10 +4,11 @@
  *   * global hw/sw initialization to be called once per process
  *   * HW support is determined by configure's WITH_CRC32C_HW
  *   * Windows porting (no hardware support on Windows yet)
+ *   * ARMv8 CRC32 hardware support (WITH_CRC32C_ARM)
+ *   * Implementation selected once at runtime through a function pointer
  *
  * FIXME:
  *   * Hardware support on Windows (MSVC assembler)
- *   * Hardware support on ARM
  */
 
 /* crc32c.c -- compute CRC-32C using the Intel crc32 instruction
@@ -56,12 +57,33 @@
 
 #include "rdunittest.h"
 #include "rdendian.h"
+#include "rdtime.h"
 
 #include "crc32c.h"
 
+#if WITH_CRC32C_ARM
+#include <arm_acle.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+#endif
+
 /* CRC-32C (iSCSI) polynomial in reversed bit order. */
 #define POLY 0x82f63b78
 
+/* Block sizes for three-way parallel crc computation.  LONG and SHORT must
+   both be powers of two.  The associated string constants must be set
+   accordingly, for use in constructing the assembler instructions. */
+#define LONG 8192
+#define LONGx1 "8192"
+#define LONGx2 "16384"
+#define SHORT 256
+#define SHORTx1 "256"
+#define SHORTx2 "512"
+
 /* Table for a quadword-at-a-time software crc. */
 static uint32_t crc32c_table[8][256];
 
@@ -134,9 +156,7 @@ static uint32_t crc32c_sw(uint32_t crci, const void *buf, size_t len)
 }
 
 
-#if WITH_CRC32C_HW
-static int sse42;  /* Cached SSE42 support */
-
+#if WITH_CRC32C_HW || WITH_CRC32C_ARM
 /* Multiply a matrix times a vector over the Galois field of two elements,
    GF(2).  Each element is a bit in an unsigned integer.  mat must have at
    least as many entries as the power of two for most significant one bit in
@@ -230,16 +250,6 @@ static RD_INLINE uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc)
            zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
 }
 
-/* Block sizes for three-way parallel crc computation.  LONG and SHORT must
-   both be powers of two.  The associated string constants must be set
-   accordingly, for use in constructing the assembler instructions. */
-#define LONG 8192
-#define LONGx1 "8192"
-#define LONGx2 "16384"
-#define SHORT 256
-#define SHORTx1 "256"
-#define SHORTx2 "512"
-
 /* Tables for hardware crc that shift a crc by LONG and SHORT zeros. */
 static uint32_t crc32c_long[4][256];
 static uint32_t crc32c_short[4][256];
@@ -250,6 +260,11 @@ static void crc32c_init_hw(void)
     crc32c_zeros(crc32c_long, LONG);
     crc32c_zeros(crc32c_short, SHORT);
 }
+#endif /* WITH_CRC32C_HW || WITH_CRC32C_ARM */
+
+
+#if WITH_CRC32C_HW
+static int sse42;  /* Cached SSE42 support */
 
 /* Compute CRC-32C using the Intel hardware instruction. */
 static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
@@ -355,34 +370,158 @@ static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
 
 #endif /* WITH_CRC32C_HW */
 
-/* Compute a CRC-32C.  If the crc32 instruction is available, use the hardware
-   version.  Otherwise, use the software version. */
-uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
-{
-#if WITH_CRC32C_HW
-        if (sse42)
-                return crc32c_hw(crc, buf, len);
-        else
+
+#if WITH_CRC32C_ARM
+static int armv8_crc32;  /* Cached ARMv8 CRC32 support */
+
+#if defined(__clang__)
+#define CRC32C_ARM_TARGET __attribute__((target("crc")))
+#else
+#define CRC32C_ARM_TARGET __attribute__((target("+crc")))
 #endif
-                return crc32c_sw(crc, buf, len);
+
+/* Compute CRC-32C using the ARMv8 crc32c instructions.  This is the same
+   three-way parallel scheme as crc32c_hw(): the crc32cx instruction has a
+   latency of three cycles but a throughput of one per cycle on Cortex-A57,
+   A72 and later cores, so three independent streams keep it saturated. */
+static CRC32C_ARM_TARGET
+uint32_t crc32c_arm(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *next = buf;
+    const unsigned char *end;
+    uint32_t crc0, crc1, crc2;
+
+    /* pre-process the crc */
+    crc0 = crc ^ 0xffffffff;
+
+    /* compute the crc for up to seven leading bytes to bring the data pointer
+       to an eight-byte boundary */
+    while (len && ((uintptr_t)next & 7) != 0) {
+        crc0 = __crc32cb(crc0, *next);
+        next++;
+        len--;
+    }
+
+    /* compute the crc on sets of LONG*3 bytes, executing three independent
+       crc instructions, each on LONG bytes */
+    while (len >= LONG*3) {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + LONG;
+        do {
+            crc0 = __crc32cd(crc0, le64toh(*(const uint64_t *)next));
+            crc1 = __crc32cd(crc1, le64toh(*(const uint64_t *)(next + LONG)));
+            crc2 = __crc32cd(crc2,
+                             le64toh(*(const uint64_t *)(next + LONG*2)));
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(crc32c_long, crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_long, crc0) ^ crc2;
+        next += LONG*2;
+        len -= LONG*3;
+    }
+
+    /* do the same thing, but now on SHORT*3 blocks for the remaining data less
+       than a LONG*3 block */
+    while (len >= SHORT*3) {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + SHORT;
+        do {
+            crc0 = __crc32cd(crc0, le64toh(*(const uint64_t *)next));
+            crc1 = __crc32cd(crc1,
+                             le64toh(*(const uint64_t *)(next + SHORT)));
+            crc2 = __crc32cd(crc2,
+                             le64toh(*(const uint64_t *)(next + SHORT*2)));
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(crc32c_short, crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_short, crc0) ^ crc2;
+        next += SHORT*2;
+        len -= SHORT*3;
+    }
+
+    /* compute the crc on the remaining eight-byte units less than a SHORT*3
+       block */
+    end = next + (len - (len & 7));
+    while (next < end) {
+        crc0 = __crc32cd(crc0, le64toh(*(const uint64_t *)next));
+        next += 8;
+    }
+    len &= 7;
+
+    /* compute the crc for up to seven trailing bytes */
+    while (len) {
+        crc0 = __crc32cb(crc0, *next);
+        next++;
+        len--;
+    }
+
+    /* return a post-processed crc */
+    return crc0 ^ 0xffffffff;
 }
 
+/* Check for the ARMv8 CRC32 extension.  It is optional in ARMv8.0 and
+   mandatory from ARMv8.1, and is only exposed to user space through the
+   ELF hwcaps on Linux.  All Apple ARM64 cores implement it. */
+#if defined(__linux__)
+#define ARMV8_CRC32(have) \
+        ((have) = !!(getauxval(AT_HWCAP) & HWCAP_CRC32))
+#elif defined(__APPLE__)
+#define ARMV8_CRC32(have) ((have) = 1)
+#else
+#define ARMV8_CRC32(have) ((have) = 0)
+#endif
+
+#endif /* WITH_CRC32C_ARM */
 
 
+/**
+ * @brief CRC-32C implementation selected by crc32c_global_init().
+ */
+static uint32_t (*crc32c_impl) (uint32_t crc, const void *buf, size_t len) =
+        crc32c_sw;
+static const char *crc32c_impl_name = "software";
 
+/* Compute a CRC-32C.  If the crc32 instruction is available, use the hardware
+   version.  Otherwise, use the software version. */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+        return crc32c_impl(crc, buf, len);
+}
 
 
 /**
- * @brief Populate shift tables once
+ * @brief Populate tables and select the fastest implementation
+ *        supported by the build and the CPU, once.
  */
 void crc32c_global_init (void) {
+        /* The software tables are always populated since the
+         * unit tests verify the hardware versions against them. */
+        crc32c_init_sw();
+
 #if WITH_CRC32C_HW
         SSE42(sse42);
-        if (sse42)
+        if (sse42) {
                 crc32c_init_hw();
-        else
+                crc32c_impl = crc32c_hw;
+                crc32c_impl_name = "hardware (SSE42)";
+                return;
+        }
 #endif
-                crc32c_init_sw();
+
+#if WITH_CRC32C_ARM
+        ARMV8_CRC32(armv8_crc32);
+        if (armv8_crc32) {
+                crc32c_init_hw();
+                crc32c_impl = crc32c_arm;
+                crc32c_impl_name = "hardware (ARMv8 CRC32)";
+                return;
+        }
+#endif
+
+        crc32c_impl = crc32c_sw;
+        crc32c_impl_name = "software";
 }
 
 int unittest_crc32c (void) {
@@ -403,36 +542,108 @@ int unittest_crc32c (void) {
 "     misrepresented as being the original software.\n"
 "  3. This notice may not be removed or altered from any source distribution.";
         const uint32_t expected_crc = 0x7dcde113;
+        static const int crc32c_sw_supported = 1;
+        const struct {
+                const char *name;
+                uint32_t (*calc) (uint32_t crc, const void *buf, size_t len);
+                const int *supportedp; /* Set by crc32c_global_init() */
+        } impls[] = {
+                { "software", crc32c_sw, &crc32c_sw_supported },
+#if WITH_CRC32C_HW
+                { "hardware (SSE42)", crc32c_hw, &sse42 },
+#endif
+#if WITH_CRC32C_ARM
+                { "hardware (ARMv8 CRC32)", crc32c_arm, &armv8_crc32 },
+#endif
+                { NULL }
+        };
+        /* Large enough to exercise the LONG*3 blocks of the
+         * hardware implementations with misaligned start offsets. */
+        const size_t bufsz = (LONG*3 * 4) + 64;
+        unsigned char *rnd;
         uint32_t crc;
-        const char *how;
+        size_t i;
+        int j, best = 0;
 
         crc32c_global_init();
 
-#if WITH_CRC32C_HW
-        if (sse42)
-                how = "hardware (SSE42)";
-        else
-                how = "software (SSE42 supported in build but not at runtime)";
-#else
-        how = "software";
-#endif
-        RD_UT_SAY("Calculate CRC32C using %s", how);
+        RD_UT_SAY("Calculate CRC32C using %s", crc32c_impl_name);
 
         crc = crc32c(0, buf, strlen(buf));
         RD_UT_ASSERT(crc == expected_crc,
                      "Calculated CRC (%s) 0x%"PRIx32
                      " not matching expected CRC 0x%"PRIx32,
-                     how, crc, expected_crc);
+                     crc32c_impl_name, crc, expected_crc);
+
+        rnd = rd_malloc(bufsz);
+        for (i = 0 ; i < bufsz ; i++)
+                rnd[i] = (unsigned char)(rand() & 0xff);
+
+        /* Verify all implementations supported by the build and CPU,
+         * regardless of which one was selected above: the known CRC,
+         * random lengths and alignments compared to the software version,
+         * and incremental calculation across split buffers. */
+        for (j = 0 ; impls[j].name ; j++) {
+                static const size_t lens[] = {
+                        0, 1, 7, 8, 9, 255, 256, 767, 768, 769,
+                        LONG*3-1, LONG*3, LONG*3+1,
+                        LONG*3*2 + 768 + 13
+                };
+                size_t k;
+
+                if (!*impls[j].supportedp) {
+                        RD_UT_SAY("Skipping CRC32C %s: "
+                                  "not supported by this CPU",
+                                  impls[j].name);
+                        continue;
+                }
+
+                RD_UT_SAY("Calculate CRC32C using %s", impls[j].name);
+
+                crc = impls[j].calc(0, buf, strlen(buf));
+                RD_UT_ASSERT(crc == expected_crc,
+                             "Calculated CRC (%s) 0x%"PRIx32
+                             " not matching expected CRC 0x%"PRIx32,
+                             impls[j].name, crc, expected_crc);
+
+                for (k = 0 ; k < RD_ARRAYSIZE(lens) ; k++) {
+                        size_t of;
+                        for (of = 0 ; of < 8 ; of++) {
+                                uint32_t exp = crc32c_sw(0, rnd+of, lens[k]);
+                                size_t split = lens[k] / 3;
+
+                                crc = impls[j].calc(0, rnd+of, lens[k]);
+                                RD_UT_ASSERT(crc == exp,
+                                             "%s: CRC 0x%"PRIx32" for "
+                                             "len %"PRIusz" at offset "
+                                             "%"PRIusz" does not match "
+                                             "software CRC 0x%"PRIx32,
+                                             impls[j].name, crc,
+                                             lens[k], of, exp);
+
+                                crc = impls[j].calc(0, rnd+of, split);
+                                crc = impls[j].calc(crc, rnd+of+split,
+                                                    lens[k] - split);
+                                RD_UT_ASSERT(crc == exp,
+                                             "%s: incremental CRC 0x%"PRIx32
+                                             " for len %"PRIusz" split at "
+                                             "%"PRIusz" does not match "
+                                             "software CRC 0x%"PRIx32,
+                                             impls[j].name, crc,
+                                             lens[k], split, exp);
+                        }
+                }
+
+                best = j;
+        }
 
-        /* Verify software version too, regardless of which
-         * version was used above. */
-        crc32c_init_sw();
-        RD_UT_SAY("Calculate CRC32C using software");
-        crc = crc32c_sw(0, buf, strlen(buf));
-        RD_UT_ASSERT(crc == expected_crc,
-                     "Calculated CRC (software) 0x%"PRIx32
-                     " not matching expected CRC 0x%"PRIx32,
-                     crc, expected_crc);
+        /* Runtime dispatch must select the hardware implementation
+         * whenever the CPU supports one. */
+        RD_UT_ASSERT(crc32c_impl == impls[best].calc,
+                     "expected %s implementation to be selected, not %s",
+                     impls[best].name, crc32c_impl_name);
+
+        rd_free(rnd);
 
         RD_UT_PASS();
 }
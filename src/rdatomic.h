@@ -121,6 +121,31 @@ static RD_INLINE int32_t RD_UNUSED rd_atomic32_set(rd_atomic32_t *ra, int32_t v)
 #endif
 }
 
+/**
+ * @brief Set the value to \p newv if it currently is \p oldv.
+ *
+ * @returns 1 if the value was set, else 0.
+ */
+static RD_INLINE RD_UNUSED int rd_atomic32_cas (rd_atomic32_t *ra,
+                                                int32_t oldv, int32_t newv) {
+#if defined(_MSC_VER)
+        return InterlockedCompareExchange(&ra->val, newv, oldv) == oldv;
+#elif !HAVE_ATOMICS_32
+        int r;
+        mtx_lock(&ra->lock);
+        if ((r = (ra->val == oldv)))
+                ra->val = newv;
+        mtx_unlock(&ra->lock);
+        return r;
+#elif HAVE_ATOMICS_32_SYNC
+        return __sync_bool_compare_and_swap(&ra->val, oldv, newv);
+#else
+        return __atomic_compare_exchange_n(&ra->val, &oldv, newv, 0,
+                                           __ATOMIC_SEQ_CST,
+                                           __ATOMIC_SEQ_CST);
+#endif
+}
+
 
 
 static RD_INLINE RD_UNUSED void rd_atomic64_init (rd_atomic64_t *ra, int64_t v) {
@@ -200,4 +225,100 @@ static RD_INLINE int64_t RD_UNUSED rd_atomic64_set(rd_atomic64_t *ra, int64_t v)
 #endif
 }
 
+
+/**
+ * @brief Atomic pointer, used for lock-free linked lists.
+ *
+ * The pointer-sized operations use the 64-bit atomics configuration,
+ * falling back to a mutex where those are not available.
+ */
+typedef struct {
+        void *val;
+#if !defined(_MSC_VER) && !HAVE_ATOMICS_64
+        mtx_t lock;
+#endif
+} rd_atomicptr_t;
+
+static RD_INLINE RD_UNUSED void rd_atomicptr_init (rd_atomicptr_t *ra,
+                                                   void *v) {
+        ra->val = v;
+#if !defined(_MSC_VER) && !HAVE_ATOMICS_64
+        mtx_init(&ra->lock, mtx_plain);
+#endif
+}
+
+static RD_INLINE RD_UNUSED void rd_atomicptr_destroy (rd_atomicptr_t *ra) {
+#if !defined(_MSC_VER) && !HAVE_ATOMICS_64
+        mtx_destroy(&ra->lock);
+#endif
+}
+
+static RD_INLINE RD_UNUSED void *rd_atomicptr_get (rd_atomicptr_t *ra) {
+#if defined(_MSC_VER)
+        return InterlockedCompareExchangePointer(&ra->val, NULL, NULL);
+#elif !HAVE_ATOMICS_64
+        void *r;
+        mtx_lock(&ra->lock);
+        r = ra->val;
+        mtx_unlock(&ra->lock);
+        return r;
+#elif HAVE_ATOMICS_64_SYNC
+        return __sync_val_compare_and_swap(&ra->val, NULL, NULL);
+#else
+        return __atomic_load_n(&ra->val, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/**
+ * @brief Set the pointer to \p newv if it is currently \p oldv.
+ *
+ * @returns 1 if the pointer was set, else 0.
+ */
+static RD_INLINE RD_UNUSED int rd_atomicptr_cas (rd_atomicptr_t *ra,
+                                                 void *oldv, void *newv) {
+#if defined(_MSC_VER)
+        return InterlockedCompareExchangePointer(&ra->val, newv, oldv) == oldv;
+#elif !HAVE_ATOMICS_64
+        int r;
+        mtx_lock(&ra->lock);
+        if ((r = (ra->val == oldv)))
+                ra->val = newv;
+        mtx_unlock(&ra->lock);
+        return r;
+#elif HAVE_ATOMICS_64_SYNC
+        return __sync_bool_compare_and_swap(&ra->val, oldv, newv);
+#else
+        return __atomic_compare_exchange_n(&ra->val, &oldv, newv, 0,
+                                           __ATOMIC_SEQ_CST,
+                                           __ATOMIC_SEQ_CST);
+#endif
+}
+
+/**
+ * @brief Set the pointer to \p v.
+ *
+ * @returns the previous value.
+ */
+static RD_INLINE RD_UNUSED void *rd_atomicptr_swap (rd_atomicptr_t *ra,
+                                                    void *v) {
+#if defined(_MSC_VER)
+        return InterlockedExchangePointer(&ra->val, v);
+#elif !HAVE_ATOMICS_64
+        void *r;
+        mtx_lock(&ra->lock);
+        r = ra->val;
+        ra->val = v;
+        mtx_unlock(&ra->lock);
+        return r;
+#elif HAVE_ATOMICS_64_SYNC
+        void *r;
+        do {
+                r = ra->val;
+        } while (!__sync_bool_compare_and_swap(&ra->val, r, v));
+        return r;
+#else
+        return __atomic_exchange_n(&ra->val, v, __ATOMIC_SEQ_CST);
+#endif
+}
+
 #endif /* _RDATOMIC_H_ */
@@ -39,6 +39,264 @@ static size_t
 rd_buf_get_writable0 (rd_buf_t *rbuf, rd_segment_t **segp, void **p);
 
 
+/**
+ * @name Buffer segment pool
+ * @{
+ */
+
+/**
+ * @brief Header preceding each block of pool memory.
+ */
+typedef struct rd_bufpool_hdr_s {
+        rd_bufpool_t *pool;              /**< Owning pool */
+        struct rd_bufpool_hdr_s *next;   /**< Free list link */
+        int cls;                         /**< Size class, or -1 if the
+                                          *   block is too large to be
+                                          *   pooled. */
+} rd_bufpool_hdr_t;
+
+/* Keep the returned memory suitably aligned. */
+#define RD_BUFPOOL_HDR_SIZE  RD_ROUNDUP(sizeof(rd_bufpool_hdr_t), 16)
+
+#define rd_bufpool_class_size(cls) \
+        ((size_t)1 << ((cls) + RD_BUFPOOL_MIN_SHIFT))
+
+struct rd_bufpool_s {
+        mtx_t   lock;
+        struct {
+                rd_bufpool_hdr_t *head;  /**< Free list */
+                int cnt;                 /**< Free list length */
+                int low;                 /**< Lowest cnt since last trim */
+        } classes[RD_BUFPOOL_CLASS_CNT];
+        size_t  max_bytes;               /**< Maximum retained bytes */
+        size_t  retained;                /**< Currently retained bytes */
+        int     retained_cnt;            /**< Currently retained blocks */
+        int     outstanding;             /**< Blocks currently in use */
+        int     terminating;             /**< Pool owner is gone: destroy
+                                          *   pool when last outstanding
+                                          *   block is freed. */
+        int64_t hits;
+        int64_t misses;
+        int64_t trimmed;
+};
+
+
+/**
+ * @returns the size class fitting \p size, or -1 if too large.
+ */
+static RD_INLINE int rd_bufpool_class (size_t size) {
+        int cls = 0;
+
+        while (rd_bufpool_class_size(cls) < size) {
+                if (++cls == RD_BUFPOOL_CLASS_CNT)
+                        return -1;
+        }
+
+        return cls;
+}
+
+
+/**
+ * @brief Create a new pool retaining at most \p max_bytes of free memory.
+ */
+rd_bufpool_t *rd_bufpool_new (size_t max_bytes) {
+        rd_bufpool_t *pool = rd_calloc(1, sizeof(*pool));
+
+        mtx_init(&pool->lock, mtx_plain);
+        pool->max_bytes = max_bytes;
+
+        return pool;
+}
+
+
+/**
+ * @brief Release all retained blocks.
+ * @locks pool->lock MUST be held
+ */
+static void rd_bufpool_purge (rd_bufpool_t *pool) {
+        int cls;
+
+        for (cls = 0 ; cls < RD_BUFPOOL_CLASS_CNT ; cls++) {
+                rd_bufpool_hdr_t *hdr;
+
+                while ((hdr = pool->classes[cls].head)) {
+                        pool->classes[cls].head = hdr->next;
+                        rd_free(hdr);
+                }
+                pool->classes[cls].cnt = 0;
+                pool->classes[cls].low = 0;
+        }
+
+        pool->retained = 0;
+        pool->retained_cnt = 0;
+}
+
+
+/**
+ * @brief Destroy the pool, releasing all retained blocks.
+ *
+ * Blocks still in use remain valid and the pool itself is not freed
+ * until the last of them has been returned with rd_bufpool_free().
+ */
+void rd_bufpool_destroy (rd_bufpool_t *pool) {
+        int outstanding;
+
+        mtx_lock(&pool->lock);
+        rd_bufpool_purge(pool);
+        pool->terminating = 1;
+        outstanding = pool->outstanding;
+        mtx_unlock(&pool->lock);
+
+        if (outstanding > 0)
+                return;
+
+        mtx_destroy(&pool->lock);
+        rd_free(pool);
+}
+
+
+/**
+ * @brief Allocate at least \p size bytes from the pool.
+ *
+ * The usable size of the returned memory, which is \p size rounded up
+ * to the nearest size class, is returned in \p *sizep.
+ *
+ * The memory must be freed with rd_bufpool_free().
+ */
+void *rd_bufpool_alloc (rd_bufpool_t *pool, size_t size, size_t *sizep) {
+        rd_bufpool_hdr_t *hdr = NULL;
+        int cls = rd_bufpool_class(size);
+
+        if (cls != -1)
+                size = rd_bufpool_class_size(cls);
+
+        mtx_lock(&pool->lock);
+        if (cls != -1 && (hdr = pool->classes[cls].head)) {
+                pool->classes[cls].head = hdr->next;
+                if (--pool->classes[cls].cnt < pool->classes[cls].low)
+                        pool->classes[cls].low = pool->classes[cls].cnt;
+                pool->retained -= size;
+                pool->retained_cnt--;
+                pool->hits++;
+        } else
+                pool->misses++;
+        pool->outstanding++;
+        mtx_unlock(&pool->lock);
+
+        if (!hdr) {
+                hdr = rd_malloc(RD_BUFPOOL_HDR_SIZE + size);
+                hdr->pool = pool;
+                hdr->cls = cls;
+        }
+
+        if (sizep)
+                *sizep = size;
+
+        return (char *)hdr + RD_BUFPOOL_HDR_SIZE;
+}
+
+
+/**
+ * @brief Return memory allocated with rd_bufpool_alloc() to its pool,
+ *        or release it if the pool is full.
+ *
+ * @locality any thread
+ */
+void rd_bufpool_free (void *p) {
+        rd_bufpool_hdr_t *hdr = (rd_bufpool_hdr_t *)
+                ((char *)p - RD_BUFPOOL_HDR_SIZE);
+        rd_bufpool_t *pool = hdr->pool;
+        int retain = 0, destroy;
+
+        mtx_lock(&pool->lock);
+        pool->outstanding--;
+        if (hdr->cls != -1 && !pool->terminating &&
+            pool->retained + rd_bufpool_class_size(hdr->cls) <=
+            pool->max_bytes) {
+                hdr->next = pool->classes[hdr->cls].head;
+                pool->classes[hdr->cls].head = hdr;
+                pool->classes[hdr->cls].cnt++;
+                pool->retained += rd_bufpool_class_size(hdr->cls);
+                pool->retained_cnt++;
+                retain = 1;
+        }
+        destroy = pool->terminating && pool->outstanding == 0;
+        mtx_unlock(&pool->lock);
+
+        if (!retain)
+                rd_free(hdr);
+
+        if (destroy) {
+                mtx_destroy(&pool->lock);
+                rd_free(pool);
+        }
+}
+
+
+/**
+ * @brief Release retained blocks that have not been needed since the
+ *        previous call, i.e., the number of blocks in each size class
+ *        that remained unused through the entire interval.
+ *
+ * @returns the number of bytes released.
+ */
+size_t rd_bufpool_trim (rd_bufpool_t *pool) {
+        rd_bufpool_hdr_t *release = NULL;
+        size_t released = 0;
+        int cls;
+
+        mtx_lock(&pool->lock);
+        for (cls = 0 ; cls < RD_BUFPOOL_CLASS_CNT ; cls++) {
+                int cnt = pool->classes[cls].low;
+
+                while (cnt-- > 0) {
+                        rd_bufpool_hdr_t *hdr = pool->classes[cls].head;
+
+                        pool->classes[cls].head = hdr->next;
+                        pool->classes[cls].cnt--;
+                        hdr->next = release;
+                        release = hdr;
+
+                        released += rd_bufpool_class_size(cls);
+                        pool->retained_cnt--;
+                        pool->trimmed++;
+                }
+
+                pool->classes[cls].low = pool->classes[cls].cnt;
+        }
+        pool->retained -= released;
+        mtx_unlock(&pool->lock);
+
+        /* Free outside the lock */
+        while (release) {
+                rd_bufpool_hdr_t *hdr = release;
+                release = hdr->next;
+                rd_free(hdr);
+        }
+
+        return released;
+}
+
+
+/**
+ * @brief Get a snapshot of the pool statistics.
+ */
+void rd_bufpool_stats (rd_bufpool_t *pool, rd_bufpool_stats_t *stats) {
+        mtx_lock(&pool->lock);
+        stats->max_bytes    = pool->max_bytes;
+        stats->retained     = pool->retained;
+        stats->retained_cnt = pool->retained_cnt;
+        stats->outstanding  = pool->outstanding;
+        stats->hits         = pool->hits;
+        stats->misses       = pool->misses;
+        stats->trimmed      = pool->trimmed;
+        mtx_unlock(&pool->lock);
+}
+
+/**@}*/
+
+
+
 /**
  * @brief Destroy the segment and free its payload.
  *
@@ -128,6 +386,20 @@ rd_buf_alloc_segment0 (rd_buf_t *rbuf, size_t size) {
         if ((seg = extra_alloc(rbuf, sizeof(*seg) + size))) {
                 rd_segment_init(seg, size > 0 ? seg+1 : NULL, size);
 
+        } else if (rbuf->rbuf_pool && size >= RD_BUFPOOL_MIN_SIZE) {
+                /* Large payload: use pooled memory, which may be
+                 * larger than requested. */
+                void *p = rd_bufpool_alloc(rbuf->rbuf_pool, size, &size);
+                int flags = 0;
+
+                if (!(seg = extra_alloc(rbuf, sizeof(*seg)))) {
+                        seg = rd_malloc(sizeof(*seg));
+                        flags = RD_SEGMENT_F_FREE;
+                }
+                rd_segment_init(seg, p, size);
+                seg->seg_free   = rd_bufpool_free;
+                seg->seg_flags |= flags;
+
         } else if ((seg = extra_alloc(rbuf, sizeof(*seg)))) {
                 rd_segment_init(seg, size > 0 ? rd_malloc(size) : NULL, size);
                 if (size > 0)
@@ -337,7 +609,7 @@ void rd_buf_destroy (rd_buf_t *rbuf) {
         }
 
         if (rbuf->rbuf_extra)
-                rd_free(rbuf->rbuf_extra);
+                rbuf->rbuf_extra_free(rbuf->rbuf_extra);
 }
 
 
@@ -345,13 +617,18 @@ void rd_buf_destroy (rd_buf_t *rbuf) {
  * @brief Initialize buffer, pre-allocating \p fixed_seg_cnt segments
  *        where the first segment will have a \p buf_size of backing memory.
  *
+ *        If \p pool is non-NULL, large pre-allocations and segments
+ *        will use memory from the pool.
+ *
  *        The caller may rearrange the backing memory as it see fits.
  */
-void rd_buf_init (rd_buf_t *rbuf, size_t fixed_seg_cnt, size_t buf_size) {
+void rd_buf_init_pool (rd_buf_t *rbuf, rd_bufpool_t *pool,
+                       size_t fixed_seg_cnt, size_t buf_size) {
         size_t totalloc = 0;
 
         memset(rbuf, 0, sizeof(*rbuf));
         TAILQ_INIT(&rbuf->rbuf_segments);
+        rbuf->rbuf_pool = pool;
 
         if (!fixed_seg_cnt) {
                 assert(!buf_size);
@@ -366,8 +643,24 @@ void rd_buf_init (rd_buf_t *rbuf, size_t fixed_seg_cnt, size_t buf_size) {
         /* Pre-allocate extra space for the backing buffer. */
         totalloc += buf_size;
 
+        if (pool && totalloc >= RD_BUFPOOL_MIN_SIZE) {
+                rbuf->rbuf_extra = rd_bufpool_alloc(pool, totalloc,
+                                                    &totalloc);
+                rbuf->rbuf_extra_free = rd_bufpool_free;
+        } else {
+                rbuf->rbuf_extra = rd_malloc(totalloc);
+                rbuf->rbuf_extra_free = rd_free;
+        }
+
         rbuf->rbuf_extra_size = totalloc;
-        rbuf->rbuf_extra = rd_malloc(rbuf->rbuf_extra_size);
+}
+
+
+/**
+ * @brief Initialize buffer without a pool, see rd_buf_init_pool().
+ */
+void rd_buf_init (rd_buf_t *rbuf, size_t fixed_seg_cnt, size_t buf_size) {
+        rd_buf_init_pool(rbuf, NULL, fixed_seg_cnt, buf_size);
 }
 
 
@@ -1538,6 +1831,110 @@ static int do_unittest_write_iov (void) {
 }
 
 
+/**
+ * @brief Verify buffer segment pool allocation, retention, caps and trimming.
+ */
+int unittest_bufpool (void) {
+        rd_bufpool_t *pool;
+        rd_bufpool_stats_t st;
+        rd_buf_t b;
+        rd_slice_t slice;
+        void *p, *p2, *p3;
+        size_t size;
+        char buf[256];
+        int i;
+
+        pool = rd_bufpool_new(2 * 1024 * 1024);
+
+        /* Sizes are rounded up to the size class */
+        p = rd_bufpool_alloc(pool, 5000, &size);
+        RD_UT_ASSERT(size == 8192, "expected size 8192, not %"PRIusz, size);
+        memset(p, 'a', size);
+        rd_bufpool_free(p);
+
+        /* Same size class is served from the pool */
+        p2 = rd_bufpool_alloc(pool, 8000, &size);
+        RD_UT_ASSERT(p2 == p, "expected pooled block %p to be reused, got %p",
+                     p, p2);
+        rd_bufpool_stats(pool, &st);
+        RD_UT_ASSERT(st.hits == 1 && st.misses == 1 && st.outstanding == 1,
+                     "hits %"PRId64", misses %"PRId64", outstanding %d",
+                     st.hits, st.misses, st.outstanding);
+
+        /* Blocks beyond the cap are not retained */
+        p = rd_bufpool_alloc(pool, 1024 * 1024, &size);
+        p3 = rd_bufpool_alloc(pool, 1024 * 1024, &size);
+        rd_bufpool_free(p2);
+        rd_bufpool_free(p);
+        rd_bufpool_free(p3);
+        rd_bufpool_stats(pool, &st);
+        RD_UT_ASSERT(st.retained == 8192 + 1024 * 1024 &&
+                     st.retained_cnt == 2 && st.outstanding == 0,
+                     "retained %"PRIusz" (%d blocks), outstanding %d",
+                     st.retained, st.retained_cnt, st.outstanding);
+
+        /* The first trim only establishes the idle low-water mark
+         * (the free lists were empty when the pool was created).
+         * The 8 KiB block is used in between the next two trims and is
+         * thus retained, while the idle 1 MiB block is released. */
+        RD_UT_ASSERT(rd_bufpool_trim(pool) == 0, "expected nothing trimmed");
+        p = rd_bufpool_alloc(pool, 8192, NULL);
+        rd_bufpool_free(p);
+        size = rd_bufpool_trim(pool);
+        RD_UT_ASSERT(size == 1024 * 1024,
+                     "expected idle 1 MiB block to be trimmed, "
+                     "not %"PRIusz" bytes", size);
+        size = rd_bufpool_trim(pool);
+        RD_UT_ASSERT(size == 8192,
+                     "expected idle 8 KiB block to be trimmed, "
+                     "not %"PRIusz" bytes", size);
+        rd_bufpool_stats(pool, &st);
+        RD_UT_ASSERT(st.retained == 0 && st.retained_cnt == 0 &&
+                     st.trimmed == 2,
+                     "retained %"PRIusz" (%d blocks), trimmed %"PRId64,
+                     st.retained, st.retained_cnt, st.trimmed);
+
+        /* Pooled buffer: pre-allocation and large segments from the pool */
+        rd_buf_init_pool(&b, pool, 2, 10000);
+        rd_buf_write_ensure_contig(&b, 100);
+        for (i = 0 ; i < (int)sizeof(buf) ; i++)
+                buf[i] = (char)i;
+        for (i = 0 ; i < 1000 ; i++)
+                rd_buf_write(&b, buf, sizeof(buf));
+        rd_buf_write_ensure_contig(&b, 100000);
+        rd_buf_write(&b, buf, sizeof(buf));
+
+        rd_bufpool_stats(pool, &st);
+        RD_UT_ASSERT(st.outstanding >= 2,
+                     "expected pooled segments, outstanding %d",
+                     st.outstanding);
+
+        rd_slice_init_full(&slice, &b);
+        for (i = 0 ; i < 1001 ; i++) {
+                char rbuf[sizeof(buf)];
+                RD_UT_ASSERT(rd_slice_read(&slice, rbuf, sizeof(rbuf)) ==
+                             sizeof(rbuf), "short read at #%d", i);
+                RD_UT_ASSERT(!memcmp(rbuf, buf, sizeof(buf)),
+                             "payload mismatch at #%d", i);
+        }
+
+        rd_buf_destroy(&b);
+
+        rd_bufpool_stats(pool, &st);
+        RD_UT_ASSERT(st.outstanding == 0 && st.retained_cnt > 0,
+                     "outstanding %d, retained %d blocks",
+                     st.outstanding, st.retained_cnt);
+
+        /* Destroying the pool with blocks in use defers the final
+         * destruction to the last free. */
+        p = rd_bufpool_alloc(pool, 100000, NULL);
+        rd_bufpool_destroy(pool);
+        rd_bufpool_free(p);
+
+        RD_UT_PASS();
+}
+
+
 int unittest_rdbuf (void) {
         int fails = 0;
 
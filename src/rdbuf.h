@@ -38,6 +38,57 @@
 #include "rdsysqueue.h"
 
 
+/**
+ * @name Buffer segment pool
+ *
+ * @{
+ *
+ * Thread-safe pool of power-of-two sized memory blocks used as backing
+ * memory for large buffer segments (such as protocol responses and
+ * ProduceRequests), avoiding repeated allocation and release of
+ * multi-megabyte blocks.
+ *
+ * Blocks returned to the pool are retained up to the configured maximum
+ * number of bytes, and blocks that have not been needed during an
+ * entire trim interval are released by rd_bufpool_trim().
+ *
+ * Memory allocated from the pool carries a small header pointing back
+ * to the pool, which allows rd_bufpool_free() to be used as a
+ * standard segment free function.
+ */
+
+#define RD_BUFPOOL_MIN_SHIFT  12  /**< Smallest size class: 4 KiB */
+#define RD_BUFPOOL_MAX_SHIFT  27  /**< Largest size class: 128 MiB */
+#define RD_BUFPOOL_CLASS_CNT  (RD_BUFPOOL_MAX_SHIFT-RD_BUFPOOL_MIN_SHIFT+1)
+#define RD_BUFPOOL_MIN_SIZE   ((size_t)1 << RD_BUFPOOL_MIN_SHIFT)
+
+typedef struct rd_bufpool_s rd_bufpool_t;
+
+/**
+ * @brief Pool statistics, see rd_bufpool_stats().
+ */
+typedef struct rd_bufpool_stats_s {
+        size_t  max_bytes;     /**< Configured maximum retained bytes */
+        size_t  retained;      /**< Currently retained bytes */
+        int     retained_cnt;  /**< Currently retained blocks */
+        int     outstanding;   /**< Blocks currently in use */
+        int64_t hits;          /**< Allocations served from the pool */
+        int64_t misses;        /**< Allocations served from the heap */
+        int64_t trimmed;       /**< Idle blocks released by trimming */
+} rd_bufpool_stats_t;
+
+rd_bufpool_t *rd_bufpool_new (size_t max_bytes);
+void rd_bufpool_destroy (rd_bufpool_t *pool);
+void *rd_bufpool_alloc (rd_bufpool_t *pool, size_t size, size_t *sizep);
+void rd_bufpool_free (void *p);
+size_t rd_bufpool_trim (rd_bufpool_t *pool);
+void rd_bufpool_stats (rd_bufpool_t *pool, rd_bufpool_stats_t *stats);
+
+int unittest_bufpool (void);
+
+/**@}*/
+
+
 /**
  * @name Generic byte buffers
  *
@@ -97,6 +148,11 @@ typedef struct rd_buf_s {
                                                * buffer memory, etc. */
         size_t            rbuf_extra_len;     /* Current extra memory used */
         size_t            rbuf_extra_size;    /* Total size of extra memory */
+        void            (*rbuf_extra_free) (void *p); /* Extra memory
+                                                       * free function */
+
+        rd_bufpool_t     *rbuf_pool;          /**< Optional pool for
+                                               *   large segments. */
 } rd_buf_t;
 
 
@@ -198,6 +254,8 @@ size_t rd_buf_get_write_iov (const rd_buf_t *rbuf,
                              struct iovec *iovs, size_t *iovcntp,
                              size_t iov_max, size_t size_max);
 
+void rd_buf_init_pool (rd_buf_t *rbuf, rd_bufpool_t *pool,
+                       size_t fixed_seg_cnt, size_t buf_size);
 void rd_buf_init (rd_buf_t *rbuf, size_t fixed_seg_cnt, size_t buf_size);
 
 void rd_buf_destroy (rd_buf_t *rbuf);
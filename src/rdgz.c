@@ -28,97 +28,392 @@
 
 #include "rd.h"
 #include "rdgz.h"
+#include "rdtime.h"
+#include "rdunittest.h"
 
 #include <zlib.h>
+#include <limits.h>
 
 
-#define RD_GZ_CHUNK  262144
+/**
+ * Reusable inflate context, see rd_gz_inflate().
+ */
+struct rd_gz_inflater_s {
+        z_stream strm;
+        int      strm_init;   /* inflateInit2() has been called */
+};
+
+
+/**
+ * Inflate 'compressed' in a single pass using the initialized (or reset)
+ * stream 'strm' into an output buffer of initially 'size' bytes which is
+ * doubled whenever it runs full.
+ *
+ * 'size' is only a hint, typically derived from untrusted input, and is
+ * capped to RD_GZ_MAX_RATIO times the compressed size: the buffer grows
+ * with the actual output instead.
+ *
+ * zlib's avail_in/avail_out are uInt, so input and output larger
+ * than that are passed in chunks.
+ *
+ * As with the previous two-pass implementation a truncated input stream
+ * is not an error: the data inflated so far is returned.
+ */
+static void *rd_gz_inflate0 (z_stream *strm,
+                             const void *compressed, size_t compressed_len,
+                             size_t size, size_t *decompressed_lenp) {
+        char *decompressed;
+        size_t in_of = 0;
+        size_t of = 0;
+
+        if (compressed_len <= SIZE_MAX / RD_GZ_MAX_RATIO &&
+            size > compressed_len * RD_GZ_MAX_RATIO)
+                size = compressed_len * RD_GZ_MAX_RATIO;
+        if (size < 64)
+                size = 64;
+
+        /* +1 for the nul-terminator */
+        decompressed = rd_malloc(size + 1);
+
+        strm->avail_in = 0;
+
+        while (1) {
+                size_t out_chunk;
+                int r;
+
+                if (strm->avail_in == 0 && in_of < compressed_len) {
+                        size_t in_chunk = RD_MIN(compressed_len - in_of,
+                                                 (size_t)UINT_MAX);
+                        strm->next_in = (unsigned char *)compressed + in_of;
+                        strm->avail_in = (uInt)in_chunk;
+                        in_of += in_chunk;
+                }
+
+                out_chunk = RD_MIN(size - of, (size_t)UINT_MAX);
+                strm->next_out = (unsigned char *)decompressed + of;
+                strm->avail_out = (uInt)out_chunk;
+
+                r = inflate(strm, Z_NO_FLUSH);
+                of += out_chunk - strm->avail_out;
+
+                if (r == Z_STREAM_END)
+                        break;
+
+                /* Z_BUF_ERROR: no progress possible, which is
+                 * fine as long as it's due to a full output buffer. */
+                if (r != Z_OK && r != Z_BUF_ERROR) {
+                        rd_free(decompressed);
+                        return NULL;
+                }
+
+                if (of < size) {
+                        if (strm->avail_in == 0 && in_of == compressed_len)
+                                break; /* Input exhausted */
+                        continue; /* Next input or output chunk */
+                }
+
+                size *= 2;
+                decompressed = rd_realloc(decompressed, size + 1);
+        }
+
+        /* Return excess memory if the size estimate was way off,
+         * the buffer may be referenced for a long time. */
+        if (size - of > size / 4 && size > 4096)
+                decompressed = rd_realloc(decompressed, of + 1);
+
+        /* For convenience of the caller we nul-terminate
+         * the buffer. If it happens to be a string there
+         * is no need for extra copies. */
+        decompressed[of] = '\0';
+        *decompressed_lenp = of;
+
+        return decompressed;
+}
+
 
 void *rd_gz_decompress (const void *compressed, int compressed_len,
 			uint64_t *decompressed_lenp) {
-	int pass = 1;
-	char *decompressed = NULL;
-
-	/* First pass (1): calculate decompressed size.
-	 *                 (pass-1 is skipped if *decompressed_lenp is
-	 *                  non-zero).
-	 * Second pass (2): perform actual decompression.
-	 */
-
-	if (*decompressed_lenp != 0LLU)
-		pass++;
-
-	for (; pass <= 2 ; pass++) {
-		z_stream strm = RD_ZERO_INIT;
-		gz_header hdr;
-		char buf[512];
-		char *p;
-		int len;
-		int r;
-		
-		if ((r = inflateInit2(&strm, 15+32)) != Z_OK)
-			goto fail;
-
-		strm.next_in = (void *)compressed;
-		strm.avail_in = compressed_len;
-
-		if ((r = inflateGetHeader(&strm, &hdr)) != Z_OK) {
-			inflateEnd(&strm);
-			goto fail;
-		}
-
-		if (pass == 1) {
-			/* Use dummy output buffer */
-			p = buf;
-			len = sizeof(buf);
-		} else {
-			/* Use real output buffer */
-			p = decompressed;
-			len = (int)*decompressed_lenp;
-		}
-
-		do {
-			strm.next_out = (unsigned char *)p;
-			strm.avail_out = len;
-
-			r = inflate(&strm, Z_NO_FLUSH);
-			switch  (r) {
-			case Z_STREAM_ERROR:
-			case Z_NEED_DICT:
-			case Z_DATA_ERROR:
-			case Z_MEM_ERROR:
-				inflateEnd(&strm);
-				goto fail;
-			}
-
-			if (pass == 2) {
-				/* Advance output pointer (in pass 2). */
-				p += len - strm.avail_out;
-				len -= len - strm.avail_out;
-			}
-
-		} while (strm.avail_out == 0 && r != Z_STREAM_END);
-
-
-		if (pass == 1) {
-			*decompressed_lenp = strm.total_out;
-			if (!(decompressed = malloc((size_t)(*decompressed_lenp)+1))) {
-				inflateEnd(&strm);
-				return NULL;
-			}
-			/* For convenience of the caller we nul-terminate
-			 * the buffer. If it happens to be a string there
-			 * is no need for extra copies. */
-			decompressed[*decompressed_lenp] = '\0';
-		}
-
-		inflateEnd(&strm);
-	}
-
-	return decompressed;
+	z_stream strm = RD_ZERO_INIT;
+        char *decompressed;
+        size_t len;
+
+        if (inflateInit2(&strm, 15+32) != Z_OK)
+                return NULL;
+
+        /* Use the known length, or guess. */
+        decompressed = rd_gz_inflate0(&strm, compressed,
+                                      (size_t)compressed_len,
+                                      *decompressed_lenp ?
+                                      (size_t)*decompressed_lenp :
+                                      (size_t)compressed_len * 4,
+                                      &len);
+
+        inflateEnd(&strm);
+
+        if (decompressed)
+                *decompressed_lenp = (uint64_t)len;
+
+        return decompressed;
+}
+
+
+rd_gz_inflater_t *rd_gz_inflater_new (void) {
+        return rd_calloc(1, sizeof(rd_gz_inflater_t));
+}
+
+void rd_gz_inflater_destroy (rd_gz_inflater_t *gzi) {
+        if (gzi->strm_init)
+                inflateEnd(&gzi->strm);
+        rd_free(gzi);
+}
+
+
+void *rd_gz_inflate (rd_gz_inflater_t *gzi,
+                     const void *compressed, size_t compressed_len,
+                     size_t size_hint, size_t *decompressed_lenp) {
+        if (!gzi->strm_init) {
+                if (inflateInit2(&gzi->strm, 15+32) != Z_OK)
+                        return NULL;
+                gzi->strm_init = 1;
+        } else if (inflateReset(&gzi->strm) != Z_OK)
+                return NULL;
+
+        return rd_gz_inflate0(&gzi->strm, compressed, compressed_len,
+                              size_hint ? size_hint : compressed_len * 4,
+                              decompressed_lenp);
+}
+
+
+
+/**
+ * Previous two-pass implementation of rd_gz_decompress(), used as the
+ * reference for the single-pass implementation: the first pass inflates
+ * into a scratch buffer to find the decompressed size.
+ */
+static void *ut_gz_decompress_2pass (const void *compressed,
+                                     size_t compressed_len,
+                                     size_t *decompressed_lenp) {
+        char *decompressed = NULL;
+        size_t len = 0;
+        int pass;
+
+        for (pass = 1 ; pass <= 2 ; pass++) {
+                z_stream strm = RD_ZERO_INIT;
+                char buf[512];
+                int r;
+
+                if (inflateInit2(&strm, 15+32) != Z_OK)
+                        goto fail;
+
+                strm.next_in = (void *)compressed;
+                strm.avail_in = (uInt)compressed_len;
+
+                if (pass == 2) {
+                        strm.next_out = (unsigned char *)decompressed;
+                        strm.avail_out = (uInt)len;
+                }
+
+                do {
+                        if (pass == 1) {
+                                strm.next_out = (unsigned char *)buf;
+                                strm.avail_out = sizeof(buf);
+                        }
+                        r = inflate(&strm, Z_NO_FLUSH);
+                        if (r != Z_OK && r != Z_STREAM_END &&
+                            r != Z_BUF_ERROR) {
+                                inflateEnd(&strm);
+                                goto fail;
+                        }
+                } while (strm.avail_out == 0 && r != Z_STREAM_END);
+
+                if (pass == 1) {
+                        len = strm.total_out;
+                        decompressed = rd_malloc(len + 1);
+                        decompressed[len] = '\0';
+                }
+
+                inflateEnd(&strm);
+        }
+
+        *decompressed_lenp = len;
+        return decompressed;
 
 fail:
-	if (decompressed)
-		free(decompressed);
-	return NULL;
+        if (decompressed)
+                rd_free(decompressed);
+        return NULL;
+}
+
+
+/**
+ * gzip-compress 'len' bytes of 'data' into a malloced buffer.
+ */
+static void *ut_gz_compress (const void *data, size_t len, size_t *outlenp) {
+        z_stream strm = RD_ZERO_INIT;
+        size_t size;
+        void *out;
+
+        if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                         15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+                return NULL;
+
+        size = deflateBound(&strm, (uLong)len);
+        out = rd_malloc(size);
+
+        strm.next_in = (void *)data;
+        strm.avail_in = (uInt)len;
+        strm.next_out = out;
+        strm.avail_out = (uInt)size;
+
+        if (deflate(&strm, Z_FINISH) != Z_STREAM_END) {
+                deflateEnd(&strm);
+                rd_free(out);
+                return NULL;
+        }
+
+        *outlenp = strm.total_out;
+        deflateEnd(&strm);
+        return out;
+}
+
+
+/**
+ * Verify single-pass decompression, including against
+ * the previous two-pass implementation.
+ */
+int unittest_gz (void) {
+        const int batch_cnt = 16;
+        const int record_cnt = 500;
+        struct {
+                char  *data;
+                size_t len;
+                void  *z;
+                size_t zlen;
+        } batches[16];
+        rd_gz_inflater_t *gzi;
+        uint64_t outlen;
+        size_t len;
+        char *p;
+        int i, j;
+
+        /* Semi-compressible record-like batches of varying size */
+        for (i = 0 ; i < batch_cnt ; i++) {
+                size_t size = (size_t)record_cnt * 160 * (1 + (i % 4));
+                size_t of = 0;
+                int r;
+
+                batches[i].data = rd_malloc(size);
+                for (r = 0 ; of + 64 < size ; r++)
+                        of += rd_snprintf(batches[i].data + of, size - of,
+                                          "record %d: key=%x value=%u;",
+                                          r, (unsigned int)r * 2654435761u,
+                                          (unsigned int)rand());
+                batches[i].len = of;
+                batches[i].z = ut_gz_compress(batches[i].data, of,
+                                              &batches[i].zlen);
+                RD_UT_ASSERT(batches[i].z, "compression failed");
+        }
+
+        /* Verify: without a hint the output buffer starts off too small
+         * (ratio guess) and must grow, with a hint it does not. */
+        gzi = rd_gz_inflater_new();
+        for (j = 0 ; j < 2 ; j++) {
+                for (i = 0 ; i < batch_cnt ; i++) {
+                        p = rd_gz_inflate(gzi, batches[i].z, batches[i].zlen,
+                                          j == 0 ? 0 : batches[i].len + 1,
+                                          &len);
+                        RD_UT_ASSERT(p && len == batches[i].len &&
+                                     !memcmp(p, batches[i].data, len) &&
+                                     p[len] == '\0',
+                                     "batch %d: rd_gz_inflate() mismatch "
+                                     "(%"PRIusz" bytes, expected %"PRIusz")",
+                                     i, p ? len : 0, batches[i].len);
+                        rd_free(p);
+                }
+        }
+
+        /* Legacy interface, with and without known length */
+        for (j = 0 ; j < 2 ; j++) {
+                outlen = j == 0 ? 0 : (uint64_t)batches[0].len;
+                p = rd_gz_decompress(batches[0].z, (int)batches[0].zlen,
+                                     &outlen);
+                RD_UT_ASSERT(p && outlen == (uint64_t)batches[0].len &&
+                             !memcmp(p, batches[0].data, batches[0].len),
+                             "rd_gz_decompress() mismatch");
+                rd_free(p);
+        }
+
+        /* Corrupt input */
+        p = rd_malloc(batches[1].zlen);
+        memcpy(p, batches[1].z, batches[1].zlen);
+        for (i = 10 ; i < 40 ; i++)
+                p[i] = (char)~p[i];
+        RD_UT_ASSERT(!rd_gz_inflate(gzi, p, batches[1].zlen, 0, &len),
+                     "expected failure on corrupt input");
+        rd_free(p);
+
+        /* A bogus size hint (e.g., from a corrupt RecordCount) must
+         * not be allocated as is. */
+        p = rd_gz_inflate(gzi, batches[3].z, batches[3].zlen,
+                          (size_t)1 << 60, &len);
+        RD_UT_ASSERT(p && len == batches[3].len &&
+                     !memcmp(p, batches[3].data, len),
+                     "rd_gz_inflate() mismatch with bogus size hint");
+        rd_free(p);
+
+        /* The inflater must still be usable after a failure */
+        p = rd_gz_inflate(gzi, batches[2].z, batches[2].zlen, 0, &len);
+        RD_UT_ASSERT(p && len == batches[2].len &&
+                     !memcmp(p, batches[2].data, len),
+                     "rd_gz_inflate() mismatch after failure");
+        rd_free(p);
+
+        /* Single-pass output must be identical to the previous
+         * two-pass implementation's regardless of the size hint:
+         * too small (grows), exact, and as sized by the consumer from
+         * the partition's history (with headroom). */
+        for (i = 0 ; i < batch_cnt ; i++) {
+                const size_t hints[] = {
+                        1, batches[i].len, batches[i].len + batches[i].len / 8
+                };
+                char *p2;
+                size_t len2;
+                size_t k;
+
+                p2 = ut_gz_decompress_2pass(batches[i].z, batches[i].zlen,
+                                            &len2);
+                RD_UT_ASSERT(p2 && len2 == batches[i].len,
+                             "batch %d: two-pass decompression failed", i);
+
+                for (k = 0 ; k < RD_ARRAYSIZE(hints) ; k++) {
+                        p = rd_gz_inflate(gzi, batches[i].z, batches[i].zlen,
+                                          hints[k], &len);
+                        RD_UT_ASSERT(p && len == len2 && !memcmp(p, p2, len),
+                                     "batch %d: single-pass output with "
+                                     "size hint %"PRIusz" differs from "
+                                     "two-pass output", i, hints[k]);
+                        rd_free(p);
+                }
+
+                rd_free(p2);
+        }
+
+        /* A truncated stream is not an error: the data inflated
+         * so far is returned. */
+        p = rd_gz_inflate(gzi, batches[3].z, batches[3].zlen / 2, 0, &len);
+        RD_UT_ASSERT(p && len > 0 && len < batches[3].len &&
+                     !memcmp(p, batches[3].data, len),
+                     "truncated input: expected a prefix of the %"PRIusz
+                     " byte batch, got %"PRIusz" bytes",
+                     batches[3].len, p ? len : 0);
+        rd_free(p);
+
+        rd_gz_inflater_destroy(gzi);
+
+        for (i = 0 ; i < batch_cnt ; i++) {
+                rd_free(batches[i].data);
+                rd_free(batches[i].z);
+        }
+
+        RD_UT_PASS();
 }
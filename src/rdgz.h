@@ -42,4 +42,41 @@
 void *rd_gz_decompress (const void *compressed, int compressed_len,
 			uint64_t *decompressed_lenp);
 
+
+/**
+ * Reusable inflate context.
+ *
+ * Keeps an initialized zlib stream across calls (reset rather than
+ * re-initialized per payload).
+ *
+ * Not thread-safe: use one inflater per thread.
+ */
+typedef struct rd_gz_inflater_s rd_gz_inflater_t;
+
+rd_gz_inflater_t *rd_gz_inflater_new (void);
+void rd_gz_inflater_destroy (rd_gz_inflater_t *gzi);
+
+/**
+ * Maximum decompressed / compressed size ratio assumed when sizing
+ * the initial output buffer: larger size hints are capped.
+ */
+#define RD_GZ_MAX_RATIO 255
+
+/**
+ * Single-pass gzip decompression using inflater 'gzi', returning the
+ * inflated data in a malloced (rd_free()) and nul-terminated buffer
+ * whose length is returned in '*decompressed_lenp'.
+ *
+ * The output buffer is initially sized from 'size_hint' (the expected
+ * decompressed size, or 0 if not known), capped to RD_GZ_MAX_RATIO
+ * times 'compressed_len', and is grown as needed.
+ *
+ * Returns NULL on decompression failure.
+ */
+void *rd_gz_inflate (rd_gz_inflater_t *gzi,
+                     const void *compressed, size_t compressed_len,
+                     size_t size_hint, size_t *decompressed_lenp);
+
+int unittest_gz (void);
+
 #endif /* _RDGZ_H_ */
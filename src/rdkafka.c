@@ -48,6 +48,13 @@
 #include "rdkafka_event.h"
 #include "rdkafka_sasl.h"
 #include "rdkafka_interceptor.h"
+#include "rdkafka_idempotence.h"
+#include "rdkafka_decompress.h"
+#include "rdkafka_compress.h"
+#include "rdkafka_reactor.h"
+#if WITH_IO_URING
+#include "rdkafka_uring.h"
+#endif
 
 #include "rdtime.h"
 #include "crc32c.h"
@@ -539,6 +546,41 @@ static const struct rd_kafka_err_desc rd_kafka_err_descs[] = {
                   "Broker: Security features are disabled"),
         _ERR_DESC(RD_KAFKA_RESP_ERR_OPERATION_NOT_ATTEMPTED,
                   "Broker: Operation not attempted"),
+        _ERR_DESC(RD_KAFKA_RESP_ERR_KAFKA_STORAGE_ERROR,
+                  "Broker: Disk error when trying to access log file on "
+                  "the disk"),
+        _ERR_DESC(RD_KAFKA_RESP_ERR_LOG_DIR_NOT_FOUND,
+                  "Broker: The user-specified log directory is not found "
+                  "in the broker config"),
+        _ERR_DESC(RD_KAFKA_RESP_ERR_SASL_AUTHENTICATION_FAILED,
+                  "Broker: SASL Authentication failed"),
+        _ERR_DESC(RD_KAFKA_RESP_ERR_UNKNOWN_PRODUCER_ID,
+                  "Broker: Unknown Producer Id"),
+        _ERR_DESC(RD_KAFKA_RESP_ERR_REASSIGNMENT_IN_PROGRESS,
+                  "Broker: Partition reassignment is in progress"),
+        _ERR_DESC(RD_KAFKA_RESP_ERR_DELEGATION_TOKEN_AUTH_DISABLED,
+                  "Broker: Delegation Token feature is not enabled"),
+        _ERR_DESC(RD_KAFKA_RESP_ERR_DELEGATION_TOKEN_NOT_FOUND,
+                  "Broker: No delegation token found on server"),
+        _ERR_DESC(RD_KAFKA_RESP_ERR_DELEGATION_TOKEN_OWNER_MISMATCH,
+                  "Broker: Specified Principal is not valid Owner/Renewer"),
+        _ERR_DESC(RD_KAFKA_RESP_ERR_DELEGATION_TOKEN_REQUEST_NOT_ALLOWED,
+                  "Broker: Delegation Token requests are not allowed on "
+                  "this connection"),
+        _ERR_DESC(RD_KAFKA_RESP_ERR_DELEGATION_TOKEN_AUTHORIZATION_FAILED,
+                  "Broker: Delegation Token authorization failed"),
+        _ERR_DESC(RD_KAFKA_RESP_ERR_DELEGATION_TOKEN_EXPIRED,
+                  "Broker: Delegation Token is expired"),
+        _ERR_DESC(RD_KAFKA_RESP_ERR_INVALID_PRINCIPAL_TYPE,
+                  "Broker: Supplied principalType is not supported"),
+        _ERR_DESC(RD_KAFKA_RESP_ERR_NON_EMPTY_GROUP,
+                  "Broker: The group is not empty"),
+        _ERR_DESC(RD_KAFKA_RESP_ERR_GROUP_ID_NOT_FOUND,
+                  "Broker: The group id does not exist"),
+        _ERR_DESC(RD_KAFKA_RESP_ERR_FETCH_SESSION_ID_NOT_FOUND,
+                  "Broker: The fetch session ID was not found"),
+        _ERR_DESC(RD_KAFKA_RESP_ERR_INVALID_FETCH_SESSION_EPOCH,
+                  "Broker: The fetch session epoch is invalid"),
 
 	_ERR_DESC(RD_KAFKA_RESP_ERR__END, NULL)
 };
@@ -632,6 +674,8 @@ void rd_kafka_destroy_final (rd_kafka_t *rk) {
 
         rd_kafka_assignors_term(rk);
 
+        rd_kafka_sasl_term(rk);
+
         rd_kafka_metadata_cache_destroy(rk);
 
         rd_kafka_timers_destroy(&rk->rk_timers);
@@ -682,10 +726,16 @@ void rd_kafka_destroy_final (rd_kafka_t *rk) {
         rd_kafkap_str_destroy(rk->rk_eos.TransactionalId);
 	rd_kafka_anyconf_destroy(_RK_GLOBAL, &rk->rk_conf);
         rd_list_destroy(&rk->rk_broker_by_id);
+        RD_IF_FREE(rk->rk_topic_hash, rd_free);
 
 	rd_kafkap_bytes_destroy((rd_kafkap_bytes_t *)rk->rk_null_bytes);
 	rwlock_destroy(&rk->rk_lock);
 
+        rd_kafka_op_pool_destroy(&rk->rk_fetch_op_pool);
+
+        if (rk->rk_bufpool)
+                rd_bufpool_destroy(rk->rk_bufpool);
+
 	rd_free(rk);
 	rd_kafka_global_cnt_decr();
 }
@@ -827,6 +877,15 @@ static void rd_kafka_destroy_internal (rd_kafka_t *rk) {
         /* Call on_destroy() interceptors */
         rd_kafka_interceptors_on_destroy(rk);
 
+        /* Serve the outstanding compression ops while the broker
+         * threads are still around to send the resulting requests. */
+        if (rk->rk_compress_pool) {
+                rd_kafka_dbg(rk, GENERIC, "TERMINATE",
+                             "Terminate %d compression thread(s)",
+                             rk->rk_compress_pool->rkcp_thrd_cnt);
+                rd_kafka_compress_pool_term(rk->rk_compress_pool);
+        }
+
 	/* Brokers pick up on rk_terminate automatically. */
 
         /* List of (broker) threads to join to synchronize termination */
@@ -846,10 +905,13 @@ static void rd_kafka_destroy_internal (rd_kafka_t *rk) {
          * Broker thread holds a refcount and detects when broker refcounts
          * reaches 1 and then decommissions itself. */
         TAILQ_FOREACH_SAFE(rkb, &rk->rk_brokers, rkb_link, rkb_tmp) {
-                /* Add broker's thread to wait_thrds list for later joining */
-                thrd = malloc(sizeof(*thrd));
-                *thrd = rkb->rkb_thread;
-                rd_list_add(&wait_thrds, thrd);
+                /* Add broker's thread to wait_thrds list for later joining,
+                 * reactor threads are joined separately below. */
+                if (!rkb->rkb_reactor) {
+                        thrd = malloc(sizeof(*thrd));
+                        *thrd = rkb->rkb_thread;
+                        rd_list_add(&wait_thrds, thrd);
+                }
                 rd_kafka_wrunlock(rk);
 
                 /* Send op to trigger queue/io wake-up.
@@ -859,7 +921,7 @@ static void rd_kafka_destroy_internal (rd_kafka_t *rk) {
 
 #ifndef _MSC_VER
                 /* Interrupt IO threads to speed up termination. */
-                if (rk->rk_conf.term_sig)
+                if (rk->rk_conf.term_sig && !rkb->rkb_reactor)
 			pthread_kill(rkb->rkb_thread, rk->rk_conf.term_sig);
 #endif
 
@@ -898,9 +960,11 @@ static void rd_kafka_destroy_internal (rd_kafka_t *rk) {
                                rd_kafka_op_new(RD_KAFKA_OP_TERMINATE));
 
                 rk->rk_internal_rkb = NULL;
-                thrd = malloc(sizeof(*thrd));
-                *thrd = rkb->rkb_thread;
-                rd_list_add(&wait_thrds, thrd);
+                if (!rkb->rkb_reactor) {
+                        thrd = malloc(sizeof(*thrd));
+                        *thrd = rkb->rkb_thread;
+                        rd_list_add(&wait_thrds, thrd);
+                }
         }
         mtx_unlock(&rk->rk_internal_rkb_lock);
 	if (rkb)
@@ -918,6 +982,30 @@ static void rd_kafka_destroy_internal (rd_kafka_t *rk) {
         }
 
         rd_list_destroy(&wait_thrds);
+
+        if (rk->rk_reactors) {
+                rd_kafka_dbg(rk, GENERIC, "TERMINATE",
+                             "Join %d broker reactor thread(s)",
+                             rk->rk_reactor_cnt);
+                rd_kafka_reactors_destroy(rk);
+        }
+
+        /* Outstanding decompression jobs are served before the
+         * pool threads exit. */
+        if (rk->rk_decomp_pool) {
+                rd_kafka_dbg(rk, GENERIC, "TERMINATE",
+                             "Join %d decompression thread(s)",
+                             rk->rk_decomp_pool->rkdp_thrd_cnt);
+                rd_kafka_decomp_pool_destroy(rk->rk_decomp_pool);
+                rk->rk_decomp_pool = NULL;
+        }
+
+        /* The pool is only destroyed after the broker threads are gone
+         * since they may still submit ops, which are then failed. */
+        if (rk->rk_compress_pool) {
+                rd_kafka_compress_pool_destroy(rk->rk_compress_pool);
+                rk->rk_compress_pool = NULL;
+        }
 }
 
 /**
@@ -1016,6 +1104,9 @@ static RD_INLINE void rd_kafka_stats_emit_toppar (struct _stats_emit *st,
 
         rd_kafka_toppar_lock(rktp);
 
+        /* Reflect the intake queue in msgq_cnt */
+        rd_kafka_toppar_msgq_intake_drain(rktp);
+
         if (rktp->rktp_leader) {
                 rd_kafka_broker_lock(rktp->rktp_leader);
                 leader_nodeid = rktp->rktp_leader->rkb_nodeid;
@@ -1052,6 +1143,8 @@ static RD_INLINE void rd_kafka_stats_emit_toppar (struct _stats_emit *st,
 		   "\"xmit_msgq_bytes\":%"PRIusz", "
 		   "\"fetchq_cnt\":%i, "
 		   "\"fetchq_size\":%"PRIu64", "
+		   "\"fetchq_held_bytes\":%"PRId64", "
+		   "\"fetch_size\":%"PRId32", "
 		   "\"fetch_state\":\"%s\", "
 		   "\"query_offset\":%"PRId64", "
 		   "\"next_offset\":%"PRId64", "
@@ -1081,8 +1174,10 @@ static RD_INLINE void rd_kafka_stats_emit_toppar (struct _stats_emit *st,
                    /* FIXME: xmit_msgq is local to the broker thread. */
                    0,
                    (size_t)0,
-		   rd_kafka_q_len(rktp->rktp_fetchq),
-		   rd_kafka_q_size(rktp->rktp_fetchq),
+		   rd_kafka_toppar_fetchq_msgcnt(rktp),
+		   (size_t)rd_kafka_toppar_fetchq_size(rktp),
+		   rd_atomic64_get(&rktp->rktp_fetchq_bytes),
+		   rd_kafka_toppar_fetch_size(rktp),
 		   rd_kafka_fetch_states[rktp->rktp_fetch_state],
 		   rktp->rktp_query_offset,
                    offs.fetch_offset,
@@ -1148,6 +1243,8 @@ static void rd_kafka_stats_emit_all (rd_kafka_t *rk) {
 		   "\"msg_size_max\":%"PRIusz", "
                    "\"simple_cnt\":%i, "
                    "\"metadata_cache_cnt\":%i, "
+                   "\"fetchq_held_bytes\":%"PRId64", "
+                   "\"fetchq_max_total_bytes\":%"PRId64", "
 		   "\"brokers\":{ "/*open brokers*/,
                    rk->rk_name,
                    rk->rk_conf.client_id_str,
@@ -1158,7 +1255,9 @@ static void rd_kafka_stats_emit_all (rd_kafka_t *rk) {
 		   tot_cnt, tot_size,
 		   rk->rk_curr_msgs.max_cnt, rk->rk_curr_msgs.max_size,
                    rd_atomic32_get(&rk->rk_simple_cnt),
-                   rk->rk_metadata_cache.rkmc_cnt);
+                   rk->rk_metadata_cache.rkmc_cnt,
+                   rd_atomic64_get(&rk->rk_fetchq_bytes),
+                   rk->rk_conf.queued_max_total_bytes);
 
 
 	TAILQ_FOREACH(rkb, &rk->rk_brokers, rkb_link) {
@@ -1186,7 +1285,10 @@ static void rd_kafka_stats_emit_all (rd_kafka_t *rk) {
                            "\"rxpartial\":%"PRIu64", "
                            "\"zbuf_grow\":%"PRIu64", "
                            "\"buf_grow\":%"PRIu64", "
-                           "\"wakeups\":%"PRIu64", ",
+                           "\"wakeups\":%"PRIu64", "
+                           "\"fetch_full\":%"PRIu64", "
+                           "\"fetch_incr\":%"PRIu64", "
+                           "\"fetch_session_resets\":%"PRIu64", ",
 			   rkb == TAILQ_FIRST(&rk->rk_brokers) ? "" : ", ",
 			   rkb->rkb_name,
 			   rkb->rkb_name,
@@ -1209,7 +1311,10 @@ static void rd_kafka_stats_emit_all (rd_kafka_t *rk) {
 			   rd_atomic64_get(&rkb->rkb_c.rx_partial),
                            rd_atomic64_get(&rkb->rkb_c.zbuf_grow),
                            rd_atomic64_get(&rkb->rkb_c.buf_grow),
-                           rd_atomic64_get(&rkb->rkb_c.wakeups));
+                           rd_atomic64_get(&rkb->rkb_c.wakeups),
+                           rd_atomic64_get(&rkb->rkb_c.fetch_full),
+                           rd_atomic64_get(&rkb->rkb_c.fetch_incr),
+                           rd_atomic64_get(&rkb->rkb_c.fetch_session_resets));
 
                 total.tx       += rd_atomic64_get(&rkb->rkb_c.tx);
                 total.tx_bytes += rd_atomic64_get(&rkb->rkb_c.tx_bytes);
@@ -1305,6 +1410,51 @@ static void rd_kafka_stats_emit_all (rd_kafka_t *rk) {
                            rkcg->rkcg_c.rebalance_cnt,
                            rkcg->rkcg_c.assignment_size);
         }
+
+        if (rd_kafka_is_idempotent(rk)) {
+                _st_printf(", \"eos\": { "
+                           "\"idemp_state\": \"%s\", "
+                           "\"idemp_stateage\": %"PRId64", "
+                           "\"producer_id\": %"PRId64", "
+                           "\"producer_epoch\": %hd }",
+                           rd_kafka_idemp_state2str(rk->rk_eos.idemp_state),
+                           (rd_clock() - rk->rk_eos.ts_idemp_state) / 1000,
+                           rk->rk_eos.pid.id,
+                           rk->rk_eos.pid.epoch);
+        }
+
+        if (rk->rk_type == RD_KAFKA_CONSUMER) {
+                rd_kafka_op_pool_t *rkopp = &rk->rk_fetch_op_pool;
+                _st_printf(", \"fetch_op_pool\": { "
+                           "\"cnt\": %"PRId32", "
+                           "\"max\": %d, "
+                           "\"alloc\": %"PRId64", "
+                           "\"reuse\": %"PRId64", "
+                           "\"return\": %"PRId64", "
+                           "\"refill\": %"PRId64" }",
+                           rd_atomic32_get(&rkopp->rkopp_cnt),
+                           rkopp->rkopp_max,
+                           rd_atomic64_get(&rkopp->rkopp_c.alloc),
+                           rd_atomic64_get(&rkopp->rkopp_c.reuse),
+                           rd_atomic64_get(&rkopp->rkopp_c.ret),
+                           rd_atomic64_get(&rkopp->rkopp_c.refill));
+        }
+
+        if (rk->rk_bufpool) {
+                rd_bufpool_stats_t bps;
+                rd_bufpool_stats(rk->rk_bufpool, &bps);
+                _st_printf(", \"buffer_pool\": { "
+                           "\"retained\": %"PRIusz", "
+                           "\"retained_cnt\": %d, "
+                           "\"max\": %"PRIusz", "
+                           "\"outstanding\": %d, "
+                           "\"hits\": %"PRId64", "
+                           "\"misses\": %"PRId64", "
+                           "\"trimmed\": %"PRId64" }",
+                           bps.retained, bps.retained_cnt, bps.max_bytes,
+                           bps.outstanding, bps.hits, bps.misses,
+                           bps.trimmed);
+        }
 	rd_kafka_rdunlock(rk);
 
         /* Total counters */
@@ -1375,6 +1525,23 @@ static void rd_kafka_metadata_refresh_cb (rd_kafka_timers_t *rkts, void *arg) {
 
 
 
+/**
+ * @brief Buffer pool trim timer callback: release pooled buffers
+ *        that have been idle since the previous run.
+ *
+ * @locality rdkafka main thread
+ */
+static void rd_kafka_bufpool_trim_tmr_cb (rd_kafka_timers_t *rkts,
+                                          void *arg) {
+        rd_kafka_t *rk = rkts->rkts_rk;
+        size_t released = rd_bufpool_trim(rk->rk_bufpool);
+
+        if (released > 0)
+                rd_kafka_dbg(rk, GENERIC, "BUFPOOL",
+                             "Released %"PRIusz" bytes of idle pooled "
+                             "buffer memory", released);
+}
+
 
 
 /**
@@ -1385,6 +1552,7 @@ static int rd_kafka_thread_main (void *arg) {
 	rd_kafka_timer_t tmr_topic_scan = RD_ZERO_INIT;
 	rd_kafka_timer_t tmr_stats_emit = RD_ZERO_INIT;
 	rd_kafka_timer_t tmr_metadata_refresh = RD_ZERO_INIT;
+        rd_kafka_timer_t tmr_bufpool_trim = RD_ZERO_INIT;
 
         rd_kafka_set_thread_name("main");
         rd_kafka_set_thread_sysname("rdk:main");
@@ -1407,6 +1575,10 @@ static int rd_kafka_thread_main (void *arg) {
                                      rk->rk_conf.metadata_refresh_interval_ms *
                                      1000ll,
                                      rd_kafka_metadata_refresh_cb, NULL);
+        if (rk->rk_bufpool)
+                rd_kafka_timer_start(&rk->rk_timers, &tmr_bufpool_trim,
+                                     rk->rk_conf.buffer_pool_idle_ms * 1000ll,
+                                     rd_kafka_bufpool_trim_tmr_cb, NULL);
 
         if (rk->rk_cgrp) {
                 rd_kafka_cgrp_reassign_broker(rk->rk_cgrp);
@@ -1434,6 +1606,11 @@ static int rd_kafka_thread_main (void *arg) {
         if (rk->rk_conf.stats_interval_ms)
                 rd_kafka_timer_stop(&rk->rk_timers, &tmr_stats_emit, 1);
         rd_kafka_timer_stop(&rk->rk_timers, &tmr_metadata_refresh, 1);
+        if (rk->rk_bufpool)
+                rd_kafka_timer_stop(&rk->rk_timers, &tmr_bufpool_trim, 1);
+
+        if (rd_kafka_is_idempotent(rk))
+                rd_kafka_idemp_term(rk);
 
         /* Synchronise state */
         rd_kafka_wrlock(rk);
@@ -1527,6 +1704,15 @@ rd_kafka_t *rd_kafka_new (rd_kafka_type_t type, rd_kafka_conf_t *app_conf,
                                                  conf->fetch_max_bytes + 512);
         }
 
+        if (type == RD_KAFKA_PRODUCER) {
+                /* The idempotent producer can't guarantee ordering
+                 * with more than 5 in-flight requests per broker. */
+                if (conf->eos.idempotence)
+                        conf->max_inflight = RD_MIN(conf->max_inflight, 5);
+        } else {
+                conf->eos.idempotence = 0;
+        }
+
         if (conf->metadata_max_age_ms == -1) {
                 if (conf->metadata_refresh_interval_ms > 0)
                         conf->metadata_max_age_ms =
@@ -1561,9 +1747,22 @@ rd_kafka_t *rd_kafka_new (rd_kafka_type_t type, rd_kafka_conf_t *app_conf,
 
 	cnd_init(&rk->rk_broker_state_change_cnd);
 	mtx_init(&rk->rk_broker_state_change_lock, mtx_plain);
+
+        /* Keep (at most) as many recycled fetch ops as there may be
+         * pre-fetched messages per partition, capped to a small
+         * fixed number of ops. */
+        rd_kafka_op_pool_init(&rk->rk_fetch_op_pool,
+                              rk->rk_type == RD_KAFKA_CONSUMER ?
+                              RD_MIN(rk->rk_conf.queued_min_msgs,
+                                     RD_KAFKA_OP_POOL_MAX_CNT) : 0);
+        rd_atomic64_init(&rk->rk_fetchq_bytes, 0);
         rd_list_init(&rk->rk_broker_state_change_waiters, 8,
                      rd_kafka_enq_once_trigger_destroy);
 
+        if (rk->rk_conf.buffer_pool_max_bytes > 0)
+                rk->rk_bufpool = rd_bufpool_new(
+                        (size_t)rk->rk_conf.buffer_pool_max_bytes);
+
 	rk->rk_rep = rd_kafka_q_new(rk);
 	rk->rk_ops = rd_kafka_q_new(rk);
         rk->rk_ops->rkq_serve = rd_kafka_poll_cb;
@@ -1594,6 +1793,10 @@ rd_kafka_t *rd_kafka_new (rd_kafka_type_t type, rd_kafka_conf_t *app_conf,
         /* Admin client defaults */
         rk->rk_conf.admin.request_timeout_ms = rk->rk_conf.socket_timeout_ms;
 
+        rd_kafka_pid_reset(&rk->rk_eos.pid);
+        if (rd_kafka_is_idempotent(rk))
+                rd_kafka_idemp_init(rk);
+
 	/* Convenience Kafka protocol null bytes */
 	rk->rk_null_bytes = rd_kafkap_bytes_new(NULL, 0);
 
@@ -1613,6 +1816,8 @@ rd_kafka_t *rd_kafka_new (rd_kafka_type_t type, rd_kafka_conf_t *app_conf,
         /* Config fixups */
         rk->rk_conf.queued_max_msg_bytes =
                 (int64_t)rk->rk_conf.queued_max_msg_kbytes * 1000ll;
+        rk->rk_conf.queued_max_total_bytes =
+                (int64_t)rk->rk_conf.queued_max_total_kbytes * 1000ll;
 
 	/* Enable api.version.request=true if fallback.broker.version
 	 * indicates a supporting broker. */
@@ -1720,6 +1925,88 @@ rd_kafka_t *rd_kafka_new (rd_kafka_type_t type, rd_kafka_conf_t *app_conf,
                 rd_kafka_wrunlock(rk);
         }
 
+        /* Create decompression thread pool for consumers if
+         * fetch.decompress.threads is configured. */
+        if (type == RD_KAFKA_CONSUMER &&
+            rk->rk_conf.fetch_decompress_threads > 0) {
+                rk->rk_decomp_pool = rd_kafka_decomp_pool_new(
+                        rk, rk->rk_conf.fetch_decompress_threads,
+                        errstr, errstr_size);
+                if (!rk->rk_decomp_pool) {
+                        ret_err = RD_KAFKA_RESP_ERR__CRIT_SYS_RESOURCE;
+                        ret_errno = errno;
+#ifndef _MSC_VER
+                        /* Restore sigmask of caller */
+                        pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+#endif
+                        goto fail;
+                }
+        }
+
+        /* Fall back to the poll() backend if the io_uring backend
+         * can't be used: it is only available with
+         * per-broker threads. */
+        if (rk->rk_conf.socket_io_backend == RD_KAFKA_IO_BACKEND_IO_URING) {
+#if WITH_IO_URING
+                char uerrstr[256];
+
+                if (rk->rk_conf.broker_threads > 0) {
+                        rd_kafka_log(rk, LOG_WARNING, "IOURING",
+                                     "socket.io.backend=io_uring is not "
+                                     "supported with broker.threads > 0: "
+                                     "using poll");
+                        rk->rk_conf.socket_io_backend =
+                                RD_KAFKA_IO_BACKEND_POLL;
+                } else if (!rd_kafka_uring_supported(uerrstr,
+                                                     sizeof(uerrstr))) {
+                        rd_kafka_log(rk, LOG_WARNING, "IOURING",
+                                     "socket.io.backend=io_uring is not "
+                                     "available: %s: using poll",
+                                     uerrstr);
+                        rk->rk_conf.socket_io_backend =
+                                RD_KAFKA_IO_BACKEND_POLL;
+                }
+#else
+                rd_kafka_log(rk, LOG_WARNING, "IOURING",
+                             "socket.io.backend=io_uring is not "
+                             "supported by this build of librdkafka: "
+                             "using poll");
+                rk->rk_conf.socket_io_backend = RD_KAFKA_IO_BACKEND_POLL;
+#endif
+        }
+
+        /* Create shared broker reactor threads if
+         * broker.threads is configured. */
+        if (rk->rk_conf.broker_threads > 0 &&
+            rd_kafka_reactors_init(rk, rk->rk_conf.broker_threads,
+                                   errstr, errstr_size) == -1) {
+                ret_err = RD_KAFKA_RESP_ERR__CRIT_SYS_RESOURCE;
+                ret_errno = errno;
+#ifndef _MSC_VER
+                /* Restore sigmask of caller */
+                pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+#endif
+                goto fail;
+        }
+
+        /* Create compression thread pool for producers if
+         * compression.threads is configured. */
+        if (type == RD_KAFKA_PRODUCER &&
+            rk->rk_conf.compression_threads > 0) {
+                rk->rk_compress_pool = rd_kafka_compress_pool_new(
+                        rk, rk->rk_conf.compression_threads,
+                        errstr, errstr_size);
+                if (!rk->rk_compress_pool) {
+                        ret_err = RD_KAFKA_RESP_ERR__CRIT_SYS_RESOURCE;
+                        ret_errno = errno;
+#ifndef _MSC_VER
+                        /* Restore sigmask of caller */
+                        pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+#endif
+                        goto fail;
+                }
+        }
+
 
 
 	/* Lock handle here to synchronise state, i.e., hold off
@@ -1749,7 +2036,6 @@ rd_kafka_t *rd_kafka_new (rd_kafka_type_t type, rd_kafka_conf_t *app_conf,
          * @warning `goto fail` is prohibited past this point
          */
 
-        rk->rk_eos.PID = -1;
         rk->rk_eos.TransactionalId = rd_kafkap_str_new(NULL, 0);
 
         mtx_lock(&rk->rk_internal_rkb_lock);
@@ -1815,6 +2101,7 @@ fail:
          * Legacy APIs, sigh.. */
         if (app_conf) {
                 rd_kafka_assignors_term(rk);
+                rd_kafka_sasl_term(rk);
                 rd_kafka_interceptors_destroy(&rk->rk_conf);
                 memset(&rk->rk_conf, 0, sizeof(rk->rk_conf));
         }
@@ -2867,7 +3154,15 @@ rd_kafka_poll_cb (rd_kafka_t *rk, rd_kafka_q_t *rkq, rd_kafka_op_t *rko,
                                      "Forcing unassign of %d partition(s)",
                                      rko->rko_u.rebalance.partitions ?
                                      rko->rko_u.rebalance.partitions->cnt : 0);
-                        rd_kafka_assign(rk, NULL);
+                        if (rko->rko_err ==
+                            RD_KAFKA_RESP_ERR__REVOKE_PARTITIONS &&
+                            rko->rko_u.rebalance.partitions &&
+                            !strcmp(rd_kafka_rebalance_protocol(rk),
+                                    "COOPERATIVE"))
+                                rd_kafka_incremental_unassign(
+                                        rk, rko->rko_u.rebalance.partitions);
+                        else
+                                rd_kafka_assign(rk, NULL);
                 }
                 break;
 
@@ -471,6 +471,38 @@ typedef enum {
         RD_KAFKA_RESP_ERR_SECURITY_DISABLED = 54,
         /** Operation not attempted */
         RD_KAFKA_RESP_ERR_OPERATION_NOT_ATTEMPTED = 55,
+        /** Disk error when trying to access log file on the disk */
+        RD_KAFKA_RESP_ERR_KAFKA_STORAGE_ERROR = 56,
+        /** The user-specified log directory is not found in the broker config */
+        RD_KAFKA_RESP_ERR_LOG_DIR_NOT_FOUND = 57,
+        /** SASL Authentication failed */
+        RD_KAFKA_RESP_ERR_SASL_AUTHENTICATION_FAILED = 58,
+        /** Unknown Producer Id */
+        RD_KAFKA_RESP_ERR_UNKNOWN_PRODUCER_ID = 59,
+        /** Partition reassignment is in progress */
+        RD_KAFKA_RESP_ERR_REASSIGNMENT_IN_PROGRESS = 60,
+        /** Delegation Token feature is not enabled */
+        RD_KAFKA_RESP_ERR_DELEGATION_TOKEN_AUTH_DISABLED = 61,
+        /** No delegation token found on server */
+        RD_KAFKA_RESP_ERR_DELEGATION_TOKEN_NOT_FOUND = 62,
+        /** Specified Principal is not valid Owner/Renewer */
+        RD_KAFKA_RESP_ERR_DELEGATION_TOKEN_OWNER_MISMATCH = 63,
+        /** Delegation Token requests are not allowed on this connection */
+        RD_KAFKA_RESP_ERR_DELEGATION_TOKEN_REQUEST_NOT_ALLOWED = 64,
+        /** Delegation Token authorization failed */
+        RD_KAFKA_RESP_ERR_DELEGATION_TOKEN_AUTHORIZATION_FAILED = 65,
+        /** Delegation Token is expired */
+        RD_KAFKA_RESP_ERR_DELEGATION_TOKEN_EXPIRED = 66,
+        /** Supplied principalType is not supported */
+        RD_KAFKA_RESP_ERR_INVALID_PRINCIPAL_TYPE = 67,
+        /** The group is not empty */
+        RD_KAFKA_RESP_ERR_NON_EMPTY_GROUP = 68,
+        /** The group id does not exist */
+        RD_KAFKA_RESP_ERR_GROUP_ID_NOT_FOUND = 69,
+        /** The fetch session ID was not found */
+        RD_KAFKA_RESP_ERR_FETCH_SESSION_ID_NOT_FOUND = 70,
+        /** The fetch session epoch is invalid */
+        RD_KAFKA_RESP_ERR_INVALID_FETCH_SESSION_EPOCH = 71,
 
 	RD_KAFKA_RESP_ERR_END_ALL,
 } rd_kafka_resp_err_t;
@@ -1429,6 +1461,16 @@ void rd_kafka_conf_set_consume_cb (rd_kafka_conf_t *conf,
  * such as fetching offsets from an alternate location (on assign)
  * or manually committing offsets (on revoke).
  *
+ * With the COOPERATIVE rebalance protocol (see
+ * rd_kafka_rebalance_protocol() and the \c cooperative-sticky
+ * \c partition.assignment.strategy) the same two events are used but
+ * \p partitions only contains the partitions that are added to or
+ * removed from the current assignment, the remaining partitions keep
+ * being consumed throughout the rebalance. The rebalance callback must
+ * then call rd_kafka_incremental_assign() and
+ * rd_kafka_incremental_unassign() respectively, rather than
+ * rd_kafka_assign().
+ *
  * @remark The \p partitions list is destroyed by librdkafka on return
  *         return from the rebalance_cb and must not be freed or
  *         saved by the application.
@@ -2988,6 +3030,66 @@ RD_EXPORT rd_kafka_resp_err_t
 rd_kafka_assign (rd_kafka_t *rk,
                  const rd_kafka_topic_partition_list_t *partitions);
 
+/**
+ * @brief Incrementally add \p partitions to the current assignment.
+ *
+ * Fetchers are started for the added partitions while the partitions
+ * already assigned keep being consumed without interruption.
+ *
+ * This is the counterpart of rd_kafka_assign() for the COOPERATIVE
+ * rebalance protocol and shall be called from the rebalance callback
+ * with the partitions of a RD_KAFKA_RESP_ERR__ASSIGN_PARTITIONS event
+ * (even if the list is empty) to maintain internal join state.
+ *
+ * @returns RD_KAFKA_RESP_ERR_NO_ERROR on success,
+ *          RD_KAFKA_RESP_ERR__CONFLICT if any of the partitions is already
+ *          assigned (the assignment is left unchanged),
+ *          RD_KAFKA_RESP_ERR__STATE if the group uses the EAGER rebalance
+ *          protocol,
+ *          RD_KAFKA_RESP_ERR__INVALID_ARG if \p partitions is NULL or
+ *          RD_KAFKA_RESP_ERR__UNKNOWN_GROUP if the instance is not a
+ *          group consumer.
+ */
+RD_EXPORT rd_kafka_resp_err_t
+rd_kafka_incremental_assign (rd_kafka_t *rk,
+                             const rd_kafka_topic_partition_list_t
+                             *partitions);
+
+/**
+ * @brief Incrementally remove \p partitions from the current assignment.
+ *
+ * The offsets of the removed partitions are committed (if
+ * \c enable.auto.commit is set) and their fetchers stopped, the
+ * remaining partitions keep being consumed.
+ *
+ * This is the counterpart of rd_kafka_assign(rk, NULL) for the COOPERATIVE
+ * rebalance protocol and shall be called from the rebalance callback
+ * with the partitions of a RD_KAFKA_RESP_ERR__REVOKE_PARTITIONS event.
+ *
+ * @returns RD_KAFKA_RESP_ERR_NO_ERROR on success,
+ *          RD_KAFKA_RESP_ERR__CONFLICT if any of the partitions is not
+ *          assigned (the assignment is left unchanged), or the same errors
+ *          as rd_kafka_incremental_assign().
+ */
+RD_EXPORT rd_kafka_resp_err_t
+rd_kafka_incremental_unassign (rd_kafka_t *rk,
+                               const rd_kafka_topic_partition_list_t
+                               *partitions);
+
+/**
+ * @brief The rebalance protocol currently in use by the consumer group.
+ *
+ * The protocol is determined by the assignor selected by the group
+ * (\c partition.assignment.strategy) and is known once the consumer
+ * has joined the group.
+ *
+ * @returns \c "NONE" if the consumer has not (yet) joined a group or is not
+ *          a group consumer, else \c "EAGER" or \c "COOPERATIVE".
+ *
+ * @remark The returned string is static and must not be freed.
+ */
+RD_EXPORT const char *rd_kafka_rebalance_protocol (rd_kafka_t *rk);
+
 /**
  * @brief Returns the current partition assignment
  *
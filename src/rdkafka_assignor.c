@@ -40,6 +40,9 @@ void rd_kafka_group_member_clear (rd_kafka_group_member_t *rkgm) {
         if (rkgm->rkgm_assignment)
                 rd_kafka_topic_partition_list_destroy(rkgm->rkgm_assignment);
 
+        if (rkgm->rkgm_owned)
+                rd_kafka_topic_partition_list_destroy(rkgm->rkgm_owned);
+
         rd_list_destroy(&rkgm->rkgm_eligible);
 
         if (rkgm->rkgm_member_id)
@@ -92,10 +95,19 @@ rd_kafka_group_member_find_subscription (rd_kafka_t *rk,
 
 
 
-static rd_kafkap_bytes_t *
+/**
+ * @brief Construct the consumer protocol MemberMetadata for the
+ *        subscribed \p topics with the assignor-specific \p userdata.
+ *
+ * If \p owned_partitions is non-NULL version 1 of the MemberMetadata
+ * is constructed, which includes the partitions currently owned by
+ * the member, as used by cooperative assignors.
+ */
+rd_kafkap_bytes_t *
 rd_kafka_consumer_protocol_member_metadata_new (
 	const rd_list_t *topics,
-        const void *userdata, size_t userdata_size) {
+        const void *userdata, size_t userdata_size,
+        const rd_kafka_topic_partition_list_t *owned_partitions) {
         rd_kafka_buf_t *rkbuf;
         rd_kafkap_bytes_t *kbytes;
         int i;
@@ -106,14 +118,19 @@ rd_kafka_consumer_protocol_member_metadata_new (
         /*
          * MemberMetadata => Version Subscription AssignmentStrategies
          *   Version      => int16
-         *   Subscription => Topics UserData
+         *   Subscription => Topics UserData OwnedPartitions
          *     Topics     => [String]
          *     UserData     => Bytes
+         *     OwnedPartitions => [Topic [Partition]]  (v1)
+         *       Topic     => String
+         *       Partition => int32
          */
 
-        rkbuf = rd_kafka_buf_new(1, 100 + (topic_cnt * 100) + userdata_size);
+        rkbuf = rd_kafka_buf_new(1, 100 + (topic_cnt * 100) + userdata_size +
+                                 (owned_partitions ?
+                                  owned_partitions->cnt * 4 : 0));
 
-        rd_kafka_buf_write_i16(rkbuf, 0);
+        rd_kafka_buf_write_i16(rkbuf, owned_partitions ? 1 : 0);
         rd_kafka_buf_write_i32(rkbuf, topic_cnt);
 	RD_LIST_FOREACH(tinfo, topics, i)
                 rd_kafka_buf_write_str(rkbuf, tinfo->topic, -1);
@@ -122,6 +139,43 @@ rd_kafka_consumer_protocol_member_metadata_new (
 	else /* Kafka 0.9.0.0 cant parse NULL bytes, so we provide empty. */
 		rd_kafka_buf_write_bytes(rkbuf, "", 0);
 
+        if (owned_partitions) {
+                rd_kafka_topic_partition_list_t *sorted;
+                const char *last_topic = NULL;
+                size_t of_TopicCnt, of_PartCnt = 0;
+                int owned_topic_cnt = 0, part_cnt = 0;
+
+                sorted = rd_kafka_topic_partition_list_copy(owned_partitions);
+                rd_kafka_topic_partition_list_sort_by_topic(sorted);
+
+                of_TopicCnt = rd_kafka_buf_write_i32(rkbuf, 0);
+                for (i = 0 ; i < sorted->cnt ; i++) {
+                        const rd_kafka_topic_partition_t *rktpar =
+                                &sorted->elems[i];
+
+                        if (!last_topic || strcmp(last_topic, rktpar->topic)) {
+                                if (last_topic)
+                                        rd_kafka_buf_update_i32(
+                                                rkbuf, of_PartCnt, part_cnt);
+                                rd_kafka_buf_write_str(rkbuf,
+                                                       rktpar->topic, -1);
+                                of_PartCnt = rd_kafka_buf_write_i32(rkbuf, 0);
+                                part_cnt = 0;
+                                owned_topic_cnt++;
+                                last_topic = rktpar->topic;
+                        }
+
+                        rd_kafka_buf_write_i32(rkbuf, rktpar->partition);
+                        part_cnt++;
+                }
+
+                if (last_topic)
+                        rd_kafka_buf_update_i32(rkbuf, of_PartCnt, part_cnt);
+                rd_kafka_buf_update_i32(rkbuf, of_TopicCnt, owned_topic_cnt);
+
+                rd_kafka_topic_partition_list_destroy(sorted);
+        }
+
         /* Get binary buffer and allocate a new Kafka Bytes with a copy. */
         rd_slice_init_full(&rkbuf->rkbuf_reader, &rkbuf->rkbuf_buf);
         len = rd_slice_remains(&rkbuf->rkbuf_reader);
@@ -138,10 +192,27 @@ rd_kafka_consumer_protocol_member_metadata_new (
 
 rd_kafkap_bytes_t *
 rd_kafka_assignor_get_metadata (rd_kafka_assignor_t *rkas,
-				const rd_list_t *topics) {
+				const rd_list_t *topics,
+                                const rd_kafka_topic_partition_list_t
+                                *owned_partitions,
+                                int32_t owned_generation_id) {
         return rd_kafka_consumer_protocol_member_metadata_new(
                 topics, rkas->rkas_userdata,
-                rkas->rkas_userdata_size);
+                rkas->rkas_userdata_size, NULL);
+}
+
+
+const char *
+rd_kafka_rebalance_protocol2str (rd_kafka_rebalance_protocol_t protocol) {
+        switch (protocol)
+        {
+        case RD_KAFKA_REBALANCE_PROTOCOL_EAGER:
+                return "EAGER";
+        case RD_KAFKA_REBALANCE_PROTOCOL_COOPERATIVE:
+                return "COOPERATIVE";
+        default:
+                return "NONE";
+        }
 }
 
 
@@ -421,6 +492,7 @@ rd_kafka_assignor_add (rd_kafka_t *rk,
 		       rd_kafka_assignor_t **rkasp,
                        const char *protocol_type,
                        const char *protocol_name,
+                       rd_kafka_rebalance_protocol_t rebalance_protocol,
                        rd_kafka_resp_err_t (*assign_cb) (
                                rd_kafka_t *rk,
                                const char *member_id,
@@ -452,6 +524,7 @@ rd_kafka_assignor_add (rd_kafka_t *rk,
 
         rkas->rkas_protocol_name    = rd_kafkap_str_new(protocol_name, -1);
         rkas->rkas_protocol_type    = rd_kafkap_str_new(protocol_type, -1);
+        rkas->rkas_protocol         = rebalance_protocol;
         rkas->rkas_assign_cb        = assign_cb;
         rkas->rkas_get_metadata_cb  = rd_kafka_assignor_get_metadata;
         rkas->rkas_opaque = opaque;
@@ -514,13 +587,35 @@ int rd_kafka_assignors_init (rd_kafka_t *rk, char *errstr, size_t errstr_size) {
 		if (!strcmp(s, "range"))
 			rd_kafka_assignor_add(
 				rk, &rkas, "consumer", "range",
+                                RD_KAFKA_REBALANCE_PROTOCOL_EAGER,
 				rd_kafka_range_assignor_assign_cb,
 				NULL);
 		else if (!strcmp(s, "roundrobin"))
 			rd_kafka_assignor_add(
 				rk, &rkas, "consumer", "roundrobin",
+                                RD_KAFKA_REBALANCE_PROTOCOL_EAGER,
 				rd_kafka_roundrobin_assignor_assign_cb,
 				NULL);
+		else if (!strcmp(s, "sticky")) {
+			if (!rd_kafka_assignor_add(
+				    rk, &rkas, "consumer", "sticky",
+                                    RD_KAFKA_REBALANCE_PROTOCOL_EAGER,
+				    rd_kafka_sticky_assignor_assign_cb,
+				    NULL))
+                                /* Advertise previously owned partitions */
+                                rkas->rkas_get_metadata_cb =
+                                        rd_kafka_sticky_assignor_get_metadata;
+                }
+                else if (!strcmp(s, "cooperative-sticky")) {
+                        if (!rd_kafka_assignor_add(
+                                    rk, &rkas, "consumer",
+                                    "cooperative-sticky",
+                                    RD_KAFKA_REBALANCE_PROTOCOL_COOPERATIVE,
+                                    rd_kafka_cooperative_sticky_assignor_assign_cb,
+                                    NULL))
+                                rkas->rkas_get_metadata_cb =
+                                        rd_kafka_cooperative_sticky_assignor_get_metadata;
+                }
 		else {
 			rd_snprintf(errstr, errstr_size,
 				    "Unsupported partition.assignment.strategy:"
@@ -529,6 +624,31 @@ int rd_kafka_assignors_init (rd_kafka_t *rk, char *errstr, size_t errstr_size) {
 		}
 
 		if (rkas) {
+                        const rd_kafka_assignor_t *first =
+                                rd_list_elem(&rk->rk_conf.
+                                             partition_assignors, 0);
+
+                        /* The group can only rebalance with one protocol:
+                         * switching between eager and cooperative
+                         * assignors requires a full restart of all
+                         * members, not a rolling one. */
+                        if (first->rkas_protocol != rkas->rkas_protocol) {
+                                rd_snprintf(errstr, errstr_size,
+                                            "All partition.assignment."
+                                            "strategy assignors must have "
+                                            "the same rebalance protocol: "
+                                            "%s (%s) can't be combined "
+                                            "with %.*s (%s)",
+                                            s,
+                                            rd_kafka_rebalance_protocol2str(
+                                                    rkas->rkas_protocol),
+                                            RD_KAFKAP_STR_PR(first->
+                                                             rkas_protocol_name),
+                                            rd_kafka_rebalance_protocol2str(
+                                                    first->rkas_protocol));
+                                return -1;
+                        }
+
 			if (!rkas->rkas_enabled) {
 				rkas->rkas_enabled = 1;
 				rk->rk_conf.enabled_assignor_cnt++;
@@ -29,10 +29,32 @@
 #define _RDKAFKA_ASSIGNOR_H_
 
 
+/**
+ * @brief Rebalance protocol of an assignor.
+ *
+ * EAGER assignors revoke the entire assignment of all members before
+ * the group is rebalanced, COOPERATIVE assignors only revoke the
+ * partitions that move to another member (KIP-429).
+ */
+typedef enum rd_kafka_rebalance_protocol_t {
+        RD_KAFKA_REBALANCE_PROTOCOL_NONE,        /**< Not in a group */
+        RD_KAFKA_REBALANCE_PROTOCOL_EAGER,       /**< Eager rebalancing */
+        RD_KAFKA_REBALANCE_PROTOCOL_COOPERATIVE  /**< Incremental
+                                                  *   cooperative
+                                                  *   rebalancing */
+} rd_kafka_rebalance_protocol_t;
+
+const char *
+rd_kafka_rebalance_protocol2str (rd_kafka_rebalance_protocol_t protocol);
+
 
 typedef struct rd_kafka_group_member_s {
         rd_kafka_topic_partition_list_t *rkgm_subscription;
         rd_kafka_topic_partition_list_t *rkgm_assignment;
+        rd_kafka_topic_partition_list_t *rkgm_owned; /**< Owned partitions
+                                                      *   (MemberMetadata
+                                                      *   v1), may be
+                                                      *   NULL. */
         rd_list_t                        rkgm_eligible;
         rd_kafkap_str_t                 *rkgm_member_id;
         rd_kafkap_bytes_t               *rkgm_userdata;
@@ -70,6 +92,8 @@ typedef struct rd_kafka_assignor_s {
 
 	int                rkas_enabled;
 
+        rd_kafka_rebalance_protocol_t rkas_protocol;
+
         rd_kafka_resp_err_t (*rkas_assign_cb) (
                 rd_kafka_t *rk,
                 const char *member_id,
@@ -85,7 +109,9 @@ typedef struct rd_kafka_assignor_s {
 
         rd_kafkap_bytes_t *(*rkas_get_metadata_cb) (
                 struct rd_kafka_assignor_s *rkpas,
-		const rd_list_t *topics);
+		const rd_list_t *topics,
+                const rd_kafka_topic_partition_list_t *owned_partitions,
+                int32_t owned_generation_id);
 
 
         void (*rkas_on_assignment_cb) (const char *member_id,
@@ -96,9 +122,20 @@ typedef struct rd_kafka_assignor_s {
 } rd_kafka_assignor_t;
 
 
+rd_kafkap_bytes_t *
+rd_kafka_consumer_protocol_member_metadata_new (const rd_list_t *topics,
+                                                const void *userdata,
+                                                size_t userdata_size,
+                                                const
+                                                rd_kafka_topic_partition_list_t
+                                                *owned_partitions);
+
 rd_kafkap_bytes_t *
 rd_kafka_assignor_get_metadata (rd_kafka_assignor_t *rkpas,
-				const rd_list_t *topics);
+				const rd_list_t *topics,
+                                const rd_kafka_topic_partition_list_t
+                                *owned_partitions,
+                                int32_t owned_generation_id);
 
 
 void rd_kafka_assignor_update_subscription (rd_kafka_assignor_t *rkpas,
@@ -156,4 +193,50 @@ rd_kafka_roundrobin_assignor_assign_cb (rd_kafka_t *rk,
 					char *errstr, size_t errstr_size,
 					void *opaque);
 
+
+/**
+ * rd_kafka_sticky_assignor.c
+ */
+rd_kafka_resp_err_t
+rd_kafka_sticky_assignor_assign_cb (rd_kafka_t *rk,
+                                    const char *member_id,
+                                    const char *protocol_name,
+                                    const rd_kafka_metadata_t *metadata,
+                                    rd_kafka_group_member_t *members,
+                                    size_t member_cnt,
+                                    rd_kafka_assignor_topic_t
+                                    **eligible_topics,
+                                    size_t eligible_topic_cnt,
+                                    char *errstr, size_t errstr_size,
+                                    void *opaque);
+
+rd_kafkap_bytes_t *
+rd_kafka_sticky_assignor_get_metadata (rd_kafka_assignor_t *rkas,
+                                       const rd_list_t *topics,
+                                       const rd_kafka_topic_partition_list_t
+                                       *owned_partitions,
+                                       int32_t owned_generation_id);
+
+rd_kafka_resp_err_t
+rd_kafka_cooperative_sticky_assignor_assign_cb (
+        rd_kafka_t *rk,
+        const char *member_id,
+        const char *protocol_name,
+        const rd_kafka_metadata_t *metadata,
+        rd_kafka_group_member_t *members,
+        size_t member_cnt,
+        rd_kafka_assignor_topic_t **eligible_topics,
+        size_t eligible_topic_cnt,
+        char *errstr, size_t errstr_size,
+        void *opaque);
+
+rd_kafkap_bytes_t *
+rd_kafka_cooperative_sticky_assignor_get_metadata (
+        rd_kafka_assignor_t *rkas,
+        const rd_list_t *topics,
+        const rd_kafka_topic_partition_list_t *owned_partitions,
+        int32_t owned_generation_id);
+
+int unittest_sticky_assignor (void);
+
 #endif /* _RDKAFKA_ASSIGNOR_H_ */
@@ -60,10 +60,14 @@
 #include "rdkafka_request.h"
 #include "rdkafka_sasl.h"
 #include "rdkafka_interceptor.h"
+#include "rdkafka_idempotence.h"
+#include "rdkafka_reactor.h"
+#include "rdkafka_decompress.h"
 #include "rdtime.h"
 #include "rdcrc32.h"
 #include "rdrand.h"
 #include "rdkafka_lz4.h"
+#include "rdunittest.h"
 #if WITH_SSL
 #include <openssl/err.h>
 #endif
@@ -303,6 +307,107 @@ int rd_kafka_broker_get_state (rd_kafka_broker_t *rkb) {
 }
 
 
+/**
+ * @brief Fetch session partition comparator (by rktp).
+ */
+static int rd_kafka_fetch_session_toppar_cmp (const void *_a, const void *_b) {
+        const rd_kafka_fetch_session_toppar_t *a = _a, *b = _b;
+        return rd_list_cmp_ptr(a->rkfst_rktp, b->rkfst_rktp);
+}
+
+
+/**
+ * @returns the fetch session partition for \p rktp, or NULL if \p rktp
+ *          is not in the broker's fetch session.
+ *
+ * @locality broker thread
+ */
+static rd_kafka_fetch_session_toppar_t *
+rd_kafka_broker_fetch_session_toppar_find (rd_kafka_broker_t *rkb,
+                                           rd_kafka_toppar_t *rktp) {
+        rd_kafka_fetch_session_toppar_t skel = { .rkfst_rktp = rktp };
+        return RD_AVL_FIND(&rkb->rkb_fetch_session.avl, &skel);
+}
+
+
+/**
+ * @brief Remove \p rkfst from the broker's fetch session and free it.
+ *        If \p forget is true the partition is forgotten by the broker
+ *        with the next FetchRequest.
+ *
+ * @locality broker thread
+ */
+static void
+rd_kafka_broker_fetch_session_toppar_remove (rd_kafka_broker_t *rkb,
+                                             rd_kafka_fetch_session_toppar_t
+                                             *rkfst,
+                                             int forget) {
+        RD_AVL_REMOVE_ELM(&rkb->rkb_fetch_session.avl, rkfst);
+        TAILQ_REMOVE(&rkb->rkb_fetch_session.toppars, rkfst, rkfst_link);
+        rkb->rkb_fetch_session.toppar_cnt--;
+
+        if (forget)
+                rd_list_add(&rkb->rkb_fetch_session.forgotten,
+                            rkfst->rkfst_s_rktp);
+        else
+                rd_kafka_toppar_destroy(rkfst->rkfst_s_rktp);
+        rd_free(rkfst);
+}
+
+
+/**
+ * @brief Reset the broker's fetch session (KIP-227): the next FetchRequest
+ *        will be a full fetch request that closes the current session,
+ *        if any, and creates a new one.
+ *
+ * @locality broker thread
+ */
+static void rd_kafka_broker_fetch_session_reset (rd_kafka_broker_t *rkb,
+                                                 const char *reason) {
+        rd_kafka_fetch_session_toppar_t *rkfst;
+        shptr_rd_kafka_toppar_t *s_rktp;
+        int i;
+
+        if (rkb->rkb_fetch_session.epoch == 0 &&
+            rkb->rkb_fetch_session.toppar_cnt == 0 &&
+            rd_list_cnt(&rkb->rkb_fetch_session.forgotten) == 0)
+                return;
+
+        rd_rkb_dbg(rkb, FETCH, "FETCHSESS",
+                   "Resetting fetch session %"PRId32" at epoch %"PRId32
+                   " with %d partition(s): %s",
+                   rkb->rkb_fetch_session.id, rkb->rkb_fetch_session.epoch,
+                   rkb->rkb_fetch_session.toppar_cnt, reason);
+
+        while ((rkfst = TAILQ_FIRST(&rkb->rkb_fetch_session.toppars)))
+                rd_kafka_broker_fetch_session_toppar_remove(rkb, rkfst,
+                                                            0/*destroy*/);
+
+        RD_LIST_FOREACH(s_rktp, &rkb->rkb_fetch_session.forgotten, i)
+                rd_kafka_toppar_destroy(s_rktp);
+        rd_list_clear(&rkb->rkb_fetch_session.forgotten);
+
+        rkb->rkb_fetch_session.epoch = 0;
+        rd_atomic64_add(&rkb->rkb_c.fetch_session_resets, 1);
+}
+
+
+/**
+ * @brief Remove \p rktp from the broker's fetch session, it will be
+ *        forgotten by the broker with the next FetchRequest.
+ *
+ * @locality broker thread
+ */
+static void rd_kafka_broker_fetch_session_toppar_del (rd_kafka_broker_t *rkb,
+                                                      rd_kafka_toppar_t *rktp) {
+        rd_kafka_fetch_session_toppar_t *rkfst;
+
+        if ((rkfst = rd_kafka_broker_fetch_session_toppar_find(rkb, rktp)))
+                rd_kafka_broker_fetch_session_toppar_remove(rkb, rkfst,
+                                                            1/*forget*/);
+}
+
+
 /**
  * Failure propagation to application.
  * Will tear down connection to broker and trigger a reconnect.
@@ -332,12 +437,28 @@ void rd_kafka_broker_fail (rd_kafka_broker_t *rkb,
 	rkb->rkb_err.err = errno_save;
 
 	if (rkb->rkb_transport) {
+                /* MSG_ZEROCOPY completions can't be read once the
+                 * socket is closed. */
+                rd_kafka_transport_zerocopy_drain(
+                        rkb->rkb_transport,
+                        RD_KAFKA_TRANSPORT_ZEROCOPY_DRAIN_MS);
+
 		rd_kafka_transport_close(rkb->rkb_transport);
 		rkb->rkb_transport = NULL;
+                /* Closing the socket implicitly removed it from
+                 * the reactor's poll set, if any. */
+                rkb->rkb_reactor_sfd = -1;
 	}
 
+        /* The sends have completed or been discarded along with
+         * the socket's send queue: release the held requests. */
+        rd_kafka_broker_zerocopy_serve(rkb);
+
 	rkb->rkb_req_timeouts = 0;
 
+        /* The outcome of an outstanding FetchRequest is unknown. */
+        rd_kafka_broker_fetch_session_reset(rkb, rd_kafka_err2str(err));
+
 	if (rkb->rkb_recv_buf) {
 		rd_kafka_buf_destroy(rkb->rkb_recv_buf);
 		rkb->rkb_recv_buf = NULL;
@@ -429,6 +550,7 @@ void rd_kafka_broker_fail (rd_kafka_broker_t *rkb,
 	rd_kafka_bufq_init(&tmpq_waitresp);
 	rd_kafka_bufq_init(&tmpq);
 	rd_kafka_bufq_concat(&tmpq_waitresp, &rkb->rkb_waitresps);
+        rd_kafka_corridmap_clear(&rkb->rkb_waitresp_map);
 	rd_kafka_bufq_concat(&tmpq, &rkb->rkb_outbufs);
         rd_atomic32_init(&rkb->rkb_blocking_request_cnt, 0);
 
@@ -522,6 +644,51 @@ void rd_kafka_broker_conn_closed (rd_kafka_broker_t *rkb,
 
 
 
+/**
+ * @brief Put sent \p rkbuf on the wait-response queue.
+ *
+ * The queue is kept ordered by request timeout so that the timeout scan
+ * can stop at the first non-expired buffer. Requests are mostly sent in
+ * timeout order so the insert position is normally found at the tail.
+ * Buffers with equal timeouts retain their send order.
+ *
+ * @locality broker thread
+ */
+static void rd_kafka_broker_waitresp_enq (rd_kafka_broker_t *rkb,
+                                          rd_kafka_buf_t *rkbuf) {
+        rd_kafka_buf_t *prev;
+
+        TAILQ_FOREACH_REVERSE(prev, &rkb->rkb_waitresps.rkbq_bufs,
+                              rd_kafka_buf_head_s, rkbuf_link)
+                if (prev->rkbuf_ts_timeout <= rkbuf->rkbuf_ts_timeout)
+                        break;
+
+        if (prev)
+                TAILQ_INSERT_AFTER(&rkb->rkb_waitresps.rkbq_bufs,
+                                   prev, rkbuf, rkbuf_link);
+        else
+                TAILQ_INSERT_HEAD(&rkb->rkb_waitresps.rkbq_bufs,
+                                  rkbuf, rkbuf_link);
+
+        (void)rd_atomic32_add(&rkb->rkb_waitresps.rkbq_cnt, 1);
+        (void)rd_atomic32_add(&rkb->rkb_waitresps.rkbq_msg_cnt,
+                              rkbuf->rkbuf_msgq.rkmq_msg_cnt);
+
+        rd_kafka_corridmap_insert(&rkb->rkb_waitresp_map, rkbuf);
+}
+
+/**
+ * @brief Remove \p rkbuf from the wait-response queue.
+ *
+ * @locality broker thread
+ */
+static void rd_kafka_broker_waitresp_deq (rd_kafka_broker_t *rkb,
+                                          rd_kafka_buf_t *rkbuf) {
+        rd_kafka_corridmap_remove(&rkb->rkb_waitresp_map, rkbuf);
+        rd_kafka_bufq_deq(&rkb->rkb_waitresps, rkbuf);
+}
+
+
 /**
  * Scan bufq for buffer timeouts, trigger buffer callback on timeout.
  *
@@ -543,8 +710,13 @@ static int rd_kafka_broker_bufq_timeout_scan (rd_kafka_broker_t *rkb,
 
 	TAILQ_FOREACH_SAFE(rkbuf, &rkbq->rkbq_bufs, rkbuf_link, tmp) {
 
-		if (likely(now && rkbuf->rkbuf_ts_timeout > now))
+		if (likely(now && rkbuf->rkbuf_ts_timeout > now)) {
+                        /* The wait-response queue is ordered by
+                         * timeout: no later buffer can have expired. */
+                        if (is_waitresp_q)
+                                break;
 			continue;
+                }
 
                 if (partial_cntp && rd_slice_offset(&rkbuf->rkbuf_reader) > 0)
                         (*partial_cntp)++;
@@ -555,7 +727,10 @@ static int rd_kafka_broker_bufq_timeout_scan (rd_kafka_broker_t *rkb,
 		else
 			rkbuf->rkbuf_ts_sent = now - rkbuf->rkbuf_ts_enq;
 
-		rd_kafka_bufq_deq(rkbq, rkbuf);
+		if (is_waitresp_q)
+                        rd_kafka_broker_waitresp_deq(rkb, rkbuf);
+                else
+                        rd_kafka_bufq_deq(rkbq, rkbuf);
 
 		if (is_waitresp_q && rkbuf->rkbuf_flags & RD_KAFKA_OP_F_BLOCKING
 		    && rd_atomic32_sub(&rkb->rkb_blocking_request_cnt, 1) == 0)
@@ -637,15 +812,20 @@ static void rd_kafka_broker_timeout_scan (rd_kafka_broker_t *rkb, rd_ts_t now) {
 
 
 static ssize_t
-rd_kafka_broker_send (rd_kafka_broker_t *rkb, rd_slice_t *slice) {
+rd_kafka_broker_send (rd_kafka_broker_t *rkb, rd_slice_t *slice,
+                      int zerocopy) {
 	ssize_t r;
 	char errstr[128];
 
 	rd_kafka_assert(rkb->rkb_rk, rkb->rkb_state >= RD_KAFKA_BROKER_STATE_UP);
 	rd_kafka_assert(rkb->rkb_rk, rkb->rkb_transport);
 
-        r = rd_kafka_transport_send(rkb->rkb_transport, slice,
-                                    errstr, sizeof(errstr));
+        if (zerocopy)
+                r = rd_kafka_transport_send_zerocopy(rkb->rkb_transport, slice,
+                                                     errstr, sizeof(errstr));
+        else
+                r = rd_kafka_transport_send(rkb->rkb_transport, slice,
+                                            errstr, sizeof(errstr));
 
 	if (r == -1) {
 		rd_kafka_broker_fail(rkb, LOG_ERR, RD_KAFKA_RESP_ERR__TRANSPORT,
@@ -1235,26 +1415,23 @@ rd_kafka_broker_t *rd_kafka_broker_controller (rd_kafka_t *rk, int state,
 static rd_kafka_buf_t *rd_kafka_waitresp_find (rd_kafka_broker_t *rkb,
 					       int32_t corrid) {
 	rd_kafka_buf_t *rkbuf;
-	rd_ts_t now = rd_clock();
 
 	rd_kafka_assert(rkb->rkb_rk, thrd_is_current(rkb->rkb_thread));
 
-	TAILQ_FOREACH(rkbuf, &rkb->rkb_waitresps.rkbq_bufs, rkbuf_link)
-		if (rkbuf->rkbuf_corrid == corrid) {
-			/* Convert ts_sent to RTT */
-			rkbuf->rkbuf_ts_sent = now - rkbuf->rkbuf_ts_sent;
-			rd_avg_add(&rkb->rkb_avg_rtt, rkbuf->rkbuf_ts_sent);
+        rkbuf = rd_kafka_corridmap_find(&rkb->rkb_waitresp_map, corrid);
+        if (!rkbuf)
+                return NULL;
 
-                        if (rkbuf->rkbuf_flags & RD_KAFKA_OP_F_BLOCKING &&
-			    rd_atomic32_sub(&rkb->rkb_blocking_request_cnt,
-					    1) == 1)
-				rd_kafka_brokers_broadcast_state_change(
-					rkb->rkb_rk);
+        /* Convert ts_sent to RTT */
+        rkbuf->rkbuf_ts_sent = rd_clock() - rkbuf->rkbuf_ts_sent;
+        rd_avg_add(&rkb->rkb_avg_rtt, rkbuf->rkbuf_ts_sent);
 
-			rd_kafka_bufq_deq(&rkb->rkb_waitresps, rkbuf);
-			return rkbuf;
-		}
-	return NULL;
+        if (rkbuf->rkbuf_flags & RD_KAFKA_OP_F_BLOCKING &&
+            rd_atomic32_sub(&rkb->rkb_blocking_request_cnt, 1) == 1)
+                rd_kafka_brokers_broadcast_state_change(rkb->rkb_rk);
+
+        rd_kafka_broker_waitresp_deq(rkb, rkbuf);
+        return rkbuf;
 }
 
 
@@ -1333,7 +1510,8 @@ int rd_kafka_recv (rd_kafka_broker_t *rkb) {
 	if (!(rkbuf = rkb->rkb_recv_buf)) {
 		/* No receive in progress: create new buffer */
 
-                rkbuf = rd_kafka_buf_new(2, RD_KAFKAP_RESHDR_SIZE);
+                rkbuf = rd_kafka_buf_new0(2, RD_KAFKAP_RESHDR_SIZE, 0,
+                                          rkb->rkb_rk->rk_bufpool);
 
 		rkb->rkb_recv_buf = rkbuf;
 
@@ -1923,6 +2101,10 @@ int rd_kafka_send (rd_kafka_broker_t *rkb) {
 			rd_kafka_buf_update_i32(rkbuf, 4+2+2,
 						rkbuf->rkbuf_corrid);
 			rkbuf->rkbuf_connid = rkb->rkb_connid;
+                        /* Nothing sent on this connection yet */
+                        rkbuf->rkbuf_zc_id =
+                                rd_kafka_transport_zerocopy_id(
+                                        rkb->rkb_transport);
 		} else if (pre_of > RD_KAFKAP_REQHDR_SIZE) {
 			rd_kafka_assert(NULL,
 					rkbuf->rkbuf_connid == rkb->rkb_connid);
@@ -1938,9 +2120,16 @@ int rd_kafka_send (rd_kafka_broker_t *rkb) {
                                    pre_of, rd_slice_size(&rkbuf->rkbuf_reader));
 		}
 
-                if ((r = rd_kafka_broker_send(rkb, &rkbuf->rkbuf_reader)) == -1)
+                if ((r = rd_kafka_broker_send(rkb, &rkbuf->rkbuf_reader,
+                                              rkbuf->rkbuf_flags &
+                                              RD_KAFKA_OP_F_ZEROCOPY)) == -1)
                         return -1;
 
+                if (rkbuf->rkbuf_flags & RD_KAFKA_OP_F_ZEROCOPY)
+                        rkbuf->rkbuf_zc_id =
+                                rd_kafka_transport_zerocopy_id(
+                                        rkb->rkb_transport);
+
                 now = rd_clock();
                 rkb->rkb_ts_tx_last = now;
 
@@ -1990,10 +2179,9 @@ int rd_kafka_send (rd_kafka_broker_t *rkb) {
 		/* Put buffer on response wait list unless we are not
 		 * expecting a response (required_acks=0). */
 		if (!(rkbuf->rkbuf_flags & RD_KAFKA_OP_F_NO_RESPONSE))
-			rd_kafka_bufq_enq(&rkb->rkb_waitresps, rkbuf);
-		else { /* Call buffer callback for delivery report. */
+			rd_kafka_broker_waitresp_enq(rkb, rkbuf);
+                else /* Call buffer callback for delivery report. */
                         rd_kafka_buf_callback(rkb->rkb_rk, rkb, 0, NULL, rkbuf);
-                }
 
 		cnt++;
 	}
@@ -2002,6 +2190,68 @@ int rd_kafka_send (rd_kafka_broker_t *rkb) {
 }
 
 
+/**
+ * @brief Hold the done \p request, with its \p err and \p response,
+ *        if it was sent with MSG_ZEROCOPY on the current connection
+ *        and the kernel may still read its memory, whatever the
+ *        request's acks: a timed out or failed request may still be
+ *        in flight.
+ *
+ *        The request's callback (delivery report, retry) and destruction
+ *        are deferred until its sends have completed, see
+ *        rd_kafka_broker_zerocopy_serve().
+ *
+ * @returns true if the request is held.
+ *
+ * @locality any, only held in the broker thread
+ */
+rd_bool_t rd_kafka_broker_zerocopy_hold (rd_kafka_broker_t *rkb,
+                                         rd_kafka_resp_err_t err,
+                                         rd_kafka_buf_t *response,
+                                         rd_kafka_buf_t *request) {
+        if (!thrd_is_current(rkb->rkb_thread) ||
+            !rkb->rkb_transport ||
+            request->rkbuf_connid != rkb->rkb_connid ||
+            rd_kafka_transport_zerocopy_done(rkb->rkb_transport,
+                                             request->rkbuf_zc_id))
+                return rd_false;
+
+        request->rkbuf_zc_err = err;
+        request->rkbuf_zc_response = response;
+        rd_kafka_bufq_enq(&rkb->rkb_zc_waitcompl, request);
+
+        return rd_true;
+}
+
+
+/**
+ * @brief Serve the callbacks of requests that were held until their
+ *        MSG_ZEROCOPY sends completed, or all of them if the connection
+ *        is closed.
+ *
+ * @locality broker thread
+ */
+void rd_kafka_broker_zerocopy_serve (rd_kafka_broker_t *rkb) {
+        rd_kafka_buf_t *rkbuf, *tmp;
+
+        /* Requests are held in the order they are done, not sent. */
+        TAILQ_FOREACH_SAFE(rkbuf, &rkb->rkb_zc_waitcompl.rkbq_bufs,
+                           rkbuf_link, tmp) {
+                rd_kafka_buf_t *response = rkbuf->rkbuf_zc_response;
+
+                if (rkb->rkb_transport &&
+                    !rd_kafka_transport_zerocopy_done(rkb->rkb_transport,
+                                                      rkbuf->rkbuf_zc_id))
+                        continue;
+
+                rd_kafka_bufq_deq(&rkb->rkb_zc_waitcompl, rkbuf);
+                rkbuf->rkbuf_zc_response = NULL;
+                rd_kafka_buf_callback(rkb->rkb_rk, rkb, rkbuf->rkbuf_zc_err,
+                                      response, rkbuf);
+        }
+}
+
+
 /**
  * Add 'rkbuf' to broker 'rkb's retry queue.
  */
@@ -2294,6 +2544,11 @@ static int rd_kafka_broker_op_serve (rd_kafka_broker_t *rkb,
                 rko->rko_u.xbuf.rkbuf = NULL;
                 break;
 
+        case RD_KAFKA_OP_COMPRESS:
+                /* MessageSet compressed by the compression pool */
+                rd_kafka_ProduceRequest_compressed(rkb, rko);
+                break;
+
         case RD_KAFKA_OP_PARTITION_JOIN:
                 /*
 		 * Add partition to broker toppars
@@ -2356,7 +2611,7 @@ static int rd_kafka_broker_op_serve (rd_kafka_broker_t *rkb,
 		rkb->rkb_toppar_cnt++;
                 rd_kafka_broker_unlock(rkb);
 		rktp->rktp_leader = rkb;
-                rktp->rktp_msgq_wakeup_fd = rkb->rkb_toppar_wakeup_fd;
+                rktp->rktp_msgq_wakeup = rkb->rkb_toppar_wakeup;
                 rd_kafka_broker_keep(rkb);
 
                 if (rkb->rkb_rk->rk_type == RD_KAFKA_PRODUCER)
@@ -2397,6 +2652,7 @@ static int rd_kafka_broker_op_serve (rd_kafka_broker_t *rkb,
 
 		/* Remove from fetcher list */
 		rd_kafka_toppar_fetch_decide(rktp, rkb, 1/*force remove*/);
+                rd_kafka_broker_fetch_session_toppar_del(rkb, rktp);
 
 		rd_kafka_toppar_lock(rktp);
 
@@ -2411,6 +2667,7 @@ static int rd_kafka_broker_op_serve (rd_kafka_broker_t *rkb,
 
                 /* Insert xmitq(broker-local) messages to the msgq(global)
                  * at their sorted position to maintain ordering. */
+                rd_kafka_toppar_msgq_intake_drain(rktp);
                 rd_kafka_msgq_insert_msgq(&rktp->rktp_msgq,
                                           &rktp->rktp_xmit_msgq,
                                           rktp->rktp_rkt->rkt_conf.
@@ -2424,7 +2681,7 @@ static int rd_kafka_broker_op_serve (rd_kafka_broker_t *rkb,
 		rkb->rkb_toppar_cnt--;
                 rd_kafka_broker_unlock(rkb);
                 rd_kafka_broker_destroy(rktp->rktp_leader);
-                rktp->rktp_msgq_wakeup_fd = -1;
+                rktp->rktp_msgq_wakeup = NULL;
 		rktp->rktp_leader = NULL;
 
                 /* Need to hold on to a refcount past q_enq() and
@@ -2528,6 +2785,28 @@ static void rd_kafka_broker_serve (rd_kafka_broker_t *rkb,
         int initial_state = rkb->rkb_state;
         int remains_ms = rd_timeout_remains(abs_timeout);
 
+        if (rkb->rkb_reactor) {
+                /* Shared reactor thread: serve whatever is ready
+                 * without blocking and let the reactor wait for
+                 * events or the (capped) timeout instead. */
+                rd_kafka_broker_ops_serve(rkb, RD_POLL_NOWAIT);
+
+                if (likely(rkb->rkb_transport != NULL))
+                        rd_kafka_transport_io_serve(rkb->rkb_transport, 0);
+
+                now = rd_clock();
+                if (rd_interval(&rkb->rkb_timeout_scan_intvl,
+                                1000000, now) > 0)
+                        rd_kafka_broker_timeout_scan(rkb, now);
+
+                rkb->rkb_reactor_next = now +
+                        ((rd_ts_t)rkb->rkb_blocking_max_ms * 1000);
+                if (abs_timeout != RD_POLL_INFINITE &&
+                    abs_timeout < rkb->rkb_reactor_next)
+                        rkb->rkb_reactor_next = abs_timeout;
+                return;
+        }
+
         /* Serve broker ops */
         if (rd_kafka_broker_ops_serve(rkb,
                                       !rkb->rkb_transport ?
@@ -2595,6 +2874,7 @@ static rd_ts_t rd_kafka_broker_toppars_serve (rd_kafka_broker_t *rkb) {
  */
 static void rd_kafka_broker_ua_idle (rd_kafka_broker_t *rkb, int timeout_ms) {
         int initial_state = rkb->rkb_state;
+        rd_bool_t carry_over = timeout_ms != RD_POLL_INFINITE;
         rd_ts_t abs_timeout;
 
         if (rd_kafka_terminating(rkb->rkb_rk))
@@ -2604,6 +2884,24 @@ static void rd_kafka_broker_ua_idle (rd_kafka_broker_t *rkb, int timeout_ms) {
 
         abs_timeout = rd_timeout_init(timeout_ms);
 
+        if (rkb->rkb_reactor) {
+                /* Shared reactor thread: a single pass, a finite
+                 * idle period is resumed by the next
+                 * rd_kafka_broker_reactor_serve() step until it
+                 * expires or the state changes. */
+                rd_kafka_broker_toppars_serve(rkb);
+                rd_kafka_broker_serve(rkb, abs_timeout);
+
+                if (carry_over && !rd_kafka_broker_terminating(rkb) &&
+                    (int)rkb->rkb_state == initial_state &&
+                    !rd_timeout_expired(rd_timeout_remains(abs_timeout))) {
+                        rkb->rkb_reactor_idle_until = abs_timeout;
+                        rkb->rkb_reactor_idle_state = initial_state;
+                } else
+                        rkb->rkb_reactor_idle_until = 0;
+                return;
+        }
+
         /* Since ua_idle is used during connection setup
          * in state ..BROKER_STATE_CONNECT we only run this loop
          * as long as the state remains the same as the initial, on a state
@@ -2626,35 +2924,104 @@ static void rd_kafka_broker_ua_idle (rd_kafka_broker_t *rkb, int timeout_ms) {
  * @locality broker thread
  * @locks none
  */
-static void rd_kafka_broker_toppar_msgq_scan (rd_kafka_broker_t *rkb,
-                                              rd_kafka_toppar_t *rktp,
-                                              rd_ts_t now) {
+static int rd_kafka_broker_toppar_msgq_scan (rd_kafka_broker_t *rkb,
+                                             rd_kafka_toppar_t *rktp,
+                                             rd_ts_t now) {
         rd_kafka_msgq_t timedout = RD_KAFKA_MSGQ_INITIALIZER(timedout);
+        int cnt;
 
-        if (rd_kafka_msgq_age_scan(&rktp->rktp_xmit_msgq, &timedout, now)) {
+        if ((cnt = rd_kafka_msgq_age_scan(&rktp->rktp_xmit_msgq,
+                                          &timedout, now))) {
                 /* Trigger delivery report for timed out messages */
                 rd_kafka_dr_msgq(rktp->rktp_rkt, &timedout,
                                  RD_KAFKA_RESP_ERR__MSG_TIMED_OUT);
         }
+
+        return cnt;
+}
+
+/**
+ * @brief Idempotent producer checks prior to producing for \p rktp.
+ *
+ *        Rebases the partition's message sequence on a PID change,
+ *        which is only done when the partition has no in-flight
+ *        requests, and honours the partition's wait_drain flag.
+ *
+ * @returns true if messages may be produced for the partition, else false.
+ *
+ * @locks toppar_lock(rktp) MUST be held.
+ * @locality broker thread
+ */
+static rd_bool_t
+rd_kafka_toppar_producer_serve_idemp (rd_kafka_broker_t *rkb,
+                                      rd_kafka_toppar_t *rktp,
+                                      const rd_kafka_pid_t pid) {
+        rd_kafka_msg_t *rkm;
+        int inflight;
+
+        if (unlikely(!rd_kafka_pid_valid(pid)))
+                return rd_false; /* No PID yet or PID is being reset. */
+
+        inflight = rd_atomic32_get(&rktp->rktp_msgs_inflight);
+
+        if (likely(rd_kafka_pid_eq(pid, rktp->rktp_eos.pid)))
+                return !rktp->rktp_eos.wait_drain || inflight == 0;
+
+        if (inflight > 0) {
+                /* Wait for requests using the previous PID
+                 * to finish before rebasing the sequence. */
+                rd_rkb_dbg(rkb, EOS, "NEWPID",
+                           "%.*s [%"PRId32"] waiting for %d in-flight "
+                           "message(s) to drain before switching to "
+                           "ProducerId %"PRId64" epoch %hd",
+                           RD_KAFKAP_STR_PR(rktp->rktp_rkt->rkt_topic),
+                           rktp->rktp_partition, inflight,
+                           pid.id, pid.epoch);
+                return rd_false;
+        }
+
+        /* The first message in the transmit queue, or the next message
+         * to be enqueued, will get BaseSequence 0 for the new PID. */
+        if ((rkm = TAILQ_FIRST(&rktp->rktp_xmit_msgq.rkmq_msgs)))
+                rktp->rktp_eos.epoch_base_msgseq = rkm->rkm_u.producer.msgseq;
+        else
+                rktp->rktp_eos.epoch_base_msgseq = rktp->rktp_msgseq + 1;
+
+        rktp->rktp_eos.next_ack_msgseq = rktp->rktp_eos.epoch_base_msgseq;
+        rktp->rktp_eos.pid = pid;
+        rktp->rktp_eos.wait_drain = rd_false;
+
+        rd_rkb_dbg(rkb, EOS, "NEWPID",
+                   "%.*s [%"PRId32"] using ProducerId %"PRId64" epoch %hd "
+                   "with base msgseq %"PRIu64,
+                   RD_KAFKAP_STR_PR(rktp->rktp_rkt->rkt_topic),
+                   rktp->rktp_partition, pid.id, pid.epoch,
+                   rktp->rktp_eos.epoch_base_msgseq);
+
+        return rd_true;
 }
 
+
 /**
  * @brief Serve a toppar for producing.
  *
+ * @param pid the Idempotent Producer's current PID, or an invalid PID
+ *            if the idempotent producer is not enabled.
  * @param next_wakeup will be updated to when the next wake-up/attempt is
  *                    desired, only lower (sooner) values will be set.
  *
- * @returns the number of messages produced.
+ * @returns true if the partition's transmit queue has messages ready to
+ *          be sent, which is done by rd_kafka_broker_produce_toppars().
  *
- * @locks toppar_lock(rktp) MUST be held.
+ * @locks toppar_lock(rktp) MUST NOT be held.
  * @locality broker thread
  */
-static int rd_kafka_toppar_producer_serve (rd_kafka_broker_t *rkb,
-                                           rd_kafka_toppar_t *rktp,
-                                           rd_ts_t now,
-                                           rd_ts_t *next_wakeup,
-                                           int do_timeout_scan) {
-        int cnt = 0;
+static rd_bool_t rd_kafka_toppar_producer_serve (rd_kafka_broker_t *rkb,
+                                                 rd_kafka_toppar_t *rktp,
+                                                 const rd_kafka_pid_t pid,
+                                                 rd_ts_t now,
+                                                 rd_ts_t *next_wakeup,
+                                                 int do_timeout_scan) {
         int r;
         rd_kafka_msg_t *rkm;
         int move_cnt = 0;
@@ -2672,7 +3039,7 @@ static int rd_kafka_toppar_producer_serve (rd_kafka_broker_t *rkb,
         if (unlikely(!do_timeout_scan &&
                      rd_atomic32_get(&rkb->rkb_outbufs.rkbq_cnt) >=
                      rkb->rkb_rk->rk_conf.queue_backpressure_thres))
-                return 0;
+                return rd_false;
 
         rd_kafka_toppar_lock(rktp);
 
@@ -2680,18 +3047,41 @@ static int rd_kafka_toppar_producer_serve (rd_kafka_broker_t *rkb,
                 /* Currently migrating away from this
                  * broker. */
                 rd_kafka_toppar_unlock(rktp);
-                return 0;
+                return rd_false;
         }
 
+        /* Move messages from the lock-free intake queue, if any,
+         * to the partition produce queue. */
+        rd_kafka_toppar_msgq_intake_drain(rktp);
+
         if (unlikely(do_timeout_scan)) {
                 /* Scan xmit queue for msg timeouts */
-                rd_kafka_broker_toppar_msgq_scan(rkb, rktp, now);
+                if (rd_kafka_broker_toppar_msgq_scan(rkb, rktp, now) > 0 &&
+                    rd_kafka_is_idempotent(rkb->rkb_rk)) {
+                        /* Timed out messages leave a gap in the
+                         * partition's sequence which requires a new PID.
+                         * The drain must not be started with the
+                         * toppar lock held. */
+                        rd_kafka_toppar_unlock(rktp);
+                        rd_kafka_idemp_drain_reset(rkb->rkb_rk,
+                                                   "messages timed out in "
+                                                   "transmit queue");
+                        return rd_false;
+                }
         }
 
         if (unlikely(RD_KAFKA_TOPPAR_IS_PAUSED(rktp))) {
                 /* Partition is paused */
                 rd_kafka_toppar_unlock(rktp);
-                return 0;
+                return rd_false;
+        }
+
+        if (rd_atomic32_get(&rktp->rktp_compress_cnt) > 0) {
+                /* Previous MessageSet is still being compressed,
+                 * the broker thread is woken up by the op
+                 * being passed back. */
+                rd_kafka_toppar_unlock(rktp);
+                return rd_false;
         }
 
 
@@ -2703,11 +3093,19 @@ static int rd_kafka_toppar_producer_serve (rd_kafka_broker_t *rkb,
                                           &rktp->rktp_msgq,
                                           rktp->rktp_rkt->rkt_conf.
                                           msg_order_cmp);
+
+        if (rd_kafka_is_idempotent(rkb->rkb_rk) &&
+            !rd_kafka_toppar_producer_serve_idemp(rkb, rktp, pid)) {
+                /* Not ready to produce for this partition */
+                rd_kafka_toppar_unlock(rktp);
+                return rd_false;
+        }
+
         rd_kafka_toppar_unlock(rktp);
 
         r = rktp->rktp_xmit_msgq.rkmq_msg_cnt;
         if (r == 0)
-                return 0;
+                return rd_false;
 
         rd_rkb_dbg(rkb, QUEUE, "TOPPAR",
                    "%.*s [%"PRId32"] %d message(s) in "
@@ -2734,7 +3132,7 @@ static int rd_kafka_toppar_producer_serve (rd_kafka_broker_t *rkb,
                         /* Wait for more messages or queue.buffering.max.ms
                          * to expire. */
                         *next_wakeup = wait_max;
-                        return 0;
+                        return rd_false;
                 }
         }
 
@@ -2742,24 +3140,24 @@ static int rd_kafka_toppar_producer_serve (rd_kafka_broker_t *rkb,
         if (unlikely(rkm->rkm_u.producer.ts_backoff > now)) {
                 *next_wakeup = rkm->rkm_u.producer.ts_backoff;
                 /* Wait for backoff to expire */
-                return 0;
+                return rd_false;
         }
 
-        /* Send Produce requests for this toppar */
-        while (1) {
-                r = rd_kafka_ProduceRequest(rkb, rktp);
-                if (likely(r > 0))
-                        cnt += r;
-                else
-                        break;
-        }
+        return rd_true;
+}
 
-        /* If there are messages still in the queue, make the next
-         * wakeup immediate. */
-        if (rd_kafka_msgq_len(&rktp->rktp_xmit_msgq) > 0)
-                *next_wakeup = now;
 
-        return cnt;
+/**
+ * @brief Toppar comparator for grouping partitions by topic.
+ */
+static int rd_kafka_broker_produce_toppar_cmp (const void *_a,
+                                               const void *_b) {
+        const rd_kafka_toppar_t *a = _a, *b = _b;
+
+        if (a->rktp_rkt != b->rktp_rkt)
+                return a->rktp_rkt < b->rktp_rkt ? -1 : 1;
+
+        return a->rktp_partition - b->rktp_partition;
 }
 
 
@@ -2773,21 +3171,31 @@ static int rd_kafka_broker_produce_toppars (rd_kafka_broker_t *rkb,
                                             rd_ts_t *next_wakeup,
                                             int do_timeout_scan) {
         rd_kafka_toppar_t *rktp;
+        rd_list_t *ready = &rkb->rkb_produce_rktps;
+        rd_list_t rktps;
         int cnt = 0;
+        int i;
         rd_ts_t ret_next_wakeup = *next_wakeup;
+        rd_kafka_pid_t pid = RD_KAFKA_PID_INITIALIZER;
 
         /* Round-robin serve each toppar. */
         rktp = rkb->rkb_active_toppar_next;
         if (unlikely(!rktp))
                 return 0;
 
+        if (rd_kafka_is_idempotent(rkb->rkb_rk)) {
+                /* Get the current PID, if any. */
+                pid = rd_kafka_idemp_get_pid(rkb->rkb_rk);
+        }
+
         do {
                 rd_ts_t this_next_wakeup = ret_next_wakeup;
 
-                /* Try producing toppar */
-                cnt += rd_kafka_toppar_producer_serve(
-                        rkb, rktp, now, &this_next_wakeup,
-                        do_timeout_scan);
+                /* Collect partitions ready to produce */
+                if (rd_kafka_toppar_producer_serve(
+                            rkb, rktp, pid, now, &this_next_wakeup,
+                            do_timeout_scan))
+                        rd_list_add(ready, rktp);
 
                 if (this_next_wakeup < ret_next_wakeup)
                         ret_next_wakeup = this_next_wakeup;
@@ -2797,8 +3205,40 @@ static int rd_kafka_broker_produce_toppars (rd_kafka_broker_t *rkb,
                                            rktp, rktp_activelink)) !=
                  rkb->rkb_active_toppar_next);
 
-        *next_wakeup = ret_next_wakeup;
+        if (rd_list_cnt(ready) == 0) {
+                *next_wakeup = ret_next_wakeup;
+                return 0;
+        }
+
+        /* Pack the ready partitions' MessageSets into as few
+         * multi-partition ProduceRequests as possible, with the
+         * partitions of each topic grouped together.
+         * Each request removes the partitions it drained from
+         * the working list. */
+        rd_list_sort(ready, rd_kafka_broker_produce_toppar_cmp);
+
+        rd_list_init(&rktps, rd_list_cnt(ready), NULL);
+        rd_list_copy_to(&rktps, ready, NULL, NULL);
+
+        while (rd_list_cnt(&rktps) > 0)
+                cnt += rd_kafka_ProduceRequest(rkb, &rktps, pid);
+
+        rd_list_destroy(&rktps);
+
+        /* If there are messages still in the queue, make the next
+         * wakeup immediate.
+         * Only one MessageSet per partition may be in the compression
+         * pool at any time to retain ordering, such partitions are woken
+         * up by the compression op being passed back. */
+        RD_LIST_FOREACH(rktp, ready, i) {
+                if (rd_kafka_msgq_len(&rktp->rktp_xmit_msgq) > 0 &&
+                    rd_atomic32_get(&rktp->rktp_compress_cnt) == 0)
+                        ret_next_wakeup = now;
+        }
 
+        rd_list_clear(ready);
+
+        *next_wakeup = ret_next_wakeup;
 
         return cnt;
 }
@@ -2807,10 +3247,6 @@ static int rd_kafka_broker_produce_toppars (rd_kafka_broker_t *rkb,
  * Producer serving
  */
 static void rd_kafka_broker_producer_serve (rd_kafka_broker_t *rkb) {
-        rd_interval_t timeout_scan;
-
-        rd_interval_init(&timeout_scan);
-
         rd_kafka_assert(rkb->rkb_rk, thrd_is_current(rkb->rkb_thread));
 
 	rd_kafka_broker_lock(rkb);
@@ -2827,8 +3263,8 @@ static void rd_kafka_broker_producer_serve (rd_kafka_broker_t *rkb) {
                 next_wakeup = now + (rkb->rkb_rk->rk_conf.
                                      socket_blocking_max_ms * 1000);
 
-                do_timeout_scan = rd_interval(&timeout_scan, 1000*1000,
-                                              now) >= 0;
+                do_timeout_scan = rd_interval(&rkb->rkb_msg_timeout_scan_intvl,
+                                              1000*1000, now) >= 0;
 
                 rd_kafka_broker_produce_toppars(rkb, now, &next_wakeup,
                                                 do_timeout_scan);
@@ -2842,6 +3278,10 @@ static void rd_kafka_broker_producer_serve (rd_kafka_broker_t *rkb) {
 		rd_kafka_broker_serve(rkb, next_wakeup);
 
 		rd_kafka_broker_lock(rkb);
+
+                /* Reactor: one iteration per step */
+                if (rkb->rkb_reactor)
+                        break;
 	}
 
 	rd_kafka_broker_unlock(rkb);
@@ -2885,6 +3325,118 @@ static void rd_kafka_toppar_fetch_backoff (rd_kafka_broker_t *rkb,
 }
 
 
+/**
+ * @brief Propagate partition error \p err, such as PARTITION_EOF, to the
+ *        application at the current fetch offset.
+ *
+ *        With the decompression pool the error is queued behind the
+ *        partition's outstanding decompression jobs to retain order.
+ *
+ * @locality broker thread
+ */
+static void rd_kafka_toppar_fetch_error (rd_kafka_broker_t *rkb,
+                                         rd_kafka_toppar_t *rktp,
+                                         rd_kafka_resp_err_t err,
+                                         int32_t version) {
+        if (rkb->rkb_rk->rk_decomp_pool)
+                rd_kafka_decomp_enq_err(rktp, err, version,
+                                        rktp->rktp_offsets.fetch_offset);
+        else
+                rd_kafka_q_op_err(rktp->rktp_fetchq,
+                                  RD_KAFKA_OP_CONSUMER_ERR,
+                                  err, version,
+                                  rktp,
+                                  rktp->rktp_offsets.fetch_offset,
+                                  "%s", rd_kafka_err2str(err));
+}
+
+
+/**
+ * @brief Advance the broker's fetch session (KIP-227) after a successful
+ *        FetchResponse with session id \p SessionId.
+ *
+ * @locality broker thread
+ */
+static void rd_kafka_broker_fetch_session_update (rd_kafka_broker_t *rkb,
+                                                  int32_t SessionId) {
+        if (rkb->rkb_fetch_session.epoch == 0) {
+                /* Full fetch: the broker created a new session,
+                 * unless it has no room for it (SessionId 0) in which
+                 * case a new session is requested with the next fetch. */
+                rkb->rkb_fetch_session.id = SessionId;
+                if (SessionId) {
+                        rkb->rkb_fetch_session.epoch = 1;
+                        rd_rkb_dbg(rkb, FETCH, "FETCHSESS",
+                                   "Created fetch session %"PRId32
+                                   " with %d partition(s)",
+                                   SessionId,
+                                   rkb->rkb_fetch_session.toppar_cnt);
+                }
+                return;
+        }
+
+        /* Epochs wrap around to 1 since 0 requests a new session. */
+        if (rkb->rkb_fetch_session.epoch == INT32_MAX)
+                rkb->rkb_fetch_session.epoch = 1;
+        else
+                rkb->rkb_fetch_session.epoch++;
+}
+
+
+/**
+ * @brief Partitions in an incremental fetch session are left out of the
+ *        FetchResponse when there is nothing new for them, which is also
+ *        the case for a partition fetched at its high watermark.
+ *        Signal PARTITION_EOF for such partitions the way a full
+ *        FetchResponse would.
+ *
+ * @locality broker thread
+ */
+static void rd_kafka_broker_fetch_session_eof (rd_kafka_broker_t *rkb,
+                                               rd_kafka_buf_t *request) {
+        struct rd_kafka_toppar_ver *tver;
+        int i;
+
+        RD_LIST_FOREACH(tver, request->rkbuf_rktp_vers, i) {
+                rd_kafka_toppar_t *rktp = rd_kafka_toppar_s2i(tver->s_rktp);
+                int64_t hi_offset;
+                int valid;
+
+                if (tver->seen)
+                        continue;
+
+                rd_kafka_toppar_lock(rktp);
+                valid = rktp->rktp_leader == rkb &&
+                        tver->version >= rktp->rktp_fetch_version;
+                hi_offset = rktp->rktp_hi_offset;
+                rd_kafka_toppar_unlock(rktp);
+
+                if (!valid)
+                        continue;
+
+                /* The high watermark is unchanged since the last
+                 * response for this partition, the offset stats may
+                 * have been reset by a seek since. */
+                rktp->rktp_offsets.hi_offset = hi_offset;
+
+                if (hi_offset != rktp->rktp_offsets.fetch_offset ||
+                    rktp->rktp_offsets.eof_offset ==
+                    rktp->rktp_offsets.fetch_offset)
+                        continue;
+
+                rktp->rktp_offsets.eof_offset =
+                        rktp->rktp_offsets.fetch_offset;
+
+                if (!rkb->rkb_rk->rk_conf.enable_partition_eof)
+                        continue;
+
+                rd_kafka_toppar_fetch_error(rkb, rktp,
+                                            RD_KAFKA_RESP_ERR__PARTITION_EOF,
+                                            tver->version);
+        }
+}
+
+
 /**
  * Parses and handles a Fetch reply.
  * Returns 0 on success or an error code on failure.
@@ -2896,6 +3448,7 @@ rd_kafka_fetch_reply_handle (rd_kafka_broker_t *rkb,
 	int i;
         const int log_decode_errors = LOG_ERR;
         shptr_rd_kafka_itopic_t *s_rkt = NULL;
+        int incremental = 0;
 
 	if (rd_kafka_buf_ApiVersion(request) >= 1) {
 		int32_t Throttle_Time;
@@ -2905,6 +3458,23 @@ rd_kafka_fetch_reply_handle (rd_kafka_broker_t *rkb,
 					  Throttle_Time);
 	}
 
+        if (rd_kafka_buf_ApiVersion(request) >= 7) {
+                int16_t ErrorCode;
+                int32_t SessionId;
+                rd_kafka_buf_read_i16(rkbuf, &ErrorCode);
+                rd_kafka_buf_read_i32(rkbuf, &SessionId);
+
+                if (unlikely(ErrorCode)) {
+                        rd_rkb_dbg(rkb, FETCH, "FETCH",
+                                   "Fetch request failed: %s",
+                                   rd_kafka_err2str(ErrorCode));
+                        return ErrorCode;
+                }
+
+                incremental = rkb->rkb_fetch_session.epoch > 0;
+                rd_kafka_broker_fetch_session_update(rkb, SessionId);
+        }
+
 	rd_kafka_buf_read_i32(rkbuf, &TopicArrayCnt);
 	/* Verify that TopicArrayCnt seems to be in line with remaining size */
 	rd_kafka_buf_check_len(rkbuf,
@@ -2933,6 +3503,7 @@ rd_kafka_fetch_reply_handle (rd_kafka_broker_t *rkb,
                                 int16_t ErrorCode;
                                 int64_t HighwaterMarkOffset;
                                 int64_t LastStableOffset;       /* v4 */
+                                int64_t LogStartOffset;         /* v5 */
                                 int32_t MessageSetSize;
                         } hdr;
                         rd_kafka_resp_err_t err;
@@ -2941,10 +3512,13 @@ rd_kafka_fetch_reply_handle (rd_kafka_broker_t *rkb,
 			rd_kafka_buf_read_i16(rkbuf, &hdr.ErrorCode);
 			rd_kafka_buf_read_i64(rkbuf, &hdr.HighwaterMarkOffset);
 
-                        if (rd_kafka_buf_ApiVersion(request) == 4) {
+                        if (rd_kafka_buf_ApiVersion(request) >= 4) {
                                 int32_t AbortedTxCnt;
                                 rd_kafka_buf_read_i64(rkbuf,
                                                       &hdr.LastStableOffset);
+                                if (rd_kafka_buf_ApiVersion(request) >= 5)
+                                        rd_kafka_buf_read_i64(
+                                                rkbuf, &hdr.LogStartOffset);
                                 rd_kafka_buf_read_i32(rkbuf, &AbortedTxCnt);
                                 /* Ignore aborted transactions for now */
                                 if (AbortedTxCnt > 0)
@@ -3015,7 +3589,20 @@ rd_kafka_fetch_reply_handle (rd_kafka_broker_t *rkb,
 			tver = rd_list_find(request->rkbuf_rktp_vers,
 					    &tver_skel,
 					    rd_kafka_toppar_ver_cmp);
-			rd_kafka_assert(NULL, tver);
+                        if (unlikely(!tver)) {
+                                /* Only possible with a fetch session
+                                 * that is out of sync. */
+                                rd_rkb_dbg(rkb, FETCH, "FETCH",
+                                           "%.*s [%"PRId32"]: "
+                                           "partition not in FetchRequest: "
+                                           "ignoring",
+                                           RD_KAFKAP_STR_PR(&topic),
+                                           hdr.Partition);
+                                rd_kafka_toppar_destroy(s_rktp); /* from get */
+                                rd_kafka_buf_skip(rkbuf, hdr.MessageSetSize);
+                                continue;
+                        }
+                        tver->seen = 1;
                         if (rd_kafka_toppar_s2i(tver->s_rktp) != rktp ||
                             tver->version < fetch_version) {
                                 rd_rkb_dbg(rkb, MSG, "DROP",
@@ -3031,6 +3618,23 @@ rd_kafka_fetch_reply_handle (rd_kafka_broker_t *rkb,
                                 continue;
                         }
 
+                        if (unlikely(tver->decomp_epoch !=
+                                     rktp->rktp_decomp_epoch)) {
+                                /* Fetched from beyond a MessageSet that
+                                 * failed decompression and has since been
+                                 * rewound to, see rd_kafka_decomp_rewind() */
+                                rd_rkb_dbg(rkb, MSG, "DROP",
+                                           "%s [%"PRId32"]: "
+                                           "dropping fetch response "
+                                           "from before decompression "
+                                           "rewind",
+                                           rktp->rktp_rkt->rkt_topic->str,
+                                           rktp->rktp_partition);
+                                rd_kafka_toppar_destroy(s_rktp); /* from get */
+                                rd_kafka_buf_skip(rkbuf, hdr.MessageSetSize);
+                                continue;
+                        }
+
 			rd_rkb_dbg(rkb, MSG, "FETCH",
 				   "Topic %.*s [%"PRId32"] MessageSet "
 				   "size %"PRId32", error \"%s\", "
@@ -3055,6 +3659,11 @@ rd_kafka_fetch_reply_handle (rd_kafka_broker_t *rkb,
 			rktp->rktp_hi_offset = hdr.HighwaterMarkOffset;
 			rd_kafka_toppar_unlock(rktp);
 
+                        if (rkb->rkb_rk->rk_conf.queued_max_total_bytes)
+                                rd_kafka_toppar_fetch_adapt(
+                                        rktp, hdr.MessageSetSize,
+                                        hdr.HighwaterMarkOffset);
+
 			/* If this is the last message of the queue,
 			 * signal EOF back to the application. */
 			if (hdr.HighwaterMarkOffset ==
@@ -3106,14 +3715,9 @@ rd_kafka_fetch_reply_handle (rd_kafka_broker_t *rkb,
 				case RD_KAFKA_RESP_ERR_MSG_SIZE_TOO_LARGE:
 				default: /* and all other errors */
 					rd_dassert(tver->version > 0);
-					rd_kafka_q_op_err(
-						rktp->rktp_fetchq,
-						RD_KAFKA_OP_CONSUMER_ERR,
-						hdr.ErrorCode, tver->version,
-						rktp,
-						rktp->rktp_offsets.fetch_offset,
-						"%s",
-						rd_kafka_err2str(hdr.ErrorCode));
+                                        rd_kafka_toppar_fetch_error(
+                                                rkb, rktp, hdr.ErrorCode,
+                                                tver->version);
 					break;
 				}
 
@@ -3169,6 +3773,9 @@ rd_kafka_fetch_reply_handle (rd_kafka_broker_t *rkb,
 		RD_NOTREACHED();
 	}
 
+        if (incremental)
+                rd_kafka_broker_fetch_session_eof(rkb, request);
+
 	return 0;
 
 err_parse:
@@ -3204,8 +3811,21 @@ static void rd_kafka_broker_fetch_reply (rd_kafka_t *rk,
 
                 rd_rkb_dbg(rkb, MSG, "FETCH", "Fetch reply: %s",
                            rd_kafka_err2str(err));
+
+                /* Any failed fetch leaves the session in an unknown
+                 * state: start a new one. */
+                rd_kafka_broker_fetch_session_reset(rkb,
+                                                    rd_kafka_err2str(err));
+                if (err == RD_KAFKA_RESP_ERR_FETCH_SESSION_ID_NOT_FOUND)
+                        rkb->rkb_fetch_session.id = 0;
+
 		switch (err)
 		{
+                case RD_KAFKA_RESP_ERR_FETCH_SESSION_ID_NOT_FOUND:
+                case RD_KAFKA_RESP_ERR_INVALID_FETCH_SESSION_EPOCH:
+                        /* Refetch right away with a new session */
+                        return;
+
 		case RD_KAFKA_RESP_ERR_UNKNOWN_TOPIC_OR_PART:
 		case RD_KAFKA_RESP_ERR_LEADER_NOT_AVAILABLE:
 		case RD_KAFKA_RESP_ERR_NOT_LEADER_FOR_PARTITION:
@@ -3247,10 +3867,162 @@ static void rd_kafka_broker_fetch_reply (rd_kafka_t *rk,
 
 
 /**
- * Build and send a Fetch request message for all underflowed toppars
- * for a specific broker.
- */
-static int rd_kafka_broker_fetch_toppars (rd_kafka_broker_t *rkb, rd_ts_t now) {
+ * @brief Start the fetch session's next FetchRequest generation.
+ *
+ * @returns true if the request is a full fetch request.
+ *
+ * @locality broker thread
+ */
+static int rd_kafka_broker_fetch_session_next (rd_kafka_broker_t *rkb) {
+        rkb->rkb_fetch_session.gen++;
+        return rkb->rkb_fetch_session.epoch == 0;
+}
+
+
+/**
+ * @brief Add \p rktp, to be fetched at its current fetch offset with
+ *        \p MaxBytes, to the fetch session's current FetchRequest
+ *        generation.
+ *
+ * @returns true if the partition needs to be included in the request,
+ *          or false if it is unchanged since last sent in the
+ *          session and may be left out of an incremental request.
+ *
+ * @locality broker thread
+ */
+static int rd_kafka_broker_fetch_session_toppar_add (rd_kafka_broker_t *rkb,
+                                                     rd_kafka_toppar_t *rktp,
+                                                     int32_t MaxBytes,
+                                                     int full) {
+        rd_kafka_fetch_session_toppar_t *rkfst;
+
+        if (!(rkfst = rd_kafka_broker_fetch_session_toppar_find(rkb, rktp))) {
+                rkfst = rd_calloc(1, sizeof(*rkfst));
+                rkfst->rkfst_s_rktp = rd_kafka_toppar_keep(rktp);
+                rkfst->rkfst_rktp = rktp;
+                rkfst->rkfst_offset = RD_KAFKA_OFFSET_INVALID;
+                RD_AVL_INSERT(&rkb->rkb_fetch_session.avl, rkfst,
+                              rkfst_avlnode);
+                TAILQ_INSERT_TAIL(&rkb->rkb_fetch_session.toppars, rkfst,
+                                  rkfst_link);
+                rkb->rkb_fetch_session.toppar_cnt++;
+        }
+
+        rkfst->rkfst_gen = rkb->rkb_fetch_session.gen;
+
+        if (!full &&
+            rkfst->rkfst_offset == rktp->rktp_offsets.fetch_offset &&
+            rkfst->rkfst_max_bytes == MaxBytes)
+                return 0;
+
+        rkfst->rkfst_offset = rktp->rktp_offsets.fetch_offset;
+        rkfst->rkfst_max_bytes = MaxBytes;
+        return 1;
+}
+
+
+/**
+ * @brief Topic name + partition comparator for a list of shptr toppars.
+ */
+static int rd_kafka_broker_fetch_session_toppar_sort_cmp (const void *_a,
+                                                         const void *_b) {
+        const rd_kafka_toppar_t *a = rd_kafka_toppar_s2i(
+                (shptr_rd_kafka_toppar_t *)_a);
+        const rd_kafka_toppar_t *b = rd_kafka_toppar_s2i(
+                (shptr_rd_kafka_toppar_t *)_b);
+        int r;
+
+        if (a->rktp_rkt != b->rktp_rkt &&
+            (r = rd_kafkap_str_cmp(a->rktp_rkt->rkt_topic,
+                                   b->rktp_rkt->rkt_topic)))
+                return r;
+
+        return a->rktp_partition - b->rktp_partition;
+}
+
+
+/**
+ * @brief Write the FetchRequest ForgottenTopicsData: partitions in the
+ *        broker's fetch session that are no longer fetched, either since
+ *        they left the broker or are not part of this request's
+ *        fetch generation (e.g., paused or with a full local queue).
+ *
+ * A full request creates a new session with only the partitions in the
+ * request, no partitions need to be forgotten.
+ *
+ * @returns the number of forgotten partitions written.
+ *
+ * @locality broker thread
+ */
+static int
+rd_kafka_broker_fetch_session_write_forgotten (rd_kafka_broker_t *rkb,
+                                               rd_kafka_buf_t *rkbuf,
+                                               int full) {
+        rd_list_t *forgotten = &rkb->rkb_fetch_session.forgotten;
+        rd_kafka_fetch_session_toppar_t *rkfst, *tmp;
+        shptr_rd_kafka_toppar_t *s_rktp;
+        rd_kafka_itopic_t *rkt_last = NULL;
+        size_t of_TopicArrayCnt, of_PartitionArrayCnt = 0;
+        int TopicArrayCnt = 0, PartitionArrayCnt = 0;
+        int cnt = 0;
+        int i;
+
+        TAILQ_FOREACH_SAFE(rkfst, &rkb->rkb_fetch_session.toppars,
+                           rkfst_link, tmp) {
+                if (rkfst->rkfst_gen != rkb->rkb_fetch_session.gen)
+                        rd_kafka_broker_fetch_session_toppar_remove(
+                                rkb, rkfst, 1/*forget*/);
+        }
+
+        of_TopicArrayCnt = rd_kafka_buf_write_i32(rkbuf, 0);
+
+        if (!full)
+                rd_list_sort(forgotten,
+                             rd_kafka_broker_fetch_session_toppar_sort_cmp);
+
+        RD_LIST_FOREACH(s_rktp, forgotten, i) {
+                rd_kafka_toppar_t *rktp = rd_kafka_toppar_s2i(s_rktp);
+
+                if (!full) {
+                        if (rkt_last != rktp->rktp_rkt) {
+                                if (rkt_last)
+                                        rd_kafka_buf_update_i32(
+                                                rkbuf, of_PartitionArrayCnt,
+                                                PartitionArrayCnt);
+                                rd_kafka_buf_write_kstr(
+                                        rkbuf, rktp->rktp_rkt->rkt_topic);
+                                TopicArrayCnt++;
+                                rkt_last = rktp->rktp_rkt;
+                                of_PartitionArrayCnt =
+                                        rd_kafka_buf_write_i32(rkbuf, 0);
+                                PartitionArrayCnt = 0;
+                        }
+
+                        rd_kafka_buf_write_i32(rkbuf, rktp->rktp_partition);
+                        PartitionArrayCnt++;
+                        cnt++;
+                }
+
+                rd_kafka_toppar_destroy(s_rktp);
+        }
+        rd_list_clear(forgotten);
+
+        if (rkt_last) {
+                rd_kafka_buf_update_i32(rkbuf, of_PartitionArrayCnt,
+                                        PartitionArrayCnt);
+                rd_kafka_buf_update_i32(rkbuf, of_TopicArrayCnt,
+                                        TopicArrayCnt);
+        }
+
+        return cnt;
+}
+
+
+/**
+ * Build and send a Fetch request message for all underflowed toppars
+ * for a specific broker.
+ */
+static int rd_kafka_broker_fetch_toppars (rd_kafka_broker_t *rkb, rd_ts_t now) {
 	rd_kafka_toppar_t *rktp;
 	rd_kafka_buf_t *rkbuf;
 	int cnt = 0;
@@ -3259,6 +4031,8 @@ static int rd_kafka_broker_fetch_toppars (rd_kafka_broker_t *rkb, rd_ts_t now) {
 	size_t of_PartitionArrayCnt = 0;
 	int PartitionArrayCnt = 0;
 	rd_kafka_itopic_t *rkt_last = NULL;
+        int session = 0, full = 1;
+        int sent_cnt = 0;
 
 	/* Create buffer and segments:
 	 *   1 x ReplicaId MaxWaitTime MinBytes TopicArrayCnt
@@ -3275,12 +4049,27 @@ static int rd_kafka_broker_fetch_toppars (rd_kafka_broker_t *rkb, rd_ts_t now) {
 
 	rkbuf = rd_kafka_buf_new_request(
                 rkb, RD_KAFKAP_Fetch, 1,
-                /* ReplicaId+MaxWaitTime+MinBytes+TopicCnt */
-                4+4+4+4+
-                /* N x PartCnt+Partition+FetchOffset+MaxBytes+?TopicNameLen?*/
-                (rkb->rkb_active_toppar_cnt * (4+4+8+4+40)));
-
-        if (rkb->rkb_features & RD_KAFKA_FEATURE_MSGVER2)
+                /* ReplicaId+MaxWaitTime+MinBytes+MaxBytes+IsolationLevel+
+                 *   SessionId+Epoch+TopicCnt */
+                4+4+4+4+1+4+4+4+
+                /* N x PartCnt+Partition+CurrentLeaderEpoch+FetchOffset+
+                 *   LogStartOffset+MaxBytes+?TopicNameLen?*/
+                (rkb->rkb_active_toppar_cnt * (4+4+4+8+8+4+40)) +
+                /* ForgottenTopicsCnt */
+                4);
+
+#if WITH_ZSTD
+        /* Fetch v10 tells the broker we can read ZSTD-compressed
+         * MessageSets, which requires ZSTD support. */
+        if (rkb->rkb_features & RD_KAFKA_FEATURE_ZSTD)
+                rd_kafka_buf_ApiVersion_set(rkbuf, 10,
+                                            RD_KAFKA_FEATURE_ZSTD);
+        else
+#endif
+        if (rkb->rkb_features & RD_KAFKA_FEATURE_FETCH_SESSION)
+                rd_kafka_buf_ApiVersion_set(rkbuf, 7,
+                                            RD_KAFKA_FEATURE_FETCH_SESSION);
+        else if (rkb->rkb_features & RD_KAFKA_FEATURE_MSGVER2)
                 rd_kafka_buf_ApiVersion_set(rkbuf, 4,
                                             RD_KAFKA_FEATURE_MSGVER2);
         else if (rkb->rkb_features & RD_KAFKA_FEATURE_MSGVER1)
@@ -3299,7 +4088,7 @@ static int rd_kafka_broker_fetch_toppars (rd_kafka_broker_t *rkb, rd_ts_t now) {
 	/* MinBytes */
 	rd_kafka_buf_write_i32(rkbuf, rkb->rkb_rk->rk_conf.fetch_min_bytes);
 
-        if (rd_kafka_buf_ApiVersion(rkbuf) == 4) {
+        if (rd_kafka_buf_ApiVersion(rkbuf) >= 4) {
                 /* MaxBytes */
                 rd_kafka_buf_write_i32(rkbuf,
                                        rkb->rkb_rk->rk_conf.fetch_max_bytes);
@@ -3307,6 +4096,16 @@ static int rd_kafka_broker_fetch_toppars (rd_kafka_broker_t *rkb, rd_ts_t now) {
                 rd_kafka_buf_write_i8(rkbuf, RD_KAFKAP_READ_UNCOMMITTED);
         }
 
+        if (rd_kafka_buf_ApiVersion(rkbuf) >= 7) {
+                /* Incremental fetch session (KIP-227):
+                 * SessionEpoch 0 requests a new session, closing the
+                 * current one (SessionId), if any. */
+                session = 1;
+                full = rd_kafka_broker_fetch_session_next(rkb);
+                rd_kafka_buf_write_i32(rkbuf, rkb->rkb_fetch_session.id);
+                rd_kafka_buf_write_i32(rkbuf, rkb->rkb_fetch_session.epoch);
+        }
+
 	/* Write zero TopicArrayCnt but store pointer for later update */
 	of_TopicArrayCnt = rd_kafka_buf_write_i32(rkbuf, 0);
 
@@ -3323,6 +4122,25 @@ static int rd_kafka_broker_fetch_toppars (rd_kafka_broker_t *rkb, rd_ts_t now) {
         rktp = rkb->rkb_active_toppar_next;
         do {
 		struct rd_kafka_toppar_ver *tver;
+                int32_t MaxBytes = rd_kafka_toppar_fetch_size(rktp);
+
+		/* Add toppar + op version mapping, also for partitions
+                 * left out of an incremental request since the
+                 * broker fetches all partitions in the session. */
+		tver = rd_list_add(rkbuf->rkbuf_rktp_vers, NULL);
+		tver->s_rktp = rd_kafka_toppar_keep(rktp);
+		tver->version = rktp->rktp_fetch_version;
+                tver->seen = 0;
+                /* Only modified by this thread */
+                tver->decomp_epoch = rktp->rktp_decomp_epoch;
+
+		cnt++;
+
+                if (session &&
+                    !rd_kafka_broker_fetch_session_toppar_add(rkb, rktp,
+                                                              MaxBytes,
+                                                              full))
+                        continue; /* Unchanged since last sent */
 
 		if (rkt_last != rktp->rktp_rkt) {
 			if (rkt_last != NULL) {
@@ -3345,10 +4163,16 @@ static int rd_kafka_broker_fetch_toppars (rd_kafka_broker_t *rkb, rd_ts_t now) {
 		PartitionArrayCnt++;
 		/* Partition */
 		rd_kafka_buf_write_i32(rkbuf, rktp->rktp_partition);
+                if (rd_kafka_buf_ApiVersion(rkbuf) >= 9)
+                        /* CurrentLeaderEpoch: unknown */
+                        rd_kafka_buf_write_i32(rkbuf, -1);
 		/* FetchOffset */
 		rd_kafka_buf_write_i64(rkbuf, rktp->rktp_offsets.fetch_offset);
+                if (rd_kafka_buf_ApiVersion(rkbuf) >= 5)
+                        /* LogStartOffset: only used by followers */
+                        rd_kafka_buf_write_i64(rkbuf, -1);
 		/* MaxBytes */
-		rd_kafka_buf_write_i32(rkbuf, rktp->rktp_fetch_msg_max_bytes);
+		rd_kafka_buf_write_i32(rkbuf, MaxBytes);
 
 		rd_rkb_dbg(rkb, FETCH, "FETCH",
 			   "Fetch topic %.*s [%"PRId32"] at offset %"PRId64
@@ -3358,12 +4182,7 @@ static int rd_kafka_broker_fetch_toppars (rd_kafka_broker_t *rkb, rd_ts_t now) {
                            rktp->rktp_offsets.fetch_offset,
 			   rktp->rktp_fetch_version);
 
-		/* Add toppar + op version mapping. */
-		tver = rd_list_add(rkbuf->rkbuf_rktp_vers, NULL);
-		tver->s_rktp = rd_kafka_toppar_keep(rktp);
-		tver->version = rktp->rktp_fetch_version;
-
-		cnt++;
+                sent_cnt++;
 	} while ((rktp = CIRCLEQ_LOOP_NEXT(&rkb->rkb_active_toppars,
                                            rktp, rktp_activelink)) !=
                  rkb->rkb_active_toppar_next);
@@ -3375,8 +4194,9 @@ static int rd_kafka_broker_fetch_toppars (rd_kafka_broker_t *rkb, rd_ts_t now) {
                 CIRCLEQ_LOOP_NEXT(&rkb->rkb_active_toppars,
                                   rktp, rktp_activelink) : NULL);
 
-	rd_rkb_dbg(rkb, FETCH, "FETCH", "Fetch %i/%i/%i toppar(s)",
-                   cnt, rkb->rkb_active_toppar_cnt, rkb->rkb_toppar_cnt);
+	rd_rkb_dbg(rkb, FETCH, "FETCH", "Fetch %i/%i/%i toppar(s)%s",
+                   cnt, rkb->rkb_active_toppar_cnt, rkb->rkb_toppar_cnt,
+                   session && !full ? " in incremental session" : "");
 	if (!cnt) {
 		rd_kafka_buf_destroy(rkbuf);
 		return cnt;
@@ -3392,6 +4212,25 @@ static int rd_kafka_broker_fetch_toppars (rd_kafka_broker_t *rkb, rd_ts_t now) {
 	/* Update TopicArrayCnt */
 	rd_kafka_buf_update_i32(rkbuf, of_TopicArrayCnt, TopicArrayCnt);
 
+        if (session) {
+                int forgotten_cnt =
+                        rd_kafka_broker_fetch_session_write_forgotten(
+                                rkb, rkbuf, full);
+
+                rd_rkb_dbg(rkb, FETCH, "FETCHSESS",
+                           "%s fetch session %"PRId32" epoch %"PRId32": "
+                           "%d/%d partition(s) sent, %d forgotten",
+                           full ? "Full" : "Incremental",
+                           rkb->rkb_fetch_session.id,
+                           rkb->rkb_fetch_session.epoch,
+                           sent_cnt,
+                           rkb->rkb_fetch_session.toppar_cnt,
+                           forgotten_cnt);
+        }
+
+        rd_atomic64_add(session && !full ?
+                        &rkb->rkb_c.fetch_incr : &rkb->rkb_c.fetch_full, 1);
+
         /* Use configured timeout */
         rd_kafka_buf_set_timeout(rkbuf,
                                  rkb->rkb_rk->rk_conf.socket_timeout_ms +
@@ -3464,154 +4303,160 @@ static void rd_kafka_broker_consumer_serve (rd_kafka_broker_t *rkb) {
                                       now + (rkb->rkb_blocking_max_ms * 1000));
 
 		rd_kafka_broker_lock(rkb);
+
+                /* Reactor: one iteration per step */
+                if (rkb->rkb_reactor)
+                        break;
 	}
 
 	rd_kafka_broker_unlock(rkb);
 }
 
 
-static int rd_kafka_broker_thread_main (void *arg) {
-	rd_kafka_broker_t *rkb = arg;
+/**
+ * @brief Serve the broker's current state once.
+ *
+ * This is one iteration of the broker thread's main loop, or one step
+ * of a shared reactor thread (broker.threads), in which case all
+ * blocking waits are replaced by deadlines, see
+ * rd_kafka_broker_reactor_serve().
+ *
+ * @locality broker thread
+ */
+static void rd_kafka_broker_serve_state (rd_kafka_broker_t *rkb) {
 	rd_kafka_t *rk = rkb->rkb_rk;
+        rd_ts_t backoff;
 
-        rd_kafka_set_thread_name("%s", rkb->rkb_name);
-        rd_kafka_set_thread_sysname("rdk:broker%"PRId32, rkb->rkb_nodeid);
-
-	(void)rd_atomic32_add(&rd_kafka_thread_cnt_curr, 1);
-
-        /* Our own refcount was increased just prior to thread creation,
-         * when refcount drops to 1 it is just us left and the broker 
-         * thread should terminate. */
-
-	/* Acquire lock (which was held by thread creator during creation)
-	 * to synchronise state. */
-	rd_kafka_broker_lock(rkb);
-	rd_kafka_broker_unlock(rkb);
-
-	rd_rkb_dbg(rkb, BROKER, "BRKMAIN", "Enter main broker thread");
-
-	while (!rd_kafka_broker_terminating(rkb)) {
-                rd_ts_t backoff;
-
-		switch (rkb->rkb_state)
-		{
-		case RD_KAFKA_BROKER_STATE_INIT:
-			/* The INIT state exists so that an initial connection
-			 * failure triggers a state transition which might
-			 * trigger a ALL_BROKERS_DOWN error. */
-		case RD_KAFKA_BROKER_STATE_DOWN:
-			if (rkb->rkb_source == RD_KAFKA_INTERNAL) {
-                                rd_kafka_broker_lock(rkb);
-				rd_kafka_broker_set_state(rkb,
-							  RD_KAFKA_BROKER_STATE_UP);
-                                rd_kafka_broker_unlock(rkb);
-				break;
-			}
+	switch (rkb->rkb_state)
+	{
+	case RD_KAFKA_BROKER_STATE_INIT:
+		/* The INIT state exists so that an initial connection
+		 * failure triggers a state transition which might
+		 * trigger a ALL_BROKERS_DOWN error. */
+	case RD_KAFKA_BROKER_STATE_DOWN:
+		if (rkb->rkb_source == RD_KAFKA_INTERNAL) {
+                        rd_kafka_broker_lock(rkb);
+			rd_kafka_broker_set_state(rkb,
+						  RD_KAFKA_BROKER_STATE_UP);
+                        rd_kafka_broker_unlock(rkb);
+			break;
+		}
 
-                        /* Throttle & jitter reconnects to avoid
-                         * thundering horde of reconnecting clients after
-                         * a broker / network outage. Issue #403 */
-                        if (rkb->rkb_rk->rk_conf.reconnect_jitter_ms &&
-                            (backoff =
-                             rd_interval_immediate(
-                                     &rkb->rkb_connect_intvl,
-                                     rd_jitter(rkb->rkb_rk->rk_conf.
-                                               reconnect_jitter_ms*500,
-                                               rkb->rkb_rk->rk_conf.
-                                               reconnect_jitter_ms*1500),
-                                     0)) <= 0) {
-                                backoff = -backoff/1000;
-                                rd_rkb_dbg(rkb, BROKER, "RECONNECT",
-                                           "Delaying next reconnect by %dms",
-                                           (int)backoff);
-                                rd_kafka_broker_ua_idle(rkb, (int)backoff);
-                                continue;
-                        }
+                /* Throttle & jitter reconnects to avoid
+                 * thundering horde of reconnecting clients after
+                 * a broker / network outage. Issue #403 */
+                if (rkb->rkb_rk->rk_conf.reconnect_jitter_ms &&
+                    (backoff =
+                     rd_interval_immediate(
+                             &rkb->rkb_connect_intvl,
+                             rd_jitter(rkb->rkb_rk->rk_conf.
+                                       reconnect_jitter_ms*500,
+                                       rkb->rkb_rk->rk_conf.
+                                       reconnect_jitter_ms*1500),
+                             0)) <= 0) {
+                        backoff = -backoff/1000;
+                        rd_rkb_dbg(rkb, BROKER, "RECONNECT",
+                                   "Delaying next reconnect by %dms",
+                                   (int)backoff);
+                        rd_kafka_broker_ua_idle(rkb, (int)backoff);
+                        return;
+                }
 
-			/* Initiate asynchronous connection attempt.
-			 * Only the host lookup is blocking here. */
-			if (rd_kafka_broker_connect(rkb) == -1) {
-				/* Immediate failure, most likely host
-				 * resolving failed.
-				 * Try the next resolve result until we've
-				 * tried them all, in which case we sleep a
-				 * short while to avoid busy looping. */
-				if (!rkb->rkb_rsal ||
-                                    rkb->rkb_rsal->rsal_cnt == 0 ||
-                                    rkb->rkb_rsal->rsal_curr + 1 ==
-                                    rkb->rkb_rsal->rsal_cnt)
-                                        rd_kafka_broker_ua_idle(rkb, 1000);
-			}
-			break;
+		/* Initiate asynchronous connection attempt.
+		 * Only the host lookup is blocking here. */
+		if (rd_kafka_broker_connect(rkb) == -1) {
+			/* Immediate failure, most likely host
+			 * resolving failed.
+			 * Try the next resolve result until we've
+			 * tried them all, in which case we sleep a
+			 * short while to avoid busy looping. */
+			if (!rkb->rkb_rsal ||
+                            rkb->rkb_rsal->rsal_cnt == 0 ||
+                            rkb->rkb_rsal->rsal_curr + 1 ==
+                            rkb->rkb_rsal->rsal_cnt)
+                                rd_kafka_broker_ua_idle(rkb, 1000);
+		}
+		break;
+
+	case RD_KAFKA_BROKER_STATE_CONNECT:
+	case RD_KAFKA_BROKER_STATE_AUTH:
+	case RD_KAFKA_BROKER_STATE_AUTH_HANDSHAKE:
+	case RD_KAFKA_BROKER_STATE_APIVERSION_QUERY:
+		/* Asynchronous connect in progress. */
+		rd_kafka_broker_ua_idle(rkb, RD_POLL_INFINITE);
+
+		if (rkb->rkb_state == RD_KAFKA_BROKER_STATE_DOWN) {
+			/* Connect failure.
+			 * Try the next resolve result until we've
+			 * tried them all, in which case we sleep a
+			 * short while to avoid busy looping. */
+			if (!rkb->rkb_rsal ||
+                            rkb->rkb_rsal->rsal_cnt == 0 ||
+                            rkb->rkb_rsal->rsal_curr + 1 ==
+                            rkb->rkb_rsal->rsal_cnt)
+                                rd_kafka_broker_ua_idle(rkb, 1000);
+		}
+		break;
 
-		case RD_KAFKA_BROKER_STATE_CONNECT:
-		case RD_KAFKA_BROKER_STATE_AUTH:
-		case RD_KAFKA_BROKER_STATE_AUTH_HANDSHAKE:
-		case RD_KAFKA_BROKER_STATE_APIVERSION_QUERY:
-			/* Asynchronous connect in progress. */
+        case RD_KAFKA_BROKER_STATE_UPDATE:
+                /* FALLTHRU */
+	case RD_KAFKA_BROKER_STATE_UP:
+		if (rkb->rkb_nodeid == RD_KAFKA_NODEID_UA)
 			rd_kafka_broker_ua_idle(rkb, RD_POLL_INFINITE);
+		else if (rk->rk_type == RD_KAFKA_PRODUCER)
+			rd_kafka_broker_producer_serve(rkb);
+		else if (rk->rk_type == RD_KAFKA_CONSUMER)
+			rd_kafka_broker_consumer_serve(rkb);
 
-			if (rkb->rkb_state == RD_KAFKA_BROKER_STATE_DOWN) {
-				/* Connect failure.
-				 * Try the next resolve result until we've
-				 * tried them all, in which case we sleep a
-				 * short while to avoid busy looping. */
-				if (!rkb->rkb_rsal ||
-                                    rkb->rkb_rsal->rsal_cnt == 0 ||
-                                    rkb->rkb_rsal->rsal_curr + 1 ==
-                                    rkb->rkb_rsal->rsal_cnt)
-                                        rd_kafka_broker_ua_idle(rkb, 1000);
-			}
-			break;
-
-                case RD_KAFKA_BROKER_STATE_UPDATE:
-                        /* FALLTHRU */
-		case RD_KAFKA_BROKER_STATE_UP:
-			if (rkb->rkb_nodeid == RD_KAFKA_NODEID_UA)
-				rd_kafka_broker_ua_idle(rkb, RD_POLL_INFINITE);
-			else if (rk->rk_type == RD_KAFKA_PRODUCER)
-				rd_kafka_broker_producer_serve(rkb);
-			else if (rk->rk_type == RD_KAFKA_CONSUMER)
-				rd_kafka_broker_consumer_serve(rkb);
-
-			if (rkb->rkb_state == RD_KAFKA_BROKER_STATE_UPDATE) {
-                                rd_kafka_broker_lock(rkb);
-				rd_kafka_broker_set_state(rkb, RD_KAFKA_BROKER_STATE_UP);
-                                rd_kafka_broker_unlock(rkb);
-			}
-			break;
+		if (rkb->rkb_state == RD_KAFKA_BROKER_STATE_UPDATE) {
+                        rd_kafka_broker_lock(rkb);
+			rd_kafka_broker_set_state(rkb, RD_KAFKA_BROKER_STATE_UP);
+                        rd_kafka_broker_unlock(rkb);
 		}
-
-                if (rd_kafka_terminating(rkb->rkb_rk)) {
-                        /* Handle is terminating: fail the send+retry queue
-                         * to speed up termination, otherwise we'll
-                         * need to wait for request timeouts. */
-                        int r;
-
-                        r = rd_kafka_broker_bufq_timeout_scan(
-                                rkb, 0, &rkb->rkb_outbufs, NULL,
-                                RD_KAFKA_RESP_ERR__DESTROY, 0);
-                        r += rd_kafka_broker_bufq_timeout_scan(
-                                rkb, 0, &rkb->rkb_retrybufs, NULL,
-                                RD_KAFKA_RESP_ERR__DESTROY, 0);
-                        rd_rkb_dbg(rkb, BROKER, "TERMINATE",
-                                   "Handle is terminating in state %s: "
-                                   "%d refcnts (%p), %d toppar(s), "
-                                   "%d active toppar(s), "
-                                   "%d outbufs, %d waitresps, %d retrybufs: "
-                                   "failed %d request(s) in retry+outbuf",
-                                   rd_kafka_broker_state_names[rkb->rkb_state],
-                                   rd_refcnt_get(&rkb->rkb_refcnt),
-                                   &rkb->rkb_refcnt,
-                                   rkb->rkb_toppar_cnt,
-                                   rkb->rkb_active_toppar_cnt,
-                                   (int)rd_kafka_bufq_cnt(&rkb->rkb_outbufs),
-                                   (int)rd_kafka_bufq_cnt(&rkb->rkb_waitresps),
-                                   (int)rd_kafka_bufq_cnt(&rkb->rkb_retrybufs),
-                                   r);
-                }
+		break;
 	}
 
+        if (rd_kafka_terminating(rkb->rkb_rk)) {
+                /* Handle is terminating: fail the send+retry queue
+                 * to speed up termination, otherwise we'll
+                 * need to wait for request timeouts. */
+                int r;
+
+                r = rd_kafka_broker_bufq_timeout_scan(
+                        rkb, 0, &rkb->rkb_outbufs, NULL,
+                        RD_KAFKA_RESP_ERR__DESTROY, 0);
+                r += rd_kafka_broker_bufq_timeout_scan(
+                        rkb, 0, &rkb->rkb_retrybufs, NULL,
+                        RD_KAFKA_RESP_ERR__DESTROY, 0);
+                rd_rkb_dbg(rkb, BROKER, "TERMINATE",
+                           "Handle is terminating in state %s: "
+                           "%d refcnts (%p), %d toppar(s), "
+                           "%d active toppar(s), "
+                           "%d outbufs, %d waitresps, %d retrybufs: "
+                           "failed %d request(s) in retry+outbuf",
+                           rd_kafka_broker_state_names[rkb->rkb_state],
+                           rd_refcnt_get(&rkb->rkb_refcnt),
+                           &rkb->rkb_refcnt,
+                           rkb->rkb_toppar_cnt,
+                           rkb->rkb_active_toppar_cnt,
+                           (int)rd_kafka_bufq_cnt(&rkb->rkb_outbufs),
+                           (int)rd_kafka_bufq_cnt(&rkb->rkb_waitresps),
+                           (int)rd_kafka_bufq_cnt(&rkb->rkb_retrybufs),
+                           r);
+        }
+}
+
+
+/**
+ * @brief Decommission a terminating broker: unlink it from the handle,
+ *        fail outstanding requests, drain its ops queue and drop the
+ *        serving thread's reference.
+ *
+ * @remark \p rkb must not be accessed after this call.
+ *
+ * @locality broker thread
+ */
+void rd_kafka_broker_decommission (rd_kafka_broker_t *rkb) {
 	if (rkb->rkb_source != RD_KAFKA_INTERNAL) {
 		rd_kafka_wrlock(rkb->rkb_rk);
 		TAILQ_REMOVE(&rkb->rkb_rk->rk_brokers, rkb, rkb_link);
@@ -3633,6 +4478,137 @@ static int rd_kafka_broker_thread_main (void *arg) {
                 ;
 
 	rd_kafka_broker_destroy(rkb);
+}
+
+
+/**
+ * @returns true if the broker has nothing to do until an IO or queue
+ *          wake-up event arrives, i.e., the reactor thread need not
+ *          serve it on a timer.
+ *
+ * Messages produced to an empty partition queue and ops enqueued on an
+ * empty ops queue trigger the broker's wake-up fd, anything else
+ * (outstanding requests, queued messages, consumer partitions, ..)
+ * requires periodic serving.
+ *
+ * @locality reactor thread
+ */
+static rd_bool_t rd_kafka_broker_reactor_idle (rd_kafka_broker_t *rkb) {
+        rd_kafka_toppar_t *rktp;
+
+        if (rkb->rkb_state != RD_KAFKA_BROKER_STATE_UP ||
+            rd_wakeup_fd(&rkb->rkb_wakeup) == -1 ||
+            rd_kafka_terminating(rkb->rkb_rk) ||
+            rd_kafka_bufq_cnt(&rkb->rkb_outbufs) > 0 ||
+            rd_kafka_bufq_cnt(&rkb->rkb_waitresps) > 0 ||
+            rd_kafka_bufq_cnt(&rkb->rkb_zc_waitcompl) > 0 ||
+            rd_atomic32_get(&rkb->rkb_retrybufs.rkbq_cnt) > 0)
+                return rd_false;
+
+        if (rkb->rkb_rk->rk_type == RD_KAFKA_CONSUMER)
+                return rkb->rkb_toppar_cnt == 0;
+
+        TAILQ_FOREACH(rktp, &rkb->rkb_toppars, rktp_rkblink) {
+                rd_bool_t empty;
+
+                if (rd_kafka_msgq_len(&rktp->rktp_xmit_msgq) > 0 ||
+                    rd_atomic32_get(&rktp->rktp_compress_cnt) > 0)
+                        return rd_false;
+
+                rd_kafka_toppar_lock(rktp);
+                empty = rd_kafka_msgq_len(&rktp->rktp_msgq) == 0 &&
+                        !rd_atomicptr_get(&rktp->rktp_msgq_intake);
+                rd_kafka_toppar_unlock(rktp);
+
+                if (!empty)
+                        return rd_false;
+        }
+
+        return rd_true;
+}
+
+
+/**
+ * @brief Serve one non-blocking step of the broker's state machine on
+ *        a shared reactor thread (broker.threads > 0).
+ *
+ * The step is the reactor's counterpart of one iteration of the
+ * rd_kafka_broker_thread_main() loop: rkb_reactor_next is set to the
+ * time at which the broker wants to be served again if no IO or
+ * wake-up event arrives before that, RD_TS_MAX if idle.
+ *
+ * @returns rd_true if the broker is terminating, in which case the
+ *          reactor must stop serving it and call
+ *          rd_kafka_broker_decommission().
+ *
+ * @locality reactor thread
+ */
+rd_bool_t rd_kafka_broker_reactor_serve (rd_kafka_broker_t *rkb) {
+        int initial_state = rkb->rkb_state;
+        rd_ts_t now;
+
+        if (rd_kafka_broker_terminating(rkb))
+                return rd_true;
+
+        /* Clear the wake-up prior to serving so that wake-ups
+         * triggered during this step are not lost. */
+        rd_wakeup_clear(&rkb->rkb_wakeup);
+
+        now = rd_clock();
+
+        /* Serve again right away unless the serve functions
+         * set a deadline. */
+        rkb->rkb_reactor_next = now;
+
+        if (rkb->rkb_reactor_idle_until > now &&
+            (int)rkb->rkb_state == rkb->rkb_reactor_idle_state) {
+                /* Resume ua_idle() period */
+                rd_kafka_broker_ua_idle(
+                        rkb,
+                        (int)((rkb->rkb_reactor_idle_until - now + 999) /
+                              1000));
+        } else {
+                rkb->rkb_reactor_idle_until = 0;
+                rd_kafka_broker_serve_state(rkb);
+        }
+
+        if (rd_kafka_broker_terminating(rkb))
+                return rd_true;
+
+        if ((int)rkb->rkb_state != initial_state ||
+            rd_kafka_q_len(rkb->rkb_ops) > 0)
+                rkb->rkb_reactor_next = now;
+        else if (!rkb->rkb_reactor_idle_until &&
+                 rd_kafka_broker_reactor_idle(rkb))
+                rkb->rkb_reactor_next = RD_TS_MAX;
+
+        return rd_false;
+}
+
+
+static int rd_kafka_broker_thread_main (void *arg) {
+	rd_kafka_broker_t *rkb = arg;
+
+        rd_kafka_set_thread_name("%s", rkb->rkb_name);
+        rd_kafka_set_thread_sysname("rdk:broker%"PRId32, rkb->rkb_nodeid);
+
+	(void)rd_atomic32_add(&rd_kafka_thread_cnt_curr, 1);
+
+        /* Our own refcount was increased just prior to thread creation,
+         * when refcount drops to 1 it is just us left and the broker 
+         * thread should terminate. */
+
+	/* Acquire lock (which was held by thread creator during creation)
+	 * to synchronise state. */
+	rd_kafka_broker_lock(rkb);
+	rd_kafka_broker_unlock(rkb);
+
+	rd_rkb_dbg(rkb, BROKER, "BRKMAIN", "Enter main broker thread");
+
+	while (!rd_kafka_broker_terminating(rkb))
+                rd_kafka_broker_serve_state(rkb);
+
+        rd_kafka_broker_decommission(rkb);
 
 #if WITH_SSL
         /* Remove OpenSSL per-thread error state to avoid memory leaks */
@@ -3658,6 +4634,8 @@ void rd_kafka_broker_destroy_final (rd_kafka_broker_t *rkb) {
         rd_kafka_assert(rkb->rkb_rk, thrd_is_current(rkb->rkb_thread));
         rd_kafka_assert(rkb->rkb_rk, TAILQ_EMPTY(&rkb->rkb_outbufs.rkbq_bufs));
         rd_kafka_assert(rkb->rkb_rk, TAILQ_EMPTY(&rkb->rkb_waitresps.rkbq_bufs));
+        rd_kafka_assert(rkb->rkb_rk,
+                        TAILQ_EMPTY(&rkb->rkb_zc_waitcompl.rkbq_bufs));
         rd_kafka_assert(rkb->rkb_rk, TAILQ_EMPTY(&rkb->rkb_retrybufs.rkbq_bufs));
         rd_kafka_assert(rkb->rkb_rk, TAILQ_EMPTY(&rkb->rkb_toppars));
 
@@ -3668,10 +4646,7 @@ void rd_kafka_broker_destroy_final (rd_kafka_broker_t *rkb) {
              RD_KAFKA_PROTO_SASL_SSL))
                 rd_kafka_sasl_broker_term(rkb);
 
-        if (rkb->rkb_wakeup_fd[0] != -1)
-                rd_close(rkb->rkb_wakeup_fd[0]);
-        if (rkb->rkb_wakeup_fd[1] != -1)
-                rd_close(rkb->rkb_wakeup_fd[1]);
+        rd_wakeup_destroy(&rkb->rkb_wakeup);
 
 	if (rkb->rkb_recv_buf)
 		rd_kafka_buf_destroy(rkb->rkb_recv_buf);
@@ -3686,6 +4661,16 @@ void rd_kafka_broker_destroy_final (rd_kafka_broker_t *rkb) {
 	rd_kafka_q_purge(rkb->rkb_ops);
         rd_kafka_q_destroy_owner(rkb->rkb_ops);
 
+        rd_kafka_op_cache_destroy(&rkb->rkb_rk->rk_fetch_op_pool,
+                                  &rkb->rkb_fetch_op_cache);
+        rd_kafka_codec_ctx_destroy(&rkb->rkb_codec);
+
+        rd_kafka_broker_fetch_session_reset(rkb, "broker destroyed");
+        rd_avl_destroy(&rkb->rkb_fetch_session.avl);
+        rd_list_destroy(&rkb->rkb_fetch_session.forgotten);
+        rd_list_destroy(&rkb->rkb_produce_rktps);
+        rd_kafka_corridmap_destroy(&rkb->rkb_waitresp_map);
+
         rd_avg_destroy(&rkb->rkb_avg_int_latency);
         rd_avg_destroy(&rkb->rkb_avg_outbuf_latency);
         rd_avg_destroy(&rkb->rkb_avg_rtt);
@@ -3720,6 +4705,19 @@ rd_kafka_broker_t *rd_kafka_broker_internal (rd_kafka_t *rk) {
 }
 
 
+/**
+ * @brief Ops queue event callback: the queue went from empty to
+ *        non-empty, wake up the broker thread.
+ *
+ * @locality any
+ * @locks rkb_ops lock is held
+ */
+static void rd_kafka_broker_ops_event_cb (rd_kafka_t *rk, void *opaque) {
+        rd_kafka_broker_t *rkb = opaque;
+        rd_wakeup_signal(&rkb->rkb_wakeup);
+}
+
+
 /**
  * Adds a broker with refcount set to 1.
  * If 'source' is RD_KAFKA_INTERNAL an internal broker is added
@@ -3758,8 +4756,15 @@ rd_kafka_broker_t *rd_kafka_broker_add (rd_kafka_t *rk,
         rkb->rkb_logname = rd_strdup(rkb->rkb_name);
 	TAILQ_INIT(&rkb->rkb_toppars);
         CIRCLEQ_INIT(&rkb->rkb_active_toppars);
+        TAILQ_INIT(&rkb->rkb_fetch_session.toppars);
+        rd_avl_init(&rkb->rkb_fetch_session.avl,
+                    rd_kafka_fetch_session_toppar_cmp, 0);
+        rd_list_init(&rkb->rkb_fetch_session.forgotten, 0, NULL);
+        rd_list_init(&rkb->rkb_produce_rktps, 0, NULL);
 	rd_kafka_bufq_init(&rkb->rkb_outbufs);
 	rd_kafka_bufq_init(&rkb->rkb_waitresps);
+        rd_kafka_corridmap_init(&rkb->rkb_waitresp_map);
+	rd_kafka_bufq_init(&rkb->rkb_zc_waitcompl);
 	rd_kafka_bufq_init(&rkb->rkb_retrybufs);
 	rkb->rkb_ops = rd_kafka_q_new(rk);
         rd_interval_init(&rkb->rkb_connect_intvl);
@@ -3809,53 +4814,62 @@ rd_kafka_broker_t *rd_kafka_broker_add (rd_kafka_t *rk,
 #endif
 
         /*
-         * Fd-based queue wake-ups using a non-blocking pipe.
-         * Writes are best effort, if the socket queue is full
-         * the write fails (silently) but this has no effect on latency
-         * since the POLLIN flag will already have been raised for fd.
+         * Fd-based queue wake-ups (eventfd on Linux, else a
+         * non-blocking pipe). Wake-ups are coalesced: only the first
+         * signal after the broker thread cleared the wake-up costs
+         * a syscall, see rdwakeup.h.
          */
-        rkb->rkb_wakeup_fd[0]     = -1;
-        rkb->rkb_wakeup_fd[1]     = -1;
-        rkb->rkb_toppar_wakeup_fd = -1;
+        rkb->rkb_toppar_wakeup    = NULL;
+        rkb->rkb_reactor_sfd      = -1;
 
-        if ((r = rd_pipe_nonblocking(rkb->rkb_wakeup_fd)) == -1) {
+        if ((r = rd_wakeup_init(&rkb->rkb_wakeup))) {
                 rd_rkb_log(rkb, LOG_ERR, "WAKEUPFD",
                            "Failed to setup broker queue wake-up fds: "
                            "%s: disabling low-latency mode",
                            rd_strerror(r));
 
-        } else if (source == RD_KAFKA_INTERNAL) {
-                /* nop: internal broker has no IO transport. */
+        } else if (source == RD_KAFKA_INTERNAL &&
+                   rk->rk_reactor_cnt == 0) {
+                /* nop: internal broker has no IO transport.
+                 * A reactor thread however needs the ops queue
+                 * wake-ups for the internal broker as well. */
 
         } else {
-                char onebyte = 1;
-
                 /* Since there is a small syscall penalty,
                  * only enable partition message queue wake-ups
-                 * if latency contract demands it.
+                 * if latency contract demands it, or if the broker is
+                 * served by a reactor thread which does not poll
+                 * idle brokers periodically.
                  * rkb_ops queue wakeups are always enabled though,
                  * since they are much more infrequent. */
                 if (rk->rk_conf.buffering_max_ms <
-                    rk->rk_conf.socket_blocking_max_ms) {
+                    rk->rk_conf.socket_blocking_max_ms ||
+                    rk->rk_reactor_cnt > 0) {
                         rd_rkb_dbg(rkb, QUEUE, "WAKEUPFD",
                                    "Enabled low-latency partition "
                                    "queue wake-ups");
-                        rkb->rkb_toppar_wakeup_fd = rkb->rkb_wakeup_fd[1];
+                        rkb->rkb_toppar_wakeup = &rkb->rkb_wakeup;
                 }
 
 
                 rd_rkb_dbg(rkb, QUEUE, "WAKEUPFD",
                            "Enabled low-latency ops queue wake-ups");
-                rd_kafka_q_io_event_enable(rkb->rkb_ops, rkb->rkb_wakeup_fd[1],
-                                           &onebyte, sizeof(onebyte));
+                rd_kafka_q_cb_event_enable(rkb->rkb_ops,
+                                           rd_kafka_broker_ops_event_cb, rkb);
         }
 
         /* Lock broker's lock here to synchronise state, i.e., hold off
 	 * the broker thread until we've finalized the rkb. */
 	rd_kafka_broker_lock(rkb);
         rd_kafka_broker_keep(rkb); /* broker thread's refcnt */
-	if (thrd_create(&rkb->rkb_thread,
-			rd_kafka_broker_thread_main, rkb) != thrd_success) {
+        if (rk->rk_reactor_cnt > 0) {
+                /* Served by a shared reactor thread (broker.threads),
+                 * which holds the broker thread's refcnt instead. */
+                rd_kafka_reactor_broker_add(rk, rkb);
+
+        } else if (thrd_create(&rkb->rkb_thread,
+                               rd_kafka_broker_thread_main, rkb) !=
+                   thrd_success) {
 		char tmp[512];
 		rd_snprintf(tmp, sizeof(tmp),
 			 "Unable to create broker thread: %s (%i)",
@@ -4216,19 +5230,65 @@ const char *rd_kafka_broker_name (rd_kafka_broker_t *rkb) {
 
 
 /**
- * @brief Send dummy OP to broker thread to wake it up from IO sleep.
+ * @brief Wake up the broker thread from IO sleep.
+ *
+ * This signals the broker's wake-up fd directly rather than enqueuing
+ * an op, and is coalesced with any wake-up that is already pending.
+ *
+ * A broker thread without a transport waits on its ops queue's condvar
+ * rather than the wake-up fd, so a dummy op is enqueued instead
+ * (which also signals the wake-up fd through the ops queue event
+ * callback, for reactor-served brokers).
+ * The transport is read without locking: a wake-up racing with the
+ * transport being torn down is at worst delayed until the broker
+ * thread's next ops queue timeout.
  *
  * @locality any
  * @locks none
  */
 void rd_kafka_broker_wakeup (rd_kafka_broker_t *rkb) {
-        rd_kafka_op_t *rko = rd_kafka_op_new(RD_KAFKA_OP_WAKEUP);
-        rd_kafka_op_set_prio(rko, RD_KAFKA_PRIO_FLASH);
-        rd_kafka_q_enq(rkb->rkb_ops, rko);
+        if (likely(rkb->rkb_transport != NULL)) {
+                rd_wakeup_signal(&rkb->rkb_wakeup);
+        } else {
+                rd_kafka_op_t *rko = rd_kafka_op_new(RD_KAFKA_OP_WAKEUP);
+                rd_kafka_op_set_prio(rko, RD_KAFKA_PRIO_FLASH);
+                rd_kafka_q_enq(rkb->rkb_ops, rko);
+        }
         rd_rkb_dbg(rkb, QUEUE, "WAKEUP", "Wake-up");
 }
 
 
+/**
+ * @brief Wake up all broker threads that are in at least state \p min_state.
+ *
+ * @returns the number of broker threads woken up.
+ *
+ * @locality any
+ * @locks none
+ */
+int rd_kafka_all_brokers_wakeup (rd_kafka_t *rk, int min_state) {
+        rd_kafka_broker_t *rkb;
+        int cnt = 0;
+
+        rd_kafka_rdlock(rk);
+        TAILQ_FOREACH(rkb, &rk->rk_brokers, rkb_link) {
+                int do_wakeup;
+
+                rd_kafka_broker_lock(rkb);
+                do_wakeup = (int)rkb->rkb_state >= min_state;
+                rd_kafka_broker_unlock(rkb);
+
+                if (do_wakeup) {
+                        rd_kafka_broker_wakeup(rkb);
+                        cnt++;
+                }
+        }
+        rd_kafka_rdunlock(rk);
+
+        return cnt;
+}
+
+
 /**
  * @brief Add toppar to broker's active list list.
  *
@@ -4306,6 +5366,166 @@ void rd_kafka_brokers_init (void) {
 
 
 
+/**
+ * @name Unit tests
+ * @{
+ */
+
+/**
+ * @brief Build the fetch session part of a FetchRequest for \p rktps
+ *        (NULL-terminated) the way rd_kafka_broker_fetch_toppars() does.
+ *
+ * @returns the number of partitions included in the request.
+ */
+static int ut_fetch_session_request (rd_kafka_broker_t *rkb,
+                                     rd_kafka_toppar_t **rktps,
+                                     int *fullp, int *forgotten_cntp) {
+        rd_kafka_buf_t *rkbuf;
+        int sent_cnt = 0;
+
+        rkbuf = rd_kafka_buf_new_request(rkb, RD_KAFKAP_Fetch, 1, 64);
+
+        *fullp = rd_kafka_broker_fetch_session_next(rkb);
+        for ( ; *rktps ; rktps++)
+                sent_cnt += rd_kafka_broker_fetch_session_toppar_add(
+                        rkb, *rktps, 1000, *fullp);
+        *forgotten_cntp = rd_kafka_broker_fetch_session_write_forgotten(
+                rkb, rkbuf, *fullp);
+
+        rd_kafka_buf_destroy(rkbuf);
+
+        return sent_cnt;
+}
+
+/**
+ * @brief Verify fetch session (KIP-227) bookkeeping: full vs incremental
+ *        requests, partitions leaving the session, and session errors.
+ */
+static int unittest_fetch_session (void) {
+        rd_kafka_t *rk;
+        rd_kafka_broker_t *rkb;
+        shptr_rd_kafka_toppar_t *s_rktp[3];
+        rd_kafka_toppar_t *rktp[3];
+        rd_kafka_toppar_t *req[4];
+        int i, full, forgotten_cnt, sent_cnt;
+
+        rk = rd_unittest_rk_new(RD_KAFKA_CONSUMER, NULL);
+        RD_UT_ASSERT(rk, "failed to create instance");
+        rkb = rd_kafka_broker_internal(rk);
+        RD_UT_ASSERT(rkb, "no internal broker");
+
+        for (i = 0 ; i < 3 ; i++) {
+                s_rktp[i] = rd_kafka_toppar_get2(rk, "ut_fetch_session",
+                                                 i, 0, 1);
+                rktp[i] = rd_kafka_toppar_s2i(s_rktp[i]);
+                rktp[i]->rktp_offsets.fetch_offset = 100 * i;
+                req[i] = rktp[i];
+        }
+        req[3] = NULL;
+
+        /* A new session starts with a full request */
+        sent_cnt = ut_fetch_session_request(rkb, req, &full,
+                                            &forgotten_cnt);
+        RD_UT_ASSERT(full && sent_cnt == 3 && forgotten_cnt == 0,
+                     "expected full request with 3 partitions, "
+                     "not full=%d, %d sent, %d forgotten",
+                     full, sent_cnt, forgotten_cnt);
+        RD_UT_ASSERT(rkb->rkb_fetch_session.toppar_cnt == 3,
+                     "expected 3 partitions in session, not %d",
+                     rkb->rkb_fetch_session.toppar_cnt);
+        rd_kafka_broker_fetch_session_update(rkb, 1234);
+        RD_UT_ASSERT(rkb->rkb_fetch_session.id == 1234 &&
+                     rkb->rkb_fetch_session.epoch == 1,
+                     "expected session 1234 at epoch 1, not %"PRId32
+                     " at epoch %"PRId32,
+                     rkb->rkb_fetch_session.id,
+                     rkb->rkb_fetch_session.epoch);
+
+        /* Unchanged partitions are left out of incremental requests */
+        sent_cnt = ut_fetch_session_request(rkb, req, &full,
+                                            &forgotten_cnt);
+        RD_UT_ASSERT(!full && sent_cnt == 0 && forgotten_cnt == 0,
+                     "expected empty incremental request, "
+                     "not full=%d, %d sent, %d forgotten",
+                     full, sent_cnt, forgotten_cnt);
+        rd_kafka_broker_fetch_session_update(rkb, 1234);
+
+        /* Only the partition with a new fetch offset is sent */
+        rktp[1]->rktp_offsets.fetch_offset = 150;
+        sent_cnt = ut_fetch_session_request(rkb, req, &full,
+                                            &forgotten_cnt);
+        RD_UT_ASSERT(!full && sent_cnt == 1 && forgotten_cnt == 0,
+                     "expected incremental request with 1 partition, "
+                     "not full=%d, %d sent, %d forgotten",
+                     full, sent_cnt, forgotten_cnt);
+        rd_kafka_broker_fetch_session_update(rkb, 1234);
+
+        /* A partition no longer fetched (e.g., paused) is forgotten */
+        req[2] = NULL;
+        sent_cnt = ut_fetch_session_request(rkb, req, &full,
+                                            &forgotten_cnt);
+        RD_UT_ASSERT(!full && sent_cnt == 0 && forgotten_cnt == 1,
+                     "expected partition 2 to be forgotten, "
+                     "not full=%d, %d sent, %d forgotten",
+                     full, sent_cnt, forgotten_cnt);
+        rd_kafka_broker_fetch_session_update(rkb, 1234);
+
+        /* A partition leaving the broker is forgotten, as is a fetched
+         * partition that rejoins the session after leaving it. */
+        rd_kafka_broker_fetch_session_toppar_del(rkb, rktp[0]);
+        RD_UT_ASSERT(rkb->rkb_fetch_session.toppar_cnt == 1,
+                     "expected 1 partition in session, not %d",
+                     rkb->rkb_fetch_session.toppar_cnt);
+        req[0] = rktp[1];
+        req[1] = rktp[2];
+        sent_cnt = ut_fetch_session_request(rkb, req, &full,
+                                            &forgotten_cnt);
+        RD_UT_ASSERT(!full && sent_cnt == 1 && forgotten_cnt == 1,
+                     "expected partition 2 re-added and partition 0 "
+                     "forgotten, not full=%d, %d sent, %d forgotten",
+                     full, sent_cnt, forgotten_cnt);
+        rd_kafka_broker_fetch_session_update(rkb, 1234);
+        RD_UT_ASSERT(rkb->rkb_fetch_session.epoch == 5,
+                     "expected epoch 5, not %"PRId32,
+                     rkb->rkb_fetch_session.epoch);
+
+        /* A session error forces the next request to be a full request
+         * with all fetched partitions. */
+        rd_kafka_broker_fetch_session_reset(rkb, "unittest");
+        RD_UT_ASSERT(rkb->rkb_fetch_session.toppar_cnt == 0 &&
+                     rkb->rkb_fetch_session.epoch == 0,
+                     "expected reset session");
+        sent_cnt = ut_fetch_session_request(rkb, req, &full,
+                                            &forgotten_cnt);
+        RD_UT_ASSERT(full && sent_cnt == 2 && forgotten_cnt == 0,
+                     "expected full request with 2 partitions, "
+                     "not full=%d, %d sent, %d forgotten",
+                     full, sent_cnt, forgotten_cnt);
+
+        /* The session's partition references are released on reset */
+        rd_kafka_broker_fetch_session_reset(rkb, "unittest");
+
+        for (i = 0 ; i < 3 ; i++)
+                rd_kafka_toppar_destroy(s_rktp[i]);
+        rd_kafka_broker_destroy(rkb);
+        rd_kafka_destroy(rk);
+
+        RD_UT_PASS();
+}
+
+
+int unittest_broker (void) {
+        int fails = 0;
+
+        fails += unittest_fetch_session();
+
+        return fails;
+}
+
+/**@}*/
+
+
+
 
 
 
@@ -35,6 +35,25 @@
 extern const char *rd_kafka_broker_state_names[];
 extern const char *rd_kafka_secproto_names[];
 
+
+/**
+ * @brief A partition in the broker's fetch session (KIP-227) and what
+ *        was last sent for it.
+ *        Locality: broker thread
+ */
+typedef struct rd_kafka_fetch_session_toppar_s {
+        rd_avl_node_t rkfst_avlnode;   /**< rkb_fetch_session.avl */
+        TAILQ_ENTRY(rd_kafka_fetch_session_toppar_s) rkfst_link; /**<
+                                        * rkb_fetch_session.toppars */
+        shptr_rd_kafka_toppar_t *rkfst_s_rktp;
+        rd_kafka_toppar_t *rkfst_rktp; /**< Lookup key */
+        int64_t   rkfst_offset;        /**< FetchOffset last sent, or
+                                        *   INVALID if never sent. */
+        int32_t   rkfst_max_bytes;     /**< MaxBytes last sent. */
+        uint64_t  rkfst_gen;           /**< Last FetchRequest generation
+                                        *   this partition was part of. */
+} rd_kafka_fetch_session_toppar_t;
+
 struct rd_kafka_broker_s { /* rd_kafka_broker_t */
 	TAILQ_ENTRY(rd_kafka_broker_s) rkb_link;
 
@@ -78,12 +97,43 @@ struct rd_kafka_broker_s { /* rd_kafka_broker_t */
                                                       * This is used for
                                                       * round-robin. */
 
+        rd_list_t           rkb_produce_rktps;  /**< Producer: partitions
+                                                 *   ready to send in the
+                                                 *   current round, see
+                                                 *   rd_kafka_broker_
+                                                 *   produce_toppars().
+                                                 *   (rd_kafka_toppar_t *,
+                                                 *    not refcounted) */
+
 
         rd_kafka_cgrp_t    *rkb_cgrp;
 
 	rd_ts_t             rkb_ts_fetch_backoff;
 	int                 rkb_fetching;
 
+        /**
+         * Incremental fetch session (KIP-227),
+         * see rd_kafka_broker_fetch_toppars().
+         * Locality: broker thread
+         */
+        struct {
+                int32_t   id;        /**< SessionId, 0 if none. */
+                int32_t   epoch;     /**< SessionEpoch for the next
+                                      *   FetchRequest, 0 requests a
+                                      *   new session (full fetch). */
+                uint64_t  gen;       /**< FetchRequest generation, used
+                                      *   to find session partitions that
+                                      *   are no longer fetched. */
+                TAILQ_HEAD(, rd_kafka_fetch_session_toppar_s) toppars; /**<
+                                      *   Partitions in the session. */
+                int       toppar_cnt; /**< Number of partitions in
+                                       *   the session. */
+                rd_avl_t  avl;       /**< Session partitions by rktp. */
+                rd_list_t forgotten; /**< Partitions (shptr) to remove
+                                      *   from the session with the
+                                      *   next FetchRequest. */
+        } rkb_fetch_session;
+
 	enum {
 		RD_KAFKA_BROKER_STATE_INIT,
 		RD_KAFKA_BROKER_STATE_DOWN,
@@ -102,6 +152,10 @@ struct rd_kafka_broker_s { /* rd_kafka_broker_t */
                                                   * state change */
         rd_interval_t       rkb_timeout_scan_intvl;  /* Waitresp timeout scan
                                                       * interval. */
+        rd_interval_t       rkb_msg_timeout_scan_intvl; /**< Producer xmit
+                                                         *   queue message
+                                                         *   timeout scan
+                                                         *   interval. */
 
         rd_atomic32_t       rkb_blocking_request_cnt; /* The number of
                                                        * in-flight blocking
@@ -145,8 +199,19 @@ struct rd_kafka_broker_s { /* rd_kafka_broker_t */
                 rd_atomic64_t zbuf_grow;     /* Compression/decompression buffer grows needed */
                 rd_atomic64_t buf_grow;      /* rkbuf grows needed */
                 rd_atomic64_t wakeups;       /* Poll wakeups */
+
+                rd_atomic64_t fetch_full;    /* Full FetchRequests */
+                rd_atomic64_t fetch_incr;    /* Incremental FetchRequests */
+                rd_atomic64_t fetch_session_resets; /* Fetch session resets */
 	} rkb_c;
 
+        rd_kafka_op_cache_t rkb_fetch_op_cache; /**< Fetch ops reclaimed
+                                                 *   from rk_fetch_op_pool.
+                                                 *   Locality: broker thread */
+        rd_kafka_codec_ctx_t rkb_codec;         /**< (De)compression
+                                                 *   contexts.
+                                                 *   Locality: broker thread */
+
         int                 rkb_req_timeouts;  /* Current value */
 
         rd_ts_t             rkb_ts_tx_last;    /**< Timestamp of last
@@ -155,7 +220,33 @@ struct rd_kafka_broker_s { /* rd_kafka_broker_t */
 	rd_ts_t             rkb_ts_metadata_poll; /* Next metadata poll time */
 	int                 rkb_metadata_fast_poll_cnt; /* Perform fast
 							 * metadata polls. */
-	thrd_t              rkb_thread;
+	thrd_t              rkb_thread;        /* Broker thread, or the
+                                                * reactor thread serving
+                                                * this broker. */
+
+        /* Shared reactor thread (broker.threads > 0),
+         * all fields are owned by the reactor thread. */
+        struct rd_kafka_reactor_s *rkb_reactor; /**< Serving reactor,
+                                                 *   NULL if served by a
+                                                 *   dedicated thread. */
+        TAILQ_ENTRY(rd_kafka_broker_s) rkb_reactor_link;
+        rd_ts_t             rkb_reactor_next;  /**< Serve again at this
+                                                *   time, even without
+                                                *   events. RD_TS_MAX if
+                                                *   idle. */
+        rd_ts_t             rkb_reactor_idle_until; /**< Remainder of a
+                                                     *   ua_idle() period
+                                                     *   carried over to
+                                                     *   the next step. */
+        int                 rkb_reactor_idle_state; /**< State at the
+                                                     *   start of that
+                                                     *   idle period. */
+        rd_bool_t           rkb_reactor_ready; /**< IO or wake-up event */
+        int                 rkb_reactor_sfd;   /**< Socket fd registered
+                                                *   with the reactor,
+                                                *   or -1. */
+        int                 rkb_reactor_sevents; /**< Registered POLL..
+                                                  *   events for sfd. */
 
 	rd_refcnt_t         rkb_refcnt;
 
@@ -167,7 +258,17 @@ struct rd_kafka_broker_s { /* rd_kafka_broker_t */
 						 * requests to broker.
 						 * Compared to rkb_waitresps length.*/
 	rd_kafka_bufq_t     rkb_outbufs;
-	rd_kafka_bufq_t     rkb_waitresps;
+	rd_kafka_bufq_t     rkb_waitresps;      /**< Sent requests awaiting
+                                                 *   response, ordered by
+                                                 *   rkbuf_ts_timeout. */
+        rd_kafka_corridmap_t rkb_waitresp_map;  /**< rkb_waitresps indexed
+                                                 *   by CorrId. */
+        rd_kafka_bufq_t     rkb_zc_waitcompl; /**< Done requests whose
+                                               *   MSG_ZEROCOPY sends
+                                               *   are not yet completed
+                                               *   (socket.zerocopy),
+                                               *   see rd_kafka_broker_
+                                               *   zerocopy_hold() */
 	rd_kafka_bufq_t     rkb_retrybufs;
 
 	rd_avg_t            rkb_avg_int_latency;/* Current internal latency period*/
@@ -190,12 +291,12 @@ struct rd_kafka_broker_s { /* rd_kafka_broker_t */
         char               *rkb_logname;
         mtx_t               rkb_logname_lock;
 
-        int                 rkb_wakeup_fd[2];     /* Wake-up fds (r/w) to wake
+        rd_wakeup_t         rkb_wakeup;           /* Wake-up fd to wake
                                                    * up from IO-wait when
                                                    * queues have content. */
-        int                 rkb_toppar_wakeup_fd; /* Toppar msgq wakeup fd,
-                                                   * this is rkb_wakeup_fd[1]
-                                                   * if enabled. */
+        rd_wakeup_t        *rkb_toppar_wakeup;    /* Toppar msgq wake-up,
+                                                   * this is &rkb_wakeup
+                                                   * if enabled, else NULL. */
         rd_interval_t       rkb_connect_intvl;    /* Reconnect throttling */
 
 	rd_kafka_secproto_t rkb_proto;
@@ -304,6 +405,9 @@ void rd_kafka_broker_conn_closed (rd_kafka_broker_t *rkb,
 
 void rd_kafka_broker_destroy_final (rd_kafka_broker_t *rkb);
 
+rd_bool_t rd_kafka_broker_reactor_serve (rd_kafka_broker_t *rkb);
+void rd_kafka_broker_decommission (rd_kafka_broker_t *rkb);
+
 #define rd_kafka_broker_destroy(rkb)                                    \
         rd_refcnt_destroywrapper(&(rkb)->rkb_refcnt,                    \
                                  rd_kafka_broker_destroy_final(rkb))
@@ -321,6 +425,11 @@ void rd_kafka_broker_connect_up (rd_kafka_broker_t *rkb);
 void rd_kafka_broker_connect_done (rd_kafka_broker_t *rkb, const char *errstr);
 
 int rd_kafka_send (rd_kafka_broker_t *rkb);
+rd_bool_t rd_kafka_broker_zerocopy_hold (rd_kafka_broker_t *rkb,
+                                         rd_kafka_resp_err_t err,
+                                         rd_kafka_buf_t *response,
+                                         rd_kafka_buf_t *request);
+void rd_kafka_broker_zerocopy_serve (rd_kafka_broker_t *rkb);
 int rd_kafka_recv (rd_kafka_broker_t *rkb);
 
 void rd_kafka_dr_msgq (rd_kafka_itopic_t *rkt,
@@ -348,6 +457,7 @@ void msghdr_print (rd_kafka_t *rk,
 
 const char *rd_kafka_broker_name (rd_kafka_broker_t *rkb);
 void rd_kafka_broker_wakeup (rd_kafka_broker_t *rkb);
+int rd_kafka_all_brokers_wakeup (rd_kafka_t *rk, int min_state);
 
 int rd_kafka_brokers_get_state_version (rd_kafka_t *rk);
 int rd_kafka_brokers_wait_state_change (rd_kafka_t *rk, int stored_version,
@@ -382,4 +492,6 @@ void rd_kafka_broker_active_toppar_add (rd_kafka_broker_t *rkb,
 void rd_kafka_broker_active_toppar_del (rd_kafka_broker_t *rkb,
                                         rd_kafka_toppar_t *rktp);
 
+int unittest_broker (void);
+
 #endif /* _RDKAFKA_BROKER_H_ */
@@ -29,6 +29,7 @@
 #include "rdkafka_int.h"
 #include "rdkafka_buf.h"
 #include "rdkafka_broker.h"
+#include "rdunittest.h"
 
 void rd_kafka_buf_destroy_final (rd_kafka_buf_t *rkbuf) {
 
@@ -51,6 +52,18 @@ void rd_kafka_buf_destroy_final (rd_kafka_buf_t *rkbuf) {
                         mtx_unlock(rkbuf->rkbuf_u.Metadata.decr_lock);
                 }
                 break;
+
+        case RD_KAFKAP_Produce:
+                if (rkbuf->rkbuf_u.Produce.batches) {
+                        int i;
+                        for (i = 0 ; i < rkbuf->rkbuf_u.Produce.batch_cnt ;
+                             i++)
+                                rd_kafka_toppar_destroy(
+                                        rkbuf->rkbuf_u.Produce.batches[i].
+                                        s_rktp);
+                        rd_free(rkbuf->rkbuf_u.Produce.batches);
+                }
+                break;
         }
 
         if (rkbuf->rkbuf_response)
@@ -94,17 +107,20 @@ void rd_kafka_buf_push0 (rd_kafka_buf_t *rkbuf, const void *buf, size_t len,
  *        of initial backing memory.
  *        The underlying buffer will grow as needed.
  *
+ * If \p pool is non-NULL large backing memory is allocated from the pool.
+ *
  * If \p rk is non-NULL (typical case):
  * Additional space for the Kafka protocol headers is inserted automatically.
  */
-rd_kafka_buf_t *rd_kafka_buf_new0 (int segcnt, size_t size, int flags) {
+rd_kafka_buf_t *rd_kafka_buf_new0 (int segcnt, size_t size, int flags,
+                                   rd_bufpool_t *pool) {
         rd_kafka_buf_t *rkbuf;
 
         rkbuf = rd_calloc(1, sizeof(*rkbuf));
 
         rkbuf->rkbuf_flags = flags;
 
-        rd_buf_init(&rkbuf->rkbuf_buf, segcnt, size);
+        rd_buf_init_pool(&rkbuf->rkbuf_buf, pool, segcnt, size);
         rd_kafka_msgq_init(&rkbuf->rkbuf_msgq);
         rd_refcnt_init(&rkbuf->rkbuf_refcnt, 1);
 
@@ -125,7 +141,7 @@ rd_kafka_buf_t *rd_kafka_buf_new_request (rd_kafka_broker_t *rkb, int16_t ApiKey
                 RD_KAFKAP_STR_SIZE(rkb->rkb_rk->rk_client_id);
         segcnt += 1; /* headers */
 
-        rkbuf = rd_kafka_buf_new0(segcnt, size, 0);
+        rkbuf = rd_kafka_buf_new0(segcnt, size, 0, rkb->rkb_rk->rk_bufpool);
 
         rkbuf->rkbuf_rkb = rkb;
         rd_kafka_broker_keep(rkb);
@@ -310,6 +326,219 @@ void rd_kafka_bufq_dump (rd_kafka_broker_t *rkb, const char *fac,
 
 
 
+/**
+ * @returns the home slot of \p corrid in a table of \p size slots.
+ */
+#define RD_KAFKA_CORRIDMAP_SLOT(corrid,size)            \
+        ((int32_t)((uint32_t)(corrid) & (uint32_t)((size) - 1)))
+
+void rd_kafka_corridmap_init (rd_kafka_corridmap_t *rkcm) {
+        memset(rkcm, 0, sizeof(*rkcm));
+}
+
+void rd_kafka_corridmap_destroy (rd_kafka_corridmap_t *rkcm) {
+        if (rkcm->rkcm_slots)
+                rd_free(rkcm->rkcm_slots);
+        rd_kafka_corridmap_init(rkcm);
+}
+
+/**
+ * @brief Remove all buffers from the index, keeping the allocated slots.
+ */
+void rd_kafka_corridmap_clear (rd_kafka_corridmap_t *rkcm) {
+        if (rkcm->rkcm_cnt > 0)
+                memset(rkcm->rkcm_slots, 0,
+                       sizeof(*rkcm->rkcm_slots) * rkcm->rkcm_size);
+        rkcm->rkcm_cnt = 0;
+}
+
+/**
+ * @brief Place \p rkbuf in its first free slot, no size checks.
+ */
+static void rd_kafka_corridmap_place (rd_kafka_corridmap_t *rkcm,
+                                      rd_kafka_buf_t *rkbuf) {
+        int32_t i = RD_KAFKA_CORRIDMAP_SLOT(rkbuf->rkbuf_corrid,
+                                            rkcm->rkcm_size);
+
+        while (rkcm->rkcm_slots[i]) {
+                rd_dassert(rkcm->rkcm_slots[i]->rkbuf_corrid !=
+                           rkbuf->rkbuf_corrid);
+                i = (i + 1) & (rkcm->rkcm_size - 1);
+        }
+
+        rkcm->rkcm_slots[i] = rkbuf;
+}
+
+/**
+ * @brief Double the table size (initially 32 slots) and rehash.
+ */
+static void rd_kafka_corridmap_grow (rd_kafka_corridmap_t *rkcm) {
+        rd_kafka_buf_t **old = rkcm->rkcm_slots;
+        int32_t old_size = rkcm->rkcm_size;
+        int32_t i;
+
+        rkcm->rkcm_size = old_size ? old_size * 2 : 32;
+        rkcm->rkcm_slots = rd_calloc(rkcm->rkcm_size,
+                                     sizeof(*rkcm->rkcm_slots));
+
+        for (i = 0 ; i < old_size ; i++)
+                if (old[i])
+                        rd_kafka_corridmap_place(rkcm, old[i]);
+
+        if (old)
+                rd_free(old);
+}
+
+/**
+ * @brief Index \p rkbuf by its (non-zero, unique) \c rkbuf_corrid.
+ */
+void rd_kafka_corridmap_insert (rd_kafka_corridmap_t *rkcm,
+                                rd_kafka_buf_t *rkbuf) {
+        if (unlikely((rkcm->rkcm_cnt + 1) * 2 > rkcm->rkcm_size))
+                rd_kafka_corridmap_grow(rkcm);
+
+        rd_kafka_corridmap_place(rkcm, rkbuf);
+        rkcm->rkcm_cnt++;
+}
+
+/**
+ * @returns the slot holding \p corrid, or -1 if not found.
+ */
+static int32_t rd_kafka_corridmap_slot (const rd_kafka_corridmap_t *rkcm,
+                                        int32_t corrid) {
+        int32_t i;
+
+        if (unlikely(rkcm->rkcm_cnt == 0))
+                return -1;
+
+        i = RD_KAFKA_CORRIDMAP_SLOT(corrid, rkcm->rkcm_size);
+        while (rkcm->rkcm_slots[i]) {
+                if (rkcm->rkcm_slots[i]->rkbuf_corrid == corrid)
+                        return i;
+                i = (i + 1) & (rkcm->rkcm_size - 1);
+        }
+
+        return -1;
+}
+
+/**
+ * @returns the indexed buffer with correlation id \p corrid, or NULL.
+ */
+rd_kafka_buf_t *rd_kafka_corridmap_find (const rd_kafka_corridmap_t *rkcm,
+                                         int32_t corrid) {
+        int32_t i = rd_kafka_corridmap_slot(rkcm, corrid);
+
+        return i == -1 ? NULL : rkcm->rkcm_slots[i];
+}
+
+/**
+ * @brief Remove \p rkbuf from the index.
+ *
+ * Uses backward-shift deletion so that no tombstones are needed:
+ * following entries of the probe run are moved up into the freed
+ * slot unless that would place them before their home slot.
+ */
+void rd_kafka_corridmap_remove (rd_kafka_corridmap_t *rkcm,
+                                rd_kafka_buf_t *rkbuf) {
+        int32_t mask = rkcm->rkcm_size - 1;
+        int32_t i = rd_kafka_corridmap_slot(rkcm, rkbuf->rkbuf_corrid);
+        int32_t j;
+
+        rd_assert(i != -1 && rkcm->rkcm_slots[i] == rkbuf);
+
+        rkcm->rkcm_slots[i] = NULL;
+        rkcm->rkcm_cnt--;
+
+        for (j = (i + 1) & mask ; rkcm->rkcm_slots[j] ; j = (j + 1) & mask) {
+                int32_t home = RD_KAFKA_CORRIDMAP_SLOT(
+                        rkcm->rkcm_slots[j]->rkbuf_corrid, rkcm->rkcm_size);
+
+                /* Leave the entry if its home slot lies cyclically
+                 * in (i, j]. */
+                if (i <= j ? (i < home && home <= j) :
+                    (i < home || home <= j))
+                        continue;
+
+                rkcm->rkcm_slots[i] = rkcm->rkcm_slots[j];
+                rkcm->rkcm_slots[j] = NULL;
+                i = j;
+        }
+}
+
+
+/**
+ * @brief Unit test for the correlation id index.
+ */
+int unittest_corridmap (void) {
+        rd_kafka_corridmap_t rkcm;
+        rd_kafka_buf_t bufs[112];
+        int i;
+
+        memset(bufs, 0, sizeof(bufs));
+        rd_kafka_corridmap_init(&rkcm);
+
+        RD_UT_ASSERT(!rd_kafka_corridmap_find(&rkcm, 1),
+                     "empty map should not find anything");
+
+        /* Sequential corrids, forcing a couple of grows. */
+        for (i = 0 ; i < 100 ; i++) {
+                bufs[i].rkbuf_corrid = i + 1;
+                rd_kafka_corridmap_insert(&rkcm, &bufs[i]);
+        }
+        RD_UT_ASSERT(rkcm.rkcm_cnt == 100 && rkcm.rkcm_size == 256,
+                     "expected 100 entries in 256 slots, not %d in %d",
+                     (int)rkcm.rkcm_cnt, (int)rkcm.rkcm_size);
+
+        /* Out of order removal, as responses and timeouts would. */
+        for (i = 0 ; i < 100 ; i += 3)
+                rd_kafka_corridmap_remove(&rkcm, &bufs[i]);
+        for (i = 0 ; i < 100 ; i++) {
+                rd_kafka_buf_t *exp = (i % 3) ? &bufs[i] : NULL;
+                RD_UT_ASSERT(rd_kafka_corridmap_find(&rkcm, i + 1) == exp,
+                             "corrid %d: wrong lookup result", i + 1);
+        }
+
+        /* Colliding corrids (same home slot) that wrap around the end
+         * of the table, removed from the middle of the probe run. */
+        rd_kafka_corridmap_clear(&rkcm);
+        for (i = 100 ; i < 110 ; i++) {
+                bufs[i].rkbuf_corrid = 250 + (i - 100) * 256;
+                rd_kafka_corridmap_insert(&rkcm, &bufs[i]);
+        }
+        bufs[110].rkbuf_corrid = 255;
+        rd_kafka_corridmap_insert(&rkcm, &bufs[110]);
+        bufs[111].rkbuf_corrid = 1;
+        rd_kafka_corridmap_insert(&rkcm, &bufs[111]);
+
+        rd_kafka_corridmap_remove(&rkcm, &bufs[102]);
+        rd_kafka_corridmap_remove(&rkcm, &bufs[100]);
+        for (i = 100 ; i < 112 ; i++)
+                RD_UT_ASSERT(rd_kafka_corridmap_find(
+                                     &rkcm, bufs[i].rkbuf_corrid) ==
+                             (i == 100 || i == 102 ? NULL : &bufs[i]),
+                             "corrid %"PRId32": wrong lookup result",
+                             bufs[i].rkbuf_corrid);
+
+        for (i = 101 ; i < 112 ; i++)
+                if (i != 102)
+                        rd_kafka_corridmap_remove(&rkcm, &bufs[i]);
+        RD_UT_ASSERT(rkcm.rkcm_cnt == 0, "map should be empty");
+        for (i = 0 ; i < rkcm.rkcm_size ; i++)
+                RD_UT_ASSERT(!rkcm.rkcm_slots[i], "slot %d not cleared", i);
+
+        /* Negative corrids (after int32 wrap-around) */
+        bufs[0].rkbuf_corrid = -5;
+        rd_kafka_corridmap_insert(&rkcm, &bufs[0]);
+        RD_UT_ASSERT(rd_kafka_corridmap_find(&rkcm, -5) == &bufs[0],
+                     "negative corrid not found");
+        rd_kafka_corridmap_remove(&rkcm, &bufs[0]);
+
+        rd_kafka_corridmap_destroy(&rkcm);
+        RD_UT_PASS();
+}
+
+
+
 /**
  * @brief Calculate the effective timeout for a request attempt
  */
@@ -418,6 +647,11 @@ void rd_kafka_buf_callback (rd_kafka_t *rk,
 			    rd_kafka_broker_t *rkb, rd_kafka_resp_err_t err,
                             rd_kafka_buf_t *response, rd_kafka_buf_t *request){
 
+        /* Neither report, retry nor free the request while the kernel
+         * may still read its MSG_ZEROCOPY sent memory. */
+        if (unlikely(request->rkbuf_flags & RD_KAFKA_OP_F_ZEROCOPY) && rkb &&
+            rd_kafka_broker_zerocopy_hold(rkb, err, response, request))
+                return;
 
         if (err != RD_KAFKA_RESP_ERR__DESTROY && request->rkbuf_replyq.q) {
                 rd_kafka_op_t *rko = rd_kafka_op_new(RD_KAFKA_OP_RECV_BUF);
@@ -449,6 +449,29 @@ typedef void (rd_kafka_resp_cb_t) (rd_kafka_t *rk,
                                    rd_kafka_buf_t *request,
                                    void *opaque);
 
+
+/**
+ * @brief A partition's MessageSet in a ProduceRequest.
+ *
+ * A ProduceRequest may carry MessageSets for any number of partitions,
+ * the messages of all batches are kept back-to-back in batch order
+ * in the request's rkbuf_msgq.
+ */
+typedef struct rd_kafka_produce_batch_s {
+        shptr_rd_kafka_toppar_t *s_rktp; /**< Partition (refcounted) */
+        int     msgcnt;                  /**< Number of messages in batch,
+                                          *   accounted as in-flight by the
+                                          *   idempotent producer. */
+        size_t  MessageSetSize;          /**< Final MessageSetSize */
+        rd_ts_t ts_timeout;              /**< First message's timeout */
+
+        /* Fields populated from the ProduceResponse */
+        rd_kafka_resp_err_t err;         /**< Partition error */
+        int64_t offset;                  /**< Assigned base offset */
+        int64_t timestamp;               /**< LogAppendTime, or -1 */
+} rd_kafka_produce_batch_t;
+
+
 struct rd_kafka_buf_s { /* rd_kafka_buf_t */
 	TAILQ_ENTRY(rd_kafka_buf_s) rkbuf_link;
 
@@ -508,6 +531,14 @@ struct rd_kafka_buf_s { /* rd_kafka_buf_t */
 	rd_ts_t rkbuf_ts_enq;
 	rd_ts_t rkbuf_ts_sent;    /* Initially: Absolute time of transmission,
 				   * after response: RTT. */
+        uint32_t rkbuf_zc_id;     /**< Zerocopy send id following the
+                                   *   buffer's last MSG_ZEROCOPY send,
+                                   *   see rd_kafka_transport_zerocopy_id() */
+        rd_kafka_resp_err_t rkbuf_zc_err; /**< Held request's error,
+                                           *   see rd_kafka_broker_
+                                           *   zerocopy_hold() */
+        struct rd_kafka_buf_s *rkbuf_zc_response; /**< Held request's
+                                                   *   response, if any. */
 
         /* Request timeouts:
          *  rkbuf_ts_timeout is the effective absolute request timeout used
@@ -576,6 +607,14 @@ struct rd_kafka_buf_s { /* rd_kafka_buf_t */
                         mtx_t *decr_lock;
 
                 } Metadata;
+                struct {
+                        rd_kafka_pid_t pid; /**< Idempotent producer:
+                                             *   PID the request was
+                                             *   created with. */
+                        rd_kafka_produce_batch_t *batches; /**< Per-partition
+                                                            *   MessageSets */
+                        int batch_cnt;      /**< Number of batches */
+                } Produce;
         } rkbuf_u;
 
         const char *rkbuf_uflow_mitigation; /**< Buffer read underflow
@@ -595,13 +634,43 @@ struct rd_kafka_buf_s { /* rd_kafka_buf_t */
         ((rkbuf)->rkbuf_flags & RD_KAFKA_OP_F_SENT)
 
 typedef struct rd_kafka_bufq_s {
-	TAILQ_HEAD(, rd_kafka_buf_s) rkbq_bufs;
+	TAILQ_HEAD(rd_kafka_buf_head_s, rd_kafka_buf_s) rkbq_bufs;
 	rd_atomic32_t  rkbq_cnt;
 	rd_atomic32_t  rkbq_msg_cnt;
 } rd_kafka_bufq_t;
 
 #define rd_kafka_bufq_cnt(rkbq) rd_atomic32_get(&(rkbq)->rkbq_cnt)
 
+
+/**
+ * @brief Correlation id index of in-flight requests.
+ *
+ * Open-addressed (linear probing) table of buffers keyed by
+ * \c rkbuf_corrid. CorrIds are allocated sequentially per broker
+ * so \c corrid & mask maps a window of in-flight requests to distinct
+ * slots and lookups are O(1) in practice.
+ * The table grows to keep the load factor below 50%.
+ *
+ * @locality broker thread
+ */
+typedef struct rd_kafka_corridmap_s {
+        rd_kafka_buf_t **rkcm_slots; /**< Slots, NULL if unused */
+        int32_t          rkcm_size;  /**< Number of slots (power of two) */
+        int32_t          rkcm_cnt;   /**< Number of used slots */
+} rd_kafka_corridmap_t;
+
+void rd_kafka_corridmap_init (rd_kafka_corridmap_t *rkcm);
+void rd_kafka_corridmap_destroy (rd_kafka_corridmap_t *rkcm);
+void rd_kafka_corridmap_clear (rd_kafka_corridmap_t *rkcm);
+void rd_kafka_corridmap_insert (rd_kafka_corridmap_t *rkcm,
+                                rd_kafka_buf_t *rkbuf);
+rd_kafka_buf_t *rd_kafka_corridmap_find (const rd_kafka_corridmap_t *rkcm,
+                                         int32_t corrid);
+void rd_kafka_corridmap_remove (rd_kafka_corridmap_t *rkcm,
+                                rd_kafka_buf_t *rkbuf);
+
+int unittest_corridmap (void);
+
 /**
  * @brief Set buffer's request timeout to relative \p timeout_ms measured
  *        from the time the buffer is sent on the underlying socket.
@@ -654,9 +723,10 @@ void rd_kafka_buf_push0 (rd_kafka_buf_t *rkbuf, const void *buf, size_t len,
                          int allow_crc_calc, void (*free_cb) (void *));
 #define rd_kafka_buf_push(rkbuf,buf,len,free_cb)                        \
         rd_kafka_buf_push0(rkbuf,buf,len,1/*allow_crc*/,free_cb)
-rd_kafka_buf_t *rd_kafka_buf_new0 (int segcnt, size_t size, int flags);
+rd_kafka_buf_t *rd_kafka_buf_new0 (int segcnt, size_t size, int flags,
+                                   rd_bufpool_t *pool);
 #define rd_kafka_buf_new(segcnt,size) \
-        rd_kafka_buf_new0(segcnt,size,0)
+        rd_kafka_buf_new0(segcnt,size,0,NULL)
 rd_kafka_buf_t *rd_kafka_buf_new_request (rd_kafka_broker_t *rkb, int16_t ApiKey,
                                           int segcnt, size_t size);
 rd_kafka_buf_t *rd_kafka_buf_new_shadow (const void *ptr, size_t size,
@@ -45,6 +45,20 @@ static void rd_kafka_cgrp_offset_commit_tmr_cb (rd_kafka_timers_t *rkts,
 static void rd_kafka_cgrp_assign (rd_kafka_cgrp_t *rkcg,
 				  rd_kafka_topic_partition_list_t *assignment);
 static rd_kafka_resp_err_t rd_kafka_cgrp_unassign (rd_kafka_cgrp_t *rkcg);
+static rd_kafka_resp_err_t
+rd_kafka_cgrp_incremental_assign (rd_kafka_cgrp_t *rkcg,
+                                  const rd_kafka_topic_partition_list_t
+                                  *partitions);
+static rd_kafka_resp_err_t
+rd_kafka_cgrp_incremental_unassign (rd_kafka_cgrp_t *rkcg,
+                                    const rd_kafka_topic_partition_list_t
+                                    *partitions);
+static void rd_kafka_cgrp_incr_fetch_start (rd_kafka_cgrp_t *rkcg);
+static void rd_kafka_cgrp_incr_rejoin_check (rd_kafka_cgrp_t *rkcg,
+                                             const char *reason);
+static void rd_kafka_cgrp_incr_revoke_done (rd_kafka_cgrp_t *rkcg);
+static void rd_kafka_cgrp_group_assignment_clear (rd_kafka_cgrp_t *rkcg,
+                                                  const char *reason);
 static void
 rd_kafka_cgrp_partitions_fetch_start0 (rd_kafka_cgrp_t *rkcg,
 				       rd_kafka_topic_partition_list_t
@@ -157,6 +171,12 @@ void rd_kafka_cgrp_destroy_final (rd_kafka_cgrp_t *rkcg) {
         rd_kafka_assert(rkcg->rkcg_rk, !rkcg->rkcg_subscription);
         rd_kafka_assert(rkcg->rkcg_rk, !rkcg->rkcg_group_leader.members);
         rd_kafka_cgrp_set_member_id(rkcg, NULL);
+        if (rkcg->rkcg_group_assignment)
+                rd_kafka_topic_partition_list_destroy(
+                        rkcg->rkcg_group_assignment);
+        if (rkcg->rkcg_rebalance_incr_assignment)
+                rd_kafka_topic_partition_list_destroy(
+                        rkcg->rkcg_rebalance_incr_assignment);
 
         rd_kafka_q_destroy_owner(rkcg->rkcg_q);
         rd_kafka_q_destroy_owner(rkcg->rkcg_ops);
@@ -183,6 +203,7 @@ rd_kafka_cgrp_t *rd_kafka_cgrp_new (rd_kafka_t *rk,
         rkcg->rkcg_client_id = client_id;
         rkcg->rkcg_coord_id = -1;
         rkcg->rkcg_generation_id = -1;
+        rkcg->rkcg_group_assignment_generation_id = -1;
 	rkcg->rkcg_version = 1;
 
         mtx_init(&rkcg->rkcg_lock, mtx_plain);
@@ -647,6 +668,77 @@ rd_kafka_rebalance_op (rd_kafka_cgrp_t *rkcg,
 }
 
 
+/**
+ * @brief Incremental (cooperative) counterpart of rd_kafka_rebalance_op():
+ *        \p partitions are the partitions to add to (ASSIGN) or remove
+ *        from (REVOKE) the current assignment, which is otherwise left
+ *        untouched and keeps fetching.
+ *
+ * The application's rebalance_cb is expected to call
+ * rd_kafka_incremental_assign() or rd_kafka_incremental_unassign().
+ *
+ * Returns 1 if a rebalance op was enqueued, else 0 in which case the
+ * incremental assign or unassign has been performed.
+ */
+static int
+rd_kafka_rebalance_op_incr (rd_kafka_cgrp_t *rkcg,
+                            rd_kafka_resp_err_t err,
+                            rd_kafka_topic_partition_list_t *partitions,
+                            const char *reason) {
+	rd_kafka_op_t *rko;
+
+        rd_kafka_wrlock(rkcg->rkcg_rk);
+        rkcg->rkcg_c.ts_rebalance = rd_clock();
+        rkcg->rkcg_c.rebalance_cnt++;
+        rd_kafka_wrunlock(rkcg->rkcg_rk);
+
+        /* Only pause the partitions being revoked */
+        if (err == RD_KAFKA_RESP_ERR__REVOKE_PARTITIONS)
+                rd_kafka_toppars_pause_resume(rkcg->rkcg_rk, 1,
+                                              RD_KAFKA_TOPPAR_F_LIB_PAUSE,
+                                              partitions);
+
+	if (!(rkcg->rkcg_rk->rk_conf.enabled_events & RD_KAFKA_EVENT_REBALANCE)
+            || rd_kafka_destroy_flags_no_consumer_close(rkcg->rkcg_rk)) {
+	no_delegation:
+		if (err == RD_KAFKA_RESP_ERR__ASSIGN_PARTITIONS)
+			rd_kafka_cgrp_incremental_assign(rkcg, partitions);
+		else
+			rd_kafka_cgrp_incremental_unassign(rkcg, partitions);
+		return 0;
+	}
+
+	rd_kafka_dbg(rkcg->rkcg_rk, CGRP, "ASSIGN",
+		     "Group \"%s\": delegating incremental %s of %d "
+                     "partition(s) to application rebalance callback "
+                     "on queue %s: %s",
+		     rkcg->rkcg_group_id->str,
+		     err == RD_KAFKA_RESP_ERR__REVOKE_PARTITIONS ?
+		     "revoke":"assign", partitions->cnt,
+		     rd_kafka_q_dest_name(rkcg->rkcg_q), reason);
+
+	rd_kafka_cgrp_set_join_state(
+		rkcg,
+		err == RD_KAFKA_RESP_ERR__ASSIGN_PARTITIONS ?
+		RD_KAFKA_CGRP_JOIN_STATE_WAIT_ASSIGN_REBALANCE_CB :
+		RD_KAFKA_CGRP_JOIN_STATE_WAIT_REVOKE_REBALANCE_CB);
+
+	rko = rd_kafka_op_new(RD_KAFKA_OP_REBALANCE);
+	rko->rko_err = err;
+	rko->rko_u.rebalance.partitions =
+		rd_kafka_topic_partition_list_copy(partitions);
+
+	if (rd_kafka_q_enq(rkcg->rkcg_q, rko) == 0) {
+		/* Queue disabled, handle assignment here. */
+                rd_kafka_cgrp_set_join_state(
+                        rkcg, RD_KAFKA_CGRP_JOIN_STATE_ASSIGNED);
+		goto no_delegation;
+	}
+
+	return 1;
+}
+
+
 /**
  * @brief Run group assignment.
  */
@@ -789,6 +881,36 @@ rd_kafka_group_MemberMetadata_consumer_read (
         rd_kafka_buf_read_bytes(rkbuf, &UserData);
         rkgm->rkgm_userdata = rd_kafkap_bytes_copy(&UserData);
 
+        if (Version >= 1 && rd_kafka_buf_read_remain(rkbuf) >= 4) {
+                /* OwnedPartitions */
+                int32_t TopicCnt;
+
+                rd_kafka_buf_read_i32(rkbuf, &TopicCnt);
+                if (TopicCnt > 10000)
+                        goto err;
+
+                rkgm->rkgm_owned = rd_kafka_topic_partition_list_new(
+                        RD_MAX(TopicCnt, 0));
+
+                while (TopicCnt-- > 0) {
+                        rd_kafkap_str_t Topic;
+                        int32_t PartCnt;
+                        char *topic_name;
+
+                        rd_kafka_buf_read_str(rkbuf, &Topic);
+                        rd_kafka_buf_read_i32(rkbuf, &PartCnt);
+                        RD_KAFKAP_STR_DUPA(&topic_name, &Topic);
+
+                        while (PartCnt-- > 0) {
+                                int32_t Partition;
+                                rd_kafka_buf_read_i32(rkbuf, &Partition);
+                                rd_kafka_topic_partition_list_add(
+                                        rkgm->rkgm_owned, topic_name,
+                                        Partition);
+                        }
+                }
+        }
+
         rd_kafka_buf_destroy(rkbuf);
 
         return 0;
@@ -806,6 +928,14 @@ rd_kafka_group_MemberMetadata_consumer_read (
                                                       rkgm_subscription);
                 rkgm->rkgm_subscription = NULL;
         }
+        if (rkgm->rkgm_userdata) {
+                rd_kafkap_bytes_destroy(rkgm->rkgm_userdata);
+                rkgm->rkgm_userdata = NULL;
+        }
+        if (rkgm->rkgm_owned) {
+                rd_kafka_topic_partition_list_destroy(rkgm->rkgm_owned);
+                rkgm->rkgm_owned = NULL;
+        }
 
         rd_kafka_buf_destroy(rkbuf);
         return -1;
@@ -879,10 +1009,15 @@ static void rd_kafka_cgrp_handle_JoinGroup (rd_kafka_t *rk,
 
         if (!ErrorCode) {
                 char *my_member_id;
+                char *protocol_name;
                 RD_KAFKAP_STR_DUPA(&my_member_id, &MyMemberId);
+                RD_KAFKAP_STR_DUPA(&protocol_name, &Protocol);
                 rkcg->rkcg_generation_id = GenerationId;
                 rd_kafka_cgrp_set_member_id(rkcg, my_member_id);
                 i_am_leader = !rd_kafkap_str_cmp(&LeaderId, &MyMemberId);
+                /* The selected assignor decides the rebalance protocol */
+                rkcg->rkcg_assignor = rd_kafka_assignor_find(rk,
+                                                             protocol_name);
         } else {
                 rd_interval_backoff(&rkcg->rkcg_join_intvl, 1000*1000);
                 goto err;
@@ -1004,8 +1139,11 @@ err:
                                           "JoinGroup failed: %s",
                                           rd_kafka_err2str(ErrorCode));
 
-                if (ErrorCode == RD_KAFKA_RESP_ERR_UNKNOWN_MEMBER_ID)
+                if (ErrorCode == RD_KAFKA_RESP_ERR_UNKNOWN_MEMBER_ID) {
                         rd_kafka_cgrp_set_member_id(rkcg, "");
+                        rd_kafka_cgrp_group_assignment_clear(
+                                rkcg, "member id reset");
+                }
                 rd_kafka_cgrp_set_join_state(rkcg,
                                              RD_KAFKA_CGRP_JOIN_STATE_INIT);
         }
@@ -1200,6 +1338,8 @@ static void rd_kafka_cgrp_join (rd_kafka_cgrp_t *rkcg) {
                                   rkcg->rkcg_member_id,
                                   rkcg->rkcg_rk->rk_conf.group_protocol_type,
                                   rkcg->rkcg_subscribed_topics,
+                                  rkcg->rkcg_group_assignment,
+                                  rkcg->rkcg_group_assignment_generation_id,
                                   RD_KAFKA_REPLYQ(rkcg->rkcg_ops, 0),
                                   rd_kafka_cgrp_handle_JoinGroup, rkcg);
 }
@@ -1220,6 +1360,23 @@ static void rd_kafka_cgrp_rejoin (rd_kafka_cgrp_t *rkcg) {
                      rd_kafka_cgrp_join_state_names[rkcg->rkcg_join_state],
                      rkcg->rkcg_assignment ? "" : "out");
 
+        if (rkcg->rkcg_assignment &&
+            !(rkcg->rkcg_flags & RD_KAFKA_CGRP_F_WAIT_UNASSIGN) &&
+            rd_kafka_cgrp_rebalance_protocol(rkcg) ==
+            RD_KAFKA_REBALANCE_PROTOCOL_COOPERATIVE) {
+                /* Keep the current assignment and fetchers running
+                 * through the rebalance, partitions that need to move
+                 * are revoked incrementally once the new assignment
+                 * is known. */
+                if (rkcg->rkcg_join_state == RD_KAFKA_CGRP_JOIN_STATE_INIT) {
+                        rd_kafka_cgrp_join(rkcg);
+                } else {
+                        rkcg->rkcg_flags |= RD_KAFKA_CGRP_F_WAIT_REJOIN;
+                        rd_kafka_cgrp_incr_rejoin_check(rkcg, "rejoin");
+                }
+                return;
+        }
+
         /* Remove assignment (async), if any. If there is already an
          * unassign in progress we dont need to bother. */
         if (rkcg->rkcg_assignment) {
@@ -1638,6 +1795,35 @@ rd_kafka_cgrp_partitions_fetch_start0 (rd_kafka_cgrp_t *rkcg,
 		return;
 	}
 
+        if (rd_kafka_cgrp_rebalance_protocol(rkcg) ==
+            RD_KAFKA_REBALANCE_PROTOCOL_COOPERATIVE) {
+                /* With incremental rebalancing the fetchers of partitions
+                 * that were retained from the previous assignment are
+                 * left running as-is: only start the new ones. */
+                rd_kafka_topic_partition_list_t *unstarted =
+                        rd_kafka_topic_partition_list_new(assignment->cnt);
+
+                for (i = 0 ; i < assignment->cnt ; i++) {
+                        rd_kafka_toppar_t *rktp = rd_kafka_toppar_s2i(
+                                (shptr_rd_kafka_toppar_t *)
+                                assignment->elems[i]._private);
+                        if (!rktp->rktp_assigned)
+                                rd_kafka_topic_partition_copy(
+                                        unstarted, &assignment->elems[i]);
+                }
+
+                if (unstarted->cnt < assignment->cnt) {
+                        if (unstarted->cnt > 0)
+                                rd_kafka_cgrp_partitions_fetch_start0(
+                                        rkcg, unstarted, usable_offsets,
+                                        line);
+                        rd_kafka_topic_partition_list_destroy(unstarted);
+                        return;
+                }
+
+                rd_kafka_topic_partition_list_destroy(unstarted);
+        }
+
 	rd_kafka_cgrp_version_new_barrier(rkcg);
 
         rd_kafka_dbg(rkcg->rkcg_rk, CGRP, "FETCHSTART",
@@ -1708,7 +1894,10 @@ rd_kafka_cgrp_partitions_fetch_start0 (rd_kafka_cgrp_t *rkcg,
                 }
         }
 
-	rd_kafka_assert(NULL, rkcg->rkcg_assigned_cnt <=
+	/* Partitions removed by an incremental unassign are still
+	 * counted as assigned until their fetchers have stopped. */
+	rd_kafka_assert(NULL, rkcg->rkcg_assigned_cnt -
+			rkcg->rkcg_wait_unassign_cnt <=
 			(rkcg->rkcg_assignment ? rkcg->rkcg_assignment->cnt : 0));
 }
 
@@ -1880,6 +2069,11 @@ static void rd_kafka_cgrp_op_handle_OffsetCommit (rd_kafka_t *rk,
                                                              rkcg->rkcg_assignment, 0);
 	}
 
+        /* A pending cooperative rejoin may have been waiting for the
+         * revoked partitions' offsets to be committed. */
+        if (err != RD_KAFKA_RESP_ERR__DESTROY)
+                rd_kafka_cgrp_incr_rejoin_check(rkcg, "OffsetCommit done");
+
 	if (err == RD_KAFKA_RESP_ERR__DESTROY ||
             (err == RD_KAFKA_RESP_ERR__NO_OFFSET &&
              rko_orig->rko_u.offset_commit.silent_empty)) {
@@ -2204,7 +2398,22 @@ rd_kafka_cgrp_unassign (rd_kafka_cgrp_t *rkcg) {
         rd_kafka_cgrp_set_join_state(rkcg,
                                      RD_KAFKA_CGRP_JOIN_STATE_WAIT_UNASSIGN);
 
-	rkcg->rkcg_flags &= ~RD_KAFKA_CGRP_F_WAIT_UNASSIGN;
+	rkcg->rkcg_flags &= ~(RD_KAFKA_CGRP_F_WAIT_UNASSIGN|
+                              RD_KAFKA_CGRP_F_WAIT_REJOIN);
+        if (rkcg->rkcg_rebalance_incr_assignment) {
+                /* Pending incremental assign is superseded */
+                rd_kafka_topic_partition_list_destroy(
+                        rkcg->rkcg_rebalance_incr_assignment);
+                rkcg->rkcg_rebalance_incr_assignment = NULL;
+        }
+        /* The eager protocol revokes the full assignment on every
+         * rebalance and retains it as the owned partitions for the
+         * next JoinGroup, while a full unassign under the cooperative
+         * protocol means the partitions are given up or lost. */
+        if (rd_kafka_cgrp_rebalance_protocol(rkcg) ==
+            RD_KAFKA_REBALANCE_PROTOCOL_COOPERATIVE)
+                rd_kafka_cgrp_group_assignment_clear(rkcg, "full unassign");
+
         old_assignment = rkcg->rkcg_assignment;
         if (!old_assignment) {
 		rd_kafka_cgrp_check_unassign_done(
@@ -2350,6 +2559,379 @@ rd_kafka_cgrp_assign (rd_kafka_cgrp_t *rkcg,
 
 
 
+/**
+ * @brief Start fetchers for the assigned partitions that are not fetching
+ *        yet, leaving the already started ones untouched.
+ *
+ * This is a no-op unless the group is synchronized (or there is no
+ * subscription), partitions added in other join states are started once
+ * the ongoing rebalance is done.
+ */
+static void rd_kafka_cgrp_incr_fetch_start (rd_kafka_cgrp_t *rkcg) {
+        rd_kafka_topic_partition_list_t *unstarted;
+        int i;
+
+        if (!rkcg->rkcg_assignment ||
+            !(rkcg->rkcg_join_state == RD_KAFKA_CGRP_JOIN_STATE_ASSIGNED ||
+              rkcg->rkcg_join_state == RD_KAFKA_CGRP_JOIN_STATE_STARTED ||
+              (rkcg->rkcg_join_state == RD_KAFKA_CGRP_JOIN_STATE_INIT &&
+               !(rkcg->rkcg_flags & RD_KAFKA_CGRP_F_SUBSCRIPTION))))
+                return;
+
+        unstarted = rd_kafka_topic_partition_list_new(0);
+        for (i = 0 ; i < rkcg->rkcg_assignment->cnt ; i++) {
+                const rd_kafka_topic_partition_t *rktpar =
+                        &rkcg->rkcg_assignment->elems[i];
+                rd_kafka_toppar_t *rktp =
+                        rd_kafka_toppar_s2i((shptr_rd_kafka_toppar_t *)
+                                            rktpar->_private);
+
+                if (!rktp->rktp_assigned)
+                        rd_kafka_topic_partition_copy(unstarted, rktpar);
+        }
+
+        if (unstarted->cnt > 0) {
+                rd_kafka_cgrp_set_join_state(
+                        rkcg, RD_KAFKA_CGRP_JOIN_STATE_ASSIGNED);
+                rd_kafka_cgrp_partitions_fetch_start(rkcg, unstarted, 0);
+        }
+
+        rd_kafka_topic_partition_list_destroy(unstarted);
+}
+
+
+/**
+ * @brief Rejoin the group if a rejoin is pending (F_WAIT_REJOIN) and the
+ *        current incremental rebalance is done: no rebalance callback
+ *        is outstanding and the revoked partitions have been stopped
+ *        and their offsets committed, so that their new owner
+ *        resumes from the committed offsets.
+ */
+static void rd_kafka_cgrp_incr_rejoin_check (rd_kafka_cgrp_t *rkcg,
+                                             const char *reason) {
+        if (!(rkcg->rkcg_flags & RD_KAFKA_CGRP_F_WAIT_REJOIN))
+                return;
+
+        if ((rkcg->rkcg_join_state != RD_KAFKA_CGRP_JOIN_STATE_ASSIGNED &&
+             rkcg->rkcg_join_state != RD_KAFKA_CGRP_JOIN_STATE_STARTED) ||
+            rkcg->rkcg_wait_unassign_cnt > 0 ||
+            rkcg->rkcg_wait_commit_cnt > 0) {
+                rd_kafka_dbg(rkcg->rkcg_rk, CGRP, "REJOIN",
+                             "Group \"%.*s\": postponing rejoin in "
+                             "join state %s (%d wait_unassign, "
+                             "%d wait commit): %s",
+                             RD_KAFKAP_STR_PR(rkcg->rkcg_group_id),
+                             rd_kafka_cgrp_join_state_names[rkcg->
+                                                            rkcg_join_state],
+                             rkcg->rkcg_wait_unassign_cnt,
+                             rkcg->rkcg_wait_commit_cnt, reason);
+                return;
+        }
+
+        rkcg->rkcg_flags &= ~RD_KAFKA_CGRP_F_WAIT_REJOIN;
+
+        rd_kafka_dbg(rkcg->rkcg_rk, CGRP, "REJOIN",
+                     "Group \"%.*s\": rejoining with %d partition(s) "
+                     "still assigned: %s",
+                     RD_KAFKAP_STR_PR(rkcg->rkcg_group_id),
+                     rkcg->rkcg_assignment ? rkcg->rkcg_assignment->cnt : 0,
+                     reason);
+
+        rd_kafka_cgrp_set_join_state(rkcg, RD_KAFKA_CGRP_JOIN_STATE_INIT);
+        rd_kafka_cgrp_join(rkcg);
+}
+
+
+/**
+ * @brief Add \p partitions to the current assignment and start fetching
+ *        them, the rest of the assignment is left untouched.
+ *
+ * @returns RD_KAFKA_RESP_ERR__CONFLICT if any of the partitions is
+ *          already assigned, in which case the assignment is not changed.
+ */
+static rd_kafka_resp_err_t
+rd_kafka_cgrp_incremental_assign (rd_kafka_cgrp_t *rkcg,
+                                  const rd_kafka_topic_partition_list_t
+                                  *partitions) {
+        int i;
+
+        for (i = 0 ; rkcg->rkcg_assignment && i < partitions->cnt ; i++) {
+                const rd_kafka_topic_partition_t *rktpar =
+                        &partitions->elems[i];
+
+                if (rd_kafka_topic_partition_list_find(
+                            rkcg->rkcg_assignment,
+                            rktpar->topic, rktpar->partition)) {
+                        rd_kafka_dbg(rkcg->rkcg_rk, CGRP, "ASSIGN",
+                                     "Group \"%s\": incremental assign "
+                                     "failed: %s [%"PRId32"] is already "
+                                     "assigned",
+                                     rkcg->rkcg_group_id->str,
+                                     rktpar->topic, rktpar->partition);
+                        return RD_KAFKA_RESP_ERR__CONFLICT;
+                }
+        }
+
+        rd_kafka_dbg(rkcg->rkcg_rk, CGRP|RD_KAFKA_DBG_CONSUMER, "ASSIGN",
+                     "Group \"%s\": incrementally assigning %d partition(s) "
+                     "to the current assignment of %d partition(s) "
+                     "in join state %s",
+                     rkcg->rkcg_group_id->str, partitions->cnt,
+                     rkcg->rkcg_assignment ? rkcg->rkcg_assignment->cnt : 0,
+                     rd_kafka_cgrp_join_state_names[rkcg->rkcg_join_state]);
+
+        if (!rkcg->rkcg_assignment)
+                rkcg->rkcg_assignment =
+                        rd_kafka_topic_partition_list_new(partitions->cnt);
+
+        for (i = 0 ; i < partitions->cnt ; i++) {
+                rd_kafka_topic_partition_t *rktpar;
+                rd_kafka_toppar_t *rktp;
+
+                rd_kafka_topic_partition_copy(rkcg->rkcg_assignment,
+                                              &partitions->elems[i]);
+                rktpar = &rkcg->rkcg_assignment->
+                        elems[rkcg->rkcg_assignment->cnt-1];
+
+                /* Get toppar object for each partition, as in assign() */
+                if (!rktpar->_private)
+                        rktpar->_private = rd_kafka_toppar_get2(
+                                rkcg->rkcg_rk,
+                                rktpar->topic, rktpar->partition,
+                                0/*no-ua*/, 1/*create-on-miss*/);
+
+                /* Mark partition as desired */
+                rktp = rd_kafka_toppar_s2i(rktpar->_private);
+                rd_kafka_toppar_lock(rktp);
+                rd_kafka_toppar_desired_add0(rktp);
+                rd_kafka_toppar_unlock(rktp);
+        }
+
+        rd_kafka_wrlock(rkcg->rkcg_rk);
+        rkcg->rkcg_c.assignment_size = rkcg->rkcg_assignment->cnt;
+        rd_kafka_wrunlock(rkcg->rkcg_rk);
+
+        if (rkcg->rkcg_join_state ==
+            RD_KAFKA_CGRP_JOIN_STATE_WAIT_ASSIGN_REBALANCE_CB)
+                rd_kafka_cgrp_set_join_state(
+                        rkcg, RD_KAFKA_CGRP_JOIN_STATE_ASSIGNED);
+
+        rd_kafka_cgrp_incr_fetch_start(rkcg);
+
+        rd_kafka_cgrp_incr_rejoin_check(rkcg, "incremental assign done");
+
+        return RD_KAFKA_RESP_ERR_NO_ERROR;
+}
+
+
+/**
+ * @brief Remove \p partitions from the current assignment: their offsets
+ *        are committed (if auto commit is enabled) and their fetchers
+ *        stopped while the rest of the assignment keeps fetching.
+ *
+ * @returns RD_KAFKA_RESP_ERR__CONFLICT if any of the partitions is not
+ *          assigned, in which case the assignment is not changed.
+ */
+static rd_kafka_resp_err_t
+rd_kafka_cgrp_incremental_unassign (rd_kafka_cgrp_t *rkcg,
+                                    const rd_kafka_topic_partition_list_t
+                                    *partitions) {
+        rd_kafka_topic_partition_list_t *kept, *revoked;
+        int i;
+
+        for (i = 0 ; i < partitions->cnt ; i++) {
+                const rd_kafka_topic_partition_t *rktpar =
+                        &partitions->elems[i];
+
+                if (!rkcg->rkcg_assignment ||
+                    !rd_kafka_topic_partition_list_find(
+                            rkcg->rkcg_assignment,
+                            rktpar->topic, rktpar->partition)) {
+                        rd_kafka_dbg(rkcg->rkcg_rk, CGRP, "UNASSIGN",
+                                     "Group \"%s\": incremental unassign "
+                                     "failed: %s [%"PRId32"] is not "
+                                     "assigned",
+                                     rkcg->rkcg_group_id->str,
+                                     rktpar->topic, rktpar->partition);
+                        return RD_KAFKA_RESP_ERR__CONFLICT;
+                }
+        }
+
+        if (partitions->cnt == 0)
+                return RD_KAFKA_RESP_ERR_NO_ERROR;
+
+        /* Split the current assignment in the kept and revoked
+         * partitions, the latter keeping the assignment's toppar
+         * references until they have been stopped below. */
+        kept = rd_kafka_topic_partition_list_new(rkcg->rkcg_assignment->cnt);
+        revoked = rd_kafka_topic_partition_list_new(partitions->cnt);
+        for (i = 0 ; i < rkcg->rkcg_assignment->cnt ; i++) {
+                const rd_kafka_topic_partition_t *rktpar =
+                        &rkcg->rkcg_assignment->elems[i];
+
+                rd_kafka_topic_partition_copy(
+                        rd_kafka_topic_partition_list_find(
+                                (rd_kafka_topic_partition_list_t *)partitions,
+                                rktpar->topic, rktpar->partition) ?
+                        revoked : kept, rktpar);
+        }
+
+        rd_kafka_topic_partition_list_destroy(rkcg->rkcg_assignment);
+        if (kept->cnt > 0) {
+                rkcg->rkcg_assignment = kept;
+        } else {
+                rd_kafka_topic_partition_list_destroy(kept);
+                rkcg->rkcg_assignment = NULL;
+        }
+
+        rd_kafka_dbg(rkcg->rkcg_rk, CGRP|RD_KAFKA_DBG_CONSUMER, "UNASSIGN",
+                     "Group \"%s\": incrementally unassigning %d "
+                     "partition(s), %d partition(s) remain assigned "
+                     "(join state %s)",
+                     rkcg->rkcg_group_id->str, revoked->cnt,
+                     rkcg->rkcg_assignment ? rkcg->rkcg_assignment->cnt : 0,
+                     rd_kafka_cgrp_join_state_names[rkcg->rkcg_join_state]);
+
+        rd_kafka_wrlock(rkcg->rkcg_rk);
+        rkcg->rkcg_c.assignment_size =
+                rkcg->rkcg_assignment ? rkcg->rkcg_assignment->cnt : 0;
+        rd_kafka_wrunlock(rkcg->rkcg_rk);
+
+        if (rkcg->rkcg_rk->rk_conf.offset_store_method ==
+            RD_KAFKA_OFFSET_METHOD_BROKER &&
+	    rkcg->rkcg_rk->rk_conf.enable_auto_commit &&
+            !rd_kafka_destroy_flags_no_consumer_close(rkcg->rkcg_rk)) {
+                /* Commit the revoked partitions' offsets to broker */
+                rd_kafka_cgrp_assigned_offsets_commit(rkcg, revoked,
+                                                      "incremental unassign");
+        }
+
+        for (i = 0 ; i < revoked->cnt ; i++) {
+                rd_kafka_toppar_t *rktp =
+                        rd_kafka_toppar_s2i((shptr_rd_kafka_toppar_t *)
+                                            revoked->elems[i]._private);
+
+                if (rktp->rktp_assigned) {
+                        rd_kafka_toppar_op_fetch_stop(
+				rktp, RD_KAFKA_REPLYQ(rkcg->rkcg_ops, 0));
+                        rkcg->rkcg_wait_unassign_cnt++;
+                }
+
+                rd_kafka_toppar_lock(rktp);
+                rd_kafka_toppar_desired_del(rktp);
+                rd_kafka_toppar_unlock(rktp);
+        }
+
+	/* Resume partition consumption (paused by the rebalance op). */
+	rd_kafka_toppars_pause_resume(rkcg->rkcg_rk, 0/*resume*/,
+				      RD_KAFKA_TOPPAR_F_LIB_PAUSE, revoked);
+
+        rd_kafka_topic_partition_list_destroy(revoked);
+
+        rd_kafka_cgrp_incr_rejoin_check(rkcg, "incremental unassign");
+
+        return RD_KAFKA_RESP_ERR_NO_ERROR;
+}
+
+
+/**
+ * @brief The revoke step of an incremental rebalance is done:
+ *        proceed with the assign step for the newly assigned partitions.
+ */
+static void rd_kafka_cgrp_incr_revoke_done (rd_kafka_cgrp_t *rkcg) {
+        rd_kafka_topic_partition_list_t *partitions =
+                rkcg->rkcg_rebalance_incr_assignment;
+
+        rkcg->rkcg_rebalance_incr_assignment = NULL;
+        if (!partitions)
+                partitions = rd_kafka_topic_partition_list_new(0);
+
+        rd_kafka_cgrp_set_join_state(rkcg, RD_KAFKA_CGRP_JOIN_STATE_ASSIGNED);
+
+        rd_kafka_rebalance_op_incr(rkcg, RD_KAFKA_RESP_ERR__ASSIGN_PARTITIONS,
+                                   partitions, "incremental rebalance");
+
+        rd_kafka_topic_partition_list_destroy(partitions);
+}
+
+
+/**
+ * @brief Handle a new assignment with the cooperative protocol: only the
+ *        difference to the current assignment is revoked and assigned,
+ *        partitions that stay with this member keep fetching.
+ *
+ * Partitions are revoked first, then the new partitions are assigned.
+ * If any partitions were revoked the group is rejoined once they have
+ * been decommissioned so that the leader can hand them to their new
+ * owner.
+ */
+static void
+rd_kafka_cgrp_handle_assignment_cooperative (rd_kafka_cgrp_t *rkcg,
+                                             rd_kafka_topic_partition_list_t
+                                             *assignment) {
+        rd_kafka_topic_partition_list_t *revoked, *added;
+        int i;
+
+        revoked = rd_kafka_topic_partition_list_new(0);
+        added = rd_kafka_topic_partition_list_new(0);
+
+        for (i = 0 ; rkcg->rkcg_assignment &&
+                     i < rkcg->rkcg_assignment->cnt ; i++) {
+                const rd_kafka_topic_partition_t *rktpar =
+                        &rkcg->rkcg_assignment->elems[i];
+                if (!rd_kafka_topic_partition_list_find(assignment,
+                                                        rktpar->topic,
+                                                        rktpar->partition))
+                        rd_kafka_topic_partition_list_add(
+                                revoked, rktpar->topic, rktpar->partition);
+        }
+
+        for (i = 0 ; i < assignment->cnt ; i++) {
+                const rd_kafka_topic_partition_t *rktpar =
+                        &assignment->elems[i];
+                if (!rkcg->rkcg_assignment ||
+                    !rd_kafka_topic_partition_list_find(rkcg->rkcg_assignment,
+                                                        rktpar->topic,
+                                                        rktpar->partition))
+                        rd_kafka_topic_partition_list_add(
+                                added, rktpar->topic, rktpar->partition);
+        }
+
+        rd_kafka_dbg(rkcg->rkcg_rk, CGRP|RD_KAFKA_DBG_CONSUMER, "ASSIGN",
+                     "Group \"%s\": cooperative assignment of %d "
+                     "partition(s): %d added, %d revoked, %d unchanged",
+                     rkcg->rkcg_group_id->str, assignment->cnt,
+                     added->cnt, revoked->cnt,
+                     assignment->cnt - added->cnt);
+
+        rd_kafka_cgrp_set_join_state(rkcg, RD_KAFKA_CGRP_JOIN_STATE_ASSIGNED);
+
+        if (revoked->cnt > 0) {
+                /* Rejoin when the revoked partitions are released */
+                rkcg->rkcg_flags |= RD_KAFKA_CGRP_F_WAIT_REJOIN;
+
+                if (rkcg->rkcg_rebalance_incr_assignment)
+                        rd_kafka_topic_partition_list_destroy(
+                                rkcg->rkcg_rebalance_incr_assignment);
+                rkcg->rkcg_rebalance_incr_assignment = added;
+                added = NULL;
+
+                if (!rd_kafka_rebalance_op_incr(
+                            rkcg, RD_KAFKA_RESP_ERR__REVOKE_PARTITIONS,
+                            revoked, "new assignment"))
+                        rd_kafka_cgrp_incr_revoke_done(rkcg);
+        } else {
+                rd_kafka_rebalance_op_incr(
+                        rkcg, RD_KAFKA_RESP_ERR__ASSIGN_PARTITIONS,
+                        added, "new assignment");
+        }
+
+        rd_kafka_topic_partition_list_destroy(revoked);
+        if (added)
+                rd_kafka_topic_partition_list_destroy(added);
+}
+
+
 /**
  * Handle a rebalance-triggered partition assignment.
  *
@@ -2365,6 +2947,12 @@ static void
 rd_kafka_cgrp_handle_assignment (rd_kafka_cgrp_t *rkcg,
 				 rd_kafka_topic_partition_list_t *assignment) {
 
+        if (rd_kafka_cgrp_rebalance_protocol(rkcg) ==
+            RD_KAFKA_REBALANCE_PROTOCOL_COOPERATIVE) {
+                rd_kafka_cgrp_handle_assignment_cooperative(rkcg, assignment);
+                return;
+        }
+
 	rd_kafka_rebalance_op(rkcg, RD_KAFKA_RESP_ERR__ASSIGN_PARTITIONS,
 			      assignment, "new assignment");
 }
@@ -2429,7 +3017,23 @@ void rd_kafka_cgrp_handle_heartbeat_error (rd_kafka_cgrp_t *rkcg,
                              "resetting member-id" :
                              "group is rebalancing");
 
+                if (err == RD_KAFKA_RESP_ERR_REBALANCE_IN_PROGRESS &&
+                    rd_kafka_cgrp_rebalance_protocol(rkcg) ==
+                    RD_KAFKA_REBALANCE_PROTOCOL_COOPERATIVE) {
+                        /* Still a member of the current generation:
+                         * rejoin while holding on to the assignment. */
+                        rd_kafka_cgrp_rejoin(rkcg);
+                        break;
+                }
+
 	default:
+                /* Other than an eager rebalance this means the member
+                 * is no longer part of the generation and its
+                 * partitions are lost. */
+                if (err != RD_KAFKA_RESP_ERR_REBALANCE_IN_PROGRESS)
+                        rd_kafka_cgrp_group_assignment_clear(
+                                rkcg, rd_kafka_err2str(err));
+
                 /* Just revert to INIT state if join state is active. */
                 if (rkcg->rkcg_join_state <
                     RD_KAFKA_CGRP_JOIN_STATE_WAIT_ASSIGN_REBALANCE_CB ||
@@ -2483,6 +3087,31 @@ static void rd_kafka_cgrp_group_leader_reset (rd_kafka_cgrp_t *rkcg,
 
 
 
+/**
+ * @brief Forget the last assignment received from the group leader so
+ *        that it is not advertised as owned partitions on the next
+ *        JoinGroup, e.g., after the partitions were lost.
+ *
+ * @locality cgrp thread
+ */
+static void rd_kafka_cgrp_group_assignment_clear (rd_kafka_cgrp_t *rkcg,
+                                                  const char *reason) {
+        if (!rkcg->rkcg_group_assignment)
+                return;
+
+        rd_kafka_dbg(rkcg->rkcg_rk, CGRP, "ASSIGNMENT",
+                     "Group \"%.*s\": clearing %d owned partition(s) "
+                     "of generation %"PRId32": %s",
+                     RD_KAFKAP_STR_PR(rkcg->rkcg_group_id),
+                     rkcg->rkcg_group_assignment->cnt,
+                     rkcg->rkcg_group_assignment_generation_id, reason);
+
+        rd_kafka_topic_partition_list_destroy(rkcg->rkcg_group_assignment);
+        rkcg->rkcg_group_assignment = NULL;
+        rkcg->rkcg_group_assignment_generation_id = -1;
+}
+
+
 /**
  * Remove existing topic subscription.
  */
@@ -2504,6 +3133,10 @@ rd_kafka_cgrp_unsubscribe (rd_kafka_cgrp_t *rkcg, int leave_group) {
                 rkcg->rkcg_subscription = NULL;
         }
 
+        /* Previously owned partitions are not carried over to
+         * a new subscription. */
+        rd_kafka_cgrp_group_assignment_clear(rkcg, "unsubscribe");
+
 	rd_kafka_cgrp_update_subscribed_topics(rkcg, NULL);
 
         /*
@@ -2824,9 +3457,25 @@ rd_kafka_cgrp_op_serve (rd_kafka_t *rk, rd_kafka_q_t *rkq,
                 /* All unassigned toppars now stopped and commit done:
                  * transition to the next state. */
                 if (rkcg->rkcg_join_state ==
-                    RD_KAFKA_CGRP_JOIN_STATE_WAIT_UNASSIGN)
+                    RD_KAFKA_CGRP_JOIN_STATE_WAIT_UNASSIGN) {
                         rd_kafka_cgrp_check_unassign_done(rkcg,
                                                           "FETCH_STOP done");
+                } else if (rd_kafka_cgrp_rebalance_protocol(rkcg) ==
+                           RD_KAFKA_REBALANCE_PROTOCOL_COOPERATIVE) {
+                        int desired;
+
+                        /* The partition may have been incrementally
+                         * assigned again while it was being stopped. */
+                        rd_kafka_toppar_lock(rktp);
+                        desired = !!(rktp->rktp_flags &
+                                     RD_KAFKA_TOPPAR_F_DESIRED);
+                        rd_kafka_toppar_unlock(rktp);
+                        if (desired)
+                                rd_kafka_cgrp_incr_fetch_start(rkcg);
+
+                        rd_kafka_cgrp_incr_rejoin_check(rkcg,
+                                                        "FETCH_STOP done");
+                }
                 break;
 
         case RD_KAFKA_OP_OFFSET_COMMIT:
@@ -2862,22 +3511,65 @@ rd_kafka_cgrp_op_serve (rd_kafka_t *rk, rd_kafka_q_t *rkq,
 
         case RD_KAFKA_OP_ASSIGN:
                 /* New atomic assignment (payload != NULL),
-                 * or unassignment (payload == NULL) */
+                 * or unassignment (payload == NULL),
+                 * or incremental (un)assignment of the payload. */
                 err = 0;
                 if (rkcg->rkcg_flags & RD_KAFKA_CGRP_F_TERMINATE) {
                         /* Treat all assignments as unassign
                          * when terminating. */
                         rd_kafka_cgrp_unassign(rkcg);
-                        if (rko->rko_u.assign.partitions)
+                        if (rko->rko_u.assign.partitions &&
+                            rko->rko_u.assign.method !=
+                            RD_KAFKA_ASSIGN_METHOD_INCR_UNASSIGN)
                                 err = RD_KAFKA_RESP_ERR__DESTROY;
+
+                } else if (rko->rko_u.assign.method ==
+                           RD_KAFKA_ASSIGN_METHOD_ASSIGN) {
+                        /* A full assignment would defeat the cooperative
+                         * protocol, but unassign() is still allowed. */
+                        if (rko->rko_u.assign.partitions &&
+                            rd_kafka_cgrp_rebalance_protocol(rkcg) ==
+                            RD_KAFKA_REBALANCE_PROTOCOL_COOPERATIVE)
+                                err = RD_KAFKA_RESP_ERR__STATE;
+                        else
+                                rd_kafka_cgrp_assign(
+                                        rkcg, rko->rko_u.assign.partitions);
+
+                } else if (rd_kafka_cgrp_rebalance_protocol(rkcg) ==
+                           RD_KAFKA_REBALANCE_PROTOCOL_EAGER) {
+                        err = RD_KAFKA_RESP_ERR__STATE;
+
+                } else if (rko->rko_u.assign.method ==
+                           RD_KAFKA_ASSIGN_METHOD_INCR_ASSIGN) {
+                        err = rd_kafka_cgrp_incremental_assign(
+                                rkcg, rko->rko_u.assign.partitions);
+
                 } else {
-                        rd_kafka_cgrp_assign(
+                        int join_state = rkcg->rkcg_join_state;
+
+                        err = rd_kafka_cgrp_incremental_unassign(
                                 rkcg, rko->rko_u.assign.partitions);
+
+                        if (rkcg->rkcg_flags & RD_KAFKA_CGRP_F_WAIT_UNASSIGN)
+                                /* Revoke of the full assignment
+                                 * (e.g., unsubscribe) is done. */
+                                rd_kafka_cgrp_unassign(rkcg);
+                        else if (!err && join_state ==
+                                 RD_KAFKA_CGRP_JOIN_STATE_WAIT_REVOKE_REBALANCE_CB)
+                                rd_kafka_cgrp_incr_revoke_done(rkcg);
                 }
                 rd_kafka_op_reply(rko, err);
                 rko = NULL;
                 break;
 
+        case RD_KAFKA_OP_GET_REBALANCE_PROTOCOL:
+                rko->rko_u.rebalance_protocol.str =
+                        rd_kafka_rebalance_protocol2str(
+                                rd_kafka_cgrp_rebalance_protocol(rkcg));
+                rd_kafka_op_reply(rko, 0);
+                rko = NULL;
+                break;
+
         case RD_KAFKA_OP_GET_SUBSCRIPTION:
                 if (rkcg->rkcg_subscription)
                         rko->rko_u.subscribe.topics =
@@ -2943,9 +3635,16 @@ static void rd_kafka_cgrp_join_state_serve (rd_kafka_cgrp_t *rkcg,
         case RD_KAFKA_CGRP_JOIN_STATE_WAIT_METADATA:
         case RD_KAFKA_CGRP_JOIN_STATE_WAIT_SYNC:
         case RD_KAFKA_CGRP_JOIN_STATE_WAIT_UNASSIGN:
-	case RD_KAFKA_CGRP_JOIN_STATE_WAIT_REVOKE_REBALANCE_CB:
 		break;
 
+	case RD_KAFKA_CGRP_JOIN_STATE_WAIT_REVOKE_REBALANCE_CB:
+                /* With the cooperative protocol the member remains
+                 * in the group while the application handles the
+                 * incremental revoke: keep heartbeating. */
+                if (rd_kafka_cgrp_rebalance_protocol(rkcg) !=
+                    RD_KAFKA_REBALANCE_PROTOCOL_COOPERATIVE)
+                        break;
+                /* FALLTHRU */
         case RD_KAFKA_CGRP_JOIN_STATE_WAIT_ASSIGN_REBALANCE_CB:
         case RD_KAFKA_CGRP_JOIN_STATE_ASSIGNED:
 	case RD_KAFKA_CGRP_JOIN_STATE_STARTED:
@@ -3248,6 +3947,14 @@ void rd_kafka_cgrp_handle_SyncGroup (rd_kafka_cgrp_t *rkcg,
         rd_kafka_buf_read_bytes(rkbuf, &UserData);
 
  done:
+        /* Remember the assignment for the next JoinGroup */
+        if (rkcg->rkcg_group_assignment)
+                rd_kafka_topic_partition_list_destroy(
+                        rkcg->rkcg_group_assignment);
+        rkcg->rkcg_group_assignment =
+                rd_kafka_topic_partition_list_copy(assignment);
+        rkcg->rkcg_group_assignment_generation_id = rkcg->rkcg_generation_id;
+
         /* Set the new assignment */
 	rd_kafka_cgrp_handle_assignment(rkcg, assignment);
 
@@ -143,6 +143,12 @@ typedef struct rd_kafka_cgrp_s {
                                                      * send a new one. */
 #define RD_KAFKA_CGRP_F_WILDCARD_SUBSCRIPTION 0x40  /* Subscription contains
                                                      * wildcards. */
+#define RD_KAFKA_CGRP_F_WAIT_REJOIN  0x80           /* Rejoin the group when
+                                                     * the current incremental
+                                                     * rebalance is done and
+                                                     * revoked partitions
+                                                     * are decommissioned
+                                                     * (cooperative). */
 
         rd_interval_t      rkcg_coord_query_intvl;  /* Coordinator query intvl*/
         rd_interval_t      rkcg_heartbeat_intvl;    /* Heartbeat intvl */
@@ -162,6 +168,10 @@ typedef struct rd_kafka_cgrp_s {
         rd_kafka_assignor_t *rkcg_assignor;         /* Selected partition
                                                      * assignor strategy. */
 
+        /** Partitions to assign once the revoke step of the current
+         *  incremental (cooperative) rebalance is done. */
+        rd_kafka_topic_partition_list_t *rkcg_rebalance_incr_assignment;
+
         rd_kafka_broker_t *rkcg_rkb;                /* Current handling broker,
                                                      * if the coordinator broker
                                                      * is not available this
@@ -182,6 +192,13 @@ typedef struct rd_kafka_cgrp_s {
         /* Current assignment */
         rd_kafka_topic_partition_list_t *rkcg_assignment;
 
+        /** Last assignment received from the group leader and the
+         *  generation it was received in. Unlike rkcg_assignment this
+         *  is retained across rebalances so that sticky assignors can
+         *  advertise the member's previously owned partitions. */
+        rd_kafka_topic_partition_list_t *rkcg_group_assignment;
+        int32_t            rkcg_group_assignment_generation_id;
+
         int rkcg_wait_unassign_cnt;                 /* Waiting for this number
                                                      * of partitions to be
                                                      * unassigned and
@@ -241,6 +258,16 @@ rd_kafka_cgrp_t *rd_kafka_cgrp_new (rd_kafka_t *rk,
                                     const rd_kafkap_str_t *client_id);
 void rd_kafka_cgrp_serve (rd_kafka_cgrp_t *rkcg);
 
+/**
+ * @returns the rebalance protocol of the group's selected assignor,
+ *          or RD_KAFKA_REBALANCE_PROTOCOL_NONE if not (yet) joined.
+ *
+ * @locality cgrp thread
+ */
+#define rd_kafka_cgrp_rebalance_protocol(rkcg)                          \
+        ((rkcg)->rkcg_assignor ? (rkcg)->rkcg_assignor->rkas_protocol : \
+         RD_KAFKA_REBALANCE_PROTOCOL_NONE)
+
 void rd_kafka_cgrp_op (rd_kafka_cgrp_t *rkcg, rd_kafka_toppar_t *rktp,
                        rd_kafka_replyq_t replyq, rd_kafka_op_type_t type,
                        rd_kafka_resp_err_t err);
@@ -0,0 +1,151 @@
+/*
+ * librdkafka - Apache Kafka C library
+ *
+ * Copyright (c) 2018 Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rdkafka_int.h"
+#include "rdkafka_op.h"
+#include "rdkafka_msgset.h"
+#include "rdkafka_compress.h"
+
+
+/**
+ * @brief Compression thread main loop.
+ *
+ * Ops are served in order until a TERMINATE op is received,
+ * one TERMINATE op is enqueued per thread on pool destruction.
+ *
+ * @locality compression thread
+ */
+static int rd_kafka_compress_pool_thread_main (void *arg) {
+        rd_kafka_compress_pool_t *rkcp = arg;
+        rd_kafka_codec_ctx_t codec = RD_ZERO_INIT;
+        rd_kafka_op_t *rko;
+
+        rd_kafka_set_thread_name("compress");
+        rd_kafka_set_thread_sysname("rdk:compress");
+
+        (void)rd_atomic32_add(&rd_kafka_thread_cnt_curr, 1);
+
+        while ((rko = rd_kafka_q_pop(rkcp->rkcp_q, RD_POLL_INFINITE, 0))) {
+                if (rko->rko_type == RD_KAFKA_OP_TERMINATE) {
+                        rd_kafka_op_destroy(rko);
+                        break;
+                }
+
+                rd_assert(rko->rko_type == RD_KAFKA_OP_COMPRESS);
+                rd_kafka_msgset_compress_op_serve(rko, &codec);
+        }
+
+        rd_kafka_codec_ctx_destroy(&codec);
+
+        rd_atomic32_sub(&rd_kafka_thread_cnt_curr, 1);
+
+        return 0;
+}
+
+
+/**
+ * @brief Create compression pool with \p thread_cnt threads.
+ *
+ * @returns the new pool, or NULL on failure in which case a human readable
+ *          error is written to \p errstr.
+ *
+ * @locality application thread
+ */
+rd_kafka_compress_pool_t *
+rd_kafka_compress_pool_new (rd_kafka_t *rk, int thread_cnt,
+                            char *errstr, size_t errstr_size) {
+        rd_kafka_compress_pool_t *rkcp;
+        int i;
+
+        rkcp = rd_calloc(1, sizeof(*rkcp));
+        rkcp->rkcp_q = rd_kafka_q_new(rk);
+        rkcp->rkcp_thrds = rd_calloc(thread_cnt, sizeof(*rkcp->rkcp_thrds));
+
+        for (i = 0 ; i < thread_cnt ; i++) {
+                if (thrd_create(&rkcp->rkcp_thrds[i],
+                                rd_kafka_compress_pool_thread_main, rkcp) !=
+                    thrd_success) {
+                        if (errstr)
+                                rd_snprintf(errstr, errstr_size,
+                                            "Failed to create compression "
+                                            "thread: %s (%i)",
+                                            rd_strerror(errno), errno);
+                        rd_kafka_compress_pool_destroy(rkcp);
+                        return NULL;
+                }
+                rkcp->rkcp_thrd_cnt++;
+        }
+
+        return rkcp;
+}
+
+
+/**
+ * @brief Serve all queued ops, then terminate the compression threads.
+ *
+ *        Ops submitted after this call are failed, see
+ *        rd_kafka_ProduceRequest_compress_fail().
+ *
+ * @remark Must be called prior to decommissioning the brokers so that
+ *         the compressed requests are passed back to live broker threads.
+ *
+ * @locality main thread
+ */
+void rd_kafka_compress_pool_term (rd_kafka_compress_pool_t *rkcp) {
+        int i;
+
+        for (i = 0 ; i < rkcp->rkcp_thrd_cnt ; i++)
+                rd_kafka_q_enq(rkcp->rkcp_q,
+                               rd_kafka_op_new(RD_KAFKA_OP_TERMINATE));
+
+        for (i = 0 ; i < rkcp->rkcp_thrd_cnt ; i++)
+                thrd_join(rkcp->rkcp_thrds[i], NULL);
+
+        rkcp->rkcp_thrd_cnt = 0;
+
+        /* Fail ops that were submitted behind the TERMINATE ops,
+         * and any ops submitted from now on. */
+        rd_kafka_q_disable(rkcp->rkcp_q);
+        rd_kafka_q_purge(rkcp->rkcp_q);
+}
+
+
+/**
+ * @brief Terminate the compression threads, if not already done,
+ *        and destroy the pool.
+ *
+ * @remark No ops may be submitted after this call.
+ */
+void rd_kafka_compress_pool_destroy (rd_kafka_compress_pool_t *rkcp) {
+
+        rd_kafka_compress_pool_term(rkcp);
+
+        rd_free(rkcp->rkcp_thrds);
+        rd_kafka_q_destroy_owner(rkcp->rkcp_q);
+        rd_free(rkcp);
+}
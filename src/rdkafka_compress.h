@@ -0,0 +1,68 @@
+/*
+ * librdkafka - Apache Kafka C library
+ *
+ * Copyright (c) 2018 Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _RDKAFKA_COMPRESS_H_
+#define _RDKAFKA_COMPRESS_H_
+
+/**
+ * @name Producer compression thread pool
+ *
+ * The broker thread may hand off compression of a ProduceRequest's
+ * MessageSet to a pool of compression threads (compression.threads)
+ * as an RD_KAFKA_OP_COMPRESS op.
+ * Once compressed the op is passed back to the broker thread's op queue
+ * which finalizes and sends the ProduceRequest.
+ *
+ * Only one MessageSet per partition is compressed at any time to retain
+ * message order, see rktp_compress_cnt.
+ *
+ * @{
+ */
+
+typedef struct rd_kafka_compress_pool_s {
+        rd_kafka_q_t *rkcp_q;         /**< RD_KAFKA_OP_COMPRESS ops */
+        thrd_t       *rkcp_thrds;
+        int           rkcp_thrd_cnt;
+} rd_kafka_compress_pool_t;
+
+
+rd_kafka_compress_pool_t *
+rd_kafka_compress_pool_new (rd_kafka_t *rk, int thread_cnt,
+                            char *errstr, size_t errstr_size);
+void rd_kafka_compress_pool_term (rd_kafka_compress_pool_t *rkcp);
+void rd_kafka_compress_pool_destroy (rd_kafka_compress_pool_t *rkcp);
+
+/**
+ * @brief Submit RD_KAFKA_OP_COMPRESS op \p rko to the pool.
+ */
+#define rd_kafka_compress_pool_submit(rkcp,rko)         \
+        rd_kafka_q_enq((rkcp)->rkcp_q, rko)
+
+/**@}*/
+
+#endif /* _RDKAFKA_COMPRESS_H_ */
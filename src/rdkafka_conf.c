@@ -73,7 +73,7 @@ struct rd_kafka_property {
 	struct {
 		int val;
 		const char *str;
-	} s2i[16];  /* _RK_C_S2I and _RK_C_S2F */
+	} s2i[20];  /* _RK_C_S2I and _RK_C_S2F */
 
 	/* Value validator (STR) */
 	int (*validate) (const struct rd_kafka_property *prop,
@@ -170,6 +170,12 @@ static const struct rd_kafka_property rd_kafka_properties[] = {
 #endif
 #if WITH_PLUGINS
                 { 0x200, "plugins" },
+#endif
+#if WITH_ZSTD
+                { 0x400, "zstd" },
+#endif
+#if WITH_IO_URING
+                { 0x800, "io_uring" },
 #endif
 		{ 0, NULL }
 		}
@@ -191,7 +197,9 @@ static const struct rd_kafka_property rd_kafka_properties[] = {
 	  _RK(msg_copy_max_size),
 	  "Maximum size for message to be copied to buffer. "
 	  "Messages larger than this will be passed by reference (zero-copy) "
-	  "at the expense of larger iovecs.",
+	  "at the expense of larger iovecs. "
+          "Messages of 4096 bytes or more are always passed by reference "
+          "when compression is disabled.",
 	  0, 1000000000, 0xffff },
 	{ _RK_GLOBAL, "receive.message.max.bytes", _RK_C_INT,
           _RK(recv_max_msg_size),
@@ -201,6 +209,22 @@ static const struct rd_kafka_property rd_kafka_properties[] = {
           "This value is automatically adjusted upwards to be at least "
           "`fetch.max.bytes` + 512 to allow for protocol overhead.",
 	  1000, INT_MAX, 100000000 },
+        { _RK_GLOBAL, "buffer.pool.max.bytes", _RK_C_INT,
+          _RK(buffer_pool_max_bytes),
+          "Maximum number of bytes of free memory to retain in the buffer "
+          "pool for reuse by future protocol requests and responses, "
+          "such as ProduceRequests and FetchResponses. "
+          "Pooling avoids repeatedly allocating and releasing large "
+          "buffers, reducing heap fragmentation and RSS growth in "
+          "long-running clients. Buffer sizes are rounded up to the "
+          "nearest power of two. A value of 0 disables the pool.",
+          0, INT_MAX, 0 },
+        { _RK_GLOBAL, "buffer.pool.idle.ms", _RK_C_INT,
+          _RK(buffer_pool_idle_ms),
+          "Pooled buffers that remain unused for an entire interval of "
+          "this length are released back to the system. "
+          "See `buffer.pool.max.bytes`.",
+          100, 3600*1000, 10*1000 },
 	{ _RK_GLOBAL, "max.in.flight.requests.per.connection", _RK_C_INT,
 	  _RK(max_inflight),
 	  "Maximum number of in-flight requests per broker connection. "
@@ -267,6 +291,7 @@ static const struct rd_kafka_property rd_kafka_properties[] = {
                         { RD_KAFKA_DBG_PLUGIN,   "plugin" },
                         { RD_KAFKA_DBG_CONSUMER, "consumer" },
                         { RD_KAFKA_DBG_ADMIN,    "admin" },
+                        { RD_KAFKA_DBG_EOS,      "eos" },
 			{ RD_KAFKA_DBG_ALL,      "all" }
 		} },
 	{ _RK_GLOBAL, "socket.timeout.ms", _RK_C_INT, _RK(socket_timeout_ms),
@@ -314,6 +339,24 @@ static const struct rd_kafka_property rd_kafka_properties[] = {
           "become desynchronized in case of request timeouts. "
           "NOTE: The connection is automatically re-established.",
           0, 1000000, 1 },
+        { _RK_GLOBAL, "socket.io.backend", _RK_C_S2I,
+          _RK(socket_io_backend),
+          "Broker socket IO backend: "
+          "`poll` waits for socket readiness with poll() and then "
+          "sends and receives with one syscall each, "
+          "`io_uring` submits sends and multishot receives "
+          "into pre-registered buffers to an io_uring (Linux >= 6.0) "
+          "and waits for their completion, which reduces the number of "
+          "syscalls per request. "
+          "io_uring is only used for plaintext (non-SSL) connections "
+          "with `broker.threads=0`, and falls back to `poll` if "
+          "io_uring is not supported by the build (see "
+          "`builtin.features`) or the kernel.",
+          .vdef = RD_KAFKA_IO_BACKEND_POLL,
+          .s2i = {
+                        { RD_KAFKA_IO_BACKEND_POLL, "poll" },
+                        { RD_KAFKA_IO_BACKEND_IO_URING, "io_uring" },
+                } },
 	{ _RK_GLOBAL, "broker.address.ttl", _RK_C_INT,
 	  _RK(broker_addr_ttl),
 	  "How long to cache the broker address resolving "
@@ -328,6 +371,19 @@ static const struct rd_kafka_property rd_kafka_properties[] = {
                         { AF_INET, "v4" },
                         { AF_INET6, "v6" },
                 } },
+        { _RK_GLOBAL, "broker.threads", _RK_C_INT,
+          _RK(broker_threads),
+          "Number of shared threads serving all broker connections, "
+          "rather than one thread per broker. "
+          "Each thread waits for socket and queue events on its brokers "
+          "(epoll on Linux) and only serves a broker when it has an "
+          "event or a pending timeout, so idle brokers cost no wake-ups. "
+          "This reduces the number of threads and context switches "
+          "when connected to many brokers. "
+          "Note that blocking operations, such as broker address "
+          "resolving, block all brokers served by the same thread. "
+          "0 = one thread per broker.",
+          0, 256, 0 },
         { _RK_GLOBAL, "reconnect.backoff.jitter.ms", _RK_C_INT,
           _RK(reconnect_jitter_ms),
           "Throttle broker reconnection attempts by this value +-50%.",
@@ -626,7 +682,16 @@ static const struct rd_kafka_property rd_kafka_properties[] = {
         { _RK_GLOBAL|_RK_CGRP, "partition.assignment.strategy", _RK_C_STR,
           _RK(partition_assignment_strategy),
           "Name of partition assignment strategy to use when elected "
-          "group leader assigns partitions to group members.",
+          "group leader assigns partitions to group members. "
+          "Available strategies are `range`, `roundrobin`, `sticky` "
+          "(retains existing ownership while balancing, compatible "
+          "with the Java StickyAssignor) and `cooperative-sticky` "
+          "(sticky with the COOPERATIVE incremental rebalance protocol: "
+          "only the partitions that move are revoked, see "
+          "rd_kafka_incremental_assign()). All configured strategies "
+          "must use the same rebalance protocol, i.e., "
+          "`cooperative-sticky` can't be combined with the other "
+          "(EAGER) strategies.",
 	  .sdef = "range,roundrobin" },
         { _RK_GLOBAL|_RK_CGRP, "session.timeout.ms", _RK_C_INT,
           _RK(group_session_timeout_ms),
@@ -680,6 +745,20 @@ static const struct rd_kafka_property rd_kafka_properties[] = {
 	  "This value may be overshot by fetch.message.max.bytes. "
 	  "This property has higher priority than queued.min.messages.",
           1, INT_MAX/1024, 0x100000/*1GB*/ },
+        { _RK_GLOBAL|_RK_CONSUMER, "queued.max.total.kbytes", _RK_C_INT,
+          _RK(queued_max_total_kbytes),
+          "Maximum total number of kilobytes of pre-fetched messages "
+          "in the local consumer queues across all partitions. "
+          "Setting this property enables adaptive per-partition fetch "
+          "sizing: a partition whose fetches come back full while its "
+          "queue is being drained by the application doubles its fetch "
+          "size (up to fetch.message.max.bytes), while a partition "
+          "returning little data halves its fetch size (down to 32 "
+          "kilobytes). A partition is not fetched while its queue holds "
+          "a full fetch size worth of messages, nor while the total "
+          "budget is exhausted, unless its queue is empty. "
+          "A value of 0 disables the budget and adaptive fetch sizing.",
+          0, INT_MAX/1024, 0 },
 	{ _RK_GLOBAL|_RK_CONSUMER, "fetch.wait.max.ms", _RK_C_INT,
 	  _RK(fetch_wait_max_ms),
 	  "Maximum time the broker may wait to fill the response "
@@ -754,6 +833,24 @@ static const struct rd_kafka_property rd_kafka_properties[] = {
           "on-disk corruption to the messages occurred. This check comes "
           "at slightly increased CPU usage.",
           0, 1, 0 },
+        { _RK_GLOBAL|_RK_CONSUMER, "enable.fetch.batch.ops", _RK_C_BOOL,
+          _RK(fetch_batch_ops),
+          "Pass each fetched MessageSet (MsgVersion 2) through the "
+          "internal queues as a single batch which is unpacked into "
+          "individual messages as they are consumed by the application. "
+          "This reduces queue locking and per-message overhead for "
+          "high throughput consumers. "
+          "Older MsgVersions are always passed one message at a time.",
+          0, 1, 0 },
+        { _RK_GLOBAL|_RK_CONSUMER, "fetch.decompress.threads", _RK_C_INT,
+          _RK(fetch_decompress_threads),
+          "Number of threads to decompress and parse compressed "
+          "MessageSets with, offloading the broker threads. "
+          "Message order is retained per partition. "
+          "This is useful for high throughput consumers of compressed "
+          "topics where a single broker thread otherwise becomes CPU bound. "
+          "0 = decompress on the broker thread.",
+          0, 64, 0 },
 	/* Global producer properties */
 	{ _RK_GLOBAL|_RK_PRODUCER, "queue.buffering.max.messages", _RK_C_INT,
 	  _RK(queue_buffering_max_msgs),
@@ -775,6 +872,27 @@ static const struct rd_kafka_property rd_kafka_properties[] = {
 	  0, 900*1000, 0 },
         { _RK_GLOBAL|_RK_PRODUCER, "linger.ms", _RK_C_ALIAS,
           .sdef = "queue.buffering.max.ms" },
+        { _RK_GLOBAL|_RK_PRODUCER, "queue.buffering.lockfree", _RK_C_BOOL,
+          _RK(queue_buffering_lockfree),
+          "Enqueue produced messages on a lock-free per-partition intake "
+          "queue that the broker thread moves to the partition queue "
+          "in bulk, rather than taking the partition lock for each "
+          "message. This reduces lock contention when many application "
+          "threads produce to the same partitions. "
+          "Message order is retained. "
+          "Only applies to the default `fifo` queuing strategy.",
+          0, 1, 0 },
+	{ _RK_GLOBAL|_RK_PRODUCER, "enable.idempotence", _RK_C_BOOL,
+	  _RK(eos.idempotence),
+	  "When set to `true`, the producer will ensure that messages are "
+	  "successfully produced exactly once and in the original produce "
+	  "order. "
+	  "The following configuration properties are adjusted automatically "
+	  "when idempotence is enabled: "
+	  "`max.in.flight.requests.per.connection` is capped to 5, "
+	  "`acks` is set to `all` and `queuing.strategy` is set to `fifo`. "
+	  "Requires broker version >= 0.11.0.",
+	  0, 1, 0 },
 	{ _RK_GLOBAL|_RK_PRODUCER, "message.send.max.retries", _RK_C_INT,
 	  _RK(max_retries),
 	  "How many times to retry sending a failing MessageSet. "
@@ -814,10 +932,34 @@ static const struct rd_kafka_property rd_kafka_properties[] = {
 			{ RD_KAFKA_COMPRESSION_SNAPPY, "snappy" },
 #endif
                         { RD_KAFKA_COMPRESSION_LZ4, "lz4" },
+#if WITH_ZSTD
+                        { RD_KAFKA_COMPRESSION_ZSTD, "zstd" },
+#endif
 			{ 0 }
 		} },
         { _RK_GLOBAL|_RK_PRODUCER, "compression.type", _RK_C_ALIAS,
           .sdef = "compression.codec" },
+        { _RK_GLOBAL|_RK_PRODUCER, "compression.threads", _RK_C_INT,
+          _RK(compression_threads),
+          "Number of threads to compress MessageSets with, offloading "
+          "the broker threads. This allows the MessageSets of different "
+          "partitions led by the same broker to be compressed in parallel. "
+          "Message order is retained per partition. "
+          "0 = compress on the broker thread.",
+          0, 64, 0 },
+        { _RK_GLOBAL|_RK_PRODUCER, "socket.zerocopy", _RK_C_BOOL,
+          _RK(socket_zerocopy),
+          "Send ProduceRequests of uncompressed messages with "
+          "MSG_ZEROCOPY (Linux >= 4.14) so that message payloads passed by "
+          "reference (see `message.copy.max.bytes`) are sent from the "
+          "application's memory without copying them to the socket buffer. "
+          "Delivery reports for `acks=0` are held until the kernel has "
+          "released the payload memory. "
+          "Only applies to plaintext connections with the `poll` "
+          "`socket.io.backend`, and is disabled for a connection if the "
+          "kernel reports it had to copy the data anyway (e.g., on "
+          "loopback). Ignored on other platforms.",
+          0, 1, 0 },
 	{ _RK_GLOBAL|_RK_PRODUCER, "batch.num.messages", _RK_C_INT,
 	  _RK(batch_num_messages),
 	  "Maximum number of messages batched in one MessageSet. "
@@ -926,6 +1068,9 @@ static const struct rd_kafka_property rd_kafka_properties[] = {
 		  { RD_KAFKA_COMPRESSION_SNAPPY, "snappy" },
 #endif
 		  { RD_KAFKA_COMPRESSION_LZ4, "lz4" },
+#if WITH_ZSTD
+		  { RD_KAFKA_COMPRESSION_ZSTD, "zstd" },
+#endif
 		  { RD_KAFKA_COMPRESSION_INHERIT, "inherit" },
 		  { 0 }
 		} },
@@ -936,7 +1081,8 @@ static const struct rd_kafka_property rd_kafka_properties[] = {
 	  "Compression level parameter for algorithm selected by configuration "
 	  "property `compression.codec`. Higher values will result in better "
 	  "compression at the cost of more CPU usage. Usable range is "
-	  "algorithm-dependent: [0-9] for gzip; [0-12] for lz4; only 0 for snappy; "
+	  "algorithm-dependent: [0-9] for gzip; [0-12] for lz4; [0-22] for zstd; "
+	  "only 0 for snappy; "
 	  "-1 = codec-dependent default compression level.",
 	  RD_KAFKA_COMPLEVEL_MIN,
 	  RD_KAFKA_COMPLEVEL_MAX,
@@ -46,6 +46,7 @@ typedef enum {
 	RD_KAFKA_COMPRESSION_GZIP = RD_KAFKA_MSG_ATTR_GZIP,
 	RD_KAFKA_COMPRESSION_SNAPPY = RD_KAFKA_MSG_ATTR_SNAPPY,
         RD_KAFKA_COMPRESSION_LZ4 = RD_KAFKA_MSG_ATTR_LZ4,
+        RD_KAFKA_COMPRESSION_ZSTD = RD_KAFKA_MSG_ATTR_ZSTD,
 	RD_KAFKA_COMPRESSION_INHERIT /* Inherit setting from global conf */
 } rd_kafka_compression_t;
 
@@ -58,7 +59,8 @@ typedef enum {
 	RD_KAFKA_COMPLEVEL_GZIP_MAX = 9,
 	RD_KAFKA_COMPLEVEL_LZ4_MAX = 12,
 	RD_KAFKA_COMPLEVEL_SNAPPY_MAX = 0,
-	RD_KAFKA_COMPLEVEL_MAX = 12
+	RD_KAFKA_COMPLEVEL_ZSTD_MAX = 22,
+	RD_KAFKA_COMPLEVEL_MAX = 22
 } rd_kafka_complevel_t;
 
 typedef enum {
@@ -92,6 +94,12 @@ typedef enum {
 
 
 
+typedef enum {
+        RD_KAFKA_IO_BACKEND_POLL,
+        RD_KAFKA_IO_BACKEND_IO_URING
+} rd_kafka_io_backend_t;
+
+
 typedef enum {
         RD_KAFKA_OFFSET_METHOD_NONE,
         RD_KAFKA_OFFSET_METHOD_FILE,
@@ -116,6 +124,8 @@ struct rd_kafka_conf_s {
 	int     max_msg_size;
 	int     msg_copy_max_size;
         int     recv_max_msg_size;
+        int     buffer_pool_max_bytes;
+        int     buffer_pool_idle_ms;
 	int     max_inflight;
 	int     metadata_request_timeout_ms;
 	int     metadata_refresh_interval_ms;
@@ -126,6 +136,7 @@ struct rd_kafka_conf_s {
 	int     debug;
 	int     broker_addr_ttl;
         int     broker_addr_family;
+        int     broker_threads;
 	int     socket_timeout_ms;
 	int     socket_blocking_max_ms;
 	int     socket_sndbuf_size;
@@ -133,6 +144,8 @@ struct rd_kafka_conf_s {
         int     socket_keepalive;
 	int     socket_nagle_disable;
         int     socket_max_fails;
+        rd_kafka_io_backend_t socket_io_backend;
+        int     socket_zerocopy;
 	char   *client_id_str;
 	char   *brokerlist;
 	int     stats_interval_ms;
@@ -217,9 +230,13 @@ struct rd_kafka_conf_s {
 	 * Consumer configuration
 	 */
         int    check_crcs;
+        int    fetch_batch_ops;
+        int    fetch_decompress_threads;
 	int    queued_min_msgs;
         int    queued_max_msg_kbytes;
         int64_t queued_max_msg_bytes;
+        int    queued_max_total_kbytes;
+        int64_t queued_max_total_bytes;
 	int    fetch_wait_max_ms;
         int    fetch_msg_max_bytes;
         int    fetch_max_bytes;
@@ -261,11 +278,16 @@ struct rd_kafka_conf_s {
 	int    queue_buffering_max_msgs;
 	int    queue_buffering_max_kbytes;
 	int    buffering_max_ms;
+        int    queue_buffering_lockfree;
         int    queue_backpressure_thres;
 	int    max_retries;
 	int    retry_backoff_ms;
+        struct {
+                int idempotence;  /**< Enable Idempotent Producer */
+        } eos;
 	int    batch_num_messages;
 	rd_kafka_compression_t compression_codec;
+        int    compression_threads;
 	int    dr_err_only;
 
 	/* Message delivery report callback.
@@ -0,0 +1,686 @@
+/*
+ * librdkafka - Apache Kafka C library
+ *
+ * Copyright (c) 2018 Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "rdkafka_int.h"
+#include "rdkafka_op.h"
+#include "rdkafka_partition.h"
+#include "rdkafka_broker.h"
+#include "rdkafka_decompress.h"
+#include "rdunittest.h"
+
+
+/**
+ * @brief Initialize job \p rkdj for partition \p rktp.
+ *        The caller sets up rkdj_run and rkdj_free.
+ */
+void rd_kafka_decomp_job_init (rd_kafka_decomp_job_t *rkdj,
+                               rd_kafka_toppar_t *rktp) {
+        rkdj->rkdj_s_rktp = rd_kafka_toppar_keep(rktp);
+        rd_kafka_q_init(&rkdj->rkdj_rkq, rktp->rktp_rkt->rkt_rk);
+        /* Make sure enqueued ops get the correct serve/opaque reflecting
+         * the fetch queue. */
+        rkdj->rkdj_rkq.rkq_serve  = rktp->rktp_fetchq->rkq_serve;
+        rkdj->rkdj_rkq.rkq_opaque = rktp->rktp_fetchq->rkq_opaque;
+        rkdj->rkdj_done = 0;
+        rkdj->rkdj_msgcnt = 0;
+        rkdj->rkdj_bytes = 0;
+        rkdj->rkdj_version = 0;
+        rkdj->rkdj_epoch = 0;
+        rkdj->rkdj_fail_offset = RD_KAFKA_OFFSET_INVALID;
+}
+
+
+/**
+ * @brief Account the job's messages and bytes on its partition until
+ *        it is destroyed, for fetch backpressure.
+ */
+static void rd_kafka_decomp_job_account (rd_kafka_decomp_job_t *rkdj,
+                                         int add) {
+        rd_kafka_toppar_t *rktp = rd_kafka_toppar_s2i(rkdj->rkdj_s_rktp);
+
+        rd_atomic32_add(&rktp->rktp_decomp_msgcnt,
+                        add ? rkdj->rkdj_msgcnt : -rkdj->rkdj_msgcnt);
+        rd_atomic64_add(&rktp->rktp_decomp_bytes,
+                        add ? rkdj->rkdj_bytes : -rkdj->rkdj_bytes);
+}
+
+
+/**
+ * @brief Destroy job, purging any ops that could not be delivered.
+ *
+ * @locks none
+ */
+static void rd_kafka_decomp_job_destroy (rd_kafka_decomp_job_t *rkdj) {
+        rd_kafka_decomp_job_account(rkdj, 0/*sub*/);
+        rd_kafka_q_destroy_owner(&rkdj->rkdj_rkq);
+        rd_kafka_toppar_destroy(rkdj->rkdj_s_rktp);
+        if (rkdj->rkdj_free)
+                rkdj->rkdj_free(rkdj);
+        else
+                rd_free(rkdj);
+}
+
+
+/**
+ * @returns true if ops may not be delivered to the partition's fetch queue
+ *          since they follow a failed job, or were fetched prior to
+ *          the rewind that followed it.
+ *
+ * @locks rktp_decomp_lock MUST be held
+ */
+static RD_INLINE int
+rd_kafka_decomp_held_back (const rd_kafka_toppar_t *rktp, int32_t epoch) {
+        return epoch != rktp->rktp_decomp_epoch ||
+                rktp->rktp_decomp_fail_offset != RD_KAFKA_OFFSET_INVALID;
+}
+
+
+/**
+ * @brief Mark \p rkdj as done and move the ops of all done jobs at the
+ *        head of the partition's job list to the partition's fetch queue.
+ *
+ *        A failed job's ops are delivered, but those of any job following
+ *        it are not: the partition's broker thread is woken up to refetch
+ *        from the failed job's offset instead, see rd_kafka_decomp_rewind().
+ *
+ * @locality decompression worker thread
+ * @locks none
+ */
+static void rd_kafka_decomp_job_done (rd_kafka_decomp_job_t *rkdj) {
+        rd_kafka_toppar_t *rktp = rd_kafka_toppar_s2i(rkdj->rkdj_s_rktp);
+        struct rd_kafka_decomp_job_head_s doneq =
+                TAILQ_HEAD_INITIALIZER(doneq);
+        int rewind = 0;
+
+        mtx_lock(&rktp->rktp_decomp_lock);
+        rkdj->rkdj_done = 1;
+        while ((rkdj = TAILQ_FIRST(&rktp->rktp_decomp_jobs)) &&
+               rkdj->rkdj_done) {
+                TAILQ_REMOVE(&rktp->rktp_decomp_jobs, rkdj, rkdj_rktp_link);
+                TAILQ_INSERT_TAIL(&doneq, rkdj, rkdj_link);
+
+                /* Ops that are not delivered are purged in
+                 * job_destroy(), as are the ops of a disabled
+                 * fetch queue. */
+                if (rd_kafka_decomp_held_back(rktp, rkdj->rkdj_epoch))
+                        continue;
+
+                rd_kafka_q_concat(rktp->rktp_fetchq, &rkdj->rkdj_rkq);
+
+                if (unlikely(rkdj->rkdj_fail_offset !=
+                             RD_KAFKA_OFFSET_INVALID)) {
+                        rktp->rktp_decomp_fail_offset =
+                                rkdj->rkdj_fail_offset;
+                        rktp->rktp_decomp_fail_version = rkdj->rkdj_version;
+                        rewind = 1;
+                }
+        }
+        mtx_unlock(&rktp->rktp_decomp_lock);
+
+        if (unlikely(rewind)) {
+                rd_kafka_toppar_lock(rktp);
+                if (rktp->rktp_leader)
+                        rd_kafka_broker_wakeup(rktp->rktp_leader);
+                rd_kafka_toppar_unlock(rktp);
+        }
+
+        /* Destroy outside the lock since this may drop the last
+         * reference to the partition. */
+        while ((rkdj = TAILQ_FIRST(&doneq))) {
+                TAILQ_REMOVE(&doneq, rkdj, rkdj_link);
+                rd_kafka_decomp_job_destroy(rkdj);
+        }
+}
+
+
+/**
+ * @brief Submit job to the pool. The job is appended to its partition's
+ *        job list to retain message order.
+ *
+ * @locality broker thread
+ */
+void rd_kafka_decomp_pool_submit (rd_kafka_decomp_pool_t *rkdp,
+                                  rd_kafka_decomp_job_t *rkdj) {
+        rd_kafka_toppar_t *rktp = rd_kafka_toppar_s2i(rkdj->rkdj_s_rktp);
+
+        rd_kafka_decomp_job_account(rkdj, 1/*add*/);
+
+        mtx_lock(&rktp->rktp_decomp_lock);
+        rkdj->rkdj_epoch = rktp->rktp_decomp_epoch;
+        TAILQ_INSERT_TAIL(&rktp->rktp_decomp_jobs, rkdj, rkdj_rktp_link);
+        mtx_unlock(&rktp->rktp_decomp_lock);
+
+        mtx_lock(&rkdp->rkdp_lock);
+        TAILQ_INSERT_TAIL(&rkdp->rkdp_jobs, rkdj, rkdj_link);
+        rkdp->rkdp_job_cnt++;
+        cnd_signal(&rkdp->rkdp_cnd);
+        mtx_unlock(&rkdp->rkdp_lock);
+}
+
+
+/**
+ * @brief Move ops parsed inline by the broker thread to the partition's
+ *        fetch queue, or if there are outstanding jobs for the partition,
+ *        queue them behind those jobs.
+ *
+ *        The ops are purged if they follow a failed job that has not
+ *        yet been rewound.
+ *
+ * @returns 0 on success or -1 if the fetch queue is disabled.
+ *
+ * @locality broker thread
+ */
+int rd_kafka_decomp_enq_done (rd_kafka_toppar_t *rktp, rd_kafka_q_t *rkq) {
+        rd_kafka_decomp_job_t *rkdj;
+        int r = 0;
+
+        mtx_lock(&rktp->rktp_decomp_lock);
+        if (unlikely(rd_kafka_decomp_held_back(rktp,
+                                               rktp->rktp_decomp_epoch))) {
+                mtx_unlock(&rktp->rktp_decomp_lock);
+                rd_kafka_q_purge(rkq);
+                return 0;
+        }
+
+        if (TAILQ_EMPTY(&rktp->rktp_decomp_jobs)) {
+                r = rd_kafka_q_concat(rktp->rktp_fetchq, rkq);
+                mtx_unlock(&rktp->rktp_decomp_lock);
+                return r;
+        }
+
+        if (rd_kafka_q_len(rkq) > 0) {
+                rkdj = rd_calloc(1, sizeof(*rkdj));
+                rd_kafka_decomp_job_init(rkdj, rktp);
+                rkdj->rkdj_msgcnt = rd_kafka_q_len(rkq);
+                rkdj->rkdj_bytes = (int64_t)rd_kafka_q_size(rkq);
+                rd_kafka_decomp_job_account(rkdj, 1/*add*/);
+                rd_kafka_q_concat(&rkdj->rkdj_rkq, rkq);
+                rkdj->rkdj_epoch = rktp->rktp_decomp_epoch;
+                rkdj->rkdj_done = 1;
+                TAILQ_INSERT_TAIL(&rktp->rktp_decomp_jobs, rkdj,
+                                  rkdj_rktp_link);
+        }
+        mtx_unlock(&rktp->rktp_decomp_lock);
+
+        return r;
+}
+
+
+/**
+ * @brief Propagate a partition error, such as PARTITION_EOF, to the
+ *        application behind any outstanding jobs for the partition
+ *        so that it is not delivered ahead of earlier messages.
+ *
+ * @locality broker thread
+ */
+void rd_kafka_decomp_enq_err (rd_kafka_toppar_t *rktp,
+                              rd_kafka_resp_err_t err, int32_t version,
+                              int64_t offset) {
+        rd_kafka_q_t rkq;
+
+        rd_kafka_q_init(&rkq, rktp->rktp_rkt->rkt_rk);
+        rkq.rkq_serve  = rktp->rktp_fetchq->rkq_serve;
+        rkq.rkq_opaque = rktp->rktp_fetchq->rkq_opaque;
+
+        rd_kafka_q_op_err(&rkq, RD_KAFKA_OP_CONSUMER_ERR,
+                          err, version, rktp, offset,
+                          "%s", rd_kafka_err2str(err));
+        rd_kafka_decomp_enq_done(rktp, &rkq);
+
+        rd_kafka_q_destroy_owner(&rkq);
+}
+
+
+/**
+ * @brief Rewind the partition's fetch position to the offset of a failed
+ *        job, if any, and back off the next fetch.
+ *
+ *        Outstanding jobs and fetch responses from before the rewind
+ *        are dropped. The rewind is skipped if the fetch version has
+ *        changed (e.g., by a seek) since the failed job was submitted.
+ *
+ * @locality broker thread
+ * @locks toppar_lock MUST be held
+ */
+void rd_kafka_decomp_rewind (rd_kafka_broker_t *rkb, rd_kafka_toppar_t *rktp) {
+        int64_t offset;
+        int32_t version;
+
+        mtx_lock(&rktp->rktp_decomp_lock);
+        offset = rktp->rktp_decomp_fail_offset;
+        version = rktp->rktp_decomp_fail_version;
+        if (likely(offset == RD_KAFKA_OFFSET_INVALID)) {
+                mtx_unlock(&rktp->rktp_decomp_lock);
+                return;
+        }
+        rktp->rktp_decomp_fail_offset = RD_KAFKA_OFFSET_INVALID;
+        rktp->rktp_decomp_epoch++;
+        mtx_unlock(&rktp->rktp_decomp_lock);
+
+        if (version != rktp->rktp_fetch_version)
+                return;
+
+        rd_rkb_dbg(rkb, FETCH, "REWIND",
+                   "%s [%"PRId32"]: decompression failed: "
+                   "refetching from offset %"PRId64" (was %"PRId64")",
+                   rktp->rktp_rkt->rkt_topic->str, rktp->rktp_partition,
+                   offset, rktp->rktp_offsets.fetch_offset);
+
+        rktp->rktp_offsets.fetch_offset = offset;
+        rktp->rktp_ts_fetch_backoff = rd_clock() +
+                (rkb->rkb_rk->rk_conf.fetch_error_backoff_ms * 1000);
+}
+
+
+/**
+ * @brief Decompression worker thread main loop.
+ *
+ * Queued jobs are drained before the thread exits on termination.
+ *
+ * @locality decompression worker thread
+ */
+static int rd_kafka_decomp_pool_thread_main (void *arg) {
+        rd_kafka_decomp_pool_t *rkdp = arg;
+        rd_kafka_op_cache_t rkopc = RD_ZERO_INIT;
+        rd_kafka_codec_ctx_t codec = RD_ZERO_INIT;
+        rd_kafka_decomp_job_t *rkdj;
+
+        rd_kafka_set_thread_name("decomp");
+        rd_kafka_set_thread_sysname("rdk:decomp");
+
+        (void)rd_atomic32_add(&rd_kafka_thread_cnt_curr, 1);
+
+        mtx_lock(&rkdp->rkdp_lock);
+        while (1) {
+                while (!(rkdj = TAILQ_FIRST(&rkdp->rkdp_jobs)) &&
+                       !rkdp->rkdp_terminate)
+                        cnd_wait(&rkdp->rkdp_cnd, &rkdp->rkdp_lock);
+
+                if (!rkdj)
+                        break; /* Terminating and all jobs served */
+
+                TAILQ_REMOVE(&rkdp->rkdp_jobs, rkdj, rkdj_link);
+                rkdp->rkdp_job_cnt--;
+                mtx_unlock(&rkdp->rkdp_lock);
+
+                rkdj->rkdj_run(rkdj, &rkopc, &codec);
+                rd_kafka_decomp_job_done(rkdj);
+
+                mtx_lock(&rkdp->rkdp_lock);
+        }
+        mtx_unlock(&rkdp->rkdp_lock);
+
+        rd_kafka_op_cache_destroy(&rkdp->rkdp_rk->rk_fetch_op_pool, &rkopc);
+        rd_kafka_codec_ctx_destroy(&codec);
+
+        rd_atomic32_sub(&rd_kafka_thread_cnt_curr, 1);
+
+        return 0;
+}
+
+
+/**
+ * @brief Create decompression pool with \p thread_cnt worker threads.
+ *
+ * @returns the new pool, or NULL on failure in which case a human readable
+ *          error is written to \p errstr.
+ *
+ * @locality application thread
+ */
+rd_kafka_decomp_pool_t *
+rd_kafka_decomp_pool_new (rd_kafka_t *rk, int thread_cnt,
+                          char *errstr, size_t errstr_size) {
+        rd_kafka_decomp_pool_t *rkdp;
+        int i;
+
+        rkdp = rd_calloc(1, sizeof(*rkdp));
+        rkdp->rkdp_rk = rk;
+        mtx_init(&rkdp->rkdp_lock, mtx_plain);
+        cnd_init(&rkdp->rkdp_cnd);
+        TAILQ_INIT(&rkdp->rkdp_jobs);
+        rkdp->rkdp_thrds = rd_calloc(thread_cnt, sizeof(*rkdp->rkdp_thrds));
+
+        for (i = 0 ; i < thread_cnt ; i++) {
+                if (thrd_create(&rkdp->rkdp_thrds[i],
+                                rd_kafka_decomp_pool_thread_main, rkdp) !=
+                    thrd_success) {
+                        if (errstr)
+                                rd_snprintf(errstr, errstr_size,
+                                            "Failed to create decompression "
+                                            "thread: %s (%i)",
+                                            rd_strerror(errno), errno);
+                        rd_kafka_decomp_pool_destroy(rkdp);
+                        return NULL;
+                }
+                rkdp->rkdp_thrd_cnt++;
+        }
+
+        return rkdp;
+}
+
+
+/**
+ * @brief Serve all queued jobs, then terminate the worker threads and
+ *        destroy the pool.
+ *
+ * @remark No jobs may be submitted after this call.
+ */
+void rd_kafka_decomp_pool_destroy (rd_kafka_decomp_pool_t *rkdp) {
+        int i;
+
+        mtx_lock(&rkdp->rkdp_lock);
+        rkdp->rkdp_terminate = 1;
+        cnd_broadcast(&rkdp->rkdp_cnd);
+        mtx_unlock(&rkdp->rkdp_lock);
+
+        for (i = 0 ; i < rkdp->rkdp_thrd_cnt ; i++)
+                thrd_join(rkdp->rkdp_thrds[i], NULL);
+
+        rd_assert(TAILQ_EMPTY(&rkdp->rkdp_jobs));
+
+        rd_free(rkdp->rkdp_thrds);
+        cnd_destroy(&rkdp->rkdp_cnd);
+        mtx_destroy(&rkdp->rkdp_lock);
+        rd_free(rkdp);
+}
+
+
+
+/**
+ * @name Unit tests
+ * @{
+ */
+
+struct ut_decomp_job {
+        rd_kafka_decomp_job_t rkdj; /* Must be first */
+        int seq;
+        rd_atomic32_t *gate;        /* Hold the job while set, or NULL */
+        int64_t fail_offset;        /* Fail the job, refetching from
+                                     * this offset, if set. */
+};
+
+static void ut_decomp_job_run (rd_kafka_decomp_job_t *rkdj,
+                               rd_kafka_op_cache_t *rkopc,
+                               rd_kafka_codec_ctx_t *codec) {
+        struct ut_decomp_job *job = (struct ut_decomp_job *)rkdj;
+        rd_kafka_op_t *rko;
+
+        while (job->gate && rd_atomic32_get(job->gate))
+                rd_usleep(1000, NULL);
+
+        /* Finish jobs out of order */
+        rd_usleep((job->seq % 3) * 1000, NULL);
+
+        rko = rd_kafka_op_new(RD_KAFKA_OP_NONE);
+        rko->rko_version = job->seq;
+        rd_kafka_q_enq(&rkdj->rkdj_rkq, rko);
+
+        if (job->fail_offset)
+                rkdj->rkdj_fail_offset = job->fail_offset;
+}
+
+static struct ut_decomp_job *ut_decomp_job_new (rd_kafka_toppar_t *rktp,
+                                                int seq) {
+        struct ut_decomp_job *job = rd_calloc(1, sizeof(*job));
+
+        rd_kafka_decomp_job_init(&job->rkdj, rktp);
+        job->rkdj.rkdj_run = ut_decomp_job_run;
+        job->rkdj.rkdj_version = rktp->rktp_fetch_version;
+        job->seq = seq;
+        return job;
+}
+
+static void ut_decomp_enq_inline (rd_kafka_toppar_t *rktp,
+                                  rd_kafka_q_t *inlineq, int seq) {
+        rd_kafka_op_t *rko = rd_kafka_op_new(RD_KAFKA_OP_NONE);
+
+        rko->rko_version = seq;
+        rd_kafka_q_enq(inlineq, rko);
+        rd_kafka_decomp_enq_done(rktp, inlineq);
+}
+
+/**
+ * @brief Verify that job results are delivered in submission order,
+ *        including inline ops and partition errors queued behind
+ *        outstanding jobs, and that a failed job rewinds the fetch
+ *        position.
+ */
+int unittest_decomp_pool (void) {
+        rd_kafka_t *rk;
+        shptr_rd_kafka_toppar_t *s_rktp;
+        rd_kafka_toppar_t *rktp;
+        rd_kafka_decomp_pool_t *rkdp;
+        rd_kafka_q_t inlineq;
+        rd_kafka_op_t *rko;
+        const int job_cnt = 30;
+        int i, seq = 0, refcnt;
+
+        rk = rd_unittest_rk_new(RD_KAFKA_CONSUMER, NULL);
+        RD_UT_ASSERT(rk, "failed to create instance");
+        s_rktp = rd_kafka_toppar_get2(rk, "ut_decomp_pool", 0, 0, 1);
+        rktp = rd_kafka_toppar_s2i(s_rktp);
+        refcnt = rd_refcnt_get(&rktp->rktp_refcnt);
+        rd_kafka_q_init(&inlineq, rk);
+
+        rkdp = rd_kafka_decomp_pool_new(rk, 4, NULL, 0);
+        RD_UT_ASSERT(rkdp, "failed to create pool");
+
+        for (i = 0 ; i < job_cnt ; i++) {
+                if (i % 5 == 4) {
+                        /* Inline parsed op */
+                        rko = rd_kafka_op_new(RD_KAFKA_OP_NONE);
+                        rko->rko_version = i;
+                        rd_kafka_q_enq(&inlineq, rko);
+                        RD_UT_ASSERT(!rd_kafka_decomp_enq_done(rktp,
+                                                               &inlineq),
+                                     "enq_done failed");
+                } else {
+                        struct ut_decomp_job *job =
+                                rd_calloc(1, sizeof(*job));
+                        rd_kafka_decomp_job_init(&job->rkdj, rktp);
+                        job->rkdj.rkdj_run = ut_decomp_job_run;
+                        job->seq = i;
+                        rd_kafka_decomp_pool_submit(rkdp, &job->rkdj);
+                }
+        }
+
+        /* Destroying the pool serves all outstanding jobs */
+        rd_kafka_decomp_pool_destroy(rkdp);
+
+        RD_UT_ASSERT(TAILQ_EMPTY(&rktp->rktp_decomp_jobs),
+                     "expected all jobs to be delivered");
+        RD_UT_ASSERT(rd_kafka_q_len(rktp->rktp_fetchq) == job_cnt,
+                     "expected %d ops, not %d",
+                     job_cnt, rd_kafka_q_len(rktp->rktp_fetchq));
+
+        while ((rko = rd_kafka_q_pop(rktp->rktp_fetchq, 0, 0))) {
+                RD_UT_ASSERT(rko->rko_version == seq,
+                             "expected op #%d, not #%d",
+                             seq, (int)rko->rko_version);
+                rd_kafka_op_destroy(rko);
+                seq++;
+        }
+
+        /* Outstanding jobs, and the inline ops queued behind them,
+         * count towards the fetch queue for backpressure. */
+        rkdp = rd_kafka_decomp_pool_new(rk, 1, NULL, 0);
+        RD_UT_ASSERT(rkdp, "failed to create pool");
+        {
+                struct ut_decomp_job *job = rd_calloc(1, sizeof(*job));
+                rd_atomic32_t gate;
+
+                rd_atomic32_init(&gate, 1);
+                rd_kafka_decomp_job_init(&job->rkdj, rktp);
+                job->rkdj.rkdj_run = ut_decomp_job_run;
+                job->rkdj.rkdj_msgcnt = 100;
+                job->rkdj.rkdj_bytes = 5000;
+                job->gate = &gate;
+                rd_kafka_decomp_pool_submit(rkdp, &job->rkdj);
+
+                rko = rd_kafka_op_new(RD_KAFKA_OP_NONE);
+                rko->rko_len = 10;
+                rd_kafka_q_enq(&inlineq, rko);
+                RD_UT_ASSERT(!rd_kafka_decomp_enq_done(rktp, &inlineq),
+                             "enq_done failed");
+
+                RD_UT_ASSERT(rd_kafka_toppar_fetchq_msgcnt(rktp) == 101 &&
+                             rd_kafka_toppar_fetchq_size(rktp) == 5010,
+                             "expected 101 msgs and 5010 bytes held, "
+                             "not %d and %"PRId64,
+                             rd_kafka_toppar_fetchq_msgcnt(rktp),
+                             rd_kafka_toppar_fetchq_size(rktp));
+
+                rd_atomic32_set(&gate, 0);
+                rd_kafka_decomp_pool_destroy(rkdp);
+
+                /* Only the delivered ops remain */
+                RD_UT_ASSERT(rd_kafka_toppar_fetchq_msgcnt(rktp) == 2 &&
+                             rd_kafka_toppar_fetchq_size(rktp) == 10,
+                             "expected 2 msgs and 10 bytes held, "
+                             "not %d and %"PRId64,
+                             rd_kafka_toppar_fetchq_msgcnt(rktp),
+                             rd_kafka_toppar_fetchq_size(rktp));
+                rd_kafka_q_purge(rktp->rktp_fetchq);
+        }
+
+        /* PARTITION_EOF is held back until the preceding job is done. */
+        rkdp = rd_kafka_decomp_pool_new(rk, 1, NULL, 0);
+        RD_UT_ASSERT(rkdp, "failed to create pool");
+        {
+                struct ut_decomp_job *job = ut_decomp_job_new(rktp, 0);
+                rd_atomic32_t gate;
+
+                rd_atomic32_init(&gate, 1);
+                job->gate = &gate;
+                rd_kafka_decomp_pool_submit(rkdp, &job->rkdj);
+
+                rd_kafka_decomp_enq_err(rktp,
+                                        RD_KAFKA_RESP_ERR__PARTITION_EOF,
+                                        rktp->rktp_fetch_version, 100);
+                RD_UT_ASSERT(rd_kafka_q_len(rktp->rktp_fetchq) == 0,
+                             "expected EOF to be held back, not %d ops",
+                             rd_kafka_q_len(rktp->rktp_fetchq));
+
+                rd_atomic32_set(&gate, 0);
+                rd_kafka_decomp_pool_destroy(rkdp);
+
+                rko = rd_kafka_q_pop(rktp->rktp_fetchq, 0, 0);
+                RD_UT_ASSERT(rko && rko->rko_type == RD_KAFKA_OP_NONE,
+                             "expected job op first");
+                rd_kafka_op_destroy(rko);
+                rko = rd_kafka_q_pop(rktp->rktp_fetchq, 0, 0);
+                RD_UT_ASSERT(rko &&
+                             rko->rko_type == RD_KAFKA_OP_CONSUMER_ERR &&
+                             rko->rko_err ==
+                             RD_KAFKA_RESP_ERR__PARTITION_EOF &&
+                             rko->rko_u.err.offset == 100,
+                             "expected PARTITION_EOF at offset 100 last");
+                rd_kafka_op_destroy(rko);
+                RD_UT_ASSERT(rd_kafka_q_len(rktp->rktp_fetchq) == 0,
+                             "expected no more ops");
+        }
+
+        /* The failed job's ops are delivered but nothing following it
+         * until the fetch position is rewound to the failed job. */
+        rkdp = rd_kafka_decomp_pool_new(rk, 2, NULL, 0);
+        RD_UT_ASSERT(rkdp, "failed to create pool");
+        {
+                rd_kafka_broker_t *rkb = rd_kafka_broker_internal(rk);
+                struct ut_decomp_job *job;
+                int32_t epoch = rktp->rktp_decomp_epoch;
+
+                RD_UT_ASSERT(rkb, "no internal broker");
+
+                job = ut_decomp_job_new(rktp, 0);
+                rd_kafka_decomp_pool_submit(rkdp, &job->rkdj);
+                job = ut_decomp_job_new(rktp, 1);
+                job->fail_offset = 200;
+                rd_kafka_decomp_pool_submit(rkdp, &job->rkdj);
+                job = ut_decomp_job_new(rktp, 2);
+                rd_kafka_decomp_pool_submit(rkdp, &job->rkdj);
+                ut_decomp_enq_inline(rktp, &inlineq, 3);
+
+                rd_kafka_decomp_pool_destroy(rkdp);
+
+                RD_UT_ASSERT(TAILQ_EMPTY(&rktp->rktp_decomp_jobs),
+                             "expected all jobs to be done");
+                RD_UT_ASSERT(rd_kafka_q_len(rktp->rktp_fetchq) == 2,
+                             "expected 2 ops up to the failed job, not %d",
+                             rd_kafka_q_len(rktp->rktp_fetchq));
+                RD_UT_ASSERT(rktp->rktp_decomp_fail_offset == 200,
+                             "expected rewind to offset 200, not %"PRId64,
+                             rktp->rktp_decomp_fail_offset);
+
+                /* Inline ops are dropped until rewound */
+                ut_decomp_enq_inline(rktp, &inlineq, 4);
+                RD_UT_ASSERT(rd_kafka_q_len(rktp->rktp_fetchq) == 2,
+                             "expected inline op to be dropped");
+
+                rd_kafka_toppar_lock(rktp);
+                rd_kafka_decomp_rewind(rkb, rktp);
+                rd_kafka_toppar_unlock(rktp);
+
+                RD_UT_ASSERT(rktp->rktp_offsets.fetch_offset == 200,
+                             "expected fetch offset 200, not %"PRId64,
+                             rktp->rktp_offsets.fetch_offset);
+                RD_UT_ASSERT(rktp->rktp_ts_fetch_backoff > 0,
+                             "expected fetch backoff");
+                RD_UT_ASSERT(rktp->rktp_decomp_fail_offset ==
+                             RD_KAFKA_OFFSET_INVALID &&
+                             rktp->rktp_decomp_epoch == epoch + 1,
+                             "expected rewind to start a new epoch");
+
+                ut_decomp_enq_inline(rktp, &inlineq, 5);
+                RD_UT_ASSERT(rd_kafka_q_len(rktp->rktp_fetchq) == 3,
+                             "expected inline op to be delivered");
+
+                for (seq = 0 ; seq < 3 ; seq++) {
+                        static const int exp[] = { 0, 1, 5 };
+                        rko = rd_kafka_q_pop(rktp->rktp_fetchq, 0, 0);
+                        RD_UT_ASSERT(rko->rko_version == exp[seq],
+                                     "expected op #%d, not #%d",
+                                     exp[seq], (int)rko->rko_version);
+                        rd_kafka_op_destroy(rko);
+                }
+
+                rd_kafka_broker_destroy(rkb);
+        }
+
+        RD_UT_ASSERT(rd_refcnt_get(&rktp->rktp_refcnt) == refcnt,
+                     "expected rktp refcnt %d, not %d",
+                     refcnt, rd_refcnt_get(&rktp->rktp_refcnt));
+
+        rd_kafka_q_destroy_owner(&inlineq);
+        rd_kafka_toppar_destroy(s_rktp);
+        rd_kafka_destroy(rk);
+
+        RD_UT_PASS();
+}
+
+/**@}*/
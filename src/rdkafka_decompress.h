@@ -0,0 +1,138 @@
+/*
+ * librdkafka - Apache Kafka C library
+ *
+ * Copyright (c) 2018 Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _RDKAFKA_DECOMPRESS_H_
+#define _RDKAFKA_DECOMPRESS_H_
+
+/**
+ * @name Fetch decompression worker pool
+ *
+ * Compressed MessageSets may be handed off by the broker thread to a pool
+ * of worker threads (fetch.decompress.threads) which decompress and parse
+ * them in parallel.
+ *
+ * To retain message order all jobs (and any ops parsed inline by the broker
+ * thread in between jobs) are kept on a per-partition list in
+ * submission order and their resulting ops are only moved to the
+ * partition's fetch queue once all preceding jobs are done.
+ *
+ * A failed job holds back all ops that follow it and rewinds the
+ * partition's fetch position to the failed MessageSet, see
+ * rd_kafka_decomp_rewind().
+ *
+ * @{
+ */
+
+typedef struct rd_kafka_decomp_job_s rd_kafka_decomp_job_t;
+
+/**
+ * @brief Decompression job.
+ *
+ * Embedded as the first field in the job owner's own struct, the owner
+ * provides the \c rkdj_run callback to perform the actual work and
+ * the \c rkdj_free callback to free the job.
+ */
+struct rd_kafka_decomp_job_s {
+        TAILQ_ENTRY(rd_kafka_decomp_job_s) rkdj_link;      /**< Pool's job
+                                                            *   queue */
+        TAILQ_ENTRY(rd_kafka_decomp_job_s) rkdj_rktp_link; /**< Partition's
+                                                            *   in-order
+                                                            *   job list */
+        shptr_rd_kafka_toppar_t *rkdj_s_rktp;
+        rd_kafka_q_t  rkdj_rkq;          /**< Resulting ops */
+        int           rkdj_done;         /**< Job is done, ops may be moved
+                                          *   to the fetch queue.
+                                          *   Locks: rktp_decomp_lock */
+        int32_t       rkdj_msgcnt;       /**< Messages held by the job,
+                                          *   set by the owner prior to
+                                          *   submission (estimate). */
+        int64_t       rkdj_bytes;        /**< Bytes held by the job,
+                                          *   set by the owner prior to
+                                          *   submission. */
+        int32_t       rkdj_version;      /**< Fetch version of the job,
+                                          *   set by the owner prior to
+                                          *   submission. */
+        int32_t       rkdj_epoch;        /**< rktp_decomp_epoch at
+                                          *   submission. */
+        int64_t       rkdj_fail_offset;  /**< Set by rkdj_run if the job
+                                          *   failed to the offset to
+                                          *   refetch from, else
+                                          *   RD_KAFKA_OFFSET_INVALID. */
+
+        /** Decompress and parse, enqueueing the ops on rkdj_rkq.
+         *  Any fetch ops must be allocated from the thread-local
+         *  \p rkopc cache, and payloads decompressed with the
+         *  thread-local \p codec contexts.
+         *  NULL for jobs that are done at submission. */
+        void (*rkdj_run) (rd_kafka_decomp_job_t *rkdj,
+                          rd_kafka_op_cache_t *rkopc,
+                          rd_kafka_codec_ctx_t *codec);
+        /** Free the job, NULL to use rd_free(). */
+        void (*rkdj_free) (rd_kafka_decomp_job_t *rkdj);
+};
+
+TAILQ_HEAD(rd_kafka_decomp_job_head_s, rd_kafka_decomp_job_s);
+
+
+/**
+ * @brief Decompression worker pool, one per consumer instance.
+ */
+typedef struct rd_kafka_decomp_pool_s {
+        rd_kafka_t   *rkdp_rk;
+        mtx_t         rkdp_lock;
+        cnd_t         rkdp_cnd;
+        struct rd_kafka_decomp_job_head_s rkdp_jobs; /**< Queued jobs.
+                                                      *   Locks: rkdp_lock */
+        int           rkdp_job_cnt;      /**< Locks: rkdp_lock */
+        int           rkdp_terminate;    /**< Locks: rkdp_lock */
+        thrd_t       *rkdp_thrds;
+        int           rkdp_thrd_cnt;
+} rd_kafka_decomp_pool_t;
+
+
+rd_kafka_decomp_pool_t *
+rd_kafka_decomp_pool_new (rd_kafka_t *rk, int thread_cnt,
+                          char *errstr, size_t errstr_size);
+void rd_kafka_decomp_pool_destroy (rd_kafka_decomp_pool_t *rkdp);
+
+void rd_kafka_decomp_job_init (rd_kafka_decomp_job_t *rkdj,
+                               rd_kafka_toppar_t *rktp);
+void rd_kafka_decomp_pool_submit (rd_kafka_decomp_pool_t *rkdp,
+                                  rd_kafka_decomp_job_t *rkdj);
+int rd_kafka_decomp_enq_done (rd_kafka_toppar_t *rktp, rd_kafka_q_t *rkq);
+void rd_kafka_decomp_enq_err (rd_kafka_toppar_t *rktp,
+                              rd_kafka_resp_err_t err, int32_t version,
+                              int64_t offset);
+void rd_kafka_decomp_rewind (rd_kafka_broker_t *rkb, rd_kafka_toppar_t *rktp);
+
+int unittest_decomp_pool (void);
+
+/**@}*/
+
+#endif /* _RDKAFKA_DECOMPRESS_H_ */
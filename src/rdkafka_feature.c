@@ -43,6 +43,10 @@ static const char *rd_kafka_feature_names[] = {
 	"LZ4",
         "OffsetTime",
         "MsgVer2",
+        "TopicAdminApi",
+        "IdempotentProducer",
+        "ZSTD",
+        "FetchSession",
 	NULL
 };
 
@@ -181,6 +185,32 @@ static const struct rd_kafka_feature_map {
                         { -1 },
                 }
         },
+        {
+                /* @brief >=0.11.0: Idempotent Producer (KIP-98) */
+                .feature = RD_KAFKA_FEATURE_IDEMPOTENT_PRODUCER,
+                .depends = {
+                        { RD_KAFKAP_InitProducerId, 0, 0 },
+                        { RD_KAFKAP_Produce, 3, 3 },
+                        { -1 },
+                }
+        },
+        {
+                /* @brief >=2.1.0-IV2: Support ZStandard Compression Codec */
+                .feature = RD_KAFKA_FEATURE_ZSTD,
+                .depends = {
+                        { RD_KAFKAP_Produce, 7, 7 },
+                        { RD_KAFKAP_Fetch, 10, 10 },
+                        { -1 },
+                }
+        },
+        {
+                /* @brief >=1.1.0: Incremental fetch sessions (KIP-227) */
+                .feature = RD_KAFKA_FEATURE_FETCH_SESSION,
+                .depends = {
+                        { RD_KAFKAP_Fetch, 7, 7 },
+                        { -1 },
+                }
+        },
         { .feature = 0 }, /* sentinel */
 };
 
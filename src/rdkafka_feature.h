@@ -69,8 +69,14 @@
 /* >= 0.10.2.0: Topic Admin API */
 #define RD_KAFKA_FEATURE_TOPIC_ADMIN_API 0x400
 
-/* >= 1.0.0: CreatePartitions */
-#define RD_KAFKA_FEATURE_TOPIC_ADMIN_API 0x400
+/* >= 0.11.0.0: Idempotent Producer support */
+#define RD_KAFKA_FEATURE_IDEMPOTENT_PRODUCER 0x800
+
+/* >= 2.1.0-IV2: Support ZStandard Compression Codec (KIP-110) */
+#define RD_KAFKA_FEATURE_ZSTD 0x1000
+
+/* >= 1.1.0: Incremental fetch sessions (KIP-227) */
+#define RD_KAFKA_FEATURE_FETCH_SESSION 0x2000
 
 
 int rd_kafka_get_legacy_ApiVersions (const char *broker_version,
@@ -0,0 +1,447 @@
+/*
+ * librdkafka - Apache Kafka C library
+ *
+ * Copyright (c) 2018, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rd.h"
+#include "rdkafka_int.h"
+#include "rdkafka_idempotence.h"
+#include "rdkafka_broker.h"
+#include "rdkafka_request.h"
+
+
+/**
+ * @name Idempotent Producer logic
+ *
+ * The idempotent producer acquires a Producer ID (PID) and epoch from
+ * any broker with the InitProducerIdRequest. All ProduceRequests
+ * are then tagged with the PID, epoch and a per-partition BaseSequence
+ * which allows the broker to detect and discard duplicates, as well as
+ * to reject out-of-order batches.
+ *
+ * The per-partition sequence is derived from the message's msgseq
+ * (rkm_u.producer.msgseq) relative to the partition's
+ * rktp_eos.epoch_base_msgseq, which is rebased each time a new PID is
+ * acquired.
+ *
+ * If the sequence of a partition can no longer be guaranteed (e.g., a
+ * message timed out or permanently failed, leaving a gap in the sequence)
+ * the state machine enters DRAIN_RESET which halts all new ProduceRequests,
+ * waits for all in-flight requests to finish, and then acquires a new PID.
+ *
+ * State machine:
+ *   INIT -> REQ_PID -> WAIT_PID -> ASSIGNED -> DRAIN_RESET -> REQ_PID ..
+ */
+
+static void rd_kafka_idemp_restart_request_pid_tmr (rd_kafka_t *rk,
+                                                    rd_bool_t immediate);
+
+
+/**
+ * @brief Set the idempotent producer's state.
+ *
+ * @locks rd_kafka_wrlock() MUST be held
+ */
+static void rd_kafka_idemp_set_state (rd_kafka_t *rk,
+                                      rd_kafka_idemp_state_t new_state) {
+
+        if (rk->rk_eos.idemp_state == new_state)
+                return;
+
+        rd_kafka_dbg(rk, EOS, "IDEMPSTATE",
+                     "Idempotent producer state change %s -> %s",
+                     rd_kafka_idemp_state2str(rk->rk_eos.
+                                              idemp_state),
+                     rd_kafka_idemp_state2str(new_state));
+
+        rk->rk_eos.idemp_state = new_state;
+        rk->rk_eos.ts_idemp_state = rd_clock();
+}
+
+
+/**
+ * @returns the current PID if the producer is in the ASSIGNED state,
+ *          else an invalid PID.
+ *
+ * @locality any
+ * @locks rd_kafka_*lock() MUST be held if \p do_lock is false.
+ */
+rd_kafka_pid_t rd_kafka_idemp_get_pid0 (rd_kafka_t *rk, rd_bool_t do_lock) {
+        rd_kafka_pid_t pid = RD_KAFKA_PID_INITIALIZER;
+
+        if (do_lock)
+                rd_kafka_rdlock(rk);
+        if (likely(rk->rk_eos.idemp_state == RD_KAFKA_IDEMP_STATE_ASSIGNED))
+                pid = rk->rk_eos.pid;
+        if (do_lock)
+                rd_kafka_rdunlock(rk);
+
+        return pid;
+}
+
+
+/**
+ * @brief Broker filter: only return brokers that support
+ *        the idempotent producer.
+ *
+ * @locks rd_kafka_broker_lock() is held by the caller.
+ */
+static int rd_kafka_idemp_broker_filter (rd_kafka_broker_t *rkb,
+                                         void *opaque) {
+        return !(rkb->rkb_features & RD_KAFKA_FEATURE_IDEMPOTENT_PRODUCER);
+}
+
+
+/**
+ * @brief Handle InitProducerIdResponse
+ *
+ * @locality rdkafka main thread
+ * @locks none
+ */
+static void
+rd_kafka_idemp_handle_InitProducerId (rd_kafka_t *rk,
+                                      rd_kafka_broker_t *rkb,
+                                      rd_kafka_resp_err_t err,
+                                      rd_kafka_buf_t *rkbuf,
+                                      rd_kafka_buf_t *request,
+                                      void *opaque) {
+        const int log_decode_errors = LOG_ERR;
+        int32_t ThrottleTime;
+        int16_t ErrorCode;
+        rd_kafka_pid_t pid;
+
+        if (err == RD_KAFKA_RESP_ERR__DESTROY)
+                return; /* Terminating */
+
+        if (err)
+                goto err;
+
+        rd_kafka_buf_read_i32(rkbuf, &ThrottleTime);
+        rd_kafka_op_throttle_time(rkb, rk->rk_rep, ThrottleTime);
+
+        rd_kafka_buf_read_i16(rkbuf, &ErrorCode);
+        if ((err = ErrorCode))
+                goto err;
+
+        rd_kafka_buf_read_i64(rkbuf, &pid.id);
+        rd_kafka_buf_read_i16(rkbuf, &pid.epoch);
+
+        if (!rd_kafka_pid_valid(pid)) {
+                err = RD_KAFKA_RESP_ERR__BAD_MSG;
+                goto err;
+        }
+
+        rd_kafka_wrlock(rk);
+        if (rk->rk_eos.idemp_state != RD_KAFKA_IDEMP_STATE_WAIT_PID) {
+                rd_kafka_dbg(rk, EOS, "GETPID",
+                             "Ignoring outdated PID response in state %s",
+                             rd_kafka_idemp_state2str(rk->rk_eos.
+                                                      idemp_state));
+                rd_kafka_wrunlock(rk);
+                return;
+        }
+
+        rk->rk_eos.pid = pid;
+        rd_kafka_idemp_set_state(rk, RD_KAFKA_IDEMP_STATE_ASSIGNED);
+        rd_kafka_wrunlock(rk);
+
+        rd_rkb_dbg(rkb, EOS, "GETPID",
+                   "Acquired ProducerId %"PRId64" with epoch %hd",
+                   pid.id, pid.epoch);
+
+        /* Wake up all broker threads that may have messages to send
+         * that were waiting for a PID. */
+        rd_kafka_all_brokers_wakeup(rk, RD_KAFKA_BROKER_STATE_UP);
+        return;
+
+ err_parse:
+        err = rkbuf->rkbuf_err;
+ err:
+        rd_rkb_log(rkb, LOG_WARNING, "GETPID",
+                   "Failed to acquire ProducerId: %s: retrying",
+                   rd_kafka_err2str(err));
+
+        rd_kafka_wrlock(rk);
+        if (rk->rk_eos.idemp_state == RD_KAFKA_IDEMP_STATE_WAIT_PID)
+                rd_kafka_idemp_set_state(rk, RD_KAFKA_IDEMP_STATE_REQ_PID);
+        rd_kafka_wrunlock(rk);
+
+        rd_kafka_idemp_restart_request_pid_tmr(rk, rd_false);
+}
+
+
+/**
+ * @brief Request a new PID from any usable broker.
+ *
+ *        If no broker is usable the request will be retried
+ *        after `retry.backoff.ms`.
+ *
+ * @locality rdkafka main thread
+ * @locks none
+ */
+static void rd_kafka_idemp_request_pid (rd_kafka_t *rk) {
+        rd_kafka_broker_t *rkb;
+        rd_kafka_resp_err_t err;
+        char errstr[128];
+
+        rd_assert(thrd_is_current(rk->rk_thread));
+
+        rd_kafka_wrlock(rk);
+
+        if (rk->rk_eos.idemp_state != RD_KAFKA_IDEMP_STATE_REQ_PID) {
+                rd_kafka_wrunlock(rk);
+                return;
+        }
+
+        rkb = rd_kafka_broker_any(rk, RD_KAFKA_BROKER_STATE_UP,
+                                  rd_kafka_idemp_broker_filter, NULL);
+        if (!rkb) {
+                rd_kafka_wrunlock(rk);
+                rd_kafka_dbg(rk, EOS, "GETPID",
+                             "No brokers with idempotent producer "
+                             "support available: retrying");
+                rd_kafka_idemp_restart_request_pid_tmr(rk, rd_false);
+                return;
+        }
+
+        rd_kafka_idemp_set_state(rk, RD_KAFKA_IDEMP_STATE_WAIT_PID);
+        rd_kafka_wrunlock(rk);
+
+        rd_rkb_dbg(rkb, EOS, "GETPID", "Acquiring ProducerId");
+
+        err = rd_kafka_InitProducerIdRequest(
+                rkb, NULL, -1,
+                errstr, sizeof(errstr),
+                RD_KAFKA_REPLYQ(rk->rk_ops, 0),
+                rd_kafka_idemp_handle_InitProducerId, NULL);
+
+        rd_kafka_broker_destroy(rkb);
+
+        if (err) {
+                rd_kafka_log(rk, LOG_WARNING, "GETPID",
+                             "Failed to acquire ProducerId: %s", errstr);
+
+                rd_kafka_wrlock(rk);
+                rd_kafka_idemp_set_state(rk, RD_KAFKA_IDEMP_STATE_REQ_PID);
+                rd_kafka_wrunlock(rk);
+
+                rd_kafka_idemp_restart_request_pid_tmr(rk, rd_false);
+        }
+}
+
+
+/**
+ * @brief Timer callback for triggering a PID request.
+ *
+ * @locality rdkafka main thread
+ */
+static void rd_kafka_idemp_request_pid_tmr_cb (rd_kafka_timers_t *rkts,
+                                               void *arg) {
+        rd_kafka_idemp_request_pid((rd_kafka_t *)arg);
+}
+
+
+/**
+ * @brief Op callback for triggering an immediate PID request.
+ *
+ * @locality rdkafka main thread
+ */
+static rd_kafka_op_res_t
+rd_kafka_idemp_request_pid_op_cb (rd_kafka_t *rk, rd_kafka_q_t *rkq,
+                                  rd_kafka_op_t *rko) {
+        if (rko->rko_err != RD_KAFKA_RESP_ERR__DESTROY)
+                rd_kafka_idemp_request_pid(rk);
+        return RD_KAFKA_OP_RES_HANDLED;
+}
+
+
+/**
+ * @brief Schedule a PID request, either immediately or
+ *        after `retry.backoff.ms`.
+ *
+ *        The immediate variant is triggered through an op since the
+ *        main thread may otherwise not wake up from its queue wait
+ *        in time to serve the timer.
+ *
+ * @locality any
+ * @locks none
+ */
+static void rd_kafka_idemp_restart_request_pid_tmr (rd_kafka_t *rk,
+                                                    rd_bool_t immediate) {
+        if (immediate) {
+                rd_kafka_q_enq(rk->rk_ops,
+                               rd_kafka_op_new_cb(
+                                       rk, RD_KAFKA_OP_NONE,
+                                       rd_kafka_idemp_request_pid_op_cb));
+                return;
+        }
+
+        rd_kafka_timer_start_oneshot(&rk->rk_timers,
+                                     &rk->rk_eos.request_pid_tmr,
+                                     rk->rk_conf.retry_backoff_ms * 1000,
+                                     rd_kafka_idemp_request_pid_tmr_cb, rk);
+}
+
+
+/**
+ * @brief Check if all in-flight requests have finished while in
+ *        DRAIN_RESET, and if so request a new PID.
+ *
+ * @locality any
+ * @locks none
+ */
+static void rd_kafka_idemp_check_drain_done (rd_kafka_t *rk) {
+        rd_bool_t drained = rd_false;
+
+        rd_kafka_wrlock(rk);
+        if (rk->rk_eos.idemp_state == RD_KAFKA_IDEMP_STATE_DRAIN_RESET &&
+            rd_atomic32_get(&rk->rk_eos.inflight_toppar_cnt) == 0) {
+                rd_kafka_pid_reset(&rk->rk_eos.pid);
+                rd_kafka_idemp_set_state(rk, RD_KAFKA_IDEMP_STATE_REQ_PID);
+                drained = rd_true;
+        }
+        rd_kafka_wrunlock(rk);
+
+        if (drained) {
+                rd_kafka_dbg(rk, EOS, "DRAIN",
+                             "All partitions drained: "
+                             "requesting new ProducerId");
+                rd_kafka_idemp_restart_request_pid_tmr(rk, rd_true);
+        }
+}
+
+
+/**
+ * @brief Halt all new ProduceRequests and wait for in-flight requests
+ *        to finish, then reset the PID and acquire a new one.
+ *
+ *        This is needed when the per-partition sequence can no longer be
+ *        guaranteed to be gap-free, e.g., after messages timed out or
+ *        permanently failed.
+ *
+ * @locality any
+ * @locks none
+ */
+void rd_kafka_idemp_drain_reset (rd_kafka_t *rk, const char *reason) {
+
+        rd_kafka_wrlock(rk);
+        if (rk->rk_eos.idemp_state != RD_KAFKA_IDEMP_STATE_ASSIGNED) {
+                /* Not yet assigned a PID, or already resetting. */
+                rd_kafka_wrunlock(rk);
+                return;
+        }
+
+        rd_kafka_dbg(rk, EOS, "DRAIN",
+                     "Beginning partition drain for ProducerId %"PRId64
+                     " epoch %hd reset (%"PRId32" partition(s) with "
+                     "in-flight requests): %s",
+                     rk->rk_eos.pid.id, rk->rk_eos.pid.epoch,
+                     rd_atomic32_get(&rk->rk_eos.inflight_toppar_cnt),
+                     reason);
+        rd_kafka_idemp_set_state(rk, RD_KAFKA_IDEMP_STATE_DRAIN_RESET);
+        rd_kafka_wrunlock(rk);
+
+        rd_kafka_idemp_check_drain_done(rk);
+}
+
+
+/**
+ * @brief Account for \p cnt messages now being in-flight for \p rktp.
+ *
+ * @locality broker thread
+ * @locks none
+ */
+void rd_kafka_idemp_inflight_toppar_add (rd_kafka_t *rk,
+                                         rd_kafka_toppar_t *rktp, int cnt) {
+        if (rd_atomic32_add(&rktp->rktp_msgs_inflight, cnt) == cnt)
+                rd_atomic32_add(&rk->rk_eos.inflight_toppar_cnt, 1);
+}
+
+
+/**
+ * @brief Account for \p cnt in-flight messages for \p rktp having
+ *        finished (successfully or not).
+ *
+ *        When the partition no longer has any messages in-flight
+ *        its wait_drain flag is cleared, and if the producer is in the
+ *        DRAIN_RESET state and this was the last partition to drain
+ *        a new PID is requested.
+ *
+ * @locality broker thread
+ * @locks none
+ */
+void rd_kafka_idemp_inflight_toppar_sub (rd_kafka_t *rk,
+                                         rd_kafka_toppar_t *rktp, int cnt) {
+        int r = rd_atomic32_sub(&rktp->rktp_msgs_inflight, cnt);
+
+        rd_assert(r >= 0);
+        if (r > 0)
+                return;
+
+        rd_kafka_toppar_lock(rktp);
+        rktp->rktp_eos.wait_drain = rd_false;
+        rd_kafka_toppar_unlock(rktp);
+
+        if (rd_atomic32_sub(&rk->rk_eos.inflight_toppar_cnt, 1) == 0)
+                rd_kafka_idemp_check_drain_done(rk);
+}
+
+
+/**
+ * @brief Initialize the idempotent producer and trigger the
+ *        initial PID request.
+ *
+ * @remark Must be called prior to creating broker threads.
+ * @locality application thread
+ */
+void rd_kafka_idemp_init (rd_kafka_t *rk) {
+        rd_kafka_wrlock(rk);
+        rd_kafka_pid_reset(&rk->rk_eos.pid);
+        rd_atomic32_init(&rk->rk_eos.inflight_toppar_cnt, 0);
+        rd_kafka_idemp_set_state(rk, RD_KAFKA_IDEMP_STATE_REQ_PID);
+        rd_kafka_wrunlock(rk);
+
+        /* No broker is likely to be up yet, in which case the request
+         * is retried every retry.backoff.ms until one is. */
+        rd_kafka_idemp_restart_request_pid_tmr(rk, rd_true);
+}
+
+
+/**
+ * @brief Terminate and clean up idempotent producer
+ *
+ * @locality rdkafka main thread
+ * @locks none
+ */
+void rd_kafka_idemp_term (rd_kafka_t *rk) {
+        rd_assert(thrd_is_current(rk->rk_thread));
+
+        rd_kafka_timer_stop(&rk->rk_timers, &rk->rk_eos.request_pid_tmr, 1);
+
+        rd_kafka_wrlock(rk);
+        rd_kafka_idemp_set_state(rk, RD_KAFKA_IDEMP_STATE_TERM);
+        rd_kafka_wrunlock(rk);
+}
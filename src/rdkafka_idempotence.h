@@ -0,0 +1,53 @@
+/*
+ * librdkafka - Apache Kafka C library
+ *
+ * Copyright (c) 2018, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _RD_KAFKA_IDEMPOTENCE_H_
+#define _RD_KAFKA_IDEMPOTENCE_H_
+
+
+/**
+ * @returns true if the idempotent producer is enabled for \p rk.
+ */
+#define rd_kafka_is_idempotent(rk) ((rk)->rk_conf.eos.idempotence)
+
+
+rd_kafka_pid_t rd_kafka_idemp_get_pid0 (rd_kafka_t *rk, rd_bool_t do_lock);
+#define rd_kafka_idemp_get_pid(rk) rd_kafka_idemp_get_pid0(rk, rd_true/*lock*/)
+
+void rd_kafka_idemp_drain_reset (rd_kafka_t *rk, const char *reason);
+
+void rd_kafka_idemp_inflight_toppar_add (rd_kafka_t *rk,
+                                         rd_kafka_toppar_t *rktp, int cnt);
+void rd_kafka_idemp_inflight_toppar_sub (rd_kafka_t *rk,
+                                         rd_kafka_toppar_t *rktp, int cnt);
+
+void rd_kafka_idemp_init (rd_kafka_t *rk);
+void rd_kafka_idemp_term (rd_kafka_t *rk);
+
+#endif /* _RD_KAFKA_IDEMPOTENCE_H_ */
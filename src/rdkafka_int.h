@@ -48,6 +48,7 @@ typedef int mode_t;
 #include "rdinterval.h"
 #include "rdavg.h"
 #include "rdlist.h"
+#include "rdwakeup.h"
 
 #if WITH_SSL
 #include <openssl/ssl.h>
@@ -84,6 +85,21 @@ typedef RD_SHARED_PTR_TYPE(, struct rd_kafka_toppar_s) shptr_rd_kafka_toppar_t;
 typedef RD_SHARED_PTR_TYPE(, struct rd_kafka_itopic_s) shptr_rd_kafka_itopic_t;
 
 
+/**
+ * @brief Reusable (de)compression contexts of a single thread.
+ *
+ * Owned by a broker (used by the broker thread) or a compression or
+ * decompression pool thread. The contexts are created on first use
+ * and freed with rd_kafka_codec_ctx_destroy().
+ */
+typedef struct rd_kafka_codec_ctx_s {
+        struct rd_gz_inflater_s   *rkcc_gzip;  /**< gzip inflater */
+        struct rd_kafka_lz4_ctx_s *rkcc_lz4;   /**< LZ4F contexts */
+} rd_kafka_codec_ctx_t;
+
+void rd_kafka_codec_ctx_destroy (rd_kafka_codec_ctx_t *rkcc);
+
+
 
 #include "rdkafka_op.h"
 #include "rdkafka_queue.h"
@@ -109,6 +125,38 @@ typedef RD_SHARED_PTR_TYPE(, struct rd_kafka_itopic_s) shptr_rd_kafka_itopic_t;
 #define RD_KAFKA_OFFSET_IS_LOGICAL(OFF)  ((OFF) < 0)
 
 
+/**
+ * @enum Idempotent Producer state
+ */
+typedef enum {
+        RD_KAFKA_IDEMP_STATE_INIT,      /**< Initial state */
+        RD_KAFKA_IDEMP_STATE_TERM,      /**< Instance is terminating */
+        RD_KAFKA_IDEMP_STATE_REQ_PID,   /**< Request new PID */
+        RD_KAFKA_IDEMP_STATE_WAIT_PID,  /**< PID requested, waiting for reply */
+        RD_KAFKA_IDEMP_STATE_ASSIGNED,  /**< New PID assigned */
+        RD_KAFKA_IDEMP_STATE_DRAIN_RESET, /**< Wait for outstanding
+                                           *   ProduceRequests to finish
+                                           *   before resetting and
+                                           *   re-requesting a new PID. */
+} rd_kafka_idemp_state_t;
+
+/**
+ * @returns the idemp_state_t string representation
+ */
+static RD_UNUSED const char *
+rd_kafka_idemp_state2str (rd_kafka_idemp_state_t state) {
+        static const char *names[] = {
+                "Init",
+                "Terminate",
+                "RequestPID",
+                "WaitPID",
+                "Assigned",
+                "DrainReset"
+        };
+        return names[state];
+}
+
+
 
 
 
@@ -142,6 +190,10 @@ struct rd_kafka_s {
 
 	TAILQ_HEAD(, rd_kafka_itopic_s)  rk_topics;
 	int              rk_topic_cnt;
+        /* Hash index of rk_topics on topic name, protected by rk_lock.
+         * See rd_kafka_topic_hash_*() */
+        LIST_HEAD(, rd_kafka_itopic_s) *rk_topic_hash;
+        int              rk_topic_hash_size; /* Bucket count, power of 2 */
 
         struct rd_kafka_cgrp_s *rk_cgrp;
 
@@ -224,8 +276,19 @@ struct rd_kafka_s {
          */
         struct {
                 rd_kafkap_str_t *TransactionalId;
-                int64_t          PID;
-                int16_t          ProducerEpoch;
+
+                rd_kafka_idemp_state_t idemp_state; /**< Idempotent Producer
+                                                     *   state.
+                                                     *   Locks: rk_lock */
+                rd_ts_t ts_idemp_state;/**< Last state change.
+                                        *   Locks: rk_lock */
+                rd_kafka_pid_t pid;    /**< Current Producer ID and Epoch.
+                                        *   Locks: rk_lock */
+                rd_atomic32_t inflight_toppar_cnt; /**< Current number of
+                                                    *   toppars with
+                                                    *   in-flight
+                                                    *   ProduceRequests. */
+                rd_kafka_timer_t request_pid_tmr; /**< Timer for pid retrieval*/
         } rk_eos;
 
 	const rd_kafkap_bytes_t *rk_null_bytes;
@@ -239,6 +302,37 @@ struct rd_kafka_s {
 		size_t max_size; /* Max limit */
 	} rk_curr_msgs;
 
+        rd_kafka_op_pool_t rk_fetch_op_pool; /**< Recycled fetch ops */
+
+        rd_atomic64_t rk_fetchq_bytes; /**< Total bytes of fetched messages
+                                        *   held by the application or its
+                                        *   queues, accounted for when
+                                        *   queued.max.total.kbytes is
+                                        *   set. */
+
+        struct rd_bufpool_s *rk_bufpool; /**< Buffer segment pool for
+                                          *   large protocol buffers,
+                                          *   if enabled
+                                          *   (buffer.pool.max.bytes). */
+
+        struct rd_kafka_decomp_pool_s *rk_decomp_pool; /**< Fetch
+                                                        *   decompression
+                                                        *   worker pool,
+                                                        *   if enabled. */
+        struct rd_kafka_compress_pool_s *rk_compress_pool; /**< Producer
+                                                            *   compression
+                                                            *   thread pool,
+                                                            *   if enabled. */
+
+        struct rd_kafka_reactor_s **rk_reactors; /**< Shared broker
+                                                  *   reactor threads
+                                                  *   (broker.threads) */
+        int rk_reactor_cnt;                      /**< Number of reactors,
+                                                  *   0 = a dedicated
+                                                  *   thread per broker. */
+        rd_atomic32_t rk_reactor_rr;             /**< Round-robin broker
+                                                  *   assignment. */
+
         rd_kafka_timers_t rk_timers;
 	thrd_t rk_thread;
 
@@ -257,6 +351,15 @@ struct rd_kafka_s {
                                    *   This can be used for troubleshooting
                                    *   purposes. */
         } rk_background;
+
+        /**
+         * SASL state
+         */
+        struct {
+                void *handle; /**< Provider-specific per-instance state,
+                               *   set up by the provider's .init()
+                               *   and freed by .term(). */
+        } rk_sasl;
 };
 
 #define rd_kafka_wrlock(rk)    rwlock_wrlock(&(rk)->rk_lock)
@@ -442,6 +545,7 @@ int rd_kafka_simple_consumer_add (rd_kafka_t *rk);
 #define RD_KAFKA_DBG_PLUGIN         0x1000
 #define RD_KAFKA_DBG_CONSUMER       0x2000
 #define RD_KAFKA_DBG_ADMIN          0x4000
+#define RD_KAFKA_DBG_EOS            0x8000
 #define RD_KAFKA_DBG_ALL            0xffff
 #define RD_KAFKA_DBG_NONE           0x0
 
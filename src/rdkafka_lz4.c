@@ -36,6 +36,7 @@
 #include "xxhash.h"
 
 #include "rdbuf.h"
+#include "rdunittest.h"
 
 /**
  * Fix-up bad LZ4 framing caused by buggy Kafka client / broker.
@@ -156,24 +157,62 @@ rd_kafka_lz4_compress_break_framing (rd_kafka_broker_t *rkb,
 
 
 
+/**
+ * @brief Reusable LZ4F contexts, see rd_kafka_codec_ctx_t.
+ *
+ * A context that was left in an unknown state (by a failed or truncated
+ * frame) is freed and re-created on next use.
+ */
+struct rd_kafka_lz4_ctx_s {
+        LZ4F_decompressionContext_t dctx; /**< NULL until first use */
+        LZ4F_compressionContext_t   cctx; /**< NULL until first use */
+};
+
+
+/**
+ * @returns the LZ4F contexts of \p codec, allocating them on first use.
+ */
+static rd_kafka_lz4_ctx_t *rd_kafka_lz4_ctx_get (rd_kafka_codec_ctx_t *codec) {
+        if (unlikely(!codec->rkcc_lz4))
+                codec->rkcc_lz4 = rd_calloc(1, sizeof(*codec->rkcc_lz4));
+        return codec->rkcc_lz4;
+}
+
+void rd_kafka_lz4_ctx_destroy (rd_kafka_lz4_ctx_t *lz4) {
+        if (lz4->dctx)
+                LZ4F_freeDecompressionContext(lz4->dctx);
+        if (lz4->cctx)
+                LZ4F_freeCompressionContext(lz4->cctx);
+        rd_free(lz4);
+}
+
+
 /**
  * @brief Decompress LZ4F (framed) data.
  *        Kafka broker versions <0.10.0.0 (MsgVersion 0) breaks LZ4 framing
  *        checksum, if \p proper_hc we assume the checksum is okay
  *        (broker version >=0.10.0, MsgVersion >= 1) else we fix it up.
  *
+ * @param codec the calling thread's contexts, the decompression context
+ *              is reused between calls.
+ * @param size_hint expected decompressed size (0 if not known), used to
+ *                  size the output buffer when the frame does not
+ *                  carry the content size.
+ *
  * @remark May modify \p inbuf (if not \p proper_hc)
  */
 rd_kafka_resp_err_t
-rd_kafka_lz4_decompress (rd_kafka_broker_t *rkb, int proper_hc, int64_t Offset,
-                         char *inbuf, size_t inlen,
+rd_kafka_lz4_decompress (rd_kafka_broker_t *rkb, rd_kafka_codec_ctx_t *codec,
+                         int proper_hc, int64_t Offset,
+                         char *inbuf, size_t inlen, size_t size_hint,
                          void **outbuf, size_t *outlenp) {
+        rd_kafka_lz4_ctx_t *lz4 = rd_kafka_lz4_ctx_get(codec);
         LZ4F_errorCode_t code;
         LZ4F_decompressionContext_t dctx;
         LZ4F_frameInfo_t fi;
         size_t in_sz, out_sz;
         size_t in_of, out_of;
-        size_t r;
+        size_t r = 1;
         size_t estimated_uncompressed_size;
         size_t outlen;
         rd_kafka_resp_err_t err = RD_KAFKA_RESP_ERR_NO_ERROR;
@@ -181,13 +220,19 @@ rd_kafka_lz4_decompress (rd_kafka_broker_t *rkb, int proper_hc, int64_t Offset,
 
         *outbuf = NULL;
 
-        code = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
-        if (LZ4F_isError(code)) {
-                rd_rkb_dbg(rkb, BROKER, "LZ4DECOMPR",
-                           "Unable to create LZ4 decompression context: %s",
-                           LZ4F_getErrorName(code));
-                return RD_KAFKA_RESP_ERR__CRIT_SYS_RESOURCE;
+        if (unlikely(!lz4->dctx)) {
+                code = LZ4F_createDecompressionContext(&lz4->dctx,
+                                                       LZ4F_VERSION);
+                if (LZ4F_isError(code)) {
+                        rd_rkb_dbg(rkb, BROKER, "LZ4DECOMPR",
+                                   "Unable to create LZ4 decompression "
+                                   "context: %s",
+                                   LZ4F_getErrorName(code));
+                        lz4->dctx = NULL;
+                        return RD_KAFKA_RESP_ERR__CRIT_SYS_RESOURCE;
+                }
         }
+        dctx = lz4->dctx;
 
         if (!proper_hc) {
                 /* The original/legacy LZ4 framing in Kafka was buggy and
@@ -209,14 +254,20 @@ rd_kafka_lz4_decompress (rd_kafka_broker_t *rkb, int proper_hc, int64_t Offset,
                 goto done;
         }
 
-        /* If uncompressed size is unknown or out of bounds, use a sane
-         * default (2x compression) and reallocate if needed
+        /* If uncompressed size is unknown or out of bounds, use the
+         * caller's estimate, or a sane default (2x compression),
+         * and reallocate if needed.
          * More info on max size: http://stackoverflow.com/a/25751871/1821055 */
         if (fi.contentSize == 0 || fi.contentSize > inlen * 255) {
-                estimated_uncompressed_size = RD_MIN(
-                        inlen * 255,
-                        RD_MAX(inlen * 2,
-                               (size_t)(rkb->rkb_rk->rk_conf.max_msg_size)));
+                if (size_hint > 0)
+                        estimated_uncompressed_size = RD_MIN(
+                                inlen * 255, RD_MAX(size_hint, 1024));
+                else
+                        estimated_uncompressed_size = RD_MIN(
+                                inlen * 255,
+                                RD_MAX(inlen * 2,
+                                       (size_t)(rkb->rkb_rk->rk_conf.
+                                                max_msg_size)));
         } else {
                 estimated_uncompressed_size = (size_t)fi.contentSize;
         }
@@ -262,7 +313,8 @@ rd_kafka_lz4_decompress (rd_kafka_broker_t *rkb, int proper_hc, int64_t Offset,
                         break;
 
                 /* Need to grow output buffer, this shouldn't happen if
-                 * contentSize was properly set. */
+                 * contentSize was properly set or the estimate was
+                 * accurate. */
                 if (unlikely(out_of == outlen)) {
                         char *tmp;
                         /* Grow exponentially with some factor > 1 (using 1.75)
@@ -296,16 +348,23 @@ rd_kafka_lz4_decompress (rd_kafka_broker_t *rkb, int proper_hc, int64_t Offset,
                 goto done;
         }
 
+        /* Return excess memory if the estimate was way off,
+         * the buffer is referenced by the messages. */
+        if (outlen - out_of > outlen / 4 && outlen > 4096) {
+                char *tmp = rd_realloc(out, RD_MAX(out_of, 1));
+                if (tmp)
+                        out = tmp;
+        }
+
         *outbuf = out;
         *outlenp = out_of;
 
  done:
-        code = LZ4F_freeDecompressionContext(dctx);
-        if (LZ4F_isError(code)) {
-                rd_rkb_dbg(rkb, BROKER, "LZ4DECOMPR",
-                           "Failed to close LZ4 compression context: %s",
-                           LZ4F_getErrorName(code));
-                err = RD_KAFKA_RESP_ERR__BAD_COMPRESSION;
+        /* A context left mid-frame can't be reused: re-create it
+         * on next use. */
+        if (unlikely(err || r != 0)) {
+                LZ4F_freeDecompressionContext(lz4->dctx);
+                lz4->dctx = NULL;
         }
 
         if (err && out)
@@ -325,8 +384,10 @@ rd_kafka_lz4_decompress (rd_kafka_broker_t *rkb, int proper_hc, int64_t Offset,
  * @returns allocated buffer in \p *outbuf, length in \p *outlenp.
  */
 rd_kafka_resp_err_t
-rd_kafka_lz4_compress (rd_kafka_broker_t *rkb, int proper_hc, int comp_level,
+rd_kafka_lz4_compress (rd_kafka_broker_t *rkb, rd_kafka_codec_ctx_t *codec,
+                       int proper_hc, int comp_level,
                        rd_slice_t *slice, void **outbuf, size_t *outlenp) {
+        rd_kafka_lz4_ctx_t *lz4 = rd_kafka_lz4_ctx_get(codec);
         LZ4F_compressionContext_t cctx;
         LZ4F_errorCode_t r;
         rd_kafka_resp_err_t err = RD_KAFKA_RESP_ERR_NO_ERROR;
@@ -355,6 +416,19 @@ rd_kafka_lz4_compress (rd_kafka_broker_t *rkb, int proper_hc, int comp_level,
                 return RD_KAFKA_RESP_ERR__BAD_MSG;
         }
 
+        if (unlikely(!lz4->cctx)) {
+                r = LZ4F_createCompressionContext(&lz4->cctx, LZ4F_VERSION);
+                if (LZ4F_isError(r)) {
+                        rd_rkb_dbg(rkb, MSG, "LZ4COMPR",
+                                   "Unable to create LZ4 compression "
+                                   "context: %s",
+                                   LZ4F_getErrorName(r));
+                        lz4->cctx = NULL;
+                        return RD_KAFKA_RESP_ERR__CRIT_SYS_RESOURCE;
+                }
+        }
+        cctx = lz4->cctx;
+
         out = rd_malloc(out_sz);
         if (!out) {
                 rd_rkb_dbg(rkb, MSG, "LZ4COMPR",
@@ -364,14 +438,6 @@ rd_kafka_lz4_compress (rd_kafka_broker_t *rkb, int proper_hc, int comp_level,
                 return RD_KAFKA_RESP_ERR__CRIT_SYS_RESOURCE;
         }
 
-        r = LZ4F_createCompressionContext(&cctx, LZ4F_VERSION);
-        if (LZ4F_isError(r)) {
-                rd_rkb_dbg(rkb, MSG, "LZ4COMPR",
-                           "Unable to create LZ4 compression context: %s",
-                           LZ4F_getErrorName(r));
-                return RD_KAFKA_RESP_ERR__CRIT_SYS_RESOURCE;
-        }
-
         r = LZ4F_compressBegin(cctx, out, out_sz, &prefs);
         if (LZ4F_isError(r)) {
                 rd_rkb_dbg(rkb, MSG, "LZ4COMPR",
@@ -429,11 +495,150 @@ rd_kafka_lz4_compress (rd_kafka_broker_t *rkb, int proper_hc, int comp_level,
         *outlenp = out_of;
 
  done:
-        LZ4F_freeCompressionContext(cctx);
-
-        if (err)
+        /* The context is reused for the next frame unless
+         * this one failed midway. */
+        if (unlikely(err)) {
+                LZ4F_freeCompressionContext(lz4->cctx);
+                lz4->cctx = NULL;
                 rd_free(out);
+        }
 
         return err;
 
 }
+
+
+
+/**
+ * @brief Compress the first \p blen bytes of \p data and decompress the
+ *        result with size hint \p size_hint, verifying the round-trip.
+ *
+ * @returns 0 on success or 1 on failure.
+ */
+static int ut_lz4_roundtrip (rd_kafka_broker_t *rkb,
+                             rd_kafka_codec_ctx_t *codec,
+                             const char *data, size_t blen,
+                             size_t size_hint) {
+        rd_buf_t rbuf;
+        rd_slice_t slice;
+        void *z, *out;
+        size_t zlen, outlen;
+        rd_kafka_resp_err_t err;
+
+        rd_buf_init(&rbuf, 1, blen);
+        rd_buf_write(&rbuf, data, blen);
+        rd_slice_init_full(&slice, &rbuf);
+
+        err = rd_kafka_lz4_compress(rkb, codec, 1, 0, &slice, &z, &zlen);
+        rd_buf_destroy(&rbuf);
+        RD_UT_ASSERT(!err, "compress failed: %s", rd_kafka_err2str(err));
+
+        err = rd_kafka_lz4_decompress(rkb, codec, 1, 0, z, zlen, size_hint,
+                                      &out, &outlen);
+        rd_free(z);
+        RD_UT_ASSERT(!err, "decompress failed: %s", rd_kafka_err2str(err));
+        RD_UT_ASSERT(outlen == blen && !memcmp(out, data, blen),
+                     "round-trip mismatch for %"PRIusz" bytes", blen);
+        rd_free(out);
+
+        return 0;
+}
+
+
+/**
+ * @brief LZ4 round-trips reuse the thread's LZ4F contexts, also after a
+ *        corrupt frame, and size the decompression buffer from the
+ *        size hint (our frames do not carry the content size).
+ */
+int unittest_lz4 (void) {
+        rd_kafka_t *rk;
+        rd_kafka_broker_t *rkb;
+        rd_kafka_codec_ctx_t codec = RD_ZERO_INIT;
+        LZ4F_compressionContext_t cctx;
+        LZ4F_decompressionContext_t dctx;
+        char data[4096];
+        size_t len = 0;
+        int64_t grow_cnt;
+        int i, r;
+
+        rk = rd_unittest_rk_new(RD_KAFKA_PRODUCER, NULL);
+        RD_UT_ASSERT(rk, "failed to create instance");
+        rkb = rd_kafka_broker_internal(rk);
+        RD_UT_ASSERT(rkb, "no internal broker");
+
+        for (r = 0 ; len + 64 < sizeof(data) ; r++)
+                len += rd_snprintf(data + len, sizeof(data) - len,
+                                   "record %d: value=%u;",
+                                   r, (unsigned int)rand() % 1000);
+
+        if (ut_lz4_roundtrip(rkb, &codec, data, len, len))
+                return 1;
+        RD_UT_ASSERT(codec.rkcc_lz4 && codec.rkcc_lz4->cctx &&
+                     codec.rkcc_lz4->dctx,
+                     "contexts should have been created on first use");
+        cctx = codec.rkcc_lz4->cctx;
+        dctx = codec.rkcc_lz4->dctx;
+
+        /* Batches of varying size reuse the same contexts, and an
+         * accurate size hint never grows the output buffer. */
+        grow_cnt = rd_atomic64_get(&rkb->rkb_c.zbuf_grow);
+        for (i = 0 ; i < 100 ; i++) {
+                size_t blen = 256 + (i * 37) % (len - 256);
+
+                if (ut_lz4_roundtrip(rkb, &codec, data, blen, blen))
+                        return 1;
+                RD_UT_ASSERT(codec.rkcc_lz4->cctx == cctx &&
+                             codec.rkcc_lz4->dctx == dctx,
+                             "batch %d: contexts were not reused", i);
+        }
+        RD_UT_ASSERT(rd_atomic64_get(&rkb->rkb_c.zbuf_grow) == grow_cnt,
+                     "output buffer grown %"PRId64" time(s) despite "
+                     "accurate size hints",
+                     rd_atomic64_get(&rkb->rkb_c.zbuf_grow) - grow_cnt);
+
+        /* A too small size hint is used as is: the buffer must grow. */
+        if (ut_lz4_roundtrip(rkb, &codec, data, len, 1))
+                return 1;
+        RD_UT_ASSERT(rd_atomic64_get(&rkb->rkb_c.zbuf_grow) > grow_cnt,
+                     "expected output buffer to grow with a "
+                     "too small size hint");
+
+        /* A corrupt frame must not break subsequent round-trips:
+         * the decompression context is re-created. */
+        {
+                rd_buf_t rbuf;
+                rd_slice_t slice;
+                void *z, *out;
+                size_t zlen, outlen;
+                rd_kafka_resp_err_t err;
+
+                rd_buf_init(&rbuf, 1, len);
+                rd_buf_write(&rbuf, data, len);
+                rd_slice_init_full(&slice, &rbuf);
+                err = rd_kafka_lz4_compress(rkb, &codec, 1, 0, &slice,
+                                            &z, &zlen);
+                rd_buf_destroy(&rbuf);
+                RD_UT_ASSERT(!err, "compress failed: %s",
+                             rd_kafka_err2str(err));
+
+                memset((char *)z + zlen / 2, 0xff, zlen - zlen / 2);
+                err = rd_kafka_lz4_decompress(rkb, &codec, 1, 0, z, zlen, 0,
+                                              &out, &outlen);
+                rd_free(z);
+                RD_UT_ASSERT(err, "expected corrupt frame to fail");
+                RD_UT_ASSERT(!codec.rkcc_lz4->dctx,
+                             "decompression context left mid-frame "
+                             "should have been freed");
+        }
+
+        if (ut_lz4_roundtrip(rkb, &codec, data, len, len))
+                return 1;
+        RD_UT_ASSERT(codec.rkcc_lz4->cctx == cctx,
+                     "compression context was not reused");
+
+        rd_kafka_codec_ctx_destroy(&codec);
+        rd_kafka_broker_destroy(rkb);
+        rd_kafka_destroy(rk);
+
+        RD_UT_PASS();
+}
@@ -31,13 +31,21 @@
 #define _RDKAFKA_LZ4_H_
 
 
+typedef struct rd_kafka_lz4_ctx_s rd_kafka_lz4_ctx_t;
+
+void rd_kafka_lz4_ctx_destroy (rd_kafka_lz4_ctx_t *lz4);
+
 rd_kafka_resp_err_t
-rd_kafka_lz4_decompress (rd_kafka_broker_t *rkb, int proper_hc, int64_t Offset,
-                         char *inbuf, size_t inlen,
+rd_kafka_lz4_decompress (rd_kafka_broker_t *rkb, rd_kafka_codec_ctx_t *codec,
+                         int proper_hc, int64_t Offset,
+                         char *inbuf, size_t inlen, size_t size_hint,
                          void **outbuf, size_t *outlenp);
 
 rd_kafka_resp_err_t
-rd_kafka_lz4_compress (rd_kafka_broker_t *rkb, int proper_hc, int comp_level,
+rd_kafka_lz4_compress (rd_kafka_broker_t *rkb, rd_kafka_codec_ctx_t *codec,
+                       int proper_hc, int comp_level,
                        rd_slice_t *slice, void **outbuf, size_t *outlenp);
 
+int unittest_lz4 (void);
+
 #endif /* _RDKAFKA_LZ4_H_ */
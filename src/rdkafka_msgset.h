@@ -35,8 +35,13 @@
  */
 rd_kafka_buf_t *
 rd_kafka_msgset_create_ProduceRequest (rd_kafka_broker_t *rkb,
-                                       rd_kafka_toppar_t *rktp,
-                                       size_t *MessageSetSizep);
+                                       rd_list_t *rktps,
+                                       const rd_kafka_pid_t pid,
+                                       rd_kafka_op_t **rko_compressp);
+void rd_kafka_msgset_compress_op_serve (rd_kafka_op_t *rko,
+                                        rd_kafka_codec_ctx_t *codec);
+rd_kafka_buf_t *
+rd_kafka_msgset_compress_op_finalize (rd_kafka_op_t *rko);
 
 /**
  * @name MessageSet readers
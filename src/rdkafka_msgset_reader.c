@@ -61,6 +61,10 @@
 #include "rdkafka_partition.h"
 #include "rdkafka_header.h"
 #include "rdkafka_lz4.h"
+#include "rdkafka_decompress.h"
+#if WITH_ZSTD
+#include "rdkafka_zstd.h"
+#endif
 
 #include "rdvarint.h"
 #include "crc32c.h"
@@ -116,6 +120,10 @@ typedef struct rd_kafka_msgset_reader_s {
         rd_kafka_toppar_t *msetr_rktp;   /* @warning Not a refcounted
                                           *          reference! */
 
+        rd_kafka_op_t *msetr_batch_rko; /**< Current FETCH_BATCH op for
+                                         *   the MessageSet v2 being read,
+                                         *   if enable.fetch.batch.ops */
+
         int          msetr_msgcnt;      /**< Number of messages in rkq */
         int64_t      msetr_msg_bytes;   /**< Number of bytes in rkq */
         rd_kafka_q_t msetr_rkq;         /**< Temp Message and error queue */
@@ -143,15 +151,56 @@ typedef struct rd_kafka_msgset_reader_s {
                                          *   message set.
                                          *   Not freed (use const memory).
                                          *   Add trailing space. */
+
+        int64_t msetr_fetch_offset;     /**< Partition's fetch offset at
+                                         *   the time the reader was set up,
+                                         *   earlier offsets are skipped. */
+
+        rd_kafka_op_cache_t *msetr_op_cache; /**< Fetch op cache of the
+                                              *   current thread. */
+        rd_kafka_codec_ctx_t *msetr_codec; /**< Decompression contexts
+                                            *   of the current thread. */
+
+        rd_kafka_decomp_pool_t *msetr_decomp_pool; /**< Hand off compressed
+                                                    *   MessageSets to this
+                                                    *   pool (top-level
+                                                    *   reader only). */
+        int msetr_decomp_cnt;           /**< Number of compressed MessageSets
+                                         *   handed off to the pool. */
+        int msetr_offload;              /**< Bool: reader runs on a
+                                         *   decompression thread and
+                                         *   must not modify the
+                                         *   partition's fetch state. */
 } rd_kafka_msgset_reader_t;
 
 
 
+/**
+ * @brief Free the contexts of \p rkcc, which may be reused.
+ */
+void rd_kafka_codec_ctx_destroy (rd_kafka_codec_ctx_t *rkcc) {
+#if WITH_ZLIB
+        if (rkcc->rkcc_gzip)
+                rd_gz_inflater_destroy(rkcc->rkcc_gzip);
+#endif
+        if (rkcc->rkcc_lz4)
+                rd_kafka_lz4_ctx_destroy(rkcc->rkcc_lz4);
+        memset(rkcc, 0, sizeof(*rkcc));
+}
+
+
+
 /* Forward declarations */
 static rd_kafka_resp_err_t
 rd_kafka_msgset_reader_run (rd_kafka_msgset_reader_t *msetr);
 static rd_kafka_resp_err_t
 rd_kafka_msgset_reader_msgs_v2 (rd_kafka_msgset_reader_t *msetr);
+static rd_kafka_resp_err_t
+rd_kafka_msgset_reader_decompress_submit (rd_kafka_msgset_reader_t *msetr,
+                                          int MsgVersion, int Attributes,
+                                          int64_t Timestamp, int64_t Offset,
+                                          const void *compressed,
+                                          size_t compressed_size);
 
 
 /**
@@ -171,8 +220,9 @@ rd_kafka_msgset_reader_init (rd_kafka_msgset_reader_t *msetr,
         msetr->msetr_tver       = tver;
         msetr->msetr_rkbuf      = rkbuf;
         msetr->msetr_srcname    = "";
-
-        rkbuf->rkbuf_uflow_mitigation = "truncated response from broker (ok)";
+        msetr->msetr_fetch_offset = rktp->rktp_offsets.fetch_offset;
+        msetr->msetr_op_cache   = &msetr->msetr_rkb->rkb_fetch_op_cache;
+        msetr->msetr_codec      = &msetr->msetr_rkb->rkb_codec;
 
         /* All parsed messages are put on this temporary op
          * queue first and then moved in one go to the real op queue. */
@@ -209,16 +259,48 @@ rd_kafka_msgset_reader_decompress (rd_kafka_msgset_reader_t *msetr,
         rd_kafka_resp_err_t err = RD_KAFKA_RESP_ERR_NO_ERROR;
         rd_kafka_buf_t *rkbufz;
 
+        if (msetr->msetr_decomp_pool)
+                return rd_kafka_msgset_reader_decompress_submit(
+                        msetr, MsgVersion, Attributes, Timestamp, Offset,
+                        compressed, compressed_size);
+
         switch (codec)
         {
 #if WITH_ZLIB
         case RD_KAFKA_COMPRESSION_GZIP:
         {
-                uint64_t outlenx = 0;
+                int32_t ratio = rd_atomic32_get(&rktp->rktp_gzip_ratio);
+                int32_t recsize = rd_atomic32_get(&rktp->rktp_gzip_recsize);
+                int32_t record_cnt = 0;
+                double est;
+
+                if (unlikely(!msetr->msetr_codec->rkcc_gzip))
+                        msetr->msetr_codec->rkcc_gzip = rd_gz_inflater_new();
+
+                if (MsgVersion == 2 && msetr->msetr_v2_hdr &&
+                    msetr->msetr_v2_hdr->RecordCount > 0)
+                        record_cnt = msetr->msetr_v2_hdr->RecordCount;
+
+                /* Size the output buffer from the partition's recent
+                 * bytes per record if the RecordCount (v2) is known,
+                 * else from its recent compression ratio, with some
+                 * headroom.
+                 * The RecordCount is untrusted: the estimate is capped
+                 * to fetch.max.bytes here, and to RD_GZ_MAX_RATIO times
+                 * the compressed size by rd_gz_inflate(). */
+                if (record_cnt > 0 && recsize > 0)
+                        est = (double)recsize * (double)record_cnt;
+                else
+                        est = (double)compressed_size *
+                                (double)(ratio ? ratio : 400) / 100.0;
+                est = RD_MIN(est * 1.125,
+                             (double)msetr->msetr_rkb->rkb_rk->
+                             rk_conf.fetch_max_bytes);
 
                 /* Decompress Message payload */
-                iov.iov_base = rd_gz_decompress(compressed, (int)compressed_size,
-                                                &outlenx);
+                iov.iov_base = rd_gz_inflate(msetr->msetr_codec->rkcc_gzip,
+                                             compressed, compressed_size,
+                                             (size_t)est, &iov.iov_len);
                 if (unlikely(!iov.iov_base)) {
                         rd_rkb_dbg(msetr->msetr_rkb, MSG, "GZIP",
                                    "Failed to decompress Gzip "
@@ -230,7 +312,28 @@ rd_kafka_msgset_reader_decompress (rd_kafka_msgset_reader_t *msetr,
                         goto err;
                 }
 
-                iov.iov_len = (size_t)outlenx;
+                /* Update the running averages, racing updates from
+                 * other decompression threads are harmless. */
+                if (compressed_size > 0) {
+                        int32_t new_ratio = (int32_t)RD_MIN(
+                                iov.iov_len * 100 / compressed_size,
+                                RD_GZ_MAX_RATIO * 100);
+                        rd_atomic32_set(&rktp->rktp_gzip_ratio,
+                                        ratio ?
+                                        (ratio * 3 + new_ratio) / 4 :
+                                        new_ratio);
+                }
+
+                if (record_cnt > 0) {
+                        int64_t new_recsize = (int64_t)RD_MIN(
+                                iov.iov_len / (size_t)record_cnt,
+                                (size_t)INT32_MAX);
+                        rd_atomic32_set(&rktp->rktp_gzip_recsize,
+                                        (int32_t)(recsize ?
+                                                  ((int64_t)recsize * 3 +
+                                                   new_recsize) / 4 :
+                                                  new_recsize));
+                }
         }
         break;
 #endif
@@ -332,20 +435,53 @@ rd_kafka_msgset_reader_decompress (rd_kafka_msgset_reader_t *msetr,
 
         case RD_KAFKA_COMPRESSION_LZ4:
         {
+                /* Size the output buffer from the partition's
+                 * recent compression ratio, with some headroom. */
+                int32_t ratio = rd_atomic32_get(&rktp->rktp_lz4_ratio);
+                size_t size_hint = compressed_size *
+                        (size_t)(ratio + ratio / 8) / 100;
+                int32_t new_ratio;
+
                 err = rd_kafka_lz4_decompress(msetr->msetr_rkb,
+                                              msetr->msetr_codec,
                                               /* Proper HC? */
                                               MsgVersion >= 1 ? 1 : 0,
                                               Offset,
                                               /* @warning Will modify compressed
                                                *          if no proper HC */
                                               (char *)compressed,
-                                              compressed_size,
+                                              compressed_size, size_hint,
                                               &iov.iov_base, &iov.iov_len);
                 if (err)
                         goto err;
+
+                /* Update the running average, racing updates from
+                 * other decompression threads are harmless. */
+                if (compressed_size > 0) {
+                        new_ratio = (int32_t)RD_MIN(
+                                iov.iov_len * 100 / compressed_size,
+                                255 * 100);
+                        rd_atomic32_set(&rktp->rktp_lz4_ratio,
+                                        ratio ?
+                                        (ratio * 3 + new_ratio) / 4 :
+                                        new_ratio);
+                }
         }
         break;
 
+#if WITH_ZSTD
+        case RD_KAFKA_COMPRESSION_ZSTD:
+        {
+                err = rd_kafka_zstd_decompress(msetr->msetr_rkb,
+                                               (char *)compressed,
+                                               compressed_size,
+                                               &iov.iov_base, &iov.iov_len);
+                if (err)
+                        goto err;
+        }
+        break;
+#endif
+
         default:
                 rd_rkb_dbg(msetr->msetr_rkb, MSG, "CODEC",
                            "%s [%"PRId32"]: Message at offset %"PRId64
@@ -372,6 +508,7 @@ rd_kafka_msgset_reader_decompress (rd_kafka_msgset_reader_t *msetr,
         rkbufz = rd_kafka_buf_new_shadow(iov.iov_base, iov.iov_len, rd_free);
         rkbufz->rkbuf_rkb = msetr->msetr_rkbuf->rkbuf_rkb;
         rd_kafka_broker_keep(rkbufz->rkbuf_rkb);
+        rkbufz->rkbuf_uflow_mitigation = "truncated response from broker (ok)";
 
 
         /* In MsgVersion v0..1 the decompressed data contains
@@ -391,6 +528,10 @@ rd_kafka_msgset_reader_decompress (rd_kafka_msgset_reader_t *msetr,
                                             &msetr->msetr_rkq);
 
                 inner_msetr.msetr_srcname = "compressed ";
+                inner_msetr.msetr_fetch_offset = msetr->msetr_fetch_offset;
+                inner_msetr.msetr_op_cache     = msetr->msetr_op_cache;
+                inner_msetr.msetr_codec        = msetr->msetr_codec;
+                inner_msetr.msetr_offload      = msetr->msetr_offload;
 
                 if (MsgVersion == 1) {
                         /* postproc() will convert relative to
@@ -419,9 +560,6 @@ rd_kafka_msgset_reader_decompress (rd_kafka_msgset_reader_t *msetr,
                 /* MsgVersion 2 */
                 rd_kafka_buf_t *orig_rkbuf = msetr->msetr_rkbuf;
 
-                rkbufz->rkbuf_uflow_mitigation =
-                        "truncated response from broker (ok)";
-
                 /* Temporarily replace read buffer with uncompressed buffer */
                 msetr->msetr_rkbuf = rkbufz;
 
@@ -453,6 +591,212 @@ rd_kafka_msgset_reader_decompress (rd_kafka_msgset_reader_t *msetr,
 
 
 
+/**
+ * @returns the offset of the last message enqueued on the reader's
+ *          temporary queue, or -1 if none.
+ */
+static int64_t
+rd_kafka_msgset_reader_last_offset (rd_kafka_msgset_reader_t *msetr) {
+        rd_kafka_op_t *rko;
+        int64_t last_offset = -1;
+
+        rko = rd_kafka_q_last(&msetr->msetr_rkq,
+                              RD_KAFKA_OP_FETCH,
+                              0 /* no error ops */);
+        if (rko)
+                last_offset = rko->rko_u.fetch.rkm.rkm_offset;
+
+        rko = rd_kafka_q_last(&msetr->msetr_rkq,
+                              RD_KAFKA_OP_FETCH_BATCH,
+                              0 /* no error ops */);
+        if (rko &&
+            rd_kafka_op_fetch_batch_last_offset(rko) > last_offset)
+                last_offset = rd_kafka_op_fetch_batch_last_offset(rko);
+
+        return last_offset;
+}
+
+
+/**
+ * @brief Decompression job for a single compressed MessageSet,
+ *        see rd_kafka_msgset_reader_decompress_submit().
+ */
+typedef struct rd_kafka_msgset_decomp_job_s {
+        rd_kafka_decomp_job_t rkmdj_rkdj;   /**< Must be first */
+        rd_kafka_buf_t *rkmdj_rkbuf;        /**< Response buffer holding the
+                                             *   compressed payload. */
+        struct rd_kafka_toppar_ver rkmdj_tver;
+        struct msgset_v2_hdr rkmdj_v2_hdr;  /**< MsgVersion 2 header copy */
+        int     rkmdj_MsgVersion;
+        int     rkmdj_Attributes;
+        int64_t rkmdj_Timestamp;
+        int64_t rkmdj_Offset;
+        const void *rkmdj_compressed;       /**< Points into rkmdj_rkbuf */
+        size_t  rkmdj_compressed_size;
+        int64_t rkmdj_fetch_offset;         /**< msetr_fetch_offset */
+        int64_t rkmdj_start_offset;         /**< First offset of the
+                                             *   MessageSet not preceding
+                                             *   the fetch offset. */
+} rd_kafka_msgset_decomp_job_t;
+
+
+/**
+ * @brief Decompress and parse the job's MessageSet on a
+ *        decompression thread.
+ *
+ * @locality decompression worker thread
+ */
+static void rd_kafka_msgset_decomp_job_run (rd_kafka_decomp_job_t *rkdj,
+                                            rd_kafka_op_cache_t *rkopc,
+                                            rd_kafka_codec_ctx_t *codec) {
+        rd_kafka_msgset_decomp_job_t *job = (rd_kafka_msgset_decomp_job_t *)
+                rkdj;
+        rd_kafka_toppar_t *rktp = rd_kafka_toppar_s2i(rkdj->rkdj_s_rktp);
+        rd_kafka_msgset_reader_t msetr;
+        rd_kafka_resp_err_t err;
+        int64_t last_offset;
+
+        rd_kafka_msgset_reader_init(&msetr, job->rkmdj_rkbuf, rktp,
+                                    &job->rkmdj_tver, &rkdj->rkdj_rkq);
+        msetr.msetr_fetch_offset = job->rkmdj_fetch_offset;
+        msetr.msetr_op_cache     = rkopc;
+        msetr.msetr_codec        = codec;
+        msetr.msetr_offload      = 1;
+        if (job->rkmdj_MsgVersion == 2)
+                msetr.msetr_v2_hdr = &job->rkmdj_v2_hdr;
+
+        /* Errors are propagated as ops on the queue */
+        err = rd_kafka_msgset_reader_decompress(&msetr,
+                                                job->rkmdj_MsgVersion,
+                                                job->rkmdj_Attributes,
+                                                job->rkmdj_Timestamp,
+                                                job->rkmdj_Offset,
+                                                job->rkmdj_compressed,
+                                                job->rkmdj_compressed_size);
+        if (unlikely(err)) {
+                /* Refetch from the first message that was not parsed,
+                 * as the broker thread would have had it decompressed
+                 * the MessageSet itself. */
+                last_offset = rd_kafka_msgset_reader_last_offset(&msetr);
+                rkdj->rkdj_fail_offset =
+                        RD_MAX(job->rkmdj_start_offset, last_offset + 1);
+        }
+
+        rd_kafka_q_concat(&rkdj->rkdj_rkq, &msetr.msetr_rkq);
+        rd_kafka_q_destroy_owner(&msetr.msetr_rkq);
+
+        rd_atomic64_add(&rktp->rktp_c.rx_msgs, msetr.msetr_msgcnt);
+        rd_atomic64_add(&rktp->rktp_c.rx_msg_bytes, msetr.msetr_msg_bytes);
+
+        rd_avg_add(&rktp->rktp_rkt->rkt_avg_batchcnt,
+                   (int64_t)msetr.msetr_msgcnt);
+        rd_avg_add(&rktp->rktp_rkt->rkt_avg_batchsize,
+                   (int64_t)msetr.msetr_msg_bytes);
+}
+
+
+/**
+ * @brief Free decompression job.
+ */
+static void rd_kafka_msgset_decomp_job_free (rd_kafka_decomp_job_t *rkdj) {
+        rd_kafka_msgset_decomp_job_t *job = (rd_kafka_msgset_decomp_job_t *)
+                rkdj;
+
+        rd_kafka_buf_destroy(job->rkmdj_rkbuf);
+        rd_free(job);
+}
+
+
+/**
+ * @brief Hand off a compressed MessageSet to the decompression pool
+ *        rather than decompressing it on the broker thread.
+ *
+ *        The ops parsed so far are queued ahead of the job to retain
+ *        message order.
+ *
+ *        Since the job's messages are not known until the job is done
+ *        the next fetch offset is derived from the MessageSet header:
+ *        the MessageSet header's last offset for MsgVersion 2, and the
+ *        wrapper Message's offset (which is the last inner offset) for
+ *        MsgVersion 0..1.
+ *        Should the job fail the fetch position is rewound to the
+ *        job's MessageSet, see rd_kafka_decomp_rewind().
+ *
+ * @locality broker thread
+ */
+static rd_kafka_resp_err_t
+rd_kafka_msgset_reader_decompress_submit (rd_kafka_msgset_reader_t *msetr,
+                                          int MsgVersion, int Attributes,
+                                          int64_t Timestamp, int64_t Offset,
+                                          const void *compressed,
+                                          size_t compressed_size) {
+        rd_kafka_toppar_t *rktp = msetr->msetr_rktp;
+        rd_kafka_msgset_decomp_job_t *job;
+        int64_t start_offset = msetr->msetr_fetch_offset;
+
+        /* The MessageSet starts at the v2 BaseOffset, while the
+         * v0..1 wrapper's first inner offset is not known: it follows
+         * the preceding message or wrapper. */
+        if (MsgVersion == 2) {
+                if (Offset > start_offset)
+                        start_offset = Offset;
+        } else {
+                if (msetr->msetr_next_offset > start_offset)
+                        start_offset = msetr->msetr_next_offset;
+                start_offset = RD_MAX(
+                        start_offset,
+                        rd_kafka_msgset_reader_last_offset(msetr) + 1);
+        }
+
+        /* Move the ops parsed so far ahead of the job */
+        if (rd_kafka_q_len(&msetr->msetr_rkq) > 0)
+                rd_kafka_decomp_enq_done(rktp, &msetr->msetr_rkq);
+
+        job = rd_calloc(1, sizeof(*job));
+        rd_kafka_decomp_job_init(&job->rkmdj_rkdj, rktp);
+        job->rkmdj_rkdj.rkdj_run  = rd_kafka_msgset_decomp_job_run;
+        job->rkmdj_rkdj.rkdj_free = rd_kafka_msgset_decomp_job_free;
+
+        job->rkmdj_rkbuf = msetr->msetr_rkbuf;
+        rd_kafka_buf_keep(job->rkmdj_rkbuf);
+        job->rkmdj_tver = *msetr->msetr_tver;
+        if (msetr->msetr_v2_hdr)
+                job->rkmdj_v2_hdr = *msetr->msetr_v2_hdr;
+        job->rkmdj_MsgVersion      = MsgVersion;
+        job->rkmdj_Attributes      = Attributes;
+        job->rkmdj_Timestamp       = Timestamp;
+        job->rkmdj_Offset          = Offset;
+        job->rkmdj_compressed      = compressed;
+        job->rkmdj_compressed_size = compressed_size;
+        job->rkmdj_fetch_offset    = msetr->msetr_fetch_offset;
+        job->rkmdj_start_offset    = start_offset;
+        job->rkmdj_rkdj.rkdj_version = msetr->msetr_tver->version;
+
+        /* Held back from the fetch queue until done: accounted
+         * by the fetch backpressure. The v0..1 wrapper's inner
+         * message count is not known. */
+        job->rkmdj_rkdj.rkdj_msgcnt =
+                MsgVersion == 2 && msetr->msetr_v2_hdr &&
+                msetr->msetr_v2_hdr->RecordCount > 0 ?
+                msetr->msetr_v2_hdr->RecordCount : 1;
+        job->rkmdj_rkdj.rkdj_bytes = (int64_t)compressed_size;
+
+        /* The wrapper Message's offset is the last inner offset,
+         * MsgVersion 2 sets the next offset from its MessageSet header. */
+        if (MsgVersion <= 1 && Offset + 1 > msetr->msetr_next_offset)
+                msetr->msetr_next_offset = Offset + 1;
+
+        msetr->msetr_decomp_cnt++;
+
+        rd_kafka_decomp_pool_submit(msetr->msetr_decomp_pool,
+                                    &job->rkmdj_rkdj);
+
+        return RD_KAFKA_RESP_ERR_NO_ERROR;
+}
+
+
+
+
 /**
  * @brief Message parser for MsgVersion v0..1
  *
@@ -576,7 +920,7 @@ rd_kafka_msgset_reader_msg_v0_1 (rd_kafka_msgset_reader_t *msetr) {
          *       we cant perform this offset check here
          *       in that case. */
         if (!relative_offsets &&
-            hdr.Offset < rktp->rktp_offsets.fetch_offset)
+            hdr.Offset < msetr->msetr_fetch_offset)
                 return RD_KAFKA_RESP_ERR_NO_ERROR; /* Continue with next msg */
 
         /* Handle compressed MessageSet */
@@ -591,7 +935,8 @@ rd_kafka_msgset_reader_msg_v0_1 (rd_kafka_msgset_reader_t *msetr) {
          * MessageSets have been peeled off. */
 
         /* Create op/message container for message. */
-        rko = rd_kafka_op_new_fetch_msg(&rkm, rktp, msetr->msetr_tver->version,
+        rko = rd_kafka_op_new_fetch_msg(&rkm, msetr->msetr_op_cache,
+                                        rktp, msetr->msetr_tver->version,
                                         rkbuf,
                                         hdr.Offset,
                                         (size_t)RD_KAFKAP_BYTES_LEN(&Key),
@@ -633,6 +978,48 @@ rd_kafka_msgset_reader_msg_v0_1 (rd_kafka_msgset_reader_t *msetr) {
 
 
 
+/**
+ * @brief Decode a zig-zag varint from contiguous record memory
+ *        \p p .. \p end.
+ *
+ * @returns a pointer past the varint, or NULL on underflow.
+ */
+static RD_INLINE const char *
+rd_kafka_msgset_reader_mem_varint (const char *p, const char *end,
+                                   int64_t *nump) {
+        size_t r = rd_varint_dec_mem(p, (size_t)(end - p), nump);
+        return likely(r > 0) ? p + r : NULL;
+}
+
+/**
+ * @brief Decode varint-length-prefixed bytes from contiguous record memory,
+ *        with the same semantics as rd_kafka_buf_read_bytes_varint().
+ *
+ * @returns a pointer past the bytes, or NULL on underflow.
+ */
+static RD_INLINE const char *
+rd_kafka_msgset_reader_mem_bytes (const char *p, const char *end,
+                                  rd_kafkap_bytes_t *kbytes) {
+        int64_t len;
+
+        if (unlikely(!(p = rd_kafka_msgset_reader_mem_varint(p, end, &len))))
+                return NULL;
+
+        if (len == RD_KAFKAP_BYTES_LEN_NULL) {
+                kbytes->data = NULL;
+                kbytes->len  = 0;
+        } else if (unlikely(len < 0 || len > (int64_t)(end - p))) {
+                return NULL;
+        } else {
+                kbytes->data = len == 0 ? "" : p;
+                kbytes->len  = (int32_t)len;
+                p += len;
+        }
+
+        return p;
+}
+
+
 /**
  * @brief Message parser for MsgVersion v2
  */
@@ -652,13 +1039,68 @@ rd_kafka_msgset_reader_msg_v2 (rd_kafka_msgset_reader_t *msetr) {
         } hdr;
         rd_kafka_op_t *rko;
         rd_kafka_msg_t *rkm;
+        rd_kafka_timestamp_type_t tstype;
+        int64_t timestamp;
         /* Only log decoding errors if protocol debugging enabled. */
         int log_decode_errors = (rkbuf->rkbuf_rkb->rkb_rk->rk_conf.debug &
                                  RD_KAFKA_DBG_PROTOCOL) ? LOG_DEBUG : 0;
         size_t message_end;
+        rd_slice_t record_start;
+        const char *p, *end;
 
         rd_kafka_buf_read_varint(rkbuf, &hdr.Length);
         message_end = rd_slice_offset(&rkbuf->rkbuf_reader)+(size_t)hdr.Length;
+
+        /* Fast path: the record is contiguous in memory (which is
+         * always the case for uncompressed and decompressed MessageSets
+         * unless the record is split by a buffer segment boundary),
+         * decode the record header fields directly from memory without
+         * per-field slice bounds checks. */
+        record_start = rkbuf->rkbuf_reader;
+        if (likely(hdr.Length > 0 &&
+                   (p = rd_slice_ensure_contig(&rkbuf->rkbuf_reader,
+                                               (size_t)hdr.Length)))) {
+                end = p + hdr.Length;
+                hdr.MsgAttributes = (int8_t)*p++;
+
+                if (likely((p = rd_kafka_msgset_reader_mem_varint(
+                                    p, end, &hdr.TimestampDelta)) &&
+                           (p = rd_kafka_msgset_reader_mem_varint(
+                                   p, end, &hdr.OffsetDelta)) &&
+                           (p = rd_kafka_msgset_reader_mem_bytes(
+                                   p, end, &hdr.Key)) &&
+                           (p = rd_kafka_msgset_reader_mem_bytes(
+                                   p, end, &hdr.Value)))) {
+                        hdr.Offset = msetr->msetr_v2_hdr->BaseOffset +
+                                hdr.OffsetDelta;
+
+                        /* Skip message if outdated.
+                         * The read position is already at the next
+                         * message. */
+                        if (hdr.Offset < msetr->msetr_fetch_offset) {
+                                rd_rkb_dbg(msetr->msetr_rkb, MSG, "MSG",
+                                           "%s [%"PRId32"]: "
+                                           "Skip offset %"PRId64" < "
+                                           "fetch_offset %"PRId64,
+                                           rktp->rktp_rkt->rkt_topic->str,
+                                           rktp->rktp_partition,
+                                           hdr.Offset,
+                                           msetr->msetr_fetch_offset);
+                                return RD_KAFKA_RESP_ERR_NO_ERROR;
+                        }
+
+                        /* Headers are parsed on first access */
+                        hdr.Headers.len  = (int32_t)(end - p);
+                        hdr.Headers.data = p;
+
+                        goto record_parsed;
+                }
+
+                /* Malformed record: rewind and let the slice-based
+                 * parser below report the error. */
+                rkbuf->rkbuf_reader = record_start;
+        }
+
         rd_kafka_buf_read_i8(rkbuf, &hdr.MsgAttributes);
 
         rd_kafka_buf_read_varint(rkbuf, &hdr.TimestampDelta);
@@ -666,13 +1108,13 @@ rd_kafka_msgset_reader_msg_v2 (rd_kafka_msgset_reader_t *msetr) {
         hdr.Offset = msetr->msetr_v2_hdr->BaseOffset + hdr.OffsetDelta;
 
         /* Skip message if outdated */
-        if (hdr.Offset < rktp->rktp_offsets.fetch_offset) {
+        if (hdr.Offset < msetr->msetr_fetch_offset) {
                 rd_rkb_dbg(msetr->msetr_rkb, MSG, "MSG",
                            "%s [%"PRId32"]: "
                            "Skip offset %"PRId64" < fetch_offset %"PRId64,
                            rktp->rktp_rkt->rkt_topic->str,
                            rktp->rktp_partition,
-                           hdr.Offset, rktp->rktp_offsets.fetch_offset);
+                           hdr.Offset, msetr->msetr_fetch_offset);
                 rd_kafka_buf_skip_to(rkbuf, message_end);
                 return RD_KAFKA_RESP_ERR_NO_ERROR; /* Continue with next msg */
         }
@@ -687,8 +1129,60 @@ rd_kafka_msgset_reader_msg_v2 (rd_kafka_msgset_reader_t *msetr) {
                                     rd_slice_offset(&rkbuf->rkbuf_reader));
         rd_kafka_buf_read_ptr(rkbuf, &hdr.Headers.data, hdr.Headers.len);
 
+ record_parsed:
+
+        /* Set timestamp.
+         *
+         * When broker assigns the timestamps (LOG_APPEND_TIME) it will
+         * assign the same timestamp for all messages in a MessageSet
+         * using MaxTimestamp.
+         */
+        if ((msetr->msetr_v2_hdr->Attributes &
+             RD_KAFKA_MSG_ATTR_LOG_APPEND_TIME) ||
+            (hdr.MsgAttributes & RD_KAFKA_MSG_ATTR_LOG_APPEND_TIME)) {
+                tstype = RD_KAFKA_TIMESTAMP_LOG_APPEND_TIME;
+                timestamp = msetr->msetr_v2_hdr->MaxTimestamp;
+        } else {
+                tstype = RD_KAFKA_TIMESTAMP_CREATE_TIME;
+                timestamp =
+                        msetr->msetr_v2_hdr->BaseTimestamp + hdr.TimestampDelta;
+        }
+
+        if (rkbuf->rkbuf_rkb->rkb_rk->rk_conf.fetch_batch_ops) {
+                /* Add a lightweight view of the message to the
+                 * MessageSet's batch op, it will be unpacked to a
+                 * proper op/message when consumed by the application. */
+                rd_kafka_msg_view_t *view;
+
+                if (!msetr->msetr_batch_rko)
+                        msetr->msetr_batch_rko =
+                                rd_kafka_op_new_fetch_batch(
+                                        rktp, msetr->msetr_tver->version,
+                                        rkbuf);
+
+                view = rd_kafka_op_fetch_batch_add(
+                        msetr->msetr_batch_rko,
+                        hdr.Offset,
+                        (size_t)RD_KAFKAP_BYTES_LEN(&hdr.Key),
+                        RD_KAFKAP_BYTES_IS_NULL(&hdr.Key) ?
+                        NULL : hdr.Key.data,
+                        (size_t)RD_KAFKAP_BYTES_LEN(&hdr.Value),
+                        RD_KAFKAP_BYTES_IS_NULL(&hdr.Value) ?
+                        NULL : hdr.Value.data);
+
+                view->hdrs_len  = hdr.Headers.len;
+                view->hdrs      = hdr.Headers.data;
+                view->tstype    = tstype;
+                view->timestamp = timestamp;
+
+                msetr->msetr_msgcnt++;
+                msetr->msetr_msg_bytes += view->key_len + view->val_len;
+
+                return RD_KAFKA_RESP_ERR_NO_ERROR;
+        }
+
         /* Create op/message container for message. */
-        rko = rd_kafka_op_new_fetch_msg(&rkm,
+        rko = rd_kafka_op_new_fetch_msg(&rkm, msetr->msetr_op_cache,
                                         rktp, msetr->msetr_tver->version, rkbuf,
                                         hdr.Offset,
                                         (size_t)RD_KAFKAP_BYTES_LEN(&hdr.Key),
@@ -705,22 +1199,8 @@ rd_kafka_msgset_reader_msg_v2 (rd_kafka_msgset_reader_t *msetr) {
         rkm->rkm_u.consumer.binhdrs.len  = hdr.Headers.len;
         rkm->rkm_u.consumer.binhdrs.data = hdr.Headers.data;
 
-        /* Set timestamp.
-         *
-         * When broker assigns the timestamps (LOG_APPEND_TIME) it will
-         * assign the same timestamp for all messages in a MessageSet
-         * using MaxTimestamp.
-         */
-        if ((msetr->msetr_v2_hdr->Attributes &
-             RD_KAFKA_MSG_ATTR_LOG_APPEND_TIME) ||
-            (hdr.MsgAttributes & RD_KAFKA_MSG_ATTR_LOG_APPEND_TIME)) {
-                rkm->rkm_tstype = RD_KAFKA_TIMESTAMP_LOG_APPEND_TIME;
-                rkm->rkm_timestamp = msetr->msetr_v2_hdr->MaxTimestamp;
-        } else {
-                rkm->rkm_tstype = RD_KAFKA_TIMESTAMP_CREATE_TIME;
-                rkm->rkm_timestamp =
-                        msetr->msetr_v2_hdr->BaseTimestamp + hdr.TimestampDelta;
-        }
+        rkm->rkm_tstype    = tstype;
+        rkm->rkm_timestamp = timestamp;
 
 
         /* Enqueue message on temporary queue */
@@ -742,14 +1222,21 @@ rd_kafka_msgset_reader_msg_v2 (rd_kafka_msgset_reader_t *msetr) {
  */
 static rd_kafka_resp_err_t
 rd_kafka_msgset_reader_msgs_v2 (rd_kafka_msgset_reader_t *msetr) {
+        rd_kafka_resp_err_t err = RD_KAFKA_RESP_ERR_NO_ERROR;
+
         while (rd_kafka_buf_read_remain(msetr->msetr_rkbuf)) {
-                rd_kafka_resp_err_t err;
                 err = rd_kafka_msgset_reader_msg_v2(msetr);
                 if (unlikely(err))
-                        return err;
+                        break;
         }
 
-        return RD_KAFKA_RESP_ERR_NO_ERROR;
+        /* Enqueue the batch op of successfully parsed messages, if any. */
+        if (msetr->msetr_batch_rko) {
+                rd_kafka_q_enq(&msetr->msetr_rkq, msetr->msetr_batch_rko);
+                msetr->msetr_batch_rko = NULL;
+        }
+
+        return err;
 }
 
 
@@ -848,7 +1335,7 @@ rd_kafka_msgset_reader_v2 (rd_kafka_msgset_reader_t *msetr) {
                                             hdr.BaseOffset, payload_size);
 
         /* If entire MessageSet contains old outdated offsets, skip it. */
-        if (LastOffset < rktp->rktp_offsets.fetch_offset) {
+        if (LastOffset < msetr->msetr_fetch_offset) {
                 rd_kafka_buf_skip(rkbuf, payload_size);
                 goto done;
         }
@@ -960,7 +1447,7 @@ rd_kafka_msgset_reader (rd_kafka_msgset_reader_t *msetr) {
                            rktp->rktp_rkt->rkt_topic->str,
                            rktp->rktp_partition,
                            (int)MagicByte, Offset);
-                if (Offset >= msetr->msetr_rktp->rktp_offsets.fetch_offset) {
+                if (Offset >= msetr->msetr_fetch_offset) {
                         rd_kafka_q_op_err(
                                 &msetr->msetr_rkq,
                                 RD_KAFKA_OP_CONSUMER_ERR,
@@ -970,7 +1457,8 @@ rd_kafka_msgset_reader (rd_kafka_msgset_reader_t *msetr) {
                                 "at offset %"PRId64,
                                 (int)MagicByte, Offset);
                         /* Skip message(set) */
-                        msetr->msetr_rktp->rktp_offsets.fetch_offset = Offset+1;
+                        if (Offset + 1 > msetr->msetr_next_offset)
+                                msetr->msetr_next_offset = Offset + 1;
                 }
 
                 return RD_KAFKA_RESP_ERR__NOT_IMPLEMENTED;
@@ -998,24 +1486,17 @@ rd_kafka_msgset_reader (rd_kafka_msgset_reader_t *msetr) {
  */
 static void rd_kafka_msgset_reader_postproc (rd_kafka_msgset_reader_t *msetr,
                                              int64_t *last_offsetp) {
-        rd_kafka_op_t *rko;
-
         if (msetr->msetr_relative_offsets) {
                 /* Update messages to absolute offsets
                  * and purge any messages older than the current
                  * fetch offset. */
                 rd_kafka_q_fix_offsets(&msetr->msetr_rkq,
-                                       msetr->msetr_rktp->rktp_offsets.
-                                       fetch_offset,
+                                       msetr->msetr_fetch_offset,
                                        msetr->msetr_outer.offset -
                                        msetr->msetr_msgcnt + 1);
         }
 
-        rko = rd_kafka_q_last(&msetr->msetr_rkq,
-                              RD_KAFKA_OP_FETCH,
-                              0 /* no error ops */);
-        if (rko)
-                *last_offsetp = rko->rko_u.fetch.rkm.rkm_offset;
+        *last_offsetp = rd_kafka_msgset_reader_last_offset(msetr);
 }
 
 
@@ -1042,16 +1523,35 @@ rd_kafka_msgset_reader_run (rd_kafka_msgset_reader_t *msetr) {
         /* Parse MessageSets and messages */
         err = rd_kafka_msgset_reader(msetr);
 
-        if (unlikely(rd_kafka_q_len(&msetr->msetr_rkq) == 0)) {
+        if (unlikely(rd_kafka_q_len(&msetr->msetr_rkq) == 0 &&
+                     msetr->msetr_decomp_cnt == 0)) {
                 /* The message set didn't contain at least one full message
                  * or no error was posted on the response queue.
                  * This means the size limit perhaps was too tight,
                  * increase it automatically.
                  * If there was at least one control message there
-                 * is probably not a size limit and nothing is done. */
-                if (msetr->msetr_ctrl_cnt > 0) {
+                 * is probably not a size limit and nothing is done.
+                 * The partition's fetch state is owned by the broker
+                 * thread so nothing is done for offloaded readers either. */
+                if (msetr->msetr_ctrl_cnt > 0 || msetr->msetr_offload) {
                         /* Noop */
 
+                } else if (rktp->rktp_rkt->rkt_rk->rk_conf.
+                           queued_max_total_bytes &&
+                           rktp->rktp_fetch_adaptive_size <
+                           rktp->rktp_fetch_msg_max_bytes) {
+                        /* Adaptive fetch size was too small for the
+                         * message: open it up fully before raising
+                         * the max fetch size itself. */
+                        rktp->rktp_fetch_adaptive_size =
+                                rktp->rktp_fetch_msg_max_bytes;
+                        rd_rkb_dbg(msetr->msetr_rkb, FETCH, "CONSUME",
+                                   "Topic %s [%"PRId32"]: Increasing "
+                                   "adaptive fetch size to %"PRId32,
+                                   rktp->rktp_rkt->rkt_topic->str,
+                                   rktp->rktp_partition,
+                                   rktp->rktp_fetch_adaptive_size);
+
                 } else  if (rktp->rktp_fetch_msg_max_bytes < (1 << 30)) {
                         rktp->rktp_fetch_msg_max_bytes *= 2;
                         rd_rkb_dbg(msetr->msetr_rkb, FETCH, "CONSUME",
@@ -1082,7 +1582,7 @@ rd_kafka_msgset_reader_run (rd_kafka_msgset_reader_t *msetr) {
                  * good message since it probably indicates a
                  * partial response rather than an erroneous one. */
                 if (err == RD_KAFKA_RESP_ERR__UNDERFLOW &&
-                    msetr->msetr_msgcnt > 0)
+                    (msetr->msetr_msgcnt > 0 || msetr->msetr_decomp_cnt > 0))
                         err = RD_KAFKA_RESP_ERR_NO_ERROR;
         }
 
@@ -1099,19 +1599,32 @@ rd_kafka_msgset_reader_run (rd_kafka_msgset_reader_t *msetr) {
                    msetr->msetr_tver->version, last_offset,
                    msetr->msetr_ctrl_cnt);
 
-        /* Concat all messages&errors onto the parent's queue
-         * (the partition's fetch queue) */
-        if (rd_kafka_q_concat(msetr->msetr_par_rkq, &msetr->msetr_rkq) != -1) {
-                /* Update partition's fetch offset based on
-                 * last message's offest. */
-                if (likely(last_offset != -1))
-                        rktp->rktp_offsets.fetch_offset = last_offset + 1;
-        }
+        if (msetr->msetr_offload) {
+                /* Concat onto the parent (outer reader or job) queue,
+                 * the fetch offset is maintained by the broker thread. */
+                rd_kafka_q_concat(msetr->msetr_par_rkq, &msetr->msetr_rkq);
+
+        } else {
+                /* Concat all messages&errors onto the parent's queue
+                 * (the partition's fetch queue), or behind any outstanding
+                 * decompression jobs for the partition. */
+                if ((msetr->msetr_decomp_pool ?
+                     rd_kafka_decomp_enq_done(rktp, &msetr->msetr_rkq) :
+                     rd_kafka_q_concat(msetr->msetr_par_rkq,
+                                       &msetr->msetr_rkq)) != -1) {
+                        /* Update partition's fetch offset based on
+                         * last message's offest. */
+                        if (likely(last_offset != -1))
+                                rktp->rktp_offsets.fetch_offset =
+                                        last_offset + 1;
+                }
 
-        /* Adjust next fetch offset if outlier code has indicated
-         * an even later next offset. */
-        if (msetr->msetr_next_offset > rktp->rktp_offsets.fetch_offset)
-                rktp->rktp_offsets.fetch_offset = msetr->msetr_next_offset;
+                /* Adjust next fetch offset if outlier code has indicated
+                 * an even later next offset. */
+                if (msetr->msetr_next_offset > rktp->rktp_offsets.fetch_offset)
+                        rktp->rktp_offsets.fetch_offset =
+                                msetr->msetr_next_offset;
+        }
 
         rd_kafka_q_destroy_owner(&msetr->msetr_rkq);
 
@@ -1142,6 +1655,12 @@ rd_kafka_msgset_parse (rd_kafka_buf_t *rkbuf,
         rd_kafka_msgset_reader_init(&msetr, rkbuf, rktp, tver,
                                     rktp->rktp_fetchq);
 
+        rkbuf->rkbuf_uflow_mitigation = "truncated response from broker (ok)";
+
+        /* Compressed MessageSets are handed off to the decompression
+         * pool, if configured. */
+        msetr.msetr_decomp_pool = rkbuf->rkbuf_rkb->rkb_rk->rk_decomp_pool;
+
         /* Parse and handle the message set */
         err = rd_kafka_msgset_reader_run(&msetr);
 
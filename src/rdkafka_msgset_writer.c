@@ -34,6 +34,9 @@
 #include "rdkafka_partition.h"
 #include "rdkafka_header.h"
 #include "rdkafka_lz4.h"
+#if WITH_ZSTD
+#include "rdkafka_zstd.h"
+#endif
 
 #include "snappy.h"
 #include "rdvarint.h"
@@ -44,10 +47,25 @@ typedef struct rd_kafka_msgset_writer_s {
         rd_kafka_buf_t *msetw_rkbuf;     /* Backing store buffer (refcounted)*/
 
         int16_t msetw_ApiVersion;        /* ProduceRequest ApiVersion */
-        int     msetw_MsgVersion;        /* MsgVersion to construct */
         int     msetw_features;          /* Protocol features to use */
+
+        /* ProduceRequest topic and partition arrays */
+        size_t  msetw_of_TopicArrayCnt;  /**< offset of TopicArrayCnt */
+        int32_t msetw_TopicArrayCnt;     /**< Number of topics written */
+        size_t  msetw_of_PartitionArrayCnt; /**< offset of current topic's
+                                             *   PartitionArrayCnt */
+        int32_t msetw_PartitionArrayCnt; /**< Number of partitions written
+                                          *   for current topic */
+        rd_kafka_itopic_t *msetw_rkt;    /**< Current topic.
+                                          *   @warning Not a refcounted
+                                          *            reference! */
+
+        /* Current partition's MessageSet */
+        int     msetw_MsgVersion;        /* MsgVersion to construct */
         int     msetw_msgcntmax;         /* Max number of messages to send
                                           * in a batch. */
+        int     msetw_msgcnt;            /**< Number of messages written
+                                          *   to the MessageSet */
         size_t  msetw_messages_len;      /* Total size of Messages, with Message
                                           * framing but without
                                           * MessageSet header */
@@ -69,15 +87,34 @@ typedef struct rd_kafka_msgset_writer_s {
         struct {
                 size_t     of;  /* rkbuf's first message position */
                 int64_t    timestamp;
+                uint64_t   msgseq;     /**< Idempotent producer msgseq */
+                rd_ts_t    ts_timeout; /**< Message timeout */
         } msetw_firstmsg;
 
         rd_kafka_broker_t *msetw_rkb;    /* @warning Not a refcounted
                                           *          reference! */
+        rd_kafka_codec_ctx_t *msetw_codec; /**< Compression contexts of
+                                            *   the current thread. */
         rd_kafka_toppar_t *msetw_rktp;   /* @warning Not a refcounted
                                           *          reference! */
+        rd_kafka_pid_t     msetw_pid;    /**< Idempotent producer's
+                                          *   current Producer Id */
+        size_t  msetw_copy_max;          /**< Max payload size to copy,
+                                          *   larger payloads are
+                                          *   referenced. */
+        int     msetw_refcnt;            /**< Number of payloads
+                                          *   referenced (not copied) */
 } rd_kafka_msgset_writer_t;
 
 
+/**
+ * Uncompressed payloads of this size or larger are always passed by
+ * reference: below this the per-segment allocation and iovec overhead
+ * outweighs the copy.
+ */
+#define RD_KAFKA_MSGSET_WRITER_REF_MIN_SIZE  4096
+
+
 
 /**
  * @brief Select ApiVersion and MsgVersion to use based on broker's
@@ -88,44 +125,70 @@ typedef struct rd_kafka_msgset_writer_s {
 static RD_INLINE void
 rd_kafka_msgset_writer_select_MsgVersion (rd_kafka_msgset_writer_t *msetw) {
         rd_kafka_broker_t *rkb = msetw->msetw_rkb;
+        int16_t ApiVersion;
         int feature;
 
-        if ((feature = rkb->rkb_features & RD_KAFKA_FEATURE_MSGVER2)) {
-                msetw->msetw_ApiVersion = 3;
+        if (msetw->msetw_rktp->rktp_rkt->rkt_conf.compression_codec ==
+            RD_KAFKA_COMPRESSION_ZSTD &&
+            (feature = rkb->rkb_features & RD_KAFKA_FEATURE_ZSTD)) {
+                /* ZSTD-compressed MessageSets require ProduceRequest v7 */
+                ApiVersion = 7;
+                msetw->msetw_MsgVersion = 2;
+                msetw->msetw_features |= feature | RD_KAFKA_FEATURE_MSGVER2;
+        } else if ((feature = rkb->rkb_features & RD_KAFKA_FEATURE_MSGVER2)) {
+                ApiVersion = 3;
                 msetw->msetw_MsgVersion = 2;
                 msetw->msetw_features |= feature;
         } else if ((feature = rkb->rkb_features & RD_KAFKA_FEATURE_MSGVER1)) {
-                msetw->msetw_ApiVersion = 2;
+                ApiVersion = 2;
                 msetw->msetw_MsgVersion = 1;
                 msetw->msetw_features |= feature;
         } else {
                 if ((feature =
                      rkb->rkb_features & RD_KAFKA_FEATURE_THROTTLETIME)) {
-                        msetw->msetw_ApiVersion = 1;
+                        ApiVersion = 1;
                         msetw->msetw_features |= feature;
                 } else
-                        msetw->msetw_ApiVersion = 0;
+                        ApiVersion = 0;
                 msetw->msetw_MsgVersion = 0;
         }
+
+        /* The request is sent with the highest ApiVersion required
+         * by any of its MessageSets: the request layout is the same
+         * for v3..v7, which is the only range where the per-partition
+         * ApiVersion differs (ZSTD). */
+        if (ApiVersion > msetw->msetw_ApiVersion)
+                msetw->msetw_ApiVersion = ApiVersion;
+
+        /* LZ4 compression requires broker support. Record it here since
+         * compression may be performed on a compression thread. */
+        if (msetw->msetw_rktp->rktp_rkt->rkt_conf.compression_codec ==
+            RD_KAFKA_COMPRESSION_LZ4)
+                msetw->msetw_features |= rkb->rkb_features &
+                        RD_KAFKA_FEATURE_LZ4;
 }
 
 
 /**
  * @brief Allocate buffer for messageset writer based on a previously set
- *        up \p msetw.
+ *        up \p msetw and the partitions in \p rktps.
  *
  * Allocate iovecs to hold all headers and messages,
  * and allocate enough space to allow copies of small messages.
  * The allocated size is the minimum of message.max.bytes
- * or queued_bytes + msgcntmax * msg_overhead
+ * or the sum of each partition's queued_bytes + msgcntmax * msg_overhead
  */
 static void
-rd_kafka_msgset_writer_alloc_buf (rd_kafka_msgset_writer_t *msetw) {
+rd_kafka_msgset_writer_alloc_buf (rd_kafka_msgset_writer_t *msetw,
+                                  const rd_list_t *rktps) {
         rd_kafka_t *rk = msetw->msetw_rkb->rkb_rk;
+        rd_kafka_toppar_t *rktp;
         size_t msg_overhead = 0;
         size_t hdrsize = 0;
         size_t msgsetsize = 0;
         size_t bufsize;
+        int iovcnt = 10;
+        int i;
 
         rd_kafka_assert(NULL, !msetw->msetw_rkbuf);
 
@@ -139,7 +202,7 @@ rd_kafka_msgset_writer_alloc_buf (rd_kafka_msgset_writer_t *msetw) {
          *    RequiredAcks + Timeout +
          *    [Topic + [Partition + MessageSetSize]]
          *
-         *  ProduceRequest v3:
+         *  ProduceRequest v3..7:
          *    TransactionalId + RequiredAcks + Timeout +
          *    [Topic + [Partition + MessageSetSize + MessageSet]]
          */
@@ -149,6 +212,7 @@ rd_kafka_msgset_writer_alloc_buf (rd_kafka_msgset_writer_t *msetw) {
          */
         switch (msetw->msetw_ApiVersion)
         {
+        case 7:
         case 3:
                 /* Add TransactionalId */
                 hdrsize += RD_KAFKAP_STR_SIZE(rk->rk_eos.TransactionalId);
@@ -158,12 +222,7 @@ rd_kafka_msgset_writer_alloc_buf (rd_kafka_msgset_writer_t *msetw) {
         case 2:
                 hdrsize +=
                         /* RequiredAcks + Timeout + TopicCnt */
-                        2 + 4 + 4 +
-                        /* Topic */
-                        RD_KAFKAP_STR_SIZE(msetw->msetw_rktp->
-                                           rktp_rkt->rkt_topic) +
-                        /* PartitionCnt + Partition + MessageSetSize */
-                        4 + 4 + 4;
+                        2 + 4 + 4;
                 msgsetsize += 4; /* MessageSetSize */
                 break;
 
@@ -215,34 +274,49 @@ rd_kafka_msgset_writer_alloc_buf (rd_kafka_msgset_writer_t *msetw) {
         /*
          * Calculate total buffer size to allocate
          */
-        bufsize = hdrsize + msgsetsize;
-
-        /* If copying for small payloads is enabled, allocate enough
-         * space for each message to be copied based on this limit.
-         */
-        if (rk->rk_conf.msg_copy_max_size > 0) {
-                size_t queued_bytes = rd_kafka_msgq_size(&msetw->msetw_rktp->
-                                                         rktp_xmit_msgq);
-                bufsize += RD_MIN(queued_bytes,
-                                  (size_t)rk->rk_conf.msg_copy_max_size *
-                                  msetw->msetw_msgcntmax);
+        bufsize = hdrsize;
+
+        RD_LIST_FOREACH(rktp, rktps, i) {
+                int msgcntmax = RD_MIN(rktp->rktp_xmit_msgq.rkmq_msg_cnt,
+                                       rk->rk_conf.batch_num_messages);
+                size_t copy_max = (size_t)rk->rk_conf.msg_copy_max_size;
+
+                /* Topic + PartitionCnt (worst-case: one per partition) +
+                 * Partition + MessageSet header */
+                bufsize += RD_KAFKAP_STR_SIZE(rktp->rktp_rkt->rkt_topic) +
+                        4 + 4 + msgsetsize;
+
+                /* If copying for small payloads is enabled, allocate enough
+                 * space for each message to be copied based on this limit.
+                 */
+                if (!rktp->rktp_rkt->rkt_conf.compression_codec)
+                        copy_max = RD_MIN(copy_max,
+                                          RD_KAFKA_MSGSET_WRITER_REF_MIN_SIZE -
+                                          1);
+                if (copy_max > 0)
+                        bufsize += RD_MIN(rd_kafka_msgq_size(&rktp->
+                                                             rktp_xmit_msgq),
+                                          copy_max * msgcntmax);
+
+                /* Add estimed per-message overhead */
+                bufsize += msg_overhead * msgcntmax;
+
+                iovcnt += msgcntmax/2;
+
+                /* Cap allocation at message.max.bytes */
+                if (bufsize >= (size_t)rk->rk_conf.max_msg_size) {
+                        bufsize = (size_t)rk->rk_conf.max_msg_size;
+                        break;
+                }
         }
 
-        /* Add estimed per-message overhead */
-        bufsize += msg_overhead * msetw->msetw_msgcntmax;
-
-        /* Cap allocation at message.max.bytes */
-        if (bufsize > (size_t)rk->rk_conf.max_msg_size)
-                bufsize = (size_t)rk->rk_conf.max_msg_size;
-
         /*
          * Allocate iovecs to hold all headers and messages,
          * and allocate auxilliery space for message headers, etc.
          */
         msetw->msetw_rkbuf =
                 rd_kafka_buf_new_request(msetw->msetw_rkb, RD_KAFKAP_Produce,
-                                         msetw->msetw_msgcntmax/2 + 10,
-                                         bufsize);
+                                         iovcnt, bufsize);
 
         rd_kafka_buf_ApiVersion_set(msetw->msetw_rkbuf,
                                     msetw->msetw_ApiVersion,
@@ -258,7 +332,6 @@ static void
 rd_kafka_msgset_writer_write_MessageSet_v2_header (
         rd_kafka_msgset_writer_t *msetw) {
         rd_kafka_buf_t *rkbuf = msetw->msetw_rkbuf;
-        rd_kafka_t *rk = msetw->msetw_rkb->rkb_rk;
 
         rd_kafka_assert(NULL, msetw->msetw_ApiVersion >= 3);
         rd_kafka_assert(NULL, msetw->msetw_MsgVersion == 2);
@@ -295,12 +368,12 @@ rd_kafka_msgset_writer_write_MessageSet_v2_header (
         rd_kafka_buf_write_i64(rkbuf, 0);
 
         /* ProducerId */
-        rd_kafka_buf_write_i64(rkbuf, rk->rk_eos.PID);
+        rd_kafka_buf_write_i64(rkbuf, msetw->msetw_pid.id);
 
         /* ProducerEpoch */
-        rd_kafka_buf_write_i16(rkbuf, rk->rk_eos.ProducerEpoch);
+        rd_kafka_buf_write_i16(rkbuf, msetw->msetw_pid.epoch);
 
-        /* BaseSequence */
+        /* BaseSequence: updated later in case of Idempotent Producer */
         rd_kafka_buf_write_i32(rkbuf, -1);
 
         /* RecordCount: udpated later */
@@ -310,10 +383,8 @@ rd_kafka_msgset_writer_write_MessageSet_v2_header (
 
 
 /**
- * @brief Write ProduceRequest headers.
- *        When this function returns the msgset is ready for
- *        writing individual messages.
- *        msetw_MessageSetSize will have been set to the messageset header.
+ * @brief Write ProduceRequest headers up to and including the
+ *        TopicArrayCnt, which is updated when the request is finalized.
  */
 static void
 rd_kafka_msgset_writer_write_Produce_header (rd_kafka_msgset_writer_t *msetw) {
@@ -322,8 +393,8 @@ rd_kafka_msgset_writer_write_Produce_header (rd_kafka_msgset_writer_t *msetw) {
         rd_kafka_t *rk = msetw->msetw_rkb->rkb_rk;
         rd_kafka_itopic_t *rkt = msetw->msetw_rktp->rktp_rkt;
 
-        /* V3: TransactionalId */
-        if (msetw->msetw_ApiVersion == 3)
+        /* V3..7: TransactionalId */
+        if (msetw->msetw_ApiVersion >= 3)
                 rd_kafka_buf_write_kstr(rkbuf, rk->rk_eos.TransactionalId);
 
         /* RequiredAcks */
@@ -332,62 +403,110 @@ rd_kafka_msgset_writer_write_Produce_header (rd_kafka_msgset_writer_t *msetw) {
         /* Timeout */
         rd_kafka_buf_write_i32(rkbuf, rkt->rkt_conf.request_timeout_ms);
 
-        /* TopicArrayCnt */
-        rd_kafka_buf_write_i32(rkbuf, 1);
-
-        /* Insert topic */
-        rd_kafka_buf_write_kstr(rkbuf, rkt->rkt_topic);
-
-        /* PartitionArrayCnt */
-        rd_kafka_buf_write_i32(rkbuf, 1);
+        /* TopicArrayCnt: Will be finalized later */
+        msetw->msetw_of_TopicArrayCnt = rd_kafka_buf_write_i32(rkbuf, 0);
+}
 
-        /* Partition */
-        rd_kafka_buf_write_i32(rkbuf, msetw->msetw_rktp->rktp_partition);
 
-        /* MessageSetSize: Will be finalized later*/
-        msetw->msetw_of_MessageSetSize = rd_kafka_buf_write_i32(rkbuf, 0);
+/**
+ * @brief Write the current topic's final PartitionArrayCnt, if any.
+ */
+static void
+rd_kafka_msgset_writer_finalize_topic (rd_kafka_msgset_writer_t *msetw) {
+        if (!msetw->msetw_rkt)
+                return;
 
-        if (msetw->msetw_MsgVersion == 2) {
-                /* MessageSet v2 header */
-                rd_kafka_msgset_writer_write_MessageSet_v2_header(msetw);
-                msetw->msetw_MessageSetSize = RD_KAFKAP_MSGSET_V2_SIZE;
-        } else {
-                /* Older MessageSet */
-                msetw->msetw_MessageSetSize = RD_KAFKAP_MSGSET_V0_SIZE;
-        }
+        rd_kafka_buf_update_i32(msetw->msetw_rkbuf,
+                                msetw->msetw_of_PartitionArrayCnt,
+                                msetw->msetw_PartitionArrayCnt);
 }
 
 
 /**
  * @brief Initialize a ProduceRequest MessageSet writer for
- *        the given broker and partition.
+ *        the given broker and partitions.
  *
- *        A new buffer will be allocated to fit the pending messages in queue.
+ *        A new buffer will be allocated to fit the pending messages of
+ *        the partitions in \p rktps and the ProduceRequest header is
+ *        written, using the first partition's topic configuration
+ *        for RequiredAcks and Timeout.
+ *        MessageSets are then added with
+ *        rd_kafka_msgset_writer_batch_init().
  *
- * @returns the number of messages to enqueue
+ * @locality broker thread
+ */
+static void rd_kafka_msgset_writer_init (rd_kafka_msgset_writer_t *msetw,
+                                         rd_kafka_broker_t *rkb,
+                                         const rd_list_t *rktps,
+                                         const rd_kafka_pid_t pid) {
+        rd_kafka_buf_t *rkbuf;
+
+        memset(msetw, 0, sizeof(*msetw));
+
+        msetw->msetw_rktp = rd_list_elem(rktps, 0);
+        msetw->msetw_rkb = rkb;
+        msetw->msetw_codec = &rkb->rkb_codec;
+        msetw->msetw_pid = pid;
+
+        /* Select ApiVersion and MsgVersion to use */
+        rd_kafka_msgset_writer_select_MsgVersion(msetw);
+
+        /* Allocate backing buffer */
+        rd_kafka_msgset_writer_alloc_buf(msetw, rktps);
+        rkbuf = msetw->msetw_rkbuf;
+
+        rkbuf->rkbuf_u.Produce.pid = pid;
+        rkbuf->rkbuf_u.Produce.batches =
+                rd_malloc(sizeof(*rkbuf->rkbuf_u.Produce.batches) *
+                          rd_list_cnt(rktps));
+
+        /* Construct the Produce header */
+        rd_kafka_msgset_writer_write_Produce_header(msetw);
+}
+
+
+/**
+ * @brief Begin a new MessageSet for partition \p rktp in the request,
+ *        writing the Topic (if it differs from the previous MessageSet's),
+ *        Partition and MessageSet headers.
  *
- * @remark This currently constructs the entire ProduceRequest, containing
- *         a single outer MessageSet for a single partition.
+ * @returns the maximum number of messages to write to the MessageSet,
+ *          0 if the partition's next message does not fit in what remains
+ *          of the request, or -1 if no messages can currently be sent
+ *          for the partition.
  *
  * @locality broker thread
  */
-static int rd_kafka_msgset_writer_init (rd_kafka_msgset_writer_t *msetw,
-                                         rd_kafka_broker_t *rkb,
-                                         rd_kafka_toppar_t *rktp) {
-        int msgcnt = rktp->rktp_xmit_msgq.rkmq_msg_cnt;
+static int
+rd_kafka_msgset_writer_batch_init (rd_kafka_msgset_writer_t *msetw,
+                                   rd_kafka_toppar_t *rktp,
+                                   rd_ts_t now) {
+        rd_kafka_broker_t *rkb = msetw->msetw_rkb;
+        rd_kafka_buf_t *rkbuf = msetw->msetw_rkbuf;
+        const rd_kafka_msg_t *rkm = TAILQ_FIRST(&rktp->rktp_xmit_msgq.
+                                                rkmq_msgs);
+        size_t hdrsize;
 
-        if (msgcnt == 0)
-                return 0;
+        if (!rkm)
+                return -1;
 
-        memset(msetw, 0, sizeof(*msetw));
+        /* Honour retry.backoff.ms */
+        if (unlikely(rkm->rkm_u.producer.ts_backoff > now))
+                return -1;
 
         msetw->msetw_rktp = rktp;
-        msetw->msetw_rkb = rkb;
+        msetw->msetw_msgcnt = 0;
+        msetw->msetw_messages_len = 0;
+        msetw->msetw_messages_kvlen = 0;
+        msetw->msetw_relative_offsets = 0;
+        msetw->msetw_Attributes = 0;
+        msetw->msetw_MaxTimestamp = 0;
+        msetw->msetw_refcnt = 0;
 
         /* Max number of messages to send in a batch,
          * limited by current queue size or configured batch size,
          * whichever is lower. */
-        msetw->msetw_msgcntmax = RD_MIN(msgcnt,
+        msetw->msetw_msgcntmax = RD_MIN(rktp->rktp_xmit_msgq.rkmq_msg_cnt,
                                         rkb->rkb_rk->rk_conf.
                                         batch_num_messages);
         rd_dassert(msetw->msetw_msgcntmax > 0);
@@ -407,18 +526,66 @@ static int rd_kafka_msgset_writer_init (rd_kafka_msgset_writer_t *msetw,
                 break;
         }
 
-        /* Allocate backing buffer */
-        rd_kafka_msgset_writer_alloc_buf(msetw);
+        /* Payloads of uncompressed MessageSets are written to the
+         * socket as is, so larger payloads are referenced rather than
+         * copied. Compressed MessageSets are replaced by the compressed
+         * copy so the copy limit is only an iovec count trade-off. */
+        msetw->msetw_copy_max = (size_t)rkb->rkb_rk->rk_conf.msg_copy_max_size;
+        if (!rktp->rktp_rkt->rkt_conf.compression_codec)
+                msetw->msetw_copy_max =
+                        RD_MIN(msetw->msetw_copy_max,
+                               RD_KAFKA_MSGSET_WRITER_REF_MIN_SIZE - 1);
+
+        /* The first message must fit in the request along with
+         * the Partition (and Topic) and MessageSet headers. */
+        hdrsize = 4/*Partition*/ + 4/*MessageSetSize*/ +
+                (msetw->msetw_MsgVersion == 2 ?
+                 RD_KAFKAP_MSGSET_V2_SIZE : RD_KAFKAP_MSGSET_V0_SIZE);
+        if (rktp->rktp_rkt != msetw->msetw_rkt)
+                hdrsize += RD_KAFKAP_STR_SIZE(rktp->rktp_rkt->rkt_topic) +
+                        4/*PartitionArrayCnt*/;
+
+        if (unlikely(rd_buf_len(&rkbuf->rkbuf_buf) + hdrsize +
+                     rd_kafka_msg_wire_size(rkm, msetw->msetw_MsgVersion) >
+                     (size_t)rkb->rkb_rk->rk_conf.max_msg_size))
+                return rkbuf->rkbuf_u.Produce.batch_cnt > 0 ? 0 : -1;
+
+        if (rktp->rktp_rkt != msetw->msetw_rkt) {
+                /* New topic */
+                rd_kafka_msgset_writer_finalize_topic(msetw);
+
+                rd_kafka_buf_write_kstr(rkbuf, rktp->rktp_rkt->rkt_topic);
+
+                /* PartitionArrayCnt: Will be finalized later */
+                msetw->msetw_of_PartitionArrayCnt =
+                        rd_kafka_buf_write_i32(rkbuf, 0);
+                msetw->msetw_PartitionArrayCnt = 0;
+                msetw->msetw_TopicArrayCnt++;
+                msetw->msetw_rkt = rktp->rktp_rkt;
+        }
 
-        /* Construct first part of Produce header + MessageSet header */
-        rd_kafka_msgset_writer_write_Produce_header(msetw);
+        msetw->msetw_PartitionArrayCnt++;
+
+        /* Partition */
+        rd_kafka_buf_write_i32(rkbuf, rktp->rktp_partition);
+
+        /* MessageSetSize: Will be finalized later*/
+        msetw->msetw_of_MessageSetSize = rd_kafka_buf_write_i32(rkbuf, 0);
+
+        if (msetw->msetw_MsgVersion == 2) {
+                /* MessageSet v2 header */
+                rd_kafka_msgset_writer_write_MessageSet_v2_header(msetw);
+                msetw->msetw_MessageSetSize = RD_KAFKAP_MSGSET_V2_SIZE;
+        } else {
+                /* Older MessageSet */
+                msetw->msetw_MessageSetSize = RD_KAFKAP_MSGSET_V0_SIZE;
+        }
 
         /* The current buffer position is now where the first message
          * is located.
          * Record the current buffer position so it can be rewound later
          * in case of compression. */
-        msetw->msetw_firstmsg.of = rd_buf_write_pos(&msetw->msetw_rkbuf->
-                                                    rkbuf_buf);
+        msetw->msetw_firstmsg.of = rd_buf_write_pos(&rkbuf->rkbuf_buf);
 
         return msetw->msetw_msgcntmax;
 }
@@ -432,21 +599,22 @@ static RD_INLINE void
 rd_kafka_msgset_writer_write_msg_payload (rd_kafka_msgset_writer_t *msetw,
                                           const rd_kafka_msg_t *rkm,
                                           void (*free_cb)(void *)) {
-        const rd_kafka_t *rk = msetw->msetw_rkb->rkb_rk;
         rd_kafka_buf_t *rkbuf = msetw->msetw_rkbuf;
 
         /* If payload is below the copy limit and there is still
          * room in the buffer we'll copy the payload to the buffer,
          * otherwise we push a reference to the memory. */
-        if (rkm->rkm_len <= (size_t)rk->rk_conf.msg_copy_max_size &&
+        if (rkm->rkm_len <= msetw->msetw_copy_max &&
             rd_buf_write_remains(&rkbuf->rkbuf_buf) > rkm->rkm_len) {
                 rd_kafka_buf_write(rkbuf,
                                    rkm->rkm_payload, rkm->rkm_len);
                 if (free_cb)
                         free_cb(rkm->rkm_payload);
-        } else
+        } else {
                 rd_kafka_buf_push(rkbuf, rkm->rkm_payload, rkm->rkm_len,
                                   free_cb);
+                msetw->msetw_refcnt++;
+        }
 }
 
 
@@ -723,6 +891,7 @@ rd_kafka_msgset_writer_write_msgq (rd_kafka_msgset_writer_t *msetw,
         rd_kafka_msg_t *rkm;
         int msgcnt = 0;
         const rd_ts_t now = rd_clock();
+        uint64_t last_msgseq = 0;
 
         /* Internal latency calculation base.
          * Uses rkm_ts_timeout which is enqueue time + timeout */
@@ -733,6 +902,8 @@ rd_kafka_msgset_writer_write_msgq (rd_kafka_msgset_writer_t *msetw,
         rkm = TAILQ_FIRST(&rkmq->rkmq_msgs);
         rd_kafka_assert(NULL, rkm);
         msetw->msetw_firstmsg.timestamp = rkm->rkm_timestamp;
+        msetw->msetw_firstmsg.msgseq = rkm->rkm_u.producer.msgseq;
+        msetw->msetw_firstmsg.ts_timeout = rkm->rkm_ts_timeout;
 
         /*
          * Write as many messages as possible until buffer is full
@@ -756,6 +927,16 @@ rd_kafka_msgset_writer_write_msgq (rd_kafka_msgset_writer_t *msetw,
                         break;
                 }
 
+                if (rd_kafka_pid_valid(msetw->msetw_pid) &&
+                    unlikely(msgcnt > 0 &&
+                             rkm->rkm_u.producer.msgseq != last_msgseq + 1)) {
+                        /* The idempotent producer's BaseSequence
+                         * is per batch, so the messages in a batch
+                         * must have consecutive sequence numbers. */
+                        break;
+                }
+                last_msgseq = rkm->rkm_u.producer.msgseq;
+
                 /* Move message to buffer's queue */
                 rd_kafka_msgq_deq(rkmq, rkm, 1);
                 rd_kafka_msgq_enq(&rkbuf->rkbuf_msgq, rkm);
@@ -779,6 +960,7 @@ rd_kafka_msgset_writer_write_msgq (rd_kafka_msgset_writer_t *msetw,
 
         } while ((rkm = TAILQ_FIRST(&rkmq->rkmq_msgs)));
 
+        msetw->msetw_msgcnt = msgcnt;
         msetw->msetw_MaxTimestamp = MaxTimestamp;
 }
 
@@ -940,7 +1122,7 @@ rd_kafka_msgset_writer_compress_lz4 (rd_kafka_msgset_writer_t *msetw,
         rd_kafka_resp_err_t err;
         int comp_level =
                 msetw->msetw_rktp->rktp_rkt->rkt_conf.compression_level;
-        err = rd_kafka_lz4_compress(msetw->msetw_rkb,
+        err = rd_kafka_lz4_compress(msetw->msetw_rkb, msetw->msetw_codec,
                                     /* Correct or incorrect HC */
                                     msetw->msetw_MsgVersion >= 1 ? 1 : 0,
                                     comp_level,
@@ -948,6 +1130,22 @@ rd_kafka_msgset_writer_compress_lz4 (rd_kafka_msgset_writer_t *msetw,
         return (err ? -1 : 0);
 }
 
+#if WITH_ZSTD
+/**
+ * @brief Compress messageset using ZSTD
+ */
+static int
+rd_kafka_msgset_writer_compress_zstd (rd_kafka_msgset_writer_t *msetw,
+                                      rd_slice_t *slice, struct iovec *ciov) {
+        rd_kafka_resp_err_t err;
+        int comp_level =
+                msetw->msetw_rktp->rktp_rkt->rkt_conf.compression_level;
+        err = rd_kafka_zstd_compress(msetw->msetw_rkb,
+                                     comp_level,
+                                     slice, &ciov->iov_base, &ciov->iov_len);
+        return (err ? -1 : 0);
+}
+#endif
 
 
 /**
@@ -957,6 +1155,8 @@ rd_kafka_msgset_writer_compress_lz4 (rd_kafka_msgset_writer_t *msetw,
  * @returns 0 on success or if -1 if compression failed.
  * @remark Compression failures are not critical, we'll just send the
  *         the messageset uncompressed.
+ *
+ * @locality broker thread or compression thread
  */
 static int
 rd_kafka_msgset_writer_compress (rd_kafka_msgset_writer_t *msetw,
@@ -992,12 +1192,22 @@ rd_kafka_msgset_writer_compress (rd_kafka_msgset_writer_t *msetw,
 
         case RD_KAFKA_COMPRESSION_LZ4:
                 /* Skip LZ4 compression if broker doesn't support it. */
-                if (!(msetw->msetw_rkb->rkb_features & RD_KAFKA_FEATURE_LZ4))
+                if (!(msetw->msetw_features & RD_KAFKA_FEATURE_LZ4))
                         return -1;
 
                 r = rd_kafka_msgset_writer_compress_lz4(msetw, &slice, &ciov);
                 break;
 
+#if WITH_ZSTD
+        case RD_KAFKA_COMPRESSION_ZSTD:
+                /* Skip ZSTD compression if broker doesn't support it. */
+                if (!(msetw->msetw_features & RD_KAFKA_FEATURE_ZSTD))
+                        return -1;
+
+                r = rd_kafka_msgset_writer_compress_zstd(msetw, &slice, &ciov);
+                break;
+#endif
+
 
         default:
                 rd_kafka_assert(NULL,
@@ -1085,7 +1295,7 @@ static void
 rd_kafka_msgset_writer_finalize_MessageSet_v2_header (
         rd_kafka_msgset_writer_t *msetw) {
         rd_kafka_buf_t *rkbuf = msetw->msetw_rkbuf;
-        int msgcnt = rd_kafka_msgq_len(&rkbuf->rkbuf_msgq);
+        int msgcnt = msetw->msetw_msgcnt;
 
         rd_kafka_assert(NULL, msgcnt > 0);
         rd_kafka_assert(NULL, msetw->msetw_ApiVersion >= 3);
@@ -1117,6 +1327,23 @@ rd_kafka_msgset_writer_finalize_MessageSet_v2_header (
                                 RD_KAFKAP_MSGSET_V2_OF_MaxTimestamp,
                                 msetw->msetw_MaxTimestamp);
 
+        if (rd_kafka_pid_valid(msetw->msetw_pid)) {
+                /* The BaseSequence is the first message's msgseq relative
+                 * to the partition's msgseq base for the current PID,
+                 * wrapped at INT32_MAX.
+                 * epoch_base_msgseq is only modified by the partition
+                 * leader's broker thread (this thread) and is thus
+                 * safe to read without the toppar lock. */
+                int32_t BaseSequence = (int32_t)
+                        ((msetw->msetw_firstmsg.msgseq -
+                          msetw->msetw_rktp->rktp_eos.epoch_base_msgseq) %
+                         ((uint64_t)INT32_MAX + 1));
+
+                rd_kafka_buf_update_i32(rkbuf, msetw->msetw_of_start +
+                                        RD_KAFKAP_MSGSET_V2_OF_BaseSequence,
+                                        BaseSequence);
+        }
+
         rd_kafka_buf_update_i32(rkbuf, msetw->msetw_of_start +
                                 RD_KAFKAP_MSGSET_V2_OF_RecordCount, msgcnt);
 
@@ -1148,32 +1375,95 @@ rd_kafka_msgset_writer_finalize_MessageSet (rd_kafka_msgset_writer_t *msetw) {
 
 
 /**
- * @brief Finalize the messageset - call when no more messages are to be
- *        added to the messageset.
+ * @brief Finalize the MessageSet headers and CRCs of the (possibly compressed)
+ *        messages of length \p len of the current partition's MessageSet,
+ *        which is the request's last batch.
  *
- *        Will compress, update final values, CRCs, etc.
+ * @locality broker thread
+ */
+static void
+rd_kafka_msgset_writer_finalize0 (rd_kafka_msgset_writer_t *msetw,
+                                  size_t len) {
+        rd_kafka_buf_t *rkbuf = msetw->msetw_rkbuf;
+        rd_kafka_toppar_t *rktp = msetw->msetw_rktp;
+
+        msetw->msetw_messages_len = len;
+
+        /* Finalize MessageSet header fields */
+        rd_kafka_msgset_writer_finalize_MessageSet(msetw);
+
+        /* Record final MessageSetSize */
+        rkbuf->rkbuf_u.Produce.batches[rkbuf->rkbuf_u.Produce.batch_cnt-1].
+                MessageSetSize = msetw->msetw_MessageSetSize;
+
+        /* Referenced payloads of uncompressed MessageSets are owned by
+         * the messages, which outlive the request, and may thus be sent
+         * without copying them to the socket buffer (socket.zerocopy). */
+        if (msetw->msetw_refcnt > 0 &&
+            !(msetw->msetw_Attributes & RD_KAFKA_MSG_ATTR_COMPRESSION_MASK))
+                rkbuf->rkbuf_flags |= RD_KAFKA_OP_F_ZEROCOPY;
+
+        rd_rkb_dbg(msetw->msetw_rkb, MSG, "PRODUCE",
+                   "%s [%"PRId32"]: "
+                   "Produce MessageSet with %i message(s) (%"PRIusz" bytes, "
+                   "ApiVersion %d, MsgVersion %d)",
+                   rktp->rktp_rkt->rkt_topic->str, rktp->rktp_partition,
+                   msetw->msetw_msgcnt,
+                   msetw->msetw_MessageSetSize,
+                   msetw->msetw_ApiVersion, msetw->msetw_MsgVersion);
+}
+
+
+/**
+ * @brief Hand off compression of the messageset to the compression
+ *        thread pool.
  *
- *        The messageset writer is destroyed and the buffer is returned
- *        and ready to be transmitted.
+ *        The writer state is moved to a new RD_KAFKA_OP_COMPRESS op
+ *        which is passed back to the broker thread's op queue
+ *        once compressed, see rd_kafka_msgset_compress_op_finalize().
  *
- * @param MessagetSetSizep will be set to the finalized MessageSetSize
+ * @locality broker thread
+ */
+static rd_kafka_op_t *
+rd_kafka_msgset_writer_compress_op_new (rd_kafka_msgset_writer_t *msetw,
+                                        size_t len) {
+        rd_kafka_op_t *rko;
+
+        rko = rd_kafka_op_new(RD_KAFKA_OP_COMPRESS);
+        rko->rko_rktp = rd_kafka_toppar_keep(msetw->msetw_rktp);
+        rko->rko_u.compress.rkbuf = msetw->msetw_rkbuf;
+        rko->rko_u.compress.msetw = rd_malloc(sizeof(*msetw));
+        *rko->rko_u.compress.msetw = *msetw;
+        rko->rko_u.compress.len = len;
+
+        return rko;
+}
+
+
+/**
+ * @brief Finalize the current partition's MessageSet - call when no more
+ *        messages are to be added to the messageset.
+ *
+ *        Adds the MessageSet to the request's batches and
+ *        compresses it, update final values, CRCs, etc.
+ *
+ * @param offload if true and the MessageSet is to be compressed the
+ *                compression is left to the compression thread pool:
+ *                the uncompressed length is retained in
+ *                msetw_messages_len for
+ *                rd_kafka_msgset_writer_compress_op_new().
  *
- * @returns the buffer to transmit or NULL if there were no messages
- *          in messageset.
+ * @returns true if compression is to be offloaded, else false.
  */
-static rd_kafka_buf_t *
-rd_kafka_msgset_writer_finalize (rd_kafka_msgset_writer_t *msetw,
-                                 size_t *MessageSetSizep) {
+static rd_bool_t
+rd_kafka_msgset_writer_batch_finalize (rd_kafka_msgset_writer_t *msetw,
+                                       rd_bool_t offload) {
         rd_kafka_buf_t *rkbuf = msetw->msetw_rkbuf;
         rd_kafka_toppar_t *rktp = msetw->msetw_rktp;
+        rd_kafka_produce_batch_t *batch;
         size_t len;
-        int cnt;
 
-        /* No messages added, bail out early. */
-        if (unlikely((cnt = rd_kafka_msgq_len(&rkbuf->rkbuf_msgq)) == 0)) {
-                rd_kafka_buf_destroy(rkbuf);
-                return NULL;
-        }
+        rd_assert(msetw->msetw_msgcnt > 0);
 
         /* Total size of messages */
         len = rd_buf_write_pos(&msetw->msetw_rkbuf->rkbuf_buf) -
@@ -1181,58 +1471,218 @@ rd_kafka_msgset_writer_finalize (rd_kafka_msgset_writer_t *msetw,
         rd_assert(len > 0);
         rd_assert(len <= (size_t)rktp->rktp_rkt->rkt_rk->rk_conf.max_msg_size);
 
-        rd_atomic64_add(&rktp->rktp_c.tx_msgs, cnt);
+        rd_atomic64_add(&rktp->rktp_c.tx_msgs, msetw->msetw_msgcnt);
         rd_atomic64_add(&rktp->rktp_c.tx_msg_bytes, msetw->msetw_messages_kvlen);
 
+        batch = &rkbuf->rkbuf_u.Produce.batches[rkbuf->rkbuf_u.Produce.
+                                                batch_cnt++];
+        batch->s_rktp = rd_kafka_toppar_keep(rktp);
+        batch->msgcnt = msetw->msetw_msgcnt;
+        batch->MessageSetSize = 0;
+        batch->ts_timeout = msetw->msetw_firstmsg.ts_timeout;
+        batch->err = RD_KAFKA_RESP_ERR_NO_ERROR;
+        batch->offset = RD_KAFKA_OFFSET_INVALID;
+        batch->timestamp = -1;
+
         /* Compress the message set */
-        if (rktp->rktp_rkt->rkt_conf.compression_codec)
+        if (rktp->rktp_rkt->rkt_conf.compression_codec) {
+                if (offload) {
+                        msetw->msetw_messages_len = len;
+                        return rd_true;
+                }
+
                 rd_kafka_msgset_writer_compress(msetw, &len);
+        }
 
-        msetw->msetw_messages_len = len;
+        rd_kafka_msgset_writer_finalize0(msetw, len);
 
-        /* Finalize MessageSet header fields */
-        rd_kafka_msgset_writer_finalize_MessageSet(msetw);
+        return rd_false;
+}
 
-        /* Return final MessageSetSize */
-        *MessageSetSizep = msetw->msetw_MessageSetSize;
+
+/**
+ * @brief Finalize the ProduceRequest's topic and partition arrays.
+ *
+ *        The messageset writer is destroyed and the buffer is returned
+ *        and ready to be transmitted (unless compression is pending).
+ *
+ * @returns the buffer to transmit or NULL if no MessageSets were added.
+ */
+static rd_kafka_buf_t *
+rd_kafka_msgset_writer_finalize (rd_kafka_msgset_writer_t *msetw) {
+        rd_kafka_buf_t *rkbuf = msetw->msetw_rkbuf;
+
+        /* No messages added, bail out early. */
+        if (unlikely(rkbuf->rkbuf_u.Produce.batch_cnt == 0)) {
+                rd_kafka_buf_destroy(rkbuf);
+                return NULL;
+        }
+
+        rd_kafka_msgset_writer_finalize_topic(msetw);
+
+        rd_kafka_buf_update_i32(rkbuf, msetw->msetw_of_TopicArrayCnt,
+                                msetw->msetw_TopicArrayCnt);
+
+        rd_kafka_buf_ApiVersion_set(rkbuf, msetw->msetw_ApiVersion,
+                                    msetw->msetw_features);
 
         rd_rkb_dbg(msetw->msetw_rkb, MSG, "PRODUCE",
-                   "%s [%"PRId32"]: "
-                   "Produce MessageSet with %i message(s) (%"PRIusz" bytes, "
-                   "ApiVersion %d, MsgVersion %d)",
-                   rktp->rktp_rkt->rkt_topic->str, rktp->rktp_partition,
-                   cnt, msetw->msetw_MessageSetSize,
-                   msetw->msetw_ApiVersion, msetw->msetw_MsgVersion);
+                   "ProduceRequest with %d MessageSet(s) for %"PRId32
+                   " topic(s) (%i message(s), ApiVersion %d)",
+                   rkbuf->rkbuf_u.Produce.batch_cnt,
+                   msetw->msetw_TopicArrayCnt,
+                   rd_kafka_msgq_len(&rkbuf->rkbuf_msgq),
+                   msetw->msetw_ApiVersion);
+
+        return rkbuf;
+}
+
+
+/**
+ * @brief Compress the messageset of RD_KAFKA_OP_COMPRESS op \p rko
+ *        and pass the op back to the broker thread.
+ *
+ *        \p codec is the compression thread's context.
+ *
+ * @locality compression thread
+ */
+void rd_kafka_msgset_compress_op_serve (rd_kafka_op_t *rko,
+                                        rd_kafka_codec_ctx_t *codec) {
+        rd_kafka_broker_t *rkb = rko->rko_u.compress.rkbuf->rkbuf_rkb;
+        rd_kafka_msgset_writer_t *msetw = rko->rko_u.compress.msetw;
+
+        /* On failure the messageset is sent uncompressed */
+        msetw->msetw_codec = codec;
+        rd_kafka_msgset_writer_compress(msetw, &rko->rko_u.compress.len);
+        msetw->msetw_codec = &rkb->rkb_codec;
+
+        rd_kafka_q_enq(rkb->rkb_ops, rko);
+}
+
+
+/**
+ * @brief Finalize the compressed messageset of RD_KAFKA_OP_COMPRESS op
+ *        \p rko.
+ *
+ * @returns the buffer to transmit, which is now owned by the caller.
+ *
+ * @locality broker thread
+ */
+rd_kafka_buf_t *
+rd_kafka_msgset_compress_op_finalize (rd_kafka_op_t *rko) {
+        rd_kafka_buf_t *rkbuf = rko->rko_u.compress.rkbuf;
+
+        rd_kafka_msgset_writer_finalize0(rko->rko_u.compress.msetw,
+                                         rko->rko_u.compress.len);
+
+        rko->rko_u.compress.rkbuf = NULL;
+        rd_free(rko->rko_u.compress.msetw);
+        rko->rko_u.compress.msetw = NULL;
 
         return rkbuf;
 }
 
 
 /**
- * @brief Create ProduceRequest containing as many messages from
- *        the toppar's transmit queue as possible, limited by configuration,
- *        size, etc.
+ * @brief Create a ProduceRequest containing as many messages from
+ *        the transmit queues of the partitions in \p rktps as possible,
+ *        limited by configuration, size, etc.
+ *
+ *        At most one MessageSet per partition is added to the request,
+ *        and only for partitions whose topic has the same RequiredAcks
+ *        and request timeout as the first partition in \p rktps.
+ *        Partitions with nothing more to send in this round
+ *        (drained, awaiting retry backoff, or handed off for compression)
+ *        are removed from \p rktps, so the caller may call this function
+ *        until \p rktps is empty.
+ *
+ *        MessageSets of topics compressed by the compression thread pool
+ *        are sent in single-partition requests, see \p rko_compressp.
  *
  * @param rkb broker to create buffer for
- * @param rktp toppar to transmit messages for
- * @param MessagetSetSizep will be set to the final MessageSetSize
+ * @param rktps partitions to transmit messages for, preferably sorted
+ *              by topic since each run of partitions of the same topic
+ *              makes up one topic in the request.
+ * @param pid the Idempotent Producer's PID, or an invalid PID if the
+ *            idempotent producer is not enabled.
+ * @param rko_compressp if the compression thread pool is enabled and the
+ *                      first partition's topic is compressed,
+ *                      compression is offloaded: the buffer is returned
+ *                      unfinalized and \p *rko_compressp is set to the op
+ *                      to submit to the compression pool.
  *
- * @returns the buffer to transmit or NULL if there were no messages
- *          in messageset.
+ * @returns the buffer to transmit or NULL if no messages could be added.
  *
  * @locality broker thread
  */
 rd_kafka_buf_t *
 rd_kafka_msgset_create_ProduceRequest (rd_kafka_broker_t *rkb,
-                                       rd_kafka_toppar_t *rktp,
-                                       size_t *MessageSetSizep) {
+                                       rd_list_t *rktps,
+                                       const rd_kafka_pid_t pid,
+                                       rd_kafka_op_t **rko_compressp) {
 
         rd_kafka_msgset_writer_t msetw;
+        const rd_kafka_itopic_t *rkt0;
+        rd_kafka_buf_t *rkbuf;
+        rd_bool_t offload = rd_false;
+        rd_ts_t now = rd_clock();
+        int i = 0;
+
+        rd_assert(rd_list_cnt(rktps) > 0);
+
+        rkt0 = ((rd_kafka_toppar_t *)rd_list_elem(rktps, 0))->rktp_rkt;
+
+        rd_kafka_msgset_writer_init(&msetw, rkb, rktps, pid);
+
+        while (i < rd_list_cnt(rktps)) {
+                rd_kafka_toppar_t *rktp = rd_list_elem(rktps, i);
+                const rd_kafka_itopic_t *rkt = rktp->rktp_rkt;
+                rd_bool_t compress_pool = rkt->rkt_conf.compression_codec &&
+                        rkb->rkb_rk->rk_compress_pool;
+                int r;
+
+                if (rkt->rkt_conf.required_acks !=
+                    rkt0->rkt_conf.required_acks ||
+                    rkt->rkt_conf.request_timeout_ms !=
+                    rkt0->rkt_conf.request_timeout_ms ||
+                    (compress_pool &&
+                     msetw.msetw_rkbuf->rkbuf_u.Produce.batch_cnt > 0)) {
+                        /* Left for a subsequent request */
+                        i++;
+                        continue;
+                }
+
+                r = rd_kafka_msgset_writer_batch_init(&msetw, rktp, now);
+                if (r == 0) {
+                        /* Does not fit in this request */
+                        i++;
+                        continue;
+
+                } else if (r > 0) {
+                        rd_kafka_msgset_writer_write_msgq(
+                                &msetw, &rktp->rktp_xmit_msgq);
 
-        if (rd_kafka_msgset_writer_init(&msetw, rkb, rktp) == 0)
+                        offload = rd_kafka_msgset_writer_batch_finalize(
+                                &msetw, compress_pool);
+                }
+
+                if (r < 0 || offload ||
+                    rd_kafka_msgq_len(&rktp->rktp_xmit_msgq) == 0) {
+                        /* Nothing more to send for this partition
+                         * in this round. */
+                        rd_list_remove_elem(rktps, i);
+                        if (offload)
+                                break;
+                } else
+                        i++;
+        }
+
+        if (!(rkbuf = rd_kafka_msgset_writer_finalize(&msetw)))
                 return NULL;
 
-        rd_kafka_msgset_writer_write_msgq(&msetw, &rktp->rktp_xmit_msgq);
+        if (offload)
+                *rko_compressp = rd_kafka_msgset_writer_compress_op_new(
+                        &msetw, msetw.msetw_messages_len);
 
-        return rd_kafka_msgset_writer_finalize(&msetw, MessageSetSizep);
+        return rkbuf;
 }
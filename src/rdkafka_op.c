@@ -33,6 +33,8 @@
 #include "rdkafka_topic.h"
 #include "rdkafka_partition.h"
 #include "rdkafka_offset.h"
+#include "rdkafka_request.h"
+#include "rdunittest.h"
 
 /* Current number of rd_kafka_op_t */
 rd_atomic32_t rd_kafka_op_cnt;
@@ -78,6 +80,10 @@ const char *rd_kafka_op2str (rd_kafka_op_type_t type) {
                 [RD_KAFKA_OP_ALTERCONFIGS] = "REPLY:ALTERCONFIGS",
                 [RD_KAFKA_OP_DESCRIBECONFIGS] = "REPLY:DESCRIBECONFIGS",
                 [RD_KAFKA_OP_ADMIN_RESULT] = "REPLY:ADMIN_RESULT",
+                [RD_KAFKA_OP_FETCH_BATCH] = "REPLY:FETCH_BATCH",
+                [RD_KAFKA_OP_COMPRESS] = "REPLY:COMPRESS",
+                [RD_KAFKA_OP_GET_REBALANCE_PROTOCOL] =
+                "REPLY:GET_REBALANCE_PROTOCOL",
         };
 
         if (type & RD_KAFKA_OP_REPLY)
@@ -197,6 +203,10 @@ rd_kafka_op_t *rd_kafka_op_new0 (const char *source, rd_kafka_op_type_t type) {
                 [RD_KAFKA_OP_ALTERCONFIGS] = sizeof(rko->rko_u.admin_request),
                 [RD_KAFKA_OP_DESCRIBECONFIGS] = sizeof(rko->rko_u.admin_request),
                 [RD_KAFKA_OP_ADMIN_RESULT] = sizeof(rko->rko_u.admin_result),
+                [RD_KAFKA_OP_FETCH_BATCH] = sizeof(rko->rko_u.fetch_batch),
+                [RD_KAFKA_OP_COMPRESS] = sizeof(rko->rko_u.compress),
+                [RD_KAFKA_OP_GET_REBALANCE_PROTOCOL] =
+                sizeof(rko->rko_u.rebalance_protocol),
 	};
 	size_t tsize = op2size[type & ~RD_KAFKA_OP_FLAGMASK];
 
@@ -211,18 +221,207 @@ rd_kafka_op_t *rd_kafka_op_new0 (const char *source, rd_kafka_op_type_t type) {
 }
 
 
+/**
+ * @returns the allocation size of an RD_KAFKA_OP_FETCH op.
+ */
+#define RD_KAFKA_OP_FETCH_SIZE                                          \
+        (sizeof(rd_kafka_op_t) - sizeof(((rd_kafka_op_t *)0)->rko_u) +  \
+         sizeof(((rd_kafka_op_t *)0)->rko_u.fetch))
+
+
+/**
+ * @brief Initialize fetch op pool, keeping at most \p max_cnt ops.
+ */
+void rd_kafka_op_pool_init (rd_kafka_op_pool_t *rkopp, int max_cnt) {
+        memset(rkopp, 0, sizeof(*rkopp));
+        mtx_init(&rkopp->rkopp_lock, mtx_plain);
+        rd_atomic32_init(&rkopp->rkopp_cnt, 0);
+        rkopp->rkopp_max = max_cnt;
+        rd_atomic64_init(&rkopp->rkopp_c.alloc, 0);
+        rd_atomic64_init(&rkopp->rkopp_c.reuse, 0);
+        rd_atomic64_init(&rkopp->rkopp_c.ret, 0);
+        rd_atomic64_init(&rkopp->rkopp_c.refill, 0);
+}
+
+/**
+ * @brief Free all ops in the pool and destroy it.
+ *
+ * @remark All broker caches must have been destroyed prior to this call.
+ */
+void rd_kafka_op_pool_destroy (rd_kafka_op_pool_t *rkopp) {
+        rd_kafka_op_t *rko;
+
+        while ((rko = rkopp->rkopp_free)) {
+                rkopp->rkopp_free = TAILQ_NEXT(rko, rko_link);
+                rd_free(rko);
+        }
+
+        mtx_destroy(&rkopp->rkopp_lock);
+}
+
+/**
+ * @brief Free all ops in the broker's local cache.
+ *
+ * @locality broker thread
+ */
+void rd_kafka_op_cache_destroy (rd_kafka_op_pool_t *rkopp,
+                                rd_kafka_op_cache_t *rkopc) {
+        rd_kafka_op_t *rko;
+
+        while ((rko = rkopc->rkopc_head)) {
+                rkopc->rkopc_head = TAILQ_NEXT(rko, rko_link);
+                rd_free(rko);
+        }
+
+        rd_atomic32_sub(&rkopp->rkopp_cnt, rkopc->rkopc_cnt);
+        rkopc->rkopc_cnt = 0;
+}
+
+/**
+ * @brief Get a zeroed fetch op from the broker's local cache,
+ *        refilling the cache with all currently returned ops from the
+ *        pool when empty, or allocate a new one if the pool is empty too.
+ *
+ * @locality broker thread
+ */
+static rd_kafka_op_t *rd_kafka_op_pool_get (rd_kafka_op_pool_t *rkopp,
+                                            rd_kafka_op_cache_t *rkopc) {
+        rd_kafka_op_t *rko;
+
+        if (unlikely(!rkopc->rkopc_head) && rkopp->rkopp_max > 0) {
+                /* Reclaim all returned ops in one go */
+                mtx_lock(&rkopp->rkopp_lock);
+                rkopc->rkopc_head = rkopp->rkopp_free;
+                rkopc->rkopc_cnt  = rkopp->rkopp_free_cnt;
+                rkopp->rkopp_free = NULL;
+                rkopp->rkopp_free_cnt = 0;
+                mtx_unlock(&rkopp->rkopp_lock);
+
+                if (rkopc->rkopc_head)
+                        rd_atomic64_add(&rkopp->rkopp_c.refill, 1);
+        }
+
+        if (!(rko = rkopc->rkopc_head)) {
+                rd_atomic64_add(&rkopp->rkopp_c.alloc, 1);
+                return rd_calloc(1, RD_KAFKA_OP_FETCH_SIZE);
+        }
+
+        rkopc->rkopc_head = TAILQ_NEXT(rko, rko_link);
+        rkopc->rkopc_cnt--;
+        rd_atomic32_sub(&rkopp->rkopp_cnt, 1);
+        rd_atomic64_add(&rkopp->rkopp_c.reuse, 1);
+
+        memset(rko, 0, RD_KAFKA_OP_FETCH_SIZE);
+
+        return rko;
+}
+
+/**
+ * @brief Get a zeroed fetch op directly from the pool's returned ops,
+ *        or allocate a new one if the pool is empty.
+ *        Used by threads without a local cache, such as when unpacking
+ *        FETCH_BATCH ops on the application thread.
+ *
+ * @locality any thread
+ */
+static rd_kafka_op_t *rd_kafka_op_pool_get1 (rd_kafka_op_pool_t *rkopp) {
+        rd_kafka_op_t *rko = NULL;
+
+        if (rkopp->rkopp_max > 0) {
+                mtx_lock(&rkopp->rkopp_lock);
+                if ((rko = rkopp->rkopp_free)) {
+                        rkopp->rkopp_free = TAILQ_NEXT(rko, rko_link);
+                        rkopp->rkopp_free_cnt--;
+                }
+                mtx_unlock(&rkopp->rkopp_lock);
+        }
+
+        if (!rko) {
+                rd_atomic64_add(&rkopp->rkopp_c.alloc, 1);
+                return rd_calloc(1, RD_KAFKA_OP_FETCH_SIZE);
+        }
+
+        rd_atomic32_sub(&rkopp->rkopp_cnt, 1);
+        rd_atomic64_add(&rkopp->rkopp_c.reuse, 1);
+
+        memset(rko, 0, RD_KAFKA_OP_FETCH_SIZE);
+
+        return rko;
+}
+
+/**
+ * @brief Return a destroyed fetch op to the pool.
+ *
+ * @returns 1 if the op was pooled, or 0 if the pool is full (or disabled)
+ *          in which case the caller must free the op.
+ *
+ * @locality any thread
+ */
+static int rd_kafka_op_pool_put (rd_kafka_op_pool_t *rkopp,
+                                 rd_kafka_op_t *rko) {
+
+        if (rd_atomic32_get(&rkopp->rkopp_cnt) >= rkopp->rkopp_max)
+                return 0;
+
+        rd_atomic32_add(&rkopp->rkopp_cnt, 1);
+
+        mtx_lock(&rkopp->rkopp_lock);
+        TAILQ_NEXT(rko, rko_link) = rkopp->rkopp_free;
+        rkopp->rkopp_free = rko;
+        rkopp->rkopp_free_cnt++;
+        mtx_unlock(&rkopp->rkopp_lock);
+
+        rd_atomic64_add(&rkopp->rkopp_c.ret, 1);
+
+        return 1;
+}
+
+
 void rd_kafka_op_destroy (rd_kafka_op_t *rko) {
+        rd_kafka_op_pool_t *rkopp = NULL;
 
 	switch (rko->rko_type & ~RD_KAFKA_OP_FLAGMASK)
 	{
 	case RD_KAFKA_OP_FETCH:
+                if (rko->rko_rktp)
+                        rd_kafka_toppar_fetchq_bytes_add(
+                                rd_kafka_toppar_s2i(rko->rko_rktp),
+                                -(int64_t)rko->rko_len);
 		rd_kafka_msg_destroy(NULL, &rko->rko_u.fetch.rkm);
 		/* Decrease refcount on rkbuf to eventually rd_free shared buf*/
 		if (rko->rko_u.fetch.rkbuf)
 			rd_kafka_buf_handle_op(rko, RD_KAFKA_RESP_ERR__DESTROY);
 
+                /* Plain fetch ops are returned to the instance's pool */
+                if (rko->rko_type == RD_KAFKA_OP_FETCH && rko->rko_rktp)
+                        rkopp = &rd_kafka_toppar_s2i(rko->rko_rktp)->
+                                rktp_rkt->rkt_rk->rk_fetch_op_pool;
 		break;
 
+        case RD_KAFKA_OP_FETCH_BATCH:
+                /* Release the prefetch accounting of messages that
+                 * were never unpacked. */
+                if (rd_kafka_op_fetch_batch_remains(rko) > 1)
+                        rd_atomic32_sub(&rd_kafka_toppar_s2i(rko->rko_rktp)->
+                                        rktp_fetchq_batch_cnt,
+                                        rd_kafka_op_fetch_batch_remains(rko)-1);
+                rd_kafka_toppar_fetchq_bytes_add(
+                        rd_kafka_toppar_s2i(rko->rko_rktp),
+                        -(int64_t)rko->rko_len);
+                RD_IF_FREE(rko->rko_u.fetch_batch.views, rd_free);
+                if (rko->rko_u.fetch_batch.rkbuf)
+                        rd_kafka_buf_destroy(rko->rko_u.fetch_batch.rkbuf);
+                break;
+
+        case RD_KAFKA_OP_COMPRESS:
+                /* Only reached if the op was never handed back to
+                 * the broker thread. */
+                if (rko->rko_u.compress.rkbuf)
+                        rd_kafka_ProduceRequest_compress_fail(
+                                rko, RD_KAFKA_RESP_ERR__DESTROY);
+                RD_IF_FREE(rko->rko_u.compress.msetw, rd_free);
+                break;
+
 	case RD_KAFKA_OP_OFFSET_FETCH:
 		if (rko->rko_u.offset_fetch.partitions &&
 		    rko->rko_u.offset_fetch.do_free)
@@ -339,6 +538,9 @@ void rd_kafka_op_destroy (rd_kafka_op_t *rko) {
                 rd_kafka_assert(NULL, !*"rd_kafka_op_cnt < 0");
 #endif
 
+        if (rkopp && rd_kafka_op_pool_put(rkopp, rko))
+                return;
+
 	rd_free(rko);
 }
 
@@ -526,28 +728,28 @@ rd_kafka_op_res_t rd_kafka_op_call (rd_kafka_t *rk, rd_kafka_q_t *rkq,
 
 
 /**
- * @brief Creates a new RD_KAFKA_OP_FETCH op and sets up the
- *        embedded message according to the parameters.
+ * @brief Set up a zeroed RD_KAFKA_OP_FETCH op and its embedded message.
  *
- * @param rkmp will be set to the embedded rkm in the rko (for convenience)
- * @param offset may be updated later if relative offset.
+ * @returns the embedded rkm.
  */
-rd_kafka_op_t *
-rd_kafka_op_new_fetch_msg (rd_kafka_msg_t **rkmp,
-                           rd_kafka_toppar_t *rktp,
-                           int32_t version,
-                           rd_kafka_buf_t *rkbuf,
-                           int64_t offset,
-                           size_t key_len, const void *key,
-                           size_t val_len, const void *val) {
+static rd_kafka_msg_t *
+rd_kafka_op_fetch_msg_init (rd_kafka_op_t *rko,
+                            rd_kafka_toppar_t *rktp,
+                            int32_t version,
+                            rd_kafka_buf_t *rkbuf,
+                            int64_t offset,
+                            size_t key_len, const void *key,
+                            size_t val_len, const void *val) {
         rd_kafka_msg_t *rkm;
-        rd_kafka_op_t *rko;
 
-        rko = rd_kafka_op_new(RD_KAFKA_OP_FETCH);
+        rko->rko_type    = RD_KAFKA_OP_FETCH;
+#if ENABLE_DEVEL
+        rko->rko_source  = __FUNCTION__;
+        rd_atomic32_add(&rd_kafka_op_cnt, 1);
+#endif
         rko->rko_rktp    = rd_kafka_toppar_keep(rktp);
         rko->rko_version = version;
         rkm   = &rko->rko_u.fetch.rkm;
-        *rkmp = rkm;
 
         /* Since all the ops share the same payload buffer
          * a refcnt is used on the rkbuf that makes sure all
@@ -568,10 +770,175 @@ rd_kafka_op_new_fetch_msg (rd_kafka_msg_t **rkmp,
 
         rkm->rkm_partition = rktp->rktp_partition;
 
+        return rkm;
+}
+
+
+/**
+ * @brief Creates a new RD_KAFKA_OP_FETCH op and sets up the
+ *        embedded message according to the parameters.
+ *
+ * @param rkmp will be set to the embedded rkm in the rko (for convenience)
+ * @param rkopc the op is taken from this thread-local fetch op cache,
+ *              typically the broker's rkb_fetch_op_cache.
+ * @param offset may be updated later if relative offset.
+ *
+ * @locality broker thread or decompression thread (owner of \p rkopc)
+ */
+rd_kafka_op_t *
+rd_kafka_op_new_fetch_msg (rd_kafka_msg_t **rkmp,
+                           rd_kafka_op_cache_t *rkopc,
+                           rd_kafka_toppar_t *rktp,
+                           int32_t version,
+                           rd_kafka_buf_t *rkbuf,
+                           int64_t offset,
+                           size_t key_len, const void *key,
+                           size_t val_len, const void *val) {
+        rd_kafka_op_t *rko;
+
+        rko = rd_kafka_op_pool_get(&rktp->rktp_rkt->rkt_rk->rk_fetch_op_pool,
+                                   rkopc);
+        *rkmp = rd_kafka_op_fetch_msg_init(rko, rktp, version, rkbuf, offset,
+                                           key_len, key, val_len, val);
+        rd_kafka_toppar_fetchq_bytes_add(rktp, rko->rko_len);
+
+        return rko;
+}
+
+
+/**
+ * @brief Creates a new, empty, RD_KAFKA_OP_FETCH_BATCH op holding a
+ *        reference to the shared payload buffer \p rkbuf.
+ *        Messages are added with rd_kafka_op_fetch_batch_add().
+ *
+ * @locality broker thread
+ */
+rd_kafka_op_t *rd_kafka_op_new_fetch_batch (rd_kafka_toppar_t *rktp,
+                                            int32_t version,
+                                            rd_kafka_buf_t *rkbuf) {
+        rd_kafka_op_t *rko;
+
+        rko = rd_kafka_op_new(RD_KAFKA_OP_FETCH_BATCH);
+        rko->rko_rktp    = rd_kafka_toppar_keep(rktp);
+        rko->rko_version = version;
+
+        rko->rko_u.fetch_batch.rkbuf = rkbuf;
+        rd_kafka_buf_keep(rkbuf);
+
+        return rko;
+}
+
+
+/**
+ * @brief Add a message view to FETCH_BATCH op \p rko.
+ *
+ * Every message beyond the first is accounted for in the partition's
+ * rktp_fetchq_batch_cnt since the batch only counts as one op
+ * in the fetch queue's length.
+ *
+ * @returns the new view for the caller to set up headers and timestamp on.
+ *
+ * @locality broker thread
+ */
+rd_kafka_msg_view_t *rd_kafka_op_fetch_batch_add (rd_kafka_op_t *rko,
+                                                  int64_t offset,
+                                                  size_t key_len,
+                                                  const void *key,
+                                                  size_t val_len,
+                                                  const void *val) {
+        rd_kafka_msg_view_t *view;
+
+        if (rko->rko_u.fetch_batch.cnt == rko->rko_u.fetch_batch.size) {
+                rko->rko_u.fetch_batch.size =
+                        RD_MAX(16, rko->rko_u.fetch_batch.size * 2);
+                rko->rko_u.fetch_batch.views =
+                        rd_realloc(rko->rko_u.fetch_batch.views,
+                                   sizeof(*view) *
+                                   rko->rko_u.fetch_batch.size);
+        }
+
+        if (rko->rko_u.fetch_batch.cnt > 0)
+                rd_atomic32_add(&rd_kafka_toppar_s2i(rko->rko_rktp)->
+                                rktp_fetchq_batch_cnt, 1);
+
+        view = &rko->rko_u.fetch_batch.views[rko->rko_u.fetch_batch.cnt++];
+        memset(view, 0, sizeof(*view));
+        view->offset  = offset;
+        view->key     = key;
+        view->key_len = key_len;
+        view->val     = val;
+        view->val_len = val_len;
+
+        rko->rko_len += (int32_t)val_len;
+        rd_kafka_toppar_fetchq_bytes_add(rd_kafka_toppar_s2i(rko->rko_rktp),
+                                         (int64_t)val_len);
+
+        return view;
+}
+
+
+/**
+ * @brief Unpack the next message of FETCH_BATCH op \p rko_batch into
+ *        a standalone RD_KAFKA_OP_FETCH op.
+ *
+ * The batch's rko_len is reduced by the returned op's rko_len, the caller
+ * must adjust the size of the queue the batch is on accordingly.
+ * The message's prefetch byte accounting moves along with it.
+ *
+ * @returns the new FETCH op, or NULL if all messages have been unpacked.
+ *
+ * @locality application thread
+ */
+rd_kafka_op_t *rd_kafka_op_fetch_batch_next (rd_kafka_op_t *rko_batch) {
+        rd_kafka_toppar_t *rktp = rd_kafka_toppar_s2i(rko_batch->rko_rktp);
+        const rd_kafka_msg_view_t *view;
+        rd_kafka_msg_t *rkm;
+        rd_kafka_op_t *rko;
+
+        if (rd_kafka_op_fetch_batch_remains(rko_batch) == 0)
+                return NULL;
+
+        if (rd_kafka_op_fetch_batch_remains(rko_batch) > 1)
+                rd_atomic32_sub(&rktp->rktp_fetchq_batch_cnt, 1);
+
+        view = &rko_batch->rko_u.fetch_batch.views[
+                rko_batch->rko_u.fetch_batch.next++];
+
+        rko = rd_kafka_op_pool_get1(&rktp->rktp_rkt->rkt_rk->
+                                    rk_fetch_op_pool);
+        rkm = rd_kafka_op_fetch_msg_init(rko, rktp, rko_batch->rko_version,
+                                         rko_batch->rko_u.fetch_batch.rkbuf,
+                                         view->offset,
+                                         view->key_len, view->key,
+                                         view->val_len, view->val);
+
+        rkm->rkm_u.consumer.binhdrs.len  = view->hdrs_len;
+        rkm->rkm_u.consumer.binhdrs.data = view->hdrs;
+        rkm->rkm_tstype    = view->tstype;
+        rkm->rkm_timestamp = view->timestamp;
+
+        /* Serve the message like the batch would have been served */
+        rko->rko_serve        = rko_batch->rko_serve;
+        rko->rko_serve_opaque = rko_batch->rko_serve_opaque;
+
+        rko_batch->rko_len -= rko->rko_len;
+
         return rko;
 }
 
 
+/**
+ * @returns the offset of the last message in FETCH_BATCH op \p rko,
+ *          or -1 if the batch is empty.
+ */
+int64_t rd_kafka_op_fetch_batch_last_offset (const rd_kafka_op_t *rko) {
+        if (rko->rko_u.fetch_batch.cnt == 0)
+                return -1;
+        return rko->rko_u.fetch_batch.views[rko->rko_u.fetch_batch.cnt-1].
+                offset;
+}
+
+
 /**
  * Enqueue ERR__THROTTLE op, if desired.
  */
@@ -689,3 +1056,211 @@ void rd_kafka_op_offset_store (rd_kafka_t *rk, rd_kafka_op_t *rko,
 		rd_kafka_offset_store0(rktp, rkmessage->offset+1, 0/*no lock*/);
 	rd_kafka_toppar_unlock(rktp);
 }
+
+
+
+/**
+ * @brief Verify fetch op pool accounting, capping and batched refills.
+ */
+int unittest_op_pool (void) {
+        rd_kafka_op_pool_t rkopp;
+        rd_kafka_op_cache_t rkopc = RD_ZERO_INIT;
+        rd_kafka_op_t *rkos[5];
+        int i;
+
+        rd_kafka_op_pool_init(&rkopp, 3);
+
+        for (i = 0 ; i < 5 ; i++) {
+                rkos[i] = rd_kafka_op_pool_get(&rkopp, &rkopc);
+                rkos[i]->rko_len = i + 1;
+        }
+
+        RD_UT_ASSERT(rd_atomic64_get(&rkopp.rkopp_c.alloc) == 5,
+                     "expected 5 heap allocations, not %"PRId64,
+                     rd_atomic64_get(&rkopp.rkopp_c.alloc));
+
+        /* Only the first three fit in the pool */
+        for (i = 0 ; i < 5 ; i++) {
+                int pooled = rd_kafka_op_pool_put(&rkopp, rkos[i]);
+                RD_UT_ASSERT(pooled == (i < 3),
+                             "op #%d: expected pooled=%d, not %d",
+                             i, i < 3, pooled);
+                if (!pooled)
+                        rd_free(rkos[i]);
+        }
+
+        RD_UT_ASSERT(rd_atomic32_get(&rkopp.rkopp_cnt) == 3,
+                     "expected 3 pooled ops, not %"PRId32,
+                     rd_atomic32_get(&rkopp.rkopp_cnt));
+
+        /* First get reclaims all returned ops into the cache */
+        rkos[0] = rd_kafka_op_pool_get(&rkopp, &rkopc);
+        RD_UT_ASSERT(rd_atomic64_get(&rkopp.rkopp_c.refill) == 1,
+                     "expected 1 refill, not %"PRId64,
+                     rd_atomic64_get(&rkopp.rkopp_c.refill));
+        RD_UT_ASSERT(rkopc.rkopc_cnt == 2 && rkopp.rkopp_free_cnt == 0,
+                     "expected 2 cached and 0 free ops, not %d and %d",
+                     rkopc.rkopc_cnt, rkopp.rkopp_free_cnt);
+        RD_UT_ASSERT(rkos[0]->rko_len == 0, "reused op not cleared");
+        RD_UT_ASSERT(rd_atomic64_get(&rkopp.rkopp_c.reuse) == 1,
+                     "expected 1 reuse, not %"PRId64,
+                     rd_atomic64_get(&rkopp.rkopp_c.reuse));
+
+        rd_free(rkos[0]);
+
+        rd_kafka_op_cache_destroy(&rkopp, &rkopc);
+        RD_UT_ASSERT(rd_atomic32_get(&rkopp.rkopp_cnt) == 0,
+                     "expected 0 pooled ops after cache destroy, not %"PRId32,
+                     rd_atomic32_get(&rkopp.rkopp_cnt));
+
+        rd_kafka_op_pool_destroy(&rkopp);
+
+        RD_UT_PASS();
+}
+
+
+static rd_kafka_op_res_t
+ut_fetch_batch_serve_cb (rd_kafka_t *rk, rd_kafka_q_t *rkq,
+                         rd_kafka_op_t *rko,
+                         rd_kafka_q_cb_type_t cb_type, void *opaque) {
+        int *cntp = opaque;
+
+        if (rko->rko_type == RD_KAFKA_OP_FETCH)
+                (*cntp)++;
+        rd_kafka_op_destroy(rko);
+        return RD_KAFKA_OP_RES_HANDLED;
+}
+
+
+/**
+ * @brief Verify FETCH_BATCH op unpacking and prefetch accounting.
+ */
+int unittest_fetch_batch (void) {
+        /* Enable prefetch byte accounting */
+        static const char *confv[] = {
+                "queued.max.total.kbytes", "1", NULL
+        };
+        rd_kafka_t *rk;
+        shptr_rd_kafka_toppar_t *s_rktp;
+        rd_kafka_toppar_t *rktp;
+        rd_kafka_buf_t *rkbuf = rd_kafka_buf_new0(0, 0, 0, NULL);
+        rd_kafka_op_t *rko_batch, *rko;
+        rd_kafka_msg_view_t *view;
+        static const char *vals[] = { "one", "three", "fifteen" };
+        rd_kafka_q_t *rkq;
+        int refcnt, served = 0;
+        int i, r;
+
+        rk = rd_unittest_rk_new(RD_KAFKA_CONSUMER, confv);
+        RD_UT_ASSERT(rk, "failed to create instance");
+        s_rktp = rd_kafka_toppar_get2(rk, "ut_fetch_batch", 3, 0, 1);
+        rktp = rd_kafka_toppar_s2i(s_rktp);
+        refcnt = rd_refcnt_get(&rktp->rktp_refcnt);
+
+        rko_batch = rd_kafka_op_new_fetch_batch(rktp, 7, rkbuf);
+        for (i = 0 ; i < 3 ; i++) {
+                view = rd_kafka_op_fetch_batch_add(rko_batch, 100 + i,
+                                                   0, NULL,
+                                                   strlen(vals[i]), vals[i]);
+                view->tstype    = RD_KAFKA_TIMESTAMP_CREATE_TIME;
+                view->timestamp = 1000 + i;
+        }
+
+        RD_UT_ASSERT(rko_batch->rko_len == 3+5+7,
+                     "expected batch len 15, not %"PRId32, rko_batch->rko_len);
+        RD_UT_ASSERT(rd_atomic32_get(&rktp->rktp_fetchq_batch_cnt) == 2,
+                     "expected 2 batched messages, not %"PRId32,
+                     rd_atomic32_get(&rktp->rktp_fetchq_batch_cnt));
+        RD_UT_ASSERT(rd_atomic64_get(&rktp->rktp_fetchq_bytes) == 15 &&
+                     rd_atomic64_get(&rk->rk_fetchq_bytes) == 15,
+                     "expected 15 held bytes, not %"PRId64"/%"PRId64,
+                     rd_atomic64_get(&rktp->rktp_fetchq_bytes),
+                     rd_atomic64_get(&rk->rk_fetchq_bytes));
+        RD_UT_ASSERT(rd_kafka_op_fetch_batch_last_offset(rko_batch) == 102,
+                     "expected last offset 102, not %"PRId64,
+                     rd_kafka_op_fetch_batch_last_offset(rko_batch));
+
+        rko = rd_kafka_op_fetch_batch_next(rko_batch);
+        RD_UT_ASSERT(rko && rko->rko_type == RD_KAFKA_OP_FETCH,
+                     "expected FETCH op");
+        RD_UT_ASSERT(rko->rko_version == 7 &&
+                     rko->rko_u.fetch.rkm.rkm_offset == 100 &&
+                     rko->rko_u.fetch.rkm.rkm_timestamp == 1000 &&
+                     rko->rko_u.fetch.rkm.rkm_partition == 3 &&
+                     rko->rko_u.fetch.rkm.rkm_len == 3 &&
+                     !memcmp(rko->rko_u.fetch.rkm.rkm_payload, "one", 3),
+                     "unpacked message mismatch");
+        RD_UT_ASSERT(rko_batch->rko_len == 5+7,
+                     "expected batch len 12, not %"PRId32, rko_batch->rko_len);
+        RD_UT_ASSERT(rd_atomic32_get(&rktp->rktp_fetchq_batch_cnt) == 1,
+                     "expected 1 batched message, not %"PRId32,
+                     rd_atomic32_get(&rktp->rktp_fetchq_batch_cnt));
+        RD_UT_ASSERT(rd_kafka_op_fetch_batch_remains(rko_batch) == 2,
+                     "expected 2 remaining messages, not %d",
+                     rd_kafka_op_fetch_batch_remains(rko_batch));
+        /* Unpacking moves the accounting, destroying releases it. */
+        RD_UT_ASSERT(rd_atomic64_get(&rktp->rktp_fetchq_bytes) == 15,
+                     "expected 15 held bytes, not %"PRId64,
+                     rd_atomic64_get(&rktp->rktp_fetchq_bytes));
+        rd_kafka_op_destroy(rko);
+        RD_UT_ASSERT(rd_atomic64_get(&rktp->rktp_fetchq_bytes) == 12 &&
+                     rd_atomic64_get(&rk->rk_fetchq_bytes) == 12,
+                     "expected 12 held bytes, not %"PRId64"/%"PRId64,
+                     rd_atomic64_get(&rktp->rktp_fetchq_bytes),
+                     rd_atomic64_get(&rk->rk_fetchq_bytes));
+
+        /* Destroying the batch releases the accounting of
+         * the messages not yet unpacked. */
+        rd_kafka_op_destroy(rko_batch);
+        RD_UT_ASSERT(rd_atomic32_get(&rktp->rktp_fetchq_batch_cnt) == 0,
+                     "expected 0 batched messages, not %"PRId32,
+                     rd_atomic32_get(&rktp->rktp_fetchq_batch_cnt));
+        RD_UT_ASSERT(rd_atomic64_get(&rktp->rktp_fetchq_bytes) == 0 &&
+                     rd_atomic64_get(&rk->rk_fetchq_bytes) == 0,
+                     "expected 0 held bytes, not %"PRId64"/%"PRId64,
+                     rd_atomic64_get(&rktp->rktp_fetchq_bytes),
+                     rd_atomic64_get(&rk->rk_fetchq_bytes));
+        RD_UT_ASSERT(rd_refcnt_get(&rkbuf->rkbuf_refcnt) == 1,
+                     "expected rkbuf refcnt 1, not %d",
+                     rd_refcnt_get(&rkbuf->rkbuf_refcnt));
+        /* rd_kafka_q_serve() max_cnt counts the messages of a batch,
+         * not the batch op (consume.callback.max.messages). */
+        rkq = rd_kafka_q_new(rk);
+        rko_batch = rd_kafka_op_new_fetch_batch(rktp, 7, rkbuf);
+        for (i = 0 ; i < 5 ; i++)
+                rd_kafka_op_fetch_batch_add(rko_batch, 200 + i, 0, NULL,
+                                            strlen(vals[0]), vals[0]);
+        rd_kafka_q_enq(rkq, rko_batch);
+        rd_kafka_q_enq(rkq, rd_kafka_op_new(RD_KAFKA_OP_NONE));
+
+        r = rd_kafka_q_serve(rkq, 0, 2, RD_KAFKA_Q_CB_CALLBACK,
+                             ut_fetch_batch_serve_cb, &served);
+        RD_UT_ASSERT(r == 2 && served == 2,
+                     "expected 2 messages served, not %d (%d)", r, served);
+        RD_UT_ASSERT(rd_kafka_q_len(rkq) == 2 &&
+                     rd_kafka_op_fetch_batch_remains(
+                             TAILQ_FIRST(&rkq->rkq_q)) == 3,
+                     "expected the partially served batch to be put back "
+                     "first, with 3 remaining messages");
+        RD_UT_ASSERT(rd_kafka_q_size(rkq) == 3 * 3,
+                     "expected queue size 9, not %"PRIu64,
+                     rd_kafka_q_size(rkq));
+
+        r = rd_kafka_q_serve(rkq, 0, 0, RD_KAFKA_Q_CB_CALLBACK,
+                             ut_fetch_batch_serve_cb, &served);
+        RD_UT_ASSERT(r == 4 && served == 5,
+                     "expected the remaining 3 messages and 1 op served, "
+                     "not %d (%d messages in total)", r, served);
+        RD_UT_ASSERT(rd_kafka_q_len(rkq) == 0, "expected empty queue");
+        rd_kafka_q_destroy_owner(rkq);
+
+        RD_UT_ASSERT(rd_refcnt_get(&rktp->rktp_refcnt) == refcnt,
+                     "expected rktp refcnt %d, not %d",
+                     refcnt, rd_refcnt_get(&rktp->rktp_refcnt));
+
+        rd_kafka_buf_destroy(rkbuf);
+        rd_kafka_toppar_destroy(s_rktp);
+        rd_kafka_destroy(rk);
+
+        RD_UT_PASS();
+}
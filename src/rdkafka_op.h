@@ -68,6 +68,8 @@ typedef struct rd_kafka_replyq_s {
 #define RD_KAFKA_OP_F_BLOCKING    0x10 /* rkbuf: blocking protocol request */
 #define RD_KAFKA_OP_F_REPROCESS   0x20 /* cgrp: Reprocess at a later time. */
 #define RD_KAFKA_OP_F_SENT        0x80 /* rkbuf: request sent on wire */
+#define RD_KAFKA_OP_F_ZEROCOPY    0x100 /* rkbuf: may be sent with
+                                        *        MSG_ZEROCOPY */
 
 
 typedef enum {
@@ -118,6 +120,15 @@ typedef enum {
         RD_KAFKA_OP_ALTERCONFIGS,    /**< Admin: AlterConfigs: u.admin_request*/
         RD_KAFKA_OP_DESCRIBECONFIGS, /**< Admin: DescribeConfigs: u.admin_request*/
         RD_KAFKA_OP_ADMIN_RESULT,    /**< Admin API .._result_t */
+        RD_KAFKA_OP_FETCH_BATCH,     /**< Kafka thread -> Application:
+                                      *   all messages of a MessageSet v2:
+                                      *   u.fetch_batch */
+        RD_KAFKA_OP_COMPRESS,        /**< Broker thread -> compression thread
+                                      *   -> broker thread: compress
+                                      *   ProduceRequest MessageSet:
+                                      *   u.compress */
+        RD_KAFKA_OP_GET_REBALANCE_PROTOCOL, /**< Get group rebalance protocol:
+                                             *   u.rebalance_protocol */
         RD_KAFKA_OP__END
 } rd_kafka_op_type_t;
 
@@ -200,6 +211,24 @@ struct rd_kafka_admin_worker_cbs;
 #define RD_KAFKA_OP_TYPE_ASSERT(rko,type) \
 	rd_kafka_assert(NULL, (rko)->rko_type == (type) && # type)
 
+/**
+ * @brief Lightweight view of a fetched message in a FETCH_BATCH op,
+ *        pointing into the batch's shared rkbuf payload.
+ *        Views are unpacked into proper FETCH ops as they are consumed.
+ */
+typedef struct rd_kafka_msg_view_s {
+        int64_t     offset;
+        int64_t     timestamp;
+        rd_kafka_timestamp_type_t tstype;
+        int32_t     hdrs_len;     /**< Unparsed headers length */
+        const void *hdrs;         /**< Unparsed headers */
+        const void *key;
+        size_t      key_len;
+        const void *val;
+        size_t      val_len;
+} rd_kafka_msg_view_t;
+
+
 struct rd_kafka_op_s {
 	TAILQ_ENTRY(rd_kafka_op_s) rko_link;
 
@@ -245,6 +274,15 @@ struct rd_kafka_op_s {
 			int evidx;
 		} fetch;
 
+                /* RD_KAFKA_OP_FETCH_BATCH */
+                struct {
+                        rd_kafka_buf_t *rkbuf;   /**< Shared payload buffer */
+                        rd_kafka_msg_view_t *views; /**< Message views */
+                        int cnt;                 /**< Number of views */
+                        int size;                /**< Allocated views */
+                        int next;                /**< Next view to unpack */
+                } fetch_batch;
+
 		struct {
 			rd_kafka_topic_partition_list_t *partitions;
 			int do_free; /* free .partitions on destroy() */
@@ -269,8 +307,18 @@ struct rd_kafka_op_s {
 
 		struct {
 			rd_kafka_topic_partition_list_t *partitions;
+                        /** How to apply the partitions */
+                        enum {
+                                RD_KAFKA_ASSIGN_METHOD_ASSIGN,
+                                RD_KAFKA_ASSIGN_METHOD_INCR_ASSIGN,
+                                RD_KAFKA_ASSIGN_METHOD_INCR_UNASSIGN
+                        } method;
 		} assign; /* also used for GET_ASSIGNMENT */
 
+                struct {
+                        const char *str; /**< Static protocol name */
+                } rebalance_protocol;
+
 		struct {
 			rd_kafka_topic_partition_list_t *partitions;
 		} rebalance;
@@ -300,6 +348,16 @@ struct rd_kafka_op_s {
 			rd_kafka_buf_t *rkbuf;
 		} xbuf; /* XMIT_BUF and RECV_BUF */
 
+                /* RD_KAFKA_OP_COMPRESS */
+                struct {
+                        rd_kafka_buf_t *rkbuf;   /**< ProduceRequest buffer */
+                        struct rd_kafka_msgset_writer_s *msetw; /**< Writer
+                                                                 *   state */
+                        size_t len;              /**< Messages length,
+                                                  *   compressed length
+                                                  *   when done. */
+                } compress;
+
                 /* RD_KAFKA_OP_METADATA */
                 struct {
                         rd_kafka_metadata_t *md;
@@ -464,8 +522,62 @@ rd_kafka_op_res_t rd_kafka_op_call (rd_kafka_t *rk,
                                     rd_kafka_q_t *rkq, rd_kafka_op_t *rko)
         RD_WARN_UNUSED_RESULT;
 
+
+/**
+ * @brief Pool of recycled RD_KAFKA_OP_FETCH ops (one per rd_kafka_t).
+ *
+ * Fetch ops are created by the broker threads, one per consumed message,
+ * but are typically destroyed by the application thread.
+ * Instead of freeing them they are returned to the pool from where
+ * the broker threads reclaim them in batches into their own
+ * (lock-less) rd_kafka_op_cache_t.
+ */
+typedef struct rd_kafka_op_pool_s {
+        mtx_t          rkopp_lock;     /**< Protects rkopp_free* */
+        rd_kafka_op_t *rkopp_free;     /**< Returned ops, linked through
+                                        *   rko_link.tqe_next.
+                                        *   Locks: rkopp_lock */
+        int            rkopp_free_cnt; /**< Number of ops in rkopp_free.
+                                        *   Locks: rkopp_lock */
+        rd_atomic32_t  rkopp_cnt;      /**< Total number of pooled ops,
+                                        *   including broker caches. */
+        int            rkopp_max;      /**< Max number of pooled ops,
+                                        *   0 disables pooling. */
+        struct {
+                rd_atomic64_t alloc;   /**< Ops allocated from the heap */
+                rd_atomic64_t reuse;   /**< Ops served from the pool */
+                rd_atomic64_t ret;     /**< Ops returned to the pool */
+                rd_atomic64_t refill;  /**< Batch refills of broker caches */
+        } rkopp_c;
+} rd_kafka_op_pool_t;
+
+/**
+ * @brief Maximum number of pooled fetch ops: a few Fetch responses' worth
+ *        of messages. Ops beyond this are freed, so that the memory of
+ *        a consumption burst is not held for the lifetime of the instance.
+ */
+#define RD_KAFKA_OP_POOL_MAX_CNT  2048
+
+/**
+ * @brief Broker thread local cache of pooled fetch ops.
+ * @locality broker thread
+ */
+typedef struct rd_kafka_op_cache_s {
+        rd_kafka_op_t *rkopc_head;
+        int            rkopc_cnt;
+} rd_kafka_op_cache_t;
+
+void rd_kafka_op_pool_init (rd_kafka_op_pool_t *rkopp, int max_cnt);
+void rd_kafka_op_pool_destroy (rd_kafka_op_pool_t *rkopp);
+void rd_kafka_op_cache_destroy (rd_kafka_op_pool_t *rkopp,
+                                rd_kafka_op_cache_t *rkopc);
+
+int unittest_op_pool (void);
+int unittest_fetch_batch (void);
+
 rd_kafka_op_t *
 rd_kafka_op_new_fetch_msg (rd_kafka_msg_t **rkmp,
+                           rd_kafka_op_cache_t *rkopc,
                            rd_kafka_toppar_t *rktp,
                            int32_t version,
                            rd_kafka_buf_t *rkbuf,
@@ -473,6 +585,24 @@ rd_kafka_op_new_fetch_msg (rd_kafka_msg_t **rkmp,
                            size_t key_len, const void *key,
                            size_t val_len, const void *val);
 
+rd_kafka_op_t *rd_kafka_op_new_fetch_batch (rd_kafka_toppar_t *rktp,
+                                            int32_t version,
+                                            rd_kafka_buf_t *rkbuf);
+rd_kafka_msg_view_t *rd_kafka_op_fetch_batch_add (rd_kafka_op_t *rko,
+                                                  int64_t offset,
+                                                  size_t key_len,
+                                                  const void *key,
+                                                  size_t val_len,
+                                                  const void *val);
+rd_kafka_op_t *rd_kafka_op_fetch_batch_next (rd_kafka_op_t *rko);
+int64_t rd_kafka_op_fetch_batch_last_offset (const rd_kafka_op_t *rko);
+
+/**
+ * @returns the number of messages not yet unpacked from FETCH_BATCH \p rko.
+ */
+#define rd_kafka_op_fetch_batch_remains(rko)                            \
+        ((rko)->rko_u.fetch_batch.cnt - (rko)->rko_u.fetch_batch.next)
+
 void rd_kafka_op_throttle_time (struct rd_kafka_broker_s *rkb,
 				rd_kafka_q_t *rkq,
 				int throttle_time);
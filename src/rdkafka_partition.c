@@ -31,8 +31,10 @@
 #include "rdkafka_request.h"
 #include "rdkafka_offset.h"
 #include "rdkafka_partition.h"
+#include "rdkafka_decompress.h"
 #include "rdregex.h"
 #include "rdports.h"  /* rd_qsort_r() */
+#include "rdunittest.h"
 
 const char *rd_kafka_fetch_states[] = {
 	"none",
@@ -189,6 +191,7 @@ shptr_rd_kafka_toppar_t *rd_kafka_toppar_new0 (rd_kafka_itopic_t *rkt,
 	rktp->rktp_fetch_state = RD_KAFKA_TOPPAR_FETCH_NONE;
         rktp->rktp_fetch_msg_max_bytes
             = rkt->rkt_rk->rk_conf.fetch_msg_max_bytes;
+        rktp->rktp_fetch_adaptive_size = RD_KAFKA_FETCH_ADAPTIVE_MIN_SIZE;
 	rktp->rktp_offset_fp = NULL;
         rd_kafka_offset_stats_reset(&rktp->rktp_offsets);
         rd_kafka_offset_stats_reset(&rktp->rktp_offsets_fin);
@@ -202,12 +205,26 @@ shptr_rd_kafka_toppar_t *rd_kafka_toppar_new0 (rd_kafka_itopic_t *rkt,
         rktp->rktp_committing_offset = RD_KAFKA_OFFSET_INVALID;
         rktp->rktp_committed_offset = RD_KAFKA_OFFSET_INVALID;
 	rd_kafka_msgq_init(&rktp->rktp_msgq);
-        rktp->rktp_msgq_wakeup_fd = -1;
+        rktp->rktp_msgq_wakeup = NULL;
 	rd_kafka_msgq_init(&rktp->rktp_xmit_msgq);
+        rd_atomic32_init(&rktp->rktp_compress_cnt, 0);
+        rd_atomicptr_init(&rktp->rktp_msgq_intake, NULL);
+        rd_kafka_pid_reset(&rktp->rktp_eos.pid);
+        rd_atomic32_init(&rktp->rktp_msgs_inflight, 0);
 	mtx_init(&rktp->rktp_lock, mtx_plain);
 
         rd_refcnt_init(&rktp->rktp_refcnt, 0);
 	rktp->rktp_fetchq = rd_kafka_q_new(rkt->rkt_rk);
+        rd_atomic32_init(&rktp->rktp_fetchq_batch_cnt, 0);
+        rd_atomic64_init(&rktp->rktp_fetchq_bytes, 0);
+        mtx_init(&rktp->rktp_decomp_lock, mtx_plain);
+        TAILQ_INIT(&rktp->rktp_decomp_jobs);
+        rktp->rktp_decomp_fail_offset = RD_KAFKA_OFFSET_INVALID;
+        rd_atomic32_init(&rktp->rktp_decomp_msgcnt, 0);
+        rd_atomic64_init(&rktp->rktp_decomp_bytes, 0);
+        rd_atomic32_init(&rktp->rktp_lz4_ratio, 0);
+        rd_atomic32_init(&rktp->rktp_gzip_ratio, 0);
+        rd_atomic32_init(&rktp->rktp_gzip_recsize, 0);
         rktp->rktp_ops    = rd_kafka_q_new(rkt->rkt_rk);
         rktp->rktp_ops->rkq_serve = rd_kafka_toppar_op_serve;
         rktp->rktp_ops->rkq_opaque = rktp;
@@ -280,8 +297,11 @@ void rd_kafka_toppar_destroy_final (rd_kafka_toppar_t *rktp) {
 	/* Clear queues */
 	rd_kafka_assert(rktp->rktp_rkt->rkt_rk,
 			rd_kafka_msgq_len(&rktp->rktp_xmit_msgq) == 0);
+        rd_kafka_toppar_msgq_intake_drain(rktp);
 	rd_kafka_dr_msgq(rktp->rktp_rkt, &rktp->rktp_msgq,
 			 RD_KAFKA_RESP_ERR__DESTROY);
+        rd_atomicptr_destroy(&rktp->rktp_msgq_intake);
+        rd_dassert(TAILQ_EMPTY(&rktp->rktp_decomp_jobs));
 	rd_kafka_q_destroy_owner(rktp->rktp_fetchq);
         rd_kafka_q_destroy_owner(rktp->rktp_ops);
 
@@ -290,6 +310,7 @@ void rd_kafka_toppar_destroy_final (rd_kafka_toppar_t *rktp) {
 	rd_kafka_topic_destroy0(rktp->rktp_s_rkt);
 
 	mtx_destroy(&rktp->rktp_lock);
+        mtx_destroy(&rktp->rktp_decomp_lock);
 
         rd_refcnt_destroy(&rktp->rktp_refcnt);
 
@@ -634,14 +655,110 @@ void rd_kafka_toppar_desired_del (rd_kafka_toppar_t *rktp) {
 
 
 
+/**
+ * @brief Wake up the partition's leader broker thread through
+ *        rktp_msgq_wakeup, if set.
+ *
+ * The wake-up is coalesced with any wake-up of the broker thread that is
+ * already pending, in which case this is an atomic read only.
+ *
+ * @locks rktp_lock MUST be held (the wake-up belongs to the leader broker)
+ */
+static RD_INLINE void rd_kafka_toppar_msgq_wakeup (rd_kafka_toppar_t *rktp) {
+        if (rktp->rktp_msgq_wakeup)
+                rd_wakeup_signal(rktp->rktp_msgq_wakeup);
+}
+
+
+/**
+ * @brief Move all messages from the lock-free intake queue to the tail of
+ *        rktp_msgq, in the order they were enqueued, assigning their
+ *        msgseqs.
+ *
+ * Whoever holds rktp_lock is the single consumer of the intake queue.
+ *
+ * @returns the number of messages moved.
+ *
+ * @locks rktp_lock MUST be held
+ */
+int rd_kafka_toppar_msgq_intake_drain (rd_kafka_toppar_t *rktp) {
+        rd_kafka_msg_t *rkm, *next, *prev = NULL;
+        int cnt = 0;
+
+        if (!(rkm = rd_atomicptr_swap(&rktp->rktp_msgq_intake, NULL)))
+                return 0;
+
+        /* The intake queue is newest first: reverse it. */
+        while (rkm) {
+                next = TAILQ_NEXT(rkm, rkm_link);
+                TAILQ_NEXT(rkm, rkm_link) = prev;
+                prev = rkm;
+                rkm = next;
+        }
+
+        for (rkm = prev ; rkm ; rkm = next) {
+                next = TAILQ_NEXT(rkm, rkm_link);
+                rkm->rkm_u.producer.msgseq = ++rktp->rktp_msgseq;
+                rd_kafka_msgq_enq(&rktp->rktp_msgq, rkm);
+                cnt++;
+        }
+
+        return cnt;
+}
+
+
+/**
+ * @brief Add message to the lock-free intake queue.
+ *
+ * The intake queue is a singly linked list that producers push to
+ * with compare-and-swap, and that the consumer takes in its entirety
+ * with an atomic swap, so there is no ABA problem.
+ * The order of the successful CASes defines the FIFO order, and msgseqs
+ * are assigned in that order when the queue is drained.
+ *
+ * @locks none
+ */
+static void rd_kafka_toppar_msgq_intake_enq (rd_kafka_toppar_t *rktp,
+                                             rd_kafka_msg_t *rkm) {
+        rd_kafka_msg_t *head;
+
+        do {
+                head = rd_atomicptr_get(&rktp->rktp_msgq_intake);
+                TAILQ_NEXT(rkm, rkm_link) = head;
+        } while (!rd_atomicptr_cas(&rktp->rktp_msgq_intake, head, rkm));
+
+        /* Only wake up the broker thread when the intake queue
+         * goes from empty to non-empty. The partition lock is needed
+         * to access the leader's wake-up, but is thus only acquired
+         * once per drain rather than for each message. */
+        if (!head) {
+                rd_kafka_toppar_lock(rktp);
+                rd_kafka_toppar_msgq_wakeup(rktp);
+                rd_kafka_toppar_unlock(rktp);
+        }
+}
+
+
 /**
  * Append message at tail of 'rktp' message queue.
  */
 void rd_kafka_toppar_enq_msg (rd_kafka_toppar_t *rktp, rd_kafka_msg_t *rkm) {
-        int wakeup_fd, queue_len;
+        int queue_len;
+
+        if (rktp->rktp_rkt->rkt_rk->rk_conf.queue_buffering_lockfree &&
+            !rkm->rkm_u.producer.msgseq &&
+            rktp->rktp_partition != RD_KAFKA_PARTITION_UA &&
+            rktp->rktp_rkt->rkt_conf.queuing_strategy ==
+            RD_KAFKA_QUEUE_FIFO) {
+                rd_kafka_toppar_msgq_intake_enq(rktp, rkm);
+                return;
+        }
 
         rd_kafka_toppar_lock(rktp);
 
+        /* Messages on the intake queue precede this message. */
+        rd_kafka_toppar_msgq_intake_drain(rktp);
+
         if (!rkm->rkm_u.producer.msgseq &&
             rktp->rktp_partition != RD_KAFKA_PARTITION_UA)
                 rkm->rkm_u.producer.msgseq = ++rktp->rktp_msgseq;
@@ -655,22 +772,10 @@ void rd_kafka_toppar_enq_msg (rd_kafka_toppar_t *rktp, rd_kafka_msg_t *rkm) {
                                                      &rktp->rktp_msgq, rkm);
         }
 
-        wakeup_fd = rktp->rktp_msgq_wakeup_fd;
-        rd_kafka_toppar_unlock(rktp);
+        if (queue_len == 1)
+                rd_kafka_toppar_msgq_wakeup(rktp);
 
-        if (wakeup_fd != -1 && queue_len == 1) {
-                char one = 1;
-                int r;
-                r = rd_write(wakeup_fd, &one, sizeof(one));
-                if (r == -1)
-                        rd_kafka_log(rktp->rktp_rkt->rkt_rk, LOG_ERR, "PARTENQ",
-                                     "%s [%"PRId32"]: write to "
-                                     "wake-up fd %d failed: %s",
-                                     rktp->rktp_rkt->rkt_topic->str,
-                                     rktp->rktp_partition,
-                                     wakeup_fd,
-                                     rd_strerror(errno));
-        }
+        rd_kafka_toppar_unlock(rktp);
 }
 
 
@@ -1813,6 +1918,75 @@ static void rd_kafka_toppar_pause_resume (rd_kafka_toppar_t *rktp,
 
 
 
+/**
+ * @brief Adapt the partition's fetch size to the Fetch response just
+ *        received for it (with queued.max.total.kbytes set).
+ *
+ * The fetch size is doubled (up to fetch.message.max.bytes) if the
+ * response was at least half full, the partition is still lagging and
+ * the application has consumed most of what was previously fetched.
+ * It is halved (down to RD_KAFKA_FETCH_ADAPTIVE_MIN_SIZE) if the
+ * response was less than a quarter full, e.g., for idle partitions.
+ *
+ * @locality broker thread
+ */
+void rd_kafka_toppar_fetch_adapt (rd_kafka_toppar_t *rktp,
+                                  int32_t MessageSetSize,
+                                  int64_t HighwaterMarkOffset) {
+        int32_t size = rktp->rktp_fetch_adaptive_size;
+        int32_t min_size = RD_MIN(RD_KAFKA_FETCH_ADAPTIVE_MIN_SIZE,
+                                  rktp->rktp_fetch_msg_max_bytes);
+
+        if (MessageSetSize >= size / 2 &&
+            HighwaterMarkOffset > rktp->rktp_offsets.fetch_offset &&
+            rd_atomic64_get(&rktp->rktp_fetchq_bytes) < (int64_t)size / 2) {
+                if (size >= rktp->rktp_fetch_msg_max_bytes)
+                        return;
+                size = RD_MIN(size * 2, rktp->rktp_fetch_msg_max_bytes);
+
+        } else if (MessageSetSize < size / 4) {
+                if (size <= min_size)
+                        return;
+                size = RD_MAX(size / 2, min_size);
+
+        } else
+                return;
+
+        rd_kafka_dbg(rktp->rktp_rkt->rkt_rk, FETCH, "FETCHADAPT",
+                     "Topic %s [%"PRId32"]: adaptive fetch size %"PRId32
+                     " -> %"PRId32" (MessageSetSize %"PRId32", "
+                     "%"PRId64" bytes queued)",
+                     rktp->rktp_rkt->rkt_topic->str,
+                     rktp->rktp_partition,
+                     rktp->rktp_fetch_adaptive_size, size,
+                     MessageSetSize,
+                     rd_atomic64_get(&rktp->rktp_fetchq_bytes));
+
+        rktp->rktp_fetch_adaptive_size = size;
+}
+
+
+/**
+ * @brief Wake up the partition's leader broker thread to re-evaluate
+ *        fetching after the application released prefetched messages,
+ *        see rd_kafka_toppar_fetchq_bytes_add().
+ *
+ * The leader is read without the toppar lock since this may be called
+ * from op destructors with the lock held (e.g., fetchq purges).
+ * Brokers are only freed on termination, so the broker is valid
+ * even if leadership changes concurrently.
+ *
+ * @locality any
+ * @locks none
+ */
+void rd_kafka_toppar_fetchq_bytes_wakeup (rd_kafka_toppar_t *rktp) {
+        rd_kafka_broker_t *rkb = rktp->rktp_leader;
+
+        if (rkb)
+                rd_kafka_broker_wakeup(rkb);
+}
+
+
 /**
  * @brief Decide whether this toppar should be on the fetch list or not.
  *
@@ -1886,6 +2060,10 @@ rd_ts_t rd_kafka_toppar_fetch_decide (rd_kafka_toppar_t *rktp,
                                                 version);
         }
 
+        /* Refetch from a MessageSet that failed decompression */
+        if (rkb->rkb_rk->rk_decomp_pool)
+                rd_kafka_decomp_rewind(rkb, rktp);
+
 
 	if (RD_KAFKA_TOPPAR_IS_PAUSED(rktp)) {
 		should_fetch = 0;
@@ -1895,18 +2073,34 @@ rd_ts_t rd_kafka_toppar_fetch_decide (rd_kafka_toppar_t *rktp,
                 should_fetch = 0;
                 reason = "no concrete offset";
 
-        } else if (rd_kafka_q_len(rktp->rktp_fetchq) >=
+        } else if (rd_kafka_toppar_fetchq_msgcnt(rktp) >=
 		   rkb->rkb_rk->rk_conf.queued_min_msgs) {
 		/* Skip toppars who's local message queue is already above
 		 * the lower threshold. */
                 reason = "queued.min.messages exceeded";
                 should_fetch = 0;
 
-        } else if ((int64_t)rd_kafka_q_size(rktp->rktp_fetchq) >=
+        } else if (rd_kafka_toppar_fetchq_size(rktp) >=
             rkb->rkb_rk->rk_conf.queued_max_msg_bytes) {
                 reason = "queued.max.messages.kbytes exceeded";
                 should_fetch = 0;
 
+        } else if (rkb->rkb_rk->rk_conf.queued_max_total_bytes &&
+                   rd_atomic64_get(&rktp->rktp_fetchq_bytes) >=
+                   (int64_t)rd_kafka_toppar_fetch_adaptive_size(rktp)) {
+                /* A full fetch is already waiting to be consumed. */
+                reason = "adaptive fetch size queued";
+                should_fetch = 0;
+
+        } else if (rkb->rkb_rk->rk_conf.queued_max_total_bytes &&
+                   rd_atomic64_get(&rkb->rkb_rk->rk_fetchq_bytes) >=
+                   rkb->rkb_rk->rk_conf.queued_max_total_bytes &&
+                   rd_atomic64_get(&rktp->rktp_fetchq_bytes) > 0) {
+                /* Partitions with nothing queued may still fetch
+                 * to avoid starving them. */
+                reason = "queued.max.total.kbytes exceeded";
+                should_fetch = 0;
+
         } else if (rktp->rktp_ts_fetch_backoff > rd_clock()) {
                 reason = "fetch backed off";
                 ts_backoff = rktp->rktp_ts_fetch_backoff;
@@ -1926,9 +2120,9 @@ rd_ts_t rd_kafka_toppar_fetch_decide (rd_kafka_toppar_t *rktp,
                            rktp->rktp_partition,
 			   rd_kafka_fetch_states[rktp->rktp_fetch_state],
                            rd_kafka_offset2str(rktp->rktp_next_offset),
-                           rd_kafka_q_len(rktp->rktp_fetchq),
+                           rd_kafka_toppar_fetchq_msgcnt(rktp),
                            rkb->rkb_rk->rk_conf.queued_min_msgs,
-                           rd_kafka_q_size(rktp->rktp_fetchq) / 1024,
+                           rd_kafka_toppar_fetchq_size(rktp) / 1024,
                            rkb->rkb_rk->rk_conf.queued_max_msg_kbytes,
 			   rktp->rktp_fetch_version,
                            should_fetch ? "" : "not ", reason);
@@ -3415,3 +3609,142 @@ int rd_kafka_topic_partition_list_regex_cnt (
         }
         return cnt;
 }
+
+
+
+/**
+ * @name Unit tests
+ * @{
+ */
+
+#define UT_INTAKE_THREADS  8
+#define UT_INTAKE_MSGS     20000  /* per thread */
+
+struct ut_intake_thread {
+        rd_kafka_toppar_t *rktp;
+        int32_t            id;
+};
+
+static int ut_intake_producer_main (void *arg) {
+        struct ut_intake_thread *ut = arg;
+        int i;
+
+        for (i = 0 ; i < UT_INTAKE_MSGS ; i++) {
+                rd_kafka_msg_t *rkm = rd_calloc(1, sizeof(*rkm));
+                rkm->rkm_partition = ut->id;
+                rkm->rkm_offset    = i;
+                /* Keep the main thread's timeout scan away */
+                rkm->rkm_ts_timeout = INT64_MAX;
+                rd_kafka_toppar_enq_msg(ut->rktp, rkm);
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Pop and verify all messages on rktp_msgq: msgseqs must be
+ *        consecutive and each producer thread's messages in its
+ *        produce order.
+ *
+ * @returns 0 on success (\p cntp is incremented by the number of
+ *          verified messages), or 1 on failure.
+ */
+static int ut_intake_verify (rd_kafka_toppar_t *rktp, uint64_t *last_msgseq,
+                             int64_t *next_offset, int *cntp) {
+        rd_kafka_msg_t *rkm;
+
+        while ((rkm = rd_kafka_msgq_pop(&rktp->rktp_msgq))) {
+                int32_t id = rkm->rkm_partition;
+
+                RD_UT_ASSERT(rkm->rkm_u.producer.msgseq == *last_msgseq + 1,
+                             "expected msgseq %"PRIu64", not %"PRIu64,
+                             *last_msgseq + 1, rkm->rkm_u.producer.msgseq);
+                *last_msgseq = rkm->rkm_u.producer.msgseq;
+
+                RD_UT_ASSERT(rkm->rkm_offset == next_offset[id],
+                             "thread %"PRId32": expected message #%"PRId64
+                             ", not #%"PRId64,
+                             id, next_offset[id], rkm->rkm_offset);
+                next_offset[id]++;
+
+                rd_free(rkm);
+                (*cntp)++;
+        }
+
+        return 0;
+}
+
+/**
+ * @brief Concurrent producers on the lock-free intake queue
+ *        (queue.buffering.lockfree) with a concurrent drainer.
+ */
+static int unittest_msgq_intake (void) {
+        const char *confv[] = { "queue.buffering.lockfree", "true", NULL };
+        rd_kafka_t *rk;
+        shptr_rd_kafka_toppar_t *s_rktp;
+        rd_kafka_toppar_t *rktp;
+        struct ut_intake_thread uts[UT_INTAKE_THREADS];
+        thrd_t thrds[UT_INTAKE_THREADS];
+        int64_t next_offset[UT_INTAKE_THREADS] = RD_ZERO_INIT;
+        uint64_t last_msgseq = 0;
+        int i, r, cnt = 0, drains = 0;
+        rd_ts_t ts_start = rd_clock();
+
+        rk = rd_unittest_rk_new(RD_KAFKA_PRODUCER, confv);
+        RD_UT_ASSERT(rk, "failed to create instance");
+        s_rktp = rd_kafka_toppar_get2(rk, "ut_intake", 0, 0, 1);
+        rktp = rd_kafka_toppar_s2i(s_rktp);
+
+        for (i = 0 ; i < UT_INTAKE_THREADS ; i++) {
+                uts[i].rktp = rktp;
+                uts[i].id = i;
+                RD_UT_ASSERT(thrd_create(&thrds[i], ut_intake_producer_main,
+                                         &uts[i]) == thrd_success,
+                             "thrd_create failed");
+        }
+
+        /* Drain concurrently with the producers, like the broker thread. */
+        while (cnt < UT_INTAKE_THREADS * UT_INTAKE_MSGS) {
+                rd_kafka_toppar_lock(rktp);
+                if (rd_kafka_toppar_msgq_intake_drain(rktp) > 0)
+                        drains++;
+                r = ut_intake_verify(rktp, &last_msgseq, next_offset, &cnt);
+                rd_kafka_toppar_unlock(rktp);
+
+                if (r)
+                        return 1;
+        }
+
+        for (i = 0 ; i < UT_INTAKE_THREADS ; i++) {
+                thrd_join(thrds[i], NULL);
+                RD_UT_ASSERT(next_offset[i] == UT_INTAKE_MSGS,
+                             "thread %d: expected %d messages, not %"PRId64,
+                             i, UT_INTAKE_MSGS, next_offset[i]);
+        }
+
+        RD_UT_ASSERT(rd_atomicptr_get(&rktp->rktp_msgq_intake) == NULL,
+                     "intake queue should be empty");
+        RD_UT_ASSERT(rktp->rktp_msgseq == (uint64_t)cnt,
+                     "expected msgseq %d, not %"PRIu64,
+                     cnt, rktp->rktp_msgseq);
+
+        RD_UT_SAY("%d messages from %d threads in %d drains in %.3fms",
+                  cnt, UT_INTAKE_THREADS, drains,
+                  (double)(rd_clock() - ts_start) / 1000.0);
+
+        rd_kafka_toppar_destroy(s_rktp);
+        rd_kafka_destroy(rk);
+
+        RD_UT_PASS();
+}
+
+
+int unittest_toppar (void) {
+        int fails = 0;
+
+        fails += unittest_msgq_intake();
+
+        return fails;
+}
+
+/**@}*/
@@ -85,11 +85,28 @@ struct rd_kafka_toppar_s { /* rd_kafka_toppar_t */
 
         //LOCK: toppar_lock. toppar_insert_msg(), concat_msgq()
         //LOCK: toppar_lock. toppar_enq_msg(), deq_msg(), toppar_retry_msgq()
-        int                rktp_msgq_wakeup_fd; /* Wake-up fd */
+        rd_wakeup_t       *rktp_msgq_wakeup; /* Leader broker's wake-up,
+                                             * or NULL. */
 	rd_kafka_msgq_t    rktp_msgq;      /* application->rdkafka queue.
 					    * protected by rktp_lock */
+        rd_atomicptr_t     rktp_msgq_intake; /**< Lock-free
+                                              *   application->rktp_msgq
+                                              *   intake queue
+                                              *   (queue.buffering.lockfree).
+                                              *   Newest message first,
+                                              *   linked through
+                                              *   rkm_link.tqe_next.
+                                              *   Drained to rktp_msgq
+                                              *   under rktp_lock by
+                                              *   rd_kafka_toppar_msgq_intake_drain() */
         rd_kafka_msgq_t    rktp_xmit_msgq; /* internal broker xmit queue.
                                             * local to broker thread. */
+        rd_atomic32_t      rktp_compress_cnt; /**< MessageSets (0 or 1)
+                                               *   currently being compressed
+                                               *   by the compression pool.
+                                               *   The partition is not
+                                               *   served while non-zero
+                                               *   to retain ordering. */
 
         int                rktp_fetch;     /* On rkb_active_toppars list */
 
@@ -97,6 +114,57 @@ struct rd_kafka_toppar_s { /* rd_kafka_toppar_t */
 	rd_kafka_q_t      *rktp_fetchq;          /* Queue of fetched messages
 						  * from broker.
                                                   * Broker thread -> App */
+        rd_atomic32_t      rktp_fetchq_batch_cnt; /**< Messages in
+                                                   *   FETCH_BATCH ops not
+                                                   *   reflected by the
+                                                   *   fetchq length
+                                                   *   (all but one per op).*/
+        rd_atomic64_t      rktp_fetchq_bytes;    /**< Bytes of fetched
+                                                  *   messages not yet
+                                                  *   destroyed, accounted
+                                                  *   for when
+                                                  *   queued.max.total.kbytes
+                                                  *   is set. */
+        mtx_t              rktp_decomp_lock;     /**< Protects
+                                                  *   rktp_decomp_jobs and
+                                                  *   the rktp_decomp_
+                                                  *   epoch and fail
+                                                  *   fields. */
+        TAILQ_HEAD(, rd_kafka_decomp_job_s) rktp_decomp_jobs; /**< Outstanding
+                                                  * decompression jobs in
+                                                  * fetch order. */
+        int32_t            rktp_decomp_epoch;    /**< Bumped by the broker
+                                                  *   thread on rewind,
+                                                  *   older jobs and fetch
+                                                  *   responses are
+                                                  *   dropped. */
+        int64_t            rktp_decomp_fail_offset; /**< Offset to refetch
+                                                  *   from after a failed
+                                                  *   job, else
+                                                  *   RD_KAFKA_OFFSET_INVALID.
+                                                  *   No ops are delivered
+                                                  *   while set. */
+        int32_t            rktp_decomp_fail_version; /**< Fetch version of
+                                                  *   the failed job. */
+        rd_atomic32_t      rktp_decomp_msgcnt;   /**< Messages held by
+                                                  *   outstanding jobs
+                                                  *   (estimated), not yet
+                                                  *   on the fetchq. */
+        rd_atomic64_t      rktp_decomp_bytes;    /**< Bytes held by
+                                                  *   outstanding jobs. */
+        rd_atomic32_t      rktp_lz4_ratio;       /**< Running average of the
+                                                  *   LZ4 decompressed /
+                                                  *   compressed size ratio
+                                                  *   (x100), 0 if unknown.
+                                                  *   Sizes the output
+                                                  *   buffer of the next
+                                                  *   decompression. */
+        rd_atomic32_t      rktp_gzip_ratio;      /**< Same as rktp_lz4_ratio
+                                                  *   but for gzip. */
+        rd_atomic32_t      rktp_gzip_recsize;    /**< Running average of the
+                                                  *   gzip decompressed
+                                                  *   bytes per record,
+                                                  *   0 if unknown. */
         rd_kafka_q_t      *rktp_ops;             /* * -> Main thread */
 
         uint64_t           rktp_msgseq;     /* Current message sequence number.
@@ -110,6 +178,30 @@ struct rd_kafka_toppar_s { /* rd_kafka_toppar_t */
                                              * maintained.
                                              * Starts at 1. */
 
+        /**
+         * Idempotent Producer state.
+         * Locks: toppar_lock */
+        struct {
+                rd_kafka_pid_t pid;         /**< Partition's last known
+                                             *   Producer Id and epoch. */
+                uint64_t epoch_base_msgseq; /**< The msgseq that maps
+                                             *   to BaseSequence 0 for
+                                             *   the current pid. */
+                uint64_t next_ack_msgseq;   /**< Next expected msgseq
+                                             *   to be acked by the
+                                             *   broker. */
+                rd_bool_t wait_drain;       /**< Don't send any new
+                                             *   ProduceRequests until
+                                             *   all in-flight requests
+                                             *   have finished, so that
+                                             *   retried messages are
+                                             *   re-sent in order. */
+        } rktp_eos;
+
+        rd_atomic32_t      rktp_msgs_inflight; /**< Current number of
+                                                *   messages in-flight
+                                                *   in ProduceRequests. */
+
 	/**
 	 * rktp version barriers
 	 *
@@ -170,6 +262,12 @@ struct rd_kafka_toppar_s { /* rd_kafka_toppar_t */
                                                       * fetch.
                                                       * Locality: broker thread
                                                       */
+        int32_t            rktp_fetch_adaptive_size; /**< Adaptive fetch
+                                                      *   size, see
+                                                      *   rd_kafka_toppar_
+                                                      *   fetch_adapt().
+                                                      *   Locality: broker
+                                                      *   thread */
 
         rd_ts_t            rktp_ts_fetch_backoff; /* Back off fetcher for
                                                    * this partition until this
@@ -338,6 +436,7 @@ void rd_kafka_toppar_set_fetch_state (rd_kafka_toppar_t *rktp,
                                       int fetch_state);
 void rd_kafka_toppar_insert_msg (rd_kafka_toppar_t *rktp, rd_kafka_msg_t *rkm);
 void rd_kafka_toppar_enq_msg (rd_kafka_toppar_t *rktp, rd_kafka_msg_t *rkm);
+int rd_kafka_toppar_msgq_intake_drain (rd_kafka_toppar_t *rktp);
 void rd_kafka_toppar_deq_msg (rd_kafka_toppar_t *rktp, rd_kafka_msg_t *rkm);
 int rd_kafka_retry_msgq (rd_kafka_msgq_t *destq,
                          rd_kafka_msgq_t *srcq,
@@ -458,6 +557,10 @@ rd_kafka_topic_partition_list_upsert (
         rd_kafka_topic_partition_list_t *rktparlist,
         const char *topic, int32_t partition);
 
+void
+rd_kafka_topic_partition_copy (rd_kafka_topic_partition_list_t *rktparlist,
+                               const rd_kafka_topic_partition_t *rktpar);
+
 int rd_kafka_topic_partition_match (rd_kafka_t *rk,
 				    const rd_kafka_group_member_t *rkgm,
 				    const rd_kafka_topic_partition_t *rktpar,
@@ -558,6 +661,8 @@ int rd_kafka_topic_partition_list_regex_cnt (
 struct rd_kafka_toppar_ver {
 	shptr_rd_kafka_toppar_t *s_rktp;
 	int32_t version;
+        int     seen;     /**< Partition was seen in the FetchResponse */
+        int32_t decomp_epoch; /**< rktp_decomp_epoch at request time */
 };
 
 
@@ -606,6 +711,116 @@ int rd_kafka_op_version_outdated (rd_kafka_op_t *rko, int version) {
 	return 0;
 }
 
+
+/**
+ * @returns the number of messages in the partition's fetch queue,
+ *          including all messages held in FETCH_BATCH ops and
+ *          outstanding decompression jobs.
+ */
+static RD_INLINE RD_UNUSED
+int rd_kafka_toppar_fetchq_msgcnt (rd_kafka_toppar_t *rktp) {
+        return rd_kafka_q_len(rktp->rktp_fetchq) +
+                rd_atomic32_get(&rktp->rktp_fetchq_batch_cnt) +
+                rd_atomic32_get(&rktp->rktp_decomp_msgcnt);
+}
+
+/**
+ * @returns the size of the partition's fetch queue, including
+ *          the payloads held by outstanding decompression jobs.
+ */
+static RD_INLINE RD_UNUSED
+int64_t rd_kafka_toppar_fetchq_size (rd_kafka_toppar_t *rktp) {
+        return (int64_t)rd_kafka_q_size(rktp->rktp_fetchq) +
+                rd_atomic64_get(&rktp->rktp_decomp_bytes);
+}
+
+
+/**
+ * @brief Smallest adaptive fetch size, see rd_kafka_toppar_fetch_adapt().
+ */
+#define RD_KAFKA_FETCH_ADAPTIVE_MIN_SIZE  (32*1024)
+
+/**
+ * @returns the partition's adaptive fetch size, capped by
+ *          fetch.message.max.bytes.
+ *          This is also the number of prefetched bytes a partition
+ *          may hold before it stops fetching.
+ */
+static RD_INLINE RD_UNUSED
+int32_t rd_kafka_toppar_fetch_adaptive_size (const rd_kafka_toppar_t *rktp) {
+        return RD_MIN(rktp->rktp_fetch_adaptive_size,
+                      rktp->rktp_fetch_msg_max_bytes);
+}
+
+/**
+ * @returns the number of bytes to request for \p rktp in the next
+ *          FetchRequest: if the total prefetch budget is enabled this is
+ *          the adaptive fetch size, clamped to what is left of the budget,
+ *          else fetch.message.max.bytes.
+ *
+ * @locality broker thread
+ */
+static RD_INLINE RD_UNUSED
+int32_t rd_kafka_toppar_fetch_size (rd_kafka_toppar_t *rktp) {
+        rd_kafka_t *rk = rktp->rktp_rkt->rkt_rk;
+        int32_t size;
+        int64_t remains;
+
+        if (likely(!rk->rk_conf.queued_max_total_bytes))
+                return rktp->rktp_fetch_msg_max_bytes;
+
+        size = rd_kafka_toppar_fetch_adaptive_size(rktp);
+
+        remains = rk->rk_conf.queued_max_total_bytes -
+                rd_atomic64_get(&rk->rk_fetchq_bytes);
+        if (remains < (int64_t)size)
+                size = (int32_t)RD_MAX(remains,
+                                       RD_MIN(RD_KAFKA_FETCH_ADAPTIVE_MIN_SIZE,
+                                              rktp->
+                                              rktp_fetch_msg_max_bytes));
+
+        return size;
+}
+
+void rd_kafka_toppar_fetch_adapt (rd_kafka_toppar_t *rktp,
+                                  int32_t MessageSetSize,
+                                  int64_t HighwaterMarkOffset);
+void rd_kafka_toppar_fetchq_bytes_wakeup (rd_kafka_toppar_t *rktp);
+
+/**
+ * @brief Account \p size bytes of fetched messages (negative to release)
+ *        to the partition and instance totals, if the total prefetch
+ *        budget (queued.max.total.kbytes) is enabled.
+ *
+ * A release that brings the partition below its fetch size, or the
+ * instance below its budget, wakes up the partition's broker thread
+ * so that fetching resumes without waiting for the next fetch decision.
+ *
+ * @locality any
+ */
+static RD_INLINE RD_UNUSED
+void rd_kafka_toppar_fetchq_bytes_add (rd_kafka_toppar_t *rktp,
+                                       int64_t size) {
+        rd_kafka_t *rk = rktp->rktp_rkt->rkt_rk;
+        int64_t tp_bytes, rk_bytes, threshold;
+
+        if (likely(!rk->rk_conf.queued_max_total_bytes) || !size)
+                return;
+
+        tp_bytes = rd_atomic64_add(&rktp->rktp_fetchq_bytes, size);
+        rk_bytes = rd_atomic64_add(&rk->rk_fetchq_bytes, size);
+
+        if (size > 0)
+                return;
+
+        threshold = (int64_t)rd_kafka_toppar_fetch_adaptive_size(rktp);
+        if (unlikely((tp_bytes < threshold && tp_bytes - size >= threshold) ||
+                     (rk_bytes < rk->rk_conf.queued_max_total_bytes &&
+                      rk_bytes - size >=
+                      rk->rk_conf.queued_max_total_bytes)))
+                rd_kafka_toppar_fetchq_bytes_wakeup(rktp);
+}
+
 void
 rd_kafka_toppar_offset_commit_result (rd_kafka_toppar_t *rktp,
 				      rd_kafka_resp_err_t err,
@@ -644,4 +859,6 @@ int rd_kafka_partition_leader_cmp (const void *_a, const void *_b) {
         return rd_kafka_broker_cmp(a->rkb, b->rkb);
 }
 
+int unittest_toppar (void);
+
 #endif /* _RDKAFKA_PARTITION_H_ */
@@ -518,6 +518,38 @@ typedef struct rd_kafka_buf_s rd_kafka_buf_t;
 #define RD_KAFKAP_MSGSET_V2_OF_LastOffsetDelta  (8+4+4+1+4+2)
 #define RD_KAFKAP_MSGSET_V2_OF_BaseTimestamp    (8+4+4+1+4+2+4)
 #define RD_KAFKAP_MSGSET_V2_OF_MaxTimestamp     (8+4+4+1+4+2+4+8)
+#define RD_KAFKAP_MSGSET_V2_OF_BaseSequence     (8+4+4+1+4+2+4+8+8+8+2)
 #define RD_KAFKAP_MSGSET_V2_OF_RecordCount      (8+4+4+1+4+2+4+8+8+8+2+4)
 
+
+
+/**
+ * @struct Producer ID and Epoch for the Idempotent Producer
+ */
+typedef struct rd_kafka_pid_s {
+        int64_t id;     /**< Producer Id */
+        int16_t epoch;  /**< Producer Epoch */
+} rd_kafka_pid_t;
+
+#define RD_KAFKA_PID_INITIALIZER { -1, -1 }
+
+/**
+ * @returns true if \p PID is valid
+ */
+#define rd_kafka_pid_valid(PID) ((PID).id != -1)
+
+/**
+ * @returns true if the two PIDs are equal
+ */
+#define rd_kafka_pid_eq(PID1,PID2) \
+        ((PID1).id == (PID2).id && (PID1).epoch == (PID2).epoch)
+
+/**
+ * @brief Reset the PID to invalid/init state
+ */
+static RD_INLINE RD_UNUSED void rd_kafka_pid_reset (rd_kafka_pid_t *pid) {
+        pid->id    = -1;
+        pid->epoch = -1;
+}
+
 #endif /* _RDKAFKA_PROTO_H_ */
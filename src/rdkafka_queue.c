@@ -305,6 +305,40 @@ static RD_INLINE rd_kafka_op_t *rd_kafka_op_filter (rd_kafka_q_t *rkq,
 }
 
 
+/**
+ * @brief Unpack up to \p max_cnt messages from the FETCH_BATCH op
+ *        \p rko_batch on \p rkq into standalone FETCH ops appended to
+ *        \p dstq. The batch op is dequeued and destroyed once all its
+ *        messages have been unpacked.
+ *
+ * @returns the number of ops appended to \p dstq.
+ *
+ * @locks rkq_lock MUST be held (unless \p rkq is a local queue).
+ */
+static int rd_kafka_q_fetch_batch_unpack0 (rd_kafka_q_t *rkq,
+                                           rd_kafka_op_t *rko_batch,
+                                           struct rd_kafka_op_tailq *dstq,
+                                           int max_cnt) {
+        rd_kafka_op_t *rko;
+        int cnt = 0;
+
+        while (cnt < max_cnt &&
+               (rko = rd_kafka_op_fetch_batch_next(rko_batch))) {
+                /* The batch's rko_len was reduced accordingly */
+                rkq->rkq_qsize -= rko->rko_len;
+                TAILQ_INSERT_TAIL(dstq, rko, rko_link);
+                cnt++;
+        }
+
+        if (rd_kafka_op_fetch_batch_remains(rko_batch) == 0) {
+                rd_kafka_q_deq0(rkq, rko_batch);
+                rd_kafka_op_destroy(rko_batch);
+        }
+
+        return cnt;
+}
+
+
 
 /**
  * Pop an op from a queue.
@@ -348,10 +382,24 @@ rd_kafka_op_t *rd_kafka_q_pop_serve (rd_kafka_q_t *rkq, int timeout_ms,
                                !(rko = rd_kafka_op_filter(rkq, rko, version)))
                                 ;
 
-                        if (rko) {
+                        if (rko &&
+                            rko->rko_type == RD_KAFKA_OP_FETCH_BATCH) {
+                                /* Unpack the next message of the batch */
+                                struct rd_kafka_op_tailq unpackq =
+                                        TAILQ_HEAD_INITIALIZER(unpackq);
+
+                                if (!rd_kafka_q_fetch_batch_unpack0(
+                                            rkq, rko, &unpackq, 1))
+                                        goto retry;
+
+                                rko = TAILQ_FIRST(&unpackq);
+
+                        } else if (rko) {
                                 /* Proper versioned op */
                                 rd_kafka_q_deq0(rkq, rko);
+                        }
 
+                        if (rko) {
                                 /* Ops with callbacks are considered handled
                                  * and we move on to the next op, if any.
                                  * Ops w/o callbacks are returned immediately */
@@ -450,7 +498,9 @@ int rd_kafka_q_serve (rd_kafka_q_t *rkq, int timeout_ms,
 		return 0;
 	}
 
-	/* Move the first `max_cnt` ops. */
+	/* Move the first `max_cnt` ops.
+         * A FETCH_BATCH op counts as one op here but is served as
+         * one op per message: the loop below stops at `max_cnt`. */
 	rd_kafka_q_init(&localq, rkq->rkq_rk);
 	rd_kafka_q_move_cnt(&localq, rkq, max_cnt == 0 ? -1/*all*/ : max_cnt,
 			    0/*no-locks*/);
@@ -460,10 +510,23 @@ int rd_kafka_q_serve (rd_kafka_q_t *rkq, int timeout_ms,
         rd_kafka_yield_thread = 0;
 
 	/* Call callback for each op */
-        while ((rko = TAILQ_FIRST(&localq.rkq_q))) {
+        while ((max_cnt == 0 || cnt < max_cnt) &&
+               (rko = TAILQ_FIRST(&localq.rkq_q))) {
                 rd_kafka_op_res_t res;
 
-                rd_kafka_q_deq0(&localq, rko);
+                if (rko->rko_type == RD_KAFKA_OP_FETCH_BATCH) {
+                        /* Unpack the next message of the batch */
+                        struct rd_kafka_op_tailq unpackq =
+                                TAILQ_HEAD_INITIALIZER(unpackq);
+
+                        if (!rd_kafka_q_fetch_batch_unpack0(
+                                    &localq, rko, &unpackq, 1))
+                                continue;
+
+                        rko = TAILQ_FIRST(&unpackq);
+                } else
+                        rd_kafka_q_deq0(&localq, rko);
+
                 res = rd_kafka_op_handle(rk, &localq, rko, cb_type,
                                          opaque, callback);
                 /* op must have been handled */
@@ -473,14 +536,17 @@ int rd_kafka_q_serve (rd_kafka_q_t *rkq, int timeout_ms,
                 if (unlikely(res == RD_KAFKA_OP_RES_YIELD ||
                              rd_kafka_yield_thread)) {
                         /* Callback called rd_kafka_yield(), we must
-                         * stop our callback dispatching and put the
-                         * ops in localq back on the original queue head. */
-                        if (!TAILQ_EMPTY(&localq.rkq_q))
-                                rd_kafka_q_prepend(rkq, &localq);
+                         * stop our callback dispatching. */
                         break;
                 }
 	}
 
+        /* Put the ops not served back on the original queue head:
+         * on yield, or the remainder of a FETCH_BATCH op
+         * when `max_cnt` was reached. */
+        if (!TAILQ_EMPTY(&localq.rkq_q))
+                rd_kafka_q_prepend(rkq, &localq);
+
 	rd_kafka_q_destroy_owner(&localq);
 
 	return cnt;
@@ -503,6 +569,7 @@ int rd_kafka_q_serve_rkmessages (rd_kafka_q_t *rkq, int timeout_ms,
                                  size_t rkmessages_size) {
 	unsigned int cnt = 0;
         TAILQ_HEAD(, rd_kafka_op_s) tmpq = TAILQ_HEAD_INITIALIZER(tmpq);
+        struct rd_kafka_op_tailq unpackq = TAILQ_HEAD_INITIALIZER(unpackq);
         rd_kafka_op_t *rko, *next;
         rd_kafka_t *rk = rkq->rkq_rk;
         rd_kafka_q_t *fwdq;
@@ -526,6 +593,12 @@ int rd_kafka_q_serve_rkmessages (rd_kafka_q_t *rkq, int timeout_ms,
 	while (cnt < rkmessages_size) {
                 rd_kafka_op_res_t res;
 
+                if ((rko = TAILQ_FIRST(&unpackq))) {
+                        /* Message previously unpacked from a batch */
+                        TAILQ_REMOVE(&unpackq, rko, rko_link);
+                        goto unpacked;
+                }
+
                 mtx_lock(&rkq->rkq_lock);
 
                 while (!(rko = TAILQ_FIRST(&rkq->rkq_q)) &&
@@ -538,10 +611,23 @@ int rd_kafka_q_serve_rkmessages (rd_kafka_q_t *rkq, int timeout_ms,
 			break; /* Timed out */
                 }
 
+                if (rko->rko_type == RD_KAFKA_OP_FETCH_BATCH &&
+                    !rd_kafka_op_version_outdated(rko, 0)) {
+                        /* Unpack as many messages from the batch as
+                         * will fit in rkmessages while holding the lock. */
+                        rd_kafka_q_fetch_batch_unpack0(
+                                rkq, rko, &unpackq,
+                                (int)(rkmessages_size - cnt));
+                        mtx_unlock(&rkq->rkq_lock);
+                        continue;
+                }
+
 		rd_kafka_q_deq0(rkq, rko);
 
                 mtx_unlock(&rkq->rkq_lock);
 
+        unpacked:
+
 		if (rd_kafka_op_version_outdated(rko, 0)) {
                         /* Outdated op, put on discard queue */
                         TAILQ_INSERT_TAIL(&tmpq, rko, rko_link);
@@ -580,6 +666,20 @@ int rd_kafka_q_serve_rkmessages (rd_kafka_q_t *rkq, int timeout_ms,
 		rkmessages[cnt++] = rd_kafka_message_get(rko);
 	}
 
+        if (unlikely(!TAILQ_EMPTY(&unpackq))) {
+                /* Put unpacked but unserved messages back on
+                 * the queue head, in order. */
+                rd_kafka_q_t localq;
+
+                rd_kafka_q_init(&localq, rk);
+                while ((rko = TAILQ_FIRST(&unpackq))) {
+                        TAILQ_REMOVE(&unpackq, rko, rko_link);
+                        rd_kafka_q_enq(&localq, rko);
+                }
+                rd_kafka_q_prepend(rkq, &localq);
+                rd_kafka_q_destroy_owner(&localq);
+        }
+
         /* Discard non-desired and already handled ops */
         next = TAILQ_FIRST(&tmpq);
         while (next) {
@@ -763,6 +763,10 @@ rd_kafka_op_t *rd_kafka_q_last (rd_kafka_q_t *rkq, rd_kafka_op_type_t op_type,
 
 void rd_kafka_q_io_event_enable (rd_kafka_q_t *rkq, int fd,
                                  const void *payload, size_t size);
+void rd_kafka_q_cb_event_enable (rd_kafka_q_t *rkq,
+                                 void (*event_cb) (rd_kafka_t *rk,
+                                                   void *opaque),
+                                 void *opaque);
 
 /* Public interface */
 struct rd_kafka_queue_s {
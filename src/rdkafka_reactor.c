@@ -0,0 +1,503 @@
+/*
+ * librdkafka - Apache Kafka C library
+ *
+ * Copyright (c) 2018 Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rdkafka_int.h"
+#include "rdkafka_broker.h"
+#include "rdkafka_transport.h"
+#include "rdkafka_reactor.h"
+#include "rdtime.h"
+
+#ifdef __linux__
+#define RD_KAFKA_REACTOR_EPOLL 1
+#include <sys/epoll.h>
+#endif
+
+#if WITH_SSL
+#include <openssl/err.h>
+#endif
+
+
+typedef struct rd_kafka_reactor_s {
+        rd_kafka_t   *rktr_rk;
+        int           rktr_id;
+        thrd_t        rktr_thread;
+
+        mtx_t         rktr_lock;         /**< Protects rktr_new */
+        TAILQ_HEAD(, rd_kafka_broker_s) rktr_new; /**< Brokers added but
+                                                   *   not yet adopted by
+                                                   *   the reactor
+                                                   *   thread. */
+
+        /* Reactor thread only */
+        TAILQ_HEAD(, rd_kafka_broker_s) rktr_brokers; /**< Served brokers */
+        int           rktr_broker_cnt;
+
+        rd_wakeup_t   rktr_wakeup;       /**< Reactor wake-up */
+
+#if RD_KAFKA_REACTOR_EPOLL
+        int           rktr_epfd;
+        struct epoll_event *rktr_events;
+#else
+#ifndef _MSC_VER
+        struct pollfd *rktr_pfds;
+#else
+        WSAPOLLFD     *rktr_pfds;
+#endif
+        rd_kafka_broker_t **rktr_pfd_rkbs; /**< Broker of each pollfd */
+#endif
+        int           rktr_size;         /**< Allocated events/pfds */
+} rd_kafka_reactor_t;
+
+
+/**
+ * @brief Wake up the reactor thread.
+ * @locality any
+ */
+static void rd_kafka_reactor_wakeup (rd_kafka_reactor_t *rktr) {
+        rd_wakeup_signal(&rktr->rktr_wakeup);
+}
+
+
+#if RD_KAFKA_REACTOR_EPOLL
+static int rd_kafka_reactor_epoll_events (int events) {
+        return (events & POLLIN ? EPOLLIN : 0) |
+                (events & POLLOUT ? EPOLLOUT : 0);
+}
+#endif
+
+
+/**
+ * @brief Update the reactor's registration of the broker's socket
+ *        to what the transport currently waits for.
+ *
+ * @locality reactor thread
+ */
+static void rd_kafka_reactor_io_update (rd_kafka_reactor_t *rktr,
+                                        rd_kafka_broker_t *rkb) {
+        int fd = -1, events = 0;
+
+        if (rkb->rkb_transport)
+                fd = rd_kafka_transport_poll_fd(rkb->rkb_transport, &events);
+
+        if (fd == rkb->rkb_reactor_sfd &&
+            (fd == -1 || events == rkb->rkb_reactor_sevents))
+                return;
+
+#if RD_KAFKA_REACTOR_EPOLL
+        {
+                struct epoll_event ev = RD_ZERO_INIT;
+
+                /* A previously registered socket is never still open
+                 * at this point: rd_kafka_broker_fail() resets
+                 * rkb_reactor_sfd when it closes the transport,
+                 * which removes the fd from the epoll set. */
+                ev.events = rd_kafka_reactor_epoll_events(events);
+                ev.data.ptr = rkb;
+
+                if (fd != -1 &&
+                    epoll_ctl(rktr->rktr_epfd,
+                              rkb->rkb_reactor_sfd == fd ?
+                              EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                              fd, &ev) == -1)
+                        rd_rkb_log(rkb, LOG_ERR, "REACTOR",
+                                   "Failed to add socket %d to reactor "
+                                   "poll set: %s", fd, rd_strerror(errno));
+        }
+#endif
+
+        rkb->rkb_reactor_sfd     = fd;
+        rkb->rkb_reactor_sevents = events;
+}
+
+
+/**
+ * @brief Adopt newly added brokers.
+ *
+ * @locality reactor thread
+ * @locks rktr_lock MUST be held
+ */
+static void rd_kafka_reactor_adopt (rd_kafka_reactor_t *rktr) {
+        rd_kafka_broker_t *rkb;
+
+        while ((rkb = TAILQ_FIRST(&rktr->rktr_new))) {
+                TAILQ_REMOVE(&rktr->rktr_new, rkb, rkb_reactor_link);
+
+                /* Acquire the broker lock (which was held by
+                 * rd_kafka_broker_add() during the adding) to
+                 * synchronise state. */
+                rd_kafka_broker_lock(rkb);
+                rd_kafka_broker_unlock(rkb);
+
+#if RD_KAFKA_REACTOR_EPOLL
+                if (rd_wakeup_fd(&rkb->rkb_wakeup) != -1) {
+                        struct epoll_event ev = RD_ZERO_INIT;
+                        ev.events = EPOLLIN;
+                        ev.data.ptr = rkb;
+                        if (epoll_ctl(rktr->rktr_epfd, EPOLL_CTL_ADD,
+                                      rd_wakeup_fd(&rkb->rkb_wakeup),
+                                      &ev) == -1)
+                                rd_rkb_log(rkb, LOG_ERR, "REACTOR",
+                                           "Failed to add wake-up fd to "
+                                           "reactor poll set: %s",
+                                           rd_strerror(errno));
+                }
+#endif
+
+                rd_rkb_dbg(rkb, BROKER, "BRKMAIN",
+                           "Served by reactor thread %d", rktr->rktr_id);
+
+                rkb->rkb_reactor_next = 0; /* Serve right away */
+                TAILQ_INSERT_TAIL(&rktr->rktr_brokers, rkb, rkb_reactor_link);
+                rktr->rktr_broker_cnt++;
+        }
+
+        /* Wake-up fd + socket per broker, plus the reactor's own fd. */
+        if (rktr->rktr_size < 1 + (rktr->rktr_broker_cnt * 2)) {
+                rktr->rktr_size = 1 + (rktr->rktr_broker_cnt * 2);
+#if RD_KAFKA_REACTOR_EPOLL
+                rktr->rktr_events = rd_realloc(rktr->rktr_events,
+                                               sizeof(*rktr->rktr_events) *
+                                               rktr->rktr_size);
+#else
+                rktr->rktr_pfds = rd_realloc(rktr->rktr_pfds,
+                                             sizeof(*rktr->rktr_pfds) *
+                                             rktr->rktr_size);
+                rktr->rktr_pfd_rkbs = rd_realloc(rktr->rktr_pfd_rkbs,
+                                                 sizeof(*rktr->
+                                                        rktr_pfd_rkbs) *
+                                                 rktr->rktr_size);
+#endif
+        }
+}
+
+
+/**
+ * @brief Wait up to \p timeout_ms for IO and wake-up events and
+ *        mark the brokers with events as ready.
+ *
+ * @locality reactor thread
+ */
+static void rd_kafka_reactor_wait (rd_kafka_reactor_t *rktr,
+                                   int timeout_ms) {
+        rd_bool_t wakeup = rd_false;
+        int r, i;
+#if RD_KAFKA_REACTOR_EPOLL
+
+        r = epoll_wait(rktr->rktr_epfd, rktr->rktr_events,
+                       rktr->rktr_size, timeout_ms);
+
+        for (i = 0 ; i < r ; i++) {
+                rd_kafka_broker_t *rkb = rktr->rktr_events[i].data.ptr;
+
+                if (!rkb)
+                        wakeup = rd_true;
+                else
+                        rkb->rkb_reactor_ready = rd_true;
+        }
+
+#else
+        rd_kafka_broker_t *rkb;
+        int cnt = 0;
+
+        rktr->rktr_pfds[cnt].fd = rd_wakeup_fd(&rktr->rktr_wakeup);
+        rktr->rktr_pfds[cnt].events = POLLIN;
+        rktr->rktr_pfd_rkbs[cnt++] = NULL;
+
+        TAILQ_FOREACH(rkb, &rktr->rktr_brokers, rkb_reactor_link) {
+                if (rd_wakeup_fd(&rkb->rkb_wakeup) != -1) {
+                        rktr->rktr_pfds[cnt].fd =
+                                rd_wakeup_fd(&rkb->rkb_wakeup);
+                        rktr->rktr_pfds[cnt].events = POLLIN;
+                        rktr->rktr_pfd_rkbs[cnt++] = rkb;
+                }
+                if (rkb->rkb_reactor_sfd != -1) {
+                        rktr->rktr_pfds[cnt].fd = rkb->rkb_reactor_sfd;
+                        rktr->rktr_pfds[cnt].events =
+                                rkb->rkb_reactor_sevents;
+                        rktr->rktr_pfd_rkbs[cnt++] = rkb;
+                }
+        }
+
+#ifndef _MSC_VER
+        r = poll(rktr->rktr_pfds, cnt, timeout_ms);
+#else
+        r = WSAPoll(rktr->rktr_pfds, cnt, timeout_ms);
+#endif
+
+        for (i = 0 ; r > 0 && i < cnt ; i++) {
+                if (!rktr->rktr_pfds[i].revents)
+                        continue;
+
+                if (!rktr->rktr_pfd_rkbs[i])
+                        wakeup = rd_true;
+                else
+                        rktr->rktr_pfd_rkbs[i]->rkb_reactor_ready = rd_true;
+        }
+#endif
+
+        if (wakeup)
+                rd_wakeup_clear(&rktr->rktr_wakeup);
+}
+
+
+/**
+ * @brief Reactor thread main loop: serve the ready and due brokers
+ *        until the handle is terminating and all brokers are
+ *        decommissioned.
+ *
+ * @locality reactor thread
+ */
+static int rd_kafka_reactor_thread_main (void *arg) {
+        rd_kafka_reactor_t *rktr = arg;
+        rd_kafka_t *rk = rktr->rktr_rk;
+
+        rd_kafka_set_thread_name("reactor%d", rktr->rktr_id);
+        rd_kafka_set_thread_sysname("rdk:reactor%d", rktr->rktr_id);
+
+        (void)rd_atomic32_add(&rd_kafka_thread_cnt_curr, 1);
+
+        while (1) {
+                rd_kafka_broker_t *rkb, *rkb_tmp;
+                rd_ts_t now, next = RD_TS_MAX;
+                int timeout_ms;
+
+                mtx_lock(&rktr->rktr_lock);
+                rd_kafka_reactor_adopt(rktr);
+                mtx_unlock(&rktr->rktr_lock);
+
+                /* New brokers are not added to a terminating handle. */
+                if (rktr->rktr_broker_cnt == 0 && rd_kafka_terminating(rk))
+                        break;
+
+                TAILQ_FOREACH(rkb, &rktr->rktr_brokers, rkb_reactor_link) {
+                        if (rkb->rkb_reactor_next < next)
+                                next = rkb->rkb_reactor_next;
+                }
+
+                now = rd_clock();
+                if (next == RD_TS_MAX)
+                        timeout_ms = -1;
+                else if (next <= now)
+                        timeout_ms = 0;
+                else
+                        timeout_ms = (int)RD_MIN((next - now + 999) / 1000,
+                                                 (rd_ts_t)INT_MAX);
+
+                rd_kafka_reactor_wait(rktr, timeout_ms);
+
+                now = rd_clock();
+                TAILQ_FOREACH_SAFE(rkb, &rktr->rktr_brokers,
+                                   rkb_reactor_link, rkb_tmp) {
+                        if (!rkb->rkb_reactor_ready &&
+                            rkb->rkb_reactor_next > now)
+                                continue;
+
+                        rkb->rkb_reactor_ready = rd_false;
+
+                        if (!rd_kafka_broker_reactor_serve(rkb)) {
+                                rd_kafka_reactor_io_update(rktr, rkb);
+                                continue;
+                        }
+
+                        /* Broker is terminating */
+                        TAILQ_REMOVE(&rktr->rktr_brokers, rkb,
+                                     rkb_reactor_link);
+                        rktr->rktr_broker_cnt--;
+#if RD_KAFKA_REACTOR_EPOLL
+                        if (rd_wakeup_fd(&rkb->rkb_wakeup) != -1)
+                                epoll_ctl(rktr->rktr_epfd, EPOLL_CTL_DEL,
+                                          rd_wakeup_fd(&rkb->rkb_wakeup),
+                                          NULL);
+#endif
+                        rd_kafka_broker_decommission(rkb);
+                }
+        }
+
+#if WITH_SSL
+        /* Remove OpenSSL per-thread error state to avoid memory leaks */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
+        /*(OpenSSL libraries handle thread init and deinit)
+         * https://github.com/openssl/openssl/pull/1048 */
+#elif OPENSSL_VERSION_NUMBER >= 0x10000000L
+        ERR_remove_thread_state(NULL);
+#endif
+#endif
+
+        rd_atomic32_sub(&rd_kafka_thread_cnt_curr, 1);
+
+        return 0;
+}
+
+
+/**
+ * @brief Assign broker \p rkb to a reactor thread, round-robin.
+ *
+ * The reactor thread takes over the broker thread's refcount.
+ *
+ * @locality any
+ * @locks rd_kafka_broker_lock() MUST be held
+ */
+void rd_kafka_reactor_broker_add (rd_kafka_t *rk, rd_kafka_broker_t *rkb) {
+        rd_kafka_reactor_t *rktr;
+
+        rktr = rk->rk_reactors[(rd_atomic32_add(&rk->rk_reactor_rr, 1) - 1) %
+                               rk->rk_reactor_cnt];
+
+        rkb->rkb_reactor = rktr;
+        rkb->rkb_thread  = rktr->rktr_thread;
+
+        mtx_lock(&rktr->rktr_lock);
+        TAILQ_INSERT_TAIL(&rktr->rktr_new, rkb, rkb_reactor_link);
+        mtx_unlock(&rktr->rktr_lock);
+
+        rd_kafka_reactor_wakeup(rktr);
+}
+
+
+/**
+ * @brief Free reactor resources, the thread must not be running.
+ */
+static void rd_kafka_reactor_free (rd_kafka_reactor_t *rktr) {
+#if RD_KAFKA_REACTOR_EPOLL
+        if (rktr->rktr_epfd != -1)
+                rd_close(rktr->rktr_epfd);
+        if (rktr->rktr_events)
+                rd_free(rktr->rktr_events);
+#else
+        if (rktr->rktr_pfds)
+                rd_free(rktr->rktr_pfds);
+        if (rktr->rktr_pfd_rkbs)
+                rd_free(rktr->rktr_pfd_rkbs);
+#endif
+        rd_wakeup_destroy(&rktr->rktr_wakeup);
+        mtx_destroy(&rktr->rktr_lock);
+        rd_free(rktr);
+}
+
+
+/**
+ * @brief Create \p thread_cnt reactor threads.
+ *
+ * @returns 0 on success or -1 on failure in which case a human readable
+ *          error is written to \p errstr. The reactors created so far
+ *          are destroyed by rd_kafka_reactors_destroy().
+ *
+ * @locality application thread
+ */
+int rd_kafka_reactors_init (rd_kafka_t *rk, int thread_cnt,
+                            char *errstr, size_t errstr_size) {
+        int i;
+
+        rk->rk_reactors = rd_calloc(thread_cnt, sizeof(*rk->rk_reactors));
+        rd_atomic32_init(&rk->rk_reactor_rr, 0);
+
+        for (i = 0 ; i < thread_cnt ; i++) {
+                rd_kafka_reactor_t *rktr;
+                int r;
+
+                rktr = rd_calloc(1, sizeof(*rktr));
+                rktr->rktr_rk = rk;
+                rktr->rktr_id = i;
+                mtx_init(&rktr->rktr_lock, mtx_plain);
+                TAILQ_INIT(&rktr->rktr_new);
+                TAILQ_INIT(&rktr->rktr_brokers);
+#if RD_KAFKA_REACTOR_EPOLL
+                rktr->rktr_epfd = -1;
+#endif
+
+                if ((r = rd_wakeup_init(&rktr->rktr_wakeup))) {
+                        rd_snprintf(errstr, errstr_size,
+                                    "Failed to create reactor wake-up "
+                                    "fds: %s", rd_strerror(r));
+                        rd_kafka_reactor_free(rktr);
+                        return -1;
+                }
+
+#if RD_KAFKA_REACTOR_EPOLL
+                if ((rktr->rktr_epfd = epoll_create(1)) == -1) {
+                        rd_snprintf(errstr, errstr_size,
+                                    "Failed to create reactor epoll fd: %s",
+                                    rd_strerror(errno));
+                        rd_kafka_reactor_free(rktr);
+                        return -1;
+                } else {
+                        struct epoll_event ev = RD_ZERO_INIT;
+                        ev.events = EPOLLIN;
+                        ev.data.ptr = NULL; /* Reactor wake-up */
+                        epoll_ctl(rktr->rktr_epfd, EPOLL_CTL_ADD,
+                                  rd_wakeup_fd(&rktr->rktr_wakeup), &ev);
+                }
+#endif
+
+                /* Allocate the initial event arrays. */
+                mtx_lock(&rktr->rktr_lock);
+                rd_kafka_reactor_adopt(rktr);
+                mtx_unlock(&rktr->rktr_lock);
+
+                if (thrd_create(&rktr->rktr_thread,
+                                rd_kafka_reactor_thread_main, rktr) !=
+                    thrd_success) {
+                        rd_snprintf(errstr, errstr_size,
+                                    "Failed to create reactor thread: "
+                                    "%s (%i)", rd_strerror(errno), errno);
+                        rd_kafka_reactor_free(rktr);
+                        return -1;
+                }
+
+                rk->rk_reactors[rk->rk_reactor_cnt++] = rktr;
+        }
+
+        return 0;
+}
+
+
+/**
+ * @brief Wait for the reactor threads to decommission their brokers and
+ *        exit, then destroy the reactors.
+ *
+ * @locality rdkafka main thread or application thread (on failed
+ *           rd_kafka_new())
+ * @locks none
+ */
+void rd_kafka_reactors_destroy (rd_kafka_t *rk) {
+        int i;
+
+        rd_assert(rd_kafka_terminating(rk));
+
+        for (i = 0 ; i < rk->rk_reactor_cnt ; i++)
+                rd_kafka_reactor_wakeup(rk->rk_reactors[i]);
+
+        for (i = 0 ; i < rk->rk_reactor_cnt ; i++) {
+                thrd_join(rk->rk_reactors[i]->rktr_thread, NULL);
+                rd_kafka_reactor_free(rk->rk_reactors[i]);
+        }
+
+        rd_free(rk->rk_reactors);
+        rk->rk_reactors = NULL;
+        rk->rk_reactor_cnt = 0;
+}
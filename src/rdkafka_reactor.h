@@ -0,0 +1,54 @@
+/*
+ * librdkafka - Apache Kafka C library
+ *
+ * Copyright (c) 2018 Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _RDKAFKA_REACTOR_H_
+#define _RDKAFKA_REACTOR_H_
+
+/**
+ * @name Shared broker reactor threads
+ *
+ * With broker.threads > 0 brokers are not served by a dedicated thread
+ * each but are assigned round-robin to a fixed pool of reactor threads.
+ * A reactor thread waits for socket and wake-up fd events on all its
+ * brokers (epoll on Linux, poll elsewhere) and runs a non-blocking step
+ * of a broker's state machine, rd_kafka_broker_reactor_serve(), when
+ * the broker has an event or its next deadline is due.
+ * Idle brokers have no deadline and cost no wake-ups.
+ *
+ * @{
+ */
+
+int rd_kafka_reactors_init (rd_kafka_t *rk, int thread_cnt,
+                            char *errstr, size_t errstr_size);
+void rd_kafka_reactors_destroy (rd_kafka_t *rk);
+
+void rd_kafka_reactor_broker_add (rd_kafka_t *rk, rd_kafka_broker_t *rkb);
+
+/**@}*/
+
+#endif /* _RDKAFKA_REACTOR_H_ */
@@ -36,9 +36,12 @@
 #include "rdkafka_partition.h"
 #include "rdkafka_metadata.h"
 #include "rdkafka_msgset.h"
+#include "rdkafka_idempotence.h"
+#include "rdkafka_compress.h"
 
 #include "rdrand.h"
 #include "rdstring.h"
+#include "rdunittest.h"
 
 /**
  * Kafka protocol request and response handling.
@@ -1115,12 +1118,19 @@ err:
 
 /**
  * Send JoinGroupRequest
+ *
+ * \p owned_partitions (may be NULL) is the member's last assignment,
+ * received in generation \p owned_generation_id, which is made available
+ * to the assignors' member metadata.
  */
 void rd_kafka_JoinGroupRequest (rd_kafka_broker_t *rkb,
                                 const rd_kafkap_str_t *group_id,
                                 const rd_kafkap_str_t *member_id,
                                 const rd_kafkap_str_t *protocol_type,
 				const rd_list_t *topics,
+                                const rd_kafka_topic_partition_list_t
+                                *owned_partitions,
+                                int32_t owned_generation_id,
                                 rd_kafka_replyq_t replyq,
                                 rd_kafka_resp_cb_t *resp_cb,
                                 void *opaque) {
@@ -1148,7 +1158,8 @@ void rd_kafka_JoinGroupRequest (rd_kafka_broker_t *rkb,
 		if (!rkas->rkas_enabled)
 			continue;
                 rd_kafka_buf_write_kstr(rkbuf, rkas->rkas_protocol_name);
-                member_metadata = rkas->rkas_get_metadata_cb(rkas, topics);
+                member_metadata = rkas->rkas_get_metadata_cb(
+                        rkas, topics, owned_partitions, owned_generation_id);
                 rd_kafka_buf_write_kbytes(rkbuf, member_metadata);
                 rd_kafkap_bytes_destroy(member_metadata);
         }
@@ -1701,49 +1712,106 @@ void rd_kafka_SaslHandshakeRequest (rd_kafka_broker_t *rkb,
 
 
 /**
- * @brief Parses a Produce reply.
+ * @brief Find the batch of \p request for \p topic and \p Partition.
+ *
+ *        The response is expected to list the partitions in request order,
+ *        so the batch following the previous match (\p *nextp) is checked
+ *        first before searching all batches.
+ *
+ * @returns the batch, or NULL if not found.
+ */
+static rd_kafka_produce_batch_t *
+rd_kafka_handle_Produce_find_batch (rd_kafka_buf_t *request,
+                                    int *nextp,
+                                    const rd_kafkap_str_t *topic,
+                                    int32_t Partition) {
+        rd_kafka_produce_batch_t *batches = request->rkbuf_u.Produce.batches;
+        const int batch_cnt = request->rkbuf_u.Produce.batch_cnt;
+        int i;
+
+        for (i = 0 ; i < batch_cnt ; i++) {
+                int idx = (*nextp + i) % batch_cnt;
+                const rd_kafka_toppar_t *rktp =
+                        rd_kafka_toppar_s2i(batches[idx].s_rktp);
+
+                if (rktp->rktp_partition == Partition &&
+                    !rd_kafkap_str_cmp(rktp->rktp_rkt->rkt_topic, topic)) {
+                        *nextp = idx + 1;
+                        return &batches[idx];
+                }
+        }
+
+        return NULL;
+}
+
+
+/**
+ * @brief Parses a Produce reply, updating each of the request's batches
+ *        with its partition's ErrorCode, Offset and Timestamp.
+ *        Batches missing from the reply are failed with ERR__BAD_MSG.
+ *
  * @returns 0 on success or an error code on failure.
  * @locality broker thread
  */
 static rd_kafka_resp_err_t
 rd_kafka_handle_Produce_parse (rd_kafka_broker_t *rkb,
-                               rd_kafka_toppar_t *rktp,
                                rd_kafka_buf_t *rkbuf,
-                               rd_kafka_buf_t *request,
-                               int64_t *offsetp,
-                               int64_t *timestampp) {
+                               rd_kafka_buf_t *request) {
+        rd_kafka_produce_batch_t *batches = request->rkbuf_u.Produce.batches;
         int32_t TopicArrayCnt;
-        int32_t PartitionArrayCnt;
-        struct {
-                int32_t Partition;
-                int16_t ErrorCode;
-                int64_t Offset;
-        } hdr;
+        int next = 0;
+        int i;
         const int log_decode_errors = LOG_ERR;
 
+        for (i = 0 ; i < request->rkbuf_u.Produce.batch_cnt ; i++)
+                batches[i].err = RD_KAFKA_RESP_ERR__BAD_MSG;
+
         rd_kafka_buf_read_i32(rkbuf, &TopicArrayCnt);
-        if (TopicArrayCnt != 1)
-                goto err;
+        while (TopicArrayCnt-- > 0) {
+                rd_kafkap_str_t topic;
+                int32_t PartitionArrayCnt;
+
+                rd_kafka_buf_read_str(rkbuf, &topic);
+                rd_kafka_buf_read_i32(rkbuf, &PartitionArrayCnt);
+
+                while (PartitionArrayCnt-- > 0) {
+                        struct {
+                                int32_t Partition;
+                                int16_t ErrorCode;
+                                int64_t Offset;
+                                int64_t Timestamp;
+                        } hdr;
+                        rd_kafka_produce_batch_t *batch;
 
-        /* Since we only produce to one single topic+partition in each
-         * request we assume that the reply only contains one topic+partition
-         * and that it is the same that we requested.
-         * If not the broker is buggy. */
-        rd_kafka_buf_skip_str(rkbuf);
-        rd_kafka_buf_read_i32(rkbuf, &PartitionArrayCnt);
+                        rd_kafka_buf_read_i32(rkbuf, &hdr.Partition);
+                        rd_kafka_buf_read_i16(rkbuf, &hdr.ErrorCode);
+                        rd_kafka_buf_read_i64(rkbuf, &hdr.Offset);
 
-        if (PartitionArrayCnt != 1)
-                goto err;
+                        hdr.Timestamp = -1;
+                        if (request->rkbuf_reqhdr.ApiVersion >= 2)
+                                rd_kafka_buf_read_i64(rkbuf, &hdr.Timestamp);
 
-        rd_kafka_buf_read_i32(rkbuf, &hdr.Partition);
-        rd_kafka_buf_read_i16(rkbuf, &hdr.ErrorCode);
-        rd_kafka_buf_read_i64(rkbuf, &hdr.Offset);
+                        if (request->rkbuf_reqhdr.ApiVersion >= 5) {
+                                int64_t LogStartOffset;
+                                rd_kafka_buf_read_i64(rkbuf, &LogStartOffset);
+                        }
 
-        *offsetp = hdr.Offset;
+                        batch = rd_kafka_handle_Produce_find_batch(
+                                request, &next, &topic, hdr.Partition);
+                        if (unlikely(!batch)) {
+                                rd_rkb_dbg(rkb, MSG, "PRODUCE",
+                                           "Ignoring ProduceResponse for "
+                                           "unrequested partition "
+                                           "%.*s [%"PRId32"]",
+                                           RD_KAFKAP_STR_PR(&topic),
+                                           hdr.Partition);
+                                continue;
+                        }
 
-        *timestampp = -1;
-        if (request->rkbuf_reqhdr.ApiVersion >= 2) {
-                rd_kafka_buf_read_i64(rkbuf, timestampp);
+                        batch->err = hdr.ErrorCode;
+                        batch->offset = hdr.Offset;
+                        batch->timestamp = hdr.Timestamp;
+                }
         }
 
         if (request->rkbuf_reqhdr.ApiVersion >= 1) {
@@ -1755,36 +1823,145 @@ rd_kafka_handle_Produce_parse (rd_kafka_broker_t *rkb,
         }
 
 
-        return hdr.ErrorCode;
+        return RD_KAFKA_RESP_ERR_NO_ERROR;
 
  err_parse:
         return rkbuf->rkbuf_err;
- err:
-        return RD_KAFKA_RESP_ERR__BAD_MSG;
 }
 
 
 /**
- * @brief Handle ProduceResponse
+ * @brief Idempotent producer: update the partition's next expected
+ *        acked msgseq after a successfully produced batch \p rkmq
+ *        that was sent with \p pid.
  *
  * @locality broker thread
+ * @locks none
  */
-static void rd_kafka_handle_Produce (rd_kafka_t *rk,
-                                     rd_kafka_broker_t *rkb,
-                                     rd_kafka_resp_err_t err,
-                                     rd_kafka_buf_t *reply,
-                                     rd_kafka_buf_t *request,
-                                     void *opaque) {
-        shptr_rd_kafka_toppar_t *s_rktp = opaque; /* from ProduceRequest() */
-        rd_kafka_toppar_t *rktp = rd_kafka_toppar_s2i(s_rktp);
-        int64_t offset = RD_KAFKA_OFFSET_INVALID;
-        int64_t timestamp = -1;
+static void rd_kafka_handle_Produce_idemp_ack (rd_kafka_toppar_t *rktp,
+                                               const rd_kafka_msgq_t *rkmq,
+                                               const rd_kafka_pid_t pid) {
+        const rd_kafka_msg_t *last =
+                TAILQ_LAST(&rkmq->rkmq_msgs, rd_kafka_msg_head_s);
+
+        rd_kafka_toppar_lock(rktp);
+        if (rd_kafka_pid_eq(pid, rktp->rktp_eos.pid) &&
+            last->rkm_u.producer.msgseq >= rktp->rktp_eos.next_ack_msgseq)
+                rktp->rktp_eos.next_ack_msgseq =
+                        last->rkm_u.producer.msgseq + 1;
+        rd_kafka_toppar_unlock(rktp);
+}
 
-        /* Parse Produce reply (unless the request errored) */
-        if (!err && reply)
-                err = rd_kafka_handle_Produce_parse(rkb, rktp,
-                                                    reply, request,
-                                                    &offset, &timestamp);
+
+/**
+ * @brief Idempotent producer: prepare for retrying a failed
+ *        batch \p rkmq that was sent with \p pid.
+ *
+ *        Retried messages must be re-sent in sequence order, so the
+ *        partition is marked as wait_drain which holds off new requests
+ *        until all in-flight requests for the partition have finished.
+ *
+ *        An OUT_OF_ORDER_SEQUENCE_NUMBER error for a batch that is not the
+ *        next expected batch is caused by a preceding batch failing,
+ *        the batch is retried without increasing its retry count.
+ *        If it is the next expected batch the broker has lost track of the
+ *        sequence and a new PID must be acquired, as is the case for
+ *        the INVALID_PRODUCER_EPOCH and INVALID_PRODUCER_ID_MAPPING errors.
+ *
+ * @returns true if the messages' retry count should be increased,
+ *          else false.
+ *
+ * @locality broker thread
+ * @locks none
+ */
+static rd_bool_t
+rd_kafka_handle_Produce_idemp_retry (rd_kafka_t *rk,
+                                     rd_kafka_toppar_t *rktp,
+                                     const rd_kafka_msgq_t *rkmq,
+                                     const rd_kafka_pid_t pid,
+                                     rd_kafka_resp_err_t err) {
+        const rd_kafka_msg_t *first = TAILQ_FIRST(&rkmq->rkmq_msgs);
+        rd_bool_t incr_retry = rd_true;
+        rd_bool_t reset = rd_false;
+
+        rd_kafka_toppar_lock(rktp);
+        rktp->rktp_eos.wait_drain = rd_true;
+
+        switch (err)
+        {
+        case RD_KAFKA_RESP_ERR_OUT_OF_ORDER_SEQUENCE_NUMBER:
+                if (rd_kafka_pid_eq(pid, rktp->rktp_eos.pid) &&
+                    first->rkm_u.producer.msgseq >
+                    rktp->rktp_eos.next_ack_msgseq)
+                        incr_retry = rd_false; /* Preceding batch failed */
+                else
+                        reset = rd_true;
+                break;
+
+        case RD_KAFKA_RESP_ERR_INVALID_PRODUCER_EPOCH:
+        case RD_KAFKA_RESP_ERR_INVALID_PRODUCER_ID_MAPPING:
+                incr_retry = rd_false;
+                reset = rd_true;
+                break;
+
+        default:
+                break;
+        }
+        rd_kafka_toppar_unlock(rktp);
+
+        if (reset) {
+                rd_kafka_log(rk, LOG_WARNING, "IDEMPRESET",
+                             "%s [%"PRId32"]: ProduceRequest for msgseq "
+                             "%"PRIu64" failed: %s: acquiring new "
+                             "ProducerId",
+                             rktp->rktp_rkt->rkt_topic->str,
+                             rktp->rktp_partition,
+                             first->rkm_u.producer.msgseq,
+                             rd_kafka_err2str(err));
+                rd_kafka_idemp_drain_reset(rk, rd_kafka_err2name(err));
+        }
+
+        return incr_retry;
+}
+
+
+/**
+ * @brief Handle the ProduceResponse outcome \p err for a single
+ *        partition's batch \p batch whose messages are in \p rkmq.
+ *
+ *        Messages are either moved back to the partition queue for retry
+ *        or enqueued for delivery report, leaving \p rkmq empty
+ *        (unless the instance is terminating).
+ *
+ * @locality broker thread
+ */
+static void rd_kafka_handle_Produce_batch (rd_kafka_t *rk,
+                                           rd_kafka_broker_t *rkb,
+                                           rd_kafka_resp_err_t err,
+                                           rd_kafka_buf_t *reply,
+                                           rd_kafka_buf_t *request,
+                                           const rd_kafka_produce_batch_t
+                                           *batch,
+                                           rd_kafka_msgq_t *rkmq) {
+        rd_kafka_toppar_t *rktp = rd_kafka_toppar_s2i(batch->s_rktp);
+        int64_t offset = batch->offset;
+        int64_t timestamp = batch->timestamp;
+        const rd_kafka_pid_t pid = request->rkbuf_u.Produce.pid;
+        const rd_bool_t is_idempotent = rd_kafka_pid_valid(pid);
+
+        if (is_idempotent &&
+            err == RD_KAFKA_RESP_ERR_DUPLICATE_SEQUENCE_NUMBER) {
+                /* The batch was already successfully written to the log
+                 * by a previous (retried) request: treat as success. */
+                rd_rkb_dbg(rkb, MSG|RD_KAFKA_DBG_EOS, "DUPSEQ",
+                           "%s [%"PRId32"]: MessageSet with %i message(s) "
+                           "already persisted (duplicate sequence): "
+                           "treating as delivered",
+                           rktp->rktp_rkt->rkt_topic->str,
+                           rktp->rktp_partition,
+                           rkmq->rkmq_msg_cnt);
+                err = RD_KAFKA_RESP_ERR_NO_ERROR;
+        }
 
 
         if (likely(!err)) {
@@ -1792,7 +1969,10 @@ static void rd_kafka_handle_Produce (rd_kafka_t *rk,
                            "%s [%"PRId32"]: MessageSet with %i message(s) "
                            "delivered",
                            rktp->rktp_rkt->rkt_topic->str, rktp->rktp_partition,
-                           request->rkbuf_msgq.rkmq_msg_cnt);
+                           rkmq->rkmq_msg_cnt);
+
+                if (is_idempotent)
+                        rd_kafka_handle_Produce_idemp_ack(rktp, rkmq, pid);
 
         } else {
                 /* Error */
@@ -1826,13 +2006,24 @@ static void rd_kafka_handle_Produce (rd_kafka_t *rk,
                         RD_KAFKA_ERR_ACTION_PERMANENT,
                         RD_KAFKA_RESP_ERR__MSG_TIMED_OUT,
 
+                        /* Idempotent producer errors, these
+                         * are handled below. */
+                        RD_KAFKA_ERR_ACTION_RETRY,
+                        RD_KAFKA_RESP_ERR_OUT_OF_ORDER_SEQUENCE_NUMBER,
+
+                        RD_KAFKA_ERR_ACTION_RETRY,
+                        RD_KAFKA_RESP_ERR_INVALID_PRODUCER_EPOCH,
+
+                        RD_KAFKA_ERR_ACTION_RETRY,
+                        RD_KAFKA_RESP_ERR_INVALID_PRODUCER_ID_MAPPING,
+
                         RD_KAFKA_ERR_ACTION_END);
 
                 rd_rkb_dbg(rkb, MSG, "MSGSET",
                            "%s [%"PRId32"]: MessageSet with %i message(s) "
                            "encountered error: %s (actions %s)",
                            rktp->rktp_rkt->rkt_topic->str, rktp->rktp_partition,
-                           request->rkbuf_msgq.rkmq_msg_cnt,
+                           rkmq->rkmq_msg_cnt,
                            rd_kafka_err2str(err),
                            rd_flags2str(actstr, sizeof(actstr),
                                         rd_kafka_actions_descs,
@@ -1872,6 +2063,11 @@ static void rd_kafka_handle_Produce (rd_kafka_t *rk,
                         if (!rd_kafka_buf_was_sent(request))
                                 incr_retry = 0;
 
+                        if (is_idempotent &&
+                            !rd_kafka_handle_Produce_idemp_retry(
+                                    rk, rktp, rkmq, pid, err))
+                                incr_retry = 0;
+
                         /* Since requests are specific to a broker
                          * we move the retryable messages from the request
                          * back to the partition queue (prepend) and then
@@ -1880,13 +2076,12 @@ static void rd_kafka_handle_Produce (rd_kafka_t *rk,
                          * for each message is honoured, any messages that
                          * would exceeded the retry count will not be
                          * moved but instead fail below. */
-                        rd_kafka_toppar_retry_msgq(rktp, &request->rkbuf_msgq,
-                                                   incr_retry);
+                        rd_kafka_toppar_retry_msgq(rktp, rkmq, incr_retry);
 
-                        if (rd_kafka_msgq_len(&request->rkbuf_msgq) == 0) {
-                                /* No need do anything more with the request
-                                 * here since the request no longer has any
-                                 messages associated with it. */
+                        if (rd_kafka_msgq_len(rkmq) == 0) {
+                                /* No need do anything more with the batch
+                                 * here since it no longer has any
+                                 * messages associated with it. */
                                 goto done;
                         }
                 }
@@ -1906,8 +2101,7 @@ static void rd_kafka_handle_Produce (rd_kafka_t *rk,
                 rd_kafka_msg_t *rkm;
                 if (rktp->rktp_rkt->rkt_conf.produce_offset_report) {
                         /* produce.offset.report: each message */
-                        TAILQ_FOREACH(rkm, &request->rkbuf_msgq.rkmq_msgs,
-                                      rkm_link) {
+                        TAILQ_FOREACH(rkm, &rkmq->rkmq_msgs, rkm_link) {
                                 rkm->rkm_offset = offset++;
                                 if (timestamp != -1) {
                                         rkm->rkm_timestamp = timestamp;
@@ -1916,10 +2110,10 @@ static void rd_kafka_handle_Produce (rd_kafka_t *rk,
                         }
                 } else {
                         /* Last message in each batch */
-                        rkm = TAILQ_LAST(&request->rkbuf_msgq.rkmq_msgs,
+                        rkm = TAILQ_LAST(&rkmq->rkmq_msgs,
                                          rd_kafka_msg_head_s);
                         rkm->rkm_offset = offset +
-                                request->rkbuf_msgq.rkmq_msg_cnt - 1;
+                                rkmq->rkmq_msg_cnt - 1;
                         if (timestamp != -1) {
                                 rkm->rkm_timestamp = timestamp;
                                 rkm->rkm_tstype = RD_KAFKA_MSG_ATTR_LOG_APPEND_TIME;
@@ -1927,52 +2121,102 @@ static void rd_kafka_handle_Produce (rd_kafka_t *rk,
                 }
         }
 
+        /* Messages that permanently failed leave a gap in the
+         * partition's sequence which requires a new PID. */
+        if (unlikely(is_idempotent && err && rd_kafka_msgq_len(rkmq) > 0))
+                rd_kafka_idemp_drain_reset(rk, "messages failed");
+
         /* Enqueue messages for delivery report */
-        rd_kafka_dr_msgq(rktp->rktp_rkt, &request->rkbuf_msgq, err);
+        rd_kafka_dr_msgq(rktp->rktp_rkt, rkmq, err);
 
  done:
-        rd_kafka_toppar_destroy(s_rktp); /* from ProduceRequest() */
+        /* Only decrease the in-flight count after the messages
+         * have been re-enqueued (on retry) so that a PID reset
+         * can't rebase the sequence before the retried messages are
+         * back on the partition queue. */
+        if (is_idempotent)
+                rd_kafka_idemp_inflight_toppar_sub(rk, rktp, batch->msgcnt);
 }
 
 
 /**
- * @brief Send ProduceRequest for messages in toppar queue.
+ * @brief Handle ProduceResponse
  *
- * @returns the number of messages included, or 0 on error / no messages.
+ *        The response is demultiplexed to the request's per-partition
+ *        batches which are then handled individually.
  *
  * @locality broker thread
  */
-int rd_kafka_ProduceRequest (rd_kafka_broker_t *rkb, rd_kafka_toppar_t *rktp) {
-        rd_kafka_buf_t *rkbuf;
-        rd_kafka_itopic_t *rkt = rktp->rktp_rkt;
-        size_t MessageSetSize = 0;
-        int cnt;
+static void rd_kafka_handle_Produce (rd_kafka_t *rk,
+                                     rd_kafka_broker_t *rkb,
+                                     rd_kafka_resp_err_t err,
+                                     rd_kafka_buf_t *reply,
+                                     rd_kafka_buf_t *request,
+                                     void *opaque) {
+        int i;
+
+        /* Parse Produce reply (unless the request errored) */
+        if (!err && reply)
+                err = rd_kafka_handle_Produce_parse(rkb, reply, request);
+
+        for (i = 0 ; i < request->rkbuf_u.Produce.batch_cnt ; i++) {
+                const rd_kafka_produce_batch_t *batch =
+                        &request->rkbuf_u.Produce.batches[i];
+                rd_kafka_msgq_t rkmq = RD_KAFKA_MSGQ_INITIALIZER(rkmq);
+
+                /* The batches' messages are kept in batch order in the
+                 * request's queue.
+                 * When terminating the messages are left on the
+                 * request's queue to be purged with the request. */
+                if (err != RD_KAFKA_RESP_ERR__DESTROY)
+                        while (rd_kafka_msgq_len(&rkmq) < batch->msgcnt)
+                                rd_kafka_msgq_enq(&rkmq,
+                                                  rd_kafka_msgq_pop(
+                                                          &request->
+                                                          rkbuf_msgq));
+
+                rd_kafka_handle_Produce_batch(rk, rkb,
+                                              err ? err : batch->err,
+                                              reply, request, batch, &rkmq);
+        }
+}
+
+
+/**
+ * @brief Send the finalized ProduceRequest \p rkbuf.
+ *
+ * @locality broker thread
+ */
+static void rd_kafka_ProduceRequest_send (rd_kafka_broker_t *rkb,
+                                          rd_kafka_buf_t *rkbuf) {
+        const rd_kafka_produce_batch_t *batches =
+                rkbuf->rkbuf_u.Produce.batches;
         rd_ts_t now;
+        rd_ts_t ts_timeout = batches[0].ts_timeout;
         int64_t first_msg_timeout;
         int tmout;
+        int i;
 
-        /**
-         * Create ProduceRequest with as many messages from the toppar
-         * transmit queue as possible.
-         */
-        rkbuf = rd_kafka_msgset_create_ProduceRequest(rkb, rktp,
-                                                      &MessageSetSize);
-        if (unlikely(!rkbuf))
-                return 0;
+        for (i = 0 ; i < rkbuf->rkbuf_u.Produce.batch_cnt ; i++) {
+                rd_kafka_itopic_t *rkt =
+                        rd_kafka_toppar_s2i(batches[i].s_rktp)->rktp_rkt;
 
-        cnt = rkbuf->rkbuf_msgq.rkmq_msg_cnt;
-        rd_dassert(cnt > 0);
+                rd_avg_add(&rkt->rkt_avg_batchcnt, (int64_t)batches[i].msgcnt);
+                rd_avg_add(&rkt->rkt_avg_batchsize,
+                           (int64_t)batches[i].MessageSetSize);
 
-        rd_avg_add(&rktp->rktp_rkt->rkt_avg_batchcnt, (int64_t)cnt);
-        rd_avg_add(&rktp->rktp_rkt->rkt_avg_batchsize, (int64_t)MessageSetSize);
+                if (batches[i].ts_timeout < ts_timeout)
+                        ts_timeout = batches[i].ts_timeout;
+        }
 
-        if (!rkt->rkt_conf.required_acks)
+        /* All batches share the same required_acks */
+        if (!rd_kafka_toppar_s2i(batches[0].s_rktp)->rktp_rkt->
+            rkt_conf.required_acks)
                 rkbuf->rkbuf_flags |= RD_KAFKA_OP_F_NO_RESPONSE;
 
-        /* Use timeout from first message in batch */
+        /* Use timeout from the earliest first message of the batches */
         now = rd_clock();
-        first_msg_timeout = (TAILQ_FIRST(&rkbuf->rkbuf_msgq.rkmq_msgs)->
-                             rkm_ts_timeout - now) / 1000;
+        first_msg_timeout = (ts_timeout - now) / 1000;
 
         if (unlikely(first_msg_timeout <= 0)) {
                 /* Message has already timed out, allow 100 ms
@@ -1989,14 +2233,127 @@ int rd_kafka_ProduceRequest (rd_kafka_broker_t *rkb, rd_kafka_toppar_t *rktp) {
 
         rd_kafka_broker_buf_enq_replyq(rkb, rkbuf,
                                        RD_KAFKA_NO_REPLYQ,
-                                       rd_kafka_handle_Produce,
-                                       /* toppar ref for handle_Produce() */
-                                       rd_kafka_toppar_keep(rktp));
+                                       rd_kafka_handle_Produce, NULL);
+}
+
+
+/**
+ * @brief Send a ProduceRequest for messages in the transmit queues of
+ *        the partitions in \p rktps, packing as many of the partitions'
+ *        MessageSets into the request as possible.
+ *
+ *        Partitions that have nothing more to send in this round are
+ *        removed from \p rktps, see rd_kafka_msgset_create_ProduceRequest().
+ *
+ * @param pid is the Idempotent Producer's current PID, or an invalid
+ *            PID if the idempotent producer is not enabled.
+ *
+ * @returns the number of messages included, or 0 on error / no messages.
+ *
+ * @remark If the MessageSet is handed off to the compression pool
+ *         the request is sent by rd_kafka_ProduceRequest_compressed()
+ *         and the partition's rktp_compress_cnt is incremented.
+ *
+ * @locality broker thread
+ */
+int rd_kafka_ProduceRequest (rd_kafka_broker_t *rkb, rd_list_t *rktps,
+                             const rd_kafka_pid_t pid) {
+        rd_kafka_buf_t *rkbuf;
+        rd_kafka_op_t *rko_compress = NULL;
+        int cnt;
+
+        /**
+         * Create ProduceRequest with as many messages from the
+         * partitions' transmit queues as possible.
+         */
+        rkbuf = rd_kafka_msgset_create_ProduceRequest(rkb, rktps, pid,
+                                                      &rko_compress);
+        if (unlikely(!rkbuf))
+                return 0;
+
+        cnt = rkbuf->rkbuf_msgq.rkmq_msg_cnt;
+        rd_dassert(cnt > 0);
+
+        if (rd_kafka_pid_valid(pid)) {
+                int i;
+                for (i = 0 ; i < rkbuf->rkbuf_u.Produce.batch_cnt ; i++)
+                        rd_kafka_idemp_inflight_toppar_add(
+                                rkb->rkb_rk,
+                                rd_kafka_toppar_s2i(rkbuf->rkbuf_u.Produce.
+                                                    batches[i].s_rktp),
+                                rkbuf->rkbuf_u.Produce.batches[i].msgcnt);
+        }
+
+        if (rko_compress) {
+                /* Compression is offloaded, the request is sent
+                 * when the op is passed back to this broker thread. */
+                rd_atomic32_add(&rd_kafka_toppar_s2i(rko_compress->rko_rktp)->
+                                rktp_compress_cnt, 1);
+                rd_kafka_compress_pool_submit(rkb->rkb_rk->rk_compress_pool,
+                                              rko_compress);
+                return cnt;
+        }
+
+        rd_kafka_ProduceRequest_send(rkb, rkbuf);
 
         return cnt;
 }
 
 
+/**
+ * @brief Send the ProduceRequest of a RD_KAFKA_OP_COMPRESS op that has
+ *        been passed back from the compression pool.
+ *
+ * @locality broker thread
+ */
+void rd_kafka_ProduceRequest_compressed (rd_kafka_broker_t *rkb,
+                                         rd_kafka_op_t *rko) {
+        rd_kafka_toppar_t *rktp = rd_kafka_toppar_s2i(rko->rko_rktp);
+        rd_kafka_buf_t *rkbuf;
+
+        rkbuf = rd_kafka_msgset_compress_op_finalize(rko);
+
+        rd_kafka_ProduceRequest_send(rkb, rkbuf);
+
+        /* Now that the request is enqueued the partition may be
+         * served again. */
+        rd_atomic32_sub(&rktp->rktp_compress_cnt, 1);
+}
+
+
+/**
+ * @brief Fail the messages of a RD_KAFKA_OP_COMPRESS op that will never
+ *        be passed back to the broker thread (e.g., on termination)
+ *        with \p err and undo the in-flight accounting made by
+ *        rd_kafka_ProduceRequest().
+ *
+ * @locality any
+ * @locks none
+ */
+void rd_kafka_ProduceRequest_compress_fail (rd_kafka_op_t *rko,
+                                            rd_kafka_resp_err_t err) {
+        rd_kafka_toppar_t *rktp = rd_kafka_toppar_s2i(rko->rko_rktp);
+        rd_kafka_buf_t *rkbuf = rko->rko_u.compress.rkbuf;
+
+        rd_kafka_dr_msgq(rktp->rktp_rkt, &rkbuf->rkbuf_msgq, err);
+
+        if (rd_kafka_pid_valid(rkbuf->rkbuf_u.Produce.pid)) {
+                int i;
+                for (i = 0 ; i < rkbuf->rkbuf_u.Produce.batch_cnt ; i++)
+                        rd_kafka_idemp_inflight_toppar_sub(
+                                rktp->rktp_rkt->rkt_rk,
+                                rd_kafka_toppar_s2i(rkbuf->rkbuf_u.Produce.
+                                                    batches[i].s_rktp),
+                                rkbuf->rkbuf_u.Produce.batches[i].msgcnt);
+        }
+
+        rd_atomic32_sub(&rktp->rktp_compress_cnt, 1);
+
+        rko->rko_u.compress.rkbuf = NULL;
+        rd_kafka_buf_destroy(rkbuf);
+}
+
+
 /**
  * @brief Construct and send CreateTopicsRequest to \p rkb
  *        with the topics (NewTopic_t*) in \p new_topics, using
@@ -2510,3 +2867,378 @@ rd_kafka_DescribeConfigsRequest (rd_kafka_broker_t *rkb,
 
         return RD_KAFKA_RESP_ERR_NO_ERROR;
 }
+
+
+
+/**
+ * @brief Construct and send InitProducerIdRequest to \p rkb.
+ *
+ *        \p transactional_id may be NULL.
+ *        \p transaction_timeout_ms may be set to -1.
+ *
+ *        The response (unparsed) will be handled by \p resp_cb served
+ *        by queue \p replyq.
+ *
+ * @returns RD_KAFKA_RESP_ERR_NO_ERROR if the request was enqueued for
+ *          transmission, otherwise an error code and errstr will be
+ *          updated with a human readable error string.
+ */
+rd_kafka_resp_err_t
+rd_kafka_InitProducerIdRequest (rd_kafka_broker_t *rkb,
+                                const char *transactional_id,
+                                int transaction_timeout_ms,
+                                char *errstr, size_t errstr_size,
+                                rd_kafka_replyq_t replyq,
+                                rd_kafka_resp_cb_t *resp_cb,
+                                void *opaque) {
+        rd_kafka_buf_t *rkbuf;
+        int16_t ApiVersion = 0;
+
+        ApiVersion = rd_kafka_broker_ApiVersion_supported(
+                rkb, RD_KAFKAP_InitProducerId, 0, 0, NULL);
+        if (ApiVersion == -1) {
+                rd_snprintf(errstr, errstr_size,
+                            "InitProducerId (KIP-98) not supported by "
+                            "broker, requires broker version >= 0.11.0");
+                return RD_KAFKA_RESP_ERR__UNSUPPORTED_FEATURE;
+        }
+
+        rkbuf = rd_kafka_buf_new_request(rkb, RD_KAFKAP_InitProducerId, 1,
+                                         2 + (transactional_id ?
+                                              strlen(transactional_id) : 0) +
+                                         4);
+
+        /* transactional_id */
+        rd_kafka_buf_write_str(rkbuf, transactional_id, -1);
+
+        /* transaction_timeout_ms */
+        rd_kafka_buf_write_i32(rkbuf, transaction_timeout_ms);
+
+        rd_kafka_buf_ApiVersion_set(rkbuf, ApiVersion, 0);
+
+        /* Let the idempotence state handler perform retries */
+        rkbuf->rkbuf_retries = RD_KAFKA_BUF_NO_RETRIES;
+
+        rd_kafka_broker_buf_enq_replyq(rkb, rkbuf, replyq, resp_cb, opaque);
+
+        return RD_KAFKA_RESP_ERR_NO_ERROR;
+}
+
+
+
+/**
+ * @name Unit tests
+ * @{
+ */
+
+#define UT_PRODUCE_PAYLOAD_SIZE  100
+
+/**
+ * @brief Enqueue \p msgcnt messages on \p rktp's transmit queue, tagged
+ *        with the partition (opaque) so they can be matched to their
+ *        batch in the request.
+ */
+static void ut_produce_xmit_enq (rd_kafka_toppar_t *rktp, int msgcnt) {
+        static char payload[UT_PRODUCE_PAYLOAD_SIZE];
+        int i;
+
+        for (i = 0 ; i < msgcnt ; i++) {
+                rd_kafka_msg_t *rkm = rd_calloc(1, sizeof(*rkm));
+                rkm->rkm_flags      = RD_KAFKA_MSG_F_FREE_RKM;
+                rkm->rkm_payload    = payload;
+                rkm->rkm_len        = sizeof(payload);
+                rkm->rkm_partition  = rktp->rktp_partition;
+                rkm->rkm_opaque     = rktp;
+                rkm->rkm_offset     = RD_KAFKA_OFFSET_INVALID;
+                rkm->rkm_tstype     = RD_KAFKA_TIMESTAMP_NOT_AVAILABLE;
+                rkm->rkm_ts_timeout = INT64_MAX;
+                rd_kafka_msgq_enq(&rktp->rktp_xmit_msgq, rkm);
+        }
+}
+
+
+/**
+ * @brief Verify and destroy the ProduceRequest \p rkbuf created by
+ *        rd_kafka_msgset_create_ProduceRequest(): the request must fit
+ *        in message.max.bytes and its messages must be in batch order.
+ *
+ * @returns 0 on success (\p msgcntp is incremented by the number of
+ *          messages in the request), or 1 on failure.
+ */
+static int ut_produce_request_verify (rd_kafka_t *rk, rd_kafka_buf_t *rkbuf,
+                                      int *msgcntp) {
+        const rd_kafka_produce_batch_t *batches =
+                rkbuf->rkbuf_u.Produce.batches;
+        rd_kafka_msg_t *rkm;
+        int i;
+
+        RD_UT_ASSERT(rd_buf_len(&rkbuf->rkbuf_buf) <=
+                     (size_t)rk->rk_conf.max_msg_size,
+                     "request size %"PRIusz" exceeds message.max.bytes %d",
+                     rd_buf_len(&rkbuf->rkbuf_buf), rk->rk_conf.max_msg_size);
+
+        for (i = 0 ; i < rkbuf->rkbuf_u.Produce.batch_cnt ; i++) {
+                const rd_kafka_toppar_t *rktp =
+                        rd_kafka_toppar_s2i(batches[i].s_rktp);
+                int j;
+
+                RD_UT_ASSERT(batches[i].msgcnt > 0,
+                             "batch %d is empty", i);
+                RD_UT_ASSERT(batches[i].MessageSetSize > 0,
+                             "batch %d MessageSetSize not set", i);
+
+                for (j = 0 ; j < batches[i].msgcnt ; j++) {
+                        rkm = rd_kafka_msgq_pop(&rkbuf->rkbuf_msgq);
+                        RD_UT_ASSERT(rkm, "batch %d: message %d missing",
+                                     i, j);
+                        RD_UT_ASSERT(rkm->rkm_opaque == rktp,
+                                     "batch %d (%s [%"PRId32"]): message %d "
+                                     "belongs to another partition",
+                                     i, rktp->rktp_rkt->rkt_topic->str,
+                                     rktp->rktp_partition, j);
+                        rd_kafka_msg_destroy(NULL, rkm);
+                        (*msgcntp)++;
+                }
+        }
+
+        RD_UT_ASSERT(rd_kafka_msgq_len(&rkbuf->rkbuf_msgq) == 0,
+                     "%d message(s) not accounted for by batches",
+                     rd_kafka_msgq_len(&rkbuf->rkbuf_msgq));
+
+        rd_kafka_buf_destroy(rkbuf);
+
+        return 0;
+}
+
+
+/**
+ * @brief Multiple partitions of multiple topics are packed into each
+ *        ProduceRequest without exceeding message.max.bytes.
+ */
+static int unittest_produce_request_pack (void) {
+        const char *confv[] = { "message.max.bytes", "1000", NULL };
+        const struct {
+                const char *topic;
+                int32_t partition;
+        } parts[] = {
+                { "ut_produce_a", 0 },
+                { "ut_produce_a", 1 },
+                { "ut_produce_a", 2 },
+                { "ut_produce_b", 0 },
+                { "ut_produce_b", 1 },
+        };
+        const int part_cnt = (int)RD_ARRAYSIZE(parts);
+        const int msgs_per_part = 3;
+        shptr_rd_kafka_toppar_t *s_rktps[RD_ARRAYSIZE(parts)];
+        rd_kafka_t *rk;
+        rd_kafka_broker_t *rkb;
+        rd_list_t rktps;
+        rd_kafka_pid_t pid = RD_KAFKA_PID_INITIALIZER;
+        int reqcnt = 0, msgcnt = 0, max_batch_cnt = 0;
+        int i;
+
+        rk = rd_unittest_rk_new(RD_KAFKA_PRODUCER, confv);
+        RD_UT_ASSERT(rk, "failed to create instance");
+        rkb = rd_kafka_broker_internal(rk);
+        RD_UT_ASSERT(rkb, "no internal broker");
+
+        rd_list_init(&rktps, part_cnt, NULL);
+        for (i = 0 ; i < part_cnt ; i++) {
+                rd_kafka_toppar_t *rktp;
+
+                s_rktps[i] = rd_kafka_toppar_get2(rk, parts[i].topic,
+                                                  parts[i].partition, 0, 1);
+                rktp = rd_kafka_toppar_s2i(s_rktps[i]);
+                ut_produce_xmit_enq(rktp, msgs_per_part);
+                rd_list_add(&rktps, rktp);
+        }
+
+        /* The messages of all partitions do not fit in a single
+         * request: keep creating requests until all partitions
+         * are drained. */
+        while (rd_list_cnt(&rktps) > 0) {
+                rd_kafka_op_t *rko_compress = NULL;
+                rd_kafka_buf_t *rkbuf;
+
+                RD_UT_ASSERT(reqcnt < part_cnt * msgs_per_part,
+                             "partitions not drained after %d requests",
+                             reqcnt);
+
+                rkbuf = rd_kafka_msgset_create_ProduceRequest(
+                        rkb, &rktps, pid, &rko_compress);
+                RD_UT_ASSERT(rkbuf, "request %d: no request created "
+                             "for %d partition(s)",
+                             reqcnt, rd_list_cnt(&rktps));
+                RD_UT_ASSERT(!rko_compress,
+                             "compression should not be offloaded");
+
+                if (rkbuf->rkbuf_u.Produce.batch_cnt > max_batch_cnt)
+                        max_batch_cnt = rkbuf->rkbuf_u.Produce.batch_cnt;
+
+                if (ut_produce_request_verify(rk, rkbuf, &msgcnt))
+                        return 1;
+                reqcnt++;
+        }
+
+        RD_UT_ASSERT(msgcnt == part_cnt * msgs_per_part,
+                     "expected %d messages in requests, not %d",
+                     part_cnt * msgs_per_part, msgcnt);
+        RD_UT_ASSERT(reqcnt < part_cnt,
+                     "expected partitions to share requests: "
+                     "%d request(s) for %d partitions", reqcnt, part_cnt);
+        RD_UT_ASSERT(max_batch_cnt > 1,
+                     "expected multiple batches in a request");
+
+        RD_UT_SAY("%d messages for %d partitions in %d request(s), "
+                  "at most %d batch(es) per request",
+                  msgcnt, part_cnt, reqcnt, max_batch_cnt);
+
+        rd_list_destroy(&rktps);
+        for (i = 0 ; i < part_cnt ; i++)
+                rd_kafka_toppar_destroy(s_rktps[i]);
+        rd_kafka_broker_destroy(rkb);
+        rd_kafka_destroy(rk);
+
+        RD_UT_PASS();
+}
+
+
+/**
+ * @brief A multi-topic, multi-partition ProduceResponse is demultiplexed
+ *        to the request's batches regardless of response order,
+ *        partitions missing from the response are failed and
+ *        unrequested partitions are ignored.
+ */
+static int unittest_produce_response_parse (void) {
+        const struct {
+                const char *topic;
+                int32_t partition;
+        } parts[] = {
+                { "ut_produce_a", 0 },
+                { "ut_produce_a", 1 },
+                { "ut_produce_b", 0 },
+                { "ut_produce_b", 1 },
+        };
+        const int part_cnt = (int)RD_ARRAYSIZE(parts);
+        const struct {
+                rd_kafka_resp_err_t err;
+                int64_t offset;
+                int64_t timestamp;
+        } exp[] = {
+                { RD_KAFKA_RESP_ERR_NO_ERROR, 100, -1 },
+                /* Missing from response */
+                { RD_KAFKA_RESP_ERR__BAD_MSG, RD_KAFKA_OFFSET_INVALID, -1 },
+                { RD_KAFKA_RESP_ERR_NO_ERROR, 200, 1234567 },
+                { RD_KAFKA_RESP_ERR_NOT_LEADER_FOR_PARTITION, -1, -1 },
+        };
+        rd_kafka_t *rk;
+        rd_kafka_broker_t *rkb;
+        rd_kafka_buf_t *request, *reply;
+        rd_kafka_resp_err_t err;
+        int i;
+
+        rk = rd_unittest_rk_new(RD_KAFKA_PRODUCER, NULL);
+        RD_UT_ASSERT(rk, "failed to create instance");
+        rkb = rd_kafka_broker_internal(rk);
+        RD_UT_ASSERT(rkb, "no internal broker");
+
+        /* Request with one batch per partition, in topic order. */
+        request = rd_kafka_buf_new_request(rkb, RD_KAFKAP_Produce, 1, 0);
+        rd_kafka_buf_ApiVersion_set(request, 2, 0);
+        request->rkbuf_u.Produce.batches =
+                rd_calloc(part_cnt, sizeof(*request->rkbuf_u.Produce.batches));
+        for (i = 0 ; i < part_cnt ; i++) {
+                rd_kafka_produce_batch_t *batch =
+                        &request->rkbuf_u.Produce.batches[i];
+
+                batch->s_rktp = rd_kafka_toppar_get2(rk, parts[i].topic,
+                                                     parts[i].partition, 0, 1);
+                batch->msgcnt = 1;
+                batch->offset = RD_KAFKA_OFFSET_INVALID;
+                batch->timestamp = -1;
+                request->rkbuf_u.Produce.batch_cnt++;
+        }
+
+        /* ProduceResponse v2 listing the topics in reverse order and
+         * the partitions of ut_produce_b out of order, with an
+         * error for one partition, ut_produce_a [1] missing and an
+         * unrequested ut_produce_a [7]. */
+        reply = rd_kafka_buf_new(1, 256);
+        reply->rkbuf_rkb = rkb;
+        rd_kafka_broker_keep(rkb);
+
+        rd_kafka_buf_write_i32(reply, 2); /* TopicArrayCnt */
+
+        rd_kafka_buf_write_str(reply, "ut_produce_b", -1);
+        rd_kafka_buf_write_i32(reply, 2); /* PartitionArrayCnt */
+        rd_kafka_buf_write_i32(reply, 1); /* Partition */
+        rd_kafka_buf_write_i16(reply,
+                               RD_KAFKA_RESP_ERR_NOT_LEADER_FOR_PARTITION);
+        rd_kafka_buf_write_i64(reply, -1); /* Offset */
+        rd_kafka_buf_write_i64(reply, -1); /* Timestamp */
+        rd_kafka_buf_write_i32(reply, 0); /* Partition */
+        rd_kafka_buf_write_i16(reply, RD_KAFKA_RESP_ERR_NO_ERROR);
+        rd_kafka_buf_write_i64(reply, 200); /* Offset */
+        rd_kafka_buf_write_i64(reply, 1234567); /* Timestamp */
+
+        rd_kafka_buf_write_str(reply, "ut_produce_a", -1);
+        rd_kafka_buf_write_i32(reply, 2); /* PartitionArrayCnt */
+        rd_kafka_buf_write_i32(reply, 7); /* Partition: not requested */
+        rd_kafka_buf_write_i16(reply, RD_KAFKA_RESP_ERR_NO_ERROR);
+        rd_kafka_buf_write_i64(reply, 700); /* Offset */
+        rd_kafka_buf_write_i64(reply, -1); /* Timestamp */
+        rd_kafka_buf_write_i32(reply, 0); /* Partition */
+        rd_kafka_buf_write_i16(reply, RD_KAFKA_RESP_ERR_NO_ERROR);
+        rd_kafka_buf_write_i64(reply, 100); /* Offset */
+        rd_kafka_buf_write_i64(reply, -1); /* Timestamp */
+
+        rd_kafka_buf_write_i32(reply, 0); /* Throttle_Time */
+
+        rd_slice_init_full(&reply->rkbuf_reader, &reply->rkbuf_buf);
+
+        err = rd_kafka_handle_Produce_parse(rkb, reply, request);
+        RD_UT_ASSERT(!err, "parse failed: %s", rd_kafka_err2str(err));
+        RD_UT_ASSERT(rd_slice_remains(&reply->rkbuf_reader) == 0,
+                     "%"PRIusz" bytes of response not parsed",
+                     rd_slice_remains(&reply->rkbuf_reader));
+
+        for (i = 0 ; i < part_cnt ; i++) {
+                const rd_kafka_produce_batch_t *batch =
+                        &request->rkbuf_u.Produce.batches[i];
+
+                RD_UT_ASSERT(batch->err == exp[i].err,
+                             "%s [%"PRId32"]: expected error %s, not %s",
+                             parts[i].topic, parts[i].partition,
+                             rd_kafka_err2name(exp[i].err),
+                             rd_kafka_err2name(batch->err));
+                RD_UT_ASSERT(batch->offset == exp[i].offset,
+                             "%s [%"PRId32"]: expected offset %"PRId64
+                             ", not %"PRId64,
+                             parts[i].topic, parts[i].partition,
+                             exp[i].offset, batch->offset);
+                RD_UT_ASSERT(batch->timestamp == exp[i].timestamp,
+                             "%s [%"PRId32"]: expected timestamp %"PRId64
+                             ", not %"PRId64,
+                             parts[i].topic, parts[i].partition,
+                             exp[i].timestamp, batch->timestamp);
+        }
+
+        rd_kafka_buf_destroy(reply);
+        rd_kafka_buf_destroy(request);
+        rd_kafka_broker_destroy(rkb);
+        rd_kafka_destroy(rk);
+
+        RD_UT_PASS();
+}
+
+
+int unittest_request (void) {
+        int fails = 0;
+
+        fails += unittest_produce_request_pack();
+        fails += unittest_produce_response_parse();
+
+        return fails;
+}
+
+/**@}*/
@@ -114,6 +114,9 @@ void rd_kafka_JoinGroupRequest (rd_kafka_broker_t *rkb,
                                 const rd_kafkap_str_t *member_id,
                                 const rd_kafkap_str_t *protocol_type,
 				const rd_list_t *topics,
+                                const rd_kafka_topic_partition_list_t
+                                *owned_partitions,
+                                int32_t owned_generation_id,
                                 rd_kafka_replyq_t replyq,
                                 rd_kafka_resp_cb_t *resp_cb,
                                 void *opaque);
@@ -193,7 +196,12 @@ void rd_kafka_SaslHandshakeRequest (rd_kafka_broker_t *rkb,
 				    rd_kafka_resp_cb_t *resp_cb,
 				    void *opaque, int flash_msg);
 
-int rd_kafka_ProduceRequest (rd_kafka_broker_t *rkb, rd_kafka_toppar_t *rktp);
+int rd_kafka_ProduceRequest (rd_kafka_broker_t *rkb, rd_list_t *rktps,
+                             const rd_kafka_pid_t pid);
+void rd_kafka_ProduceRequest_compressed (rd_kafka_broker_t *rkb,
+                                         rd_kafka_op_t *rko);
+void rd_kafka_ProduceRequest_compress_fail (rd_kafka_op_t *rko,
+                                            rd_kafka_resp_err_t err);
 
 rd_kafka_resp_err_t
 rd_kafka_CreateTopicsRequest (rd_kafka_broker_t *rkb,
@@ -240,4 +248,15 @@ rd_kafka_DescribeConfigsRequest (rd_kafka_broker_t *rkb,
                                  rd_kafka_resp_cb_t *resp_cb,
                                  void *opaque);
 
+rd_kafka_resp_err_t
+rd_kafka_InitProducerIdRequest (rd_kafka_broker_t *rkb,
+                                const char *transactional_id,
+                                int transaction_timeout_ms,
+                                char *errstr, size_t errstr_size,
+                                rd_kafka_replyq_t replyq,
+                                rd_kafka_resp_cb_t *resp_cb,
+                                void *opaque);
+
+int unittest_request (void);
+
 #endif /* _RDKAFKA_REQUEST_H_ */
@@ -315,10 +315,28 @@ int rd_kafka_sasl_select_provider (rd_kafka_t *rk,
 
         rk->rk_conf.sasl.provider = provider;
 
+        if (provider->init &&
+            provider->init(rk, errstr, errstr_size) == -1)
+                return -1;
+
         return 0;
 }
 
 
+/**
+ * @brief Per-instance SASL termination.
+ *
+ * @locality application thread
+ */
+void rd_kafka_sasl_term (rd_kafka_t *rk) {
+        const struct rd_kafka_sasl_provider *provider =
+                rk->rk_conf.sasl.provider;
+
+        if (provider && provider->term)
+                provider->term(rk);
+}
+
+
 
 /**
  * Global SASL termination.
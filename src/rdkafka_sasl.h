@@ -45,5 +45,10 @@ int rd_kafka_sasl_global_init (void);
 
 int rd_kafka_sasl_select_provider (rd_kafka_t *rk,
                                    char *errstr, size_t errstr_size);
+void rd_kafka_sasl_term (rd_kafka_t *rk);
+
+#if WITH_SASL_SCRAM
+int unittest_scram (void);
+#endif
 
 #endif /* _RDKAFKA_SASL_H_ */
@@ -46,6 +46,11 @@ struct rd_kafka_sasl_provider {
 
         int (*conf_validate) (rd_kafka_t *rk,
                               char *errstr, size_t errstr_size);
+
+        /** Per-instance init and term (optional),
+         *  see rk_sasl.handle. */
+        int (*init) (rd_kafka_t *rk, char *errstr, size_t errstr_size);
+        void (*term) (rd_kafka_t *rk);
 };
 
 #ifdef _MSC_VER
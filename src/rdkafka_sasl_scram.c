@@ -36,6 +36,7 @@
 #include "rdkafka_sasl.h"
 #include "rdkafka_sasl_int.h"
 #include "rdrand.h"
+#include "rdunittest.h"
 
 #if WITH_SSL
 #include <openssl/hmac.h>
@@ -62,6 +63,37 @@ struct rd_kafka_sasl_scram_state {
 };
 
 
+/**
+ * @brief Per-instance state (rk_sasl.handle): cache of derived
+ *        SaltedPassword keyed by salt and iteration count.
+ *
+ * Hi() (PBKDF2) is by design expensive, thousands of HMACs, but its
+ * result only depends on the password, which is fixed for the lifetime
+ * of the instance, and on the user's salt and iteration count which
+ * are the same on all brokers of a cluster. With the cache each
+ * reconnect costs a few HMACs rather than a full Hi().
+ * A changed salt or iteration count (e.g., credentials updated on
+ * the cluster) simply misses the cache.
+ */
+#define RD_KAFKA_SASL_SCRAM_CACHE_SIZE 4
+
+struct rd_kafka_sasl_scram_handle {
+        mtx_t lock;             /**< Protects all fields, and is held
+                                 *   while deriving a missing entry so
+                                 *   that concurrent handshakes only
+                                 *   derive it once. */
+        struct {
+                rd_chariov_t  salt;  /**< Salt copy, NULL ptr if unused */
+                int           itcnt; /**< Iteration count */
+                unsigned char SaltedPassword[EVP_MAX_MD_SIZE];
+                size_t        size;  /**< SaltedPassword size */
+        } cache[RD_KAFKA_SASL_SCRAM_CACHE_SIZE];
+        int next;               /**< Next entry to replace */
+        int hits;               /**< Number of cache hits */
+        int misses;             /**< Number of Hi() derivations */
+};
+
+
 /**
  * @brief Close and free authentication state
  */
@@ -267,12 +299,11 @@ rd_kafka_sasl_scram_HMAC (rd_kafka_transport_t *rktrans,
  * @returns 0 on success, else -1
  */
 static int
-rd_kafka_sasl_scram_Hi (rd_kafka_transport_t *rktrans,
+rd_kafka_sasl_scram_Hi (rd_kafka_broker_t *rkb,
                         const rd_chariov_t *in,
                         const rd_chariov_t *salt,
                         int itcnt, rd_chariov_t *out) {
-        const EVP_MD *evp =
-                rktrans->rktrans_rkb->rkb_rk->rk_conf.sasl.scram_evp;
+        const EVP_MD *evp = rkb->rkb_rk->rk_conf.sasl.scram_evp;
         unsigned int  ressize = 0;
         unsigned char tempres[EVP_MAX_MD_SIZE];
         unsigned char *saltplus;
@@ -291,7 +322,7 @@ rd_kafka_sasl_scram_Hi (rd_kafka_transport_t *rktrans,
                   (const unsigned char *)in->ptr, (int)in->size,
                   saltplus, salt->size+4,
                   tempres, &ressize)) {
-                rd_rkb_dbg(rktrans->rktrans_rkb, SECURITY, "SCRAM",
+                rd_rkb_dbg(rkb, SECURITY, "SCRAM",
                            "HMAC priming failed");
                 return -1;
         }
@@ -307,7 +338,7 @@ rd_kafka_sasl_scram_Hi (rd_kafka_transport_t *rktrans,
                                    (const unsigned char *)in->ptr, (int)in->size,
                                    tempres, ressize,
                                    tempdest, NULL))) {
-                        rd_rkb_dbg(rktrans->rktrans_rkb, SECURITY, "SCRAM",
+                        rd_rkb_dbg(rkb, SECURITY, "SCRAM",
                                    "Hi() HMAC #%d/%d failed", i, itcnt);
                         return -1;
                 }
@@ -325,6 +356,80 @@ rd_kafka_sasl_scram_Hi (rd_kafka_transport_t *rktrans,
 }
 
 
+/**
+ * @brief SaltedPassword := Hi(Normalize(password), salt, i),
+ *        served from the instance's cache if possible.
+ *
+ * \p out must be at least EVP_MAX_MD_SIZE.
+ *
+ * @returns 0 on success, else -1
+ *
+ * @locality broker thread
+ * @locks none (acquires the handle lock)
+ */
+static int
+rd_kafka_sasl_scram_SaltedPassword (rd_kafka_broker_t *rkb,
+                                    const rd_chariov_t *password,
+                                    const rd_chariov_t *salt,
+                                    int itcnt, rd_chariov_t *out) {
+        struct rd_kafka_sasl_scram_handle *handle =
+                rkb->rkb_rk->rk_sasl.handle;
+        rd_ts_t ts_start;
+        int i, r;
+
+        if (!handle)
+                return rd_kafka_sasl_scram_Hi(rkb, password, salt,
+                                              itcnt, out);
+
+        mtx_lock(&handle->lock);
+
+        for (i = 0 ; i < RD_KAFKA_SASL_SCRAM_CACHE_SIZE ; i++) {
+                if (!handle->cache[i].salt.ptr ||
+                    handle->cache[i].itcnt != itcnt ||
+                    handle->cache[i].salt.size != salt->size ||
+                    memcmp(handle->cache[i].salt.ptr, salt->ptr, salt->size))
+                        continue;
+
+                memcpy(out->ptr, handle->cache[i].SaltedPassword,
+                       handle->cache[i].size);
+                out->size = handle->cache[i].size;
+                handle->hits++;
+                mtx_unlock(&handle->lock);
+
+                rd_rkb_dbg(rkb, SECURITY, "SCRAM",
+                           "Using cached SaltedPassword "
+                           "(%d iterations)", itcnt);
+                return 0;
+        }
+
+        ts_start = rd_clock();
+        r = rd_kafka_sasl_scram_Hi(rkb, password, salt, itcnt, out);
+        if (r == 0) {
+                i = handle->next;
+                handle->next = (i + 1) % RD_KAFKA_SASL_SCRAM_CACHE_SIZE;
+
+                RD_IF_FREE(handle->cache[i].salt.ptr, rd_free);
+                handle->cache[i].salt.ptr = rd_malloc(RD_MAX(salt->size, 1));
+                memcpy(handle->cache[i].salt.ptr, salt->ptr, salt->size);
+                handle->cache[i].salt.size = salt->size;
+                handle->cache[i].itcnt = itcnt;
+                memcpy(handle->cache[i].SaltedPassword, out->ptr, out->size);
+                handle->cache[i].size = out->size;
+                handle->misses++;
+        }
+
+        mtx_unlock(&handle->lock);
+
+        if (r == 0)
+                rd_rkb_dbg(rkb, SECURITY, "SCRAM",
+                           "Derived SaltedPassword (%d iterations) "
+                           "in %.3fms",
+                           itcnt, (double)(rd_clock() - ts_start) / 1000.0);
+
+        return r;
+}
+
+
 /**
  * @returns a SASL value-safe-char encoded string, replacing "," and "="
  *          with their escaped counterparts in a newly allocated string.
@@ -446,8 +551,8 @@ rd_kafka_sasl_scram_build_client_final_message (
          */
 
         /* SaltedPassword  := Hi(Normalize(password), salt, i) */
-        if (rd_kafka_sasl_scram_Hi(
-                    rktrans, &SaslPassword, salt,
+        if (rd_kafka_sasl_scram_SaltedPassword(
+                    rktrans->rktrans_rkb, &SaslPassword, salt,
                     itcnt, &SaltedPassword) == -1)
                 return -1;
 
@@ -903,10 +1008,136 @@ static int rd_kafka_sasl_scram_conf_validate (rd_kafka_t *rk,
 
 
 
+/**
+ * @brief Set up the per-instance SaltedPassword cache.
+ */
+static int rd_kafka_sasl_scram_init (rd_kafka_t *rk,
+                                     char *errstr, size_t errstr_size) {
+        struct rd_kafka_sasl_scram_handle *handle;
+
+        handle = rd_calloc(1, sizeof(*handle));
+        mtx_init(&handle->lock, mtx_plain);
+        rk->rk_sasl.handle = handle;
+
+        return 0;
+}
+
+
+/**
+ * @brief Free the per-instance SaltedPassword cache, wiping the
+ *        derived keys.
+ */
+static void rd_kafka_sasl_scram_term (rd_kafka_t *rk) {
+        struct rd_kafka_sasl_scram_handle *handle = rk->rk_sasl.handle;
+        int i;
+
+        if (!handle)
+                return;
+
+        for (i = 0 ; i < RD_KAFKA_SASL_SCRAM_CACHE_SIZE ; i++)
+                RD_IF_FREE(handle->cache[i].salt.ptr, rd_free);
+
+        mtx_destroy(&handle->lock);
+        OPENSSL_cleanse(handle, sizeof(*handle));
+        rd_free(handle);
+        rk->rk_sasl.handle = NULL;
+}
+
+
+
+
 const struct rd_kafka_sasl_provider rd_kafka_sasl_scram_provider = {
         .name          = "SCRAM (builtin)",
         .client_new    = rd_kafka_sasl_scram_client_new,
         .recv          = rd_kafka_sasl_scram_recv,
         .close         = rd_kafka_sasl_scram_close,
         .conf_validate = rd_kafka_sasl_scram_conf_validate,
+        .init          = rd_kafka_sasl_scram_init,
+        .term          = rd_kafka_sasl_scram_term,
 };
+
+
+
+/**
+ * @brief Verify SaltedPassword against the PBKDF2-HMAC-SHA1 test vectors
+ *        of RFC 6070, and that it is served from the cache.
+ */
+int unittest_scram (void) {
+        const char *confv[] = {
+                "security.protocol", "sasl_plaintext",
+                "sasl.mechanisms", "SCRAM-SHA-1",
+                "sasl.username", "user",
+                "sasl.password", "password",
+                NULL
+        };
+        rd_kafka_t *rk;
+        rd_kafka_broker_t *rkb;
+        struct rd_kafka_sasl_scram_handle *handle;
+        const rd_chariov_t password = { .ptr = "password", .size = 8 };
+        rd_chariov_t salt = { .ptr = "salt", .size = 4 };
+        rd_chariov_t out = { .ptr = rd_alloca(EVP_MAX_MD_SIZE) };
+        static const unsigned char exp_4096[] = {
+                0x4b, 0x00, 0x79, 0x01, 0xb7, 0x65, 0x48, 0x9a, 0xbe, 0xad,
+                0x49, 0xd9, 0x26, 0xf7, 0x21, 0xd0, 0x65, 0xa4, 0x29, 0xc1
+        };
+        static const unsigned char exp_2[] = {
+                0xea, 0x6c, 0x01, 0x4d, 0xc7, 0x2d, 0x6f, 0x8c, 0xcd, 0x1e,
+                0xd9, 0x2a, 0xce, 0x1d, 0x41, 0xf0, 0xd8, 0xde, 0x89, 0x57
+        };
+        char othersalt[16];
+        int i, r;
+
+        rk = rd_unittest_rk_new(RD_KAFKA_PRODUCER, confv);
+        RD_UT_ASSERT(rk, "failed to create instance");
+        rkb = rd_kafka_broker_internal(rk);
+        RD_UT_ASSERT(rkb, "no internal broker");
+        handle = rk->rk_sasl.handle;
+        RD_UT_ASSERT(handle, "no SCRAM handle");
+
+        /* Derived, then cached */
+        for (i = 0 ; i < 2 ; i++) {
+                r = rd_kafka_sasl_scram_SaltedPassword(rkb, &password, &salt,
+                                                       4096, &out);
+                RD_UT_ASSERT(!r && out.size == sizeof(exp_4096) &&
+                             !memcmp(out.ptr, exp_4096, sizeof(exp_4096)),
+                             "4096 iterations: wrong SaltedPassword "
+                             "(call #%d)", i);
+        }
+        RD_UT_ASSERT(handle->misses == 1 && handle->hits == 1,
+                     "expected 1 miss and 1 hit, not %d and %d",
+                     handle->misses, handle->hits);
+
+        /* The iteration count is part of the key */
+        r = rd_kafka_sasl_scram_SaltedPassword(rkb, &password, &salt,
+                                               2, &out);
+        RD_UT_ASSERT(!r && !memcmp(out.ptr, exp_2, sizeof(exp_2)),
+                     "2 iterations: wrong SaltedPassword");
+        RD_UT_ASSERT(handle->misses == 2, "expected a miss");
+
+        /* Other salts evict the oldest entry */
+        for (i = 0 ; i < RD_KAFKA_SASL_SCRAM_CACHE_SIZE - 1 ; i++) {
+                salt.size = rd_snprintf(othersalt, sizeof(othersalt),
+                                        "salt%d", i);
+                salt.ptr = othersalt;
+                r = rd_kafka_sasl_scram_SaltedPassword(rkb, &password, &salt,
+                                                       2, &out);
+                RD_UT_ASSERT(!r, "derivation failed");
+        }
+        RD_UT_ASSERT(handle->misses == 2 + RD_KAFKA_SASL_SCRAM_CACHE_SIZE - 1,
+                     "expected misses for other salts");
+
+        salt.ptr = "salt";
+        salt.size = 4;
+        r = rd_kafka_sasl_scram_SaltedPassword(rkb, &password, &salt,
+                                               4096, &out);
+        RD_UT_ASSERT(!r && !memcmp(out.ptr, exp_4096, sizeof(exp_4096)),
+                     "4096 iterations: wrong SaltedPassword after eviction");
+        RD_UT_ASSERT(handle->misses == 2 + RD_KAFKA_SASL_SCRAM_CACHE_SIZE &&
+                     handle->hits == 1,
+                     "expected the evicted entry to be derived again");
+
+        rd_kafka_broker_destroy(rkb);
+        rd_kafka_destroy(rk);
+
+        RD_UT_PASS();
+}
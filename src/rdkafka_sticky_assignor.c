@@ -0,0 +1,1304 @@
+/*
+ * librdkafka - The Apache Kafka C/C++ library
+ *
+ * Copyright (c) 2018 Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "rdkafka_int.h"
+#include "rdkafka_assignor.h"
+#include "rdports.h"  /* rd_qsort_r() */
+#include "rdunittest.h"
+
+
+/**
+ * Source: https://github.com/apache/kafka/blob/trunk/clients/src/main/java/org/apache/kafka/clients/consumer/StickyAssignor.java
+ *
+ * The sticky assignor serves two purposes. First, it guarantees an
+ * assignment that is as balanced as possible, meaning that the number of
+ * partitions assigned to consumers differ by at most one (when all
+ * consumers have identical subscriptions). Second, it preserves as many
+ * existing assignments as possible when a reassignment occurs, which
+ * avoids dropping fetched data and re-fetching committed offsets for
+ * partitions that end up with the same consumer anyway.
+ *
+ * Each member advertises its current assignment, and the generation it
+ * was received in, in the subscription UserData, using the same format
+ * as the Java StickyAssignor (version 1):
+ *
+ *   UserData => TopicPartitions Generation
+ *     TopicPartitions => [Topic [Partition]]
+ *       Topic     => string
+ *       Partition => int32
+ *     Generation => int32
+ *
+ * Version 0 user data (without Generation) is also accepted.
+ *
+ * The leader then:
+ *  1. lets every member keep the partitions it previously owned and still
+ *     subscribes to; if several members claim the same partition the
+ *     claim from the most recent generation wins,
+ *  2. assigns each remaining partition to the least loaded eligible
+ *     member, starting with the topics with the fewest eligible members,
+ *  3. moves partitions from members that have more than one partition
+ *     above the least loaded eligible member until no such move is
+ *     possible.
+ *
+ * For example, suppose there are three consumers C0, C1 and C2, with
+ * the same subscription to topic t0 with 6 partitions, and the current
+ * assignment is:
+ * C0: [t0p0, t0p1]
+ * C1: [t0p2, t0p3]
+ * C2: [t0p4, t0p5]
+ *
+ * When C1 leaves the group the assignment becomes:
+ * C0: [t0p0, t0p1, t0p2]
+ * C2: [t0p3, t0p4, t0p5]
+ *
+ * whereas the roundrobin assignor would reassign every partition.
+ *
+ * The cooperative-sticky assignor runs the same algorithm for the
+ * incremental cooperative rebalance protocol (KIP-429): members
+ * advertise their owned partitions in MemberMetadata v1 and only their
+ * generation (int32) in the UserData, as the Java CooperativeStickyAssignor
+ * does. A partition that moves from one member to another is left out
+ * of this generation's assignment altogether: its current owner sees it
+ * revoked and rejoins, and the partition is handed to its new owner in
+ * the following rebalance, once it has been released.
+ */
+
+
+/**
+ * @brief Per-partition assignment state.
+ */
+typedef struct rd_kafka_sticky_partition_s {
+        int     topic_idx;        /**< Index in rd_kafka_sticky_t.topics */
+        int32_t partition;
+        int     owner;            /**< Assigned member index, or -1 */
+        int     prev_owner;       /**< Previous owner (from the member
+                                   *   user data), or -1 */
+        int32_t prev_generation;  /**< Generation of the previous
+                                   *   owner's claim */
+        int     cur_owner;        /**< Current owner, eligible or not,
+                                   *   or -1 (cooperative) */
+        int32_t cur_generation;   /**< Generation of the current
+                                   *   owner's claim */
+} rd_kafka_sticky_partition_t;
+
+
+/**
+ * @brief Per-topic state.
+ */
+typedef struct rd_kafka_sticky_topic_s {
+        const rd_kafka_metadata_topic_t *metadata;
+        int  first;        /**< Index of the topic's first partition in
+                            *   rd_kafka_sticky_t.partitions */
+        int *members;      /**< Eligible member indices, sorted by
+                            *   member id rank */
+        int  member_cnt;
+} rd_kafka_sticky_topic_t;
+
+
+/**
+ * @brief Assignment run state.
+ */
+typedef struct rd_kafka_sticky_s {
+        rd_kafka_t *rk;
+        rd_kafka_group_member_t *members;
+        int member_cnt;
+        int *rank;           /**< Member index -> member id sort rank */
+        int *cnt;            /**< Member index -> assigned partitions */
+
+        rd_kafka_sticky_topic_t *topics;  /**< Sorted by topic name */
+        int topic_cnt;
+        int *topic_order;    /**< Topic indices, fewest eligible
+                              *   members first */
+
+        rd_kafka_sticky_partition_t *partitions;
+        int partition_cnt;
+
+        int cooperative;     /**< cooperative-sticky: ownership is read
+                              *   from the members' owned partitions */
+} rd_kafka_sticky_t;
+
+
+/**
+ * @brief Sort comparator for member indices by member id
+ *        (opaque is the member array).
+ */
+static int rd_kafka_sticky_member_idx_cmp (const void *_a, const void *_b,
+                                           void *opaque) {
+        const rd_kafka_group_member_t *members = opaque;
+        int a = *(const int *)_a, b = *(const int *)_b;
+
+        return rd_kafkap_str_cmp(members[a].rkgm_member_id,
+                                 members[b].rkgm_member_id);
+}
+
+/**
+ * @brief Sort comparator for member indices by rank (opaque is the
+ *        rank array).
+ */
+static int rd_kafka_sticky_member_rank_cmp (const void *_a, const void *_b,
+                                            void *opaque) {
+        const int *rank = opaque;
+        int a = *(const int *)_a, b = *(const int *)_b;
+
+        return rank[a] - rank[b];
+}
+
+/**
+ * @brief Sort comparator for eligible topics by name.
+ */
+static int rd_kafka_sticky_eligible_topic_cmp (const void *_a,
+                                               const void *_b) {
+        const rd_kafka_assignor_topic_t *a =
+                *(const rd_kafka_assignor_topic_t * const *)_a;
+        const rd_kafka_assignor_topic_t *b =
+                *(const rd_kafka_assignor_topic_t * const *)_b;
+
+        return strcmp(a->metadata->topic, b->metadata->topic);
+}
+
+/**
+ * @brief Sort comparator for topic indices by eligible member count,
+ *        then name (opaque is the rd_kafka_sticky_t).
+ */
+static int rd_kafka_sticky_topic_order_cmp (const void *_a, const void *_b,
+                                            void *opaque) {
+        const rd_kafka_sticky_t *st = opaque;
+        int a = *(const int *)_a, b = *(const int *)_b;
+
+        if (st->topics[a].member_cnt != st->topics[b].member_cnt)
+                return st->topics[a].member_cnt - st->topics[b].member_cnt;
+        return a - b;
+}
+
+
+/**
+ * @returns the index of \p topic in the sorted topic array, or -1.
+ */
+static int rd_kafka_sticky_topic_find (const rd_kafka_sticky_t *st,
+                                       const char *topic) {
+        int lo = 0, hi = st->topic_cnt - 1;
+
+        while (lo <= hi) {
+                int mid = (lo + hi) / 2;
+                int r = strcmp(topic, st->topics[mid].metadata->topic);
+                if (r == 0)
+                        return mid;
+                else if (r < 0)
+                        hi = mid - 1;
+                else
+                        lo = mid + 1;
+        }
+
+        return -1;
+}
+
+/**
+ * @returns true if member \p mi is eligible for topic \p ti.
+ */
+static int rd_kafka_sticky_member_eligible (const rd_kafka_sticky_t *st,
+                                            int ti, int mi) {
+        const rd_kafka_sticky_topic_t *t = &st->topics[ti];
+        int lo = 0, hi = t->member_cnt - 1;
+
+        while (lo <= hi) {
+                int mid = (lo + hi) / 2;
+                int r = st->rank[mi] - st->rank[t->members[mid]];
+                if (r == 0)
+                        return 1;
+                else if (r < 0)
+                        hi = mid - 1;
+                else
+                        lo = mid + 1;
+        }
+
+        return 0;
+}
+
+/**
+ * @returns the least loaded member eligible for topic \p ti, ties are
+ *          broken by member id.
+ */
+static int rd_kafka_sticky_least_loaded (const rd_kafka_sticky_t *st,
+                                         int ti) {
+        const rd_kafka_sticky_topic_t *t = &st->topics[ti];
+        int best = t->members[0];
+        int i;
+
+        for (i = 1 ; i < t->member_cnt && st->cnt[best] > 0 ; i++) {
+                int mi = t->members[i];
+                if (st->cnt[mi] < st->cnt[best])
+                        best = mi;
+        }
+
+        return best;
+}
+
+
+/**
+ * @brief Record member \p mi's claim, from generation \p generation, of
+ *        partition \p pi. If several members claim the same partition
+ *        the claim from the most recent generation wins.
+ */
+static void rd_kafka_sticky_claim (rd_kafka_sticky_t *st, int mi, int pi,
+                                   int32_t generation) {
+        rd_kafka_sticky_partition_t *p = &st->partitions[pi];
+
+        if (p->cur_owner == -1 || generation > p->cur_generation) {
+                p->cur_owner = mi;
+                p->cur_generation = generation;
+        }
+
+        if (!rd_kafka_sticky_member_eligible(st, p->topic_idx, mi))
+                return; /* No longer subscribed */
+
+        if (p->prev_owner != -1 && generation <= p->prev_generation)
+                return; /* Claimed by a more recent generation */
+
+        p->prev_owner = mi;
+        p->prev_generation = generation;
+}
+
+
+/**
+ * @brief Claim the owned partitions of cooperative member \p mi, the
+ *        user data holds the member's generation.
+ *
+ * @returns the number of owned partitions.
+ */
+static int rd_kafka_sticky_claim_owned (rd_kafka_sticky_t *st, int mi) {
+        const rd_kafka_group_member_t *rkgm = &st->members[mi];
+        int32_t generation = -1;
+        int i;
+
+        if (!rkgm->rkgm_owned)
+                return 0;
+
+        if (rkgm->rkgm_userdata &&
+            RD_KAFKAP_BYTES_LEN(rkgm->rkgm_userdata) >= 4) {
+                memcpy(&generation, rkgm->rkgm_userdata->data, 4);
+                generation = be32toh(generation);
+        }
+
+        for (i = 0 ; i < rkgm->rkgm_owned->cnt ; i++) {
+                const rd_kafka_topic_partition_t *rktpar =
+                        &rkgm->rkgm_owned->elems[i];
+                int ti = rd_kafka_sticky_topic_find(st, rktpar->topic);
+
+                if (ti == -1 || rktpar->partition < 0 ||
+                    rktpar->partition >=
+                    st->topics[ti].metadata->partition_cnt)
+                        continue;
+
+                rd_kafka_sticky_claim(st, mi,
+                                      st->topics[ti].first +
+                                      rktpar->partition, generation);
+        }
+
+        return rkgm->rkgm_owned->cnt;
+}
+
+
+/**
+ * @brief Parse member \p mi's user data and claim its previously owned
+ *        partitions that still exist.
+ *
+ * @returns the number of partitions in the user data, or -1 on
+ *          parse error.
+ */
+static int rd_kafka_sticky_claim_previous (rd_kafka_sticky_t *st, int mi) {
+        const rd_kafka_group_member_t *rkgm = &st->members[mi];
+        const int log_decode_errors = 0;
+        rd_kafka_buf_t *rkbuf;
+        int32_t TopicCnt;
+        int32_t Generation = -1;
+        int *claimed = NULL;
+        int claimed_cnt = 0, claimed_size = 0;
+        int total = 0;
+        int i;
+
+        if (st->cooperative)
+                return rd_kafka_sticky_claim_owned(st, mi);
+
+        if (!rkgm->rkgm_userdata ||
+            RD_KAFKAP_BYTES_LEN(rkgm->rkgm_userdata) == 0)
+                return 0;
+
+        rkbuf = rd_kafka_buf_new_shadow(rkgm->rkgm_userdata->data,
+                                        RD_KAFKAP_BYTES_LEN(rkgm->
+                                                            rkgm_userdata),
+                                        NULL);
+
+        rd_kafka_buf_read_i32(rkbuf, &TopicCnt);
+        if (TopicCnt < 0 || TopicCnt > 100000)
+                goto err_parse;
+
+        while (TopicCnt-- > 0) {
+                rd_kafkap_str_t Topic;
+                int32_t PartCnt;
+                char *topic;
+                int ti;
+
+                rd_kafka_buf_read_str(rkbuf, &Topic);
+                rd_kafka_buf_read_i32(rkbuf, &PartCnt);
+                if (PartCnt < 0 || PartCnt > 1000000)
+                        goto err_parse;
+
+                RD_KAFKAP_STR_DUPA(&topic, &Topic);
+                ti = rd_kafka_sticky_topic_find(st, topic);
+
+                while (PartCnt-- > 0) {
+                        int32_t Partition;
+
+                        rd_kafka_buf_read_i32(rkbuf, &Partition);
+                        total++;
+
+                        if (ti == -1 || Partition < 0 ||
+                            Partition >=
+                            st->topics[ti].metadata->partition_cnt)
+                                continue;
+
+                        if (claimed_cnt == claimed_size) {
+                                claimed_size = claimed_size ?
+                                        claimed_size * 2 : 32;
+                                claimed = rd_realloc(claimed,
+                                                     sizeof(*claimed) *
+                                                     claimed_size);
+                        }
+                        claimed[claimed_cnt++] =
+                                st->topics[ti].first + Partition;
+                }
+        }
+
+        /* Version 1 */
+        if (rd_kafka_buf_read_remain(rkbuf) >= 4)
+                rd_kafka_buf_read_i32(rkbuf, &Generation);
+
+        rd_kafka_buf_destroy(rkbuf);
+
+        for (i = 0 ; i < claimed_cnt ; i++)
+                rd_kafka_sticky_claim(st, mi, claimed[i], Generation);
+
+        if (claimed)
+                rd_free(claimed);
+
+        return total;
+
+ err_parse:
+        rd_kafka_buf_destroy(rkbuf);
+        if (claimed)
+                rd_free(claimed);
+
+        rd_kafka_dbg(st->rk, CGRP, "STICKY",
+                     "sticky: ignoring unparsable user data "
+                     "from member \"%.*s\"",
+                     RD_KAFKAP_STR_PR(rkgm->rkgm_member_id));
+        return -1;
+}
+
+
+/**
+ * @brief Move partition \p p to member \p mi.
+ */
+static RD_INLINE void rd_kafka_sticky_move (rd_kafka_sticky_t *st,
+                                            rd_kafka_sticky_partition_t *p,
+                                            int mi) {
+        if (p->owner != -1)
+                st->cnt[p->owner]--;
+        p->owner = mi;
+        st->cnt[mi]++;
+}
+
+
+/**
+ * @brief Run the sticky assignment, see the description at the top
+ *        of this file.
+ */
+static void rd_kafka_sticky_assign (rd_kafka_t *rk,
+                                    rd_kafka_group_member_t *members,
+                                    size_t member_cnt,
+                                    rd_kafka_assignor_topic_t
+                                    **eligible_topics,
+                                    size_t eligible_topic_cnt,
+                                    int cooperative) {
+        rd_kafka_sticky_t st = RD_ZERO_INIT;
+        int *order;
+        int i, j, ti, pi;
+        int retained = 0, withheld = 0, moved = 0, passes = 0;
+
+        if (member_cnt == 0 || eligible_topic_cnt == 0)
+                return;
+
+        st.rk          = rk;
+        st.cooperative = cooperative;
+        st.members    = members;
+        st.member_cnt = (int)member_cnt;
+        st.rank       = rd_malloc(sizeof(*st.rank) * member_cnt);
+        st.cnt        = rd_calloc(member_cnt, sizeof(*st.cnt));
+
+        /* Rank members by member id for deterministic tie-breaking.
+         * The members array itself is not sorted since the eligible
+         * topics' member lists point into it. */
+        order = rd_malloc(sizeof(*order) * member_cnt);
+        for (i = 0 ; i < st.member_cnt ; i++)
+                order[i] = i;
+        rd_qsort_r(order, member_cnt, sizeof(*order),
+                   rd_kafka_sticky_member_idx_cmp, members);
+        for (i = 0 ; i < st.member_cnt ; i++)
+                st.rank[order[i]] = i;
+        rd_free(order);
+
+        /* Sort topics by name and lay out all partitions */
+        qsort(eligible_topics, eligible_topic_cnt, sizeof(*eligible_topics),
+              rd_kafka_sticky_eligible_topic_cmp);
+
+        st.topic_cnt   = (int)eligible_topic_cnt;
+        st.topics      = rd_calloc(eligible_topic_cnt, sizeof(*st.topics));
+        st.topic_order = rd_malloc(sizeof(*st.topic_order) *
+                                   eligible_topic_cnt);
+
+        for (ti = 0 ; ti < st.topic_cnt ; ti++) {
+                rd_kafka_sticky_topic_t *t = &st.topics[ti];
+                const rd_kafka_group_member_t *rkgm;
+
+                t->metadata   = eligible_topics[ti]->metadata;
+                t->first      = st.partition_cnt;
+                t->member_cnt = rd_list_cnt(&eligible_topics[ti]->members);
+                t->members    = rd_malloc(sizeof(*t->members) *
+                                          RD_MAX(t->member_cnt, 1));
+                RD_LIST_FOREACH(rkgm, &eligible_topics[ti]->members, j)
+                        t->members[j] = (int)(rkgm - members);
+                rd_qsort_r(t->members, t->member_cnt, sizeof(*t->members),
+                           rd_kafka_sticky_member_rank_cmp, st.rank);
+
+                st.partition_cnt += t->metadata->partition_cnt;
+                st.topic_order[ti] = ti;
+        }
+
+        rd_qsort_r(st.topic_order, st.topic_cnt, sizeof(*st.topic_order),
+                   rd_kafka_sticky_topic_order_cmp, &st);
+
+        st.partitions = rd_malloc(sizeof(*st.partitions) *
+                                  RD_MAX(st.partition_cnt, 1));
+        for (ti = 0 ; ti < st.topic_cnt ; ti++) {
+                for (j = 0 ; j < st.topics[ti].metadata->partition_cnt ; j++) {
+                        rd_kafka_sticky_partition_t *p =
+                                &st.partitions[st.topics[ti].first + j];
+                        p->topic_idx       = ti;
+                        p->partition       = j;
+                        p->owner           = -1;
+                        p->prev_owner      = -1;
+                        p->prev_generation = -1;
+                        p->cur_owner       = -1;
+                        p->cur_generation  = -1;
+                }
+        }
+
+        /* 1. Retain previously owned partitions */
+        for (i = 0 ; i < st.member_cnt ; i++)
+                rd_kafka_sticky_claim_previous(&st, i);
+
+        for (pi = 0 ; pi < st.partition_cnt ; pi++) {
+                rd_kafka_sticky_partition_t *p = &st.partitions[pi];
+                if (p->prev_owner != -1)
+                        rd_kafka_sticky_move(&st, p, p->prev_owner);
+        }
+
+        /* 2. Assign the remaining partitions to the least loaded
+         *    eligible member, most constrained topics first. */
+        for (i = 0 ; i < st.topic_cnt ; i++) {
+                const rd_kafka_sticky_topic_t *t;
+
+                ti = st.topic_order[i];
+                t = &st.topics[ti];
+
+                if (t->member_cnt == 0)
+                        continue;
+
+                for (j = 0 ; j < t->metadata->partition_cnt ; j++) {
+                        rd_kafka_sticky_partition_t *p =
+                                &st.partitions[t->first + j];
+                        if (p->owner == -1)
+                                rd_kafka_sticky_move(
+                                        &st, p,
+                                        rd_kafka_sticky_least_loaded(&st,
+                                                                     ti));
+                }
+        }
+
+        /* 3. Balance: move partitions away from members that have more
+         *    than one partition more than the least loaded eligible
+         *    member. Each move strictly decreases the sum of squared
+         *    member loads so this terminates. */
+        do {
+                moved = 0;
+                passes++;
+
+                for (i = 0 ; i < st.topic_cnt ; i++) {
+                        const rd_kafka_sticky_topic_t *t;
+
+                        ti = st.topic_order[i];
+                        t = &st.topics[ti];
+
+                        if (t->member_cnt < 2)
+                                continue;
+
+                        for (j = 0 ; j < t->metadata->partition_cnt ; j++) {
+                                rd_kafka_sticky_partition_t *p =
+                                        &st.partitions[t->first + j];
+                                int mi = rd_kafka_sticky_least_loaded(&st,
+                                                                      ti);
+
+                                if (st.cnt[p->owner] > st.cnt[mi] + 1) {
+                                        rd_kafka_sticky_move(&st, p, mi);
+                                        moved++;
+                                }
+                        }
+                }
+        } while (moved > 0);
+
+        /* Write the assignment */
+        for (pi = 0 ; pi < st.partition_cnt ; pi++) {
+                const rd_kafka_sticky_partition_t *p = &st.partitions[pi];
+
+                if (p->owner == -1)
+                        continue;
+
+                if (p->owner == p->prev_owner)
+                        retained++;
+                else if (st.cooperative && p->cur_owner != -1 &&
+                         p->cur_owner != p->owner) {
+                        /* Still owned by another member: it must be
+                         * revoked by that member before it can be
+                         * assigned to its new owner. */
+                        withheld++;
+                        continue;
+                }
+
+                rd_kafka_topic_partition_list_add(
+                        members[p->owner].rkgm_assignment,
+                        st.topics[p->topic_idx].metadata->topic,
+                        p->partition);
+        }
+
+        rd_kafka_dbg(rk, CGRP, "ASSIGN",
+                     "%ssticky: assigned %d partition(s) to %d member(s), "
+                     "%d partition(s) retained their previous owner, "
+                     "%d withheld until revoked by their current owner "
+                     "(%d balancing pass(es))",
+                     st.cooperative ? "cooperative-" : "",
+                     st.partition_cnt - withheld, st.member_cnt, retained,
+                     withheld, passes);
+
+        for (ti = 0 ; ti < st.topic_cnt ; ti++)
+                rd_free(st.topics[ti].members);
+        rd_free(st.topics);
+        rd_free(st.topic_order);
+        rd_free(st.partitions);
+        rd_free(st.rank);
+        rd_free(st.cnt);
+}
+
+
+rd_kafka_resp_err_t
+rd_kafka_sticky_assignor_assign_cb (rd_kafka_t *rk,
+                                    const char *member_id,
+                                    const char *protocol_name,
+                                    const rd_kafka_metadata_t *metadata,
+                                    rd_kafka_group_member_t *members,
+                                    size_t member_cnt,
+                                    rd_kafka_assignor_topic_t
+                                    **eligible_topics,
+                                    size_t eligible_topic_cnt,
+                                    char *errstr, size_t errstr_size,
+                                    void *opaque) {
+        rd_kafka_sticky_assign(rk, members, member_cnt,
+                               eligible_topics, eligible_topic_cnt,
+                               0/*eager*/);
+        return RD_KAFKA_RESP_ERR_NO_ERROR;
+}
+
+
+rd_kafka_resp_err_t
+rd_kafka_cooperative_sticky_assignor_assign_cb (
+        rd_kafka_t *rk,
+        const char *member_id,
+        const char *protocol_name,
+        const rd_kafka_metadata_t *metadata,
+        rd_kafka_group_member_t *members,
+        size_t member_cnt,
+        rd_kafka_assignor_topic_t **eligible_topics,
+        size_t eligible_topic_cnt,
+        char *errstr, size_t errstr_size,
+        void *opaque) {
+        rd_kafka_sticky_assign(rk, members, member_cnt,
+                               eligible_topics, eligible_topic_cnt,
+                               1/*cooperative*/);
+        return RD_KAFKA_RESP_ERR_NO_ERROR;
+}
+
+
+/**
+ * @brief Serialize the sticky assignor user data for \p owned_partitions.
+ *
+ * @returns a newly allocated buffer of \p *lenp bytes.
+ */
+static void *
+rd_kafka_sticky_assignor_userdata_new (const rd_kafka_topic_partition_list_t
+                                       *owned_partitions,
+                                       int32_t owned_generation_id,
+                                       size_t *lenp) {
+        rd_kafka_topic_partition_list_t *sorted;
+        rd_kafka_buf_t *rkbuf;
+        const char *last_topic = NULL;
+        size_t of_TopicCnt, of_PartCnt = 0;
+        int topic_cnt = 0, part_cnt = 0;
+        void *userdata;
+        int i;
+
+        sorted = rd_kafka_topic_partition_list_copy(owned_partitions);
+        rd_kafka_topic_partition_list_sort_by_topic(sorted);
+
+        rkbuf = rd_kafka_buf_new(1, 8 + (sorted->cnt * 4) + (100 * 4));
+
+        of_TopicCnt = rd_kafka_buf_write_i32(rkbuf, 0); /* updated later */
+        for (i = 0 ; i < sorted->cnt ; i++) {
+                const rd_kafka_topic_partition_t *rktpar = &sorted->elems[i];
+
+                if (!last_topic || strcmp(last_topic, rktpar->topic)) {
+                        if (last_topic)
+                                rd_kafka_buf_update_i32(rkbuf, of_PartCnt,
+                                                        part_cnt);
+                        rd_kafka_buf_write_str(rkbuf, rktpar->topic, -1);
+                        of_PartCnt = rd_kafka_buf_write_i32(rkbuf, 0);
+                        part_cnt = 0;
+                        topic_cnt++;
+                        last_topic = rktpar->topic;
+                }
+
+                rd_kafka_buf_write_i32(rkbuf, rktpar->partition);
+                part_cnt++;
+        }
+
+        if (last_topic)
+                rd_kafka_buf_update_i32(rkbuf, of_PartCnt, part_cnt);
+        rd_kafka_buf_update_i32(rkbuf, of_TopicCnt, topic_cnt);
+
+        /* Version 1 */
+        rd_kafka_buf_write_i32(rkbuf, owned_generation_id);
+
+        rd_slice_init_full(&rkbuf->rkbuf_reader, &rkbuf->rkbuf_buf);
+        *lenp = rd_slice_remains(&rkbuf->rkbuf_reader);
+        userdata = rd_malloc(*lenp);
+        rd_slice_read(&rkbuf->rkbuf_reader, userdata, *lenp);
+
+        rd_kafka_buf_destroy(rkbuf);
+        rd_kafka_topic_partition_list_destroy(sorted);
+
+        return userdata;
+}
+
+
+/**
+ * @brief MemberMetadata with the previously owned partitions as
+ *        user data.
+ */
+rd_kafkap_bytes_t *
+rd_kafka_sticky_assignor_get_metadata (rd_kafka_assignor_t *rkas,
+                                       const rd_list_t *topics,
+                                       const rd_kafka_topic_partition_list_t
+                                       *owned_partitions,
+                                       int32_t owned_generation_id) {
+        rd_kafkap_bytes_t *metadata;
+        void *userdata;
+        size_t len;
+
+        if (!owned_partitions || owned_partitions->cnt == 0)
+                return rd_kafka_consumer_protocol_member_metadata_new(
+                        topics, NULL, 0, NULL);
+
+        userdata = rd_kafka_sticky_assignor_userdata_new(owned_partitions,
+                                                         owned_generation_id,
+                                                         &len);
+        metadata = rd_kafka_consumer_protocol_member_metadata_new(
+                topics, userdata, len, NULL);
+        rd_free(userdata);
+
+        return metadata;
+}
+
+
+/**
+ * @brief MemberMetadata v1 with the owned partitions and the generation
+ *        they were assigned in as user data.
+ */
+rd_kafkap_bytes_t *
+rd_kafka_cooperative_sticky_assignor_get_metadata (
+        rd_kafka_assignor_t *rkas,
+        const rd_list_t *topics,
+        const rd_kafka_topic_partition_list_t *owned_partitions,
+        int32_t owned_generation_id) {
+        rd_kafka_topic_partition_list_t *empty = NULL;
+        rd_kafkap_bytes_t *metadata;
+        int32_t generation = htobe32(owned_generation_id);
+
+        if (!owned_partitions)
+                owned_partitions = empty =
+                        rd_kafka_topic_partition_list_new(0);
+
+        metadata = rd_kafka_consumer_protocol_member_metadata_new(
+                topics, &generation, sizeof(generation), owned_partitions);
+
+        if (empty)
+                rd_kafka_topic_partition_list_destroy(empty);
+
+        return metadata;
+}
+
+
+
+/**
+ * @name Unit tests
+ * @{
+ */
+
+/**
+ * @brief Create \p member_cnt members subscribing to the first
+ *        \p sub_cnt topics of \p md.
+ */
+static rd_kafka_group_member_t *
+ut_sticky_members_new (const rd_kafka_metadata_t *md, int member_cnt,
+                       int sub_cnt, int id_base) {
+        rd_kafka_group_member_t *members =
+                rd_calloc(member_cnt, sizeof(*members));
+        int i, j;
+
+        for (i = 0 ; i < member_cnt ; i++) {
+                char id[32];
+
+                rd_snprintf(id, sizeof(id), "consumer-%05d", id_base + i);
+                members[i].rkgm_member_id = rd_kafkap_str_new(id, -1);
+                members[i].rkgm_subscription =
+                        rd_kafka_topic_partition_list_new(sub_cnt);
+                for (j = 0 ; j < sub_cnt ; j++)
+                        rd_kafka_topic_partition_list_add(
+                                members[i].rkgm_subscription,
+                                md->topics[j].topic, RD_KAFKA_PARTITION_UA);
+                members[i].rkgm_assignment =
+                        rd_kafka_topic_partition_list_new(0);
+                rd_list_init(&members[i].rkgm_eligible, 0, NULL);
+        }
+
+        return members;
+}
+
+static void ut_sticky_members_destroy (rd_kafka_group_member_t *members,
+                                       int member_cnt) {
+        int i;
+        for (i = 0 ; i < member_cnt ; i++)
+                rd_kafka_group_member_clear(&members[i]);
+        rd_free(members);
+}
+
+/**
+ * @brief Turn each member's assignment into its user data and clear the
+ *        assignment, as for the next rebalance.
+ */
+static void ut_sticky_members_rejoin (rd_kafka_group_member_t *members,
+                                      int member_cnt, int32_t generation) {
+        int i;
+
+        for (i = 0 ; i < member_cnt ; i++) {
+                rd_kafka_group_member_t *rkgm = &members[i];
+                void *userdata;
+                size_t len;
+
+                if (rkgm->rkgm_userdata)
+                        rd_kafkap_bytes_destroy(rkgm->rkgm_userdata);
+                userdata = rd_kafka_sticky_assignor_userdata_new(
+                        rkgm->rkgm_assignment, generation, &len);
+                rkgm->rkgm_userdata = rd_kafkap_bytes_new(userdata,
+                                                          (int32_t)len);
+                rd_free(userdata);
+
+                rd_kafka_topic_partition_list_destroy(rkgm->rkgm_assignment);
+                rkgm->rkgm_assignment = rd_kafka_topic_partition_list_new(0);
+        }
+}
+
+/**
+ * @brief As ut_sticky_members_rejoin() but for the cooperative protocol:
+ *        each member's assignment becomes its owned partitions and the
+ *        user data its \p generation.
+ */
+static void
+ut_sticky_members_rejoin_cooperative (rd_kafka_group_member_t *members,
+                                      int member_cnt, int32_t generation) {
+        int i;
+
+        for (i = 0 ; i < member_cnt ; i++) {
+                rd_kafka_group_member_t *rkgm = &members[i];
+                int32_t be_generation = htobe32(generation);
+
+                if (rkgm->rkgm_userdata)
+                        rd_kafkap_bytes_destroy(rkgm->rkgm_userdata);
+                rkgm->rkgm_userdata = rd_kafkap_bytes_new(
+                        (const char *)&be_generation,
+                        (int32_t)sizeof(be_generation));
+
+                if (rkgm->rkgm_owned)
+                        rd_kafka_topic_partition_list_destroy(
+                                rkgm->rkgm_owned);
+                rkgm->rkgm_owned = rkgm->rkgm_assignment;
+                rkgm->rkgm_assignment = rd_kafka_topic_partition_list_new(0);
+        }
+}
+
+/**
+ * @brief Run the sticky (or cooperative-sticky if \p cooperative)
+ *        assignor for \p members on \p md.
+ */
+static void ut_sticky_assign0 (rd_kafka_t *rk, const rd_kafka_metadata_t *md,
+                               rd_kafka_group_member_t *members,
+                               int member_cnt, int cooperative) {
+        rd_list_t eligible;
+        int ti, i;
+        char errstr[64];
+
+        rd_list_init(&eligible, md->topic_cnt, NULL);
+        for (ti = 0 ; ti < md->topic_cnt ; ti++) {
+                rd_kafka_assignor_topic_t *at = rd_calloc(1, sizeof(*at));
+
+                at->metadata = &md->topics[ti];
+                rd_list_init(&at->members, member_cnt, NULL);
+                for (i = 0 ; i < member_cnt ; i++)
+                        if (rd_kafka_group_member_find_subscription(
+                                    rk, &members[i], md->topics[ti].topic))
+                                rd_list_add(&at->members, &members[i]);
+                rd_list_add(&eligible, at);
+        }
+
+        if (cooperative)
+                rd_kafka_cooperative_sticky_assignor_assign_cb(
+                        rk, "", "cooperative-sticky", md, members, member_cnt,
+                        (rd_kafka_assignor_topic_t **)eligible.rl_elems,
+                        eligible.rl_cnt, errstr, sizeof(errstr), NULL);
+        else
+                rd_kafka_sticky_assignor_assign_cb(
+                        rk, "", "sticky", md, members, member_cnt,
+                        (rd_kafka_assignor_topic_t **)eligible.rl_elems,
+                        eligible.rl_cnt, errstr, sizeof(errstr), NULL);
+
+        for (ti = 0 ; ti < rd_list_cnt(&eligible) ; ti++) {
+                rd_kafka_assignor_topic_t *at = rd_list_elem(&eligible, ti);
+                rd_list_destroy(&at->members);
+                rd_free(at);
+        }
+        rd_list_destroy(&eligible);
+}
+
+#define ut_sticky_assign(rk,md,members,member_cnt)                      \
+        ut_sticky_assign0(rk, md, members, member_cnt, 0/*eager*/)
+
+/**
+ * @brief Verify that every partition in \p md is assigned exactly once
+ *        and that member loads differ by at most \p max_skew.
+ */
+static int ut_sticky_verify (const rd_kafka_metadata_t *md,
+                             const rd_kafka_group_member_t *members,
+                             int member_cnt, int max_skew) {
+        int ti, i, j;
+        int total = 0, assigned = 0;
+        int min_cnt = INT_MAX, max_cnt = 0;
+        char **seen;
+
+        seen = rd_calloc(md->topic_cnt, sizeof(*seen));
+        for (ti = 0 ; ti < md->topic_cnt ; ti++) {
+                seen[ti] = rd_calloc(md->topics[ti].partition_cnt, 1);
+                total += md->topics[ti].partition_cnt;
+        }
+
+        for (i = 0 ; i < member_cnt ; i++) {
+                const rd_kafka_topic_partition_list_t *a =
+                        members[i].rkgm_assignment;
+
+                min_cnt = RD_MIN(min_cnt, a->cnt);
+                max_cnt = RD_MAX(max_cnt, a->cnt);
+
+                for (j = 0 ; j < a->cnt ; j++) {
+                        for (ti = 0 ; ti < md->topic_cnt ; ti++)
+                                if (!strcmp(md->topics[ti].topic,
+                                            a->elems[j].topic))
+                                        break;
+                        RD_UT_ASSERT(ti < md->topic_cnt &&
+                                     !seen[ti][a->elems[j].partition],
+                                     "%s [%"PRId32"] assigned twice "
+                                     "or unknown",
+                                     a->elems[j].topic,
+                                     a->elems[j].partition);
+                        seen[ti][a->elems[j].partition] = 1;
+                        assigned++;
+                }
+        }
+
+        for (ti = 0 ; ti < md->topic_cnt ; ti++)
+                rd_free(seen[ti]);
+        rd_free(seen);
+
+        RD_UT_ASSERT(assigned == total,
+                     "expected %d assigned partitions, not %d",
+                     total, assigned);
+        RD_UT_ASSERT(max_cnt - min_cnt <= max_skew,
+                     "unbalanced assignment: min %d, max %d partitions",
+                     min_cnt, max_cnt);
+
+        return 0;
+}
+
+/**
+ * @returns the number of partitions in \p members' assignments that were
+ *          not in their previous user data.
+ */
+static int ut_sticky_moved (const rd_kafka_group_member_t *members,
+                            int member_cnt) {
+        int i, j, moved = 0;
+
+        for (i = 0 ; i < member_cnt ; i++) {
+                const rd_kafka_group_member_t *rkgm = &members[i];
+                rd_kafka_topic_partition_list_t *prev =
+                        rd_kafka_topic_partition_list_new(0);
+                rd_kafka_buf_t *rkbuf;
+                const int log_decode_errors = 0;
+                int32_t TopicCnt;
+
+                if (rkgm->rkgm_userdata) {
+                        rkbuf = rd_kafka_buf_new_shadow(
+                                rkgm->rkgm_userdata->data,
+                                RD_KAFKAP_BYTES_LEN(rkgm->rkgm_userdata),
+                                NULL);
+                        rd_kafka_buf_read_i32(rkbuf, &TopicCnt);
+                        while (TopicCnt-- > 0) {
+                                rd_kafkap_str_t Topic;
+                                int32_t PartCnt, Partition;
+                                char *topic;
+
+                                rd_kafka_buf_read_str(rkbuf, &Topic);
+                                RD_KAFKAP_STR_DUPA(&topic, &Topic);
+                                rd_kafka_buf_read_i32(rkbuf, &PartCnt);
+                                while (PartCnt-- > 0) {
+                                        rd_kafka_buf_read_i32(rkbuf,
+                                                              &Partition);
+                                        rd_kafka_topic_partition_list_add(
+                                                prev, topic, Partition);
+                                }
+                        }
+                err_parse:
+                        rd_kafka_buf_destroy(rkbuf);
+                }
+
+                for (j = 0 ; j < rkgm->rkgm_assignment->cnt ; j++)
+                        if (!rd_kafka_topic_partition_list_find(
+                                    prev,
+                                    rkgm->rkgm_assignment->elems[j].topic,
+                                    rkgm->rkgm_assignment->elems[j].
+                                    partition))
+                                moved++;
+
+                rd_kafka_topic_partition_list_destroy(prev);
+        }
+
+        return moved;
+}
+
+/**
+ * @brief Create metadata with \p topic_cnt topics with the given
+ *        partition counts.
+ */
+static rd_kafka_metadata_t *ut_sticky_metadata_new (int topic_cnt,
+                                                    const int *partition_cnt) {
+        rd_kafka_metadata_t *md = rd_calloc(1, sizeof(*md));
+        int ti;
+
+        md->topic_cnt = topic_cnt;
+        md->topics = rd_calloc(topic_cnt, sizeof(*md->topics));
+        for (ti = 0 ; ti < topic_cnt ; ti++) {
+                char name[32];
+                rd_snprintf(name, sizeof(name), "topic%d", ti);
+                md->topics[ti].topic = rd_strdup(name);
+                md->topics[ti].partition_cnt = partition_cnt[ti];
+        }
+
+        return md;
+}
+
+static void ut_sticky_metadata_destroy (rd_kafka_metadata_t *md) {
+        int ti;
+        for (ti = 0 ; ti < md->topic_cnt ; ti++)
+                rd_free(md->topics[ti].topic);
+        rd_free(md->topics);
+        rd_free(md);
+}
+
+
+/**
+ * @brief Members joining and leaving, conflicting claims and
+ *        differing subscriptions.
+ */
+static int ut_sticky_basic (rd_kafka_t *rk) {
+        static const int pcnts[] = { 10, 5 };
+        rd_kafka_metadata_t *md = ut_sticky_metadata_new(2, pcnts);
+        rd_kafka_group_member_t *members, *m4;
+        rd_kafka_topic_partition_list_t *owned;
+        void *userdata;
+        size_t len;
+        int moved, departed_cnt, j;
+
+        /* Three members, initial assignment */
+        members = ut_sticky_members_new(md, 3, 2, 0);
+        ut_sticky_assign(rk, md, members, 3);
+        if (ut_sticky_verify(md, members, 3, 0))
+                return 1;
+
+        /* A fourth member joins: only the partitions it gets move */
+        ut_sticky_members_rejoin(members, 3, 1);
+        m4 = ut_sticky_members_new(md, 1, 2, 3);
+        members = rd_realloc(members, sizeof(*members) * 4);
+        members[3] = m4[0];
+        rd_free(m4);
+        ut_sticky_assign(rk, md, members, 4);
+        if (ut_sticky_verify(md, members, 4, 1))
+                return 1;
+        moved = ut_sticky_moved(members, 4);
+        RD_UT_ASSERT(moved == members[3].rkgm_assignment->cnt &&
+                     moved == 3,
+                     "expected only the new member's 3 partitions to move, "
+                     "not %d", moved);
+
+        /* The first member leaves: the others keep what they had */
+        departed_cnt = members[0].rkgm_assignment->cnt;
+        ut_sticky_members_rejoin(members, 4, 2);
+        rd_kafka_group_member_clear(&members[0]);
+        ut_sticky_assign(rk, md, members+1, 3);
+        if (ut_sticky_verify(md, members+1, 3, 0))
+                return 1;
+        moved = ut_sticky_moved(members+1, 3);
+        RD_UT_ASSERT(moved == departed_cnt,
+                     "expected the departed member's %d partitions to move, "
+                     "not %d", departed_cnt, moved);
+
+        /* Conflicting claims: the most recent generation wins.
+         * Member 1 claims member 2's partitions from an older
+         * generation. */
+        owned = rd_kafka_topic_partition_list_copy(
+                members[2].rkgm_assignment);
+        ut_sticky_members_rejoin(members+1, 3, 3);
+        rd_kafkap_bytes_destroy(members[1].rkgm_userdata);
+        userdata = rd_kafka_sticky_assignor_userdata_new(owned, 2, &len);
+        members[1].rkgm_userdata = rd_kafkap_bytes_new(userdata,
+                                                       (int32_t)len);
+        rd_free(userdata);
+        ut_sticky_assign(rk, md, members+1, 3);
+        if (ut_sticky_verify(md, members+1, 3, 0))
+                return 1;
+        RD_UT_ASSERT(members[2].rkgm_assignment->cnt == owned->cnt,
+                     "member 2 should keep its %d partitions, not %d",
+                     owned->cnt, members[2].rkgm_assignment->cnt);
+        for (j = 0 ; j < owned->cnt ; j++)
+                RD_UT_ASSERT(rd_kafka_topic_partition_list_find(
+                                     members[2].rkgm_assignment,
+                                     owned->elems[j].topic,
+                                     owned->elems[j].partition),
+                             "stale claim won %s [%"PRId32"]",
+                             owned->elems[j].topic,
+                             owned->elems[j].partition);
+        rd_kafka_topic_partition_list_destroy(owned);
+        ut_sticky_members_destroy(members, 4); /* [0] already cleared */
+
+        /* Differing subscriptions: member 0 only subscribes to topic0,
+         * topic1 must go to member 1 and topic0 is split 7/3 to
+         * balance the total load. */
+        members = ut_sticky_members_new(md, 2, 2, 0);
+        rd_kafka_topic_partition_list_destroy(members[0].rkgm_subscription);
+        members[0].rkgm_subscription = rd_kafka_topic_partition_list_new(1);
+        rd_kafka_topic_partition_list_add(members[0].rkgm_subscription,
+                                          "topic0", RD_KAFKA_PARTITION_UA);
+        ut_sticky_assign(rk, md, members, 2);
+        if (ut_sticky_verify(md, members, 2, 1))
+                return 1;
+        RD_UT_ASSERT(members[0].rkgm_assignment->cnt == 7 ||
+                     members[0].rkgm_assignment->cnt == 8,
+                     "member 0 should get 7 or 8 partitions, not %d",
+                     members[0].rkgm_assignment->cnt);
+        ut_sticky_members_destroy(members, 2);
+
+        /* Garbage user data is ignored */
+        members = ut_sticky_members_new(md, 2, 2, 0);
+        members[0].rkgm_userdata = rd_kafkap_bytes_new("\x00\x00\x00\x05",
+                                                       4);
+        ut_sticky_assign(rk, md, members, 2);
+        if (ut_sticky_verify(md, members, 2, 1))
+                return 1;
+        ut_sticky_members_destroy(members, 2);
+
+        ut_sticky_metadata_destroy(md);
+
+        return 0;
+}
+
+
+/**
+ * @brief Cooperative protocol: partitions changing owner are withheld
+ *        until their current owner has revoked them.
+ */
+static int ut_sticky_cooperative (rd_kafka_t *rk) {
+        static const int pcnts[] = { 10, 5 };
+        rd_kafka_metadata_t *md = ut_sticky_metadata_new(2, pcnts);
+        rd_kafka_group_member_t *members, *m4;
+        int i, j, assigned = 0, revoked = 0;
+
+        /* Three members, initial assignment */
+        members = ut_sticky_members_new(md, 3, 2, 0);
+        ut_sticky_assign0(rk, md, members, 3, 1/*cooperative*/);
+        if (ut_sticky_verify(md, members, 3, 0))
+                return 1;
+
+        /* A fourth member joins: first rebalance must not hand it
+         * any partition still owned by another member. */
+        ut_sticky_members_rejoin_cooperative(members, 3, 1);
+        m4 = ut_sticky_members_new(md, 1, 2, 3);
+        members = rd_realloc(members, sizeof(*members) * 4);
+        members[3] = m4[0];
+        rd_free(m4);
+        ut_sticky_assign0(rk, md, members, 4, 1/*cooperative*/);
+
+        RD_UT_ASSERT(members[3].rkgm_assignment->cnt == 0,
+                     "new member should get no partitions in the first "
+                     "rebalance, not %d", members[3].rkgm_assignment->cnt);
+        for (i = 0 ; i < 3 ; i++) {
+                const rd_kafka_topic_partition_list_t *a =
+                        members[i].rkgm_assignment;
+
+                /* Retained partitions only, nothing new */
+                for (j = 0 ; j < a->cnt ; j++)
+                        RD_UT_ASSERT(rd_kafka_topic_partition_list_find(
+                                             members[i].rkgm_owned,
+                                             a->elems[j].topic,
+                                             a->elems[j].partition),
+                                     "member %d got %s [%"PRId32"] "
+                                     "it did not own", i,
+                                     a->elems[j].topic,
+                                     a->elems[j].partition);
+                assigned += a->cnt;
+                revoked += members[i].rkgm_owned->cnt - a->cnt;
+        }
+        RD_UT_ASSERT(revoked == 3 && assigned == 12,
+                     "expected 3 partitions to be revoked and 12 retained, "
+                     "not %d and %d", revoked, assigned);
+
+        /* The members rejoin after revoking: the withheld partitions
+         * are now free and go to the new member. */
+        ut_sticky_members_rejoin_cooperative(members, 4, 2);
+        ut_sticky_assign0(rk, md, members, 4, 1/*cooperative*/);
+        if (ut_sticky_verify(md, members, 4, 1))
+                return 1;
+        RD_UT_ASSERT(members[3].rkgm_assignment->cnt == 3,
+                     "new member should get 3 partitions, not %d",
+                     members[3].rkgm_assignment->cnt);
+        for (i = 0 ; i < 3 ; i++)
+                RD_UT_ASSERT(members[i].rkgm_assignment->cnt ==
+                             members[i].rkgm_owned->cnt,
+                             "member %d should keep its %d partitions, "
+                             "not %d", i, members[i].rkgm_owned->cnt,
+                             members[i].rkgm_assignment->cnt);
+
+        ut_sticky_members_destroy(members, 4);
+        ut_sticky_metadata_destroy(md);
+
+        return 0;
+}
+
+
+/**
+ * @brief Assignor benchmark: 1000 members, 10000 partitions.
+ */
+static int ut_sticky_benchmark (rd_kafka_t *rk) {
+        const int member_cnt = 1000;
+        static const int pcnts[] = { 10000 };
+        rd_kafka_metadata_t *md = ut_sticky_metadata_new(1, pcnts);
+        rd_kafka_group_member_t *members;
+        rd_ts_t ts;
+        int moved;
+
+        members = ut_sticky_members_new(md, member_cnt + 1, 1, 0);
+
+        /* Initial assignment with all but the last member */
+        ts = rd_clock();
+        ut_sticky_assign(rk, md, members, member_cnt);
+        RD_UT_SAY("sticky: initial assignment of %d partitions to "
+                  "%d members in %.3fms",
+                  pcnts[0], member_cnt, (double)(rd_clock() - ts) / 1000.0);
+        if (ut_sticky_verify(md, members, member_cnt, 0))
+                return 1;
+
+        /* One member leaves and another one joins */
+        ut_sticky_members_rejoin(members, member_cnt, 1);
+        ts = rd_clock();
+        ut_sticky_assign(rk, md, members+1, member_cnt);
+        RD_UT_SAY("sticky: rebalance with one member replaced in %.3fms",
+                  (double)(rd_clock() - ts) / 1000.0);
+        if (ut_sticky_verify(md, members+1, member_cnt, 0))
+                return 1;
+        moved = ut_sticky_moved(members+1, member_cnt);
+        RD_UT_ASSERT(moved == pcnts[0] / member_cnt,
+                     "expected %d moved partitions, not %d",
+                     pcnts[0] / member_cnt, moved);
+
+        ut_sticky_members_destroy(members, member_cnt + 1);
+        ut_sticky_metadata_destroy(md);
+
+        return 0;
+}
+
+
+int unittest_sticky_assignor (void) {
+        rd_kafka_t *rk;
+        int fails;
+
+        rk = rd_unittest_rk_new(RD_KAFKA_CONSUMER, NULL);
+        RD_UT_ASSERT(rk, "failed to create instance");
+
+        fails = ut_sticky_basic(rk) || ut_sticky_cooperative(rk) ||
+                ut_sticky_benchmark(rk);
+
+        rd_kafka_destroy(rk);
+
+        if (fails)
+                return 1;
+
+        RD_UT_PASS();
+}
+
+/**@}*/
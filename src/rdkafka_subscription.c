@@ -111,6 +111,76 @@ rd_kafka_assign (rd_kafka_t *rk,
 }
 
 
+/**
+ * @brief Send an incremental (un)assign op to the cgrp and wait for the
+ *        result.
+ */
+static rd_kafka_resp_err_t
+rd_kafka_assign_incr (rd_kafka_t *rk,
+                      const rd_kafka_topic_partition_list_t *partitions,
+                      int method) {
+        rd_kafka_op_t *rko;
+        rd_kafka_cgrp_t *rkcg;
+
+        if (!partitions)
+                return RD_KAFKA_RESP_ERR__INVALID_ARG;
+
+        if (!(rkcg = rd_kafka_cgrp_get(rk)))
+                return RD_KAFKA_RESP_ERR__UNKNOWN_GROUP;
+
+        rko = rd_kafka_op_new(RD_KAFKA_OP_ASSIGN);
+        rko->rko_u.assign.partitions =
+                rd_kafka_topic_partition_list_copy(partitions);
+        rko->rko_u.assign.method = method;
+
+        return rd_kafka_op_err_destroy(
+                rd_kafka_op_req(rkcg->rkcg_ops, rko, RD_POLL_INFINITE));
+}
+
+
+rd_kafka_resp_err_t
+rd_kafka_incremental_assign (rd_kafka_t *rk,
+                             const rd_kafka_topic_partition_list_t
+                             *partitions) {
+        return rd_kafka_assign_incr(rk, partitions,
+                                    RD_KAFKA_ASSIGN_METHOD_INCR_ASSIGN);
+}
+
+
+rd_kafka_resp_err_t
+rd_kafka_incremental_unassign (rd_kafka_t *rk,
+                               const rd_kafka_topic_partition_list_t
+                               *partitions) {
+        return rd_kafka_assign_incr(rk, partitions,
+                                    RD_KAFKA_ASSIGN_METHOD_INCR_UNASSIGN);
+}
+
+
+const char *rd_kafka_rebalance_protocol (rd_kafka_t *rk) {
+        rd_kafka_op_t *rko;
+        rd_kafka_cgrp_t *rkcg;
+        const char *result;
+
+        if (!(rkcg = rd_kafka_cgrp_get(rk)))
+                return rd_kafka_rebalance_protocol2str(
+                        RD_KAFKA_REBALANCE_PROTOCOL_NONE);
+
+        rko = rd_kafka_op_req2(rkcg->rkcg_ops,
+                               RD_KAFKA_OP_GET_REBALANCE_PROTOCOL);
+        if (!rko)
+                return rd_kafka_rebalance_protocol2str(
+                        RD_KAFKA_REBALANCE_PROTOCOL_NONE);
+
+        result = rko->rko_err ?
+                rd_kafka_rebalance_protocol2str(
+                        RD_KAFKA_REBALANCE_PROTOCOL_NONE) :
+                rko->rko_u.rebalance_protocol.str;
+        rd_kafka_op_destroy(rko);
+
+        return result;
+}
+
+
 
 rd_kafka_resp_err_t
 rd_kafka_assignment (rd_kafka_t *rk,
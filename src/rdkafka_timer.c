@@ -30,6 +30,9 @@
 #include "rd.h"
 #include "rdtime.h"
 #include "rdsysqueue.h"
+#include "rdrand.h"
+
+#include "rdunittest.h"
 
 
 static RD_INLINE void rd_kafka_timers_lock (rd_kafka_timers_t *rkts) {
@@ -51,20 +54,108 @@ static RD_INLINE int rd_kafka_timer_scheduled (const rd_kafka_timer_t *rtmr) {
 }
 
 
-static int rd_kafka_timer_cmp (const void *_a, const void *_b) {
-	const rd_kafka_timer_t *a = _a, *b = _b;
-	return (int)(a->rtmr_next - b->rtmr_next);
+/**
+ * Scheduled timers are kept in a binary min-heap ordered on rtmr_next.
+ * Each timer tracks its own position in the heap (rtmr_heap_idx) so that
+ * scheduling and unscheduling a timer are both O(log n), regardless of
+ * the number of timers (typically a couple per toppar).
+ *
+ * All heap operations require rkts_lock to be held.
+ */
+
+static RD_INLINE void rd_kafka_timer_heap_set (rd_kafka_timers_t *rkts,
+                                               int idx,
+                                               rd_kafka_timer_t *rtmr) {
+        rkts->rkts_timers[idx] = rtmr;
+        rtmr->rtmr_heap_idx = idx;
+}
+
+/**
+ * @brief Move the timer at \p idx towards the root until its parent
+ *        fires no later than it.
+ */
+static void rd_kafka_timer_heap_up (rd_kafka_timers_t *rkts, int idx) {
+        rd_kafka_timer_t *rtmr = rkts->rkts_timers[idx];
+
+        while (idx > 0) {
+                int parent = (idx - 1) / 2;
+                rd_kafka_timer_t *prtmr = rkts->rkts_timers[parent];
+
+                if (prtmr->rtmr_next <= rtmr->rtmr_next)
+                        break;
+
+                rd_kafka_timer_heap_set(rkts, idx, prtmr);
+                idx = parent;
+        }
+
+        rd_kafka_timer_heap_set(rkts, idx, rtmr);
+}
+
+/**
+ * @brief Move the timer at \p idx towards the leaves until both its
+ *        children fire no earlier than it.
+ */
+static void rd_kafka_timer_heap_down (rd_kafka_timers_t *rkts, int idx) {
+        rd_kafka_timer_t *rtmr = rkts->rkts_timers[idx];
+
+        while (1) {
+                int child = (idx * 2) + 1;
+                rd_kafka_timer_t *crtmr;
+
+                if (child >= rkts->rkts_timer_cnt)
+                        break;
+
+                /* Pick the earliest of the two children */
+                if (child + 1 < rkts->rkts_timer_cnt &&
+                    rkts->rkts_timers[child+1]->rtmr_next <
+                    rkts->rkts_timers[child]->rtmr_next)
+                        child++;
+
+                crtmr = rkts->rkts_timers[child];
+                if (rtmr->rtmr_next <= crtmr->rtmr_next)
+                        break;
+
+                rd_kafka_timer_heap_set(rkts, idx, crtmr);
+                idx = child;
+        }
+
+        rd_kafka_timer_heap_set(rkts, idx, rtmr);
+}
+
+/**
+ * @returns the timer that fires first, or NULL if no timers are scheduled.
+ */
+static RD_INLINE rd_kafka_timer_t *
+rd_kafka_timers_first (const rd_kafka_timers_t *rkts) {
+        return rkts->rkts_timer_cnt > 0 ? rkts->rkts_timers[0] : NULL;
 }
 
 static void rd_kafka_timer_unschedule (rd_kafka_timers_t *rkts,
                                        rd_kafka_timer_t *rtmr) {
-	TAILQ_REMOVE(&rkts->rkts_timers, rtmr, rtmr_link);
+        int idx = rtmr->rtmr_heap_idx;
+        rd_kafka_timer_t *last;
+
+        rd_dassert(idx < rkts->rkts_timer_cnt &&
+                   rkts->rkts_timers[idx] == rtmr);
+
+        /* Fill the hole with the last timer and restore the heap
+         * property in whichever direction it is violated. */
+        last = rkts->rkts_timers[--rkts->rkts_timer_cnt];
+        if (last != rtmr) {
+                rd_kafka_timer_heap_set(rkts, idx, last);
+                if (idx > 0 &&
+                    rkts->rkts_timers[(idx - 1) / 2]->rtmr_next >
+                    last->rtmr_next)
+                        rd_kafka_timer_heap_up(rkts, idx);
+                else
+                        rd_kafka_timer_heap_down(rkts, idx);
+        }
+
 	rtmr->rtmr_next = 0;
 }
 
 static void rd_kafka_timer_schedule (rd_kafka_timers_t *rkts,
 				     rd_kafka_timer_t *rtmr, int extra_us) {
-	rd_kafka_timer_t *first;
 
 	/* Timer has been stopped */
 	if (!rtmr->rtmr_interval)
@@ -76,14 +167,20 @@ static void rd_kafka_timer_schedule (rd_kafka_timers_t *rkts,
 
 	rtmr->rtmr_next = rd_clock() + rtmr->rtmr_interval + extra_us;
 
-	if (!(first = TAILQ_FIRST(&rkts->rkts_timers)) ||
-	    first->rtmr_next > rtmr->rtmr_next) {
-		TAILQ_INSERT_HEAD(&rkts->rkts_timers, rtmr, rtmr_link);
+        if (unlikely(rkts->rkts_timer_cnt == rkts->rkts_timer_size)) {
+                rkts->rkts_timer_size = rkts->rkts_timer_size ?
+                        rkts->rkts_timer_size * 2 : 32;
+                rkts->rkts_timers = rd_realloc(rkts->rkts_timers,
+                                               sizeof(*rkts->rkts_timers) *
+                                               rkts->rkts_timer_size);
+        }
+
+        rd_kafka_timer_heap_set(rkts, rkts->rkts_timer_cnt++, rtmr);
+        rd_kafka_timer_heap_up(rkts, rtmr->rtmr_heap_idx);
+
+        /* Wake up the timer thread if this is now the first timer */
+        if (rtmr->rtmr_heap_idx == 0)
                 cnd_signal(&rkts->rkts_cond);
-	} else
-		TAILQ_INSERT_SORTED(&rkts->rkts_timers, rtmr,
-                                    rd_kafka_timer_t *, rtmr_link,
-				    rd_kafka_timer_cmp);
 }
 
 /**
@@ -203,7 +300,7 @@ rd_ts_t rd_kafka_timers_next (rd_kafka_timers_t *rkts, int timeout_us,
 	if (do_lock)
 		rd_kafka_timers_lock(rkts);
 
-	if (likely((rtmr = TAILQ_FIRST(&rkts->rkts_timers)) != NULL)) {
+	if (likely((rtmr = rd_kafka_timers_first(rkts)) != NULL)) {
 		sleeptime = rtmr->rtmr_next - now;
 		if (sleeptime < 0)
 			sleeptime = 0;
@@ -248,7 +345,7 @@ void rd_kafka_timers_run (rd_kafka_timers_t *rkts, int timeout_us) {
 
 		now = rd_clock();
 
-		while ((rtmr = TAILQ_FIRST(&rkts->rkts_timers)) &&
+		while ((rtmr = rd_kafka_timers_first(rkts)) &&
 		       rtmr->rtmr_next <= now) {
 
 			rd_kafka_timer_unschedule(rkts, rtmr);
@@ -286,11 +383,13 @@ void rd_kafka_timers_destroy (rd_kafka_timers_t *rkts) {
 
         rd_kafka_timers_lock(rkts);
         rkts->rkts_enabled = 0;
-        while ((rtmr = TAILQ_FIRST(&rkts->rkts_timers)))
+        while ((rtmr = rd_kafka_timers_first(rkts)))
                 rd_kafka_timer_stop(rkts, rtmr, 0);
-        rd_kafka_assert(rkts->rkts_rk, TAILQ_EMPTY(&rkts->rkts_timers));
+        rd_kafka_assert(rkts->rkts_rk, rkts->rkts_timer_cnt == 0);
         rd_kafka_timers_unlock(rkts);
 
+        RD_IF_FREE(rkts->rkts_timers, rd_free);
+
         cnd_destroy(&rkts->rkts_cond);
         mtx_destroy(&rkts->rkts_lock);
 }
@@ -298,8 +397,158 @@ void rd_kafka_timers_destroy (rd_kafka_timers_t *rkts) {
 void rd_kafka_timers_init (rd_kafka_timers_t *rkts, rd_kafka_t *rk) {
         memset(rkts, 0, sizeof(*rkts));
         rkts->rkts_rk = rk;
-        TAILQ_INIT(&rkts->rkts_timers);
         mtx_init(&rkts->rkts_lock, mtx_plain);
         cnd_init(&rkts->rkts_cond);
         rkts->rkts_enabled = 1;
 }
+
+
+
+/**
+ * @name Unit tests
+ * @{
+ */
+
+/**
+ * @brief Verify the heap property and the heap index of each timer.
+ */
+static int ut_timers_verify (rd_kafka_timers_t *rkts) {
+        int i;
+
+        for (i = 0 ; i < rkts->rkts_timer_cnt ; i++) {
+                const rd_kafka_timer_t *rtmr = rkts->rkts_timers[i];
+
+                RD_UT_ASSERT(rtmr->rtmr_heap_idx == i,
+                             "timer at heap index %d has rtmr_heap_idx %d",
+                             i, rtmr->rtmr_heap_idx);
+                RD_UT_ASSERT(rd_kafka_timer_scheduled(rtmr),
+                             "timer at heap index %d is not scheduled", i);
+                if (i > 0)
+                        RD_UT_ASSERT(rkts->rkts_timers[(i-1)/2]->rtmr_next <=
+                                     rtmr->rtmr_next,
+                                     "heap property violated at index %d", i);
+        }
+
+        return 0;
+}
+
+struct ut_timer_fire {
+        rd_ts_t last_next;  /**< rtmr_next of the last fired timer */
+        int     cnt;        /**< Number of fired timers */
+        int     misordered; /**< Timers fired out of order */
+};
+
+static rd_kafka_timer_t *ut_timers;
+static rd_ts_t *ut_timers_next; /**< rtmr_next at schedule time, since
+                                 *   it is cleared prior to the callback. */
+static struct ut_timer_fire ut_fire;
+
+static void ut_timer_cb (rd_kafka_timers_t *rkts, void *arg) {
+        rd_ts_t next = ut_timers_next[(intptr_t)arg];
+
+        if (next < ut_fire.last_next)
+                ut_fire.misordered++;
+        ut_fire.last_next = next;
+        ut_fire.cnt++;
+}
+
+
+/**
+ * @brief Timer heap correctness test: start, restart and stop of many
+ *        timers keep the heap consistent and timers fire in order.
+ */
+int unittest_timer (void) {
+        rd_kafka_t *rk;
+        rd_kafka_timers_t rkts;
+        const int timer_cnt = 10000;
+        const int fire_cnt = 1000;
+        int i, stopped = 0;
+
+        rk = rd_unittest_rk_new(RD_KAFKA_PRODUCER, NULL);
+        RD_UT_ASSERT(rk, "failed to create instance");
+
+        /* A private timers handle that is only run by this test,
+         * not the instance's main thread. */
+        rd_kafka_timers_init(&rkts, rk);
+        ut_timers = rd_calloc(timer_cnt, sizeof(*ut_timers));
+        ut_timers_next = rd_calloc(fire_cnt, sizeof(*ut_timers_next));
+
+        /* Start timers 1000..1100s in the future in random order. */
+        for (i = 0 ; i < timer_cnt ; i++)
+                rd_kafka_timer_start(&rkts, &ut_timers[i],
+                                     1000*1000000 +
+                                     rd_jitter(0, 100*1000000),
+                                     ut_timer_cb, (void *)(intptr_t)i);
+
+        RD_UT_ASSERT(rkts.rkts_timer_cnt == timer_cnt,
+                     "expected %d scheduled timers, not %d",
+                     timer_cnt, rkts.rkts_timer_cnt);
+        if (ut_timers_verify(&rkts))
+                return 1;
+
+        /* Restart all timers (stop+start), as done by the
+         * toppar timers when their intervals are updated. */
+        for (i = 0 ; i < timer_cnt ; i++)
+                rd_kafka_timer_start(&rkts, &ut_timers[i],
+                                     1000*1000000 +
+                                     rd_jitter(0, 100*1000000),
+                                     ut_timer_cb, (void *)(intptr_t)i);
+        if (ut_timers_verify(&rkts))
+                return 1;
+
+        /* Stop every other timer, from both ends of the heap. */
+        for (i = 0 ; i < timer_cnt ; i += 2) {
+                stopped += rd_kafka_timer_stop(&rkts, &ut_timers[i], 1);
+                RD_UT_ASSERT(!rd_kafka_timer_stop(&rkts, &ut_timers[i], 1),
+                             "stopping an already stopped timer "
+                             "should return 0");
+        }
+
+        RD_UT_ASSERT(stopped == timer_cnt / 2,
+                     "expected %d stopped timers, not %d",
+                     timer_cnt / 2, stopped);
+        RD_UT_ASSERT(rkts.rkts_timer_cnt == timer_cnt - stopped,
+                     "expected %d scheduled timers, not %d",
+                     timer_cnt - stopped, rkts.rkts_timer_cnt);
+        if (ut_timers_verify(&rkts))
+                return 1;
+
+        /* Remove the remaining timers. */
+        for (i = 1 ; i < timer_cnt ; i += 2)
+                rd_kafka_timer_stop(&rkts, &ut_timers[i], 1);
+        RD_UT_ASSERT(rkts.rkts_timer_cnt == 0,
+                     "expected no scheduled timers, not %d",
+                     rkts.rkts_timer_cnt);
+
+        /* Fire one-shot timers with unique intervals and verify they
+         * are dispatched in order. */
+        for (i = 0 ; i < fire_cnt ; i++)
+                rd_kafka_timer_start_oneshot(&rkts, &ut_timers[i],
+                                             1 + ((i * 7919) % fire_cnt),
+                                             ut_timer_cb,
+                                             (void *)(intptr_t)i);
+        for (i = 0 ; i < fire_cnt ; i++)
+                ut_timers_next[i] = ut_timers[i].rtmr_next;
+        rd_usleep(fire_cnt + 1000, NULL);
+        rd_kafka_timers_run(&rkts, RD_POLL_NOWAIT);
+
+        RD_UT_ASSERT(ut_fire.cnt == fire_cnt,
+                     "expected %d timers to fire, not %d",
+                     fire_cnt, ut_fire.cnt);
+        RD_UT_ASSERT(ut_fire.misordered == 0,
+                     "%d timers fired out of order", ut_fire.misordered);
+        RD_UT_ASSERT(rkts.rkts_timer_cnt == 0,
+                     "one-shot timers should not be rescheduled, "
+                     "%d timers still scheduled", rkts.rkts_timer_cnt);
+
+        rd_kafka_timers_destroy(&rkts);
+        rd_free(ut_timers);
+        ut_timers = NULL;
+        rd_free(ut_timers_next);
+        ut_timers_next = NULL;
+        rd_kafka_destroy(rk);
+
+        RD_UT_PASS();
+}
+
+/**@}*/
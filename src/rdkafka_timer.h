@@ -34,7 +34,10 @@
 /* A timer engine. */
 typedef struct rd_kafka_timers_s {
 
-        TAILQ_HEAD(, rd_kafka_timer_s) rkts_timers;
+        /** Scheduled timers as a binary min-heap ordered on rtmr_next. */
+        struct rd_kafka_timer_s **rkts_timers;
+        int         rkts_timer_cnt;   /**< Number of scheduled timers */
+        int         rkts_timer_size;  /**< Allocated rkts_timers size */
 
         struct rd_kafka_s *rkts_rk;
 
@@ -46,7 +49,8 @@ typedef struct rd_kafka_timers_s {
 
 
 typedef struct rd_kafka_timer_s {
-	TAILQ_ENTRY(rd_kafka_timer_s)  rtmr_link;
+        int     rtmr_heap_idx;   /**< Index in rkts_timers,
+                                  *   only valid while scheduled. */
 
 	rd_ts_t rtmr_next;
 	rd_ts_t rtmr_interval;   /* interval in microseconds */
@@ -83,4 +87,6 @@ void rd_kafka_timers_run (rd_kafka_timers_t *rkts, int timeout_us);
 void rd_kafka_timers_destroy (rd_kafka_timers_t *rkts);
 void rd_kafka_timers_init (rd_kafka_timers_t *rkte, rd_kafka_t *rk);
 
+int unittest_timer (void);
+
 #endif /* _RDKAFKA_TIMER_H_ */
@@ -34,10 +34,12 @@
 #include "rdkafka_broker.h"
 #include "rdkafka_cgrp.h"
 #include "rdkafka_metadata.h"
+#include "rdkafka_idempotence.h"
 #include "rdlog.h"
 #include "rdsysqueue.h"
 #include "rdtime.h"
 #include "rdregex.h"
+#include "rdmurmur2.h"
 
 const char *rd_kafka_topic_state_names[] = {
         "unknown",
@@ -102,6 +104,101 @@ static void rd_kafka_topic_destroy_app (rd_kafka_topic_t *app_rkt) {
 }
 
 
+/**
+ * @name Topic name hash index
+ *
+ * rk_topics is indexed on topic name by rk_topic_hash, a chained hash
+ * table that grows as topics are added, so that topic lookups by name
+ * (on every fetch response, metadata update and topic_new()) do not
+ * need to scan all topics.
+ *
+ * @locks rd_kafka_wrlock() for insert and remove,
+ *        rd_kafka_rdlock() for lookups.
+ * @{
+ */
+
+static RD_INLINE uint32_t rd_kafka_topic_hash (const char *topic,
+                                               size_t len) {
+        return rd_murmur2(topic, len);
+}
+
+/**
+ * @brief Resize the hash table to \p size buckets and rehash all topics.
+ */
+static void rd_kafka_topic_hash_resize (rd_kafka_t *rk, int size) {
+        rd_kafka_itopic_t *rkt;
+        int i;
+
+        RD_IF_FREE(rk->rk_topic_hash, rd_free);
+        rk->rk_topic_hash_size = size;
+        rk->rk_topic_hash = rd_malloc(sizeof(*rk->rk_topic_hash) * size);
+        for (i = 0 ; i < size ; i++)
+                LIST_INIT(&rk->rk_topic_hash[i]);
+
+        TAILQ_FOREACH(rkt, &rk->rk_topics, rkt_link)
+                LIST_INSERT_HEAD(&rk->rk_topic_hash[rkt->rkt_hash &
+                                                    (size - 1)],
+                                 rkt, rkt_hash_link);
+}
+
+/**
+ * @brief Add topic to the hash index. The topic must already be on
+ *        rk_topics and counted in rk_topic_cnt.
+ */
+static void rd_kafka_topic_hash_insert (rd_kafka_t *rk,
+                                        rd_kafka_itopic_t *rkt) {
+        rkt->rkt_hash = rd_kafka_topic_hash(rkt->rkt_topic->str,
+                                            (size_t)rkt->rkt_topic->len);
+
+        /* Keep the average chain length at or below 1.
+         * The resize re-adds all topics, including this one. */
+        if (unlikely(rk->rk_topic_cnt > rk->rk_topic_hash_size)) {
+                rd_kafka_topic_hash_resize(rk,
+                                           RD_MAX(64,
+                                                  rk->rk_topic_hash_size * 2));
+                return;
+        }
+
+        LIST_INSERT_HEAD(&rk->rk_topic_hash[rkt->rkt_hash &
+                                            (rk->rk_topic_hash_size - 1)],
+                         rkt, rkt_hash_link);
+}
+
+static void rd_kafka_topic_hash_remove (rd_kafka_t *rk,
+                                        rd_kafka_itopic_t *rkt) {
+        LIST_REMOVE(rkt, rkt_hash_link);
+}
+
+/**
+ * @returns the topic named \p topic of length \p len, or NULL.
+ *          No reference is acquired.
+ */
+static rd_kafka_itopic_t *rd_kafka_topic_hash_find (rd_kafka_t *rk,
+                                                    const char *topic,
+                                                    size_t len) {
+        rd_kafka_itopic_t *rkt;
+        uint32_t hash;
+
+        if (unlikely(!rk->rk_topic_hash))
+                return NULL;
+
+        hash = rd_kafka_topic_hash(topic, len);
+
+        LIST_FOREACH(rkt, &rk->rk_topic_hash[hash &
+                                             (rk->rk_topic_hash_size - 1)],
+                     rkt_hash_link) {
+                if (rkt->rkt_hash == hash &&
+                    (size_t)rkt->rkt_topic->len == len &&
+                    !memcmp(rkt->rkt_topic->str, topic, len))
+                        return rkt;
+        }
+
+        return NULL;
+}
+
+/**@}*/
+
+
 /**
  * Final destructor for topic. Refcnt must be 0.
  */
@@ -111,6 +208,7 @@ void rd_kafka_topic_destroy_final (rd_kafka_itopic_t *rkt) {
 
         rd_kafka_wrlock(rkt->rkt_rk);
         TAILQ_REMOVE(&rkt->rkt_rk->rk_topics, rkt, rkt_link);
+        rd_kafka_topic_hash_remove(rkt->rkt_rk, rkt);
         rkt->rkt_rk->rk_topic_cnt--;
         rd_kafka_wrunlock(rkt->rkt_rk);
 
@@ -156,12 +254,8 @@ shptr_rd_kafka_itopic_t *rd_kafka_topic_find_fl (const char *func, int line,
 
         if (do_lock)
                 rd_kafka_rdlock(rk);
-	TAILQ_FOREACH(rkt, &rk->rk_topics, rkt_link) {
-		if (!rd_kafkap_str_cmp_str(rkt->rkt_topic, topic)) {
-                        s_rkt = rd_kafka_topic_keep(rkt);
-			break;
-		}
-	}
+        if ((rkt = rd_kafka_topic_hash_find(rk, topic, strlen(topic))))
+                s_rkt = rd_kafka_topic_keep(rkt);
         if (do_lock)
                 rd_kafka_rdunlock(rk);
 
@@ -178,12 +272,9 @@ shptr_rd_kafka_itopic_t *rd_kafka_topic_find0_fl (const char *func, int line,
         shptr_rd_kafka_itopic_t *s_rkt = NULL;
 
 	rd_kafka_rdlock(rk);
-	TAILQ_FOREACH(rkt, &rk->rk_topics, rkt_link) {
-		if (!rd_kafkap_str_cmp(rkt->rkt_topic, topic)) {
-                        s_rkt = rd_kafka_topic_keep(rkt);
-			break;
-		}
-	}
+        if ((rkt = rd_kafka_topic_hash_find(rk, topic->str,
+                                            (size_t)RD_KAFKAP_STR_LEN(topic))))
+                s_rkt = rd_kafka_topic_keep(rkt);
 	rd_kafka_rdunlock(rk);
 
 	return s_rkt;
@@ -305,6 +396,13 @@ shptr_rd_kafka_itopic_t *rd_kafka_topic_new0 (rd_kafka_t *rk,
                 }
         }
 
+        if (rd_kafka_is_idempotent(rk)) {
+                /* The idempotent producer requires acks=all and
+                 * FIFO ordering to maintain the per-partition sequence. */
+                rkt->rkt_conf.required_acks = -1;
+                rkt->rkt_conf.queuing_strategy = RD_KAFKA_QUEUE_FIFO;
+        }
+
         if (rkt->rkt_conf.queuing_strategy == RD_KAFKA_QUEUE_FIFO)
                 rkt->rkt_conf.msg_order_cmp = rd_kafka_msg_cmp_msgseq;
         else
@@ -334,6 +432,17 @@ shptr_rd_kafka_itopic_t *rd_kafka_topic_new0 (rd_kafka_t *rk,
                         rkt->rkt_conf.compression_level =
                                 RD_KAFKA_COMPLEVEL_LZ4_MAX;
                 break;
+#if WITH_ZSTD
+        case RD_KAFKA_COMPRESSION_ZSTD:
+                if (rkt->rkt_conf.compression_level == RD_KAFKA_COMPLEVEL_DEFAULT)
+                        /* ZSTD uses 0 to select the library's default
+                         * compression level (currently 3) */
+                        rkt->rkt_conf.compression_level = 0;
+                else if (rkt->rkt_conf.compression_level > RD_KAFKA_COMPLEVEL_ZSTD_MAX)
+                        rkt->rkt_conf.compression_level =
+                                RD_KAFKA_COMPLEVEL_ZSTD_MAX;
+                break;
+#endif
         case RD_KAFKA_COMPRESSION_SNAPPY:
         default:
                 /* Compression level has no effect in this case */
@@ -363,6 +472,7 @@ shptr_rd_kafka_itopic_t *rd_kafka_topic_new0 (rd_kafka_t *rk,
 
 	TAILQ_INSERT_TAIL(&rk->rk_topics, rkt, rkt_link);
 	rk->rk_topic_cnt++;
+        rd_kafka_topic_hash_insert(rk, rkt);
 
         /* Populate from metadata cache. */
         if ((rkmce = rd_kafka_metadata_cache_find(rk, topic, 1/*valid*/))) {
@@ -1046,6 +1156,7 @@ void rd_kafka_topic_partitions_remove (rd_kafka_itopic_t *rkt) {
 		rd_kafka_toppar_t *rktp = rd_kafka_toppar_s2i(s_rktp);
 
 		rd_kafka_toppar_lock(rktp);
+                rd_kafka_toppar_msgq_intake_drain(rktp);
 		rd_kafka_msgq_purge(rkt->rkt_rk, &rktp->rktp_msgq);
 		rd_kafka_toppar_purge_queues(rktp);
 		rd_kafka_toppar_unlock(rktp);
@@ -1185,6 +1296,9 @@ int rd_kafka_topic_scan_all (rd_kafka_t *rk, rd_ts_t now) {
                                 query_this = 1;
                         }
 
+                        /* Messages on the intake queue may time out
+                         * while the partition is not being served. */
+                        rd_kafka_toppar_msgq_intake_drain(rktp);
 			if (rd_kafka_msgq_age_scan(&rktp->rktp_msgq,
 						   &timedout, now) > 0)
 				did_tmout = 1;
@@ -1217,6 +1331,11 @@ int rd_kafka_topic_scan_all (rd_kafka_t *rk, rd_ts_t now) {
         }
         rd_kafka_rdunlock(rk);
 
+        /* Timed out messages leave a gap in the partitions' sequence
+         * which requires a new PID. */
+        if (totcnt > 0 && rd_kafka_is_idempotent(rk))
+                rd_kafka_idemp_drain_reset(rk, "messages timed out in queue");
+
         if (!rd_list_empty(&query_topics))
                 rd_kafka_metadata_refresh_topics(rk, NULL, &query_topics,
                                                  1/*force even if cached
@@ -37,6 +37,8 @@ extern const char *rd_kafka_topic_state_names[];
 /* rd_kafka_itopic_t: internal representation of a topic */
 struct rd_kafka_itopic_s {
 	TAILQ_ENTRY(rd_kafka_itopic_s) rkt_link;
+        LIST_ENTRY(rd_kafka_itopic_s) rkt_hash_link; /* rk_topic_hash link */
+        uint32_t           rkt_hash;    /* Hash of rkt_topic name */
 
 	rd_refcnt_t        rkt_refcnt;
 
@@ -60,6 +60,14 @@
 #define SOCKET_ERROR -1
 #endif
 
+#ifdef __linux__
+#include <linux/errqueue.h>
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && \
+        defined(SO_EE_ORIGIN_ZEROCOPY)
+#define RD_KAFKA_TRANSPORT_ZEROCOPY 1  /* socket.zerocopy support */
+#endif
+#endif
+
 /* AIX doesn't have MSG_DONTWAIT */
 #ifndef MSG_DONTWAIT
 #  define MSG_DONTWAIT MSG_NONBLOCK
@@ -102,6 +110,13 @@ void rd_kafka_transport_close (rd_kafka_transport_t *rktrans) {
 
         rd_kafka_sasl_close(rktrans);
 
+#if WITH_IO_URING
+        /* Must be destroyed prior to closing the socket since
+         * requests may still be in flight on it. */
+        if (rktrans->rktrans_uring)
+                rd_kafka_uring_destroy(rktrans->rktrans_uring);
+#endif
+
 	if (rktrans->rktrans_recv_buf)
 		rd_kafka_buf_destroy(rktrans->rktrans_recv_buf);
 
@@ -129,10 +144,11 @@ static const char *socket_strerror(int err) {
 #ifndef _MSC_VER
 /**
  * @brief sendmsg() abstraction, converting a list of segments to iovecs.
+ * @param flags additional sendmsg() flags, e.g., MSG_ZEROCOPY.
  * @remark should only be called if the number of segments is > 1.
  */
 ssize_t rd_kafka_transport_socket_sendmsg (rd_kafka_transport_t *rktrans,
-                                           rd_slice_t *slice,
+                                           rd_slice_t *slice, int flags,
                                            char *errstr, size_t errstr_size) {
         struct iovec iov[IOV_MAX];
         struct msghdr msg = { .msg_iov = iov };
@@ -149,7 +165,7 @@ ssize_t rd_kafka_transport_socket_sendmsg (rd_kafka_transport_t *rktrans,
         socket_errno = EAGAIN;
 #endif
 
-        r = sendmsg(rktrans->rktrans_s, &msg, MSG_DONTWAIT
+        r = sendmsg(rktrans->rktrans_s, &msg, MSG_DONTWAIT | flags
 #ifdef MSG_NOSIGNAL
                     | MSG_NOSIGNAL
 #endif
@@ -234,7 +250,7 @@ rd_kafka_transport_socket_send (rd_kafka_transport_t *rktrans,
         /* FIXME: Use sendmsg() with iovecs if there's more than one segment
          * remaining, otherwise (or if platform does not have sendmsg)
          * use plain send(). */
-        return rd_kafka_transport_socket_sendmsg(rktrans, slice,
+        return rd_kafka_transport_socket_sendmsg(rktrans, slice, 0,
                                                  errstr, errstr_size);
 #endif
         return rd_kafka_transport_socket_send0(rktrans, slice,
@@ -1098,6 +1114,12 @@ rd_kafka_transport_send (rd_kafka_transport_t *rktrans,
                 return rd_kafka_transport_ssl_send(rktrans, slice,
                                                    errstr, errstr_size);
         else
+#endif
+#if WITH_IO_URING
+        if (rktrans->rktrans_uring)
+                return rd_kafka_uring_send(rktrans->rktrans_uring, slice,
+                                           errstr, errstr_size);
+        else
 #endif
                 return rd_kafka_transport_socket_send(rktrans, slice,
                                                       errstr, errstr_size);
@@ -1112,6 +1134,12 @@ rd_kafka_transport_recv (rd_kafka_transport_t *rktrans, rd_buf_t *rbuf,
                 return rd_kafka_transport_ssl_recv(rktrans, rbuf,
                                                    errstr, errstr_size);
 	else
+#endif
+#if WITH_IO_URING
+        if (rktrans->rktrans_uring)
+                return rd_kafka_uring_recv(rktrans->rktrans_uring, rbuf,
+                                           errstr, errstr_size);
+        else
 #endif
                 return rd_kafka_transport_socket_recv(rktrans, rbuf,
                                                       errstr, errstr_size);
@@ -1119,6 +1147,169 @@ rd_kafka_transport_recv (rd_kafka_transport_t *rktrans, rd_buf_t *rbuf,
 
 
 
+/**
+ * @brief Send \p slice with MSG_ZEROCOPY if enabled for the connection
+ *        (socket.zerocopy), else as rd_kafka_transport_send().
+ *
+ * The memory referenced by \p slice must remain unmodified until
+ * the send has completed, see rd_kafka_transport_zerocopy_done().
+ *
+ * @locality broker thread
+ */
+ssize_t
+rd_kafka_transport_send_zerocopy (rd_kafka_transport_t *rktrans,
+                                  rd_slice_t *slice,
+                                  char *errstr, size_t errstr_size) {
+#ifdef RD_KAFKA_TRANSPORT_ZEROCOPY
+        if (rktrans->rktrans_zerocopy) {
+                ssize_t r;
+
+                r = rd_kafka_transport_socket_sendmsg(rktrans, slice,
+                                                      MSG_ZEROCOPY,
+                                                      errstr, errstr_size);
+                if (r > 0) {
+                        /* Each successful send is assigned the
+                         * next send id by the kernel. */
+                        rktrans->rktrans_zc_sent++;
+                        return r;
+                } else if (!(r == -1 && socket_errno == ENOBUFS))
+                        return r;
+
+                /* ENOBUFS: too many uncompleted zerocopy sends,
+                 * fall back to a copying send. */
+        }
+#endif
+
+        return rd_kafka_transport_send(rktrans, slice, errstr, errstr_size);
+}
+
+
+/**
+ * @returns the send id following the last MSG_ZEROCOPY send,
+ *          to be passed to rd_kafka_transport_zerocopy_done().
+ */
+uint32_t rd_kafka_transport_zerocopy_id (const rd_kafka_transport_t *rktrans) {
+        return rktrans->rktrans_zc_sent;
+}
+
+
+/**
+ * @returns true if all MSG_ZEROCOPY sends prior to send id \p id
+ *          (from rd_kafka_transport_zerocopy_id()) have completed,
+ *          i.e., the kernel no longer references their memory.
+ */
+rd_bool_t rd_kafka_transport_zerocopy_done (const rd_kafka_transport_t *rktrans,
+                                            uint32_t id) {
+        return (int32_t)(rktrans->rktrans_zc_done - id) >= 0;
+}
+
+
+#ifdef RD_KAFKA_TRANSPORT_ZEROCOPY
+/**
+ * @brief Read MSG_ZEROCOPY completion notifications from the socket's
+ *        error queue and serve the requests waiting for them.
+ *
+ * @locality broker thread
+ */
+static void rd_kafka_transport_zerocopy_reap (rd_kafka_transport_t *rktrans) {
+        rd_kafka_broker_t *rkb = rktrans->rktrans_rkb;
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+
+        while (1) {
+                struct msghdr msg = {
+                        .msg_control    = control,
+                        .msg_controllen = sizeof(control)
+                };
+                struct cmsghdr *cmsg;
+                const struct sock_extended_err *serr;
+
+                if (recvmsg(rktrans->rktrans_s, &msg, MSG_ERRQUEUE) == -1)
+                        break; /* EAGAIN: error queue is empty */
+
+                if (!(cmsg = CMSG_FIRSTHDR(&msg)) ||
+                    !((cmsg->cmsg_level == SOL_IP &&
+                       cmsg->cmsg_type == IP_RECVERR) ||
+                      (cmsg->cmsg_level == SOL_IPV6 &&
+                       cmsg->cmsg_type == IPV6_RECVERR)))
+                        continue;
+
+                serr = (const struct sock_extended_err *)CMSG_DATA(cmsg);
+                if (serr->ee_errno != 0 ||
+                    serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                        continue;
+
+                /* The notification covers the (inclusive) send id
+                 * range ee_info..ee_data, TCP completes sends in order. */
+                rktrans->rktrans_zc_done += serr->ee_data - serr->ee_info + 1;
+
+                if ((serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) &&
+                    rktrans->rktrans_zerocopy) {
+                        /* The deferred copy is more expensive than
+                         * a regular send. */
+                        rd_rkb_dbg(rkb, BROKER, "ZEROCOPY",
+                                   "Kernel copied MSG_ZEROCOPY send data "
+                                   "(e.g., loopback or device without "
+                                   "scatter-gather support): disabling "
+                                   "zerocopy for this connection");
+                        rktrans->rktrans_zerocopy = rd_false;
+                }
+        }
+
+        rd_kafka_broker_zerocopy_serve(rkb);
+}
+#endif
+
+
+/**
+ * @brief Wait up to \p timeout_ms for the completion of all MSG_ZEROCOPY
+ *        sends, which can't be read once the socket is closed.
+ *
+ *        Sends still uncompleted after \p timeout_ms are discarded
+ *        along with the socket's send queue on close (SO_LINGER 0),
+ *        after which the kernel no longer references their memory.
+ *
+ * @returns true if all sends completed.
+ *
+ * @locality broker thread
+ */
+rd_bool_t rd_kafka_transport_zerocopy_drain (rd_kafka_transport_t *rktrans,
+                                             int timeout_ms) {
+#ifdef RD_KAFKA_TRANSPORT_ZEROCOPY
+        rd_ts_t ts_end = rd_timeout_init(timeout_ms);
+        struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+
+        while (rktrans->rktrans_zc_sent != rktrans->rktrans_zc_done) {
+                struct pollfd pfd = { .fd = rktrans->rktrans_s };
+                int remains_ms = rd_timeout_remains(ts_end);
+                uint32_t done;
+
+                if (rd_timeout_expired(remains_ms)) {
+                        rd_rkb_dbg(rktrans->rktrans_rkb, BROKER, "ZEROCOPY",
+                                   "%"PRIu32" MSG_ZEROCOPY send(s) not "
+                                   "completed after %dms: discarding "
+                                   "send queue on close",
+                                   rktrans->rktrans_zc_sent -
+                                   rktrans->rktrans_zc_done, timeout_ms);
+                        setsockopt(rktrans->rktrans_s, SOL_SOCKET, SO_LINGER,
+                                   (void *)&linger, sizeof(linger));
+                        return rd_false;
+                }
+
+                done = rktrans->rktrans_zc_done;
+
+                /* POLLERR is always polled for: wait for notifications */
+                poll(&pfd, 1, RD_MIN(remains_ms, 10));
+                rd_kafka_transport_zerocopy_reap(rktrans);
+
+                /* A pending socket error also raises POLLERR */
+                if (rktrans->rktrans_zc_done == done)
+                        rd_usleep(1000, NULL);
+        }
+#endif
+        return rd_true;
+}
+
+
 /**
  * @brief Notify transport layer of full request sent.
  */
@@ -1318,6 +1509,52 @@ static void rd_kafka_transport_connected (rd_kafka_transport_t *rktrans) {
         }
 #endif
 
+#if WITH_IO_URING
+        /* The io_uring backend is only used for plaintext connections,
+         * SSL reads and writes the socket from OpenSSL. */
+        if (rkb->rkb_rk->rk_conf.socket_io_backend ==
+            RD_KAFKA_IO_BACKEND_IO_URING &&
+            (rkb->rkb_proto == RD_KAFKA_PROTO_PLAINTEXT ||
+             rkb->rkb_proto == RD_KAFKA_PROTO_SASL_PLAINTEXT)) {
+                char errstr[512];
+
+                rktrans->rktrans_uring =
+                        rd_kafka_uring_new(rktrans->rktrans_s,
+                                           &rkb->rkb_wakeup,
+                                           rktrans->rktrans_sndbuf_size,
+                                           errstr, sizeof(errstr));
+                if (!rktrans->rktrans_uring)
+                        rd_rkb_log(rkb, LOG_WARNING, "IOURING",
+                                   "Failed to set up io_uring for "
+                                   "connection, falling back to poll: %s",
+                                   errstr);
+                else
+                        rd_rkb_dbg(rkb, BROKER, "IOURING",
+                                   "Using io_uring for connection");
+        }
+#endif
+
+
+#ifdef RD_KAFKA_TRANSPORT_ZEROCOPY
+        if (rkb->rkb_rk->rk_conf.socket_zerocopy &&
+            (rkb->rkb_proto == RD_KAFKA_PROTO_PLAINTEXT ||
+             rkb->rkb_proto == RD_KAFKA_PROTO_SASL_PLAINTEXT)
+#if WITH_IO_URING
+            && !rktrans->rktrans_uring
+#endif
+                ) {
+                int one = 1;
+                if (setsockopt(rktrans->rktrans_s, SOL_SOCKET, SO_ZEROCOPY,
+                               (void *)&one, sizeof(one)) == SOCKET_ERROR)
+                        rd_rkb_log(rkb, LOG_WARNING, "ZEROCOPY",
+                                   "Failed to enable MSG_ZEROCOPY "
+                                   "on socket: %s",
+                                   socket_strerror(socket_errno));
+                else
+                        rktrans->rktrans_zerocopy = rd_true;
+        }
+#endif
+
 
 #if WITH_SSL
 	if (rkb->rkb_proto == RD_KAFKA_PROTO_SSL ||
@@ -1447,6 +1684,13 @@ static void rd_kafka_transport_io_event (rd_kafka_transport_t *rktrans,
 	case RD_KAFKA_BROKER_STATE_UP:
 	case RD_KAFKA_BROKER_STATE_UPDATE:
 
+#ifdef RD_KAFKA_TRANSPORT_ZEROCOPY
+                /* POLLERR is raised for queued zerocopy notifications */
+                if ((events & POLLERR) &&
+                    rktrans->rktrans_zc_sent != rktrans->rktrans_zc_done)
+                        rd_kafka_transport_zerocopy_reap(rktrans);
+#endif
+
 		if (events & POLLIN) {
 			while (rkb->rkb_state >= RD_KAFKA_BROKER_STATE_UP &&
 			       rd_kafka_recv(rkb) > 0)
@@ -1596,9 +1840,10 @@ rd_kafka_transport_t *rd_kafka_transport_connect (rd_kafka_broker_t *rkb,
 	rktrans->rktrans_rkb = rkb;
 	rktrans->rktrans_s = s;
 	rktrans->rktrans_pfd[rktrans->rktrans_pfd_cnt++].fd = s;
-        if (rkb->rkb_wakeup_fd[0] != -1) {
+        if (rd_wakeup_fd(&rkb->rkb_wakeup) != -1) {
                 rktrans->rktrans_pfd[rktrans->rktrans_pfd_cnt].events = POLLIN;
-                rktrans->rktrans_pfd[rktrans->rktrans_pfd_cnt++].fd = rkb->rkb_wakeup_fd[0];
+                rktrans->rktrans_pfd[rktrans->rktrans_pfd_cnt++].fd =
+                        rd_wakeup_fd(&rkb->rkb_wakeup);
         }
 
 
@@ -1625,8 +1870,43 @@ void rd_kafka_transport_poll_clear(rd_kafka_transport_t *rktrans, int event) {
 }
 
 
+/**
+ * @brief Get the socket and the POLL.. events an external poller
+ *        (reactor thread) should wait for, which is what
+ *        rd_kafka_transport_io_serve() would poll for.
+ *
+ * @returns the socket fd.
+ *
+ * @locality broker thread
+ */
+int rd_kafka_transport_poll_fd (rd_kafka_transport_t *rktrans,
+                                int *eventsp) {
+        rd_kafka_broker_t *rkb = rktrans->rktrans_rkb;
+        int events = rktrans->rktrans_pfd[0].events;
+
+        if (rd_kafka_bufq_cnt(&rkb->rkb_waitresps) < rkb->rkb_max_inflight &&
+            rd_kafka_bufq_cnt(&rkb->rkb_outbufs) > 0)
+                events |= POLLOUT;
+
+        *eventsp = events;
+        return rktrans->rktrans_s;
+}
+
+
 int rd_kafka_transport_poll(rd_kafka_transport_t *rktrans, int tmout) {
         int r;
+#if WITH_IO_URING
+        if (rktrans->rktrans_uring) {
+                /* The io_uring also polls the wake-up fd */
+                r = rd_kafka_uring_poll(rktrans->rktrans_uring,
+                                        rktrans->rktrans_pfd[0].events,
+                                        tmout);
+                if (r > 0)
+                        rd_atomic64_add(&rktrans->rktrans_rkb->rkb_c.wakeups,
+                                        1);
+                return r;
+        }
+#endif
 #ifndef _MSC_VER
 	r = poll(rktrans->rktrans_pfd, rktrans->rktrans_pfd_cnt, tmout);
 	if (r <= 0)
@@ -1663,12 +1943,9 @@ int rd_kafka_transport_poll(rd_kafka_transport_t *rktrans, int tmout) {
         rd_atomic64_add(&rktrans->rktrans_rkb->rkb_c.wakeups, 1);
 
         if (rktrans->rktrans_pfd[1].revents & POLLIN) {
-                /* Read wake-up fd data and throw away, just used for wake-ups*/
-                char buf[512];
-                if (rd_read((int)rktrans->rktrans_pfd[1].fd,
-                            buf, sizeof(buf)) == -1) {
-                        /* Ignore warning */
-                }
+                /* Clear the wake-up (re-arming it) prior to the
+                 * broker thread serving its queues. */
+                rd_wakeup_clear(&rktrans->rktrans_rkb->rkb_wakeup);
         }
 
         return rktrans->rktrans_pfd[0].revents;
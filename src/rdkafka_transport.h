@@ -44,6 +44,19 @@ void rd_kafka_transport_io_serve (rd_kafka_transport_t *rktrans,
 ssize_t rd_kafka_transport_send (rd_kafka_transport_t *rktrans,
                                  rd_slice_t *slice,
                                  char *errstr, size_t errstr_size);
+ssize_t rd_kafka_transport_send_zerocopy (rd_kafka_transport_t *rktrans,
+                                          rd_slice_t *slice,
+                                          char *errstr, size_t errstr_size);
+uint32_t rd_kafka_transport_zerocopy_id (const rd_kafka_transport_t *rktrans);
+rd_bool_t rd_kafka_transport_zerocopy_done (const rd_kafka_transport_t *rktrans,
+                                            uint32_t id);
+rd_bool_t rd_kafka_transport_zerocopy_drain (rd_kafka_transport_t *rktrans,
+                                             int timeout_ms);
+
+/**
+ * Max time to wait for MSG_ZEROCOPY completions before closing the socket.
+ */
+#define RD_KAFKA_TRANSPORT_ZEROCOPY_DRAIN_MS 1000
 ssize_t rd_kafka_transport_recv (rd_kafka_transport_t *rktrans,
                                  rd_buf_t *rbuf,
                                  char *errstr, size_t errstr_size);
@@ -62,6 +75,8 @@ void rd_kafka_transport_connect_done (rd_kafka_transport_t *rktrans,
 
 void rd_kafka_transport_close(rd_kafka_transport_t *rktrans);
 void rd_kafka_transport_poll_set(rd_kafka_transport_t *rktrans, int event);
+int rd_kafka_transport_poll_fd (rd_kafka_transport_t *rktrans,
+                                int *eventsp);
 void rd_kafka_transport_poll_clear(rd_kafka_transport_t *rktrans, int event);
 int rd_kafka_transport_poll(rd_kafka_transport_t *rktrans, int tmout);
 
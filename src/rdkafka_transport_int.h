@@ -39,6 +39,10 @@
 #include <openssl/pkcs12.h>
 #endif
 
+#if WITH_IO_URING
+#include "rdkafka_uring.h"
+#endif
+
 struct rd_kafka_transport_s {	
 	int rktrans_s;
 	
@@ -48,6 +52,11 @@ struct rd_kafka_transport_s {
 	SSL *rktrans_ssl;
 #endif
 
+#if WITH_IO_URING
+        rd_kafka_uring_t *rktrans_uring; /**< io_uring backend, if enabled
+                                          *   (socket.io.backend). */
+#endif
+
 	struct {
                 void *state;               /* SASL implementation
                                             * state handle */
@@ -82,6 +91,13 @@ struct rd_kafka_transport_s {
 
         size_t rktrans_rcvbuf_size;    /**< Socket receive buffer size */
         size_t rktrans_sndbuf_size;    /**< Socket send buffer size */
+
+        /* MSG_ZEROCOPY sends (socket.zerocopy) */
+        rd_bool_t rktrans_zerocopy;    /**< MSG_ZEROCOPY enabled */
+        uint32_t  rktrans_zc_sent;     /**< Number of MSG_ZEROCOPY sends,
+                                        *   the kernel's send id counter */
+        uint32_t  rktrans_zc_done;     /**< Number of completed
+                                        *   MSG_ZEROCOPY sends */
 };
 
 #endif /* _RDKAFKA_TRANSPORT_INT_H_ */
@@ -0,0 +1,1121 @@
+/*
+ * librdkafka - Apache Kafka C library
+ *
+ * Copyright (c) 2018 Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "rdkafka_int.h"
+#include "rdkafka_uring.h"
+#include "rdunittest.h"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <linux/io_uring.h>
+
+
+/**
+ * @name io_uring broker socket IO backend
+ *
+ * The io_uring is driven through the raw syscalls and the shared
+ * submission and completion rings are accessed directly, so there is
+ * no dependency on liburing.
+ *
+ * Only the broker thread accesses a ring: the kernel is the only
+ * other party, and the ring head/tail updates are ordered with
+ * acquire/release atomics as documented for the io_uring ABI.
+ *
+ * @{
+ */
+
+#define RD_KAFKA_URING_SQ_ENTRIES    8   /**< recv, send, wake-up, cancels */
+#define RD_KAFKA_URING_CQ_ENTRIES    64
+#define RD_KAFKA_URING_RBUF_CNT      8   /**< Provided receive buffers,
+                                          *   must be a power of two. */
+#define RD_KAFKA_URING_RBUF_SIZE     (64*1024)
+#define RD_KAFKA_URING_BGID          0   /**< Provided buffer group id */
+#define RD_KAFKA_URING_SBUF_MIN      (64*1024)
+#define RD_KAFKA_URING_SBUF_MAX      (1024*1024)
+
+/** Request types, used as SQE/CQE user_data */
+enum {
+        RD_KAFKA_URING_UD_RECV = 1,
+        RD_KAFKA_URING_UD_SEND,
+        RD_KAFKA_URING_UD_WAKEUP,
+        RD_KAFKA_URING_UD_CANCEL
+};
+
+/** Send buffer */
+typedef struct rd_kafka_uring_sbuf_s {
+        char   *p;
+        size_t  size;  /**< Allocated size */
+        size_t  len;   /**< Bytes written to the buffer */
+        size_t  of;    /**< Bytes sent */
+} rd_kafka_uring_sbuf_t;
+
+struct rd_kafka_uring_s {
+        int           rku_fd;           /**< io_uring fd */
+        int           rku_s;            /**< Socket */
+        rd_wakeup_t  *rku_wakeup;       /**< Broker wake-up, or NULL */
+
+        /* Submission queue */
+        void         *rku_sq_ring;
+        size_t        rku_sq_ring_size;
+        unsigned     *rku_sq_head;
+        unsigned     *rku_sq_tail;
+        unsigned     *rku_sq_array;
+        unsigned      rku_sq_mask;
+        unsigned      rku_sq_entries;
+        struct io_uring_sqe *rku_sqes;
+        size_t        rku_sqes_size;
+        unsigned      rku_to_submit;    /**< Queued but not yet submitted */
+
+        /* Completion queue */
+        void         *rku_cq_ring;      /**< Same as rku_sq_ring with
+                                         *   IORING_FEAT_SINGLE_MMAP */
+        size_t        rku_cq_ring_size;
+        unsigned     *rku_cq_head;
+        unsigned     *rku_cq_tail;
+        unsigned      rku_cq_mask;
+        struct io_uring_cqe *rku_cqes;
+
+        /* Provided receive buffers */
+        struct io_uring_buf_ring *rku_br;
+        size_t        rku_br_size;
+        char         *rku_rbufs;
+        uint16_t      rku_br_tail;
+        rd_bool_t     rku_br_registered;
+
+        /** Received buffers, in order, not yet (fully) consumed
+         *  by rd_kafka_uring_recv(). */
+        struct {
+                uint16_t bid;
+                size_t   len;
+                size_t   of;
+        } rku_rq[RD_KAFKA_URING_RBUF_CNT];
+        int           rku_rq_head;
+        int           rku_rq_cnt;
+        rd_bool_t     rku_recv_armed;   /**< Multishot receive active */
+        rd_bool_t     rku_recv_eof;     /**< Peer closed the connection */
+        int           rku_recv_err;     /**< Receive error (errno) */
+
+        /* Send buffers: one is being filled while the other is
+         * in flight. */
+        rd_kafka_uring_sbuf_t rku_sbuf[2];
+        int           rku_sbuf_fill;    /**< Buffer being filled */
+        rd_bool_t     rku_send_inflight; /**< The other buffer is in flight */
+        int           rku_send_err;     /**< Send error (errno) */
+
+        rd_bool_t     rku_wakeup_armed; /**< Wake-up fd poll active */
+};
+
+
+static int rd_kafka_uring_enter (rd_kafka_uring_t *rku,
+                                 unsigned min_complete, int tmout) {
+        struct io_uring_getevents_arg arg = RD_ZERO_INIT;
+        struct __kernel_timespec ts;
+        unsigned flags = 0;
+        int r;
+
+        if (min_complete > 0) {
+                flags = IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG;
+                arg.sigmask_sz = _NSIG / 8;
+                if (tmout != RD_POLL_INFINITE) {
+                        ts.tv_sec  = tmout / 1000;
+                        ts.tv_nsec = (long long)(tmout % 1000) * 1000000;
+                        arg.ts     = (uint64_t)(uintptr_t)&ts;
+                }
+        }
+
+        r = (int)syscall(__NR_io_uring_enter, rku->rku_fd,
+                         rku->rku_to_submit, min_complete, flags,
+                         min_complete > 0 ? &arg : NULL,
+                         min_complete > 0 ? sizeof(arg) : 0);
+        if (r > 0)
+                rku->rku_to_submit -= (unsigned)r;
+
+        /* ETIME (timeout), EINTR, and EBUSY (completions must be
+         * reaped first) are all handled by the caller reaping the
+         * completion queue and trying again later. */
+        return r;
+}
+
+
+/**
+ * @returns a zeroed SQE, which must be committed with
+ *          rd_kafka_uring_sqe_commit(), or NULL if the
+ *          submission queue is full.
+ */
+static struct io_uring_sqe *rd_kafka_uring_sqe (rd_kafka_uring_t *rku) {
+        unsigned tail = *rku->rku_sq_tail;
+        unsigned idx;
+        struct io_uring_sqe *sqe;
+
+        if (tail - __atomic_load_n(rku->rku_sq_head, __ATOMIC_ACQUIRE) >=
+            rku->rku_sq_entries) {
+                /* Submit what is queued to make room */
+                rd_kafka_uring_enter(rku, 0, 0);
+                if (tail - __atomic_load_n(rku->rku_sq_head,
+                                           __ATOMIC_ACQUIRE) >=
+                    rku->rku_sq_entries)
+                        return NULL;
+        }
+
+        idx = tail & rku->rku_sq_mask;
+        sqe = &rku->rku_sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        rku->rku_sq_array[idx] = idx;
+
+        return sqe;
+}
+
+static void rd_kafka_uring_sqe_commit (rd_kafka_uring_t *rku) {
+        __atomic_store_n(rku->rku_sq_tail, *rku->rku_sq_tail + 1,
+                         __ATOMIC_RELEASE);
+        rku->rku_to_submit++;
+}
+
+
+/**
+ * @brief Arm a multishot receive into the provided buffers.
+ */
+static void rd_kafka_uring_recv_arm (rd_kafka_uring_t *rku) {
+        struct io_uring_sqe *sqe;
+
+        if (!(sqe = rd_kafka_uring_sqe(rku)))
+                return; /* Try again on next poll */
+
+        sqe->opcode    = IORING_OP_RECV;
+        sqe->fd        = rku->rku_s;
+        sqe->ioprio    = IORING_RECV_MULTISHOT;
+        sqe->flags     = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = RD_KAFKA_URING_BGID;
+        sqe->user_data = RD_KAFKA_URING_UD_RECV;
+        rd_kafka_uring_sqe_commit(rku);
+
+        rku->rku_recv_armed = rd_true;
+}
+
+
+/**
+ * @brief Arm a one-shot poll of the wake-up fd.
+ */
+static void rd_kafka_uring_wakeup_arm (rd_kafka_uring_t *rku) {
+        struct io_uring_sqe *sqe;
+        uint32_t events = POLLIN;
+
+        if (!(sqe = rd_kafka_uring_sqe(rku)))
+                return;
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+        events = (events << 16) | (events >> 16);
+#endif
+        sqe->opcode        = IORING_OP_POLL_ADD;
+        sqe->fd            = rd_wakeup_fd(rku->rku_wakeup);
+        sqe->poll32_events = events;
+        sqe->user_data     = RD_KAFKA_URING_UD_WAKEUP;
+        rd_kafka_uring_sqe_commit(rku);
+
+        rku->rku_wakeup_armed = rd_true;
+}
+
+
+/**
+ * @brief Cancel the request identified by \p user_data.
+ */
+static void rd_kafka_uring_cancel (rd_kafka_uring_t *rku, uint64_t user_data) {
+        struct io_uring_sqe *sqe;
+
+        if (!(sqe = rd_kafka_uring_sqe(rku)))
+                return;
+
+        sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+        sqe->addr      = user_data;
+        sqe->user_data = RD_KAFKA_URING_UD_CANCEL;
+        rd_kafka_uring_sqe_commit(rku);
+}
+
+
+/**
+ * @brief Send the unsent remainder of send buffer \p sb.
+ */
+static void rd_kafka_uring_send_sqe (rd_kafka_uring_t *rku,
+                                     rd_kafka_uring_sbuf_t *sb) {
+        struct io_uring_sqe *sqe;
+
+        if (!(sqe = rd_kafka_uring_sqe(rku))) {
+                /* Nothing is in flight referencing the buffer */
+                rku->rku_send_err = EAGAIN;
+                rku->rku_send_inflight = rd_false;
+                return;
+        }
+
+        sqe->opcode    = IORING_OP_SEND;
+        sqe->fd        = rku->rku_s;
+        sqe->addr      = (uint64_t)(uintptr_t)(sb->p + sb->of);
+        sqe->len       = (unsigned)(sb->len - sb->of);
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = RD_KAFKA_URING_UD_SEND;
+        rd_kafka_uring_sqe_commit(rku);
+}
+
+
+/**
+ * @brief Put the buffer being filled in flight and start filling
+ *        the other one.
+ */
+static void rd_kafka_uring_send_submit (rd_kafka_uring_t *rku) {
+        rd_kafka_uring_sbuf_t *sb = &rku->rku_sbuf[rku->rku_sbuf_fill];
+
+        rku->rku_sbuf_fill     = !rku->rku_sbuf_fill;
+        rku->rku_send_inflight = rd_true;
+        rd_kafka_uring_send_sqe(rku, sb);
+}
+
+
+/**
+ * @brief Hand receive buffer \p bid back to the kernel.
+ */
+static void rd_kafka_uring_rbuf_recycle (rd_kafka_uring_t *rku, uint16_t bid) {
+        struct io_uring_buf *buf;
+
+        buf = &rku->rku_br->bufs[rku->rku_br_tail &
+                                 (RD_KAFKA_URING_RBUF_CNT - 1)];
+        buf->addr = (uint64_t)(uintptr_t)(rku->rku_rbufs +
+                                          (size_t)bid *
+                                          RD_KAFKA_URING_RBUF_SIZE);
+        buf->len  = RD_KAFKA_URING_RBUF_SIZE;
+        buf->bid  = bid;
+
+        rku->rku_br_tail++;
+        __atomic_store_n(&rku->rku_br->tail, rku->rku_br_tail,
+                         __ATOMIC_RELEASE);
+}
+
+
+/**
+ * @brief Serve the completion queue.
+ *
+ * @returns rd_true if the wake-up fd was triggered.
+ */
+static rd_bool_t rd_kafka_uring_reap (rd_kafka_uring_t *rku) {
+        unsigned head = *rku->rku_cq_head;
+        unsigned tail = __atomic_load_n(rku->rku_cq_tail, __ATOMIC_ACQUIRE);
+        rd_bool_t woken = rd_false;
+
+        for ( ; head != tail ; head++) {
+                const struct io_uring_cqe *cqe =
+                        &rku->rku_cqes[head & rku->rku_cq_mask];
+                rd_kafka_uring_sbuf_t *sb;
+
+                switch (cqe->user_data)
+                {
+                case RD_KAFKA_URING_UD_RECV:
+                        if (!(cqe->flags & IORING_CQE_F_MORE))
+                                rku->rku_recv_armed = rd_false;
+
+                        if (cqe->res > 0) {
+                                int i = (rku->rku_rq_head + rku->rku_rq_cnt) &
+                                        (RD_KAFKA_URING_RBUF_CNT - 1);
+                                rd_assert(cqe->flags & IORING_CQE_F_BUFFER);
+                                rd_assert(rku->rku_rq_cnt <
+                                          RD_KAFKA_URING_RBUF_CNT);
+                                rku->rku_rq[i].bid = (uint16_t)
+                                        (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                                rku->rku_rq[i].len = (size_t)cqe->res;
+                                rku->rku_rq[i].of  = 0;
+                                rku->rku_rq_cnt++;
+                        } else if (cqe->res == 0) {
+                                rku->rku_recv_eof = rd_true;
+                        } else if (cqe->res != -ENOBUFS &&
+                                   cqe->res != -ECANCELED) {
+                                /* -ENOBUFS: all buffers are in use,
+                                 * re-armed when one is recycled. */
+                                rku->rku_recv_err = -cqe->res;
+                        }
+                        break;
+
+                case RD_KAFKA_URING_UD_SEND:
+                        sb = &rku->rku_sbuf[!rku->rku_sbuf_fill];
+
+                        if (cqe->res <= 0) {
+                                rku->rku_send_err = cqe->res < 0 ?
+                                        -cqe->res : ECONNRESET;
+                                rku->rku_send_inflight = rd_false;
+                                break;
+                        }
+
+                        sb->of += (size_t)cqe->res;
+                        if (sb->of < sb->len) {
+                                /* Partial send: send the remainder */
+                                rd_kafka_uring_send_sqe(rku, sb);
+                                break;
+                        }
+
+                        sb->len = sb->of = 0;
+                        rku->rku_send_inflight = rd_false;
+
+                        if (rku->rku_sbuf[rku->rku_sbuf_fill].len > 0 &&
+                            !rku->rku_send_err)
+                                rd_kafka_uring_send_submit(rku);
+                        break;
+
+                case RD_KAFKA_URING_UD_WAKEUP:
+                        rku->rku_wakeup_armed = rd_false;
+                        if (cqe->res > 0 && rku->rku_wakeup) {
+                                /* Clear the wake-up (re-arming it) prior
+                                 * to the broker thread serving
+                                 * its queues. */
+                                rd_wakeup_clear(rku->rku_wakeup);
+                                woken = rd_true;
+                        }
+                        break;
+
+                default:
+                        break;
+                }
+        }
+
+        __atomic_store_n(rku->rku_cq_head, head, __ATOMIC_RELEASE);
+
+        return woken;
+}
+
+
+/**
+ * @brief Re-arm the receive and wake-up requests if they have ended.
+ */
+static void rd_kafka_uring_arm (rd_kafka_uring_t *rku) {
+        /* The multishot receive ends when there are no free
+         * buffers: only re-arm it once a buffer has been recycled. */
+        if (!rku->rku_recv_armed && !rku->rku_recv_eof &&
+            !rku->rku_recv_err &&
+            rku->rku_rq_cnt < RD_KAFKA_URING_RBUF_CNT)
+                rd_kafka_uring_recv_arm(rku);
+
+        if (!rku->rku_wakeup_armed && rku->rku_wakeup &&
+            rd_wakeup_fd(rku->rku_wakeup) != -1)
+                rd_kafka_uring_wakeup_arm(rku);
+}
+
+
+/**
+ * @returns the POLL.. events that are ready out of \p events.
+ */
+static int rd_kafka_uring_revents (const rd_kafka_uring_t *rku, int events) {
+        int revents = 0;
+
+        /* A failed send is reported as a receive error, whether or
+         * not there is more to send, see rd_kafka_uring_recv(). */
+        if (rku->rku_rq_cnt > 0 || rku->rku_recv_eof || rku->rku_recv_err ||
+            rku->rku_send_err)
+                revents |= POLLIN;
+
+        if ((events & POLLOUT) &&
+            (rku->rku_send_err ||
+             rku->rku_sbuf[rku->rku_sbuf_fill].len <
+             rku->rku_sbuf[rku->rku_sbuf_fill].size))
+                revents |= POLLOUT;
+
+        return revents;
+}
+
+
+/**
+ * @brief Wait at most \p tmout ms for \p events (POLLIN, POLLOUT)
+ *        or the broker wake-up, submitting any queued requests.
+ *
+ * @returns the POLL.. events that are ready.
+ *
+ * @locality broker thread
+ */
+int rd_kafka_uring_poll (rd_kafka_uring_t *rku, int events, int tmout) {
+        rd_ts_t abs_timeout = rd_timeout_init(tmout);
+        rd_bool_t woken;
+        int revents;
+
+        woken = rd_kafka_uring_reap(rku);
+        rd_kafka_uring_arm(rku);
+        revents = rd_kafka_uring_revents(rku, events);
+
+        while (!revents && !woken &&
+               (tmout = rd_timeout_remains(abs_timeout)) != RD_POLL_NOWAIT) {
+                if (rd_kafka_uring_enter(rku, 1, tmout) == -1 &&
+                    errno != ETIME && errno != EINTR && errno != EBUSY) {
+                        rku->rku_recv_err = errno;
+                        return POLLIN;
+                }
+
+                woken = rd_kafka_uring_reap(rku);
+                rd_kafka_uring_arm(rku);
+                revents = rd_kafka_uring_revents(rku, events);
+        }
+
+        /* Submit requests queued by the reaping above so they are
+         * not held back while the caller serves the events. */
+        if (rku->rku_to_submit > 0)
+                rd_kafka_uring_enter(rku, 0, 0);
+
+        return revents;
+}
+
+
+/**
+ * @brief Copy received data to \p rbuf.
+ *
+ * Once the received data is consumed an asynchronous send error is
+ * returned as well: the sent requests have already been handed over to
+ * wait for their responses, so the connection must fail for them
+ * to be retried.
+ *
+ * @returns the number of bytes copied, 0 if no data is available,
+ *          or -1 on error or disconnect.
+ *
+ * @locality broker thread
+ */
+ssize_t rd_kafka_uring_recv (rd_kafka_uring_t *rku, rd_buf_t *rbuf,
+                             char *errstr, size_t errstr_size) {
+        ssize_t sum = 0;
+
+        while (rku->rku_rq_cnt > 0) {
+                const char *src;
+                void *p;
+                size_t len, n;
+
+                if (!(len = rd_buf_get_writable(rbuf, &p)))
+                        break;
+
+                src = rku->rku_rbufs +
+                        (size_t)rku->rku_rq[rku->rku_rq_head].bid *
+                        RD_KAFKA_URING_RBUF_SIZE;
+                n = RD_MIN(len, rku->rku_rq[rku->rku_rq_head].len -
+                           rku->rku_rq[rku->rku_rq_head].of);
+
+                memcpy(p, src + rku->rku_rq[rku->rku_rq_head].of, n);
+                rd_buf_write(rbuf, NULL, n);
+                sum += (ssize_t)n;
+
+                rku->rku_rq[rku->rku_rq_head].of += n;
+                if (rku->rku_rq[rku->rku_rq_head].of ==
+                    rku->rku_rq[rku->rku_rq_head].len) {
+                        rd_kafka_uring_rbuf_recycle(
+                                rku, rku->rku_rq[rku->rku_rq_head].bid);
+                        rku->rku_rq_head = (rku->rku_rq_head + 1) &
+                                (RD_KAFKA_URING_RBUF_CNT - 1);
+                        rku->rku_rq_cnt--;
+                }
+        }
+
+        if (sum > 0 || rku->rku_rq_cnt > 0)
+                return sum;
+
+        if (rku->rku_send_err) {
+                rd_snprintf(errstr, errstr_size, "Send failed: %s",
+                            rd_strerror(rku->rku_send_err));
+                errno = rku->rku_send_err;
+                return -1;
+        } else if (rku->rku_recv_err) {
+                rd_snprintf(errstr, errstr_size, "%s",
+                            rd_strerror(rku->rku_recv_err));
+                errno = rku->rku_recv_err;
+                return -1;
+        } else if (rku->rku_recv_eof) {
+                rd_snprintf(errstr, errstr_size, "Disconnected");
+                errno = ECONNRESET;
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/**
+ * @brief Copy as much as possible of \p slice to the send buffer
+ *        and submit it, unless a send is already in flight.
+ *
+ * Like a socket send buffer the copied data is sent asynchronously:
+ * a later send failure is reported by rd_kafka_uring_poll() and
+ * rd_kafka_uring_recv().
+ *
+ * @returns the number of bytes copied, 0 if the send buffer is full,
+ *          or -1 on error.
+ *
+ * @locality broker thread
+ */
+ssize_t rd_kafka_uring_send (rd_kafka_uring_t *rku, rd_slice_t *slice,
+                             char *errstr, size_t errstr_size) {
+        rd_kafka_uring_sbuf_t *sb = &rku->rku_sbuf[rku->rku_sbuf_fill];
+        size_t n;
+
+        if (rku->rku_send_err) {
+                rd_snprintf(errstr, errstr_size, "%s",
+                            rd_strerror(rku->rku_send_err));
+                errno = rku->rku_send_err;
+                return -1;
+        }
+
+        n = RD_MIN(sb->size - sb->len, rd_slice_remains(slice));
+        if (n == 0)
+                return 0;
+
+        rd_slice_read(slice, sb->p + sb->len, n);
+        sb->len += n;
+
+        if (!rku->rku_send_inflight)
+                rd_kafka_uring_send_submit(rku);
+
+        return (ssize_t)n;
+}
+
+
+/**
+ * @brief Set up the io_uring and its shared rings.
+ *
+ * @returns 0 on success or -1 on failure.
+ */
+static int rd_kafka_uring_setup (rd_kafka_uring_t *rku,
+                                 char *errstr, size_t errstr_size) {
+        struct io_uring_params p = RD_ZERO_INIT;
+        const int features = IORING_FEAT_NODROP|IORING_FEAT_EXT_ARG;
+
+        p.flags      = IORING_SETUP_CQSIZE;
+        p.cq_entries = RD_KAFKA_URING_CQ_ENTRIES;
+
+        rku->rku_fd = (int)syscall(__NR_io_uring_setup,
+                                   RD_KAFKA_URING_SQ_ENTRIES, &p);
+        if (rku->rku_fd == -1) {
+                rd_snprintf(errstr, errstr_size,
+                            "io_uring_setup() failed: %s",
+                            rd_strerror(errno));
+                return -1;
+        }
+
+        if ((p.features & features) != features) {
+                rd_snprintf(errstr, errstr_size,
+                            "io_uring features 0x%x not supported by kernel "
+                            "(requires Linux >= 6.0)",
+                            features & ~p.features);
+                return -1;
+        }
+
+        rku->rku_sq_ring_size = p.sq_off.array +
+                p.sq_entries * sizeof(unsigned);
+        rku->rku_cq_ring_size = p.cq_off.cqes +
+                p.cq_entries * sizeof(struct io_uring_cqe);
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+                rku->rku_sq_ring_size = rku->rku_cq_ring_size =
+                        RD_MAX(rku->rku_sq_ring_size, rku->rku_cq_ring_size);
+
+        rku->rku_sq_ring = mmap(NULL, rku->rku_sq_ring_size,
+                                PROT_READ|PROT_WRITE,
+                                MAP_SHARED|MAP_POPULATE,
+                                rku->rku_fd, IORING_OFF_SQ_RING);
+        if (rku->rku_sq_ring == MAP_FAILED) {
+                rku->rku_sq_ring = NULL;
+                goto err_mmap;
+        }
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                rku->rku_cq_ring = rku->rku_sq_ring;
+        } else {
+                rku->rku_cq_ring = mmap(NULL, rku->rku_cq_ring_size,
+                                        PROT_READ|PROT_WRITE,
+                                        MAP_SHARED|MAP_POPULATE,
+                                        rku->rku_fd, IORING_OFF_CQ_RING);
+                if (rku->rku_cq_ring == MAP_FAILED) {
+                        rku->rku_cq_ring = NULL;
+                        goto err_mmap;
+                }
+        }
+
+        rku->rku_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        rku->rku_sqes = mmap(NULL, rku->rku_sqes_size,
+                             PROT_READ|PROT_WRITE,
+                             MAP_SHARED|MAP_POPULATE,
+                             rku->rku_fd, IORING_OFF_SQES);
+        if (rku->rku_sqes == MAP_FAILED) {
+                rku->rku_sqes = NULL;
+                goto err_mmap;
+        }
+
+        rku->rku_sq_head    = (unsigned *)((char *)rku->rku_sq_ring +
+                                           p.sq_off.head);
+        rku->rku_sq_tail    = (unsigned *)((char *)rku->rku_sq_ring +
+                                           p.sq_off.tail);
+        rku->rku_sq_array   = (unsigned *)((char *)rku->rku_sq_ring +
+                                           p.sq_off.array);
+        rku->rku_sq_mask    = *(unsigned *)((char *)rku->rku_sq_ring +
+                                            p.sq_off.ring_mask);
+        rku->rku_sq_entries = p.sq_entries;
+
+        rku->rku_cq_head    = (unsigned *)((char *)rku->rku_cq_ring +
+                                           p.cq_off.head);
+        rku->rku_cq_tail    = (unsigned *)((char *)rku->rku_cq_ring +
+                                           p.cq_off.tail);
+        rku->rku_cq_mask    = *(unsigned *)((char *)rku->rku_cq_ring +
+                                            p.cq_off.ring_mask);
+        rku->rku_cqes       = (struct io_uring_cqe *)
+                ((char *)rku->rku_cq_ring + p.cq_off.cqes);
+
+        return 0;
+
+ err_mmap:
+        rd_snprintf(errstr, errstr_size, "Failed to map io_uring: %s",
+                    rd_strerror(errno));
+        return -1;
+}
+
+
+/**
+ * @brief Set up and register the provided receive buffer ring.
+ *
+ * @returns 0 on success or -1 on failure.
+ */
+static int rd_kafka_uring_rbufs_setup (rd_kafka_uring_t *rku,
+                                       char *errstr, size_t errstr_size) {
+        struct io_uring_buf_reg reg = RD_ZERO_INIT;
+        int i;
+
+        /* The buffer ring must be page aligned */
+        rku->rku_br_size = RD_KAFKA_URING_RBUF_CNT *
+                sizeof(struct io_uring_buf);
+        rku->rku_br = mmap(NULL, rku->rku_br_size, PROT_READ|PROT_WRITE,
+                           MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (rku->rku_br == MAP_FAILED) {
+                rku->rku_br = NULL;
+                rd_snprintf(errstr, errstr_size,
+                            "Failed to allocate io_uring buffer ring: %s",
+                            rd_strerror(errno));
+                return -1;
+        }
+
+        reg.ring_addr    = (uint64_t)(uintptr_t)rku->rku_br;
+        reg.ring_entries = RD_KAFKA_URING_RBUF_CNT;
+        reg.bgid         = RD_KAFKA_URING_BGID;
+
+        if (syscall(__NR_io_uring_register, rku->rku_fd,
+                    IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+                rd_snprintf(errstr, errstr_size,
+                            "Failed to register io_uring buffer ring: %s "
+                            "(requires Linux >= 5.19)",
+                            rd_strerror(errno));
+                return -1;
+        }
+        rku->rku_br_registered = rd_true;
+
+        rku->rku_rbufs = rd_malloc((size_t)RD_KAFKA_URING_RBUF_CNT *
+                                   RD_KAFKA_URING_RBUF_SIZE);
+        for (i = 0 ; i < RD_KAFKA_URING_RBUF_CNT ; i++)
+                rd_kafka_uring_rbuf_recycle(rku, (uint16_t)i);
+
+        return 0;
+}
+
+
+/**
+ * @brief Free the io_uring and the buffers, unless \p leak_bufs
+ *        is set in which case the buffers are leaked since requests
+ *        referencing them may still be in flight.
+ *
+ * The ring teardown following close() of the io_uring fd is asynchronous
+ * in the kernel, so there is no point after which buffers referenced by
+ * uncancelled requests are known to be unused: those must be leaked
+ * rather than risk the kernel writing to freed memory.
+ * rd_kafka_uring_destroy() only asks for this if the synchronous
+ * cancellation of all requests failed.
+ */
+static void rd_kafka_uring_free (rd_kafka_uring_t *rku, rd_bool_t leak_bufs) {
+        int i;
+
+        if (rku->rku_br_registered && !leak_bufs) {
+                /* The ring is quiesced: hand the buffer ring back
+                 * explicitly rather than leaving it to the teardown. */
+                struct io_uring_buf_reg reg = RD_ZERO_INIT;
+
+                reg.bgid = RD_KAFKA_URING_BGID;
+                syscall(__NR_io_uring_register, rku->rku_fd,
+                        IORING_UNREGISTER_PBUF_RING, &reg, 1);
+                rku->rku_br_registered = rd_false;
+        }
+
+        if (rku->rku_sqes)
+                munmap(rku->rku_sqes, rku->rku_sqes_size);
+        if (rku->rku_cq_ring && rku->rku_cq_ring != rku->rku_sq_ring)
+                munmap(rku->rku_cq_ring, rku->rku_cq_ring_size);
+        if (rku->rku_sq_ring)
+                munmap(rku->rku_sq_ring, rku->rku_sq_ring_size);
+        if (rku->rku_fd != -1)
+                close(rku->rku_fd);
+
+        if (leak_bufs)
+                return;
+
+        if (rku->rku_br)
+                munmap(rku->rku_br, rku->rku_br_size);
+        if (rku->rku_rbufs)
+                rd_free(rku->rku_rbufs);
+        for (i = 0 ; i < 2 ; i++)
+                if (rku->rku_sbuf[i].p)
+                        rd_free(rku->rku_sbuf[i].p);
+        rd_free(rku);
+}
+
+
+/**
+ * @brief Create an io_uring backend for connected socket \p s.
+ *
+ * @param wakeup The broker's wake-up, polled by rd_kafka_uring_poll(),
+ *               or NULL.
+ * @param sndbuf_size Socket send buffer size, used as the size of each
+ *                    of the two send buffers.
+ *
+ * @returns the io_uring backend, or NULL on failure (errstr set).
+ *
+ * @locality broker thread
+ */
+rd_kafka_uring_t *rd_kafka_uring_new (int s, rd_wakeup_t *wakeup,
+                                      size_t sndbuf_size,
+                                      char *errstr, size_t errstr_size) {
+        rd_kafka_uring_t *rku;
+        int i;
+
+        rku = rd_calloc(1, sizeof(*rku));
+        rku->rku_fd     = -1;
+        rku->rku_s      = s;
+        rku->rku_wakeup = wakeup;
+
+        if (rd_kafka_uring_setup(rku, errstr, errstr_size) == -1 ||
+            rd_kafka_uring_rbufs_setup(rku, errstr, errstr_size) == -1) {
+                rd_kafka_uring_free(rku, rd_false);
+                return NULL;
+        }
+
+        sndbuf_size = RD_MAX(sndbuf_size, RD_KAFKA_URING_SBUF_MIN);
+        sndbuf_size = RD_MIN(sndbuf_size, RD_KAFKA_URING_SBUF_MAX);
+        for (i = 0 ; i < 2 ; i++) {
+                rku->rku_sbuf[i].p    = rd_malloc(sndbuf_size);
+                rku->rku_sbuf[i].size = sndbuf_size;
+        }
+
+        rd_kafka_uring_arm(rku);
+
+        return rku;
+}
+
+
+/**
+ * @brief Synchronously cancel all requests in flight, waiting at most
+ *        \p tmout ms for them to complete, and reap their completions.
+ *
+ * @returns rd_true if no requests referencing the buffers remain
+ *          in flight.
+ */
+static rd_bool_t rd_kafka_uring_quiesce (rd_kafka_uring_t *rku, int tmout) {
+        struct io_uring_sync_cancel_reg reg = RD_ZERO_INIT;
+
+        reg.fd              = -1;
+        reg.flags           = IORING_ASYNC_CANCEL_ANY|IORING_ASYNC_CANCEL_ALL;
+        reg.timeout.tv_sec  = tmout / 1000;
+        reg.timeout.tv_nsec = (long long)(tmout % 1000) * 1000000;
+
+        /* Returns once the cancelled requests have completed,
+         * -ENOENT if there were none. */
+        if (syscall(__NR_io_uring_register, rku->rku_fd,
+                    IORING_REGISTER_SYNC_CANCEL, &reg, 1) == -1 &&
+            errno != ENOENT)
+                return rd_false;
+
+        rd_kafka_uring_reap(rku);
+
+        /* A send may have been resubmitted for a partial send that
+         * completed prior to the cancellation. */
+        return !rku->rku_recv_armed && !rku->rku_send_inflight;
+}
+
+
+/**
+ * @brief Shut down the socket, wait for in-flight requests referencing
+ *        the buffers to finish and destroy the io_uring backend.
+ *
+ * @locality broker thread
+ */
+void rd_kafka_uring_destroy (rd_kafka_uring_t *rku) {
+        int i;
+
+        /* The broker's wake-up must not be cleared from here on */
+        rku->rku_wakeup = NULL;
+
+        /* Receives and sends in flight end with an error or EOF
+         * on shutdown. */
+        shutdown(rku->rku_s, SHUT_RDWR);
+        if (rku->rku_wakeup_armed)
+                rd_kafka_uring_cancel(rku, RD_KAFKA_URING_UD_WAKEUP);
+        if (rku->rku_recv_armed)
+                rd_kafka_uring_cancel(rku, RD_KAFKA_URING_UD_RECV);
+
+        for (i = 0 ; i < 100 &&
+                     (rku->rku_recv_armed || rku->rku_send_inflight ||
+                      rku->rku_to_submit > 0) ; i++) {
+                rd_kafka_uring_enter(rku, 1, 10);
+                rd_kafka_uring_reap(rku);
+        }
+
+        /* Requests still in flight are cancelled, at most twice since
+         * a partial send completion reaped above may have resubmitted
+         * the remainder. */
+        for (i = 0 ; i < 2 &&
+                     (rku->rku_recv_armed || rku->rku_send_inflight) ; i++) {
+                if (rku->rku_to_submit > 0)
+                        rd_kafka_uring_enter(rku, 0, 0);
+                if (rd_kafka_uring_quiesce(rku, 1000))
+                        break;
+        }
+
+        rd_kafka_uring_free(rku, rku->rku_recv_armed ||
+                            rku->rku_send_inflight);
+}
+
+
+static once_flag rd_kafka_uring_probe_once = ONCE_FLAG_INIT;
+static char rd_kafka_uring_probe_errstr[256];
+
+/**
+ * @brief Probe whether the kernel supports the io_uring features used,
+ *        by receiving on a socketpair with a multishot receive.
+ */
+static void rd_kafka_uring_probe (void) {
+        char *errstr = rd_kafka_uring_probe_errstr;
+        size_t errstr_size = sizeof(rd_kafka_uring_probe_errstr);
+        rd_kafka_uring_t *rku;
+        char buf[8] = "probe";
+        int sv[2];
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+                rd_snprintf(errstr, errstr_size,
+                            "socketpair() failed: %s", rd_strerror(errno));
+                return;
+        }
+
+        if ((rku = rd_kafka_uring_new(sv[0], NULL, 0,
+                                      errstr, errstr_size))) {
+                if (write(sv[1], buf, sizeof(buf)) != sizeof(buf) ||
+                    !(rd_kafka_uring_poll(rku, POLLIN, 1000) & POLLIN) ||
+                    rku->rku_rq_cnt != 1 || !rku->rku_recv_armed)
+                        rd_snprintf(errstr, errstr_size,
+                                    "io_uring multishot receive "
+                                    "not supported by kernel: %s "
+                                    "(requires Linux >= 6.0)",
+                                    rku->rku_recv_err ?
+                                    rd_strerror(rku->rku_recv_err) :
+                                    "no data received");
+                rd_kafka_uring_destroy(rku);
+        }
+
+        close(sv[0]);
+        close(sv[1]);
+}
+
+
+/**
+ * @returns 1 if the kernel supports the io_uring backend, else 0 in
+ *          which case the reason is written to \p errstr.
+ *
+ * The kernel is probed once per process.
+ */
+int rd_kafka_uring_supported (char *errstr, size_t errstr_size) {
+        call_once(&rd_kafka_uring_probe_once, rd_kafka_uring_probe);
+
+        if (!*rd_kafka_uring_probe_errstr)
+                return 1;
+
+        rd_snprintf(errstr, errstr_size, "%s", rd_kafka_uring_probe_errstr);
+        return 0;
+}
+
+/**@}*/
+
+
+
+/**
+ * @brief Unit test: send and receive more than the send and receive
+ *        buffers hold over a socketpair, and verify wake-ups,
+ *        disconnect and asynchronous send error handling.
+ */
+int unittest_uring (void) {
+        const size_t size = 3 * RD_KAFKA_URING_SBUF_MIN +
+                RD_KAFKA_URING_RBUF_CNT * RD_KAFKA_URING_RBUF_SIZE + 13;
+        char errstr[256];
+        rd_kafka_uring_t *rku;
+        rd_wakeup_t rdw;
+        rd_buf_t sbuf, rbuf;
+        rd_slice_t slice;
+        char *data, *peer;
+        size_t peer_of = 0, wof = 0;
+        rd_ts_t ts;
+        ssize_t r;
+        int sv[2];
+        size_t i;
+
+        if (!rd_kafka_uring_supported(errstr, sizeof(errstr))) {
+                RD_UT_SAY("io_uring not supported, skipping: %s", errstr);
+                RD_UT_PASS();
+        }
+
+        RD_UT_ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0,
+                     "socketpair() failed: %s", rd_strerror(errno));
+        RD_UT_ASSERT(rd_fd_set_nonblocking(sv[1]) == 0,
+                     "failed to set non-blocking");
+        RD_UT_ASSERT(rd_wakeup_init(&rdw) == 0, "wakeup init failed");
+
+        rku = rd_kafka_uring_new(sv[0], &rdw, 0, errstr, sizeof(errstr));
+        RD_UT_ASSERT(rku, "rd_kafka_uring_new() failed: %s", errstr);
+
+        data = rd_malloc(size);
+        peer = rd_malloc(size);
+        for (i = 0 ; i < size ; i++)
+                data[i] = (char)(i * 31);
+
+        /* Send: the peer reads while the send buffers are full */
+        rd_buf_init(&sbuf, 1, size);
+        rd_buf_write(&sbuf, data, size);
+        rd_slice_init_full(&slice, &sbuf);
+
+        ts = rd_clock() + 10*1000*1000;
+        while (peer_of < size && rd_clock() < ts) {
+                if (rd_slice_remains(&slice) > 0) {
+                        r = rd_kafka_uring_send(rku, &slice,
+                                                errstr, sizeof(errstr));
+                        RD_UT_ASSERT(r >= 0, "send failed: %s", errstr);
+                }
+
+                rd_kafka_uring_poll(rku, POLLOUT, 10);
+
+                while ((r = read(sv[1], peer + peer_of,
+                                 size - peer_of)) > 0)
+                        peer_of += (size_t)r;
+        }
+        RD_UT_ASSERT(peer_of == size, "peer received %"PRIusz"/%"PRIusz,
+                     peer_of, size);
+        RD_UT_ASSERT(!memcmp(data, peer, size), "sent data mismatch");
+        rd_buf_destroy(&sbuf);
+
+        /* Receive: more than the provided buffers hold, which
+         * requires the multishot receive to be re-armed. */
+        rd_buf_init(&rbuf, 1, size);
+        rd_buf_write_ensure(&rbuf, size, size);
+
+        ts = rd_clock() + 10*1000*1000;
+        while (rd_buf_len(&rbuf) < size && rd_clock() < ts) {
+                if (wof < size &&
+                    (r = write(sv[1], data + wof, size - wof)) > 0)
+                        wof += (size_t)r;
+
+                if (rd_kafka_uring_poll(rku, 0, 10) & POLLIN) {
+                        r = rd_kafka_uring_recv(rku, &rbuf,
+                                                errstr, sizeof(errstr));
+                        RD_UT_ASSERT(r >= 0, "recv failed: %s", errstr);
+                }
+        }
+        RD_UT_ASSERT(rd_buf_len(&rbuf) == size,
+                     "received %"PRIusz"/%"PRIusz,
+                     rd_buf_len(&rbuf), size);
+        rd_slice_init_full(&slice, &rbuf);
+        RD_UT_ASSERT(rd_slice_read(&slice, peer, size) == size,
+                     "short slice read");
+        RD_UT_ASSERT(!memcmp(data, peer, size), "received data mismatch");
+        rd_buf_destroy(&rbuf);
+
+        /* Wake-up interrupts the poll */
+        ts = rd_clock();
+        rd_wakeup_signal(&rdw);
+        rd_kafka_uring_poll(rku, 0, 5000);
+        RD_UT_ASSERT(rd_clock() - ts < 2*1000*1000,
+                     "poll was not woken up");
+
+        /* Disconnect */
+        close(sv[1]);
+        rd_buf_init(&rbuf, 1, 100);
+        rd_buf_write_ensure(&rbuf, 100, 100);
+        RD_UT_ASSERT(rd_kafka_uring_poll(rku, 0, 5000) & POLLIN,
+                     "disconnect not signalled");
+        r = rd_kafka_uring_recv(rku, &rbuf, errstr, sizeof(errstr));
+        RD_UT_ASSERT(r == -1, "expected recv failure, not %"PRIdsz, r);
+        rd_buf_destroy(&rbuf);
+
+        rd_kafka_uring_destroy(rku);
+        close(sv[0]);
+
+        /* A send failing after its data was accepted fails the
+         * connection, even with nothing more to send. */
+        RD_UT_ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0,
+                     "socketpair() failed: %s", rd_strerror(errno));
+        RD_UT_ASSERT(shutdown(sv[1], SHUT_RD) == 0,
+                     "shutdown() failed: %s", rd_strerror(errno));
+        rku = rd_kafka_uring_new(sv[0], NULL, 0, errstr, sizeof(errstr));
+        RD_UT_ASSERT(rku, "rd_kafka_uring_new() failed: %s", errstr);
+        rd_buf_init(&sbuf, 1, 100);
+        rd_buf_write(&sbuf, data, 100);
+        rd_slice_init_full(&slice, &sbuf);
+        r = rd_kafka_uring_send(rku, &slice, errstr, sizeof(errstr));
+        RD_UT_ASSERT(r == 100, "expected send to be accepted, not %"PRIdsz,
+                     r);
+        rd_buf_destroy(&sbuf);
+        RD_UT_ASSERT(rd_kafka_uring_poll(rku, 0, 5000) & POLLIN,
+                     "send error not signalled");
+        rd_buf_init(&rbuf, 1, 100);
+        rd_buf_write_ensure(&rbuf, 100, 100);
+        r = rd_kafka_uring_recv(rku, &rbuf, errstr, sizeof(errstr));
+        RD_UT_ASSERT(r == -1 && errno == EPIPE,
+                     "expected recv to fail with EPIPE, not %"PRIdsz": %s",
+                     r, r == -1 ? rd_strerror(errno) : "");
+        rd_buf_destroy(&rbuf);
+        rd_kafka_uring_destroy(rku);
+        close(sv[0]);
+        close(sv[1]);
+
+        /* Requests that do not end by themselves, here an idle
+         * multishot receive on a live connection, are cancelled so
+         * the buffers can be freed. */
+        RD_UT_ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0,
+                     "socketpair() failed: %s", rd_strerror(errno));
+        rku = rd_kafka_uring_new(sv[0], NULL, 0, errstr, sizeof(errstr));
+        RD_UT_ASSERT(rku, "rd_kafka_uring_new() failed: %s", errstr);
+        rd_kafka_uring_poll(rku, POLLIN, 0);
+        RD_UT_ASSERT(rku->rku_recv_armed, "receive not armed");
+        RD_UT_ASSERT(rd_kafka_uring_quiesce(rku, 1000),
+                     "requests still in flight after cancellation");
+        rd_kafka_uring_destroy(rku);
+        close(sv[0]);
+        close(sv[1]);
+
+        rd_wakeup_destroy(&rdw);
+        rd_free(data);
+        rd_free(peer);
+
+        RD_UT_PASS();
+}
@@ -0,0 +1,69 @@
+/*
+ * librdkafka - Apache Kafka C library
+ *
+ * Copyright (c) 2018 Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _RDKAFKA_URING_H_
+#define _RDKAFKA_URING_H_
+
+/**
+ * @name io_uring broker socket IO backend (socket.io.backend=io_uring)
+ *
+ * Each connection gets its own small io_uring on which the broker thread
+ * keeps a multishot receive into a ring of provided (pre-registered)
+ * buffers, one send at a time, and a poll of the broker's wake-up fd.
+ *
+ * Sends are copied to a send buffer and submitted asynchronously,
+ * like a socket send buffer, and received data is copied out of the
+ * provided buffers on demand.
+ * Submissions are batched with the wait for completions in a single
+ * io_uring_enter() call, and completions that have already arrived are
+ * reaped from the shared completion ring without any syscall.
+ *
+ * @{
+ */
+
+typedef struct rd_kafka_uring_s rd_kafka_uring_t;
+
+int rd_kafka_uring_supported (char *errstr, size_t errstr_size);
+
+rd_kafka_uring_t *rd_kafka_uring_new (int s, rd_wakeup_t *wakeup,
+                                      size_t sndbuf_size,
+                                      char *errstr, size_t errstr_size);
+void rd_kafka_uring_destroy (rd_kafka_uring_t *rku);
+
+ssize_t rd_kafka_uring_send (rd_kafka_uring_t *rku, rd_slice_t *slice,
+                             char *errstr, size_t errstr_size);
+ssize_t rd_kafka_uring_recv (rd_kafka_uring_t *rku, rd_buf_t *rbuf,
+                             char *errstr, size_t errstr_size);
+int rd_kafka_uring_poll (rd_kafka_uring_t *rku, int events, int tmout);
+
+int unittest_uring (void);
+
+/**@}*/
+
+#endif /* _RDKAFKA_URING_H_ */
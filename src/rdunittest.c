@@ -35,16 +35,63 @@
 
 #include "rdvarint.h"
 #include "rdbuf.h"
+#include "rdgz.h"
 #include "crc32c.h"
 #include "rdmurmur2.h"
 #if WITH_HDRHISTOGRAM
 #include "rdhdrhistogram.h"
 #endif
 #include "rdkafka_int.h"
+#include "rdkafka_decompress.h"
+#include "rdkafka_lz4.h"
+#include "rdkafka_assignor.h"
+#include "rdkafka_request.h"
+#include "rdkafka_broker.h"
+#include "rdkafka_sasl.h"
+#if WITH_IO_URING
+#include "rdkafka_uring.h"
+#endif
 
 #include "rdsysqueue.h"
 
 
+/**
+ * @brief Create a client instance, without any brokers, for unit tests
+ *        that need real handles (and toppars from rd_kafka_toppar_get2())
+ *        rather than partially initialized mock structs.
+ *
+ * @param confv NULL-terminated list of property name and value pairs,
+ *              or NULL.
+ *
+ * @returns the instance, to be destroyed with rd_kafka_destroy(),
+ *          or NULL on failure.
+ */
+rd_kafka_t *rd_unittest_rk_new (rd_kafka_type_t type, const char **confv) {
+        rd_kafka_conf_t *conf = rd_kafka_conf_new();
+        char errstr[256];
+        rd_kafka_t *rk;
+
+        for ( ; confv && *confv ; confv += 2) {
+                if (rd_kafka_conf_set(conf, confv[0], confv[1],
+                                      errstr, sizeof(errstr)) !=
+                    RD_KAFKA_CONF_OK) {
+                        RD_UT_WARN("%s", errstr);
+                        rd_kafka_conf_destroy(conf);
+                        return NULL;
+                }
+        }
+
+        if (!(rk = rd_kafka_new(type, conf, errstr, sizeof(errstr)))) {
+                RD_UT_WARN("Failed to create instance: %s", errstr);
+                rd_kafka_conf_destroy(conf);
+                return NULL;
+        }
+
+        return rk;
+}
+
+
+
 /**
  * @name Test rdsysqueue.h / queue.h
  * @{
@@ -376,7 +423,73 @@ static int unittest_rdclock (void) {
 }
 #endif
 
+/**@}*/
+
 
+/**
+ * @name Test rdwakeup.h
+ * @{
+ */
+
+/**
+ * @returns the number of wake-ups read from the wake-up's fd, bypassing
+ *          rd_wakeup_clear(), or 0 if the fd was not readable.
+ */
+static int ut_wakeup_read (rd_wakeup_t *rdw) {
+#if RD_WAKEUP_EVENTFD
+        uint64_t cnt;
+        if (rd_read(rd_wakeup_fd(rdw), &cnt, sizeof(cnt)) != sizeof(cnt))
+                return 0;
+        return (int)cnt;
+#else
+        char buf[64];
+        int r = (int)rd_read(rd_wakeup_fd(rdw), buf, sizeof(buf));
+        return r > 0 ? r : 0;
+#endif
+}
+
+static int unittest_rdwakeup (void) {
+        rd_wakeup_t rdw;
+        int r, i;
+
+        r = rd_wakeup_init(&rdw);
+        RD_UT_ASSERT(!r, "rd_wakeup_init() failed: %s", rd_strerror(r));
+        RD_UT_ASSERT(rd_wakeup_fd(&rdw) != -1, "expected wake-up fd");
+
+        RD_UT_ASSERT((r = ut_wakeup_read(&rdw)) == 0,
+                     "expected no wake-up, got %d", r);
+
+        /* Signals are coalesced until the wake-up is cleared */
+        for (i = 0 ; i < 10 ; i++)
+                rd_wakeup_signal(&rdw);
+        RD_UT_ASSERT((r = ut_wakeup_read(&rdw)) == 1,
+                     "expected 1 coalesced wake-up, got %d", r);
+
+        rd_wakeup_signal(&rdw);
+        RD_UT_ASSERT((r = ut_wakeup_read(&rdw)) == 0,
+                     "expected no wake-up while pending, got %d", r);
+
+        /* Clearing re-arms the wake-up */
+        rd_wakeup_clear(&rdw);
+        rd_wakeup_signal(&rdw);
+        rd_wakeup_signal(&rdw);
+        rd_wakeup_clear(&rdw);
+        RD_UT_ASSERT((r = ut_wakeup_read(&rdw)) == 0,
+                     "expected cleared wake-up, got %d", r);
+
+        rd_wakeup_signal(&rdw);
+        RD_UT_ASSERT((r = ut_wakeup_read(&rdw)) == 1,
+                     "expected 1 wake-up after clear, got %d", r);
+
+        rd_wakeup_destroy(&rdw);
+        RD_UT_ASSERT(rd_wakeup_fd(&rdw) == -1, "expected no wake-up fd");
+
+        /* An uninitialized wake-up is a no-op */
+        rd_wakeup_signal(&rdw);
+        rd_wakeup_clear(&rdw);
+
+        RD_UT_PASS();
+}
 
 /**@}*/
 
@@ -389,13 +502,34 @@ int rd_unittest (void) {
         } unittests[] = {
                 { "sysqueue", unittest_sysqueue },
                 { "rdbuf",    unittest_rdbuf },
+                { "bufpool",  unittest_bufpool },
                 { "rdvarint", unittest_rdvarint },
                 { "crc32c",   unittest_crc32c },
                 { "msg",      unittest_msg },
+                { "op_pool",  unittest_op_pool },
+                { "fetch_batch", unittest_fetch_batch },
+                { "decomp_pool", unittest_decomp_pool },
                 { "murmurhash", unittest_murmur2 },
+                { "timer",    unittest_timer },
+                { "toppar",   unittest_toppar },
+                { "rdwakeup", unittest_rdwakeup },
+                { "sticky_assignor", unittest_sticky_assignor },
+                { "corridmap", unittest_corridmap },
+                { "request",  unittest_request },
+                { "broker",   unittest_broker },
+#if WITH_ZLIB
+                { "gz",       unittest_gz },
+#endif
+                { "lz4",      unittest_lz4 },
+#if WITH_SASL_SCRAM
+                { "scram",    unittest_scram },
+#endif
 #if WITH_HDRHISTOGRAM
                 { "rdhdrhistogram", unittest_rdhdrhistogram },
 #endif
+#if WITH_IO_URING
+                { "uring", unittest_uring },
+#endif
 #ifdef _MSC_VER
                 { "rdclock", unittest_rdclock },
 #endif
@@ -31,6 +31,8 @@
 
 #include <stdio.h>
 
+#include "rdkafka.h"
+
 
 /**
  * @brief Fail the current unit-test function.
@@ -89,6 +91,8 @@
         } while (0)
 
 
+rd_kafka_t *rd_unittest_rk_new (rd_kafka_type_t type, const char **confv);
+
 int rd_unittest (void);
 
 #endif /* _RD_UNITTEST_H */
@@ -29,6 +29,7 @@
 
 #include "rdvarint.h"
 #include "rdunittest.h"
+#include "rdtime.h"
 
 
 /**
@@ -38,11 +39,20 @@ size_t rd_varint_dec_slice (rd_slice_t *slice, int64_t *nump) {
         size_t num = 0;
         int shift = 0;
         unsigned char oct;
+        const void *p;
+        size_t r;
+
+        /* Decode directly from the current segment if
+         * the varint is fully contained in it. */
+        if (likely((r = rd_slice_peeker(slice, &p)) > 0 &&
+                   (r = rd_varint_dec_mem((const char *)p, r, nump)) > 0)) {
+                rd_slice_read(slice, NULL, r);
+                return r;
+        }
 
-        /* FIXME: Optimize to use something better than read() */
+        /* Slow path: varint spans segments */
         do {
-                size_t r = rd_slice_read(slice, &oct, sizeof(oct));
-                if (unlikely(r == 0))
+                if (unlikely(rd_slice_read(slice, &oct, sizeof(oct)) == 0))
                         return 0; /* Underflow */
                 num |= (uint64_t)(oct & 0x7f) << shift;
                 shift += 7;
@@ -56,7 +66,6 @@ size_t rd_varint_dec_slice (rd_slice_t *slice, int64_t *nump) {
 
 
 
-
 static int do_test_rd_uvarint_enc_i64 (const char *file, int line,
                                        int64_t num, const char *exp,
                                        size_t exp_size) {
@@ -114,6 +123,153 @@ static int do_test_rd_uvarint_enc_i64 (const char *file, int line,
 }
 
 
+/**
+ * @brief Verify the contiguous memory decoder for all encoded lengths,
+ *        and the slice decoder for varints spanning buffer segments.
+ */
+static int do_test_rd_varint_dec_mem (void) {
+        static const int64_t nums[] = {
+                0, 1, -1, 63, -64, 64, -65, 8191, -8192, 8192,
+                1048575, -1048576, 1048576, 134217727, -134217728,
+                134217728, 17179869183ll, 2199023255551ll,
+                281474976710655ll, 36028797018963967ll,
+                -36028797018963968ll, 36028797018963968ll,
+                4611686018427387903ll, INT64_MAX, INT64_MIN
+        };
+        size_t i;
+
+        for (i = 0 ; i < RD_ARRAYSIZE(nums) ; i++) {
+                char buf[32];
+                size_t sz, r;
+                int64_t v = -2;
+
+                memset(buf, 0xff, sizeof(buf));
+                sz = rd_uvarint_enc_i64(buf, sizeof(buf), nums[i]);
+                RD_UT_ASSERT(sz > 0, "encode of %"PRId64" failed", nums[i]);
+
+                r = rd_varint_dec_mem(buf, sizeof(buf), &v);
+                RD_UT_ASSERT(r == sz,
+                             "%"PRId64": expected %"PRIusz" bytes "
+                             "read, not %"PRIusz, nums[i], sz, r);
+                RD_UT_ASSERT(v == nums[i],
+                             "expected %"PRId64", not %"PRId64, nums[i], v);
+
+                /* Truncated */
+                r = rd_varint_dec_mem(buf, sz - 1, &v);
+                RD_UT_ASSERT(r == 0,
+                             "%"PRId64": truncated decode should fail, "
+                             "returned %"PRIusz, nums[i], r);
+
+                /* Spanning two segments */
+                if (sz > 1) {
+                        rd_buf_t b;
+                        rd_slice_t slice;
+
+                        rd_buf_init(&b, 2, 0);
+                        rd_buf_push(&b, buf, 1, NULL);
+                        rd_buf_push(&b, buf+1, sz-1, NULL);
+                        rd_slice_init_full(&slice, &b);
+                        v = -2;
+                        r = rd_varint_dec_slice(&slice, &v);
+                        RD_UT_ASSERT(r == sz && v == nums[i],
+                                     "split decode of %"PRId64" returned "
+                                     "%"PRId64" (%"PRIusz" bytes)",
+                                     nums[i], v, r);
+                        RD_UT_ASSERT(rd_slice_remains(&slice) == 0,
+                                     "%"PRIusz" bytes remain",
+                                     rd_slice_remains(&slice));
+                        rd_buf_destroy(&b);
+                }
+        }
+
+        /* Malformed: more than 10 bytes with the continuation bit set */
+        {
+                char buf[16];
+                int64_t v;
+                memset(buf, 0x80, sizeof(buf));
+                RD_UT_ASSERT(rd_varint_dec_mem(buf, sizeof(buf), &v) == 0,
+                             "malformed varint should fail");
+        }
+
+        RD_UT_PASS();
+}
+
+
+/**
+ * @brief Decode a stream of record-header-like varints from a slice,
+ *        with segment boundaries inside varints, and from contiguous
+ *        memory: both must yield the same values and consume the
+ *        entire stream.
+ */
+static int do_test_rd_varint_dec_stream (void) {
+        const size_t cnt = 1000;
+        const size_t bufsize = cnt * 10;
+        const size_t segsize = 7;
+        char *buf = rd_malloc(bufsize);
+        int64_t *exp = rd_malloc(sizeof(*exp) * cnt);
+        size_t of = 0, rof = 0, i;
+        rd_buf_t b;
+        rd_slice_t slice;
+
+        /* Mix of values typical of small-message record headers:
+         * record length, timestamp delta, offset delta,
+         * null key and value length, and a few large values
+         * that need the longer encodings. */
+        for (i = 0 ; i < cnt ; i++) {
+                switch (i % 6) {
+                case 0: exp[i] = 40 + (int64_t)(i % 200); break;
+                case 1: exp[i] = (int64_t)(i * 7) % 100000; break;
+                case 2: exp[i] = (int64_t)i / 5; break;
+                case 3: exp[i] = -1; break;
+                case 4: exp[i] = (int64_t)(i % 300); break;
+                default: exp[i] = -((int64_t)i << 40); break;
+                }
+                of += rd_uvarint_enc_i64(buf+of, bufsize-of, exp[i]);
+        }
+
+        /* Small segments so that many varints span two segments. */
+        rd_buf_init(&b, (of / segsize) + 1, 0);
+        for (i = 0 ; i < of ; i += segsize)
+                rd_buf_push(&b, buf+i, RD_MIN(segsize, of - i), NULL);
+        rd_slice_init_full(&slice, &b);
+
+        for (i = 0 ; i < cnt ; i++) {
+                int64_t v = 0;
+                size_t r;
+
+                r = rd_varint_dec_slice(&slice, &v);
+                RD_UT_ASSERT(r > 0 && v == exp[i],
+                             "slice: varint #%"PRIusz": expected %"PRId64
+                             ", not %"PRId64" (%"PRIusz" bytes)",
+                             i, exp[i], v, r);
+
+                v = 0;
+                r = rd_varint_dec_mem(buf+rof, of-rof, &v);
+                RD_UT_ASSERT(r > 0 && v == exp[i],
+                             "memory: varint #%"PRIusz": expected %"PRId64
+                             ", not %"PRId64" (%"PRIusz" bytes)",
+                             i, exp[i], v, r);
+                rof += r;
+
+                RD_UT_ASSERT(rd_slice_offset(&slice) == rof,
+                             "varint #%"PRIusz": slice at offset %"PRIusz
+                             ", memory at %"PRIusz,
+                             i, rd_slice_offset(&slice), rof);
+        }
+
+        RD_UT_ASSERT(rd_slice_remains(&slice) == 0 && rof == of,
+                     "%"PRIusz" slice and %"PRIusz" memory bytes "
+                     "not consumed",
+                     rd_slice_remains(&slice), of - rof);
+
+        rd_buf_destroy(&b);
+        rd_free(exp);
+        rd_free(buf);
+
+        RD_UT_PASS();
+}
+
+
 int unittest_rdvarint (void) {
         int fails = 0;
 
@@ -121,6 +277,8 @@ int unittest_rdvarint (void) {
                                             (const char[]){ 23<<1 }, 1);
         fails += do_test_rd_uvarint_enc_i64(__FILE__, __LINE__, 253,
                                             (const char[]){ 0xfa,  3 }, 2);
+        fails += do_test_rd_varint_dec_mem();
+        fails += do_test_rd_varint_dec_stream();
 
         return fails;
 }
@@ -141,6 +141,35 @@ size_t rd_varint_dec_i64 (const char *src, size_t srcsize, int64_t *nump) {
 }
 
 
+/**
+ * @brief Decodes the zig-zag varint in contiguous memory \p src of size
+ *        \p srcsize and stores the decoded signed integer in \p nump.
+ *
+ *        Unlike rd_varint_dec_i64() the varint is always decoded into
+ *        64 bits (regardless of the size of size_t) and varints longer
+ *        than 10 bytes are rejected.
+ *
+ * @returns the number of bytes read from \p src, or 0 if there were not
+ *          enough bytes in \p src or the varint is malformed.
+ */
+static RD_INLINE RD_UNUSED
+size_t rd_varint_dec_mem (const char *src, size_t srcsize, int64_t *nump) {
+        uint64_t num = 0;
+        size_t of = 0;
+        int shift = 0;
+
+        do {
+                if (unlikely(of == srcsize || of == 10))
+                        return 0; /* Underflow or malformed */
+                num |= (uint64_t)(src[of] & 0x7f) << shift;
+                shift += 7;
+        } while (src[of++] & 0x80);
+
+        *nump = (int64_t)(num >> 1) ^ -(int64_t)(num & 1);
+        return of;
+}
+
+
 /**
  * @brief Read a varint-encoded signed integer from \p slice.
  *
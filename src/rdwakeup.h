@@ -0,0 +1,178 @@
+/*
+ * librdkafka - Apache Kafka C library
+ *
+ * Copyright (c) 2018 Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _RDWAKEUP_H_
+#define _RDWAKEUP_H_
+
+#include "rd.h"
+#include "rdatomic.h"
+
+#ifdef __linux__
+#define RD_WAKEUP_EVENTFD 1
+#include <sys/eventfd.h>
+#endif
+
+
+/**
+ * @name Coalescing fd-based wake-ups
+ *
+ * A wake-up fd that a thread can include in its poll set and that any
+ * number of other threads can signal.
+ * The fd is an eventfd on Linux and a non-blocking pipe elsewhere.
+ *
+ * Signalled wake-ups are coalesced: once a wake-up is pending further
+ * rd_wakeup_signal() calls are reduced to an atomic read and cause no
+ * syscall until the waiting thread calls rd_wakeup_clear().
+ *
+ * The waiting thread must call rd_wakeup_clear() after it has been woken
+ * up and *before* it inspects the state (queues, etc) that the wake-up
+ * signals, so that a signal that is coalesced away while clearing
+ * is for state that the waiting thread is yet to inspect.
+ *
+ * @{
+ */
+
+typedef struct rd_wakeup_s {
+        int           rdw_fds[2];  /**< Read and write fds.
+                                    *   Both are the same eventfd on Linux.
+                                    *   -1 if not initialized. */
+        rd_atomic32_t rdw_pending; /**< A wake-up has been signalled
+                                    *   but not yet cleared. */
+} rd_wakeup_t;
+
+
+/**
+ * @brief Initialize the wake-up \p rdw.
+ *
+ * @returns 0 on success or an errno on failure in which case the
+ *          wake-up fd is -1 and rd_wakeup_signal() is a no-op.
+ */
+static RD_INLINE RD_UNUSED int rd_wakeup_init (rd_wakeup_t *rdw) {
+        int r = 0;
+
+        rd_atomic32_init(&rdw->rdw_pending, 0);
+
+#if RD_WAKEUP_EVENTFD
+        rdw->rdw_fds[0] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+        if (rdw->rdw_fds[0] == -1)
+                r = errno;
+        rdw->rdw_fds[1] = rdw->rdw_fds[0];
+#else
+        if ((r = rd_pipe_nonblocking(rdw->rdw_fds))) {
+                rdw->rdw_fds[0] = -1;
+                rdw->rdw_fds[1] = -1;
+        }
+#endif
+
+        return r;
+}
+
+
+/**
+ * @brief Close the wake-up's fds.
+ */
+static RD_INLINE RD_UNUSED void rd_wakeup_destroy (rd_wakeup_t *rdw) {
+        if (rdw->rdw_fds[0] != -1)
+                rd_close(rdw->rdw_fds[0]);
+        if (rdw->rdw_fds[1] != -1 && rdw->rdw_fds[1] != rdw->rdw_fds[0])
+                rd_close(rdw->rdw_fds[1]);
+        rdw->rdw_fds[0] = -1;
+        rdw->rdw_fds[1] = -1;
+}
+
+
+/**
+ * @returns the fd to poll for POLLIN, or -1 if not initialized.
+ */
+static RD_INLINE RD_UNUSED int rd_wakeup_fd (const rd_wakeup_t *rdw) {
+        return rdw->rdw_fds[0];
+}
+
+
+/**
+ * @brief Signal a wake-up, unless one is already pending.
+ *
+ * Writes are best effort: if the write fails (e.g., a full pipe)
+ * the fd is already readable.
+ *
+ * @locality any
+ */
+static RD_INLINE RD_UNUSED void rd_wakeup_signal (rd_wakeup_t *rdw) {
+#if RD_WAKEUP_EVENTFD
+        uint64_t one = 1;
+#else
+        char one = 1;
+#endif
+
+        if (unlikely(rdw->rdw_fds[1] == -1))
+                return;
+
+        /* Coalesce with the pending wake-up, if any. */
+        if (rd_atomic32_get(&rdw->rdw_pending) ||
+            !rd_atomic32_cas(&rdw->rdw_pending, 0, 1))
+                return;
+
+        if (rd_write(rdw->rdw_fds[1], (void *)&one, sizeof(one)) == -1) {
+                /* Ignore */
+        }
+}
+
+
+/**
+ * @brief Consume the pending wake-up, if any, re-arming rd_wakeup_signal().
+ *
+ * @locality the waiting thread
+ */
+static RD_INLINE RD_UNUSED void rd_wakeup_clear (rd_wakeup_t *rdw) {
+#if RD_WAKEUP_EVENTFD
+        uint64_t buf;
+#else
+        char buf[64];
+#endif
+
+        if (unlikely(rdw->rdw_fds[0] == -1))
+                return;
+
+        /* Drain the fd prior to re-arming: a signal in between is
+         * coalesced but is for state the caller has yet to inspect. */
+#if RD_WAKEUP_EVENTFD
+        if (rd_read(rdw->rdw_fds[0], &buf, sizeof(buf)) == -1) {
+                /* Ignore: EAGAIN, nothing to read */
+        }
+#else
+        while (rd_read(rdw->rdw_fds[0], buf, sizeof(buf)) > 0)
+                ;
+#endif
+
+        rd_atomic32_set(&rdw->rdw_pending, 0);
+}
+
+/**@}*/
+
+#endif /* _RDWAKEUP_H_ */
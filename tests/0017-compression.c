@@ -39,11 +39,11 @@
 
 
 int main_0017_compression(int argc, char **argv) {
-        rd_kafka_t *rk_p, *rk_c;
+        rd_kafka_t *rk_p, *rk_p_thr, *rk_c;
         const int msg_cnt = 1000;
         int msg_base = 0;
         uint64_t testid;
-#define CODEC_CNT 4
+#define CODEC_CNT 5
         const char *codecs[CODEC_CNT+1] = {
                 "none",
 #if WITH_ZLIB
@@ -53,53 +53,71 @@ int main_0017_compression(int argc, char **argv) {
                 "snappy",
 #endif
                 "lz4",
+#if WITH_ZSTD
+                "zstd",
+#endif
                 NULL
         };
         const char *topics[CODEC_CNT];
         const int32_t partition = 0;
         int i;
-        int crc;
+        int pass;
 
         testid = test_id_generate();
 
-        /* Produce messages */
+        /* Produce messages: every other codec is compressed
+         * by the compression thread pool rather than the broker thread. */
         rk_p = test_create_producer();
+        {
+                rd_kafka_conf_t *conf;
+                test_conf_init(&conf, NULL, 0);
+                test_conf_set(conf, "compression.threads", "2");
+                rd_kafka_conf_set_dr_cb(conf, test_dr_cb);
+                rk_p_thr = test_create_handle(RD_KAFKA_PRODUCER, conf);
+        }
         for (i = 0; codecs[i] != NULL ; i++) {
+                rd_kafka_t *rk = (i & 1) ? rk_p_thr : rk_p;
                 rd_kafka_topic_t *rkt_p;
 
                 topics[i] = test_mk_topic_name(codecs[i], 1);
                 TEST_SAY("Produce %d messages with %s compression to "
-                         "topic %s\n",
-                        msg_cnt, codecs[i], topics[i]);
-                rkt_p = test_create_producer_topic(rk_p, topics[i],
+                         "topic %s%s\n",
+                        msg_cnt, codecs[i], topics[i],
+                        rk == rk_p_thr ? " using compression threads" : "");
+                rkt_p = test_create_producer_topic(rk, topics[i],
                         "compression.codec", codecs[i], NULL);
 
                 /* Produce small message that will not decrease with
                  * compression (issue #781) */
-                test_produce_msgs(rk_p, rkt_p, testid, partition,
+                test_produce_msgs(rk, rkt_p, testid, partition,
                                   msg_base + (partition*msg_cnt), 1,
                                   NULL, 5);
 
                 /* Produce standard sized messages */
-                test_produce_msgs(rk_p, rkt_p, testid, partition,
+                test_produce_msgs(rk, rkt_p, testid, partition,
                                   msg_base + (partition*msg_cnt) + 1, msg_cnt-1,
                                   NULL, 512);
                 rd_kafka_topic_destroy(rkt_p);
         }
 
         rd_kafka_destroy(rk_p);
+        rd_kafka_destroy(rk_p_thr);
 
 
         /* restart timeout (mainly for helgrind use since it is very slow) */
         test_timeout_set(30);
 
-        /* Consume messages: Without and with CRC checking */
-        for (crc = 0 ; crc < 2 ; crc++) {
-                const char *crc_tof = crc ? "true":"false";
+        /* Consume messages: Without and with CRC checking,
+         * and with decompression offloaded to worker threads. */
+        for (pass = 0 ; pass < 3 ; pass++) {
+                const char *crc_tof = pass > 0 ? "true":"false";
+                const char *decomp_threads = pass == 2 ? "2" : "0";
                 rd_kafka_conf_t *conf;
 
                 test_conf_init(&conf, NULL, 0);
                 test_conf_set(conf, "check.crcs", crc_tof);
+                test_conf_set(conf, "fetch.decompress.threads",
+                              decomp_threads);
 
                 rk_c = test_create_consumer(NULL, NULL, conf, NULL);
 
@@ -108,8 +126,9 @@ int main_0017_compression(int argc, char **argv) {
                                                                      topics[i],
                                                                      NULL);
 
-                        TEST_SAY("Consume %d messages from topic %s (crc=%s)\n",
-                                 msg_cnt, topics[i], crc_tof);
+                        TEST_SAY("Consume %d messages from topic %s "
+                                 "(crc=%s, decompress.threads=%s)\n",
+                                 msg_cnt, topics[i], crc_tof, decomp_threads);
                         /* Start consuming */
                         test_consumer_start(codecs[i], rkt_c, partition,
                                             RD_KAFKA_OFFSET_BEGINNING);
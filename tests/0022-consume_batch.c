@@ -39,11 +39,12 @@
  */
 
 
-static int do_test_consume_batch (void) {
+static int do_test_consume_batch (int fetch_batch_ops) {
 #define topic_cnt 2
 	char *topics[topic_cnt];
         const int partition_cnt = 2;
 	rd_kafka_t *rk;
+        rd_kafka_conf_t *conf;
         rd_kafka_queue_t *rkq;
         rd_kafka_topic_t *rkts[topic_cnt];
 	rd_kafka_resp_err_t err;
@@ -53,6 +54,9 @@ static int do_test_consume_batch (void) {
         int batch_cnt = 0;
         int remains;
 
+        TEST_SAY("Testing with enable.fetch.batch.ops=%s\n",
+                 fetch_batch_ops ? "true" : "false");
+
         testid = test_id_generate();
 
         /* Produce messages */
@@ -66,7 +70,10 @@ static int do_test_consume_batch (void) {
 
 
         /* Create simple consumer */
-        rk = test_create_consumer(NULL, NULL, NULL, NULL);
+        test_conf_init(&conf, NULL, 0);
+        test_conf_set(conf, "enable.fetch.batch.ops",
+                      fetch_batch_ops ? "true" : "false");
+        rk = test_create_consumer(NULL, NULL, conf, NULL);
 
         /* Create generic consume queue */
         rkq = rd_kafka_queue_new(rk);
@@ -148,7 +155,8 @@ static int do_test_consume_batch (void) {
 int main_0022_consume_batch (int argc, char **argv) {
         int fails = 0;
 
-        fails += do_test_consume_batch();
+        fails += do_test_consume_batch(0);
+        fails += do_test_consume_batch(1);
 
         if (fails > 0)
                 TEST_FAIL("See %d previous error(s)\n", fails);
@@ -399,6 +399,7 @@ static int do_test (const char *assignor) {
 int main_0033_regex_subscribe (int argc, char **argv) {
 	do_test("range");
 	do_test("roundrobin");
+	do_test("sticky");
 	return 0;
 }
 
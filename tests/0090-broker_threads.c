@@ -0,0 +1,116 @@
+/*
+ * librdkafka - Apache Kafka C library
+ *
+ * Copyright (c) 2012-2015, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "test.h"
+#include "rdkafka.h"
+
+/**
+ * @name Shared broker threads (broker.threads)
+ *
+ * Produce and consume with the brokers served by a small number of
+ * shared reactor threads rather than one thread per broker and verify
+ * that all messages are delivered, and consumed in order.
+ */
+
+static int msg_dr_cnt = 0;
+static int msg_dr_fail_cnt = 0;
+
+static void dr_msg_cb (rd_kafka_t *rk, const rd_kafka_message_t *rkmessage,
+                       void *opaque) {
+        msg_dr_cnt++;
+        if (rkmessage->err) {
+                TEST_FAIL_LATER("Expected message to succeed, got %s",
+                                rd_kafka_err2str(rkmessage->err));
+                msg_dr_fail_cnt++;
+        }
+}
+
+
+int main_0090_broker_threads (int argc, char **argv) {
+        const char *topic = test_mk_topic_name("0090_broker_threads", 1);
+        const int partition_cnt = 3;
+        const int msgcnt_per_part = 2000;
+        int msgcounter = 0;
+        uint64_t testid;
+        rd_kafka_t *rk;
+        rd_kafka_topic_t *rkt;
+        rd_kafka_conf_t *conf;
+        int32_t partition;
+
+        testid = test_id_generate();
+
+        test_create_topic(topic, partition_cnt, 1);
+
+        /* Produce with all brokers on a single reactor thread. */
+        test_conf_init(&conf, NULL, 60);
+        rd_kafka_conf_set_dr_msg_cb(conf, dr_msg_cb);
+        test_conf_set(conf, "broker.threads", "1");
+        test_conf_set(conf, "linger.ms", "5");
+
+        rk = test_create_handle(RD_KAFKA_PRODUCER, conf);
+        rkt = test_create_producer_topic(rk, topic, NULL);
+
+        for (partition = 0 ; partition < partition_cnt ; partition++)
+                test_produce_msgs_nowait(rk, rkt, testid, partition,
+                                         partition * msgcnt_per_part,
+                                         msgcnt_per_part,
+                                         NULL, 0, &msgcounter);
+
+        test_flush(rk, tmout_multip(30*1000));
+
+        TEST_ASSERT(msg_dr_cnt == msgcounter,
+                    "expected %d delivery reports, got %d",
+                    msgcounter, msg_dr_cnt);
+        TEST_ASSERT(msg_dr_fail_cnt == 0,
+                    "expected %d dr failures, got %d", 0, msg_dr_fail_cnt);
+
+        rd_kafka_topic_destroy(rkt);
+        rd_kafka_destroy(rk);
+
+        /* Consume with more reactor threads than there are brokers. */
+        test_conf_init(&conf, NULL, 60);
+        test_conf_set(conf, "broker.threads", "2");
+
+        rk = test_create_handle(RD_KAFKA_CONSUMER, conf);
+        rkt = test_create_consumer_topic(rk, topic);
+
+        for (partition = 0 ; partition < partition_cnt ; partition++) {
+                test_consumer_start("consume", rkt, partition,
+                                    RD_KAFKA_OFFSET_BEGINNING);
+                test_consume_msgs("consume", rkt, testid, partition,
+                                  TEST_NO_SEEK,
+                                  partition * msgcnt_per_part,
+                                  msgcnt_per_part, 1);
+                test_consumer_stop("consume", rkt, partition);
+        }
+
+        rd_kafka_topic_destroy(rkt);
+        rd_kafka_destroy(rk);
+
+        return 0;
+}
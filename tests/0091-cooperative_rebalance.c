@@ -0,0 +1,281 @@
+/*
+ * librdkafka - Apache Kafka C library
+ *
+ * Copyright (c) 2012-2015, Magnus Edenhill
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "test.h"
+
+#include "rdkafka.h"
+
+/**
+ * Incremental cooperative rebalancing (cooperative-sticky assignor):
+ * a second member joining the group must only revoke the partitions
+ * that change owner from the first member, and the partitions of a
+ * member leaving the group must be incrementally assigned to the
+ * remaining member without revoking anything.
+ */
+
+#define PARTITION_CNT 6
+
+struct coop_consumer {
+        const char *name;
+        rd_kafka_t *rk;
+        int assign_cnt;    /**< ASSIGN_PARTITIONS events */
+        int revoke_cnt;    /**< REVOKE_PARTITIONS events */
+        int revoked;       /**< Total number of revoked partitions */
+        int assigned;      /**< Currently assigned partitions */
+        int min_assigned;  /**< Smallest assignment after the first
+                            *   non-empty one, or -1. */
+        int closing;       /**< consumer_close() in progress */
+};
+
+
+static void rebalance_cb (rd_kafka_t *rk, rd_kafka_resp_err_t err,
+                          rd_kafka_topic_partition_list_t *parts,
+                          void *opaque) {
+        struct coop_consumer *c = opaque;
+        rd_kafka_topic_partition_list_t *assignment;
+        rd_kafka_resp_err_t err2;
+        const char *protocol = rd_kafka_rebalance_protocol(rk);
+
+        TEST_SAY("%s: rebalance: %s: %d partition(s)\n",
+                 c->name, rd_kafka_err2name(err), parts->cnt);
+        test_print_partition_list(parts);
+
+        TEST_ASSERT(!strcmp(protocol, "COOPERATIVE"),
+                    "%s: expected COOPERATIVE rebalance protocol, not %s",
+                    c->name, protocol);
+
+        switch (err)
+        {
+        case RD_KAFKA_RESP_ERR__ASSIGN_PARTITIONS:
+                err2 = rd_kafka_incremental_assign(rk, parts);
+                TEST_ASSERT(!err2, "%s: incremental_assign() failed: %s",
+                            c->name, rd_kafka_err2str(err2));
+                c->assign_cnt++;
+                c->assigned += parts->cnt;
+                break;
+
+        case RD_KAFKA_RESP_ERR__REVOKE_PARTITIONS:
+                err2 = rd_kafka_incremental_unassign(rk, parts);
+                TEST_ASSERT(!err2, "%s: incremental_unassign() failed: %s",
+                            c->name, rd_kafka_err2str(err2));
+                c->revoke_cnt++;
+                c->revoked += parts->cnt;
+                c->assigned -= parts->cnt;
+                break;
+
+        default:
+                TEST_FAIL("%s: unexpected rebalance event: %s",
+                          c->name, rd_kafka_err2str(err));
+                break;
+        }
+
+        if (c->assigned > 0 &&
+            (c->min_assigned == -1 || c->assigned < c->min_assigned))
+                c->min_assigned = c->assigned;
+
+        /* Verify that the incremental (un)assign is reflected in the
+         * current assignment, which is not available while closing. */
+        if (c->closing)
+                return;
+
+        err2 = rd_kafka_assignment(rk, &assignment);
+        TEST_ASSERT(!err2, "%s: assignment() failed: %s",
+                    c->name, rd_kafka_err2str(err2));
+        TEST_ASSERT(assignment->cnt == c->assigned,
+                    "%s: expected %d assigned partition(s), not %d",
+                    c->name, c->assigned, assignment->cnt);
+        rd_kafka_topic_partition_list_destroy(assignment);
+}
+
+
+static void coop_consumer_init (struct coop_consumer *c, const char *name,
+                                const char *topic) {
+        rd_kafka_conf_t *conf;
+
+        memset(c, 0, sizeof(*c));
+        c->name = name;
+        c->min_assigned = -1;
+
+        test_conf_init(&conf, NULL, 0);
+        test_conf_set(conf, "partition.assignment.strategy",
+                      "cooperative-sticky");
+        rd_kafka_conf_set_opaque(conf, c);
+        c->rk = test_create_consumer(topic, rebalance_cb, conf, NULL);
+}
+
+
+/**
+ * @brief Poll consumers \p c until \p cond is true for all of them,
+ *        failing the test after \p timeout_ms.
+ */
+static void coop_wait (const char *what, struct coop_consumer **c, int cnt,
+                       int (*cond) (const struct coop_consumer *c, void *arg),
+                       void *arg, int timeout_ms) {
+        int64_t abs_timeout = test_clock() + (int64_t)timeout_ms * 1000;
+
+        TEST_SAY("Waiting for %s\n", what);
+
+        while (1) {
+                int i, done = 0;
+
+                for (i = 0 ; i < cnt ; i++) {
+                        rd_kafka_message_t *rkmessage;
+
+                        rkmessage = rd_kafka_consumer_poll(c[i]->rk, 100);
+                        if (rkmessage)
+                                rd_kafka_message_destroy(rkmessage);
+
+                        done += cond(c[i], arg);
+                }
+
+                if (done == cnt)
+                        break;
+
+                TEST_ASSERT(test_clock() < abs_timeout,
+                            "Timed out waiting for %s", what);
+        }
+}
+
+static int cond_assigned (const struct coop_consumer *c, void *arg) {
+        return c->assigned == *(const int *)arg;
+}
+
+
+/**
+ * @brief Verify that the members' current assignments are disjoint and
+ *        together cover all partitions of \p topic.
+ */
+static void coop_verify_assignments (struct coop_consumer **c, int cnt,
+                                     const char *topic) {
+        int owners[PARTITION_CNT] = { 0 };
+        int i, j;
+
+        for (i = 0 ; i < cnt ; i++) {
+                rd_kafka_topic_partition_list_t *assignment;
+                rd_kafka_resp_err_t err;
+
+                err = rd_kafka_assignment(c[i]->rk, &assignment);
+                TEST_ASSERT(!err, "%s: assignment() failed: %s",
+                            c[i]->name, rd_kafka_err2str(err));
+
+                for (j = 0 ; j < assignment->cnt ; j++) {
+                        const rd_kafka_topic_partition_t *rktpar =
+                                &assignment->elems[j];
+
+                        TEST_ASSERT(!strcmp(rktpar->topic, topic) &&
+                                    rktpar->partition >= 0 &&
+                                    rktpar->partition < PARTITION_CNT,
+                                    "%s: unexpected partition %s [%"PRId32"]",
+                                    c[i]->name, rktpar->topic,
+                                    rktpar->partition);
+                        owners[rktpar->partition]++;
+                }
+
+                rd_kafka_topic_partition_list_destroy(assignment);
+        }
+
+        for (j = 0 ; j < PARTITION_CNT ; j++)
+                TEST_ASSERT(owners[j] == 1,
+                            "partition %d is assigned to %d member(s)",
+                            j, owners[j]);
+}
+
+
+int main_0091_cooperative_rebalance (int argc, char **argv) {
+        const char *topic = test_mk_topic_name(__FUNCTION__ + 5, 1);
+        struct coop_consumer c1, c2;
+        struct coop_consumer *cs[2] = { &c1, &c2 };
+        int tmout = test_session_timeout_ms + 30*1000;
+        int exp;
+
+        test_conf_init(NULL, NULL, 120);
+
+        test_create_topic(topic, PARTITION_CNT, 1);
+
+        /* First member gets all partitions */
+        coop_consumer_init(&c1, "c1", topic);
+        test_consumer_subscribe(c1.rk, topic);
+
+        exp = PARTITION_CNT;
+        coop_wait("c1 to be assigned all partitions", cs, 1,
+                  cond_assigned, &exp, tmout);
+        TEST_ASSERT(c1.revoke_cnt == 0,
+                    "c1: expected no revocation, not %d", c1.revoke_cnt);
+
+        /* Second member joins: only the partitions that move to c2
+         * are revoked from c1, c1 keeps consuming the others. */
+        coop_consumer_init(&c2, "c2", topic);
+        test_consumer_subscribe(c2.rk, topic);
+
+        exp = PARTITION_CNT / 2;
+        coop_wait("partitions to be balanced over c1 and c2", cs, 2,
+                  cond_assigned, &exp, tmout);
+        coop_verify_assignments(cs, 2, topic);
+
+        TEST_ASSERT(c1.revoke_cnt == 1 && c1.revoked == PARTITION_CNT / 2,
+                    "c1: expected %d partitions revoked in one event, "
+                    "not %d in %d event(s)",
+                    PARTITION_CNT / 2, c1.revoked, c1.revoke_cnt);
+        TEST_ASSERT(c1.min_assigned == PARTITION_CNT / 2,
+                    "c1: expected the assignment to never drop below %d "
+                    "partitions, dropped to %d",
+                    PARTITION_CNT / 2, c1.min_assigned);
+        TEST_ASSERT(c2.revoke_cnt == 0,
+                    "c2: expected no revocation, not %d", c2.revoke_cnt);
+
+        /* Second member leaves: its partitions are added to c1's
+         * assignment without revoking anything from c1. */
+        TEST_SAY("Closing c2\n");
+        c2.closing = 1;
+        test_consumer_close(c2.rk);
+        TEST_ASSERT(c2.assigned == 0 && c2.revoked == PARTITION_CNT / 2,
+                    "c2: expected %d partitions revoked on close, "
+                    "not %d (%d still assigned)",
+                    PARTITION_CNT / 2, c2.revoked, c2.assigned);
+        rd_kafka_destroy(c2.rk);
+
+        exp = PARTITION_CNT;
+        coop_wait("c1 to be assigned all partitions after c2 left", cs, 1,
+                  cond_assigned, &exp, tmout);
+        coop_verify_assignments(cs, 1, topic);
+
+        TEST_ASSERT(c1.revoke_cnt == 1,
+                    "c1: expected no further revocation, not %d event(s)",
+                    c1.revoke_cnt);
+
+        TEST_SAY("Closing c1\n");
+        c1.closing = 1;
+        test_consumer_close(c1.rk);
+        TEST_ASSERT(c1.assigned == 0,
+                    "c1: expected all partitions revoked on close, "
+                    "%d still assigned", c1.assigned);
+        rd_kafka_destroy(c1.rk);
+
+        return 0;
+}
@@ -176,6 +176,9 @@ _TEST_DECL(0083_cb_event);
 _TEST_DECL(0084_destroy_flags_local);
 _TEST_DECL(0084_destroy_flags);
 _TEST_DECL(0088_produce_metadata_timeout);
+_TEST_DECL(0089_idempotence);
+_TEST_DECL(0090_broker_threads);
+_TEST_DECL(0091_cooperative_rebalance);
 
 /* Manual tests */
 _TEST_DECL(8000_idle);
@@ -284,6 +287,9 @@ struct test tests[] = {
         _TEST(0083_cb_event, 0, TEST_BRKVER(0,9,0,0)),
         _TEST(0084_destroy_flags_local, TEST_F_LOCAL),
         _TEST(0084_destroy_flags, 0),
+        _TEST(0089_idempotence, 0, TEST_BRKVER(0,11,0,0)),
+        _TEST(0090_broker_threads, 0),
+        _TEST(0091_cooperative_rebalance, 0, TEST_BRKVER(0,9,0,0)),
 #if WITH_SOCKEM
         _TEST(0088_produce_metadata_timeout, TEST_F_SOCKEM),
 #endif